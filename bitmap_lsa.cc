@@ -0,0 +1,800 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "bitmap_lsa.hh"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <endian.h>
+
+namespace redis {
+
+constexpr size_t bitmap_lsa::chunk_bits;
+constexpr size_t bitmap_lsa::chunk_bytes;
+constexpr uint32_t bitmap_lsa::max_array_cardinality;
+constexpr uint64_t bitmap_lsa::max_offset;
+thread_local size_t bitmap_lsa::_directory_bytes = 0;
+
+using container_type = bitmap_lsa::container_type;
+static constexpr uint32_t chunk_bits = bitmap_lsa::chunk_bits;
+static constexpr size_t chunk_bytes = bitmap_lsa::chunk_bytes;
+
+// A container as it is read. The payloads may not be aligned, they are only
+// accessed by memcpy.
+struct bitmap_chunk {
+    container_type type;
+    uint32_t cardinality;
+    const uint8_t* data;
+    size_t size;
+
+    inline size_t runs() const { return size / 4; }
+    inline uint16_t value(size_t i) const {
+        uint16_t v;
+        std::memcpy(&v, data + i * 2, sizeof(v));
+        return v;
+    }
+    inline uint16_t first(size_t i) const { return value(i * 2); }
+    inline uint16_t last(size_t i) const { return value(i * 2 + 1); }
+};
+
+// The containers are decoded into and rebuilt from these buffers, off the LSA, so
+// no pointer into a payload is held while the LSA allocates.
+struct bitmap_scratch {
+    std::vector<uint16_t> values;
+    std::vector<uint16_t> runs;
+    uint8_t bits[chunk_bytes];
+    uint8_t other[chunk_bytes];
+    uint8_t encoded[chunk_bytes];
+};
+
+static bitmap_scratch& scratch()
+{
+    static thread_local bitmap_scratch s;
+    return s;
+}
+
+static inline uint64_t load_be64(const uint8_t* p)
+{
+    uint64_t w;
+    std::memcpy(&w, p, sizeof(w));
+    return be64toh(w);
+}
+
+static inline bool test_bit(const uint8_t* bits, uint32_t i)
+{
+    return bits[i >> 3] & (0x80 >> (i & 7));
+}
+
+static inline void set_bit(uint8_t* bits, uint32_t i)
+{
+    bits[i >> 3] |= 0x80 >> (i & 7);
+}
+
+// Sets the bits [lo, hi).
+static void set_bits(uint8_t* bits, uint32_t lo, uint32_t hi)
+{
+    for (; lo < hi && (lo & 7); ++lo) {
+        set_bit(bits, lo);
+    }
+    if (hi - lo >= 8) {
+        std::memset(bits + (lo >> 3), 0xff, (hi - lo) >> 3);
+        lo += (hi - lo) & ~uint32_t(7);
+    }
+    for (; lo < hi; ++lo) {
+        set_bit(bits, lo);
+    }
+}
+
+// The bits set in [lo, hi) of a bitset.
+static uint64_t count_bits(const uint8_t* bits, uint32_t lo, uint32_t hi)
+{
+    if (lo >= hi) {
+        return 0;
+    }
+    auto first = lo >> 3, last = (hi - 1) >> 3;
+    uint8_t head = 0xff >> (lo & 7);
+    uint8_t tail = uint8_t(0xff << (7 - ((hi - 1) & 7)));
+    if (first == last) {
+        return __builtin_popcount(bits[first] & head & tail);
+    }
+    uint64_t n = __builtin_popcount(bits[first] & head) + __builtin_popcount(bits[last] & tail);
+    return n + bits_operation::popcount(reinterpret_cast<const char*>(bits) + first + 1, last - first - 1);
+}
+
+// The first bit equal to bit at or after lo in a bitset, or -1.
+static long next_bit(const uint8_t* bits, uint32_t lo, bool bit)
+{
+    auto byte = lo >> 3;
+    uint8_t b = (bit ? bits[byte] : uint8_t(~bits[byte])) & (0xff >> (lo & 7));
+    if (b) {
+        return long(byte * 8 + __builtin_clz(b) - 24);
+    }
+    auto p = bits_operation::find_bit(reinterpret_cast<const char*>(bits) + byte + 1, chunk_bytes - byte - 1, bit);
+    return p < 0 ? -1 : long((byte + 1) * 8) + p;
+}
+
+// The number of ranges of set bits of a bitset: the set bits whose previous bit is clear.
+static size_t count_runs(const uint8_t* bits)
+{
+    size_t runs = 0;
+    uint64_t carry = 0;
+    for (size_t i = 0; i < chunk_bytes; i += 8) {
+        auto w = load_be64(bits + i);
+        runs += __builtin_popcountll(w & ~((w >> 1) | (carry << 63)));
+        carry = w & 1;
+    }
+    return runs;
+}
+
+// the index of the first value of an array not below v.
+static size_t array_lower_bound(const bitmap_chunk& c, uint32_t v)
+{
+    size_t lo = 0, hi = c.cardinality;
+    while (lo < hi) {
+        auto mid = (lo + hi) / 2;
+        if (c.value(mid) < v) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// the index of the first run which does not end before v.
+static size_t run_lower_bound(const bitmap_chunk& c, uint32_t v)
+{
+    size_t lo = 0, hi = c.runs();
+    while (lo < hi) {
+        auto mid = (lo + hi) / 2;
+        if (c.last(mid) < v) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static bool chunk_contains(const bitmap_chunk& c, uint32_t v)
+{
+    switch (c.type) {
+    case container_type::ARRAY: {
+        auto i = array_lower_bound(c, v);
+        return i < c.cardinality && c.value(i) == v;
+    }
+    case container_type::BITSET:
+        return test_bit(c.data, v);
+    case container_type::RUN: {
+        auto i = run_lower_bound(c, v);
+        return i < c.runs() && c.first(i) <= v;
+    }
+    }
+    return false;
+}
+
+// The bits set in [lo, hi).
+static uint64_t chunk_count(const bitmap_chunk& c, uint32_t lo, uint32_t hi)
+{
+    if (lo == 0 && hi == chunk_bits) {
+        return c.cardinality;
+    }
+    switch (c.type) {
+    case container_type::ARRAY:
+        return array_lower_bound(c, hi) - array_lower_bound(c, lo);
+    case container_type::BITSET:
+        return count_bits(c.data, lo, hi);
+    case container_type::RUN: {
+        uint64_t n = 0;
+        for (auto i = run_lower_bound(c, lo); i < c.runs() && c.first(i) < hi; ++i) {
+            n += std::min<uint32_t>(c.last(i) + 1, hi) - std::max<uint32_t>(c.first(i), lo);
+        }
+        return n;
+    }
+    }
+    return 0;
+}
+
+// The first set bit at or after lo, or -1.
+static long chunk_next_set(const bitmap_chunk& c, uint32_t lo)
+{
+    switch (c.type) {
+    case container_type::ARRAY: {
+        auto i = array_lower_bound(c, lo);
+        return i < c.cardinality ? long(c.value(i)) : -1;
+    }
+    case container_type::BITSET:
+        return next_bit(c.data, lo, true);
+    case container_type::RUN: {
+        auto i = run_lower_bound(c, lo);
+        return i < c.runs() ? long(std::max<uint32_t>(c.first(i), lo)) : -1;
+    }
+    }
+    return -1;
+}
+
+// The first clear bit at or after lo, or chunk_bits.
+static uint32_t chunk_next_clear(const bitmap_chunk& c, uint32_t lo)
+{
+    switch (c.type) {
+    case container_type::ARRAY: {
+        auto v = lo;
+        for (auto i = array_lower_bound(c, lo); i < c.cardinality && c.value(i) == v; ++i) {
+            ++v;
+        }
+        return v;
+    }
+    case container_type::BITSET: {
+        auto p = next_bit(c.data, lo, false);
+        return p < 0 ? chunk_bits : uint32_t(p);
+    }
+    case container_type::RUN: {
+        // the runs never touch, the bit after a run is clear.
+        auto i = run_lower_bound(c, lo);
+        return i < c.runs() && c.first(i) <= lo ? uint32_t(c.last(i)) + 1 : lo;
+    }
+    }
+    return lo;
+}
+
+// Decodes a container into a bitset.
+static const uint8_t* chunk_bits_of(const bitmap_chunk& c, uint8_t* out)
+{
+    if (c.type == container_type::BITSET) {
+        std::memcpy(out, c.data, chunk_bytes);
+        return out;
+    }
+    std::memset(out, 0, chunk_bytes);
+    if (c.type == container_type::ARRAY) {
+        for (size_t i = 0; i < c.cardinality; ++i) {
+            set_bit(out, c.value(i));
+        }
+    }
+    else {
+        for (size_t i = 0; i < c.runs(); ++i) {
+            set_bits(out, c.first(i), uint32_t(c.last(i)) + 1);
+        }
+    }
+    return out;
+}
+
+static container_type smallest_type(uint32_t cardinality, size_t runs)
+{
+    auto type = container_type::BITSET;
+    size_t bytes = chunk_bytes;
+    if (cardinality <= bitmap_lsa::max_array_cardinality && cardinality * sizeof(uint16_t) < bytes) {
+        type = container_type::ARRAY;
+        bytes = cardinality * sizeof(uint16_t);
+    }
+    if (runs * 2 * sizeof(uint16_t) < bytes) {
+        type = container_type::RUN;
+    }
+    return type;
+}
+
+static managed_bytes make_payload(const void* data, size_t size)
+{
+    return managed_bytes(bytes_view(reinterpret_cast<const int8_t*>(data), size));
+}
+
+bitmap_chunk bitmap_lsa::view(const container& c)
+{
+    return bitmap_chunk { c._type, c._cardinality, reinterpret_cast<const uint8_t*>(c._data.data()), c._data.size() };
+}
+
+bitmap_lsa::container_vector::iterator bitmap_lsa::lower_bound(uint64_t key)
+{
+    return std::lower_bound(_containers.begin(), _containers.end(), key, [] (const container& c, uint64_t k) {
+        return c._key < k;
+    });
+}
+
+bitmap_lsa::container_vector::const_iterator bitmap_lsa::lower_bound(uint64_t key) const
+{
+    return std::lower_bound(_containers.begin(), _containers.end(), key, [] (const container& c, uint64_t k) {
+        return c._key < k;
+    });
+}
+
+void bitmap_lsa::store_array(container& c, const uint16_t* values, uint32_t count)
+{
+    size_t runs = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (i == 0 || values[i] != values[i - 1] + 1) {
+            ++runs;
+        }
+    }
+    auto type = smallest_type(count, runs);
+    auto& s = scratch();
+    if (type == container_type::ARRAY) {
+        c._data = make_payload(values, count * sizeof(uint16_t));
+    }
+    else if (type == container_type::RUN) {
+        s.runs.clear();
+        for (uint32_t i = 0; i < count; ++i) {
+            if (i == 0 || values[i] != values[i - 1] + 1) {
+                s.runs.push_back(values[i]);
+                s.runs.push_back(values[i]);
+            }
+            else {
+                s.runs.back() = values[i];
+            }
+        }
+        c._data = make_payload(s.runs.data(), s.runs.size() * sizeof(uint16_t));
+    }
+    else {
+        std::memset(s.encoded, 0, chunk_bytes);
+        for (uint32_t i = 0; i < count; ++i) {
+            set_bit(s.encoded, values[i]);
+        }
+        c._data = make_payload(s.encoded, chunk_bytes);
+    }
+    c._type = type;
+    c._cardinality = count;
+}
+
+void bitmap_lsa::store_runs(container& c, const run* runs, size_t count)
+{
+    uint32_t cardinality = 0;
+    for (size_t i = 0; i < count; ++i) {
+        cardinality += uint32_t(runs[i].last) - runs[i].first + 1;
+    }
+    auto type = smallest_type(cardinality, count);
+    auto& s = scratch();
+    if (type == container_type::ARRAY) {
+        s.values.clear();
+        for (size_t i = 0; i < count; ++i) {
+            for (uint32_t v = runs[i].first; v <= runs[i].last; ++v) {
+                s.values.push_back(uint16_t(v));
+            }
+        }
+        c._data = make_payload(s.values.data(), s.values.size() * sizeof(uint16_t));
+    }
+    else if (type == container_type::RUN) {
+        c._data = make_payload(runs, count * sizeof(run));
+    }
+    else {
+        std::memset(s.encoded, 0, chunk_bytes);
+        for (size_t i = 0; i < count; ++i) {
+            set_bits(s.encoded, runs[i].first, uint32_t(runs[i].last) + 1);
+        }
+        c._data = make_payload(s.encoded, chunk_bytes);
+    }
+    c._type = type;
+    c._cardinality = cardinality;
+}
+
+void bitmap_lsa::store_bits(container& c, const uint8_t* bits)
+{
+    auto cardinality = uint32_t(bits_operation::popcount(reinterpret_cast<const char*>(bits), chunk_bytes));
+    auto type = smallest_type(cardinality, count_runs(bits));
+    auto& s = scratch();
+    bitmap_chunk b { container_type::BITSET, cardinality, bits, chunk_bytes };
+    if (type == container_type::ARRAY) {
+        s.values.clear();
+        for (long v = chunk_next_set(b, 0); v >= 0; v = v + 1 < long(chunk_bits) ? chunk_next_set(b, v + 1) : -1) {
+            s.values.push_back(uint16_t(v));
+        }
+        c._data = make_payload(s.values.data(), s.values.size() * sizeof(uint16_t));
+    }
+    else if (type == container_type::RUN) {
+        s.runs.clear();
+        for (long v = chunk_next_set(b, 0); v >= 0;) {
+            auto end = chunk_next_clear(b, v);
+            s.runs.push_back(uint16_t(v));
+            s.runs.push_back(uint16_t(end - 1));
+            v = end < chunk_bits ? chunk_next_set(b, end) : -1;
+        }
+        c._data = make_payload(s.runs.data(), s.runs.size() * sizeof(uint16_t));
+    }
+    else {
+        c._data = make_payload(bits, chunk_bytes);
+    }
+    c._type = type;
+    c._cardinality = cardinality;
+}
+
+bitmap_lsa::bitmap_lsa(const char* data, size_t size)
+    : _size(size)
+{
+    auto& s = scratch();
+    for (size_t offset = 0; offset < size; offset += chunk_bytes) {
+        auto n = std::min(chunk_bytes, size - offset);
+        if (bits_operation::find_bit(data + offset, n, true) < 0) {
+            continue;
+        }
+        std::memcpy(s.bits, data + offset, n);
+        std::memset(s.bits + n, 0, chunk_bytes - n);
+        container c;
+        c._key = uint16_t(offset / chunk_bytes);
+        store_bits(c, s.bits);
+        _containers.push_back(std::move(c));
+    }
+}
+
+uint64_t bitmap_lsa::cardinality() const
+{
+    uint64_t n = 0;
+    for (auto& c : _containers) {
+        n += c._cardinality;
+    }
+    return n;
+}
+
+size_t bitmap_lsa::memory_usage() const
+{
+    size_t n = sizeof(*this) + _containers.capacity() * sizeof(container);
+    for (auto& c : _containers) {
+        n += c._data.size();
+    }
+    return n;
+}
+
+bool bitmap_lsa::set(uint64_t offset, bool value)
+{
+    auto key = uint16_t(offset >> 16);
+    auto v = uint16_t(offset & 0xffff);
+    _size = std::max(_size, (offset >> 3) + 1);
+    auto it = lower_bound(key);
+    if (it == _containers.end() || it->_key != key) {
+        if (value) {
+            container c;
+            c._key = key;
+            c._cardinality = 1;
+            c._data = make_payload(&v, sizeof(v));
+            _containers.insert(it, std::move(c));
+        }
+        return false;
+    }
+    auto& c = *it;
+    auto old = chunk_contains(view(c), v);
+    if (old == value) {
+        return old;
+    }
+    auto& s = scratch();
+    switch (c._type) {
+    case container_type::BITSET: {
+        auto bits = reinterpret_cast<uint8_t*>(c._data.data());
+        bits[v >> 3] ^= 0x80 >> (v & 7);
+        c._cardinality += value ? 1 : -1;
+        // in between, a bitset is the smallest unless the bits form few runs.
+        if (c._cardinality <= max_array_cardinality || c._cardinality == chunk_bits) {
+            std::memcpy(s.bits, bits, chunk_bytes);
+            store_bits(c, s.bits);
+        }
+        break;
+    }
+    case container_type::ARRAY: {
+        auto n = c._cardinality;
+        s.values.resize(n + 1);
+        auto b = view(c);
+        std::memcpy(s.values.data(), b.data, n * sizeof(uint16_t));
+        auto pos = std::lower_bound(s.values.begin(), s.values.begin() + n, v);
+        if (value) {
+            std::copy_backward(pos, s.values.begin() + n, s.values.begin() + n + 1);
+            *pos = v;
+            ++n;
+        }
+        else {
+            std::copy(pos + 1, s.values.begin() + n, pos);
+            --n;
+        }
+        store_array(c, s.values.data(), n);
+        break;
+    }
+    case container_type::RUN: {
+        auto count = c._data.size() / sizeof(run);
+        std::vector<run> runs(count + 1);
+        std::memcpy(runs.data(), c._data.data(), count * sizeof(run));
+        runs.resize(count);
+        auto i = std::lower_bound(runs.begin(), runs.end(), v, [] (const run& r, uint16_t x) {
+            return r.last < x;
+        });
+        if (value) {
+            // v is clear, so it is before *i and after the run before it.
+            bool joins_prev = i != runs.begin() && uint32_t((i - 1)->last) + 1 == v;
+            bool joins_next = i != runs.end() && uint32_t(v) + 1 == i->first;
+            if (joins_prev && joins_next) {
+                (i - 1)->last = i->last;
+                runs.erase(i);
+            }
+            else if (joins_prev) {
+                (i - 1)->last = v;
+            }
+            else if (joins_next) {
+                i->first = v;
+            }
+            else {
+                runs.insert(i, run { v, v });
+            }
+        }
+        else if (i->first == i->last) {
+            runs.erase(i);
+        }
+        else if (i->first == v) {
+            ++i->first;
+        }
+        else if (i->last == v) {
+            --i->last;
+        }
+        else {
+            auto tail = run { uint16_t(v + 1), i->last };
+            i->last = v - 1;
+            runs.insert(i + 1, tail);
+        }
+        store_runs(c, runs.data(), runs.size());
+        break;
+    }
+    }
+    if (c._cardinality == 0) {
+        _containers.erase(it);
+    }
+    return old;
+}
+
+bool bitmap_lsa::get(uint64_t offset) const
+{
+    if (offset > max_offset) {
+        return false;
+    }
+    auto it = lower_bound(offset >> 16);
+    if (it == _containers.end() || it->_key != (offset >> 16)) {
+        return false;
+    }
+    return chunk_contains(view(*it), uint32_t(offset & 0xffff));
+}
+
+uint64_t bitmap_lsa::count_range(uint64_t first, uint64_t last) const
+{
+    uint64_t n = 0;
+    for (auto it = lower_bound(first >> 16); it != _containers.end(); ++it) {
+        uint64_t base = uint64_t(it->_key) << 16;
+        if (base >= last) {
+            break;
+        }
+        auto lo = first > base ? first - base : 0;
+        auto hi = std::min<uint64_t>(last - base, chunk_bits);
+        n += chunk_count(view(*it), uint32_t(lo), uint32_t(hi));
+    }
+    return n;
+}
+
+uint64_t bitmap_lsa::count(long start, long end) const
+{
+    if (!bits_operation::byte_range(_size, start, end)) {
+        return 0;
+    }
+    return count_range(uint64_t(start) * 8, uint64_t(end + 1) * 8);
+}
+
+long bitmap_lsa::pos(bool bit, long start, long end, bool end_given) const
+{
+    if (!bits_operation::byte_range(_size, start, end)) {
+        return -1;
+    }
+    uint64_t first = uint64_t(start) * 8, last = uint64_t(end + 1) * 8;
+    auto it = lower_bound(first >> 16);
+    if (bit) {
+        for (; it != _containers.end(); ++it) {
+            uint64_t base = uint64_t(it->_key) << 16;
+            if (base >= last) {
+                break;
+            }
+            auto p = chunk_next_set(view(*it), first > base ? uint32_t(first - base) : 0);
+            if (p >= 0) {
+                return base + p < last ? long(base + p) : -1;
+            }
+        }
+        return -1;
+    }
+    // the first bit which is not in a run of set bits starting at first.
+    uint64_t b = first;
+    for (; it != _containers.end() && b < last; ++it) {
+        uint64_t base = uint64_t(it->_key) << 16;
+        if (base > b) {
+            break;
+        }
+        auto c = chunk_next_clear(view(*it), uint32_t(b - base));
+        b = base + c;
+        if (c < chunk_bits) {
+            break;
+        }
+    }
+    if (b < last) {
+        return long(b);
+    }
+    return end_given ? -1 : long(last);
+}
+
+void bitmap_lsa::combine(bitop_type op, const bitmap_lsa& src)
+{
+    if (op == bitop_type::NOT) {
+        *this = bitmap_lsa(src);
+        invert();
+        return;
+    }
+    auto& s = scratch();
+    container_vector result;
+    result.reserve(op == bitop_type::AND ? std::min(_containers.size(), src._containers.size())
+                                         : _containers.size() + src._containers.size());
+    auto a = _containers.begin();
+    auto b = src._containers.begin();
+    while (a != _containers.end() || b != src._containers.end()) {
+        if (b == src._containers.end() || (a != _containers.end() && a->_key < b->_key)) {
+            if (op != bitop_type::AND) {
+                result.push_back(std::move(*a));
+            }
+            ++a;
+        }
+        else if (a == _containers.end() || b->_key < a->_key) {
+            if (op != bitop_type::AND) {
+                result.push_back(*b);
+            }
+            ++b;
+        }
+        else {
+            chunk_bits_of(view(*a), s.bits);
+            chunk_bits_of(view(*b), s.other);
+            bits_operation::combine(op, reinterpret_cast<char*>(s.bits), reinterpret_cast<const char*>(s.other), chunk_bytes);
+            container c;
+            c._key = a->_key;
+            store_bits(c, s.bits);
+            if (c._cardinality > 0) {
+                result.push_back(std::move(c));
+            }
+            ++a;
+            ++b;
+        }
+    }
+    _containers = std::move(result);
+    _size = std::max(_size, src._size);
+}
+
+void bitmap_lsa::invert()
+{
+    auto& s = scratch();
+    auto chunks = (_size + chunk_bytes - 1) / chunk_bytes;
+    container_vector result;
+    result.reserve(chunks);
+    auto it = _containers.begin();
+    for (uint64_t key = 0; key < chunks; ++key) {
+        // the bits past the end of the string stay clear.
+        auto bytes = std::min<uint64_t>(chunk_bytes, _size - key * chunk_bytes);
+        container c;
+        c._key = uint16_t(key);
+        if (it == _containers.end() || it->_key != key) {
+            run full { 0, uint16_t(bytes * 8 - 1) };
+            store_runs(c, &full, 1);
+        }
+        else {
+            chunk_bits_of(view(*it++), s.bits);
+            bits_operation::combine(bitop_type::NOT, reinterpret_cast<char*>(s.bits), reinterpret_cast<const char*>(s.bits), bytes);
+            std::memset(s.bits + bytes, 0, chunk_bytes - bytes);
+            store_bits(c, s.bits);
+        }
+        if (c._cardinality > 0) {
+            result.push_back(std::move(c));
+        }
+    }
+    _containers = std::move(result);
+}
+
+void bitmap_lsa::read(uint64_t offset, char* out, size_t size) const
+{
+    std::memset(out, 0, size);
+    auto& s = scratch();
+    for (auto it = lower_bound(offset / chunk_bytes); it != _containers.end(); ++it) {
+        uint64_t base = uint64_t(it->_key) * chunk_bytes;
+        if (base >= offset + size) {
+            break;
+        }
+        auto c = view(*it);
+        auto bits = c.type == container_type::BITSET ? c.data : chunk_bits_of(c, s.bits);
+        auto from = std::max(base, offset), to = std::min(base + chunk_bytes, offset + size);
+        std::memcpy(out + (from - offset), bits + (from - base), to - from);
+    }
+}
+
+void bitmap_lsa::for_each_set_bit(const std::function<void(uint64_t)>& func) const
+{
+    for (auto& c : _containers) {
+        uint64_t base = uint64_t(c._key) << 16;
+        auto b = view(c);
+        for (long v = chunk_next_set(b, 0); v >= 0; v = v + 1 < long(chunk_bits) ? chunk_next_set(b, v + 1) : -1) {
+            func(base + v);
+        }
+    }
+}
+
+template <typename T>
+static void put(std::vector<char>& out, T v)
+{
+    auto p = reinterpret_cast<const char*>(&v);
+    out.insert(out.end(), p, p + sizeof(v));
+}
+
+template <typename T>
+static T take(const char*& p, const char* end)
+{
+    if (size_t(end - p) < sizeof(T)) {
+        throw std::runtime_error("truncated bitmap");
+    }
+    T v;
+    std::memcpy(&v, p, sizeof(v));
+    p += sizeof(v);
+    return v;
+}
+
+void bitmap_lsa::serialize(std::vector<char>& out) const
+{
+    put(out, htole64(_size));
+    put(out, htole32(uint32_t(_containers.size())));
+    for (auto& c : _containers) {
+        auto b = view(c);
+        put(out, htole16(c._key));
+        put(out, uint8_t(c._type));
+        put(out, htole32(c._cardinality));
+        put(out, htole32(uint32_t(b.size)));
+        if (c._type == container_type::BITSET) {
+            out.insert(out.end(), b.data, b.data + b.size);
+            continue;
+        }
+        for (size_t i = 0; i < b.size / sizeof(uint16_t); ++i) {
+            put(out, htole16(b.value(i)));
+        }
+    }
+}
+
+void bitmap_lsa::deserialize(const char* data, size_t size)
+{
+    auto end = data + size;
+    _containers.clear();
+    _size = le64toh(take<uint64_t>(data, end));
+    auto count = le32toh(take<uint32_t>(data, end));
+    auto& s = scratch();
+    for (uint32_t n = 0; n < count; ++n) {
+        container c;
+        c._key = le16toh(take<uint16_t>(data, end));
+        c._type = container_type(take<uint8_t>(data, end));
+        c._cardinality = le32toh(take<uint32_t>(data, end));
+        auto bytes = le32toh(take<uint32_t>(data, end));
+        bool valid = (c._type == container_type::ARRAY && bytes == c._cardinality * sizeof(uint16_t))
+            || (c._type == container_type::BITSET && bytes == chunk_bytes)
+            || (c._type == container_type::RUN && bytes % sizeof(run) == 0);
+        if (!valid || size_t(end - data) < bytes || (!_containers.empty() && _containers.back()._key >= c._key)) {
+            throw std::runtime_error("malformed bitmap");
+        }
+        if (c._type == container_type::BITSET) {
+            c._data = make_payload(data, bytes);
+            data += bytes;
+        }
+        else {
+            s.values.resize(bytes / sizeof(uint16_t));
+            for (auto& v : s.values) {
+                v = le16toh(take<uint16_t>(data, end));
+            }
+            c._data = make_payload(s.values.data(), bytes);
+        }
+        _containers.push_back(std::move(c));
+    }
+}
+}
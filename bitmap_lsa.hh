@@ -0,0 +1,144 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "utils/managed_bytes.hh"
+#include "bits_operation.hh"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace redis {
+
+struct bitmap_chunk;
+
+// A compressed bitmap, the value of the keys created by SETBIT.
+//
+// As in Roaring, the bits are split into chunks of 65536 by the high 16 bits of
+// their offset, and every chunk which has a bit set is a container, encoded as
+// the smallest of:
+//   array:  the sorted low 16 bits of its set bits, at most 4096 of them,
+//   bitset: 8192 bytes, in the byte and bit order of a Redis string,
+//   run:    the sorted [first, last] ranges of its set bits, 16 bits each.
+// The value behaves as a string of size() bytes, whose bytes are only built when
+// the value is read as a string. The payloads are allocated by the current
+// allocator, the directory of the containers is not: it lives in the standard
+// allocator, since the containers are referenced while the payloads allocate,
+// and its bytes are counted by directory_memory() instead.
+class bitmap_lsa final {
+public:
+    static constexpr size_t chunk_bits = 1 << 16;
+    static constexpr size_t chunk_bytes = chunk_bits / 8;
+    static constexpr uint32_t max_array_cardinality = 4096;
+    // the bit offsets of a string are 32 bits.
+    static constexpr uint64_t max_offset = (uint64_t(1) << 32) - 1;
+
+    enum class container_type : uint8_t {
+        ARRAY  = 0,
+        BITSET = 1,
+        RUN    = 2,
+    };
+private:
+    struct run {
+        uint16_t first;
+        uint16_t last;
+    };
+    struct container {
+        uint16_t _key = 0;
+        container_type _type = container_type::ARRAY;
+        uint32_t _cardinality = 0;
+        managed_bytes _data;
+    };
+    // the bytes of the directories of the bitmaps of this shard.
+    static thread_local size_t _directory_bytes;
+    template <typename T>
+    struct directory_allocator {
+        using value_type = T;
+        directory_allocator() noexcept {}
+        template <typename U>
+        directory_allocator(const directory_allocator<U>&) noexcept {}
+        T* allocate(size_t n) {
+            auto p = std::allocator<T>().allocate(n);
+            _directory_bytes += n * sizeof(T);
+            return p;
+        }
+        void deallocate(T* p, size_t n) noexcept {
+            _directory_bytes -= n * sizeof(T);
+            std::allocator<T>().deallocate(p, n);
+        }
+        template <typename U>
+        bool operator == (const directory_allocator<U>&) const noexcept { return true; }
+        template <typename U>
+        bool operator != (const directory_allocator<U>&) const noexcept { return false; }
+    };
+    using container_vector = std::vector<container, directory_allocator<container>>;
+    // sorted by key.
+    container_vector _containers;
+    // the size in bytes of the equivalent string.
+    uint64_t _size = 0;
+public:
+    bitmap_lsa() noexcept {}
+    bitmap_lsa(bitmap_lsa&&) noexcept = default;
+    bitmap_lsa(const bitmap_lsa&) = default;
+    bitmap_lsa& operator = (bitmap_lsa&&) noexcept = default;
+    // the bitmap of the bytes of a string.
+    bitmap_lsa(const char* data, size_t size);
+
+    inline uint64_t size() const { return _size; }
+    inline size_t containers() const { return _containers.size(); }
+    uint64_t cardinality() const;
+    size_t memory_usage() const;
+    // The memory of the directories of the bitmaps of this shard, which is not in
+    // the LSA.
+    static inline size_t directory_memory() { return _directory_bytes; }
+
+    // As the ones of bits_operation, on the equivalent string.
+    bool set(uint64_t offset, bool value);
+    bool get(uint64_t offset) const;
+    uint64_t count(long start, long end) const;
+    long pos(bool bit, long start, long end, bool end_given) const;
+    // this = this op src, chunk by chunk. A chunk which is only in one of them is
+    // copied or dropped without being decoded.
+    void combine(bitop_type op, const bitmap_lsa& src);
+    // this = NOT this, over the size of the bitmap.
+    void invert();
+
+    // Writes the bytes [offset, offset + size) of the equivalent string.
+    void read(uint64_t offset, char* out, size_t size) const;
+    void for_each_set_bit(const std::function<void(uint64_t)>& func) const;
+
+    // [le64 size][le32 containers] and for every container
+    // [le16 key][type: 1][le32 cardinality][le32 payload size][payload].
+    void serialize(std::vector<char>& out) const;
+    // throws if the data is truncated or malformed.
+    void deserialize(const char* data, size_t size);
+private:
+    static bitmap_chunk view(const container& c);
+    // the first container whose key is not below key.
+    container_vector::iterator lower_bound(uint64_t key);
+    container_vector::const_iterator lower_bound(uint64_t key) const;
+    // Encode the bits of a container in its smallest encoding.
+    static void store_array(container& c, const uint16_t* values, uint32_t count);
+    static void store_runs(container& c, const run* runs, size_t count);
+    static void store_bits(container& c, const uint8_t* bits);
+    uint64_t count_range(uint64_t first, uint64_t last) const;
+};
+}
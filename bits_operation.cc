@@ -25,21 +25,23 @@
 #include "core/shared_ptr.hh"
 #include "core/sharded.hh"
 #include "common.hh"
+#include <algorithm>
+#include <cstring>
+#include <endian.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 namespace redis {
 // 512M bytes
 static const size_t MAX_BYTE_COUNT = 1024 * 1024 * 512 - 1;
-static const size_t RESIZE_STEP    = 16;
 
 bool bits_operation::set(managed_bytes& o, size_t offset, bool value)
 {
     auto index = offset >> 3;
     if (index >= o.size()) {
-        size_t append_size = RESIZE_STEP;
-        while (append_size < index) append_size+= RESIZE_STEP;
-        if (append_size < 64) {
-            append_size = 64;
-        }
-        o.extend(append_size, 0);
+        // up to the byte of the offset only, the size of the value is the length
+        // of the string.
+        o.extend(index + 1, 0);
     }
     uint8_t byte_val = uint8_t(o[index]);
     auto bit = 7 - (offset & 0x7);
@@ -63,72 +65,283 @@ bool bits_operation::get(const managed_bytes& o, size_t offset)
     return bit_val > 0;
 }
 
-size_t bits_operation::count(const managed_bytes& o, long start, long end)
+static const unsigned char bits_in_byte[256] = {
+    0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,
+    1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,
+    1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,
+    2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,
+    1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,
+    2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,
+    2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,
+    3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8
+};
+
+// Bitmaps are big endian: the bit 0 is the most significant bit of the byte 0,
+// so a word loaded as big endian keeps the bits in order.
+static inline uint64_t load_be64(const uint8_t* p)
+{
+    uint64_t w;
+    std::memcpy(&w, p, sizeof(w));
+    return be64toh(w);
+}
+
+static inline uint64_t load64(const uint8_t* p)
+{
+    uint64_t w;
+    std::memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+static long find_bit_words(const uint8_t* p, size_t size, size_t i, bool bit)
+{
+    for (; i + 8 <= size; i += 8) {
+        auto w = load_be64(p + i);
+        if (!bit) {
+            w = ~w;
+        }
+        if (w) {
+            return long(i * 8 + __builtin_clzll(w));
+        }
+    }
+    for (; i < size; ++i) {
+        uint8_t b = bit ? p[i] : uint8_t(~p[i]);
+        if (b) {
+            return long(i * 8 + __builtin_clz(b) - 24);
+        }
+    }
+    return -1;
+}
+
+static uint64_t popcount_words(const uint8_t* p, size_t size)
+{
+    uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        c0 += __builtin_popcountll(load64(p + i));
+        c1 += __builtin_popcountll(load64(p + i + 8));
+        c2 += __builtin_popcountll(load64(p + i + 16));
+        c3 += __builtin_popcountll(load64(p + i + 24));
+    }
+    for (; i + 8 <= size; i += 8) {
+        c0 += __builtin_popcountll(load64(p + i));
+    }
+    for (; i < size; ++i) {
+        c0 += bits_in_byte[p[i]];
+    }
+    return c0 + c1 + c2 + c3;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("popcnt")))
+static uint64_t popcount_popcnt(const uint8_t* p, size_t size)
+{
+    uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        c0 += __builtin_popcountll(load64(p + i));
+        c1 += __builtin_popcountll(load64(p + i + 8));
+        c2 += __builtin_popcountll(load64(p + i + 16));
+        c3 += __builtin_popcountll(load64(p + i + 24));
+    }
+    for (; i + 8 <= size; i += 8) {
+        c0 += __builtin_popcountll(load64(p + i));
+    }
+    for (; i < size; ++i) {
+        c0 += bits_in_byte[p[i]];
+    }
+    return c0 + c1 + c2 + c3;
+}
+
+// Counts the bits of the two nibbles of every byte with a shuffle lookup, and sums
+// the byte counters into 64 bits lanes before they can overflow (Mula et al.).
+__attribute__((target("avx2")))
+static uint64_t popcount_avx2(const uint8_t* p, size_t size)
+{
+    const __m256i lookup = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+    while (size - i >= 32) {
+        // a byte counter takes at most 8 per block, 31 blocks fit into it.
+        size_t blocks = std::min((size - i) / 32, size_t(31));
+        __m256i local = _mm256_setzero_si256();
+        for (size_t k = 0; k < blocks; ++k, i += 32) {
+            auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+            auto lo = _mm256_and_si256(v, low_mask);
+            auto hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+            local = _mm256_add_epi8(local, _mm256_shuffle_epi8(lookup, lo));
+            local = _mm256_add_epi8(local, _mm256_shuffle_epi8(lookup, hi));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(local, _mm256_setzero_si256()));
+    }
+    uint64_t count = uint64_t(_mm256_extract_epi64(total, 0)) + uint64_t(_mm256_extract_epi64(total, 1))
+        + uint64_t(_mm256_extract_epi64(total, 2)) + uint64_t(_mm256_extract_epi64(total, 3));
+    return count + popcount_popcnt(p + i, size - i);
+}
+
+// Skips the blocks of 32 bytes which are all clear, or all set when looking for a
+// clear bit, then finds the bit in the words of the first other block.
+__attribute__((target("avx2")))
+static long find_bit_avx2(const uint8_t* p, size_t size, bool bit)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        if (bit ? !_mm256_testz_si256(v, v) : !_mm256_testc_si256(v, ones)) {
+            break;
+        }
+    }
+    return find_bit_words(p, size, i, bit);
+}
+#endif
+
+static long find_bit_portable(const uint8_t* p, size_t size, bool bit)
 {
-    if (start < 0) start = static_cast<size_t>(start) + o.size();
-    if (end < 0) end = static_cast<size_t>(end) + o.size();
+    return find_bit_words(p, size, 0, bit);
+}
+
+std::vector<bits_operation::kernel_set> bits_operation::supported_kernels()
+{
+    std::vector<kernel_set> k = { { "portable", popcount_words, find_bit_portable } };
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt")) {
+        k.push_back({ "popcnt", popcount_popcnt, find_bit_portable });
+        if (__builtin_cpu_supports("avx2")) {
+            k.push_back({ "avx2", popcount_avx2, find_bit_avx2 });
+        }
+    }
+#endif
+    return k;
+}
+
+static const bits_operation::kernel_set& kernels()
+{
+    static const bits_operation::kernel_set k = bits_operation::supported_kernels().back();
+    return k;
+}
+
+uint64_t bits_operation::popcount(const char* data, size_t size)
+{
+    return kernels().popcount(reinterpret_cast<const uint8_t*>(data), size);
+}
+
+long bits_operation::find_bit(const char* data, size_t size, bool bit)
+{
+    return kernels().find_bit(reinterpret_cast<const uint8_t*>(data), size, bit);
+}
+
+const char* bits_operation::kernel_name()
+{
+    return kernels().name;
+}
+
+uint64_t bits_operation::popcount_scalar(const char* data, size_t size)
+{
+    auto p = reinterpret_cast<const uint8_t*>(data);
+    uint64_t count = 0;
+    for (size_t i = 0; i < size; ++i) {
+        count += bits_in_byte[p[i]];
+    }
+    return count;
+}
+
+long bits_operation::find_bit_scalar(const char* data, size_t size, bool bit)
+{
+    auto p = reinterpret_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        uint8_t b = bit ? p[i] : uint8_t(~p[i]);
+        if (b) {
+            return long(i * 8 + __builtin_clz(b) - 24);
+        }
+    }
+    return -1;
+}
+
+bool bits_operation::byte_range(size_t size, long& start, long& end)
+{
+    long n = static_cast<long>(size);
+    if (start < 0) start += n;
+    if (end < 0) end += n;
     if (start < 0) start = 0;
     if (end < 0) end = 0;
-    if (end >= static_cast<long>(o.size())) end = static_cast<long>(o.size()) - 1;
-    size_t bits_count = 0, count = static_cast<size_t>(end - start) + 1;
-    size_t p = start /*, p4 = 0 */;
-    static const unsigned char bits_in_byte[256] = {
-        0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,
-        1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,
-        1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,
-        2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,
-        1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,
-        2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,
-        2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,
-        3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8
-    };
+    if (end >= n) end = n - 1;
+    return n > 0 && start <= end;
+}
 
-    while((unsigned long)(uint8_t(o[p])) & 3 && count) {
-        uint8_t v = uint8_t(o[p++]);
-        bits_count += static_cast<size_t>(bits_in_byte[static_cast<unsigned int>(v)]);
-        count--;
+size_t bits_operation::count(const managed_bytes& o, long start, long end)
+{
+    if (!byte_range(o.size(), start, end)) {
+        return 0;
     }
-/*
-    p4 = p;
-    uint32_t d1 = 0, d2 = 0, d3 = 0, d4 = 0, d5 = 0, d6 = 0, d7 = 0;
-    while(count>=28) {
-        d1 = uint8_t(o[p4++]);
-        d2 = uint8_t(o[p4++]);
-        d3 = uint8_t(o[p4++]);
-        d4 = uint8_t(o[p4++]);
-        d5 = uint8_t(o[p4++]);
-        d6 = uint8_t(o[p4++]);
-        d7 = uint8_t(o[p4++]);
-        count -= 28;
-
-        d1 = d1 - ((d1 >> 1) & 0x55555555);
-        d1 = (d1 & 0x33333333) + ((d1 >> 2) & 0x33333333);
-        d2 = d2 - ((d2 >> 1) & 0x55555555);
-        d2 = (d2 & 0x33333333) + ((d2 >> 2) & 0x33333333);
-        d3 = d3 - ((d3 >> 1) & 0x55555555);
-        d3 = (d3 & 0x33333333) + ((d3 >> 2) & 0x33333333);
-        d4 = d4 - ((d4 >> 1) & 0x55555555);
-        d4 = (d4 & 0x33333333) + ((d4 >> 2) & 0x33333333);
-        d5 = d5 - ((d5 >> 1) & 0x55555555);
-        d5 = (d5 & 0x33333333) + ((d5 >> 2) & 0x33333333);
-        d6 = d6 - ((d6 >> 1) & 0x55555555);
-        d6 = (d6 & 0x33333333) + ((d6 >> 2) & 0x33333333);
-        d7 = d7 - ((d7 >> 1) & 0x55555555);
-        d7 = (d7 & 0x33333333) + ((d7 >> 2) & 0x33333333);
-        bits_count += ((((d1 + (d1 >> 4)) & 0x0F0F0F0F) +
-                    ((d2 + (d2 >> 4)) & 0x0F0F0F0F) +
-                    ((d3 + (d3 >> 4)) & 0x0F0F0F0F) +
-                    ((d4 + (d4 >> 4)) & 0x0F0F0F0F) +
-                    ((d5 + (d5 >> 4)) & 0x0F0F0F0F) +
-                    ((d6 + (d6 >> 4)) & 0x0F0F0F0F) +
-                    ((d7 + (d7 >> 4)) & 0x0F0F0F0F))* 0x01010101) >> 24;
-    }
-    p = p4;
-*/
-    while(count--) {
-        uint8_t v = uint8_t(o[p++]);
-        bits_count += static_cast<size_t>(bits_in_byte[static_cast<unsigned int>(v)]);
+    size_t first = start, last = end + 1;
+    size_t count = 0;
+    // a large bitmap is made of several fragments, they are counted in place.
+    o.for_each_fragment([&count, first, last] (size_t offset, const int8_t* data, size_t size) {
+        auto b = std::max(first, offset), e = std::min(last, offset + size);
+        if (b < e) {
+            count += popcount(reinterpret_cast<const char*>(data) + b - offset, e - b);
+        }
+        return e < last;
+    });
+    return count;
+}
+
+long bits_operation::pos(const managed_bytes& o, bool bit, long start, long end, bool end_given)
+{
+    if (!byte_range(o.size(), start, end)) {
+        return -1;
+    }
+    size_t first = start, last = end + 1;
+    long found = -1;
+    o.for_each_fragment([&found, bit, first, last] (size_t offset, const int8_t* data, size_t size) {
+        auto b = std::max(first, offset), e = std::min(last, offset + size);
+        if (b < e) {
+            auto p = find_bit(reinterpret_cast<const char*>(data) + b - offset, e - b, bit);
+            if (p >= 0) {
+                found = long(b * 8) + p;
+                return false;
+            }
+        }
+        return e < last;
+    });
+    if (found < 0 && !bit && !end_given) {
+        return long(last * 8);
+    }
+    return found;
+}
+
+void bits_operation::combine(bitop_type op, char* dst, const char* src, size_t size)
+{
+    size_t i = 0;
+    auto combine_words = [&i, dst, src, size] (auto&& f) {
+        for (; i + 8 <= size; i += 8) {
+            uint64_t a, b;
+            std::memcpy(&a, dst + i, sizeof(a));
+            std::memcpy(&b, src + i, sizeof(b));
+            a = f(a, b);
+            std::memcpy(dst + i, &a, sizeof(a));
+        }
+        for (; i < size; ++i) {
+            dst[i] = char(f(uint8_t(dst[i]), uint8_t(src[i])));
+        }
+    };
+    switch (op) {
+    case bitop_type::AND:
+        combine_words([] (auto a, auto b) { return a & b; });
+        break;
+    case bitop_type::OR:
+        combine_words([] (auto a, auto b) { return a | b; });
+        break;
+    case bitop_type::XOR:
+        combine_words([] (auto a, auto b) { return a ^ b; });
+        break;
+    case bitop_type::NOT:
+        combine_words([] (auto, auto b) { return decltype(b)(~b); });
+        break;
     }
-    return bits_count;
 }
 }
@@ -20,11 +20,45 @@
 */
 #pragma once
 #include "utils/managed_bytes.hh"
+#include <vector>
 namespace redis {
+enum class bitop_type {
+    AND,
+    OR,
+    XOR,
+    NOT,
+};
+
 struct bits_operation
 {
     static bool set(managed_bytes& o, size_t offset, bool value);
     static bool get(const managed_bytes& o, size_t offset);
+    // the bits set in the bytes [start, end], negative offsets count from the end.
     static size_t count(const managed_bytes& o, long start, long end);
+    // the offset of the first bit equal to bit in the bytes [start, end], or -1. As
+    // Redis, a clear bit is found past the end of the value unless end was given.
+    static long pos(const managed_bytes& o, bool bit, long start, long end, bool end_given);
+    // Normalizes the byte range [start, end] of a value of size bytes as Redis
+    // does, returns false if it is empty.
+    static bool byte_range(size_t size, long& start, long& end);
+    // dst = dst op src on the first size bytes, NOT ignores dst.
+    static void combine(bitop_type op, char* dst, const char* src, size_t size);
+
+    // The kernels on contiguous bytes, the fastest the cpu supports is selected at
+    // startup: AVX2, then POPCNT, then a portable one.
+    static uint64_t popcount(const char* data, size_t size);
+    // the offset of the first bit equal to bit, or -1.
+    static long find_bit(const char* data, size_t size, bool bit);
+    static const char* kernel_name();
+    struct kernel_set {
+        const char* name;
+        uint64_t (*popcount)(const uint8_t* p, size_t size);
+        long (*find_bit)(const uint8_t* p, size_t size, bool bit);
+    };
+    // the kernels the cpu supports, the portable ones first and the selected ones last.
+    static std::vector<kernel_set> supported_kernels();
+    // the portable kernels, whatever the cpu supports.
+    static uint64_t popcount_scalar(const char* data, size_t size);
+    static long find_bit_scalar(const char* data, size_t size, bool bit);
 };
 }
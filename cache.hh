@@ -19,11 +19,12 @@
 *
 */
 #pragma once
-#include <boost/intrusive/unordered_set.hpp>
 #include <boost/intrusive/list.hpp>
 #include <boost/intrusive_ptr.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/optional.hpp>
+#include <limits>
+#include <random>
 #include "common.hh"
 #include "bytes.hh"
 #include "utils/managed_ref.hh"
@@ -34,8 +35,11 @@
 #include "dict_lsa.hh"
 #include "sset_lsa.hh"
 #include "core/sstring.hh"
+#include "core/temporary_buffer.hh"
 #include "core/timer-set.hh"
 #include "hll.hh"
+#include "bitmap_lsa.hh"
+#include "hash_table.hh"
 #include "util/log.hh"
 using logger =  seastar::logger;
 static logger logc ("cache");
@@ -86,14 +90,26 @@ enum class entry_type {
     ENTRY_SET   = 5,
     ENTRY_SSET  = 6,
     ENTRY_HLL   = 7,
+    ENTRY_BITMAP = 8,
+};
+
+// What is evicted once a shard uses more than its maxmemory.
+enum class eviction_policy {
+    noeviction,
+    allkeys_lru,
+    allkeys_lfu,
+    volatile_ttl,
 };
 class cache_entry
 {
 protected:
     friend class cache;
-    using hook_type = boost::intrusive::unordered_set_member_hook<>;
+    using hook_type = hash_table_hook;
     hook_type _cache_link;
     entry_type _type;
+    // the last access for the eviction policy, see cache::touch(). It fills the
+    // padding after _type, so it does not make the entry larger.
+    mutable uint32_t _access = 0;
     managed_ref<managed_bytes> _key;
     size_t _key_hash;
     union storage {
@@ -103,11 +119,14 @@ protected:
         managed_ref<list_lsa> _list;
         managed_ref<dict_lsa> _dict;
         managed_ref<sset_lsa> _sset;
+        managed_ref<bitmap_lsa> _bitmap;
         storage() {}
         ~storage() {}
     } _storage;
     bi::list_member_hook<> _timer_link;
     expiration _expiry;
+    // the cache version the entry was inserted, or serialized by a snapshot at.
+    uint64_t _version = 0;
 public:
     using time_point = expiration::time_point;
     using duration = expiration::duration;
@@ -142,6 +161,12 @@ public:
     {
         _storage._bytes = make_managed<managed_bytes>(bytes_view{reinterpret_cast<const signed char*>(data.data()), data.size()});
     }
+    // the value is copied straight from the received data.
+    cache_entry(const sstring& key, size_t hash, const temporary_buffer<char>& data) noexcept
+        : cache_entry(key, hash, entry_type::ENTRY_BYTES)
+    {
+        _storage._bytes = make_managed<managed_bytes>(bytes_view{reinterpret_cast<const signed char*>(data.get()), data.size()});
+    }
     struct list_initializer {};
     cache_entry(const sstring& key, size_t hash, list_initializer) noexcept
         : cache_entry(key, hash, entry_type::ENTRY_LIST)
@@ -153,14 +178,14 @@ public:
     cache_entry(const sstring& key, size_t hash, dict_initializer) noexcept
         : cache_entry(key, hash, entry_type::ENTRY_MAP)
     {
-        _storage._dict = make_managed<dict_lsa>();
+        _storage._dict = make_managed<dict_lsa>(hash_packed_limits);
     }
 
     struct set_initializer {};
     cache_entry(const sstring& key, size_t hash, set_initializer) noexcept
         : cache_entry(key, hash, entry_type::ENTRY_SET)
     {
-        _storage._dict = make_managed<dict_lsa>();
+        _storage._dict = make_managed<dict_lsa>(set_packed_limits);
     }
 
     struct sset_initializer {};
@@ -170,19 +195,44 @@ public:
         _storage._sset = make_managed<sset_lsa>();
     }
 
+    cache_entry(const sstring& key, size_t hash, managed_ref<sset_lsa>&& sset) noexcept
+        : cache_entry(key, hash, entry_type::ENTRY_SSET)
+    {
+        _storage._sset = std::move(sset);
+    }
+
     struct hll_initializer {};
     cache_entry(const sstring& key, size_t hash, hll_initializer) noexcept
         : cache_entry(key, hash, entry_type::ENTRY_HLL)
     {
-        _storage._bytes = make_managed<managed_bytes>(HLL_BYTES_SIZE, 0);
+        // an empty sparse HLL, see hll.hh.
+        _storage._bytes = make_managed<managed_bytes>(HLL_CARD_CACHE_SIZE, 0);
+    }
+
+    struct bitmap_initializer {};
+    cache_entry(const sstring& key, size_t hash, bitmap_initializer) noexcept
+        : cache_entry(key, hash, entry_type::ENTRY_BITMAP)
+    {
+        _storage._bitmap = make_managed<bitmap_lsa>();
+    }
+
+    cache_entry(const sstring& key, size_t hash, const bitmap_lsa& bitmap) noexcept
+        : cache_entry(key, hash, entry_type::ENTRY_BITMAP)
+    {
+        _storage._bitmap = make_managed<bitmap_lsa>(bitmap);
     }
 
     cache_entry(cache_entry&& o) noexcept
         : _cache_link(std::move(o._cache_link))
         , _type(o._type)
-        , _key(std::move(_key))
+        , _access(o._access)
+        , _key(std::move(o._key))
         , _key_hash(std::move(o._key_hash))
+        , _expiry(o._expiry)
+        , _version(o._version)
     {
+        // the LSA moves entries, the moved one takes the place in the expiry lists.
+        _timer_link.swap_nodes(o._timer_link);
         switch (_type) {
             case entry_type::ENTRY_FLOAT:
                 _storage._float_number = std::move(o._storage._float_number);
@@ -204,6 +254,9 @@ public:
             case entry_type::ENTRY_SSET:
                 _storage._sset = std::move(o._storage._sset);
                 break;
+            case entry_type::ENTRY_BITMAP:
+                _storage._bitmap = std::move(o._storage._bitmap);
+                break;
         }
     }
 
@@ -227,6 +280,9 @@ public:
             case entry_type::ENTRY_SSET:
                 _storage._sset.~managed_ref<sset_lsa>();
                 break;
+            case entry_type::ENTRY_BITMAP:
+                _storage._bitmap.~managed_ref<bitmap_lsa>();
+                break;
         }
     }
 
@@ -236,6 +292,7 @@ public:
             case entry_type::ENTRY_FLOAT:
             case entry_type::ENTRY_INT64:
             case entry_type::ENTRY_BYTES:
+            case entry_type::ENTRY_BITMAP:
                 return msg_type_string;
             case entry_type::ENTRY_HLL:
                 return msg_type_hll;
@@ -254,9 +311,11 @@ public:
         return (l._key_hash == r._key_hash) && (*(l._key) == *(r._key));
     }
 
-    friend inline std::size_t hash_value(const cache_entry& e) {
-        return e._key_hash;
-    }
+    struct hash {
+        inline size_t operator () (const cache_entry& e) const noexcept {
+            return e._key_hash;
+        }
+    };
 
     struct compare {
     public:
@@ -283,6 +342,11 @@ public:
         return _expiry.ever_expires();
     }
 
+    inline uint64_t version() const
+    {
+        return _version;
+    }
+
     inline void set_never_expired()
     {
         return _expiry.set_never_expired();
@@ -363,6 +427,9 @@ public:
     inline bool type_of_hll() const {
         return _type == entry_type::ENTRY_HLL;
     }
+    inline bool type_of_bitmap() const {
+        return _type == entry_type::ENTRY_BITMAP;
+    }
     inline int64_t value_integer() const
     {
         return _storage._integer_number;
@@ -411,34 +478,122 @@ public:
     inline const sset_lsa& value_sset() const {
         return *(_storage._sset);
     }
+    inline bitmap_lsa& value_bitmap() {
+        return *(_storage._bitmap);
+    }
+    inline const bitmap_lsa& value_bitmap() const {
+        return *(_storage._bitmap);
+    }
+    // Turns a bitmap into the bytes of the equivalent string, for the commands
+    // which modify the value as a string.
+    void bitmap_to_bytes(const char* data, size_t size)
+    {
+        auto bytes = make_managed<managed_bytes>(bytes_view{reinterpret_cast<const signed char*>(data), size});
+        _storage._bitmap.~managed_ref<bitmap_lsa>();
+        new (&_storage._bytes) managed_ref<managed_bytes>(std::move(bytes));
+        _type = entry_type::ENTRY_BYTES;
+    }
 };
 
 static constexpr const size_t DEFAULT_INITIAL_SIZE = 1 << 20;
 
 class cache {
-    using cache_type = boost::intrusive::unordered_set<cache_entry,
-        boost::intrusive::member_hook<cache_entry, cache_entry::hook_type, &cache_entry::_cache_link>,
-        boost::intrusive::power_2_buckets<true>,
-        boost::intrusive::constant_time_size<true>>;
-    using cache_iterator = typename cache_type::iterator;
-    using const_cache_iterator = typename cache_type::const_iterator;
+    using cache_type = hash_table<cache_entry, &cache_entry::_cache_link, cache_entry::hash>;
     static constexpr size_t initial_bucket_count = DEFAULT_INITIAL_SIZE;
     static constexpr float load_factor = 0.75f;
-    size_t _resize_up_threshold = load_factor * initial_bucket_count;
-    cache_type::bucket_type* _buckets;
+    // While the store is rehashing, the background timer migrates buckets
+    // for at most rehash_budget_us every rehash_period_us, so that an idle
+    // shard finishes the rehash without waiting for the mutations.
+    static constexpr size_t rehash_batch_buckets = 256;
+    static constexpr int64_t rehash_budget_us = 200;
+    static constexpr int64_t rehash_period_us = 1000;
+    // A cycle of the active expiry releases expired entries for at most
+    // expire_budget_us. While some are left, the next cycle runs after
+    // expire_fast_period_us if they are more than expire_fast_ratio of the entries
+    // with a timeout, after expire_slow_period_us otherwise.
+    static constexpr int64_t expire_budget_us = 1000;
+    static constexpr int64_t expire_fast_period_us = 1000;
+    static constexpr int64_t expire_slow_period_us = 10000;
+    static constexpr double expire_fast_ratio = 0.1;
+    // entries released between two checks of the budget.
+    static constexpr size_t expire_check_interval = 64;
     cache_type _store;
-    seastar::timer_set<cache_entry, &cache_entry::_timer_link> _alive;
+    using alive_type = seastar::timer_set<cache_entry, &cache_entry::_timer_link>;
+    // The entries with a timeout are in _alive until they expire, then in _expired
+    // until the active expiry releases them, or until they are accessed; an entry
+    // is in _expired if its timeout is not after _expired_upto.
+    alive_type _alive;
+    alive_type::timer_list_t _expired;
+    clock_type::time_point _expired_upto = clock_type::time_point::min();
     timer<clock_type> _timer;
+    timer<> _expire_timer;
+    timer<> _rehash_timer;
     clock_type::duration _wc_to_clock_type_delta;
     allocation_strategy* alloc;
     using expired_entry_releaser_type = std::function<void(cache_entry& e)>;
     expired_entry_releaser_type _expired_entry_releaser;
+    // A snapshot serializes the entries which were alive when it started, the ones
+    // with a version not above _snapshot_version: each of them once, by the walk or
+    // right before it is modified, whichever comes first, after which it gets the
+    // current version. So the snapshot is a point in time one, without a fork.
+    using snapshot_writer_type = std::function<void(const cache_entry& e)>;
+    static constexpr size_t snapshot_batch_buckets = 256;
+    uint64_t _version = 0;
+    uint64_t _snapshot_version = 0;
+    size_t _snapshot_cursor = 0;
+    bool _snapshotting = false;
+    snapshot_writer_type _snapshot_writer;
+    // Eviction samples a few entries from random buckets and picks the one the
+    // policy ranks worst, there is no list to maintain. The LFU counter grows
+    // logarithmically and decays by one every lfu_decay_minutes.
+    static constexpr uint8_t lfu_init_value = 5;
+    static constexpr double lfu_log_factor = 10;
+    static constexpr uint32_t lfu_decay_minutes = 1;
+    static constexpr size_t eviction_attempts = 4;
+    eviction_policy _eviction_policy = eviction_policy::noeviction;
+    size_t _eviction_samples = 5;
+    mutable std::minstd_rand _random;
+    // The number of the operations in progress, the entries they hold must not
+    // be evicted. The memory guard runs before an operation which is not nested.
+    mutable unsigned _depth = 0;
+    using memory_guard_type = std::function<void()>;
+    memory_guard_type _memory_guard;
+    // told of the pauses of rehash and expiry, by the name of their latency event.
+    using pause_observer_type = std::function<void(const char*, std::chrono::steady_clock::duration)>;
+    pause_observer_type _pause_observer;
+    struct operation {
+        const cache& _cache;
+        explicit operation(const cache& c) : _cache(c) { ++_cache._depth; }
+        ~operation() { --_cache._depth; }
+    };
 public:
-    cache ()
-        : _buckets(new cache_type::bucket_type[initial_bucket_count])
-        , _store(cache_type::bucket_traits(_buckets, initial_bucket_count))
+    struct rehash_stats {
+        uint64_t _started = 0;
+        uint64_t _completed = 0;
+        uint64_t _background_steps = 0;
+        // time spent in allocating bucket arrays and in background steps.
+        uint64_t _stall_us = 0;
+        uint64_t _max_stall_us = 0;
+    };
+    struct expire_stats {
+        uint64_t _cycles = 0;
+        uint64_t _active = 0;
+        uint64_t _lazy = 0;
+        uint64_t _stall_us = 0;
+    };
+private:
+    rehash_stats _rehash_stats;
+    expire_stats _expire_stats;
+public:
+    cache () : cache(initial_bucket_count)
+    {
+    }
+    explicit cache (size_t bucket_count)
+        : _store(bucket_count, load_factor)
     {
         _timer.set_callback([this] { erase_expired_entries(); });
+        _expire_timer.set_callback([this] { expire_cycle(); });
+        _rehash_timer.set_callback([this] { background_rehash(); });
     }
     ~cache ()
     {
@@ -449,6 +604,17 @@ public:
         return _alive.size();
     }
 
+    // The expired entries which were not released yet.
+    inline size_t expired_backlog() const
+    {
+        return _expired.size();
+    }
+
+    inline const expire_stats& expire_statistics() const
+    {
+        return _expire_stats;
+    }
+
 
     void set_expired_entry_releaser(expired_entry_releaser_type&& releaser)
     {
@@ -459,22 +625,21 @@ public:
     void flush_all()
     {
         for (auto it = _store.begin(); it != _store.end(); ++it) {
-            if (it->ever_expires()) {
-                _alive.remove(*it);
-            }
+            unlink_expiry(*it);
         }
-        _store.erase_and_dispose(_store.begin(), _store.end(), current_deleter<cache_entry>());
+        _store.clear_and_dispose(current_deleter<cache_entry>());
+        _rehash_timer.cancel();
+        _expire_timer.cancel();
     }
 
     inline bool erase(const redis_key& key)
     {
-        static auto hash_fn = [] (const redis_key& k) -> size_t { return k.hash(); };
-        auto it = _store.find(key, hash_fn, cache_entry::compare());
-        if (it != _store.end()) {
-            if (it->ever_expires()) {
-                _alive.remove(*it);
-            }
-            _store.erase_and_dispose(it, current_deleter<cache_entry>());
+        operation op(*this);
+        auto e = _store.find(key, key.hash(), cache_entry::compare());
+        if (e != nullptr && !expire_lazily(*e)) {
+            capture(*e);
+            unlink_expiry(*e);
+            erase_and_dispose(*e);
             return true;
         }
         return false;
@@ -482,22 +647,24 @@ public:
 
     inline bool erase(cache_entry& e)
     {
-        auto it = _store.iterator_to(e);
-        _store.erase_and_dispose(it, current_deleter<cache_entry>());
+        operation op(*this);
+        capture(e);
+        unlink_expiry(e);
+        erase_and_dispose(e);
         return true;
     }
 
     inline bool replace(cache_entry* entry)
     {
+        guard_memory();
+        operation op(*this);
         bool res = true;
         if (entry) {
-            static auto hash_fn = [] (const cache_entry& e) -> size_t { return e.key_hash(); };
-            auto it = _store.find(*entry, hash_fn, cache_entry::compare());
-            if (it != _store.end()) {
-                if (it->ever_expires()) {
-                    _alive.remove(*it);
-                }
-                _store.erase_and_dispose(it, current_deleter<cache_entry>());
+            auto e = _store.find(*entry, entry->key_hash(), cache_entry::compare());
+            if (e != nullptr && !expire_lazily(*e)) {
+                capture(*e);
+                unlink_expiry(*e);
+                erase_and_dispose(*e);
                 res = false;
             }
         }
@@ -507,15 +674,15 @@ public:
 
     inline bool replace(cache_entry* entry, long expired)
     {
+        guard_memory();
+        operation op(*this);
         bool res = true;
         if (entry) {
-            static auto hash_fn = [] (const cache_entry& e) -> size_t { return e.key_hash(); };
-            auto it = _store.find(*entry, hash_fn, cache_entry::compare());
-            if (it != _store.end()) {
-                if (it->ever_expires()) {
-                    _alive.remove(*it);
-                }
-                _store.erase_and_dispose(it, current_deleter<cache_entry>());
+            auto e = _store.find(*entry, entry->key_hash(), cache_entry::compare());
+            if (e != nullptr && !expire_lazily(*e)) {
+                capture(*e);
+                unlink_expiry(*e);
+                erase_and_dispose(*e);
                 res = false;
             }
         }
@@ -529,15 +696,16 @@ public:
         if (!entry) {
             return false;
         }
-        static auto hash_fn = [] (const cache_entry& e) -> size_t { return e.key_hash(); };
-        auto it = _store.find(*entry, hash_fn, cache_entry::compare());
-        if (it != _store.end() && (xx || (!xx && !nx))) {
-            if (it->ever_expires()) {
-                _alive.remove(*it);
-            }
-            _store.erase_and_dispose(it, current_deleter<cache_entry>());
+        guard_memory();
+        operation op(*this);
+        auto e = _store.find(*entry, entry->key_hash(), cache_entry::compare());
+        bool exists = e != nullptr && !expire_lazily(*e);
+        if (exists && (xx || (!xx && !nx))) {
+            capture(*e);
+            unlink_expiry(*e);
+            erase_and_dispose(*e);
         }
-        bool should_insert = (xx && it != _store.end()) || (nx && it == _store.end()) || (!nx && !xx);
+        bool should_insert = (xx && exists) || (nx && !exists) || (!nx && !xx);
         if (should_insert) {
             if (expired > 0) {
                 auto expiry = expiration(expired);
@@ -546,8 +714,7 @@ public:
                     _timer.rearm(entry->get_timeout());
                 }
             }
-            _store.insert(*entry);
-            maybe_rehash();
+            insert(entry);
             return true;
         }
         return false;
@@ -555,60 +722,130 @@ public:
 
     inline void insert(cache_entry* entry)
     {
+        operation op(*this);
+        entry->_version = _version;
+        init_access(*entry);
         auto& etnry_reference = *entry;
-        _store.insert(etnry_reference);
-        // maybe cache will be rehashed.
+        if (_store.will_grow()) {
+            // allocating the new bucket array is the only step which is not bounded.
+            auto start = std::chrono::steady_clock::now();
+            _store.insert(etnry_reference);
+            account_stall(std::chrono::steady_clock::now() - start);
+        }
+        else {
+            _store.insert(etnry_reference);
+        }
+        // maybe cache is being rehashed.
         maybe_rehash();
     }
 
     template <typename Func>
     inline std::result_of_t<Func(const cache_entry* e)> with_entry_run(const redis_key& rk, Func&& func) const {
-        static auto hash_fn = [] (const redis_key& k) -> size_t { return k.hash(); };
-        auto it = _store.find(rk, hash_fn, cache_entry::compare());
-        if (it != _store.end()) {
-            const auto& e = *it;
-            return func(&e);
+        operation op(*this);
+        const cache_entry* e = _store.find(rk, rk.hash(), cache_entry::compare());
+        if (e && is_expired(*e)) {
+            e = nullptr;
         }
-        else {
-            return func(nullptr);
+        if (e) {
+            touch(*e);
         }
+        return func(e);
     }
 
+    // The entry may be modified by func, a running snapshot serializes it first.
     template <typename Func>
     inline std::result_of_t<Func(cache_entry* e)> with_entry_run(const redis_key& rk, Func&& func) {
-        static auto hash_fn = [] (const redis_key& k) -> size_t { return k.hash(); };
-        auto it = _store.find(rk, hash_fn, cache_entry::compare());
-        if (it != _store.end()) {
-            auto& e = *it;
-            return func(&e);
+        guard_memory();
+        operation op(*this);
+        auto e = _store.find(rk, rk.hash(), cache_entry::compare());
+        if (e && expire_lazily(*e)) {
+            e = nullptr;
         }
-        else {
-            return func(nullptr);
+        if (e) {
+            capture(*e);
+            touch(*e);
         }
+        return func(e);
     }
 
 
     inline bool exists(const redis_key& rk)
     {
-        static auto hash_fn = [] (const redis_key& k) -> size_t { return k.hash(); };
-        auto it = _store.find(rk, hash_fn, cache_entry::compare());
-        return it != _store.end();
+        operation op(*this);
+        auto e = _store.find(rk, rk.hash(), cache_entry::compare());
+        return e != nullptr && !expire_lazily(*e);
+    }
+
+    // Calls func with the entries which did not expire, of the buckets from the
+    // cursor on, until count entries or count * SCAN_BUCKETS_PER_COUNT buckets were
+    // visited. Returns the cursor of the next call, 0 once the scan is complete;
+    // the cursor survives rehash, see hash_table::scan().
+    template <typename Func>
+    size_t scan(size_t cursor, size_t count, Func&& func) const
+    {
+        operation op(*this);
+        size_t visited = 0;
+        size_t buckets = count * SCAN_BUCKETS_PER_COUNT;
+        do {
+            cursor = _store.scan(cursor, [this, &visited, &func] (const cache_entry& e) {
+                ++visited;
+                if (!is_expired(e)) {
+                    func(e);
+                }
+            });
+        } while (cursor != 0 && visited < count && --buckets > 0);
+        return cursor;
     }
 
     void maybe_rehash()
     {
-        if (_store.size() >= _resize_up_threshold) {
-            auto new_size = _store.bucket_count() * 2;
-            auto old_buckets = _buckets;
-            try {
-                _buckets = new cache_type::bucket_type[new_size];
-            } catch (const std::bad_alloc& e) {
-                return;
+        if (_store.rehashing() && !_store.frozen() && !_rehash_timer.armed()) {
+            ++_rehash_stats._started;
+            _rehash_timer.arm(std::chrono::microseconds(rehash_period_us));
+        }
+    }
+
+    void background_rehash()
+    {
+        if (_store.frozen()) {
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        bool rehashing = _store.rehashing();
+        while (rehashing) {
+            rehashing = _store.rehash_step(rehash_batch_buckets);
+            ++_rehash_stats._background_steps;
+            if (std::chrono::steady_clock::now() - start >= std::chrono::microseconds(rehash_budget_us)) {
+                break;
             }
-            _store.rehash(typename cache_type::bucket_traits(_buckets, new_size));
-            delete[] old_buckets;
-            _resize_up_threshold = _store.bucket_count() * load_factor;
         }
+        account_stall(std::chrono::steady_clock::now() - start);
+        if (rehashing) {
+            _rehash_timer.arm(std::chrono::microseconds(rehash_period_us));
+        }
+        else {
+            ++_rehash_stats._completed;
+        }
+    }
+
+    inline bool rehashing() const
+    {
+        return _store.rehashing();
+    }
+
+    inline size_t rehash_pending() const
+    {
+        return _store.rehash_pending();
+    }
+
+    inline size_t bucket_count() const
+    {
+        return _store.bucket_count();
+    }
+
+    inline const rehash_stats& rehash_statistics() const
+    {
+        return _rehash_stats;
     }
 
     inline size_t size() const
@@ -623,46 +860,298 @@ public:
 
     bool expire(const redis_key& rk, long expired)
     {
+        operation op(*this);
         bool result = false;
-        static auto hash_fn = [] (const redis_key& k) -> size_t { return k.hash(); };
-        auto it = _store.find(rk, hash_fn, cache_entry::compare());
-        if (it != _store.end()) {
+        auto e = _store.find(rk, rk.hash(), cache_entry::compare());
+        if (e != nullptr && !expire_lazily(*e)) {
+            result = true;
+            if (expired <= 0) {
+                // a timeout in the past deletes the key.
+                if (_expired_entry_releaser) {
+                    _expired_entry_releaser(*e);
+                }
+                return result;
+            }
+            capture(*e);
+            unlink_expiry(*e);
             auto expiry = expiration(expired);
-            it->set_expiry(expiry);
-            auto& ref = *it;
+            e->set_expiry(expiry);
+            auto& ref = *e;
             if (_alive.insert(ref)) {
-                _timer.rearm(it->get_timeout());
-                result = true;
+                _timer.rearm(e->get_timeout());
             }
         }
         return result;
     }
 
+    // Moves the entries which expired to the backlog, and starts releasing them.
     void erase_expired_entries()
     {
         assert(_expired_entry_releaser);
+        _expired_upto = clock_type::now();
+        auto expired_entries = _alive.expire(_expired_upto);
+        _expired.splice(_expired.end(), expired_entries);
+        _timer.arm(_alive.get_next_timeout());
+        if (!_expire_timer.armed()) {
+            expire_cycle();
+        }
+    }
 
-        auto expired_entries = _alive.expire(clock_type::now());
-        while (!expired_entries.empty()) {
-            auto entry = &*expired_entries.begin();
-            expired_entries.pop_front();
-            _expired_entry_releaser(*entry);
+    // Releases the expired entries for at most expire_budget_us, so that a large
+    // batch of entries which share a timeout does not stall the shard.
+    void expire_cycle()
+    {
+        auto start = std::chrono::steady_clock::now();
+        size_t released = 0;
+        while (!_expired.empty()) {
+            // the releaser erases the entry, which unlinks it from _expired.
+            _expired_entry_releaser(_expired.front());
+            ++released;
+            if (released % expire_check_interval == 0 && std::chrono::steady_clock::now() - start >= std::chrono::microseconds(expire_budget_us)) {
+                break;
+            }
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        ++_expire_stats._cycles;
+        _expire_stats._active += released;
+        _expire_stats._stall_us += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+        if (_pause_observer) {
+            _pause_observer("expire-cycle", elapsed);
+        }
+        if (!_expired.empty()) {
+            double ratio = static_cast<double>(_expired.size()) / (_expired.size() + _alive.size());
+            _expire_timer.arm(std::chrono::microseconds(ratio > expire_fast_ratio ? expire_fast_period_us : expire_slow_period_us));
         }
-        _timer.arm(_alive.get_next_timeout());
     }
 
     bool never_expired(const redis_key& rk)
     {
+        operation op(*this);
         bool result = false;
-        static auto hash_fn = [] (const redis_key& k) -> size_t { return k.hash(); };
-        auto it = _store.find(rk, hash_fn, cache_entry::compare());
-        if (it != _store.end() && it->ever_expires()) {
-            it->set_never_expired();
-            auto& ref = *it;
-            _alive.remove(ref);
+        auto e = _store.find(rk, rk.hash(), cache_entry::compare());
+        if (e != nullptr && e->ever_expires() && !expire_lazily(*e)) {
+            capture(*e);
+            unlink_expiry(*e);
+            e->set_never_expired();
             result = true;
         }
         return result;
     }
+    // Starts a snapshot of the entries alive now, the table is frozen until it ends.
+    void start_snapshot(snapshot_writer_type&& writer)
+    {
+        assert(!_snapshotting);
+        _snapshot_version = _version++;
+        _snapshot_cursor = 0;
+        _snapshotting = true;
+        _snapshot_writer = std::move(writer);
+        _store.freeze(true);
+    }
+
+    // Serializes the entries of the next buckets for at most budget, returns true
+    // once the whole table was walked.
+    template <typename Duration>
+    bool snapshot_step(Duration budget)
+    {
+        auto start = std::chrono::steady_clock::now();
+        auto end = _store.bucket_count();
+        while (_snapshot_cursor < end) {
+            _snapshot_cursor = _store.walk(_snapshot_cursor, snapshot_batch_buckets, [this] (cache_entry& e) {
+                capture(e);
+            });
+            if (std::chrono::steady_clock::now() - start >= budget) {
+                break;
+            }
+        }
+        return _snapshot_cursor >= _store.bucket_count();
+    }
+
+    void end_snapshot()
+    {
+        _snapshotting = false;
+        _snapshot_writer = {};
+        _store.freeze(false);
+        maybe_rehash();
+    }
+
+    inline bool snapshotting() const
+    {
+        return _snapshotting;
+    }
+
+    void set_eviction_policy(eviction_policy policy, size_t samples)
+    {
+        _eviction_policy = policy;
+        _eviction_samples = std::max<size_t>(samples, 1);
+    }
+
+    inline eviction_policy get_eviction_policy() const
+    {
+        return _eviction_policy;
+    }
+
+    // The guard may evict entries, see evictable().
+    void set_memory_guard(memory_guard_type&& guard)
+    {
+        _memory_guard = std::move(guard);
+    }
+
+    void set_pause_observer(pause_observer_type&& observer)
+    {
+        _pause_observer = std::move(observer);
+    }
+
+    // Entries may only be evicted while no operation is in progress, since the
+    // operation may hold any of them.
+    inline bool evictable() const
+    {
+        return _depth == 0;
+    }
+
+    // Returns the entry the policy ranks worst among a few sampled ones, or
+    // nullptr if none of the sampled entries may be evicted.
+    cache_entry* eviction_candidate()
+    {
+        if (_eviction_policy == eviction_policy::noeviction) {
+            return nullptr;
+        }
+        cache_entry* candidate = nullptr;
+        uint64_t worst = 0;
+        auto now = access_clock();
+        for (size_t attempt = 0; attempt < eviction_attempts && candidate == nullptr; ++attempt) {
+            _store.sample(_random(), _eviction_samples, [this, now, &candidate, &worst] (cache_entry& e) {
+                uint64_t rank = 0;
+                switch (_eviction_policy) {
+                    case eviction_policy::allkeys_lru:
+                        rank = now - e._access;
+                        break;
+                    case eviction_policy::allkeys_lfu:
+                        rank = 255 - lfu_decayed(e._access);
+                        break;
+                    case eviction_policy::volatile_ttl:
+                        if (!e.ever_expires()) {
+                            return;
+                        }
+                        rank = std::numeric_limits<uint64_t>::max() - static_cast<uint64_t>(e.get_timeout().time_since_epoch().count());
+                        break;
+                    case eviction_policy::noeviction:
+                        return;
+                }
+                if (candidate == nullptr || rank > worst) {
+                    candidate = &e;
+                    worst = rank;
+                }
+            });
+        }
+        return candidate;
+    }
+private:
+    inline bool is_expired(const cache_entry& e) const
+    {
+        return e.ever_expires() && e.get_timeout() <= clock_type::now();
+    }
+
+    // Releases the entry if it expired, returns true if so.
+    inline bool expire_lazily(cache_entry& e)
+    {
+        if (!is_expired(e) || !_expired_entry_releaser) {
+            return false;
+        }
+        ++_expire_stats._lazy;
+        _expired_entry_releaser(e);
+        return true;
+    }
+
+    inline void unlink_expiry(cache_entry& e)
+    {
+        if (!e._timer_link.is_linked()) {
+            return;
+        }
+        if (e.get_timeout() <= _expired_upto) {
+            _expired.erase(_expired.iterator_to(e));
+        }
+        else {
+            _alive.remove(e);
+        }
+    }
+
+    inline void guard_memory()
+    {
+        if (_depth == 0 && _memory_guard) {
+            _memory_guard();
+        }
+    }
+
+    // seconds for LRU, the access field of LFU keeps minutes.
+    static inline uint32_t access_clock()
+    {
+        return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(clock_type::now().time_since_epoch()).count());
+    }
+
+    // The LFU access field is [16 bits: minutes][8 bits: counter].
+    static inline uint8_t lfu_decayed(uint32_t access)
+    {
+        uint16_t minutes = static_cast<uint16_t>(access_clock() / 60);
+        uint16_t elapsed = minutes - static_cast<uint16_t>(access >> 8);
+        uint32_t periods = elapsed / lfu_decay_minutes;
+        uint8_t counter = access & 0xff;
+        return periods >= counter ? 0 : counter - periods;
+    }
+
+    inline void init_access(const cache_entry& e)
+    {
+        if (_eviction_policy == eviction_policy::allkeys_lfu) {
+            e._access = (static_cast<uint32_t>(static_cast<uint16_t>(access_clock() / 60)) << 8) | lfu_init_value;
+        }
+        else {
+            e._access = access_clock();
+        }
+    }
+
+    inline void touch(const cache_entry& e) const
+    {
+        if (_eviction_policy == eviction_policy::allkeys_lfu) {
+            uint8_t counter = lfu_decayed(e._access);
+            if (counter < 255) {
+                double base = counter > lfu_init_value ? counter - lfu_init_value : 0;
+                double p = 1.0 / (base * lfu_log_factor + 1);
+                if (std::generate_canonical<double, 32>(_random) < p) {
+                    ++counter;
+                }
+            }
+            e._access = (static_cast<uint32_t>(static_cast<uint16_t>(access_clock() / 60)) << 8) | counter;
+        }
+        else if (_eviction_policy != eviction_policy::noeviction) {
+            e._access = access_clock();
+        }
+    }
+
+    inline void capture(cache_entry& e)
+    {
+        if (_snapshotting && e._version <= _snapshot_version) {
+            _snapshot_writer(e);
+            e._version = _version;
+        }
+    }
+
+    inline void erase_and_dispose(cache_entry& e)
+    {
+        _store.erase(e);
+        current_deleter<cache_entry>()(&e);
+        maybe_rehash();
+    }
+
+    template <typename Duration>
+    inline void account_stall(Duration d)
+    {
+        auto us = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+        _rehash_stats._stall_us += us;
+        if (us > _rehash_stats._max_stall_us) {
+            _rehash_stats._max_stall_us = us;
+        }
+        if (_pause_observer) {
+            _pause_observer("rehash", std::chrono::duration_cast<std::chrono::steady_clock::duration>(d));
+        }
+    }
 };
 }
@@ -0,0 +1,492 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "commitlog.hh"
+#include "config.hh"
+#include "redis_protocol.hh"
+#include "core/align.hh"
+#include "core/byteorder.hh"
+#include "core/fstream.hh"
+#include "core/reactor.hh"
+#include "core/metrics.hh"
+#include "utils/crc.hh"
+#include "util/log.hh"
+#include <boost/algorithm/string/replace.hpp>
+#include <algorithm>
+#include <map>
+#include <tuple>
+
+namespace redis {
+
+using logger = seastar::logger;
+static logger clog("commitlog");
+
+namespace {
+// Replayed requests are executed for their effect only, the replies are dropped.
+class null_data_sink : public data_sink_impl {
+public:
+    virtual future<> put(net::packet) override {
+        return make_ready_future<>();
+    }
+    virtual future<> close() override {
+        return make_ready_future<>();
+    }
+};
+
+uint32_t checksum(const char* data, size_t size)
+{
+    utils::crc32 c;
+    c.process(reinterpret_cast<const uint8_t*>(data), size);
+    return c.get();
+}
+
+void write_le32(char* p, uint32_t v)
+{
+    v = cpu_to_le(v);
+    std::memcpy(p, &v, sizeof(v));
+}
+
+uint32_t read_le32(const char* p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return le_to_cpu(v);
+}
+
+size_t digits(size_t v)
+{
+    size_t n = 1;
+    while (v >= 10) {
+        v /= 10;
+        ++n;
+    }
+    return n;
+}
+
+char* write_bulk_header(char* p, char tag, size_t v)
+{
+    *p++ = tag;
+    auto end = p + digits(v);
+    for (auto q = end; q != p; v /= 10) {
+        *--q = '0' + v % 10;
+    }
+    *end++ = '\r';
+    *end++ = '\n';
+    return end;
+}
+}
+
+commit_log::config commit_log::make_config(const redis::config& cfg)
+{
+    config c;
+    auto home = std::getenv("REDIS_HOME");
+    auto directory = boost::replace_all_copy(std::string(cfg.commitlog_directory()), "${REDIS_HOME}", home ? home : ".");
+    c.directory = sstring(directory.data(), directory.size());
+    c.mode = cfg.commitlog_sync() == "batch" ? sync_mode::batch : sync_mode::periodic;
+    c.sync_period = std::chrono::milliseconds(cfg.commitlog_sync_period_in_ms());
+    c.batch_window = std::chrono::milliseconds(cfg.commitlog_sync_batch_window_in_ms());
+    c.segment_size = size_t(cfg.commitlog_segment_size_in_mb()) * 1024 * 1024;
+    return c;
+}
+
+commit_log::commit_log(config cfg)
+    : _config(std::move(cfg))
+    , _next_sync(make_lw_shared<shared_promise<>>())
+{
+    _sync_timer.set_callback([this] {
+        if (_dirty) {
+            sync().handle_exception([] (auto ep) {
+                clog.error("failed to sync: {}", ep);
+            });
+        }
+    });
+    setup_metrics();
+}
+
+commit_log::~commit_log()
+{
+}
+
+void commit_log::setup_metrics()
+{
+    namespace sm = seastar::metrics;
+    _metrics.add_group("commitlog", {
+        sm::make_counter("records", [this] { return _stats._records; }, sm::description("Total number of the logged mutations.")),
+        sm::make_counter("bytes", [this] { return _stats._bytes; }, sm::description("Total bytes appended to the log.")),
+        sm::make_counter("syncs", [this] { return _stats._syncs; }, sm::description("Total number of the log syncs.")),
+        sm::make_counter("segments", [this] { return _stats._segments; }, sm::description("Total number of the created segments.")),
+        sm::make_gauge("pending_buffers", [this] { return _full_buffers.size(); }, sm::description("Full buffers waiting to be written.")),
+    });
+}
+
+sstring commit_log::make_segment_name(uint64_t generation, unsigned shard, uint64_t id)
+{
+    return sprint("commitlog-%d-%d-%d.log", generation, shard, id);
+}
+
+bool commit_log::parse_segment_name(const sstring& name, segment_name& parsed)
+{
+    unsigned long long generation = 0, id = 0;
+    unsigned shard = 0;
+    int consumed = 0;
+    if (std::sscanf(name.c_str(), "commitlog-%llu-%u-%llu.log%n", &generation, &shard, &id, &consumed) != 3 || size_t(consumed) != name.size()) {
+        return false;
+    }
+    parsed = segment_name { generation, shard, id };
+    return true;
+}
+
+future<> commit_log::start(uint64_t generation)
+{
+    _generation = generation;
+    _segment = new_segment();
+    _buffer = temporary_buffer<char>::aligned(alignment, buffer_size);
+    std::memset(_buffer.get_write(), 0, _buffer.size());
+    if (_config.mode == sync_mode::periodic) {
+        _sync_timer.arm_periodic(_config.sync_period);
+    }
+    return recursive_touch_directory(_config.directory);
+}
+
+future<> commit_log::stop()
+{
+    _stopped = true;
+    _sync_timer.cancel();
+    return sync().finally([this] {
+        return std::move(_writer);
+    }).then([this] {
+        auto seg = std::move(_written);
+        if (seg && seg->_open) {
+            return seg->_file.close().finally([seg] {});
+        }
+        return make_ready_future<>();
+    });
+}
+
+lw_shared_ptr<commit_log::segment> commit_log::new_segment()
+{
+    auto seg = make_lw_shared<segment>();
+    seg->_id = _next_id++;
+    ++_stats._segments;
+    return seg;
+}
+
+void commit_log::append(const log_arg* args, size_t count)
+{
+    if (_stopped) {
+        return;
+    }
+    auto end = args + count;
+    size_t payload = 1 + digits(count) + 2;
+    for (auto a = args; a != end; ++a) {
+        payload += 1 + digits(a->_size) + 2 + a->_size + 2;
+    }
+    // records are 8 bytes aligned, so a header never straddles the padding at
+    // the end of a block.
+    size_t record = align_up(header_size + payload, size_t(8));
+    if (_buffer_used + record > _buffer.size()) {
+        roll_buffer(record);
+    }
+    auto start = _buffer.get_write() + _buffer_used;
+    auto p = write_bulk_header(start + header_size, '*', count);
+    for (auto a = args; a != end; ++a) {
+        p = write_bulk_header(p, '$', a->_size);
+        std::memcpy(p, a->_data, a->_size);
+        p += a->_size;
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    write_le32(start, payload);
+    write_le32(start + sizeof(uint32_t), checksum(start + header_size, payload));
+    _buffer_used += record;
+    _stats._bytes += record;
+    ++_stats._records;
+    if (!_dirty) {
+        _dirty = true;
+        if (_config.mode == sync_mode::batch) {
+            _sync_timer.arm(_config.batch_window);
+        }
+    }
+}
+
+uint64_t commit_log::cut()
+{
+    if (_buffer_used > 0 || _buffer_position > 0) {
+        roll_buffer(0);
+        if (_buffer_position > 0) {
+            _segment = new_segment();
+            _buffer_position = 0;
+        }
+    }
+    return _segment->_id;
+}
+
+// Hands the current buffer to the writer and starts a new one, in a new segment
+// once the current one is full.
+void commit_log::roll_buffer(size_t needed)
+{
+    if (_buffer_used > 0) {
+        auto size = align_up(_buffer_used, alignment);
+        _buffer.trim(size);
+        _full_buffers.push_back(full_buffer { _segment, _buffer_position, std::move(_buffer) });
+        _buffer_position += size;
+        if (_buffer_position >= _config.segment_size) {
+            _segment = new_segment();
+            _buffer_position = 0;
+        }
+        schedule_write();
+    }
+    auto size = std::max(size_t(buffer_size), align_up(needed, alignment));
+    _buffer = temporary_buffer<char>::aligned(alignment, size);
+    std::memset(_buffer.get_write(), 0, _buffer.size());
+    _buffer_used = 0;
+}
+
+void commit_log::schedule_write()
+{
+    _writer = _writer.then([this] {
+        return with_semaphore(_write_sem, 1, [this] {
+            return write_full_buffers();
+        });
+    }).handle_exception([] (auto ep) {
+        clog.error("failed to write: {}", ep);
+    });
+}
+
+future<> commit_log::write(lw_shared_ptr<segment> seg, uint64_t position, temporary_buffer<char> data)
+{
+    auto prepare = make_ready_future<>();
+    if (_written && _written != seg) {
+        // the writer moved on, the previous segment is complete.
+        auto done = std::move(_written);
+        prepare = done->_file.flush().then([done] {
+            return done->_file.close();
+        }).finally([done] {});
+    }
+    _written = seg;
+    if (!seg->_open) {
+        prepare = prepare.then([this, seg] {
+            auto path = _config.directory + "/" + make_segment_name(_generation, engine().cpu_id(), seg->_id);
+            return open_file_dma(path, open_flags::wo | open_flags::create | open_flags::truncate).then([this, seg] (file f) {
+                seg->_file = std::move(f);
+                seg->_open = true;
+                return seg->_file.allocate(0, _config.segment_size);
+            });
+        });
+    }
+    return prepare.then([seg, position, data = std::move(data)] () mutable {
+        auto p = data.get();
+        auto size = data.size();
+        return seg->_file.dma_write(position, p, size).then([data = std::move(data)] (size_t) {});
+    });
+}
+
+future<> commit_log::write_full_buffers()
+{
+    return do_until([this] { return _full_buffers.empty(); }, [this] {
+        auto b = std::move(_full_buffers.front());
+        _full_buffers.pop_front();
+        return write(std::move(b._segment), b._position, std::move(b._data));
+    });
+}
+
+// Writes everything appended so far and syncs it. The current buffer is written
+// up to its last used block and rewritten once it has more records.
+future<> commit_log::sync()
+{
+    auto done = std::move(_next_sync);
+    _next_sync = make_lw_shared<shared_promise<>>();
+    _running_sync = done;
+    _dirty = false;
+    return with_semaphore(_write_sem, 1, [this] {
+        return write_full_buffers().then([this] {
+            if (_buffer_used == 0) {
+                return make_ready_future<>();
+            }
+            auto size = align_up(_buffer_used, alignment);
+            return write(_segment, _buffer_position, _buffer.share(0, size));
+        }).then([this] {
+            if (!_written) {
+                return make_ready_future<>();
+            }
+            return _written->_file.flush();
+        });
+    }).then_wrapped([this, done] (auto&& f) {
+        ++_stats._syncs;
+        if (_running_sync == done) {
+            _running_sync = nullptr;
+        }
+        try {
+            f.get();
+            done->set_value();
+        } catch (...) {
+            done->set_exception(std::current_exception());
+            throw;
+        }
+    });
+}
+
+future<> commit_log::sync_point()
+{
+    if (_dirty) {
+        return _next_sync->get_shared_future();
+    }
+    if (_running_sync) {
+        return _running_sync->get_shared_future();
+    }
+    return make_ready_future<>();
+}
+
+future<> commit_log::replay_segment(sstring path)
+{
+    struct replay_state {
+        input_stream<char> in;
+        output_stream<char> out;
+        redis_protocol proto;
+        request_latency_tracer tracer;
+        uint64_t position = 0;
+        uint64_t records = 0;
+        bool done = false;
+        explicit replay_state(file f)
+            : in(make_file_input_stream(std::move(f)))
+            , out(data_sink(std::make_unique<null_data_sink>()), 8192)
+            , proto(true)
+        {
+        }
+    };
+    return open_file_dma(path, open_flags::ro).then([path] (file f) {
+        auto state = make_lw_shared<replay_state>(f);
+        return do_until([state] { return state->done; }, [state, path] {
+            return state->in.read_exactly(header_size).then([state, path] (temporary_buffer<char> header) {
+                if (header.size() < header_size) {
+                    state->done = true;
+                    return make_ready_future<>();
+                }
+                auto size = read_le32(header.get());
+                auto crc = read_le32(header.get() + sizeof(uint32_t));
+                if (size == 0) {
+                    // padding up to the next block, or the end of the log.
+                    if (state->position % alignment == 0) {
+                        state->done = true;
+                        return make_ready_future<>();
+                    }
+                    auto next = align_up(state->position, uint64_t(alignment));
+                    auto skip = next - state->position - header_size;
+                    state->position = next;
+                    return state->in.skip(skip);
+                }
+                auto record = align_up(header_size + size, size_t(8));
+                return state->in.read_exactly(record - header_size).then([state, path, size, crc, record] (temporary_buffer<char> data) {
+                    if (data.size() < size || checksum(data.get(), size) != crc) {
+                        // torn write at the tail of the log.
+                        clog.warn("{}: stop replaying at offset {}, the record is incomplete", path, state->position);
+                        state->done = true;
+                        return make_ready_future<>();
+                    }
+                    state->position += record;
+                    ++state->records;
+                    data.trim(size);
+                    return state->proto.handle(std::move(data), state->out, state->tracer).then([state] {
+                        return state->out.flush();
+                    });
+                });
+            });
+        }).then([state, path] {
+            clog.info("{}: replayed {} records", path, state->records);
+            return state->in.close();
+        }).finally([state, f] () mutable {
+            return f.close().finally([f] {});
+        });
+    });
+}
+
+future<std::vector<commit_log::segment_name>> commit_log::list_segments(sstring directory)
+{
+    return recursive_touch_directory(directory).then([directory] {
+        return engine().open_directory(directory);
+    }).then([] (file dir) {
+        auto segments = make_lw_shared<std::vector<segment_name>>();
+        auto listing = make_lw_shared(dir.list_directory([segments] (directory_entry de) {
+            segment_name name;
+            if (parse_segment_name(de.name, name)) {
+                segments->push_back(name);
+            }
+            return make_ready_future<>();
+        }));
+        return listing->done().then([listing, segments] {
+            return std::move(*segments);
+        }).finally([dir] () mutable {
+            return dir.close().finally([dir] {});
+        });
+    });
+}
+
+future<uint64_t> commit_log::replay(sstring directory, replay_position from)
+{
+    return list_segments(directory).then([directory, from = std::move(from)] (std::vector<segment_name> names) {
+        // generation -> segment names
+        std::map<uint64_t, std::vector<segment_name>> segments;
+        for (auto& name : names) {
+            if (!from.covers(name._generation, name._shard, name._id)) {
+                segments[name._generation].push_back(name);
+            }
+        }
+        auto next = std::max(from.generation + 1, names.empty() ? uint64_t(0) : std::max_element(names.begin(), names.end(), [] (auto& l, auto& r) {
+            return l._generation < r._generation;
+        })->_generation + 1);
+        return do_with(std::move(segments), [directory, next] (auto& segments) {
+            return do_for_each(segments, [directory] (auto& generation) {
+                auto& names = generation.second;
+                std::sort(names.begin(), names.end(), [] (auto& l, auto& r) {
+                    return std::tie(l._shard, l._id) < std::tie(r._shard, r._id);
+                });
+                // the segments of a shard of the old run are replayed in order by
+                // one shard; different old shards owned different keys.
+                return smp::invoke_on_all([directory, names] {
+                    return do_for_each(names, [directory] (const segment_name& name) {
+                        if (name._shard % smp::count != engine().cpu_id()) {
+                            return make_ready_future<>();
+                        }
+                        return replay_segment(directory + "/" + make_segment_name(name._generation, name._shard, name._id));
+                    });
+                });
+            }).then([next] {
+                return next;
+            });
+        });
+    });
+}
+
+future<> commit_log::discard(sstring directory, replay_position upto)
+{
+    return list_segments(directory).then([directory, upto = std::move(upto)] (std::vector<segment_name> names) {
+        return do_with(std::move(names), [directory, upto = std::move(upto)] (auto& names) {
+            return do_for_each(names, [directory, &upto] (const segment_name& name) {
+                if (!upto.covers(name._generation, name._shard, name._id)) {
+                    return make_ready_future<>();
+                }
+                return remove_file(directory + "/" + make_segment_name(name._generation, name._shard, name._id));
+            });
+        }).then([directory] {
+            return sync_directory(directory);
+        });
+    });
+}
+}
@@ -0,0 +1,181 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/file.hh"
+#include "core/future.hh"
+#include "core/semaphore.hh"
+#include "core/shared_future.hh"
+#include "core/sstring.hh"
+#include "core/temporary_buffer.hh"
+#include "core/timer.hh"
+#include "core/metrics_registration.hh"
+#include "common.hh"
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+namespace redis {
+
+class config;
+
+// One argument of a logged mutation.
+struct log_arg {
+    const char* _data;
+    size_t _size;
+    log_arg(const sstring& s) : _data(s.data()), _size(s.size()) {}
+    log_arg(const temporary_buffer<char>& b) : _data(b.get()), _size(b.size()) {}
+    log_arg(const redis_key& rk) : _data(rk.data()), _size(rk.size()) {}
+    log_arg(const char* s) : _data(s), _size(std::strlen(s)) {}
+    log_arg(const char* data, size_t size) : _data(data), _size(size) {}
+};
+
+// Where the replay of the log starts, after a snapshot was loaded: the segments
+// of older generations, and the ones of the same generation with an id below the
+// first one of their shard, are covered by the snapshot.
+struct replay_position {
+    uint64_t generation = 0;
+    std::vector<uint64_t> first_segments;
+    bool covers(uint64_t generation_, unsigned shard, uint64_t id) const {
+        if (generation_ != generation) {
+            return generation_ < generation;
+        }
+        return shard < first_segments.size() && id < first_segments[shard];
+    }
+};
+
+// The append-only log of the mutations applied by a shard.
+//
+// Every mutation is logged as the RESP request which reproduces it, framed by
+// its size and crc32, into preallocated segments written with DMA. Appending
+// only copies the record into the current buffer, a background writer writes
+// the full buffers. In periodic mode the log is synced every sync period and
+// mutations are acknowledged at once; in batch mode the mutations which arrive
+// within a batch window share one sync and are acknowledged after it.
+//
+// Segments are named by generation, shard and id; every start opens a new
+// generation. At startup the generations are replayed in order, the segments of
+// a generation in parallel on all shards, and their requests are executed as if
+// they came from a client. So the mutations of a key, which are all logged by
+// its owner shard, are replayed in order even if the number of shards changed.
+class commit_log {
+public:
+    enum class sync_mode {
+        periodic,
+        batch,
+    };
+    struct config {
+        sstring directory;
+        sync_mode mode = sync_mode::periodic;
+        std::chrono::milliseconds sync_period { 10000 };
+        std::chrono::milliseconds batch_window { 2 };
+        size_t segment_size = 32 * 1024 * 1024;
+    };
+    static config make_config(const redis::config& cfg);
+
+    explicit commit_log(config cfg);
+    ~commit_log();
+
+    future<> start(uint64_t generation);
+    future<> stop();
+
+    void append(const log_arg* args, size_t count);
+    inline void append(std::initializer_list<log_arg> args) { append(args.begin(), args.size()); }
+    inline void append(const std::vector<log_arg>& args) { append(args.data(), args.size()); }
+
+    // Resolves once everything appended so far is on disk. Only needed in batch mode.
+    future<> sync_point();
+    inline bool batch_mode() const { return _config.mode == sync_mode::batch; }
+
+    // Moves on to a new segment and returns its id: the mutations appended before
+    // are all in the previous segments.
+    uint64_t cut();
+    inline uint64_t generation() const { return _generation; }
+
+    // Replays the segments in the directory which are not covered by the position,
+    // returns the generation which the new segments should use.
+    static future<uint64_t> replay(sstring directory, replay_position from);
+    // Removes the segments covered by the position.
+    static future<> discard(sstring directory, replay_position upto);
+private:
+    static constexpr size_t buffer_size = 128 * 1024;
+    static constexpr size_t alignment = 4096;
+    static constexpr size_t header_size = 2 * sizeof(uint32_t);
+
+    struct segment {
+        uint64_t _id;
+        file _file;
+        bool _open = false;
+    };
+    struct stats {
+        uint64_t _records = 0;
+        uint64_t _bytes = 0;
+        uint64_t _syncs = 0;
+        uint64_t _segments = 0;
+    };
+
+    config _config;
+    uint64_t _generation = 0;
+    uint64_t _next_id = 0;
+    lw_shared_ptr<segment> _segment;
+    // the segment the writer wrote last, it is closed when the writer moves on.
+    lw_shared_ptr<segment> _written;
+    // where _buffer starts in the current segment.
+    uint64_t _buffer_position = 0;
+    temporary_buffer<char> _buffer;
+    size_t _buffer_used = 0;
+    // full buffers which are waiting for the writer.
+    struct full_buffer {
+        lw_shared_ptr<segment> _segment;
+        uint64_t _position;
+        temporary_buffer<char> _data;
+    };
+    std::deque<full_buffer> _full_buffers;
+    semaphore _write_sem { 1 };
+    future<> _writer = make_ready_future<>();
+    bool _dirty = false;
+    bool _stopped = false;
+    timer<> _sync_timer;
+    // resolved by the next sync, and by the sync in progress.
+    lw_shared_ptr<shared_promise<>> _next_sync;
+    lw_shared_ptr<shared_promise<>> _running_sync;
+    stats _stats;
+    seastar::metrics::metric_groups _metrics;
+
+    struct segment_name {
+        uint64_t _generation;
+        unsigned _shard;
+        uint64_t _id;
+    };
+    static sstring make_segment_name(uint64_t generation, unsigned shard, uint64_t id);
+    static bool parse_segment_name(const sstring& name, segment_name& parsed);
+    static future<std::vector<segment_name>> list_segments(sstring directory);
+    static future<> replay_segment(sstring path);
+
+    lw_shared_ptr<segment> new_segment();
+    void roll_buffer(size_t needed);
+    void schedule_write();
+    future<> write(lw_shared_ptr<segment> seg, uint64_t position, temporary_buffer<char> data);
+    future<> write_full_buffers();
+    future<> sync();
+    void setup_metrics();
+};
+}
@@ -24,4 +24,100 @@
  *
  */
 #include "common.hh"
-namespace redis { }
+namespace redis {
+
+// Matches the class which starts after the '[' at p against c, moves p past its ']'.
+static bool match_class(const char*& p, const char* end, char c)
+{
+    bool negate = p < end && *p == '^';
+    if (negate) {
+        ++p;
+    }
+    bool matched = false;
+    for (; p < end && *p != ']'; ++p) {
+        if (*p == '\\' && p + 1 < end) {
+            ++p;
+            matched |= *p == c;
+        }
+        else if (p + 2 < end && p[1] == '-' && p[2] != ']') {
+            auto lo = static_cast<unsigned char>(p[0]);
+            auto hi = static_cast<unsigned char>(p[2]);
+            if (lo > hi) {
+                std::swap(lo, hi);
+            }
+            auto u = static_cast<unsigned char>(c);
+            matched |= u >= lo && u <= hi;
+            p += 2;
+        }
+        else {
+            matched |= *p == c;
+        }
+    }
+    if (p < end) {
+        ++p;
+    }
+    return matched != negate;
+}
+
+// Backtracks to the last '*' only, so a pattern with many of them stays linear
+// in the size of the string for every star, unlike a recursive matcher.
+bool string_match(const char* pattern, size_t pattern_size, const char* s, size_t size)
+{
+    const char* p = pattern;
+    const char* pend = pattern + pattern_size;
+    const char* send = s + size;
+    const char* star = nullptr;
+    const char* resume = nullptr;
+    while (s < send) {
+        if (p < pend && *p == '*') {
+            while (p < pend && *p == '*') {
+                ++p;
+            }
+            if (p == pend) {
+                return true;
+            }
+            star = p;
+            resume = s;
+            continue;
+        }
+        if (p < pend) {
+            auto next = p;
+            bool matched;
+            switch (*p) {
+                case '?':
+                    matched = true;
+                    ++next;
+                    break;
+                case '[':
+                    ++next;
+                    matched = match_class(next, pend, *s);
+                    break;
+                case '\\':
+                    if (p + 1 < pend) {
+                        ++next;
+                    }
+                    // fall through
+                default:
+                    matched = *next == *s;
+                    ++next;
+                    break;
+            }
+            if (matched) {
+                p = next;
+                ++s;
+                continue;
+            }
+        }
+        if (star == nullptr) {
+            return false;
+        }
+        // let the last star take one more byte.
+        p = star;
+        s = ++resume;
+    }
+    while (p < pend && *p == '*') {
+        ++p;
+    }
+    return p == pend;
+}
+}
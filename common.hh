@@ -24,6 +24,7 @@
  *
  */
 #pragma once
+#include <chrono>
 #include <iomanip>
 #include <sstream>
 #include <functional>
@@ -42,6 +43,7 @@
 #include "core/align.hh"
 #include "net/api.hh"
 #include "net/packet-data-source.hh"
+#include "key_hash.hh"
 #include <unistd.h>
 #include  <experimental/vector>
 namespace stdx = std::experimental;
@@ -73,6 +75,10 @@ enum {
 struct args_collection {
     uint32_t _command_args_count;
     std::vector<sstring> _command_args;
+    // The arguments as parsed, shares of the received data where possible. The
+    // values which are stored as they are, see redis_protocol::by_view(), are only
+    // here and left empty in _command_args, so they are copied once, into the cache.
+    std::vector<temporary_buffer<char>> _command_views;
     std::vector<sstring> _tmp_keys;
     std::unordered_map<sstring, sstring> _tmp_key_values;
     std::unordered_map<sstring, double> _tmp_key_scores;
@@ -88,7 +94,7 @@ class db;
 struct redis_key {
     sstring& _key;
     size_t  _hash;
-    redis_key(sstring& key) : _key(key), _hash(std::hash<sstring>()(_key)) {}
+    redis_key(sstring& key) : _key(key), _hash(hash_key(_key.data(), _key.size())) {}
     redis_key& operator = (const redis_key& o) {
         if (this != &o) {
             _key = o._key;
@@ -96,12 +102,22 @@ struct redis_key {
         }
         return *this;
     }
-    inline unsigned get_cpu() const { return _hash % smp::count; }
+    inline unsigned get_cpu() const { return shard_of(_hash, smp::count); }
     inline const size_t hash() const { return _hash; }
     inline const sstring& key() const { return _key; }
     inline const size_t size() const { return _key.size(); }
     inline const char* data() const { return _key.c_str(); }
 };
+
+// The keys of a multi-key request which are owned by one shard, they are sent
+// to the shard in one message.
+struct key_batch {
+    std::vector<redis_key> keys;
+    // the position of every key in the request.
+    std::vector<size_t> positions;
+    // the values of MSET, in the order of the keys.
+    std::vector<const temporary_buffer<char>*> values;
+};
 // The defination of `item was copied from apps/memcached
 static const sstring msg_crlf {"\r\n"};
 static const sstring msg_ok {"+OK\r\n"};
@@ -119,6 +135,12 @@ static const sstring msg_nokey_err = {"-ERR no such key\r\n"};
 static const sstring msg_syntax_err = {"-ERR syntax error\r\n"};
 static const sstring msg_same_object_err = {"-ERR source and destination objects are the same\r\n"};
 static const sstring msg_out_of_range_err = {"-ERR index out of range\r\n"};
+static const sstring msg_bit_offset_err = {"-ERR bit offset is not an integer or out of range\r\n"};
+static const sstring msg_value_err = {"-ERR value is not an integer or out of range\r\n"};
+static const sstring msg_geo_position_err = {"-ERR invalid longitude,latitude pair\r\n"};
+static const sstring msg_geo_member_err = {"-ERR could not decode requested zset member\r\n"};
+static const sstring msg_invalid_cursor_err = {"-ERR invalid cursor\r\n"};
+static const sstring msg_forward_err = {"-ERR the node owning the key is unreachable\r\n"};
 static const sstring msg_not_integer_err = {"-ERR ERR hash value is not an integer\r\n" };
 static const sstring msg_not_float_err = {"-ERR ERR hash value is not an float\r\n" };
 static const sstring msg_str_tag = {"+"};
@@ -127,6 +149,9 @@ static const sstring msg_sigle_tag = {"*"};
 static const sstring msg_batch_tag = {"$"};
 static const sstring msg_not_found = {"+(nil)\r\n"};
 static const sstring msg_nil = {"+(nil)\r\n"};
+static const sstring msg_bgsave_started = {"+Background saving started\r\n"};
+static const sstring msg_oom_err = {"-OOM command not allowed when used memory > 'maxmemory'.\r\n"};
+static const sstring msg_snapshot_in_progress = {"-ERR Background save already in progress\r\n"};
 static constexpr const int REDIS_OK = 0;
 static constexpr const int REDIS_ERR = 1;
 static constexpr const int REDIS_NONE = -1;
@@ -193,4 +218,21 @@ static constexpr const int GEO_UNIT_MI     = (1 << 11);
 static constexpr const int GEO_UNIT_FT     = (1 << 12);
 
 static constexpr const size_t BITMAP_MAX_OFFSET  = (1 << 31);
+
+// The COUNT of SCAN and of the other cursor commands if none is given; a call
+// visits at most SCAN_BUCKETS_PER_COUNT times COUNT buckets.
+static constexpr const size_t SCAN_COUNT_DEFAULT = 10;
+static constexpr const size_t SCAN_BUCKETS_PER_COUNT = 10;
+
+// Matches the string against a glob style pattern, as Redis's stringmatchlen():
+// * and ? wildcards, [abc], [^abc] and [a-z] classes, and \ escapes.
+bool string_match(const char* pattern, size_t pattern_size, const char* s, size_t size);
+
+// The wall clock in unix milliseconds, which the absolute expiries are given in:
+// the ones of PEXPIREAT and SET PXAT, of the snapshots and of the commit log.
+inline int64_t unix_time_ms()
+{
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
 } /* namespace redis */
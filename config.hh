@@ -333,6 +333,22 @@ public:
     val(abort_on_lsa_bad_alloc, bool, false, Used, "Abort when allocation in LSA region fails") \
     val(murmur3_partitioner_ignore_msb_bits, unsigned, 0, Used, "Number of most siginificant token bits to ignore in murmur3 partitioner; increase for very large clusters") \
     val(virtual_dirty_soft_limit, double, 0.6, Used, "Soft limit of virtual dirty memory expressed as a portion of the hard limit") \
+    val(hash_max_packed_entries, uint32_t, 128, Used, "A hash is stored in the compact packed encoding while it has no more fields than this, and is converted to a hash table past it.") \
+    val(hash_max_packed_value, uint32_t, 64, Used, "A hash is stored in the compact packed encoding while none of its fields and values is longer than this, in bytes (at most 255).") \
+    val(set_max_packed_entries, uint32_t, 128, Used, "A set is stored in the compact packed encoding while it has no more members than this, and is converted to a hash table past it.") \
+    val(set_max_packed_value, uint32_t, 64, Used, "A set is stored in the compact packed encoding while none of its members is longer than this, in bytes (at most 255).") \
+    val(hll_sparse_max_bytes, uint32_t, 3000, Used, "A HyperLogLog is stored in the sparse encoding while it takes no more than this, in bytes, and is converted to the dense encoding of 12KB past it.") \
+    val(snapshot_period_in_s, uint32_t, 3600, Used, "Takes a snapshot of all shards into the first data file directory every this many seconds, and truncates the commit log it covers. 0 disables the periodic snapshots, SAVE and BGSAVE still take them.") \
+    val(maxmemory_per_shard_in_mb, uint32_t, 0, Used, "The memory every shard may use for its keys, in MB. Past it the shard evicts keys as maxmemory_policy says, or rejects the writes. 0 means no limit.") \
+    val(maxmemory_policy, sstring, "noeviction", Used, "What is evicted once a shard uses more than maxmemory_per_shard_in_mb:\n" \
+            "\tnoeviction : nothing, the writes are rejected until memory is freed.\n" \
+            "\tallkeys-lru : the least recently used keys.\n" \
+            "\tallkeys-lfu : the least frequently used keys.\n" \
+            "\tvolatile-ttl : the keys with a timeout which expire first.") \
+    val(maxmemory_samples, uint32_t, 5, Used, "The number of keys sampled to pick one to evict. More samples approximate the policy better and cost more.") \
+    val(slowlog_log_slower_than_in_us, int64_t, 10000, Used, "Commands which take at least this many microseconds, until their reply is written, are kept in the slowlog of their shard. A negative value disables the slowlog, 0 logs every command.") \
+    val(slowlog_max_len, uint32_t, 128, Used, "The number of commands the slowlog of a shard keeps, the oldest are dropped.") \
+    val(latency_monitor_threshold_in_ms, uint32_t, 10, Used, "Reactor stalls, rehash and expiry pauses and commands which take at least this many milliseconds are recorded by the latency monitor. 0 disables it.") \
     /* done! */
 
 #define _make_value_member(name, type, deflt, status, desc, ...)    \
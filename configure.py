@@ -170,6 +170,27 @@ modes = {
 
 tests = [
     'tests/cache_test',
+    'tests/bitmap_test',
+    'tests/geo_test',
+    'tests/cluster_test',
+    'tests/sset_test',
+    'tests/rank_tree_test',
+    'tests/hll_test',
+    'tests/parser_test',
+    'tests/reply_test',
+    'tests/slowlog_test',
+    'tests/key_hash_test',
+    'tests/commitlog_test',
+    'tests/snapshot_test',
+    'tests/commands_test',
+    'tests/perf/perf_sset',
+    'tests/perf/perf_key_hash',
+    'tests/perf/perf_reply',
+    'tests/perf/perf_bits',
+    'tests/perf/perf_hll',
+    'tests/perf/perf_bitmap',
+    'tests/perf/perf_geo',
+    'tests/perf/perf_commitlog',
     ]
 
 apps = [
@@ -324,6 +345,7 @@ gms = [
         ]
 idls = [
         'idl/gossip_digest.idl.hh',
+        'idl/internal_message.idl.hh',
        ]
 boost_test_lib = [
    'seastar/tests/test-utils.cc',
@@ -401,6 +423,7 @@ deps = {
       'geo.cc',
       'hll.cc',
       'bits_operation.cc',
+      'bitmap_lsa.cc',
       'list_lsa.cc',
       'cache.cc',
       'reply_builder.cc',
@@ -408,14 +431,58 @@ deps = {
       'storage_proxy.cc',
       'storage_service.cc',
       'config.cc',
+      'commitlog.cc',
+      'snapshot.cc',
+      'slowlog.cc',
       'init.cc',
       'main.cc',
       ] + libnet + core + http + utils + protobuf + prometheus + idls + exceptions + gms + msic + message,
-      'tests/cache_test': ['tests/cache_test.cc'] + core + utils,
+      'tests/cache_test': ['tests/cache_test.cc', 'dict_lsa.cc'] + core + utils,
+      'tests/bitmap_test': ['tests/bitmap_test.cc', 'bitmap_lsa.cc', 'bits_operation.cc'] + core + utils,
+      'tests/geo_test': ['tests/geo_test.cc', 'geo.cc'] + core + utils,
+      'tests/sset_test': ['tests/sset_test.cc'] + core + utils,
+      'tests/rank_tree_test': ['tests/rank_tree_test.cc'] + core + utils,
+      'tests/hll_test': ['tests/hll_test.cc', 'hll.cc'] + core + utils,
+      'tests/parser_test': ['tests/parser_test.cc', 'redis_protocol_parser.rl'] + core,
+      'tests/reply_test': ['tests/reply_test.cc'] + core,
+      'tests/slowlog_test': ['tests/slowlog_test.cc', 'slowlog.cc'] + core,
+      'tests/key_hash_test': ['tests/key_hash_test.cc'] + core,
+      # the whole server but its main().
+      'tests/cluster_test': ['tests/cluster_test.cc'],
+      'tests/commitlog_test': ['tests/commitlog_test.cc'],
+      'tests/snapshot_test': ['tests/snapshot_test.cc'],
+      'tests/commands_test': ['tests/commands_test.cc'],
+      'tests/perf/perf_sset': ['tests/perf/perf_sset.cc'] + core + utils,
+      'tests/perf/perf_key_hash': ['tests/perf/perf_key_hash.cc'] + core + utils,
+      'tests/perf/perf_reply': ['tests/perf/perf_reply.cc', 'dict_lsa.cc', 'geo.cc'] + core + utils,
+      'tests/perf/perf_bits': ['tests/perf/perf_bits.cc', 'bits_operation.cc'] + core + utils,
+      'tests/perf/perf_hll': ['tests/perf/perf_hll.cc', 'hll.cc'] + core + utils,
+      'tests/perf/perf_bitmap': ['tests/perf/perf_bitmap.cc', 'bitmap_lsa.cc', 'bits_operation.cc'] + core + utils,
+      'tests/perf/perf_geo': ['tests/perf/perf_geo.cc', 'geo.cc'] + core,
+      'tests/perf/perf_commitlog': ['tests/perf/perf_commitlog.cc'],
 }
 
+deps['tests/cluster_test'] += [src for src in deps['pedis'] if src != 'main.cc']
+deps['tests/commitlog_test'] += [src for src in deps['pedis'] if src != 'main.cc']
+deps['tests/snapshot_test'] += [src for src in deps['pedis'] if src != 'main.cc']
+deps['tests/commands_test'] += [src for src in deps['pedis'] if src != 'main.cc']
+deps['tests/perf/perf_commitlog'] += [src for src in deps['pedis'] if src != 'main.cc']
+
 boost_tests = [
     'tests/cache_test',
+    'tests/bitmap_test',
+    'tests/geo_test',
+    'tests/cluster_test',
+    'tests/sset_test',
+    'tests/rank_tree_test',
+    'tests/hll_test',
+    'tests/parser_test',
+    'tests/reply_test',
+    'tests/slowlog_test',
+    'tests/key_hash_test',
+    'tests/commitlog_test',
+    'tests/snapshot_test',
+    'tests/commands_test',
     ]
 
 for bt in boost_tests:
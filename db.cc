@@ -22,10 +22,15 @@
 #include <random>
 #include <chrono>
 #include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include "util/log.hh"
 #include "bits_operation.hh"
 #include "core/metrics.hh"
 #include "hll.hh"
+#include "snapshot.hh"
+#include "core/fstream.hh"
+#include "core/reactor.hh"
 
 using logger =  seastar::logger;
 static logger db_log ("db");
@@ -63,44 +68,68 @@ private:
 
 distributed<database> _the_database;
 
-database::database()
+static eviction_policy parse_eviction_policy(const sstring& name)
+{
+    if (name == "allkeys-lru") {
+        return eviction_policy::allkeys_lru;
+    }
+    else if (name == "allkeys-lfu") {
+        return eviction_policy::allkeys_lfu;
+    }
+    else if (name == "volatile-ttl") {
+        return eviction_policy::volatile_ttl;
+    }
+    else if (name != "noeviction") {
+        db_log.warn("unknown maxmemory_policy {}, using noeviction", name);
+    }
+    return eviction_policy::noeviction;
+}
+
+// Expiries are logged as deadlines in unix milliseconds, so that they do not move
+// however late the log is replayed.
+static sstring log_deadline(int64_t ttl)
+{
+    return to_sstring(unix_time_ms() + ttl);
+}
+
+database::database(const redis::config& cfg)
+    : _config(std::make_unique<redis::config>(cfg))
+    , _slowlog(cfg.slowlog_log_slower_than_in_us(), cfg.slowlog_max_len())
+    , _latency_monitor(cfg.latency_monitor_threshold_in_ms())
 {
     using namespace std::chrono;
 
+    hash_packed_limits.max_entries = _config->hash_max_packed_entries();
+    hash_packed_limits.max_value = _config->hash_max_packed_value();
+    set_packed_limits.max_entries = _config->set_max_packed_entries();
+    set_packed_limits.max_value = _config->set_max_packed_value();
+    _hll_sparse_max_bytes = _config->hll_sparse_max_bytes();
+
+    _maxmemory = static_cast<size_t>(_config->maxmemory_per_shard_in_mb()) << 20;
+    _eviction_policy = parse_eviction_policy(_config->maxmemory_policy());
     for (size_t i = 0; i < DEFAULT_DB_COUNT; ++i) {
         auto& store = _cache_stores[i];
+        store.set_eviction_policy(_eviction_policy, _config->maxmemory_samples());
+        if (_maxmemory > 0) {
+            store.set_memory_guard([this] { enforce_maxmemory(); });
+        }
+        store.set_pause_observer([this] (const char* event, std::chrono::steady_clock::duration d) {
+            _latency_monitor.record(event, d);
+        });
         _cache_stores[i].set_expired_entry_releaser([this, &store] (cache_entry& e) {
-             with_allocator(allocator(), [this, &store, &e] {
-                 auto type = e.type();
-                 if (store.erase(e)) {
-                     switch (type) {
-                         case entry_type::ENTRY_FLOAT:
-                         case entry_type::ENTRY_INT64:
-                             --_stat._total_counter_entries;
-                             break;
-                         case entry_type::ENTRY_BYTES:
-                             --_stat._total_string_entries;
-                             break;
-                         case entry_type::ENTRY_LIST:
-                             --_stat._total_list_entries;
-                             break;
-                         case entry_type::ENTRY_MAP:
-                             --_stat._total_bitmap_entries;
-                             break;
-                         case entry_type::ENTRY_SET:
-                             --_stat._total_set_entries;
-                             break;
-                         case entry_type::ENTRY_SSET:
-                             --_stat._total_zset_entries;
-                             break;
-                         case entry_type::ENTRY_HLL:
-                             --_stat._total_hll_entries;
-                             break;
-                     }
-                 }
-             });
+            with_allocator(allocator(), [this, &store, &e] {
+                decrease_entries_counter(e);
+                log_mutation({ "DEL", log_arg(e.key_data(), e.key_size()) });
+                store.erase(e);
+            });
         });
     }
+    if (_eviction_policy != eviction_policy::noeviction) {
+        // the LSA evicts through reclaim() when the shard runs short of memory.
+        _reclaimed_keys.reserve(reclaimed_keys_capacity);
+        _reclaimed_keys_timer.set_callback([this] { log_reclaimed_keys(); });
+        make_evictable([this] { return reclaim(); });
+    }
     setup_metrics();
 }
 
@@ -111,6 +140,7 @@ database::~database()
             db_log.info("total {} entries were released in cache [{}]", _cache_stores[i].size(), i);
             _cache_stores[i].flush_all();
         }
+        _zstore_staging.clear();
     });
 }
 
@@ -123,6 +153,15 @@ size_t database::sum_expiring_entries()
     return sum;
 }
 
+uint64_t database::max_rehash_stall()
+{
+    uint64_t max = 0;
+    for (size_t i = 0; i < DEFAULT_DB_COUNT; ++i) {
+        max = std::max(max, _cache_stores[i].rehash_statistics()._max_stall_us);
+    }
+    return max;
+}
+
 void database::setup_metrics()
 {
     namespace sm = seastar::metrics;
@@ -136,7 +175,40 @@ void database::setup_metrics()
         sm::make_counter("total_set_entries", [this] { return _stat._total_set_entries; }, sm::description("Total of set entries.")),
         sm::make_counter("total_sorted_set_entries", [this] { return _stat._total_zset_entries; }, sm::description("Total of sorted set entries.")),
         sm::make_counter("total_hll_entries", [this] { return _stat._total_hll_entries; }, sm::description("Total of hyperloglog entries.")),
+        sm::make_counter("total_bitmap_entries", [this] { return _stat._total_bitmap_entries; }, sm::description("Total of compressed bitmap entries.")),
         sm::make_counter("total_expiring_entries", [this] { return sum_expiring_entries(); }, sm::description("Total of expiring entries.")),
+        sm::make_gauge("rehashing", [this] { return sum_stores([] (const cache& c) -> uint64_t { return c.rehashing() ? 1 : 0; }); }, sm::description("Number of the stores which are being rehashed.")),
+        sm::make_gauge("rehash_pending_entries", [this] { return sum_stores([] (const cache& c) -> uint64_t { return c.rehash_pending(); }); }, sm::description("Entries which are still in the old bucket arrays.")),
+        sm::make_gauge("bucket_count", [this] { return sum_stores([] (const cache& c) -> uint64_t { return c.bucket_count(); }); }, sm::description("Total of allocated buckets.")),
+        sm::make_counter("rehash_started", [this] { return sum_stores([] (const cache& c) { return c.rehash_statistics()._started; }); }, sm::description("Total number of the started rehashes.")),
+        sm::make_counter("rehash_completed", [this] { return sum_stores([] (const cache& c) { return c.rehash_statistics()._completed; }); }, sm::description("Total number of the completed rehashes.")),
+        sm::make_counter("rehash_background_steps", [this] { return sum_stores([] (const cache& c) { return c.rehash_statistics()._background_steps; }); }, sm::description("Total number of the rehash steps run by the background timer.")),
+        sm::make_counter("rehash_stall_us", [this] { return sum_stores([] (const cache& c) { return c.rehash_statistics()._stall_us; }); }, sm::description("Total time in microseconds spent in rehash outside of the mutations.")),
+        sm::make_counter("batch_messages", [this] { return _stat._batch_messages; }, sm::description("Total number of the multi-key messages received from the other shards.")),
+        sm::make_counter("batch_keys", [this] { return _stat._batch_keys; }, sm::description("Total number of the keys carried by the multi-key messages.")),
+        sm::make_counter("snapshot_entries", [this] { return _stat._snapshot_entries; }, sm::description("Total number of the entries written to snapshots.")),
+        sm::make_counter("snapshot_bytes", [this] { return _stat._snapshot_bytes; }, sm::description("Total bytes written to snapshots.")),
+        sm::make_counter("restored_entries", [this] { return _stat._restored_entries; }, sm::description("Total number of the entries restored from snapshots.")),
+        sm::make_gauge("batch_ratio", [this] { return _stat._batch_messages ? static_cast<double>(_stat._batch_keys) / _stat._batch_messages : 0.0; }, sm::description("Average number of the keys per multi-key message.")),
+        sm::make_gauge("rehash_max_stall_us", [this] { return max_rehash_stall(); }, sm::description("The longest rehash stall in microseconds.")),
+        sm::make_gauge("expired_backlog", [this] { return sum_stores([] (const cache& c) -> uint64_t { return c.expired_backlog(); }); }, sm::description("Expired entries which were not released yet.")),
+        sm::make_counter("expired_active", [this] { return sum_stores([] (const cache& c) { return c.expire_statistics()._active; }); }, sm::description("Total number of the expired entries released by the active expiry.")),
+        sm::make_counter("expired_lazy", [this] { return sum_stores([] (const cache& c) { return c.expire_statistics()._lazy; }); }, sm::description("Total number of the expired entries released when they were accessed.")),
+        sm::make_counter("expire_cycles", [this] { return sum_stores([] (const cache& c) { return c.expire_statistics()._cycles; }); }, sm::description("Total number of the active expiry cycles.")),
+        sm::make_counter("expire_stall_us", [this] { return sum_stores([] (const cache& c) { return c.expire_statistics()._stall_us; }); }, sm::description("Total time in microseconds spent in the active expiry cycles.")),
+        sm::make_gauge("used_memory", [this] { return used_memory(); }, sm::description("Memory used by the keys, in bytes.")),
+        sm::make_gauge("maxmemory", [this] { return _maxmemory; }, sm::description("The maxmemory of the shard in bytes, 0 means no limit.")),
+        sm::make_counter("evicted_keys", [this] { return _stat._evicted_keys; }, sm::description("Total number of the keys evicted by the maxmemory policy.")),
+        sm::make_counter("reclaim_evictions", [this] { return _stat._reclaim_evictions; }, sm::description("Keys among the evicted ones which were evicted by the LSA reclaimer.")),
+        sm::make_counter("oom_rejections", [this] { return _stat._oom_rejections; }, sm::description("Total number of the writes rejected because a shard was out of memory.")),
+        sm::make_gauge("out_of_memory", [this] { return _shard_out_of_memory ? 1 : 0; }, sm::description("Whether the shard is above its maxmemory and cannot evict.")),
+    });
+
+    _metrics.add_group("stages", {
+        sm::make_histogram("hop_latency", sm::description("Time a request from another shard waited to reach this one (us)."), [this] { return _hop_latency.to_metrics(); }),
+        sm::make_histogram("execute_latency", sm::description("Time the operations ran on this shard (us)."), [this] { return _execute_latency.to_metrics(); }),
+        sm::make_gauge("hop_latency_p99", [this] { return _hop_latency.quantile(0.99) / 1000.0; }, sm::description("99th percentile of the hop latency (us).")),
+        sm::make_gauge("execute_latency_p99", [this] { return _execute_latency.quantile(0.99) / 1000.0; }, sm::description("99th percentile of the execute latency (us).")),
     });
 
     _metrics.add_group("op", {
@@ -172,7 +244,9 @@ void database::setup_metrics()
         sm::make_counter("hgetall", [this] { return _stat._hgetall; }, sm::description("HGETALL")),
         sm::make_counter("hgetallkeys", [this] { return _stat._hgetall_keys; }, sm::description("HGETALLKEYS")),
         sm::make_counter("hgetallvalues", [this] { return _stat._hgetall_values; }, sm::description("HGETALLVALUES")),
+        sm::make_counter("hrandfield", [this] { return _stat._hrandfield; }, sm::description("HRANDFIELD")),
         sm::make_counter("hmget", [this] { return _stat._hmget; }, sm::description("HMGET")),
+        sm::make_counter("hscan", [this] { return _stat._hscan; }, sm::description("HSCAN")),
         sm::make_counter("smembers", [this] { return _stat._smembers; }, sm::description("SMEMBERS")),
         sm::make_counter("sadd", [this] { return _stat._sadd; }, sm::description("SADD")),
         sm::make_counter("scard", [this] { return _stat._scard; }, sm::description("SCARD")),
@@ -187,7 +261,9 @@ void database::setup_metrics()
         sm::make_counter("smove", [this] { return _stat._smove; }, sm::description("SMOVE")),
         sm::make_counter("srandmember", [this] { return _stat._srandmember; }, sm::description("SRANDMEMBER")),
         sm::make_counter("spop", [this] { return _stat._spop; }, sm::description("SPOP")),
+        sm::make_counter("sscan", [this] { return _stat._sscan; }, sm::description("SSCAN")),
         sm::make_counter("type", [this] { return _stat._type; }, sm::description("TYPE")),
+        sm::make_counter("scan", [this] { return _stat._scan; }, sm::description("SCAN")),
         sm::make_counter("expire", [this] { return _stat._expire; }, sm::description("EXPIRE")),
         sm::make_counter("pexpire", [this] { return _stat._pexpire; }, sm::description("PEXPIRE")),
         sm::make_counter("ttl", [this] { return _stat._ttl; }, sm::description("TTL")),
@@ -212,12 +288,14 @@ void database::setup_metrics()
         sm::make_counter("zinter", [this] { return _stat._zinter; }, sm::description("ZINTER")),
         sm::make_counter("zrangebylex", [this] { return _stat._zrangebylex; }, sm::description("ZRANGEBYLEX")),
         sm::make_counter("zlexcount", [this] { return _stat._zlexcount; }, sm::description("ZLEXCOUNT")),
+        sm::make_counter("zscan", [this] { return _stat._zscan; }, sm::description("ZSCAN")),
         sm::make_counter("select", [this] { return _stat._select; }, sm::description("SELECT")),
         sm::make_counter("geoadd", [this] { return _stat._geoadd; }, sm::description("GEOADD")),
         sm::make_counter("geodist", [this] { return _stat._geodist; }, sm::description("GEODIST")),
         sm::make_counter("geohash", [this] { return _stat._geohash; }, sm::description("GEOHASH")),
         sm::make_counter("geopos", [this] { return _stat._geopos; }, sm::description("GEOPOS")),
         sm::make_counter("georadius", [this] { return _stat._georadius; }, sm::description("GEORADIUS")),
+        sm::make_counter("geosearch", [this] { return _stat._geosearch; }, sm::description("GEOSEARCH")),
         sm::make_counter("setbit", [this] { return _stat._setbit; }, sm::description("SETBIT")),
         sm::make_counter("getbit", [this] { return _stat._getbit; }, sm::description("GETBIT")),
         sm::make_counter("bitcount", [this] { return _stat._bitcount; }, sm::description("BITCOUNT")),
@@ -230,7 +308,7 @@ void database::setup_metrics()
      });
 }
 
-bool database::set_direct(const redis_key& rk, sstring& val, long expired, uint32_t flag)
+bool database::set_direct(const redis_key& rk, const temporary_buffer<char>& val, long expired, uint32_t flag)
 {
     ++_stat._set;
     return with_allocator(allocator(), [this, &rk, &val, expired, flag] {
@@ -238,6 +316,13 @@ bool database::set_direct(const redis_key& rk, sstring& val, long expired, uint3
         bool result = true;
         if (current_store().insert_if(entry, expired, flag & FLAG_SET_NX, flag & FLAG_SET_XX)) {
             ++_stat._total_string_entries;
+            if (expired > 0) {
+                auto at = log_deadline(expired);
+                log_mutation({ "SET", rk, val, "PXAT", at });
+            }
+            else {
+                log_mutation({ "SET", rk, val });
+            }
         }
         else {
             result = false;
@@ -247,7 +332,7 @@ bool database::set_direct(const redis_key& rk, sstring& val, long expired, uint3
     });
 }
 
-future<scattered_message_ptr> database::set(const redis_key& rk, sstring& val, long expired, uint32_t flag)
+future<scattered_message_ptr> database::set(const redis_key& rk, const temporary_buffer<char>& val, long expired, uint32_t flag)
 {
     ++_stat._set;
     return with_allocator(allocator(), [this, &rk, &val, expired, flag] {
@@ -255,6 +340,13 @@ future<scattered_message_ptr> database::set(const redis_key& rk, sstring& val, l
         bool result = true;
         if (current_store().insert_if(entry, expired, flag & FLAG_SET_NX, flag & FLAG_SET_XX)) {
             ++_stat._total_string_entries;
+            if (expired > 0) {
+                auto at = log_deadline(expired);
+                log_mutation({ "SET", rk, val, "PXAT", at });
+            }
+            else {
+                log_mutation({ "SET", rk, val });
+            }
         }
         else {
             result = false;
@@ -264,32 +356,200 @@ future<scattered_message_ptr> database::set(const redis_key& rk, sstring& val, l
     });
 }
 
-bool database::del_direct(const redis_key& rk)
+void database::enforce_maxmemory()
 {
-    ++_stat._del;
-    return current_store().with_entry_run(rk, [this, &rk] (cache_entry* e) {
-        if (!e) return false;
-        if (e->type_of_bytes()) {
-            --_stat._total_string_entries;
-        }
-        else if (e->type_of_set()) {
-            --_stat._total_set_entries;
-        }
-        else if (e->type_of_list()) {
-            --_stat._total_list_entries;
-        }
-        else if (e->type_of_map()) {
-            --_stat._total_dict_entries;
+    size_t evicted = 0;
+    while (used_memory() > _maxmemory && evicted < max_evictions_per_operation && evict_one(false)) {
+        ++evicted;
+    }
+    set_shard_out_of_memory(used_memory() > _maxmemory);
+}
+
+bool database::evict_one(bool reclaiming)
+{
+    auto& store = current_store();
+    // logging the victim may allocate, the LSA must neither move nor evict it
+    // before it is erased.
+    logalloc::reclaim_lock lock(*this);
+    auto e = store.eviction_candidate();
+    if (e == nullptr) {
+        return false;
+    }
+    if (reclaiming && _commitlog) {
+        uint32_t size = e->key_size();
+        if (_reclaimed_keys.size() + sizeof(size) + size > _reclaimed_keys.capacity()) {
+            return false;
         }
-        else if (e->type_of_sset()) {
-            --_stat._total_zset_entries;
+        auto p = reinterpret_cast<const char*>(&size);
+        _reclaimed_keys.insert(_reclaimed_keys.end(), p, p + sizeof(size));
+        _reclaimed_keys.insert(_reclaimed_keys.end(), e->key_data(), e->key_data() + size);
+        if (!_reclaimed_keys_timer.armed()) {
+            _reclaimed_keys_timer.arm(std::chrono::milliseconds(0));
         }
-        else if (e->type_of_hll()) {
-            --_stat._total_hll_entries;
+    }
+    with_allocator(allocator(), [this, &store, e, reclaiming] {
+        decrease_entries_counter(*e);
+        if (!reclaiming) {
+            log_mutation({ "DEL", log_arg(e->key_data(), e->key_size()) });
         }
-        else {
-            --_stat._total_counter_entries;
+        store.erase(*e);
+    });
+    ++_stat._evicted_keys;
+    return true;
+}
+
+memory::reclaiming_result database::reclaim()
+{
+    // the reclaimer may run in the middle of an operation, see cache::evictable(),
+    // and must not run the snapshot writer, which erasing an entry a running
+    // snapshot has yet to serialize would.
+    auto& store = current_store();
+    if (!store.evictable() || store.snapshotting() || !evict_one(true)) {
+        return memory::reclaiming_result::reclaimed_nothing;
+    }
+    ++_stat._reclaim_evictions;
+    return memory::reclaiming_result::reclaimed_something;
+}
+
+void database::log_reclaimed_keys()
+{
+    // the reclaimer may queue more keys while these are appended, they are
+    // logged as well: the buffer never grows past its capacity, nor moves.
+    size_t offset = 0;
+    while (_commitlog && offset < _reclaimed_keys.size()) {
+        uint32_t size;
+        std::memcpy(&size, _reclaimed_keys.data() + offset, sizeof(size));
+        offset += sizeof(size);
+        _commitlog->append({ "DEL", log_arg(_reclaimed_keys.data() + offset, size) });
+        offset += size;
+    }
+    _reclaimed_keys.clear();
+}
+
+void database::set_shard_out_of_memory(bool oom)
+{
+    if (oom == _shard_out_of_memory) {
+        return;
+    }
+    _shard_out_of_memory = oom;
+    // rare, only when the shard crosses its maxmemory. The updates are chained so
+    // that the shards apply them in order, and stop() waits for them.
+    _out_of_memory_update = _out_of_memory_update.then([oom] {
+        return get_database().invoke_on_all([oom] (database& db) {
+            if (oom) {
+                ++db._out_of_memory_shards;
+            }
+            else {
+                --db._out_of_memory_shards;
+            }
+        });
+    }).handle_exception([] (auto ep) {
+        db_log.error("failed to update the out of memory shards: {}", ep);
+    });
+}
+
+// Scores are logged with all their digits, so the replay restores them exactly.
+static sstring format_double(double v)
+{
+    return sprint("%.17g", v);
+}
+
+void database::log_zadd(const redis_key& rk, const std::unordered_map<sstring, double>& members, int flags)
+{
+    if (!_commitlog) {
+        return;
+    }
+    std::vector<sstring> scores;
+    scores.reserve(members.size());
+    std::vector<log_arg> record { "ZADD", rk };
+    record.reserve(2 * members.size() + 3);
+    if (flags & ZADD_NX) {
+        record.emplace_back("NX");
+    }
+    else if (flags & ZADD_XX) {
+        record.emplace_back("XX");
+    }
+    for (auto& m : members) {
+        scores.emplace_back(format_double(m.second));
+        record.emplace_back(scores.back());
+        record.emplace_back(m.first);
+    }
+    log_mutation(record);
+}
+
+// Logs the whole sorted set as ZADDs of at most zstore_log_chunk members.
+void database::log_sset(const redis_key& rk, const sset_lsa& sset)
+{
+    if (!_commitlog) {
+        return;
+    }
+    std::vector<sstring> scores;
+    std::vector<log_arg> record;
+    auto flush = [&] {
+        if (!scores.empty()) {
+            log_mutation(record);
+        }
+        scores.clear();
+        record.clear();
+        scores.reserve(zstore_log_chunk);
+        record.emplace_back("ZADD");
+        record.emplace_back(rk);
+    };
+    flush();
+    for (auto& e : sset._dict) {
+        scores.emplace_back(format_double(e.score()));
+        record.emplace_back(scores.back());
+        record.emplace_back(e.key_data(), e.key_size());
+        if (scores.size() == zstore_log_chunk) {
+            flush();
         }
+    }
+    flush();
+}
+
+// The bytes of the string a bitmap stands for.
+static sstring bitmap_bytes(const bitmap_lsa& bitmap)
+{
+    sstring bytes(sstring::initialized_later(), bitmap.size());
+    bitmap.read(0, bytes.begin(), bytes.size());
+    return bytes;
+}
+
+void database::decrease_entries_counter(const cache_entry& e)
+{
+    if (e.type_of_bytes()) {
+        --_stat._total_string_entries;
+    }
+    else if (e.type_of_set()) {
+        --_stat._total_set_entries;
+    }
+    else if (e.type_of_list()) {
+        --_stat._total_list_entries;
+    }
+    else if (e.type_of_map()) {
+        --_stat._total_dict_entries;
+    }
+    else if (e.type_of_sset()) {
+        --_stat._total_zset_entries;
+    }
+    else if (e.type_of_hll()) {
+        --_stat._total_hll_entries;
+    }
+    else if (e.type_of_bitmap()) {
+        --_stat._total_bitmap_entries;
+    }
+    else {
+        --_stat._total_counter_entries;
+    }
+}
+
+bool database::del_direct(const redis_key& rk)
+{
+    ++_stat._del;
+    return current_store().with_entry_run(rk, [this, &rk] (cache_entry* e) {
+        if (!e) return false;
+        decrease_entries_counter(*e);
+        log_mutation({ "DEL", rk });
         auto result =  current_store().erase(*e);
         return result;
     });
@@ -300,27 +560,8 @@ future<scattered_message_ptr> database::del(const redis_key& rk)
     ++_stat._del;
     return current_store().with_entry_run(rk, [this, &rk] (cache_entry* e) {
         if (!e) return reply_builder::build(msg_zero);
-        if (e->type_of_bytes()) {
-            --_stat._total_string_entries;
-        }
-        else if (e->type_of_set()) {
-            --_stat._total_set_entries;
-        }
-        else if (e->type_of_list()) {
-            --_stat._total_list_entries;
-        }
-        else if (e->type_of_map()) {
-            --_stat._total_dict_entries;
-        }
-        else if (e->type_of_sset()) {
-            --_stat._total_zset_entries;
-        }
-        else if (e->type_of_hll()) {
-            --_stat._total_hll_entries;
-        }
-        else {
-            --_stat._total_counter_entries;
-        }
+        decrease_entries_counter(*e);
+        log_mutation({ "DEL", rk });
         auto result =  current_store().erase(*e);
         return reply_builder::build(result ? msg_one : msg_zero);
     });
@@ -344,6 +585,10 @@ future<scattered_message_ptr> database::counter_by(const redis_key& rk, int64_t
     ++_stat._counter;
     return with_allocator(allocator(), [this, &rk, step, incr] {
         return current_store().with_entry_run(rk, [this, &rk, step, incr] (cache_entry* e) {
+            if (!e || e->type_of_integer()) {
+                auto s = to_sstring(step);
+                log_mutation({ incr ? "INCRBY" : "DECRBY", rk, s });
+            }
             if (!e) {
                 // not exists
                 auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), int64_t{step});
@@ -365,11 +610,14 @@ future<scattered_message_ptr> database::counter_by(const redis_key& rk, int64_t
     });
 }
 
-future<scattered_message_ptr> database::append(const redis_key& rk, sstring& val)
+future<scattered_message_ptr> database::append(const redis_key& rk, const temporary_buffer<char>& val)
 {
     ++_stat._append;
     return with_allocator(allocator(), [this, &rk, &val] {
         return current_store().with_entry_run(rk, [this, &rk, &val] (cache_entry* e) {
+            if (!e || e->type_of_bytes() || e->type_of_bitmap()) {
+                log_mutation({ "APPEND", rk, val });
+            }
             if (!e) {
                 // not exists
                 auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), val);
@@ -377,13 +625,19 @@ future<scattered_message_ptr> database::append(const redis_key& rk, sstring& val
                 ++_stat._total_string_entries;
                 return reply_builder::build(val.size());
             }
+            if (e->type_of_bitmap()) {
+                auto bytes = bitmap_bytes(e->value_bitmap());
+                e->bitmap_to_bytes(bytes.data(), bytes.size());
+                --_stat._total_bitmap_entries;
+                ++_stat._total_string_entries;
+            }
             if (!e->type_of_bytes()) {
                 return reply_builder::build(msg_type_err);
             }
             size_t new_size = e->value_bytes_size() + val.size();
             auto data = std::unique_ptr<bytes_view::value_type[]>(new bytes_view::value_type[new_size]);
             std::copy_n(e->value_bytes_data(), e->value_bytes_size(), data.get());
-            std::copy_n(val.data(), val.size(), data.get() + e->value_bytes_size());
+            std::copy_n(val.get(), val.size(), data.get() + e->value_bytes_size());
             auto new_value = current_allocator().construct<managed_bytes>(data.get(), new_size);
             auto& old_value = e->value_bytes();
             current_allocator().destroy<managed_bytes>(&old_value);
@@ -398,6 +652,10 @@ future<scattered_message_ptr> database::get(const redis_key& rk)
     ++_stat._read;
     ++_stat._get;
     return current_store().with_entry_run(rk, [this] (const cache_entry* e) {
+       if (e && e->type_of_bitmap()) {
+           ++_stat._hit;
+           return reply_builder::build(e->value_bitmap());
+       }
        if (e && e->type_of_bytes() == false) {
            return reply_builder::build(msg_type_err);
        }
@@ -416,6 +674,9 @@ future<scattered_message_ptr> database::strlen(const redis_key& rk)
             if (e->type_of_bytes()) {
                 return reply_builder::build(e->value_bytes_size());
             }
+            if (e->type_of_bitmap()) {
+                return reply_builder::build(size_t(e->value_bitmap().size()));
+            }
             return reply_builder::build(msg_type_err);
         }
         return reply_builder::build(msg_zero);
@@ -438,6 +699,10 @@ future<scattered_message_ptr> database::expire(const redis_key& rk, long expired
 {
     ++_stat._expire;
     auto result = current_store().expire(rk, expired);
+    if (result) {
+        auto at = log_deadline(expired);
+        log_mutation({ "PEXPIREAT", rk, at });
+    }
     return reply_builder::build(result ? msg_one : msg_zero);
 }
 
@@ -445,6 +710,9 @@ future<scattered_message_ptr> database::persist(const redis_key& rk)
 {
     ++_stat._persist;
     auto result = current_store().never_expired(rk);
+    if (result) {
+        log_mutation({ "PERSIST", rk });
+    }
     return reply_builder::build(result ? msg_one : msg_zero);
 }
 
@@ -469,6 +737,7 @@ future<scattered_message_ptr> database::push(const redis_key& rk, sstring& val,
             }
             auto& list = e->value_list();
             left ? list.insert_head(val) : list.insert_tail(val);
+            log_mutation({ left ? "LPUSH" : "RPUSH", rk, val });
             return reply_builder::build(list.size());
         });
     });
@@ -494,9 +763,12 @@ future<scattered_message_ptr> database::push_multi(const redis_key& rk, std::vec
                 return reply_builder::build(msg_type_err);
             }
             auto& list = e->value_list();
+            std::vector<log_arg> record { left ? "LPUSH" : "RPUSH", rk };
             for (auto& val : values) {
                 left ? list.insert_head(val) : list.insert_tail(val);
+                record.emplace_back(val);
             }
+            log_mutation(record);
             return reply_builder::build(list.size());
         });
     });
@@ -518,6 +790,7 @@ future<scattered_message_ptr> database::pop(const redis_key& rk, bool left)
             assert(!list.empty());
             auto reply = reply_builder::build(left ? list.front() : list.back());
             left ? list.pop_front() : list.pop_back();
+            log_mutation({ left ? "LPOP" : "RPOP", rk });
             if (list.empty()) {
                --_stat._total_list_entries;
                current_store().erase(rk);
@@ -559,7 +832,7 @@ future<scattered_message_ptr> database::lindex(const redis_key& rk, long idx)
         if (list.index_out_of_range(index)) {
             return reply_builder::build(msg_nil);
         }
-        auto& result = list.at(static_cast<size_t>(index));
+        auto result = list.at(static_cast<size_t>(index));
         ++_stat._hit;
         return reply_builder::build(result);
     });
@@ -581,12 +854,9 @@ future<scattered_message_ptr> database::lrange(const redis_key& rk, long start,
         end = database::alignment_index_base_on(list.size(), end);
         if (start < 0) start = 0;
         if (end >= static_cast<long>(list.size())) end = static_cast<size_t>(list.size()) - 1;
-        std::vector<const managed_bytes*> data;
+        std::vector<bytes_view> data;
         if (start < end) {
-           for (auto i = start; i < end; ++i) {
-              const auto& b = list.at(static_cast<size_t>(i));
-              data.push_back(&b);
-           }
+           list.range(static_cast<size_t>(start), static_cast<size_t>(end), data);
         }
         if (!data.empty()) ++_stat._hit;
         return reply_builder::build(data);
@@ -608,7 +878,11 @@ future<scattered_message_ptr> database::lrem(const redis_key& rk, long count, ss
             size_t removed = 0;
             if (count == 0) removed = list.trem<true, true>(val, count);
             else if (count > 0) removed = list.trem<false, true>(val, count);
-            else removed = list.trem<false, false>(val, count);
+            else removed = list.trem<false, false>(val, static_cast<size_t>(-count));
+            if (removed > 0) {
+                auto c = to_sstring(count);
+                log_mutation({ "LREM", rk, c, val });
+            }
             if (list.empty()) {
                 --_stat._total_list_entries;
                 current_store().erase(rk);
@@ -631,17 +905,11 @@ future<scattered_message_ptr> database::linsert(const redis_key& rk, sstring& pi
             }
             auto& list = e->value_list();
             auto index = list.index_of(pivot);
-            if (list.index_out_of_range(index)) {
+            if (index == list.size()) {
                 return reply_builder::build(msg_zero);
             }
-            if (after) {
-                if (index == list.size()) list.insert_tail(val);
-                else  list.insert_at(++index, val);
-            }
-            else {
-               if (index == 0) list.insert_head(val);
-               else list.insert_at(--index, val);
-            }
+            list.insert_at(after ? index + 1 : index, val);
+            log_mutation({ "LINSERT", rk, after ? "AFTER" : "BEFORE", pivot, val });
             return reply_builder::build(msg_one);
         });
     });
@@ -663,10 +931,9 @@ future<scattered_message_ptr> database::lset(const redis_key& rk, long idx, sstr
             if (list.index_out_of_range(nidx)) {
                 return reply_builder::build(msg_out_of_range_err);
             }
-            auto& old = list.at(static_cast<size_t>(nidx));
-            current_allocator().destroy<managed_bytes>(&old);
-            auto entry = current_allocator().construct<managed_bytes>(bytes_view{reinterpret_cast<const signed char*>(val.data()), val.size()});
-            list.at(idx) = std::move(*entry);
+            list.set(static_cast<size_t>(nidx), val);
+            auto i = to_sstring(nidx);
+            log_mutation({ "LSET", rk, i, val });
             return reply_builder::build(msg_ok);
         });
     });
@@ -691,6 +958,8 @@ future<scattered_message_ptr> database::ltrim(const redis_key& rk, long start, l
                 list.clear();
             }
             list.trim(static_cast<size_t>(nstart), static_cast<size_t>(nend));
+            auto s = to_sstring(start), e = to_sstring(end);
+            log_mutation({ "LTRIM", rk, s, e });
             if (list.empty()) {
                 --_stat._total_list_entries;
                 current_store().erase(rk);
@@ -717,10 +986,9 @@ future<scattered_message_ptr> database::hset(const redis_key& rk, sstring& key,
                 return reply_builder::build(msg_type_err);
             }
             auto& map = e->value_map();
-            bool exists = map.exists(key);
-            auto entry = current_allocator().construct<dict_entry>(key, val);
-            map.insert(entry);
-            return reply_builder::build(exists ? msg_zero : msg_one);
+            auto inserted = map.insert_or_update(key, val);
+            log_mutation({ "HSET", rk, key, val });
+            return reply_builder::build(inserted ? msg_one : msg_zero);
         });
     });
 }
@@ -742,16 +1010,12 @@ future<scattered_message_ptr> database::hincrby(const redis_key& rk, sstring& ke
                 return reply_builder::build(msg_type_err);
             }
             auto& map = e->value_map();
-            return map.with_entry_run(key, [&map, &key, delta] (dict_entry* d) {
+            return map.incr(key, delta, [this, &rk, &key, delta] (const dict_entry_view* d) {
                 if (!d) {
-                    auto entry = current_allocator().construct<dict_entry>(key, delta);
-                    map.insert(entry);
-                    return reply_builder::build<false, true>(entry);
-                }
-                if (!d->type_of_integer()) {
                     return reply_builder::build(msg_not_integer_err);
                 }
-                d->value_integer_incr(delta);
+                auto v = to_sstring(delta);
+                log_mutation({ "HINCRBY", rk, key, v });
                 return reply_builder::build<false, true>(d);
             });
         });
@@ -775,16 +1039,12 @@ future<scattered_message_ptr> database::hincrbyfloat(const redis_key& rk, sstrin
                 return reply_builder::build(msg_type_err);
             }
             auto& map = e->value_map();
-            return map.with_entry_run(key, [&map, &key, delta] (dict_entry* d) {
+            return map.incr(key, delta, [this, &rk, &key, delta] (const dict_entry_view* d) {
                 if (!d) {
-                    auto entry = current_allocator().construct<dict_entry>(key, delta);
-                    map.insert(entry);
-                    return reply_builder::build<false, true>(entry);
-                }
-                if (!d->type_of_float()) {
                     return reply_builder::build(msg_not_float_err);
                 }
-                d->value_float_incr(delta);
+                auto v = format_double(delta);
+                log_mutation({ "HINCRBYFLOAT", rk, key, v });
                 return reply_builder::build<false, true>(d);
             });
         });
@@ -808,13 +1068,14 @@ future<scattered_message_ptr> database::hmset(const redis_key& rk, std::unordere
                 return reply_builder::build(msg_type_err);
             }
             auto& map = e->value_map();
-            bool result = false;
+            std::vector<log_arg> record { "HMSET", rk };
             for (auto& kv : kvs) {
-               auto entry = current_allocator().construct<dict_entry>(kv.first, kv.second);
-               result = map.insert(entry);
-               if (!result) break;
+               map.insert_or_update(kv.first, kv.second);
+               record.emplace_back(kv.first);
+               record.emplace_back(kv.second);
             }
-            return reply_builder::build(result ? msg_ok : msg_err);
+            log_mutation(record);
+            return reply_builder::build(msg_ok);
         });
     });
 }
@@ -831,7 +1092,7 @@ future<scattered_message_ptr> database::hget(const redis_key& rk, sstring& key)
             return reply_builder::build(msg_type_err);
         }
         auto& map = e->value_map();
-        return map.with_entry_run(key, [this] (const dict_entry* d) {
+        return map.with_entry_run(key, [this] (const dict_entry_view* d) {
             if (d) ++_stat._hit;
             return reply_builder::build<false, true>(d);
         });
@@ -851,11 +1112,16 @@ future<scattered_message_ptr> database::hdel_multi(const redis_key& rk, std::vec
             }
             auto& map = e->value_map();
             size_t removed = 0;
+            std::vector<log_arg> record { "HDEL", rk };
             for (auto& key : keys) {
                 if (map.erase(key)) {
                     ++ removed;
+                    record.emplace_back(key);
                 }
             }
+            if (removed > 0) {
+                log_mutation(record);
+            }
             if (map.empty()) {
                 --_stat._total_dict_entries;
                 current_store().erase(rk);
@@ -879,6 +1145,9 @@ future<scattered_message_ptr> database::hdel(const redis_key& rk, sstring& key)
             }
             auto& map = e->value_map();
             bool exists = map.erase(key);
+            if (exists) {
+                log_mutation({ "HDEL", rk, key });
+            }
             if (map.empty()) {
                 --_stat._total_dict_entries;
                 current_store().erase(rk);
@@ -917,7 +1186,7 @@ future<scattered_message_ptr> database::hstrlen(const redis_key& rk, sstring& ke
             return reply_builder::build(msg_type_err);
         }
         auto& map = e->value_map();
-        return map.with_entry_run(key, [] (const dict_entry* d) {
+        return map.with_entry_run(key, [] (const dict_entry_view* d) {
             if (!d) {
                 return reply_builder::build(msg_zero);
             }
@@ -956,6 +1225,73 @@ future<scattered_message_ptr> database::hgetall_keys(const redis_key& rk)
     return hgetall_impl<true, false>(rk);
 }
 
+future<scattered_message_ptr> database::hrandfield(const redis_key& rk, int64_t count, bool with_count, bool with_values)
+{
+    ++_stat._read;
+    ++_stat._hrandfield;
+    return current_store().with_entry_run(rk, [this, count, with_count, with_values] (const cache_entry* e) {
+        if (!e) {
+            return reply_builder::build(with_count ? msg_empty_multi_bulk : msg_nil);
+        }
+        if (e->type_of_map() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto& map = e->value_map();
+        std::vector<dict_entry_view> entries;
+        map.fetch_random(with_count ? static_cast<size_t>(std::abs(count)) : 1, count >= 0, random_index, entries);
+        ++_stat._hit;
+        if (!with_count) {
+            return reply_builder::build<true, false>(&entries.front());
+        }
+        if (entries.empty()) {
+            return reply_builder::build(msg_empty_multi_bulk);
+        }
+        return with_values ? reply_builder::build<true, true>(entries) : reply_builder::build<true, false>(entries);
+    });
+}
+
+
+static std::pair<const char*, size_t> key_of(const dict_entry_view& e)
+{
+    return { e.key_data(), e.key_size() };
+}
+
+static std::pair<const char*, size_t> key_of(const sset_entry* e)
+{
+    return { e->key_data(), e->key_size() };
+}
+
+// Drops the entries whose key does not match the pattern of a cursor command.
+template <typename Entry>
+static void filter_scanned(std::vector<Entry>& entries, const sstring& pattern)
+{
+    if (pattern.empty()) {
+        return;
+    }
+    entries.erase(std::remove_if(entries.begin(), entries.end(), [&pattern] (const Entry& e) {
+        auto key = key_of(e);
+        return !string_match(pattern.data(), pattern.size(), key.first, key.second);
+    }), entries.end());
+}
+
+future<scattered_message_ptr> database::hscan(const redis_key& rk, uint64_t cursor, size_t count, const sstring& pattern)
+{
+    ++_stat._read;
+    ++_stat._hscan;
+    return current_store().with_entry_run(rk, [this, cursor, count, &pattern] (const cache_entry* e) {
+        std::vector<dict_entry_view> entries;
+        if (!e) {
+            return reply_builder::build_scan<true>(0, entries);
+        }
+        if (e->type_of_map() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto next = e->value_map().fetch_scan(cursor, count, entries);
+        filter_scanned(entries, pattern);
+        ++_stat._hit;
+        return reply_builder::build_scan<true>(next, entries);
+    });
+}
 
 future<scattered_message_ptr> database::hmget(const redis_key& rk, std::vector<sstring>& keys)
 {
@@ -969,33 +1305,59 @@ future<scattered_message_ptr> database::hmget(const redis_key& rk, std::vector<s
             return reply_builder::build(msg_type_err);
         }
         auto& map = e->value_map();
-        std::vector<const dict_entry*> entries;
+        std::vector<dict_entry_view> entries;
         map.fetch(keys, entries);
         if (!entries.empty()) ++_stat._hit;
         return reply_builder::build<false, true>(entries);
     });
 }
 
-future<scattered_message_ptr> database::srandmember(const redis_key& rk, size_t count)
+future<scattered_message_ptr> database::sscan(const redis_key& rk, uint64_t cursor, size_t count, const sstring& pattern)
+{
+    ++_stat._read;
+    ++_stat._sscan;
+    return current_store().with_entry_run(rk, [this, cursor, count, &pattern] (const cache_entry* e) {
+        std::vector<dict_entry_view> entries;
+        if (!e) {
+            return reply_builder::build_scan<false>(0, entries);
+        }
+        if (e->type_of_set() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto next = e->value_set().fetch_scan(cursor, count, entries);
+        filter_scanned(entries, pattern);
+        ++_stat._hit;
+        return reply_builder::build_scan<false>(next, entries);
+    });
+}
+
+static size_t random_index(size_t n)
+{
+    return rand_generater::rand_less_than(n);
+}
+
+future<scattered_message_ptr> database::srandmember(const redis_key& rk, int64_t count, bool with_count)
 {
     ++_stat._read;
     ++_stat._srandmember;
-     return current_store().with_entry_run(rk, [this, &count] (const cache_entry* e) {
-        std::vector<const dict_entry*> result;
+     return current_store().with_entry_run(rk, [this, count, with_count] (const cache_entry* e) {
         if (!e) {
-            return reply_builder::build<true, false>(result);
+            return reply_builder::build(with_count ? msg_empty_multi_bulk : msg_nil);
         }
         if (e->type_of_set() == false) {
             return reply_builder::build(msg_type_err);
         }
         auto& set = e->value_set();
-        count = std::min(count, set.size());
-        for (size_t i = 0; i < count; ++i) {
-            auto index = rand_generater::rand_less_than(set.size());
-            auto entry = set.at(index);
-            result.push_back(&(*entry));
+        std::vector<dict_entry_view> result;
+        // a negative count may return the same member several times.
+        set.fetch_random(with_count ? static_cast<size_t>(std::abs(count)) : 1, count >= 0, random_index, result);
+        ++_stat._hit;
+        if (!with_count) {
+            return reply_builder::build<true, false>(&result.front());
+        }
+        if (result.empty()) {
+            return reply_builder::build(msg_empty_multi_bulk);
         }
-        if (!result.empty()) ++_stat._hit;
         return reply_builder::build<true, false>(result);
      });
 }
@@ -1017,11 +1379,16 @@ future<scattered_message_ptr> database::sadds(const redis_key& rk, std::vector<s
             }
             auto& set = o->value_set();
             size_t inserted = 0;
+            std::vector<log_arg> record { "SADD", rk };
             for (auto& member : members) {
-                if (set.insert(current_allocator().construct<dict_entry>(member))) {
+                if (set.insert(member)) {
                     inserted++;
+                    record.emplace_back(member);
                 }
             }
+            if (inserted > 0) {
+                log_mutation(record);
+            }
             return reply_builder::build(inserted);
         });
     });
@@ -1043,7 +1410,9 @@ bool database::sadd_direct(const redis_key& rk, sstring& member)
                 return false;
             }
             auto& set = o->value_set();
-            set.insert(current_allocator().construct<dict_entry>(member));
+            if (set.insert(member)) {
+                log_mutation({ "SADD", rk, member });
+            }
             return true;
         });
     });
@@ -1066,11 +1435,16 @@ bool database::sadds_direct(const redis_key& rk, std::vector<sstring>& members)
             }
             auto& set = o->value_set();
             size_t inserted = 0;
+            std::vector<log_arg> record { "SADD", rk };
             for (auto& member : members) {
-                if (set.insert(current_allocator().construct<dict_entry>(member))) {
+                if (set.insert(member)) {
                     inserted++;
+                    record.emplace_back(member);
                 }
             }
+            if (inserted > 0) {
+                log_mutation(record);
+            }
             return true;
         });
     });
@@ -1091,6 +1465,20 @@ future<scattered_message_ptr> database::scard(const redis_key& rk)
     });
 }
 
+// Returns the cardinality of the set, 0 if there is no key, or REDIS_WRONG_TYPE.
+long database::scard_direct(const redis_key& rk)
+{
+    return current_store().with_entry_run(rk, [] (const cache_entry* e) -> long {
+       if (!e) {
+           return 0;
+       }
+       if (e->type_of_set() == false) {
+           return REDIS_WRONG_TYPE;
+       }
+       return static_cast<long>(e->value_set().size());
+    });
+}
+
 future<scattered_message_ptr> database::sismember(const redis_key& rk, sstring& member)
 {
     ++_stat._sismember;
@@ -1119,18 +1507,24 @@ future<scattered_message_ptr> database::smembers(const redis_key& rk)
             return reply_builder::build(msg_type_err);
         }
         auto& set = e->value_set();
-        std::vector<const dict_entry*> entries;
+        std::vector<dict_entry_view> entries;
         set.fetch(entries);
         if (!entries.empty()) ++_stat._hit;
         return reply_builder::build<true, false>(entries);
     });
 }
 
+// An HLL, or a string holding one, as the replay of a logged PFMERGE makes.
+static bool holds_hll(const cache_entry& e)
+{
+    return e.type_of_hll() || (e.type_of_bytes() && hll::valid(e.value_bytes_data(), e.value_bytes_size()));
+}
+
 future<foreign_ptr<lw_shared_ptr<sstring>>> database::get_hll_direct(const redis_key& rk)
 {
     using return_type = foreign_ptr<lw_shared_ptr<sstring>>;
     return current_store().with_entry_run(rk, [this] (const cache_entry* e) {
-        if (!e || e->type_of_hll() == false) {
+        if (!e || !holds_hll(*e)) {
             return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<sstring>>(nullptr));
         }
         auto data = e->value_bytes_data();
@@ -1146,6 +1540,10 @@ future<foreign_ptr<lw_shared_ptr<sstring>>> database::get_direct(const redis_key
     ++_stat._get;
     using return_type = foreign_ptr<lw_shared_ptr<sstring>>;
     return current_store().with_entry_run(rk, [this] (const cache_entry* e) {
+        if (e && e->type_of_bitmap()) {
+            ++_stat._hit;
+            return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<sstring>>(make_lw_shared<sstring>(bitmap_bytes(e->value_bitmap()))));
+        }
         if (!e || e->type_of_bytes() == false) {
             return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<sstring>>(nullptr));
         }
@@ -1156,6 +1554,84 @@ future<foreign_ptr<lw_shared_ptr<sstring>>> database::get_direct(const redis_key
     });
 }
 
+future<foreign_ptr<lw_shared_ptr<std::vector<std::experimental::optional<sstring>>>>> database::get_batch(key_batch& batch)
+{
+    ++_stat._batch_messages;
+    _stat._batch_keys += batch.keys.size();
+    using result_type = std::vector<std::experimental::optional<sstring>>;
+    using return_type = foreign_ptr<lw_shared_ptr<result_type>>;
+    auto result = make_lw_shared<result_type>();
+    result->reserve(batch.keys.size());
+    for (auto& rk : batch.keys) {
+        ++_stat._read;
+        ++_stat._get;
+        current_store().with_entry_run(rk, [this, &result] (const cache_entry* e) {
+            if (e && e->type_of_bitmap()) {
+                ++_stat._hit;
+                result->emplace_back(bitmap_bytes(e->value_bitmap()));
+                return;
+            }
+            // the counters, as GET replies them.
+            if (e && e->type_of_integer()) {
+                ++_stat._hit;
+                result->emplace_back(to_sstring(int64_t(e->value_integer())));
+                return;
+            }
+            if (e && e->type_of_float()) {
+                ++_stat._hit;
+                result->emplace_back(to_sstring(double(e->value_float())));
+                return;
+            }
+            if (!e || e->type_of_bytes() == false) {
+                result->emplace_back();
+                return;
+            }
+            ++_stat._hit;
+            result->emplace_back(sstring {e->value_bytes_data(), e->value_bytes_size()});
+        });
+    }
+    return make_ready_future<return_type>(return_type(std::move(result)));
+}
+
+size_t database::set_batch(key_batch& batch)
+{
+    ++_stat._batch_messages;
+    _stat._batch_keys += batch.keys.size();
+    size_t count = 0;
+    for (size_t i = 0; i < batch.keys.size(); ++i) {
+        if (set_direct(batch.keys[i], *(batch.values[i]), 0, FLAG_SET_NO)) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+size_t database::del_batch(key_batch& batch)
+{
+    ++_stat._batch_messages;
+    _stat._batch_keys += batch.keys.size();
+    size_t count = 0;
+    for (auto& rk : batch.keys) {
+        if (del_direct(rk)) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+size_t database::exists_batch(key_batch& batch)
+{
+    ++_stat._batch_messages;
+    _stat._batch_keys += batch.keys.size();
+    size_t count = 0;
+    for (auto& rk : batch.keys) {
+        if (exists_direct(rk)) {
+            ++count;
+        }
+    }
+    return count;
+}
+
 future<foreign_ptr<lw_shared_ptr<std::vector<sstring>>>> database::smembers_direct(const redis_key& rk)
 {
     ++_stat._read;
@@ -1174,33 +1650,59 @@ future<foreign_ptr<lw_shared_ptr<std::vector<sstring>>>> database::smembers_dire
     });
 }
 
-future<scattered_message_ptr> database::spop(const redis_key& rk, size_t count)
+// Returns the indexes of the members whose membership in the set equals exists,
+// at most limit of them unless limit is 0.
+future<foreign_ptr<lw_shared_ptr<std::vector<size_t>>>> database::sprobe_direct(const redis_key& rk, std::vector<sstring>& members, bool exists, size_t limit)
+{
+    ++_stat._read;
+    using result_type = std::vector<size_t>;
+    using return_type = foreign_ptr<lw_shared_ptr<result_type>>;
+    return current_store().with_entry_run(rk, [&members, exists, limit] (const cache_entry* e) {
+        result_type indexes;
+        const dict_lsa* set = (e && e->type_of_set()) ? &e->value_set() : nullptr;
+        for (size_t i = 0; i < members.size(); ++i) {
+            if ((set != nullptr && set->exists(members[i])) == exists) {
+                indexes.push_back(i);
+                if (indexes.size() == limit) {
+                    break;
+                }
+            }
+        }
+        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<result_type>>(make_lw_shared<result_type>(std::move(indexes))));
+    });
+}
+
+future<scattered_message_ptr> database::spop(const redis_key& rk, size_t count, bool with_count)
 {
     ++_stat._read;
     ++_stat._spop;
-    return with_allocator(allocator(), [this, &rk, &count] {
-        return current_store().with_entry_run(rk, [this, &rk, &count] (cache_entry* e) {
+    return with_allocator(allocator(), [this, &rk, count, with_count] {
+        return current_store().with_entry_run(rk, [this, &rk, count, with_count] (cache_entry* e) {
             if (!e) {
-                return reply_builder::build(msg_nil);
+                return reply_builder::build(with_count ? msg_empty_multi_bulk : msg_nil);
             }
             if (e->type_of_set() == false) {
                 return reply_builder::build(msg_type_err);
             }
             auto& set = e->value_set();
-            std::vector<dict_lsa::const_iterator> removed;
-            std::vector<const dict_entry*> entries;
-            count = std::min(count, set.size());
-            for (size_t i = 0; i < count; ++i) {
-                auto index = rand_generater::rand_less_than(set.size());
-                auto entry = set.at(index);
-                entries.push_back(&(*entry));
-                removed.push_back(entry);
-            }
-            auto reply = reply_builder::build<true, false>(entries);
+            std::vector<dict_entry_view> entries;
+            set.fetch_random(with_count ? count : 1, true, random_index, entries);
+            std::vector<sstring> removed;
+            removed.reserve(entries.size());
+            for (auto& entry : entries) {
+                removed.emplace_back(entry.key_data(), entry.key_size());
+            }
+            auto reply = with_count ? (entries.empty() ? reply_builder::build(msg_empty_multi_bulk) : reply_builder::build<true, false>(entries))
+                                    : reply_builder::build<true, false>(&entries.front());
             if (!removed.empty()) {
-                for (auto it : removed) {
-                    set.erase(it);
+                // the members are chosen at random, the log records which ones.
+                std::vector<log_arg> record { "SREM", rk };
+                for (auto& member : removed) {
+                    if (set.erase(member)) {
+                        record.emplace_back(member);
+                    }
                 }
+                log_mutation(record);
                 if (set.empty()) {
                     --_stat._total_set_entries;
                     current_store().erase(rk);
@@ -1224,6 +1726,9 @@ future<scattered_message_ptr> database::srem(const redis_key& rk, sstring& membe
             }
             auto& set = e->value_set();
             auto result = set.erase(member);
+            if (result) {
+                log_mutation({ "SREM", rk, member });
+            }
             if (set.empty()) {
                 --_stat._total_set_entries;
                 current_store().erase(rk);
@@ -1245,6 +1750,9 @@ bool database::srem_direct(const redis_key& rk, sstring& member)
             }
             auto& set = e->value_set();
             auto result = set.erase(member);
+            if (result) {
+                log_mutation({ "SREM", rk, member });
+            }
             if (set.empty()) {
                 --_stat._total_set_entries;
                 current_store().erase(rk);
@@ -1267,11 +1775,16 @@ future<scattered_message_ptr> database::srems(const redis_key& rk, std::vector<s
             }
             auto& set = e->value_set();
             size_t removed = 0;
+            std::vector<log_arg> record { "SREM", rk };
             for (auto& member : members) {
                 if (set.erase(member)) {
                     removed++;
+                    record.emplace_back(member);
                 }
             }
+            if (removed > 0) {
+                log_mutation(record);
+            }
             if (set.empty()) {
                 --_stat._total_set_entries;
                 current_store().erase(rk);
@@ -1338,6 +1851,7 @@ future<scattered_message_ptr> database::zadds(const redis_key& rk, std::unordere
             else {
                 assert(false);
             }
+            log_zadd(rk, members, flags);
             return reply_builder::build(inserted);
         });
     });
@@ -1372,6 +1886,7 @@ bool database::zadds_direct(const redis_key& rk, std::unordered_map<sstring, dou
             else {
                 assert(false);
             }
+            log_zadd(rk, members, flags);
             return inserted > 0;
         });
     });
@@ -1407,6 +1922,11 @@ future<scattered_message_ptr> database::zrem(const redis_key& rk, std::vector<ss
             }
             auto& sset = e->value_sset();
             auto removed = sset.erase(members);
+            if (removed > 0) {
+                std::vector<log_arg> record { "ZREM", rk };
+                record.insert(record.end(), members.begin(), members.end());
+                log_mutation(record);
+            }
             if (sset.empty()) {
                --_stat._total_zset_entries;
                current_store().erase(rk);
@@ -1449,6 +1969,8 @@ future<scattered_message_ptr> database::zincrby(const redis_key& rk, sstring& me
             }
             auto& sset = o->value_sset();
             auto result = sset.insert_or_update(member, delta);
+            auto d = format_double(delta);
+            log_mutation({ "ZINCRBY", rk, d, member });
             return reply_builder::build(result);
         });
     });
@@ -1472,6 +1994,74 @@ future<foreign_ptr<lw_shared_ptr<std::vector<std::pair<sstring, double>>>>> data
     });
 }
 
+future<foreign_ptr<lw_shared_ptr<std::vector<std::pair<sstring, double>>>>> database::zrange_by_member_direct(const redis_key& rk, sstring& after, bool from_start, size_t count)
+{
+    ++_stat._read;
+    using return_type = foreign_ptr<lw_shared_ptr<std::vector<std::pair<sstring, double>>>>;
+    using result_type = std::vector<std::pair<sstring, double>>;
+    return current_store().with_entry_run(rk, [this, &after, from_start, count] (const cache_entry* e) {
+        result_type entries {};
+        if (e != nullptr && e->type_of_sset()) {
+            e->value_sset().fetch_by_member(from_start ? nullptr : &after, count, entries);
+        }
+        if (!entries.empty()) ++_stat._hit;
+        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<result_type>>(make_lw_shared<result_type>(std::move(entries))));
+    });
+}
+
+bool database::zstore_batch_direct(uint64_t id, std::vector<std::pair<sstring, double>>& batch)
+{
+    return with_allocator(allocator(), [this, id, &batch] {
+        auto it = _zstore_staging.find(id);
+        if (it == _zstore_staging.end()) {
+            it = _zstore_staging.emplace(id, make_managed<sset_lsa>()).first;
+        }
+        auto& sset = *(it->second);
+        for (auto& member : batch) {
+            auto entry = current_allocator().construct<sset_entry>(member.first, member.second);
+            if (!sset.insert(entry)) {
+                current_allocator().destroy<sset_entry>(entry);
+            }
+        }
+        return true;
+    });
+}
+
+size_t database::zstore_commit_direct(const redis_key& rk, uint64_t id)
+{
+    ++_stat._zadd;
+    return with_allocator(allocator(), [this, &rk, id] {
+        // the destination is replaced, whatever it held.
+        current_store().with_entry_run(rk, [this] (const cache_entry* e) {
+            if (e) {
+                decrease_entries_counter(*e);
+            }
+        });
+        current_store().erase(rk);
+        log_mutation({ "DEL", rk });
+        size_t size = 0;
+        auto it = _zstore_staging.find(id);
+        if (it != _zstore_staging.end()) {
+            size = it->second->size();
+            if (size > 0) {
+                log_sset(rk, *(it->second));
+                auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), std::move(it->second));
+                current_store().insert(entry);
+                ++_stat._total_zset_entries;
+            }
+            _zstore_staging.erase(it);
+        }
+        return size;
+    });
+}
+
+bool database::zstore_abort_direct(uint64_t id)
+{
+    return with_allocator(allocator(), [this, id] {
+        return _zstore_staging.erase(id) > 0;
+    });
+}
+
 future<scattered_message_ptr> database::zrange(const redis_key& rk, long begin, long end, bool reverse, bool with_score)
 {
     ++_stat._read;
@@ -1532,7 +2122,7 @@ future<scattered_message_ptr> database::zrank(const redis_key& rk, sstring& memb
         if (rank_opt) {
            auto rank = *rank_opt;
            if (reverse) {
-               rank = sset.size() - rank;
+               rank = sset.size() - rank - 1;
            }
            ++_stat._hit;
            return reply_builder::build(rank);
@@ -1577,6 +2167,10 @@ future<scattered_message_ptr> database::zremrangebyscore(const redis_key& rk, do
             auto& sset = e->value_sset();
             sset.fetch_by_score(min, max, entries);
             auto removed = sset.erase(entries);
+            if (removed > 0) {
+                auto lo = format_double(min), hi = format_double(max);
+                log_mutation({ "ZREMRANGEBYSCORE", rk, lo, hi });
+            }
             if (sset.empty()) {
                 --_stat._total_zset_entries;
                 current_store().erase(rk);
@@ -1601,6 +2195,10 @@ future<scattered_message_ptr> database::zremrangebyrank(const redis_key& rk, siz
             auto& sset = e->value_sset();
             sset.fetch_by_rank(begin, end, entries);
             auto removed = sset.erase(entries);
+            if (removed > 0) {
+                auto b = to_sstring(begin), e = to_sstring(end);
+                log_mutation({ "ZREMRANGEBYRANK", rk, b, e });
+            }
             if (sset.empty()) {
                 --_stat._total_zset_entries;
                 current_store().erase(rk);
@@ -1610,6 +2208,25 @@ future<scattered_message_ptr> database::zremrangebyrank(const redis_key& rk, siz
     });
 }
 
+future<scattered_message_ptr> database::zscan(const redis_key& rk, uint64_t cursor, size_t count, const sstring& pattern)
+{
+    ++_stat._read;
+    ++_stat._zscan;
+    return current_store().with_entry_run(rk, [this, cursor, count, &pattern] (const cache_entry* e) {
+        std::vector<const sset_entry*> entries;
+        if (!e) {
+            return reply_builder::build_scan(0, entries);
+        }
+        if (e->type_of_sset() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto next = e->value_sset().fetch_scan(cursor, count, entries);
+        filter_scanned(entries, pattern);
+        ++_stat._hit;
+        return reply_builder::build_scan(next, entries);
+    });
+}
+
 bool database::select(size_t index)
 {
     ++_stat._select;
@@ -1621,6 +2238,23 @@ bool database::select(size_t index)
 }
 
 
+database::scan_result database::scan(size_t cursor, size_t count, const sstring& pattern, const sstring& type)
+{
+    ++_stat._scan;
+    scan_result result;
+    result._cursor = current_store().scan(cursor, count, [&result, &pattern, &type] (const cache_entry& e) {
+        if (!pattern.empty() && !string_match(pattern.data(), pattern.size(), e.key_data(), e.key_size())) {
+            return;
+        }
+        if (!type.empty() && e.type_name() != type) {
+            return;
+        }
+        result._keys.emplace_back(e.key_data(), e.key_size());
+    });
+    return result;
+}
+
+
 future<scattered_message_ptr> database::geodist(const redis_key& rk, sstring& lpos, sstring& rpos, int flag)
 {
     ++_stat._read;
@@ -1633,10 +2267,10 @@ future<scattered_message_ptr> database::geodist(const redis_key& rk, sstring& lp
         factor = 1000;
     }
     else if (flag & GEODIST_UNIT_MI) {
-        factor = 0.3048;
+        factor = 1609.34;
     }
     else if (flag & GEODIST_UNIT_FT) {
-        factor = 1609.34;
+        factor = 0.3048;
     }
     return current_store().with_entry_run(rk, [this, &lpos, &rpos, factor] (const cache_entry* e) {
         if (e == nullptr) {
@@ -1718,84 +2352,78 @@ future<scattered_message_ptr> database::geopos(const redis_key& rk, std::vector<
     });
 }
 using georadius_result_type = std::pair<std::vector<std::tuple<sstring, double, double, double, double>>, int>;
-future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::georadius_coord_direct(const redis_key& rk, double longitude, double latitude, double radius, size_t count, int flag)
+static future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> geo_result(int code, geo::points_type&& points = {})
 {
     using return_type = foreign_ptr<lw_shared_ptr<georadius_result_type>>;
-    return current_store().with_entry_run(rk, [this, longitude, latitude, radius, count, flag] (const cache_entry* e) {
+    return make_ready_future<return_type>(return_type(make_lw_shared<georadius_result_type>(georadius_result_type {std::move(points), code})));
+}
+
+future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::georadius_coord_direct(const redis_key& rk, double longitude, double latitude, double radius, size_t count, int flag)
+{
+    ++_stat._georadius;
+    geo::shape shape;
+    shape._longitude = longitude;
+    shape._latitude = latitude;
+    shape._radius = radius;
+    return current_store().with_entry_run(rk, [this, shape, count, flag] (const cache_entry* e) {
         if (e == nullptr) {
-            return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_ERR})));
-        }
-        if (e->type_of_sset() == false) {
-            return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_WRONG_TYPE})));
+            return geo_result(REDIS_ERR);
         }
-        auto& sset = e->value_sset();
-        return georadius(sset, longitude, latitude, radius, count, flag);
+        return geosearch(*e, nullptr, shape, count, false, flag);
     });
 }
 
 future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::georadius_member_direct(const redis_key& rk, sstring& pos, double radius, size_t count, int flag)
 {
-
-    using return_type = foreign_ptr<lw_shared_ptr<georadius_result_type>>;
-    return current_store().with_entry_run(rk, [this, pos, radius, count, flag] (const cache_entry* e) {
+    ++_stat._georadius;
+    geo::shape shape;
+    shape._radius = radius;
+    return current_store().with_entry_run(rk, [this, &pos, shape, count, flag] (const cache_entry* e) {
         if (e == nullptr) {
-            return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_ERR})));
-        }
-        if (e->type_of_sset() == false) {
-            return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_WRONG_TYPE})));
+            return geo_result(REDIS_ERR);
         }
-        auto& sset = e->value_sset();
-        auto score_opt = sset.score(pos);
-        if (!score_opt) {
-            return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_ERR})));
-        }
-        double longitude = 0, latitude = 0;
-        if (geo::decode_from_geohash(*score_opt, longitude, latitude) == false) {
-            return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_ERR})));
+        return geosearch(*e, &pos, shape, count, false, flag);
+    });
+}
+
+future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::geosearch_direct(const redis_key& rk, sstring& member, bool from_member, geo::shape shape, size_t count, bool any, int flags)
+{
+    ++_stat._geosearch;
+    return current_store().with_entry_run(rk, [this, &member, from_member, shape, count, any, flags] (const cache_entry* e) {
+        if (e == nullptr) {
+            return geo_result(REDIS_NONE);
         }
-        return georadius(sset, longitude, latitude, radius, count, flag);
+        return geosearch(*e, from_member ? &member : nullptr, shape, count, any, flags);
     });
 }
 
-future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::georadius(const sset_lsa& sset, double longitude, double latitude, double radius, size_t count, int flag)
+// The cells which cover the shape are read from a seek to their first score, and
+// their members are matched in batches. Only the members which are returned are
+// copied, after the nearest ones were selected.
+future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::geosearch(const cache_entry& e, const sstring* member, geo::shape shape, size_t count, bool any, int flags)
 {
     ++_stat._read;
-    ++_stat._georadius;
-    using return_type = foreign_ptr<lw_shared_ptr<georadius_result_type>>;
-    using data_type = std::vector<std::tuple<sstring, double, double, double, double>>;
-    data_type points;
-    auto fetch_point = [&sset, count] (double min, double max, double log, double lat, double r, data_type& points) -> size_t {
-        std::vector<const sset_entry*> entries;
-        sset.fetch_by_score(min, max, entries, count);
-        size_t _count = 0;
-        for (size_t i = 0; i < entries.size(); ++i) {
-            auto e = entries[i];
-            double score = e->score(), longitude = 0, latitude = 0, dist = 0;
-            if (geo::decode_from_geohash(score, longitude, latitude) == false) {
-                continue;
-            }
-            if (geo::dist(log, lat, longitude, latitude, dist) == false) {
-                continue;
-            }
-            if (dist < r) {
-                _count++;
-                sstring n(e->key_data(), e->key_size());
-                points.emplace_back(std::move(std::tuple<sstring, double, double, double, double>{std::move(n), score, dist, longitude, latitude}));
-            }
+    if (e.type_of_sset() == false) {
+        return geo_result(REDIS_WRONG_TYPE);
+    }
+    auto& sset = e.value_sset();
+    if (member) {
+        auto score = sset.score(*member);
+        if (!score || geo::decode_from_geohash(*score, shape._longitude, shape._latitude) == false) {
+            return geo_result(REDIS_ERR);
         }
-        return _count;
-    };
-    if (geo::fetch_points_from_location(longitude, latitude, radius, std::move(fetch_point), points) == false) {
-        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_ERR})));
     }
-    if (flag & GEORADIUS_ASC) {
-        std::sort(points.begin(), points.end(), [] (const auto& l, const auto& r) { return std::get<2>(l) > std::get<2>(r); });
+    std::vector<geo::match<sset_entry>> matches;
+    if (geo::search(sset, shape, count, any, flags, matches) == false) {
+        return geo_result(REDIS_ERR);
     }
-    else if (flag & GEORADIUS_DESC) {
-        std::sort(points.begin(), points.end(), [] (const auto& l, const auto& r) { return std::get<2>(l) < std::get<2>(r); });
+    geo::points_type result;
+    result.reserve(matches.size());
+    for (auto& m : matches) {
+        result.emplace_back(sstring(m._entry->key_data(), m._entry->key_size()), m._score, m._point._dist, m._point._longitude, m._point._latitude);
     }
-    if (!points.empty()) ++_stat._hit;
-    return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {std::move(points), REDIS_OK})));
+    if (!result.empty()) ++_stat._hit;
+    return geo_result(REDIS_OK, std::move(result));
 }
 
 future<scattered_message_ptr> database::setbit(const redis_key& rk, size_t offset, bool value)
@@ -1804,27 +2432,25 @@ future<scattered_message_ptr> database::setbit(const redis_key& rk, size_t offse
     return with_allocator(allocator(), [this, &rk, offset, value] {
         return current_store().with_entry_run(rk, [this, &rk, offset, value] (cache_entry* e) {
             auto o = e;
-            size_t offset_in_bytes = offset >> 3;
             if (o == nullptr) {
-               size_t offset_in_bytes = offset >> 3;
-               size_t origin_size = offset_in_bytes + offset_in_bytes / 4;
-               if (origin_size < 15) {
-                   origin_size = 15;
-               }
-               auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), origin_size);
+               // a new key is a compressed bitmap, a string keeps its bytes.
+               auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::bitmap_initializer());
                current_store().insert(entry);
-                --_stat._total_bitmap_entries;
+               ++_stat._total_bitmap_entries;
                o = entry;
             }
-            if (o->type_of_bytes() == false) {
-                return reply_builder::build(msg_type_err);
+            bool result = false;
+            if (o->type_of_bitmap()) {
+                result = o->value_bitmap().set(offset, value);
+            }
+            else if (o->type_of_bytes()) {
+                result = bits_operation::set(o->value_bytes(), offset, value);
             }
-            auto& mbytes = o->value_bytes();
-            if (mbytes.size() < offset_in_bytes) {
-                auto extend_size = offset_in_bytes + offset_in_bytes / 4;
-                mbytes.extend(extend_size, 0);
+            else {
+                return reply_builder::build(msg_type_err);
             }
-            auto result = bits_operation::set(mbytes, offset, value);
+            auto offset_str = to_sstring(offset);
+            log_mutation({ "SETBIT", rk, offset_str, value ? "1" : "0" });
             return reply_builder::build(result ? msg_one : msg_zero);
         });
     });
@@ -1838,11 +2464,16 @@ future<scattered_message_ptr> database::getbit(const redis_key& rk, size_t offse
         if (e == nullptr) {
             return reply_builder::build(msg_zero);
         }
-        if (e->type_of_bytes() == false) {
+        bool result = false;
+        if (e->type_of_bitmap()) {
+            result = e->value_bitmap().get(offset);
+        }
+        else if (e->type_of_bytes()) {
+            result = bits_operation::get(e->value_bytes(), offset);
+        }
+        else {
             return reply_builder::build(msg_type_err);
         }
-        auto& mbytes = e->value_bytes();
-        auto result = bits_operation::get(mbytes, offset);
         ++_stat._hit;
         return reply_builder::build(result ? msg_one : msg_zero);
     });
@@ -1856,19 +2487,110 @@ future<scattered_message_ptr> database::bitcount(const redis_key& rk, long start
         if (e == nullptr) {
             return reply_builder::build(msg_zero);
         }
-        if (e->type_of_bytes() == false) {
+        size_t result = 0;
+        if (e->type_of_bitmap()) {
+            result = e->value_bitmap().count(start, end);
+        }
+        else if (e->type_of_bytes()) {
+            result = bits_operation::count(e->value_bytes(), start, end);
+        }
+        else {
             return reply_builder::build(msg_type_err);
         }
-        auto& mbytes = e->value_bytes();
-        auto result = bits_operation::count(mbytes, start, end);
         ++_stat._hit;
         return reply_builder::build(result);
     });
 }
 
-future<scattered_message_ptr> database::bitpos(const redis_key& rk, bool bit, long start, long end)
+future<scattered_message_ptr> database::bitpos(const redis_key& rk, bool bit, long start, long end, bool end_given)
+{
+    ++_stat._read;
+    ++_stat._bitpos;
+    return current_store().with_entry_run(rk, [this, bit, start, end, end_given] (const cache_entry* e) {
+        if (e == nullptr) {
+            return reply_builder::build(bit ? msg_neg_one : msg_zero);
+        }
+        long result = -1;
+        if (e->type_of_bitmap()) {
+            result = e->value_bitmap().pos(bit, start, end, end_given);
+        }
+        else if (e->type_of_bytes()) {
+            result = bits_operation::pos(e->value_bytes(), bit, start, end, end_given);
+        }
+        else {
+            return reply_builder::build(msg_type_err);
+        }
+        ++_stat._hit;
+        return result < 0 ? reply_builder::build(msg_neg_one) : reply_builder::build(size_t(result));
+    });
+}
+
+future<foreign_ptr<lw_shared_ptr<bitmap_lsa>>> database::get_bitmap_direct(const redis_key& rk)
+{
+    ++_stat._read;
+    using return_type = foreign_ptr<lw_shared_ptr<bitmap_lsa>>;
+    return current_store().with_entry_run(rk, [this] (const cache_entry* e) {
+        if (e == nullptr) {
+            return make_ready_future<return_type>(make_lw_shared<bitmap_lsa>());
+        }
+        // the copy is made by the standard allocator, so it can be read by any shard.
+        if (e->type_of_bitmap()) {
+            ++_stat._hit;
+            return make_ready_future<return_type>(make_lw_shared<bitmap_lsa>(e->value_bitmap()));
+        }
+        if (e->type_of_bytes() == false) {
+            return make_ready_future<return_type>(return_type(nullptr));
+        }
+        auto bytes = sstring {e->value_bytes_data(), e->value_bytes_size()};
+        ++_stat._hit;
+        return make_ready_future<return_type>(make_lw_shared<bitmap_lsa>(bytes.data(), bytes.size()));
+    });
+}
+
+future<scattered_message_ptr> database::bitop_store(const redis_key& rk, const bitmap_lsa& result)
+{
+    ++_stat._bitop;
+    if (result.size() == 0) {
+        return current_store().with_entry_run(rk, [this, &rk] (cache_entry* e) {
+            if (e) {
+                decrease_entries_counter(*e);
+                log_mutation({ "DEL", rk });
+                current_store().erase(*e);
+            }
+            return reply_builder::build(msg_zero);
+        });
+    }
+    return with_allocator(allocator(), [this, &rk, &result] {
+        auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), result);
+        current_store().insert_if(entry, 0, false, false);
+        ++_stat._total_bitmap_entries;
+        log_bitmap(rk, result);
+        return reply_builder::build(size_t(result.size()));
+    });
+}
+
+void database::log_bitmap(const redis_key& rk, const bitmap_lsa& bitmap)
 {
-    return reply_builder::build(msg_nil);
+    if (!_commitlog) {
+        return;
+    }
+    // A sparse bitmap is logged as the SETBITs which rebuild it, the last one sets
+    // its size; a dense one as its bytes, it is replayed as a string.
+    if (bitmap.cardinality() * setbit_log_record_size >= bitmap.size()) {
+        auto bytes = bitmap_bytes(bitmap);
+        log_mutation({ "SET", rk, bytes });
+        return;
+    }
+    log_mutation({ "DEL", rk });
+    auto last = bitmap.size() * 8 - 1;
+    bitmap.for_each_set_bit([this, &rk, last] (uint64_t offset) {
+        if (offset != last) {
+            auto offset_str = to_sstring(offset);
+            log_mutation({ "SETBIT", rk, offset_str, "1" });
+        }
+    });
+    auto last_str = to_sstring(last);
+    log_mutation({ "SETBIT", rk, last_str, bitmap.get(last) ? "1" : "0" });
 }
 
 future<scattered_message_ptr> database::pfadd(const redis_key& rk, std::vector<sstring>& elements)
@@ -1882,11 +2604,16 @@ future<scattered_message_ptr> database::pfadd(const redis_key& rk, std::vector<s
                 --_stat._total_hll_entries;
                 e = entry;
             }
-            if (e->type_of_hll() == false) {
+            if (!holds_hll(*e)) {
                return reply_builder::build(msg_type_err);
             }
             managed_bytes& mbytes = e->value_bytes();
-            auto result = hll::append(mbytes, elements);
+            auto result = hll::append(mbytes, elements, _hll_sparse_max_bytes);
+            if (result) {
+                std::vector<log_arg> record { "PFADD", rk };
+                record.insert(record.end(), elements.begin(), elements.end());
+                log_mutation(record);
+            }
             return reply_builder::build(result);
         });
     });
@@ -1900,7 +2627,7 @@ future<scattered_message_ptr> database::pfcount(const redis_key& rk)
         if (e == nullptr) {
             return reply_builder::build(msg_zero);
         }
-        if (e->type_of_hll() == false) {
+        if (!holds_hll(*e)) {
             return reply_builder::build(msg_type_err);
         }
         auto& mbytes = e->value_bytes();
@@ -1910,22 +2637,32 @@ future<scattered_message_ptr> database::pfcount(const redis_key& rk)
     });
 }
 
-future<scattered_message_ptr> database::pfmerge(const redis_key& rk, uint8_t* merged_sources, size_t size)
+future<scattered_message_ptr> database::pfmerge(const redis_key& rk, const uint8_t* registers)
 {
     ++_stat._pfmerge;
-    return with_allocator(allocator(), [this, &rk, merged_sources, size] {
-        return current_store().with_entry_run(rk, [this, &rk, merged_sources, size] (cache_entry* e) {
+    return with_allocator(allocator(), [this, &rk, registers] {
+        return current_store().with_entry_run(rk, [this, &rk, registers] (cache_entry* e) {
             if (e == nullptr) {
                 auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::hll_initializer());
                 current_store().insert(entry);
                 --_stat._total_hll_entries;
                 e = entry;
             }
-            if (e->type_of_hll() == false) {
+            if (!holds_hll(*e)) {
                 return reply_builder::build(msg_type_err);
             }
             auto& mbytes = e->value_bytes();
-            hll::merge(mbytes, merged_sources, size);
+            hll::merge(mbytes, registers, _hll_sparse_max_bytes);
+            // the sources may be on other shards, so the merged registers are logged
+            // rather than the command.
+            log_arg value { reinterpret_cast<const char*>(mbytes.data()), mbytes.size() };
+            if (e->ever_expires()) {
+                auto at = log_deadline(std::max<int64_t>(e->time_of_live(), 1));
+                log_mutation({ "SET", rk, value, "PXAT", at });
+            }
+            else {
+                log_mutation({ "SET", rk, value });
+            }
             return reply_builder::build(msg_ok);
         });
     });
@@ -1938,6 +2675,186 @@ future<> database::start()
 
 future<> database::stop()
 {
+    _reclaimed_keys_timer.cancel();
+    auto updated = std::move(_out_of_memory_update);
+    _out_of_memory_update = make_ready_future<>();
+    return updated.then([this] {
+        if (_commitlog) {
+            log_reclaimed_keys();
+            return _commitlog->stop();
+        }
+        return make_ready_future<>();
+    });
+}
+
+future<> database::start_commitlog(uint64_t generation)
+{
+    _commitlog = std::make_unique<commit_log>(commit_log::make_config(*_config));
+    return _commitlog->start(generation);
+}
+
+future<uint64_t> database::snapshot(sstring path)
+{
+    return open_file_dma(path, open_flags::wo | open_flags::create | open_flags::truncate).then([this] (file f) {
+        auto writer = make_lw_shared<snapshot_writer>(make_file_output_stream(std::move(f)));
+        // the cut of the commit log and the start of the walk are the same point in time.
+        if (_commitlog) {
+            log_reclaimed_keys();
+        }
+        uint64_t first_segment = _commitlog ? _commitlog->cut() : 0;
+        for (auto& store : _cache_stores) {
+            store.start_snapshot([this, writer] (const cache_entry& e) {
+                // the views of the values must stay valid while they are encoded.
+                logalloc::reclaim_lock lock(*this);
+                writer->write(e);
+            });
+        }
+        return do_for_each(std::begin(_cache_stores), std::end(_cache_stores), [writer] (cache& store) {
+            return repeat([&store, writer] {
+                bool done = store.snapshot_step(std::chrono::microseconds(int64_t(snapshot_budget_us)));
+                return writer->flush().then([done] {
+                    if (done) {
+                        return make_ready_future<stop_iteration>(stop_iteration::yes);
+                    }
+                    return later().then([] {
+                        return stop_iteration::no;
+                    });
+                });
+            }).finally([&store] {
+                store.end_snapshot();
+            });
+        }).finally([this, writer] {
+            for (auto& store : _cache_stores) {
+                if (store.snapshotting()) {
+                    store.end_snapshot();
+                }
+            }
+            return writer->close().finally([this, writer] {
+                _stat._snapshot_entries += writer->entries();
+                _stat._snapshot_bytes += writer->bytes();
+            });
+        }).then([first_segment] {
+            return first_segment;
+        });
+    });
+}
+
+size_t database::restore(std::vector<char>& records)
+{
+    return with_allocator(allocator(), [this, &records] {
+        auto now = unix_time_ms();
+        size_t restored = 0;
+        snapshot_reader reader(records.data(), records.size());
+        while (!reader.empty()) {
+            auto record = reader.record();
+            auto type = static_cast<entry_type>(record.u8());
+            auto key = record.bytes();
+            auto expire_at = static_cast<int64_t>(record.u64());
+            if (expire_at != -1 && expire_at <= now) {
+                continue;
+            }
+            redis_key rk { std::ref(key) };
+            cache_entry* entry = nullptr;
+            switch (type) {
+                case entry_type::ENTRY_FLOAT:
+                    entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), record.f64());
+                    ++_stat._total_counter_entries;
+                    break;
+                case entry_type::ENTRY_INT64:
+                    entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), static_cast<int64_t>(record.u64()));
+                    ++_stat._total_counter_entries;
+                    break;
+                case entry_type::ENTRY_BYTES:
+                    entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), record.bytes());
+                    ++_stat._total_string_entries;
+                    break;
+                case entry_type::ENTRY_HLL: {
+                    entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::hll_initializer());
+                    auto v = record.view();
+                    // either encoding, as it was saved.
+                    entry->value_bytes() = managed_bytes(bytes_view(reinterpret_cast<const int8_t*>(v.first), v.second));
+                    ++_stat._total_hll_entries;
+                    break;
+                }
+                case entry_type::ENTRY_BITMAP: {
+                    entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::bitmap_initializer());
+                    auto v = record.view();
+                    entry->value_bitmap().deserialize(v.first, v.second);
+                    ++_stat._total_bitmap_entries;
+                    break;
+                }
+                case entry_type::ENTRY_LIST: {
+                    entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::list_initializer());
+                    auto& list = entry->value_list();
+                    for (auto n = record.u32(); n > 0; --n) {
+                        list.insert_tail(record.bytes());
+                    }
+                    ++_stat._total_list_entries;
+                    break;
+                }
+                case entry_type::ENTRY_MAP: {
+                    entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::dict_initializer());
+                    auto& map = entry->value_map();
+                    for (auto n = record.u32(); n > 0; --n) {
+                        auto field = record.view();
+                        auto field_type = static_cast<dict_entry::entry_type>(record.u8());
+                        if (field_type == dict_entry::entry_type::FLOAT) {
+                            map.insert_or_update(dict_entry_view(field.first, field.second, record.f64()));
+                        }
+                        else if (field_type == dict_entry::entry_type::INTEGER) {
+                            map.insert_or_update(dict_entry_view(field.first, field.second, static_cast<int64_t>(record.u64())));
+                        }
+                        else {
+                            auto value = record.view();
+                            map.insert_or_update(dict_entry_view(field.first, field.second, value.first, value.second));
+                        }
+                    }
+                    ++_stat._total_dict_entries;
+                    break;
+                }
+                case entry_type::ENTRY_SET: {
+                    entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::set_initializer());
+                    auto& set = entry->value_set();
+                    for (auto n = record.u32(); n > 0; --n) {
+                        set.insert(record.bytes());
+                    }
+                    ++_stat._total_set_entries;
+                    break;
+                }
+                case entry_type::ENTRY_SSET: {
+                    entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::sset_initializer());
+                    auto& sset = entry->value_sset();
+                    for (auto n = record.u32(); n > 0; --n) {
+                        auto member = record.bytes();
+                        sset.insert(current_allocator().construct<sset_entry>(member, record.f64()));
+                    }
+                    ++_stat._total_zset_entries;
+                    break;
+                }
+                default:
+                    throw std::runtime_error(sprint("unknown snapshot entry type %d", static_cast<unsigned>(type)));
+            }
+            current_store().with_entry_run(rk, [this] (const cache_entry* e) {
+                if (e) {
+                    decrease_entries_counter(*e);
+                }
+            });
+            current_store().replace(entry);
+            if (expire_at != -1) {
+                current_store().expire(rk, static_cast<long>(expire_at - now));
+            }
+            ++restored;
+        }
+        _stat._restored_entries += restored;
+        return restored;
+    });
+}
+
+future<> database::commitlog_sync_point()
+{
+    if (_commitlog && _commitlog->batch_mode()) {
+        return _commitlog->sync_point();
+    }
     return make_ready_future<>();
 }
 }
@@ -31,10 +31,14 @@
 #include "geo.hh"
 #include "bits_operation.hh"
 #include <tuple>
+#include <experimental/optional>
 #include "cache.hh"
 #include "reply_builder.hh"
 #include  <experimental/vector>
 #include "config.hh"
+#include "commitlog.hh"
+#include "utils/latency_histogram.hh"
+#include "slowlog.hh"
 namespace stdx = std::experimental;
 namespace redis {
 using scattered_message_ptr = foreign_ptr<lw_shared_ptr<scattered_message<char>>>;
@@ -50,14 +54,14 @@ inline database& get_local_database() {
 
 class database final : private logalloc::region {
 public:
-    database();
+    database(const redis::config& cfg);
     ~database();
 
-    future<scattered_message_ptr> set(const redis_key& rk, sstring& val, long expire, uint32_t flag);
-    bool set_direct(const redis_key& rk, sstring& val, long expire, uint32_t flag);
+    future<scattered_message_ptr> set(const redis_key& rk, const temporary_buffer<char>& val, long expire, uint32_t flag);
+    bool set_direct(const redis_key& rk, const temporary_buffer<char>& val, long expire, uint32_t flag);
 
     future<scattered_message_ptr> counter_by(const redis_key& rk, int64_t step, bool incr);
-    future<scattered_message_ptr> append(const redis_key& rk, sstring& val);
+    future<scattered_message_ptr> append(const redis_key& rk, const temporary_buffer<char>& val);
 
     future<scattered_message_ptr> del(const redis_key& key);
     bool del_direct(const redis_key& key);
@@ -67,6 +71,13 @@ public:
 
     future<scattered_message_ptr> get(const redis_key& key);
     future<foreign_ptr<lw_shared_ptr<sstring>>> get_direct(const redis_key& rk);
+
+    // Entries of the multi-key commands, each handles all the keys of a request
+    // owned by this shard.
+    future<foreign_ptr<lw_shared_ptr<std::vector<std::experimental::optional<sstring>>>>> get_batch(key_batch& batch);
+    size_t set_batch(key_batch& batch);
+    size_t del_batch(key_batch& batch);
+    size_t exists_batch(key_batch& batch);
     future<scattered_message_ptr> strlen(const redis_key& key);
 
     future<scattered_message_ptr> expire(const redis_key& rk, long expired);
@@ -75,6 +86,14 @@ public:
     future<scattered_message_ptr> pttl(const redis_key& rk);
     future<scattered_message_ptr> ttl(const redis_key& rk);
     bool select(size_t index);
+    // A slice of the keys of this shard for SCAN: the keys of the buckets from the
+    // cursor on, which match the pattern unless it is empty, and are of the type
+    // unless it is empty; and the cursor of the next slice, 0 once all were.
+    struct scan_result {
+        size_t _cursor = 0;
+        std::vector<sstring> _keys;
+    };
+    scan_result scan(size_t cursor, size_t count, const sstring& pattern, const sstring& type);
 
     // [LIST]
     future<scattered_message_ptr> push(const redis_key& rk, sstring& value, bool force, bool left);
@@ -102,7 +121,9 @@ public:
     future<scattered_message_ptr> hgetall(const redis_key& rk);
     future<scattered_message_ptr> hgetall_values(const redis_key& rk);
     future<scattered_message_ptr> hgetall_keys(const redis_key& rk);
+    future<scattered_message_ptr> hrandfield(const redis_key& rk, int64_t count, bool with_count, bool with_values);
     future<scattered_message_ptr> hmget(const redis_key& rk, std::vector<sstring>& keys);
+    future<scattered_message_ptr> hscan(const redis_key& rk, uint64_t cursor, size_t count, const sstring& pattern);
 
     // [SET]
     future<scattered_message_ptr> sadds(const redis_key& rk, std::vector<sstring>& members);
@@ -110,14 +131,17 @@ public:
     bool sadd_direct(const redis_key& rk, sstring& member);
     future<scattered_message_ptr> sadd(const redis_key& rk, sstring& member);
     future<scattered_message_ptr> scard(const redis_key& rk);
+    long scard_direct(const redis_key& rk);
     future<scattered_message_ptr> sismember(const redis_key& rk, sstring& member);
     future<scattered_message_ptr> smembers(const redis_key& rk);
-    future<scattered_message_ptr> spop(const redis_key& rk, size_t count);
+    future<scattered_message_ptr> spop(const redis_key& rk, size_t count, bool with_count);
     future<scattered_message_ptr> srem(const redis_key& rk, sstring& member);
     bool srem_direct(const redis_key& rk, sstring& member);
     future<scattered_message_ptr> srems(const redis_key& rk, std::vector<sstring>& members);
     future<foreign_ptr<lw_shared_ptr<std::vector<sstring>>>> smembers_direct(const redis_key& rk);
-    future<scattered_message_ptr> srandmember(const redis_key& rk, size_t count);
+    future<foreign_ptr<lw_shared_ptr<std::vector<size_t>>>> sprobe_direct(const redis_key& rk, std::vector<sstring>& members, bool exists, size_t limit);
+    future<scattered_message_ptr> srandmember(const redis_key& rk, int64_t count, bool with_count);
+    future<scattered_message_ptr> sscan(const redis_key& rk, uint64_t cursor, size_t count, const sstring& pattern);
 
 
     // [SORTED SET]
@@ -129,11 +153,20 @@ public:
     future<scattered_message_ptr> zincrby(const redis_key& rk, sstring& member, double delta);
     future<scattered_message_ptr> zrange(const redis_key& rk, long begin, long end, bool reverse, bool with_score);
     future<foreign_ptr<lw_shared_ptr<std::vector<std::pair<sstring, double>>>>> zrange_direct(const redis_key& rk, long begin, long end);
+    future<foreign_ptr<lw_shared_ptr<std::vector<std::pair<sstring, double>>>>> zrange_by_member_direct(const redis_key& rk, sstring& after, bool from_start, size_t count);
+    // ZUNIONSTORE / ZINTERSTORE build their result in batches, which replaces
+    // the destination on commit.
+    bool zstore_batch_direct(uint64_t id, std::vector<std::pair<sstring, double>>& batch);
+    size_t zstore_commit_direct(const redis_key& rk, uint64_t id);
+    bool zstore_abort_direct(uint64_t id);
     future<scattered_message_ptr> zrangebyscore(const redis_key& rk, double min, double max, bool reverse, bool with_score);
     future<scattered_message_ptr> zrank(const redis_key& rk, sstring& member, bool reverse);
     future<scattered_message_ptr> zscore(const redis_key& rk, sstring& member);
     future<scattered_message_ptr> zremrangebyscore(const redis_key& rk, double min, double max);
     future<scattered_message_ptr> zremrangebyrank(const redis_key& rk, size_t begin, size_t end);
+    // The cursor of ZSCAN is the score of the entry the previous call stopped at,
+    // see sset_lsa::fetch_scan().
+    future<scattered_message_ptr> zscan(const redis_key& rk, uint64_t cursor, size_t count, const sstring& pattern);
 
     // [GEO]
     future<scattered_message_ptr> geodist(const redis_key& rk, sstring& lpos, sstring& rpos, int flag);
@@ -142,28 +175,83 @@ public:
     using georadius_result_type = std::pair<std::vector<std::tuple<sstring, double, double, double, double>>, int>;
     future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> georadius_coord_direct(const redis_key& rk, double longtitude, double latitude, double radius, size_t count, int flag);
     future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> georadius_member_direct(const redis_key& rk, sstring& pos, double radius, size_t count, int flag);
+    // GEOSEARCH around the center of the shape, or around member if from_member. A
+    // missing key is REDIS_NONE, a missing member REDIS_ERR.
+    future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> geosearch_direct(const redis_key& rk, sstring& member, bool from_member, geo::shape shape, size_t count, bool any, int flags);
 
     // [BITMAP]
     future<scattered_message_ptr> setbit(const redis_key& rk, size_t offset, bool value);
     future<scattered_message_ptr> getbit(const redis_key& rk, size_t offset);
     future<scattered_message_ptr> bitcount(const redis_key& rk, long start, long end);
-    future<scattered_message_ptr> bitop(const redis_key& rk, int flags, std::vector<sstring>& keys);
-    future<scattered_message_ptr> bitpos(const redis_key& rk, bool bit, long start, long end);
+    future<scattered_message_ptr> bitpos(const redis_key& rk, bool bit, long start, long end, bool end_given);
+    // a copy of the bitmap of a string for BITOP: empty if the key is missing, null
+    // if it is not a string.
+    future<foreign_ptr<lw_shared_ptr<bitmap_lsa>>> get_bitmap_direct(const redis_key& rk);
+    // stores the result of BITOP, an empty result deletes the key.
+    future<scattered_message_ptr> bitop_store(const redis_key& rk, const bitmap_lsa& result);
 
     // [HLL]
     future<scattered_message_ptr> pfadd(const redis_key& rk, std::vector<sstring>& keys);
     future<scattered_message_ptr> pfcount(const redis_key& rk);
-    future<scattered_message_ptr> pfmerge(const redis_key& rk, uint8_t* merged_sources, size_t size);
+    future<scattered_message_ptr> pfmerge(const redis_key& rk, const uint8_t* registers);
     future<foreign_ptr<lw_shared_ptr<sstring>>> get_hll_direct(const redis_key& rk);
 
     future<> start();
     future<> stop();
 
+    // Starts logging the mutations of this shard, after the log was replayed.
+    future<> start_commitlog(uint64_t generation);
+    // Resolves once the mutations applied so far are durable. Ready at once
+    // unless the log syncs in batch mode.
+    future<> commitlog_sync_point();
+    inline bool commitlog_batch_mode() const {
+        return _commitlog && _commitlog->batch_mode();
+    }
+    inline uint64_t commitlog_generation() const {
+        return _commitlog ? _commitlog->generation() : 0;
+    }
+
+    // Writes a point in time snapshot of this shard to the file, and resolves with
+    // the first commit log segment which is not covered by it.
+    future<uint64_t> snapshot(sstring path);
+    // Restores the entries of the snapshot records, returns how many were alive.
+    size_t restore(std::vector<char>& records);
+
     const redis::config& get_config() const {
         return *_config;
     }
+
+    // The memory used by the keys of this shard: the LSA, and the directories of
+    // the bitmaps which are outside of it.
+    inline size_t used_memory() const {
+        return occupancy().used_space() + bitmap_lsa::directory_memory();
+    }
+    // True while any shard is above its maxmemory and cannot evict, the writes
+    // which may use more memory are rejected meanwhile.
+    inline bool out_of_memory() const {
+        return _out_of_memory_shards > 0;
+    }
+    inline void note_oom_rejection() {
+        ++_stat._oom_rejections;
+    }
+    inline redis::slowlog& get_slowlog() {
+        return _slowlog;
+    }
+    inline latency_monitor& get_latency_monitor() {
+        return _latency_monitor;
+    }
+    // Traces an operation which was sent by a shard at sent, and ran from start to end.
+    inline void trace_operation(bool remote, steady_clock_type::time_point sent, steady_clock_type::time_point start, steady_clock_type::time_point end) {
+        if (remote) {
+            _hop_latency.add(start - sent);
+        }
+        _execute_latency.add(end - start);
+    }
 private:
-    future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> georadius(const sset_lsa&, double longtitude, double latitude, double radius, size_t count, int flag);
+    // The members of the sorted set of e which are in the shape, around member if it
+    // is not null. At most count of them if count is not 0, any ones if any, else the
+    // nearest ones.
+    future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> geosearch(const cache_entry& e, const sstring* member, geo::shape shape, size_t count, bool any, int flags);
     static inline long alignment_index_base_on(size_t size, long index)
     {
         if (index < 0) {
@@ -184,7 +272,7 @@ private:
                 return reply_builder::build(msg_type_err);
             }
             auto& map = e->value_map();
-            std::vector<const dict_entry*> entries;
+            std::vector<dict_entry_view> entries;
             map.fetch(entries);
             if (!entries.empty()) ++_stat._hit;
             return reply_builder::build<Key, Value>(entries);
@@ -208,6 +296,15 @@ private:
         uint64_t _total_bitmap_entries = 0;
         uint64_t _total_hll_entries = 0;
 
+        uint64_t _batch_messages = 0;
+        uint64_t _batch_keys = 0;
+        uint64_t _snapshot_entries = 0;
+        uint64_t _snapshot_bytes = 0;
+        uint64_t _restored_entries = 0;
+        uint64_t _evicted_keys = 0;
+        uint64_t _reclaim_evictions = 0;
+        uint64_t _oom_rejections = 0;
+
         uint64_t _echo = 0;
         uint64_t _set = 0;
         uint64_t _get = 0;
@@ -243,7 +340,9 @@ private:
         uint64_t _hgetall = 0;
         uint64_t _hgetall_keys = 0;
         uint64_t _hgetall_values = 0;
+        uint64_t _hrandfield = 0;
         uint64_t _hmget = 0;
+        uint64_t _hscan = 0;
         uint64_t _smembers = 0;
         uint64_t _sadd = 0;
         uint64_t _scard = 0;
@@ -258,7 +357,9 @@ private:
         uint64_t _smove = 0;
         uint64_t _srandmember = 0;
         uint64_t _spop = 0;
+        uint64_t _sscan = 0;
         uint64_t _type = 0;
+        uint64_t _scan = 0;
         uint64_t _expire = 0;
         uint64_t _pexpire = 0;
         uint64_t _pttl = 0;
@@ -283,12 +384,14 @@ private:
         uint64_t _zinter = 0;
         uint64_t _zrangebylex = 0;
         uint64_t _zlexcount = 0;
+        uint64_t _zscan = 0;
         uint64_t _select  = 0;
         uint64_t _geoadd = 0;
         uint64_t _geodist = 0;
         uint64_t _geohash = 0;
         uint64_t _geopos = 0;
         uint64_t _georadius = 0;
+        uint64_t _geosearch = 0;
         uint64_t _setbit = 0;
         uint64_t _getbit = 0;
         uint64_t _bitcount = 0;
@@ -302,6 +405,85 @@ private:
     stats _stat;
     void setup_metrics();
     size_t sum_expiring_entries();
+    void decrease_entries_counter(const cache_entry& e);
+    template <typename Func>
+    uint64_t sum_stores(Func&& func)
+    {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < DEFAULT_DB_COUNT; ++i) {
+            sum += func(_cache_stores[i]);
+        }
+        return sum;
+    }
+    uint64_t max_rehash_stall();
+    // Evicts keys until this shard is below maxmemory, for at most
+    // max_evictions_per_operation keys before every operation.
+    static constexpr size_t max_evictions_per_operation = 128;
+    void enforce_maxmemory();
+    void set_shard_out_of_memory(bool oom);
+    bool evict_one(bool reclaiming);
+    memory::reclaiming_result reclaim();
+    // The LSA reclaimer must neither allocate nor append to the commit log: the keys
+    // it evicts are queued here, a 32 bits size before each, in a buffer reserved
+    // up front, and logged as DELs before the next mutation or by the timer.
+    static constexpr size_t reclaimed_keys_capacity = 64 * 1024;
+    std::vector<char> _reclaimed_keys;
+    timer<> _reclaimed_keys_timer;
+    void log_reclaimed_keys();
+    // the updates of _out_of_memory_shards on all the shards, in order.
+    future<> _out_of_memory_update = make_ready_future<>();
+    size_t _maxmemory = 0;
+    size_t _hll_sparse_max_bytes = 0;
+    eviction_policy _eviction_policy = eviction_policy::noeviction;
+    bool _shard_out_of_memory = false;
+    // the number of the shards which are out of memory.
+    unsigned _out_of_memory_shards = 0;
+    inline void log_mutation(std::initializer_list<log_arg> args) {
+        if (_commitlog) {
+            if (!_reclaimed_keys.empty()) log_reclaimed_keys();
+            _commitlog->append(args);
+        }
+    }
+    inline void log_mutation(const std::vector<log_arg>& args) {
+        if (_commitlog) {
+            if (!_reclaimed_keys.empty()) log_reclaimed_keys();
+            _commitlog->append(args);
+        }
+    }
+    static constexpr size_t zstore_log_chunk = 1024;
+    // about the size of a logged SETBIT.
+    static constexpr size_t setbit_log_record_size = 48;
+    void log_bitmap(const redis_key& rk, const bitmap_lsa& bitmap);
+    // a snapshot walks the cache for at most this long before yielding.
+    static constexpr int64_t snapshot_budget_us = 500;
+    void log_zadd(const redis_key& rk, const std::unordered_map<sstring, double>& members, int flags);
+    void log_sset(const redis_key& rk, const sset_lsa& sset);
     std::unique_ptr<redis::config> _config;
+    std::unique_ptr<commit_log> _commitlog;
+    // The results of ZUNIONSTORE / ZINTERSTORE under construction, keyed by build id.
+    std::unordered_map<uint64_t, managed_ref<sset_lsa>> _zstore_staging;
+    // the time the operations waited to reach this shard, and ran on it.
+    utils::latency_histogram _hop_latency;
+    utils::latency_histogram _execute_latency;
+    redis::slowlog _slowlog;
+    latency_monitor _latency_monitor;
 };
+
+// Runs a database operation on a shard, as get_database().invoke_on() does, and
+// traces there how long the request took to reach the shard and how long the
+// operation ran, up to the future it returned.
+template <typename Ret, typename... FuncArgs, typename... Args>
+inline futurize_t<Ret> invoke_on_owner(unsigned cpu, Ret (database::*func)(FuncArgs...), Args&&... args)
+{
+    auto origin = engine().cpu_id();
+    auto sent = steady_clock_type::now();
+    return get_database().invoke_on(cpu, [origin, sent, func, args = std::make_tuple(std::forward<Args>(args)...)] (database& db) mutable {
+        auto start = steady_clock_type::now();
+        auto f = futurize<Ret>::apply([&db, func] (auto&&... a) {
+            return (db.*func)(std::forward<decltype(a)>(a)...);
+        }, std::move(args));
+        db.trace_operation(origin != engine().cpu_id(), sent, start, steady_clock_type::now());
+        return f;
+    });
+}
 }
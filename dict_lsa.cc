@@ -19,4 +19,7 @@
 *
 */
 #include "dict_lsa.hh"
-namespace redis {}
+namespace redis {
+thread_local packed_limits hash_packed_limits;
+thread_local packed_limits set_packed_limits;
+}
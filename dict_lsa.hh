@@ -19,7 +19,7 @@
 *
 */
 #pragma once
-#include <boost/intrusive/set.hpp>
+#include "hash_table.hh"
 #include "utils/allocation_strategy.hh"
 #include "utils/managed_ref.hh"
 #include "utils/managed_bytes.hh"
@@ -29,14 +29,28 @@
 #include "common.hh"
 #include "core/sstring.hh"
 #include  <experimental/vector>
+#include <limits>
+#include <unordered_set>
 namespace stdx = std::experimental;
 namespace redis {
 
+// A dict_lsa keeps its fields packed back to back in one managed_bytes while it
+// has no more than max_entries fields, every key and value is no longer than
+// max_value bytes and they take no more than max_packed_bytes, then converts
+// itself to the hash table for good.
+// The limits are per shard, database sets them up from the config.
+struct packed_limits {
+    size_t max_entries = 128;
+    size_t max_value = 64;
+};
+extern thread_local packed_limits hash_packed_limits;
+extern thread_local packed_limits set_packed_limits;
+
 class dict_lsa;
 struct dict_entry
 {
     friend class dict_lsa;
-    using hook_type = boost::intrusive::set_member_hook<>;
+    using hook_type = hash_table_hook;
     hook_type _link;
     managed_bytes _key;
     size_t _key_hash;
@@ -47,7 +61,7 @@ struct dict_entry
         storage() {}
         ~storage() {}
     } _u;
-    enum class entry_type
+    enum class entry_type : uint8_t
     {
         BYTES   = 0,
         FLOAT   = 1,
@@ -55,37 +69,39 @@ struct dict_entry
     };
     entry_type _type;
 
-    dict_entry(const sstring& key, const sstring& val) noexcept
+    static inline bytes_view view_of(const sstring& s) noexcept
+    {
+        return bytes_view {reinterpret_cast<const signed char*>(s.data()), s.size()};
+    }
+
+    dict_entry(bytes_view key, entry_type type) noexcept
         : _link()
-        , _key(std::move(*(current_allocator().construct<managed_bytes>(bytes_view {reinterpret_cast<const signed char*>(key.data()), key.size()}))))
+        , _key(key)
         , _key_hash(std::hash<managed_bytes>()(_key))
-        , _type(entry_type::BYTES)
+        , _type(type)
     {
-        _u._data = std::move(*(current_allocator().construct<managed_bytes>(bytes_view {reinterpret_cast<const signed char*>(val.data()), val.size()})));
+    }
+
+    dict_entry(const sstring& key, const sstring& val) noexcept
+        : dict_entry(view_of(key), entry_type::BYTES)
+    {
+        new (&_u._data) managed_bytes(view_of(val));
     }
 
     dict_entry(const sstring& key) noexcept
-        : _link()
-        , _key(std::move(*(current_allocator().construct<managed_bytes>(bytes_view {reinterpret_cast<const signed char*>(key.data()), key.size()}))))
-        , _key_hash(std::hash<managed_bytes>()(_key))
-        , _type(entry_type::BYTES)
+        : dict_entry(view_of(key), entry_type::BYTES)
     {
+        new (&_u._data) managed_bytes();
     }
 
     dict_entry(const sstring& key, double data) noexcept
-        : _link()
-        , _key(std::move(*(current_allocator().construct<managed_bytes>(bytes_view {reinterpret_cast<const signed char*>(key.data()), key.size()}))))
-        , _key_hash(std::hash<managed_bytes>()(_key))
-        , _type(entry_type::FLOAT)
+        : dict_entry(view_of(key), entry_type::FLOAT)
     {
         _u._float = data;
     }
 
     dict_entry(const sstring& key, int64_t data) noexcept
-        : _link()
-        , _key(std::move(*(current_allocator().construct<managed_bytes>(bytes_view {reinterpret_cast<const signed char*>(key.data()), key.size()}))))
-        , _key_hash(std::hash<managed_bytes>()(_key))
-        , _type(entry_type::INTEGER)
+        : dict_entry(view_of(key), entry_type::INTEGER)
     {
         _u._integer = data;
     }
@@ -98,7 +114,7 @@ struct dict_entry
     {
         switch (_type) {
             case entry_type::BYTES:
-                 _u._data = std::move(o._u._data);
+                 new (&_u._data) managed_bytes(std::move(o._u._data));
                  break;
             case entry_type::FLOAT:
                  _u._float = o._u._float;
@@ -109,24 +125,26 @@ struct dict_entry
         }
     }
 
-    struct compare {
-        inline bool compare_impl(const char* d1, size_t s1, const char* d2, size_t s2) const noexcept {
-            const int len = std::min(s1, s2);
-            auto r = memcmp(d1, d2, len);
-            if (r == 0) {
-                if (s1 < s2) return true;
-                else if (s1 > s2) return false;
-            }
-            return r < 0;
+    ~dict_entry()
+    {
+        if (_type == entry_type::BYTES) {
+            _u._data.~managed_bytes();
         }
-        inline bool operator () (const dict_entry& l, const dict_entry& r) const noexcept {
-            return compare_impl(l.key_data(), l.key_size(), r.key_data(), r.key_size());
+    }
+
+    static inline size_t hash_of(const sstring& k) noexcept {
+        return std::hash<sstring_view>()(sstring_view {k.data(), k.size()});
+    }
+
+    struct hash {
+        inline size_t operator () (const dict_entry& e) const noexcept {
+            return e._key_hash;
         }
+    };
+
+    struct key_equal {
         inline bool operator () (const sstring& k, const dict_entry& e) const noexcept {
-            return compare_impl(k.data(), k.size(), e.key_data(), e.key_size());
-        }
-        inline bool operator () (const dict_entry& e, const sstring& k) const noexcept {
-            return compare_impl(e.key_data(), e.key_size(), k.data(), k.size());
+            return k.size() == e.key_size() && memcmp(k.data(), e.key_data(), k.size()) == 0;
         }
     };
 
@@ -181,22 +199,103 @@ struct dict_entry
     }
 };
 
+// A read only field of dict_lsa, which points either to a dict_entry or into the
+// packed fields. It is only valid until the dict_lsa is modified.
+class dict_entry_view {
+    using entry_type = dict_entry::entry_type;
+    const char* _key = nullptr;
+    size_t _key_size = 0;
+    entry_type _type = entry_type::BYTES;
+    const char* _data = nullptr;
+    size_t _data_size = 0;
+    double _float = 0;
+    int64_t _integer = 0;
+    bool _exists = false;
+public:
+    dict_entry_view() noexcept {}
+
+    explicit dict_entry_view(const dict_entry& e) noexcept
+        : _key(e.key_data())
+        , _key_size(e.key_size())
+        , _type(e._type)
+        , _exists(true)
+    {
+        switch (_type) {
+            case entry_type::BYTES:
+                _data = e.value_bytes_data();
+                _data_size = e.value_bytes_size();
+                break;
+            case entry_type::FLOAT:
+                _float = e.value_float();
+                break;
+            case entry_type::INTEGER:
+                _integer = e.value_integer();
+                break;
+        }
+    }
+
+    dict_entry_view(const char* key, size_t key_size, const char* data, size_t data_size) noexcept
+        : _key(key), _key_size(key_size), _type(entry_type::BYTES), _data(data), _data_size(data_size), _exists(true)
+    {
+    }
+
+    dict_entry_view(const char* key, size_t key_size, double data) noexcept
+        : _key(key), _key_size(key_size), _type(entry_type::FLOAT), _float(data), _exists(true)
+    {
+    }
+
+    dict_entry_view(const char* key, size_t key_size, int64_t data) noexcept
+        : _key(key), _key_size(key_size), _type(entry_type::INTEGER), _integer(data), _exists(true)
+    {
+    }
+
+    explicit operator bool() const { return _exists; }
+    inline entry_type type() const { return _type; }
+    inline bool type_of_bytes() const { return _type == entry_type::BYTES; }
+    inline bool type_of_integer() const { return _type == entry_type::INTEGER; }
+    inline bool type_of_float() const { return _type == entry_type::FLOAT; }
+    inline const char* key_data() const { return _key; }
+    inline size_t key_size() const { return _key_size; }
+    inline const char* value_bytes_data() const { return _data; }
+    inline size_t value_bytes_size() const { return _data_size; }
+    inline double value_float() const { return _float; }
+    inline int64_t value_integer() const { return _integer; }
+};
+
 class database;
 class dict_lsa final {
     friend class database;
-    using dict_type = boost::intrusive::set<dict_entry,
-        boost::intrusive::member_hook<dict_entry, dict_entry::hook_type, &dict_entry::_link>,
-        boost::intrusive::compare<dict_entry::compare>>;
-    using iterator = typename dict_type::iterator;
-    using const_iterator = typename dict_type::const_iterator;
+    using dict_type = hash_table<dict_entry, &dict_entry::_link, dict_entry::hash>;
+    using entry_type = dict_entry::entry_type;
+    static constexpr size_t npos = std::numeric_limits<size_t>::max();
+    // both lengths of the packed fields are one byte.
+    static constexpr size_t max_packed_length = std::numeric_limits<uint8_t>::max();
+    // The packed fields are written in place, so they must never be fragmented:
+    // they stay well below the largest contiguous allocation of the LSA, about
+    // 26KB, whatever the limits.
+    static constexpr size_t max_packed_bytes = 16 * 1024;
+
+    const packed_limits* _limits;
     dict_type _dict;
+    // The packed fields. Every field is laid out as:
+    //   [key size: 1][key][type: 1][value size: 1][value]  for bytes,
+    //   [key size: 1][key][type: 1][value: 8]              for float and integer.
+    managed_bytes _packed;
+    size_t _packed_count = 0;
+    bool _is_packed = true;
 public:
-    dict_lsa () noexcept : _dict()
+    explicit dict_lsa (const packed_limits& limits) noexcept : _limits(&limits), _dict(), _packed()
     {
     }
 
-    dict_lsa (dict_lsa&& o) noexcept : _dict(std::move(o._dict))
+    dict_lsa (dict_lsa&& o) noexcept
+        : _limits(o._limits)
+        , _dict(std::move(o._dict))
+        , _packed(std::move(o._packed))
+        , _packed_count(o._packed_count)
+        , _is_packed(o._is_packed)
     {
+        o._packed_count = 0;
     }
 
     ~dict_lsa ()
@@ -206,65 +305,85 @@ public:
 
     void flush_all()
     {
-        _dict.erase_and_dispose(_dict.begin(), _dict.end(), current_deleter<dict_entry>());
+        _dict.clear_and_dispose(current_deleter<dict_entry>());
+        _packed = managed_bytes();
+        _packed_count = 0;
+        _is_packed = true;
+    }
+
+    inline bool packed() const {
+        return _is_packed;
     }
 
-    bool insert(dict_entry* e)
+    // Inserts the field if it does not exist, returns false otherwise.
+    inline bool insert(const sstring& key)
     {
-        assert(e != nullptr);
-        auto r = _dict.insert(*e);
-        return r.second;
+        return insert_field(dict_entry_view(key.data(), key.size(), "", 0), false);
     }
 
-    template <typename Func>
-    inline std::result_of_t<Func(const dict_entry* e)> with_entry_run(const sstring& k, Func&& func) const {
-        auto it = _dict.find(k, dict_entry::compare());
-        if (it != _dict.end()) {
-            const auto& e = *it;
-            return func(&e);
-        }
-        else {
-            return func(nullptr);
-        }
+    inline bool insert(const sstring& key, const sstring& val)
+    {
+        return insert_field(dict_entry_view(key.data(), key.size(), val.data(), val.size()), false);
     }
 
+    // Inserts or overwrites the field, returns true if it did not exist.
+    inline bool insert_or_update(const sstring& key, const sstring& val)
+    {
+        return insert_field(dict_entry_view(key.data(), key.size(), val.data(), val.size()), true);
+    }
+
+    // Inserts or overwrites the field with the value and type of the view.
+    inline bool insert_or_update(const dict_entry_view& field)
+    {
+        return insert_field(field, true);
+    }
+
+    // Adds delta to the numeric field, which is created if it does not exist, then
+    // runs func with it, or with nullptr if the field holds another type.
     template <typename Func>
-    inline std::result_of_t<Func(dict_entry* e)> with_entry_run(const sstring& k, Func&& func) {
-        auto it = _dict.find(k, dict_entry::compare());
-        if (it != _dict.end()) {
-            auto& e = *it;
-            return func(&e);
-        }
-        else {
-            return func(nullptr);
-        }
+    inline std::result_of_t<Func(const dict_entry_view* e)> incr(const sstring& key, int64_t delta, Func&& func)
+    {
+        return incr_impl(key, delta, std::forward<Func>(func));
     }
 
-    inline bool erase(const_iterator i)
+    template <typename Func>
+    inline std::result_of_t<Func(const dict_entry_view* e)> incr(const sstring& key, double delta, Func&& func)
     {
-        if (i != _dict.cend()) {
-            _dict.erase_and_dispose(i, current_deleter<dict_entry>());
-            return true;
-        }
-        return false;
+        return incr_impl(key, delta, std::forward<Func>(func));
+    }
+
+    template <typename Func>
+    inline std::result_of_t<Func(const dict_entry_view* e)> with_entry_run(const sstring& k, Func&& func) const {
+        auto v = find_view(k);
+        return func(v ? &v : nullptr);
     }
 
     inline bool erase(const sstring& key)
     {
-        auto it = _dict.find(key, dict_entry::compare());
-        if (it != _dict.end()) {
-            _dict.erase_and_dispose(it, current_deleter<dict_entry>());
+        if (_is_packed) {
+            auto offset = find_packed(key);
+            if (offset == npos) {
+                return false;
+            }
+            repack(offset, skip_packed(offset), nullptr);
+            --_packed_count;
+            return true;
+        }
+        auto e = find(key);
+        if (e != nullptr) {
+            _dict.erase(*e);
+            current_deleter<dict_entry>()(e);
             return true;
         }
         return false;
     }
 
     inline bool empty() const {
-        return _dict.empty();
+        return size() == 0;
     }
 
     inline size_t size() const {
-        return _dict.size();
+        return _is_packed ? _packed_count : _dict.size();
     }
 
     inline void clear() {
@@ -273,54 +392,353 @@ public:
 
     inline bool exists(const sstring& key) const
     {
-        return _dict.find(key, dict_entry::compare()) != _dict.end();
+        return _is_packed ? find_packed(key) != npos : find(key) != nullptr;
     }
 
-    inline const dict_entry* begin() const
+    inline dict_entry_view at(size_t index) const
     {
-        if (_dict.begin() != _dict.end()) {
-            const auto& e = *(_dict.begin());
-            return &e;
+        assert(index >= 0 && index < size());
+        if (_is_packed) {
+            size_t offset = 0;
+            for (; index > 0; --index) {
+                offset = skip_packed(offset);
+            }
+            return decode(offset);
         }
-        return nullptr;
+        return dict_entry_view(*_dict.at(index));
     }
 
-    inline const_iterator at(size_t index) const
+    // Appends count random fields, distinct ones or drawn with replacement, random(n)
+    // returns a number in [0, n). A draw from the hash table is O(1) on average; the
+    // packed fields, and the tables of which most fields are wanted, are fetched once
+    // and drawn from by a partial shuffle.
+    template <typename Random>
+    void fetch_random(size_t count, bool distinct, Random&& random, std::vector<dict_entry_view>& entries) const
     {
-        assert(index >= 0 && index < size());
-        for (auto i = _dict.cbegin(); i != _dict.cend(); ++i, index--) {
-            if (index == 0) {
-                return i;
+        if (empty() || count == 0) {
+            return;
+        }
+        if (distinct && count >= size()) {
+            fetch(entries);
+            return;
+        }
+        entries.reserve(entries.size() + count);
+        if (_is_packed || (distinct && count * 3 > size())) {
+            std::vector<dict_entry_view> all;
+            fetch(all);
+            for (size_t i = 0; i < count; ++i) {
+                if (distinct) {
+                    std::swap(all[i], all[i + random(all.size() - i)]);
+                    entries.push_back(all[i]);
+                }
+                else {
+                    entries.push_back(all[random(all.size())]);
+                }
+            }
+            return;
+        }
+        std::unordered_set<const dict_entry*> picked;
+        while (count > 0) {
+            auto e = _dict.random_entry(random);
+            if (distinct && !picked.insert(e).second) {
+                continue;
             }
+            entries.push_back(dict_entry_view(*e));
+            --count;
         }
-        return _dict.cend();
     }
 
-    void fetch(const std::vector<sstring>& keys, std::vector<const dict_entry*>& entries) const {
+    void fetch(const std::vector<sstring>& keys, std::vector<dict_entry_view>& entries) const {
+        entries.reserve(entries.size() + keys.size());
         for (const auto& key : keys) {
-            auto it = _dict.find(key, dict_entry::compare());
-            if (it != _dict.end()) {
-                const auto& e = *it;
-                entries.push_back(&e);
+            entries.push_back(find_view(key));
+        }
+    }
+
+    void fetch(std::vector<dict_entry_view>& entries) const {
+        entries.reserve(entries.size() + size());
+        for_each([&entries] (const dict_entry_view& v) {
+            entries.push_back(v);
+        });
+    }
+
+    void fetch_keys(std::vector<sstring>& entries) const {
+        entries.reserve(entries.size() + size());
+        for_each([&entries] (const dict_entry_view& v) {
+            entries.emplace_back(v.key_data(), v.key_size());
+        });
+    }
+
+    // Appends the fields of the buckets from the cursor on, until count fields or
+    // count * SCAN_BUCKETS_PER_COUNT buckets were visited, and returns the cursor
+    // of the next call, 0 once all were, see hash_table::scan(). The packed fields
+    // are few, they are all appended by the first call.
+    size_t fetch_scan(size_t cursor, size_t count, std::vector<dict_entry_view>& entries) const
+    {
+        if (_is_packed) {
+            fetch(entries);
+            return 0;
+        }
+        size_t buckets = count * SCAN_BUCKETS_PER_COUNT;
+        size_t first = entries.size();
+        do {
+            cursor = _dict.scan(cursor, [&entries] (const dict_entry& e) {
+                entries.push_back(dict_entry_view(e));
+            });
+        } while (cursor != 0 && entries.size() - first < count && --buckets > 0);
+        return cursor;
+    }
+private:
+    inline dict_entry* find(const sstring& key) const
+    {
+        return _dict.find(key, dict_entry::hash_of(key), dict_entry::key_equal());
+    }
+
+    dict_entry_view find_view(const sstring& key) const
+    {
+        if (_is_packed) {
+            auto offset = find_packed(key);
+            return offset != npos ? decode(offset) : dict_entry_view();
+        }
+        auto e = find(key);
+        return e != nullptr ? dict_entry_view(*e) : dict_entry_view();
+    }
+
+    template <typename Func>
+    void for_each(Func&& func) const
+    {
+        if (_is_packed) {
+            for (size_t offset = 0; offset < _packed.size(); offset = skip_packed(offset)) {
+                func(decode(offset));
+            }
+            return;
+        }
+        for (auto it = _dict.begin(); it != _dict.end(); ++it) {
+            func(dict_entry_view(*it));
+        }
+    }
+
+    bool insert_field(const dict_entry_view& f, bool overwrite)
+    {
+        const sstring_view key {f.key_data(), f.key_size()};
+        if (_is_packed) {
+            auto offset = find_packed(key);
+            if (offset != npos && !overwrite) {
+                return false;
             }
-            else {
-                entries.push_back(nullptr);
+            const size_t replaced = offset != npos ? packed_size_at(packed_data() + offset) : 0;
+            if (fits(f) && (offset != npos || _packed_count < _limits->max_entries)
+                && _packed.size() - replaced + packed_size_of(f) <= max_packed_bytes) {
+                if (offset != npos) {
+                    repack(offset, skip_packed(offset), &f);
+                    return false;
+                }
+                repack(_packed.size(), _packed.size(), &f);
+                ++_packed_count;
+                return true;
             }
+            convert();
         }
+        auto hash = std::hash<sstring_view>()(key);
+        auto equal = [] (const sstring_view& k, const dict_entry& e) {
+            return k.size() == e.key_size() && memcmp(k.data(), e.key_data(), k.size()) == 0;
+        };
+        auto e = _dict.find(key, hash, equal);
+        if (e != nullptr) {
+            if (overwrite) {
+                _dict.erase(*e);
+                current_deleter<dict_entry>()(e);
+                _dict.insert(*make_entry(f));
+            }
+            return false;
+        }
+        _dict.insert(*make_entry(f));
+        return true;
     }
 
-    void fetch(std::vector<const dict_entry*>& entries) const {
-        for (auto it = _dict.begin(); it != _dict.end(); ++it) {
-            const auto& e = *it;
-            entries.push_back(&e);
+    template <typename T, typename Func>
+    std::result_of_t<Func(const dict_entry_view* e)> incr_impl(const sstring& key, T delta, Func&& func)
+    {
+        constexpr auto type = std::is_integral<T>::value ? entry_type::INTEGER : entry_type::FLOAT;
+        if (_is_packed) {
+            auto offset = find_packed(key);
+            if (offset != npos) {
+                auto v = decode(offset);
+                if (v.type() != type) {
+                    return func(nullptr);
+                }
+                T value = numeric_value(v, delta) + delta;
+                memcpy(_packed.data() + offset + 2 + v.key_size(), &value, sizeof(T));
+                auto updated = decode(offset);
+                return func(&updated);
+            }
         }
+        else {
+            auto e = find(key);
+            if (e != nullptr) {
+                if (e->_type != type) {
+                    return func(nullptr);
+                }
+                add(*e, delta);
+                auto updated = dict_entry_view(*e);
+                return func(&updated);
+            }
+        }
+        insert_field(dict_entry_view(key.data(), key.size(), delta), false);
+        return with_entry_run(key, std::forward<Func>(func));
     }
 
-    void fetch_keys(std::vector<sstring>& entries) const {
-        for (auto it = _dict.begin(); it != _dict.end(); ++it) {
-            const auto& e = *it;
-            entries.emplace_back(std::move(sstring(e.key_data(), e.key_size())));
+    static inline int64_t numeric_value(const dict_entry_view& v, int64_t) { return v.value_integer(); }
+    static inline double numeric_value(const dict_entry_view& v, double) { return v.value_float(); }
+
+    static inline void add(dict_entry& e, int64_t delta) { e.value_integer_incr(delta); }
+    static inline void add(dict_entry& e, double delta) { e.value_float_incr(delta); }
+
+    static dict_entry* make_entry(const dict_entry_view& f)
+    {
+        auto e = current_allocator().construct<dict_entry>(bytes_view {reinterpret_cast<const signed char*>(f.key_data()), f.key_size()}, f.type());
+        switch (f.type()) {
+            case entry_type::BYTES:
+                new (&e->_u._data) managed_bytes(bytes_view {reinterpret_cast<const signed char*>(f.value_bytes_data()), f.value_bytes_size()});
+                break;
+            case entry_type::FLOAT:
+                e->_u._float = f.value_float();
+                break;
+            case entry_type::INTEGER:
+                e->_u._integer = f.value_integer();
+                break;
+        }
+        return e;
+    }
+
+    inline bool fits(const dict_entry_view& f) const
+    {
+        const size_t limit = _limits->max_value < max_packed_length ? _limits->max_value : max_packed_length;
+        return f.key_size() <= limit && (!f.type_of_bytes() || f.value_bytes_size() <= limit);
+    }
+
+    static inline size_t packed_size_of(const dict_entry_view& f)
+    {
+        return 2 + f.key_size() + (f.type_of_bytes() ? 1 + f.value_bytes_size() : 8);
+    }
+
+    inline const char* packed_data() const
+    {
+        return reinterpret_cast<const char*>(_packed.data());
+    }
+
+    size_t find_packed(const sstring_view& key) const
+    {
+        auto data = packed_data();
+        for (size_t offset = 0; offset < _packed.size(); offset = skip_packed(offset)) {
+            auto key_size = static_cast<uint8_t>(data[offset]);
+            if (key_size == key.size() && memcmp(data + offset + 1, key.data(), key_size) == 0) {
+                return offset;
+            }
+        }
+        return npos;
+    }
+
+    inline size_t find_packed(const sstring& key) const
+    {
+        return find_packed(sstring_view {key.data(), key.size()});
+    }
+
+    inline size_t skip_packed(size_t offset) const
+    {
+        return offset + packed_size_at(packed_data() + offset);
+    }
+
+    inline dict_entry_view decode(size_t offset) const
+    {
+        return decode(packed_data() + offset);
+    }
+
+    static inline size_t packed_size_at(const char* p)
+    {
+        auto key_size = static_cast<uint8_t>(p[0]);
+        auto type = static_cast<entry_type>(p[1 + key_size]);
+        return 2 + key_size + (type == entry_type::BYTES ? 1 + static_cast<uint8_t>(p[2 + key_size]) : 8);
+    }
+
+    static dict_entry_view decode(const char* p)
+    {
+        auto key_size = static_cast<uint8_t>(*p++);
+        auto key = p;
+        p += key_size;
+        auto type = static_cast<entry_type>(*p++);
+        switch (type) {
+            case entry_type::FLOAT: {
+                double v;
+                memcpy(&v, p, sizeof(v));
+                return dict_entry_view(key, key_size, v);
+            }
+            case entry_type::INTEGER: {
+                int64_t v;
+                memcpy(&v, p, sizeof(v));
+                return dict_entry_view(key, key_size, v);
+            }
+            default:
+                return dict_entry_view(key, key_size, p + 1, static_cast<uint8_t>(*p));
+        }
+    }
+
+    static char* encode(char* p, const dict_entry_view& f)
+    {
+        *p++ = static_cast<char>(f.key_size());
+        memcpy(p, f.key_data(), f.key_size());
+        p += f.key_size();
+        *p++ = static_cast<char>(f.type());
+        switch (f.type()) {
+            case entry_type::FLOAT: {
+                auto v = f.value_float();
+                memcpy(p, &v, sizeof(v));
+                return p + sizeof(v);
+            }
+            case entry_type::INTEGER: {
+                auto v = f.value_integer();
+                memcpy(p, &v, sizeof(v));
+                return p + sizeof(v);
+            }
+            default:
+                *p++ = static_cast<char>(f.value_bytes_size());
+                memcpy(p, f.value_bytes_data(), f.value_bytes_size());
+                return p + f.value_bytes_size();
+        }
+    }
+
+    // Rebuilds the packed fields with [from, to) replaced by f, or removed if f is nullptr.
+    // The source is read after the allocation, which may move it.
+    void repack(size_t from, size_t to, const dict_entry_view* f)
+    {
+        const size_t old_size = _packed.size();
+        managed_bytes packed(managed_bytes::initialized_later(), old_size - (to - from) + (f ? packed_size_of(*f) : 0));
+        auto src = packed_data();
+        auto dst = reinterpret_cast<char*>(packed.data());
+        memcpy(dst, src, from);
+        dst += from;
+        if (f) {
+            dst = encode(dst, *f);
+        }
+        memcpy(dst, src + to, old_size - to);
+        _packed = std::move(packed);
+    }
+
+    // Moves the packed fields to the hash table.
+    void convert()
+    {
+        // the entries are allocated in the same region, which may move the packed
+        // fields, so they are copied out first.
+        const size_t size = _packed.size();
+        std::unique_ptr<char[]> copy(new char[size]);
+        memcpy(copy.get(), packed_data(), size);
+        _packed = managed_bytes();
+        _packed_count = 0;
+        _is_packed = false;
+        for (auto p = copy.get(); p < copy.get() + size; p += packed_size_at(p)) {
+            _dict.insert(*make_entry(decode(p)));
         }
     }
 };
+
 }
@@ -21,6 +21,12 @@
 #include "geo.hh"
 #include "common.hh"
 #include "util/log.hh"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 using logger =  seastar::logger;
 static logger geo_log ("db");
 namespace redis {
@@ -265,27 +271,23 @@ bool geo::dist(const double& lhash, const double& rhash, double& output)
     return dist(llongitude, llatitude, rlongitude, rlatitude, output);
 }
 
-static bool geohash_bounding_box(double longitude, double latitude, double radius, double* bounds)
+// The bounds of the cells which may hold the points of the shape, as Redis does.
+static void geohash_bounding_box(const geo::shape& s, double* bounds)
 {
-    if (!bounds) return false;
-
-    double lonr = deg_rad(longitude), latr = deg_rad(latitude);
-    if (radius > EARTH_RADIUS_IN_METERS)
-        radius = EARTH_RADIUS_IN_METERS;
-    double distance = radius / EARTH_RADIUS_IN_METERS;
-    double min_latitude = latr - distance;
-    double max_latitude = latr + distance;
-
-    double min_longitude, max_longitude;
-    double difference_longitude = std::asin(std::sin(distance) / std::cos(latr));
-    min_longitude = lonr - difference_longitude;
-    max_longitude = lonr + difference_longitude;
-
-    bounds[0] = rad_deg(min_longitude);
-    bounds[1] = rad_deg(min_latitude);
-    bounds[2] = rad_deg(max_longitude);
-    bounds[3] = rad_deg(max_latitude);
-    return true;
+    double height = s._box ? s._height / 2 : s._radius;
+    double width = s._box ? s._width / 2 : s._radius;
+    double lat_delta = rad_deg(height / EARTH_RADIUS_IN_METERS);
+    double long_delta_top = rad_deg(width / EARTH_RADIUS_IN_METERS / std::cos(deg_rad(s._latitude + lat_delta)));
+    double long_delta_bottom = rad_deg(width / EARTH_RADIUS_IN_METERS / std::cos(deg_rad(s._latitude - lat_delta)));
+    // the widest edge is the one nearer to the equator, all longitudes if a pole is within.
+    double long_delta = s._latitude < 0 ? long_delta_bottom : long_delta_top;
+    if (std::abs(s._latitude) + lat_delta >= 90 || !(long_delta >= 0 && long_delta <= 180)) {
+        long_delta = 180;
+    }
+    bounds[0] = s._longitude - long_delta;
+    bounds[1] = s._latitude - lat_delta;
+    bounds[2] = s._longitude + long_delta;
+    bounds[3] = s._latitude + lat_delta;
 }
 
 static uint8_t geohash_estimate_steps_by_radius(double range, const double lat)
@@ -331,7 +333,7 @@ static bool geohash_encode_internal(const geo_hash_range& longitude_range, const
 
 static bool geohash_decode_internal(const geo_hash_range& longitude_range, const geo_hash_range& latitude_range, const geo_hash& h, geo_hash_area& area)
 {
-    if (h._hash == 0) {
+    if (h._hash == 0 && h._step == 0) {
         return false;
     }
 
@@ -428,48 +430,37 @@ static void geohash_neighbors(const geo_hash& hash, geo_hash_neighbors& neighbor
     geohash_move_y(neighbors._south_west, -1);
 }
 
-static int fetch_points_in_box(geo_hash& h, double longitude, double latitude, double radius, geo::fetch_point& f, geo::points_type& points)
+static uint64_t align_hash(const geo_hash& h)
 {
-    uint64_t min = 0, max = 0;
-    auto align_hash = [] (const geo_hash& h) -> uint64_t {
-        uint64_t hash = h._hash;
-        hash <<= (52 - h._step * 2);
-        return hash;
-    };
-    min = align_hash(h);
-    h._hash++;
-    max = align_hash(h);
-    return f(min, max, longitude, latitude, radius, points);
+    return h._hash << (52 - h._step * 2);
 }
 
-bool geo::fetch_points_from_location(double longitude, double latitude, double radius, fetch_point&& f, points_type& points)
+bool geo::fetch_cells(const shape& s, fetch_cell&& f)
 {
     geo_radius output;
-
     double bounds[4];
-    if (geohash_bounding_box(longitude, latitude, radius, bounds) == false) {
-        return false;
-    }
+    geohash_bounding_box(s, bounds);
     double min_lon = bounds[0], max_lon = bounds[2], min_lat = bounds[1], max_lat = bounds[3];
 
-    // 1. step
-    output._hash._step = geohash_estimate_steps_by_radius(radius, latitude);
+    // 1. step, a box is estimated by its half diagonal.
+    double radius = s._box ? std::sqrt(s._width * s._width + s._height * s._height) / 2 : s._radius;
+    output._hash._step = geohash_estimate_steps_by_radius(radius, s._latitude);
 
     // 2. hash
     geo_hash_range longitude_range { GEO_LONG_MIN, GEO_LONG_MAX }, latitude_range { GEO_LAT_MIN, GEO_LAT_MAX };
-    if (geohash_encode_internal(longitude_range, latitude_range, longitude, latitude, output._hash._step, output._hash._hash) == false) {
+    if (geohash_encode_internal(longitude_range, latitude_range, s._longitude, s._latitude, output._hash._step, output._hash._hash) == false) {
         return false;
     }
 
     // 3. neighbors
     geohash_neighbors(output._hash, output._neighbors);
 
-
     // 4. area
     if (geohash_decode_internal(longitude_range, latitude_range, output._hash, output._area) == false) {
         return false;
     }
 
+    // the neighbors must reach the bounds, or the cells are too small.
     bool decrease_step = false;
     {
         geo_hash_area north, south, east, west;
@@ -479,23 +470,23 @@ bool geo::fetch_points_from_location(double longitude, double latitude, double r
         geohash_decode_internal(longitude_range, latitude_range, output._neighbors._east, east);
         geohash_decode_internal(longitude_range, latitude_range, output._neighbors._west, west);
 
-        if (dist_internal(longitude, latitude, longitude, north._latitude_range._max) < radius) {
+        if (north._latitude_range._max < max_lat) {
             decrease_step = true;
         }
-        if (dist_internal(longitude, latitude, longitude, south._latitude_range._min) < radius) {
+        if (south._latitude_range._min > min_lat) {
             decrease_step = true;
         }
-        if (dist_internal(longitude, latitude, east._longitude_range._max, latitude) < radius) {
+        if (east._longitude_range._max < max_lon) {
             decrease_step = true;
         }
-        if (dist_internal(longitude, latitude, west._longitude_range._min, latitude) < radius) {
+        if (west._longitude_range._min > min_lon) {
             decrease_step = true;
         }
     }
 
-    if (decrease_step) {
+    if (decrease_step && output._hash._step > 1) {
         output._hash._step--;
-        if (geohash_encode_internal(longitude_range, latitude_range, longitude, latitude, output._hash._step, output._hash._hash) == false) {
+        if (geohash_encode_internal(longitude_range, latitude_range, s._longitude, s._latitude, output._hash._step, output._hash._hash) == false) {
             return false;
         }
         geohash_neighbors(output._hash, output._neighbors);
@@ -504,21 +495,24 @@ bool geo::fetch_points_from_location(double longitude, double latitude, double r
         }
     }
 
-    if (output._area._latitude_range._min < min_lat) {
-        output._neighbors._south._hash =  output._neighbors._south_west._hash = output._neighbors._south_east._hash = 0;
-        output._neighbors._south._step =  output._neighbors._south_west._step = output._neighbors._south_east._step = 0;
-    }
-    if (output._area._latitude_range._max > max_lat) {
-        output._neighbors._north._hash = output._neighbors._north_east._hash = output._neighbors._north_west._hash = 0;
-        output._neighbors._north._step = output._neighbors._north_east._step = output._neighbors._north_west._step = 0;
-    }
-    if (output._area._longitude_range._min < min_lon) {
-        output._neighbors._west._hash = output._neighbors._south_west._hash = output._neighbors._north_west._hash = 0;
-        output._neighbors._west._step = output._neighbors._south_west._step = output._neighbors._north_west._step = 0;
-    }
-    if (output._area._longitude_range._max > max_lon) {
-        output._neighbors._east._hash = output._neighbors._south_east._hash = output._neighbors._north_east._hash = 0;
-        output._neighbors._east._step = output._neighbors._south_east._step = output._neighbors._north_east._step = 0;
+    // the neighbors beyond the bounds hold nothing of the shape.
+    if (output._hash._step >= 2) {
+        if (output._area._latitude_range._min < min_lat) {
+            output._neighbors._south._hash =  output._neighbors._south_west._hash = output._neighbors._south_east._hash = 0;
+            output._neighbors._south._step =  output._neighbors._south_west._step = output._neighbors._south_east._step = 0;
+        }
+        if (output._area._latitude_range._max > max_lat) {
+            output._neighbors._north._hash = output._neighbors._north_east._hash = output._neighbors._north_west._hash = 0;
+            output._neighbors._north._step = output._neighbors._north_east._step = output._neighbors._north_west._step = 0;
+        }
+        if (output._area._longitude_range._min < min_lon) {
+            output._neighbors._west._hash = output._neighbors._south_west._hash = output._neighbors._north_west._hash = 0;
+            output._neighbors._west._step = output._neighbors._south_west._step = output._neighbors._north_west._step = 0;
+        }
+        if (output._area._longitude_range._max > max_lon) {
+            output._neighbors._east._hash = output._neighbors._south_east._hash = output._neighbors._north_east._hash = 0;
+            output._neighbors._east._step = output._neighbors._south_east._step = output._neighbors._north_east._step = 0;
+        }
     }
 
     geo_hash gh[9] = {
@@ -532,7 +526,6 @@ bool geo::fetch_points_from_location(double longitude, double latitude, double r
         output._neighbors._south_east,
         output._neighbors._south_west
     };
-    size_t count = 0;
     int last_processed = 0;
     for (int i = 0; i < 9; ++i) {
         auto& h = gh[i];
@@ -542,12 +535,219 @@ bool geo::fetch_points_from_location(double longitude, double latitude, double r
         if (last_processed && gh[i]._hash == gh[last_processed]._hash && gh[i]._step == gh[last_processed]._step) {
             continue;
         }
-        count += fetch_points_in_box(gh[i], longitude, latitude, radius, f, points);
+        auto next = h;
+        next._hash++;
+        f(align_hash(h), align_hash(next));
         last_processed = i;
     }
     return true;
 }
 
+constexpr size_t geo::batch_size;
+
+// Decoded positions are compared with the bounds of a shape with this margin, in
+// degrees, so the rounding of the kernels never drops a point the exact test keeps.
+static constexpr double bounds_margin = 1e-7;
+// The scores of positions are integers below 2^52.
+static constexpr double max_score = double(uint64_t(1) << 52);
+
+geo::matcher::matcher(const shape& s) : _shape(s)
+{
+    auto infinity = std::numeric_limits<double>::infinity();
+    double height = s._box ? s._height / 2 : s._radius;
+    double lat_delta = rad_deg(height / EARTH_RADIUS_IN_METERS);
+    _bounds[1] = s._latitude - lat_delta - bounds_margin;
+    _bounds[3] = s._latitude + lat_delta + bounds_margin;
+    // The longitudes of the points of a circle are within asin(sin(d) / cos(lat))
+    // of its center, and the ones of a box, whose width is measured along the
+    // latitude of each point, within 2 * asin(sin(w / 4R) / cos(lat)) at the
+    // latitude of the band farthest from the equator. Unbounded when the shape
+    // reaches a pole or crosses the antimeridian.
+    double ratio = 0, long_delta = -1;
+    if (s._box) {
+        double farthest = std::max(std::abs(_bounds[1]), std::abs(_bounds[3]));
+        double angle = s._width / 4 / EARTH_RADIUS_IN_METERS;
+        if (farthest < 90 && angle < M_PI / 2) {
+            ratio = std::sin(angle) / std::cos(deg_rad(farthest));
+            if (ratio < 1) {
+                long_delta = 2 * rad_deg(std::asin(ratio));
+            }
+        }
+    }
+    else {
+        double angle = s._radius / EARTH_RADIUS_IN_METERS;
+        if (std::abs(s._latitude) + rad_deg(angle) < 90) {
+            ratio = std::sin(angle) / std::cos(deg_rad(s._latitude));
+            if (ratio < 1) {
+                long_delta = rad_deg(std::asin(ratio));
+            }
+        }
+    }
+    _bounds[0] = -infinity;
+    _bounds[2] = infinity;
+    if (long_delta >= 0 && s._longitude - long_delta >= -180 && s._longitude + long_delta <= 180) {
+        _bounds[0] = s._longitude - long_delta - bounds_margin;
+        _bounds[2] = s._longitude + long_delta + bounds_margin;
+    }
+}
+
+size_t geo::matcher::match(const double* scores, size_t count, point* out) const
+{
+    uint32_t keep[batch_size];
+    auto kept = within_bounds(scores, count, _bounds, keep);
+    size_t matched = 0;
+    for (size_t i = 0; i < kept; ++i) {
+        auto index = keep[i];
+        double longitude = 0, latitude = 0;
+        decode_from_geohash(scores[index], longitude, latitude);
+        if (_shape._box) {
+            // as Redis, the latitude distance first, which is the cheaper one.
+            double lat_distance = EARTH_RADIUS_IN_METERS * std::abs(deg_rad(latitude) - deg_rad(_shape._latitude));
+            if (lat_distance > _shape._height / 2) {
+                continue;
+            }
+            if (dist_internal(longitude, latitude, _shape._longitude, latitude) > _shape._width / 2) {
+                continue;
+            }
+        }
+        double dist = dist_internal(_shape._longitude, _shape._latitude, longitude, latitude);
+        if (!_shape._box && dist > _shape._radius) {
+            continue;
+        }
+        out[matched++] = point { index, dist, longitude, latitude };
+    }
+    return matched;
+}
+
+// The position of a score, as decode_from_geohash() does but without the conversion
+// to the centers of the cells, which the margin covers.
+static inline void decode_index(double score, double& longitude, double& latitude)
+{
+    uint64_t hash_sep = deinterleave64(uint64_t(score));
+    double ilato = uint32_t(hash_sep), ilono = uint32_t(hash_sep >> 32);
+    constexpr double unit = 1.0 / (1ull << GEO_HASH_STEP_MAX);
+    latitude = GEO_LAT_MIN + (ilato + 0.5) * unit * GEO_LAT_SCALE;
+    longitude = GEO_LONG_MIN + (ilono + 0.5) * unit * GEO_LONG_SCALE;
+}
+
+size_t geo::within_bounds_scalar(const double* scores, size_t count, const double* bounds, uint32_t* keep)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < count; ++i) {
+        double longitude = 0, latitude = 0;
+        auto score = scores[i];
+        bool valid = score >= 0 && score < max_score;
+        decode_index(valid ? score : 0, longitude, latitude);
+        // branch free, so the loop is the same whatever is kept.
+        keep[kept] = i;
+        kept += valid & (longitude >= bounds[0]) & (latitude >= bounds[1]) & (longitude <= bounds[2]) & (latitude <= bounds[3]);
+    }
+    return kept;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static inline __m256i compact(__m256i v, __m256i mask, int shift)
+{
+    return _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi64(v, shift)), mask);
+}
+
+// Four scores at a time: the integers are taken from the mantissa of score + 2^52,
+// deinterleaved with the same shifts and masks as deinterleave64(), and converted
+// back with the same trick.
+__attribute__((target("avx2")))
+static size_t within_bounds_avx2(const double* scores, size_t count, const double* bounds, uint32_t* keep)
+{
+    const __m256d magic = _mm256_set1_pd(max_score);
+    const __m256i mantissa = _mm256_set1_epi64x((int64_t(1) << 52) - 1);
+    const __m256i magic_bits = _mm256_castpd_si256(magic);
+    const __m256i b0 = _mm256_set1_epi64x(0x5555555555555555LL);
+    const __m256i b1 = _mm256_set1_epi64x(0x3333333333333333LL);
+    const __m256i b2 = _mm256_set1_epi64x(0x0F0F0F0F0F0F0F0FLL);
+    const __m256i b3 = _mm256_set1_epi64x(0x00FF00FF00FF00FFLL);
+    const __m256i b4 = _mm256_set1_epi64x(0x0000FFFF0000FFFFLL);
+    const __m256i b5 = _mm256_set1_epi64x(0x00000000FFFFFFFFLL);
+    const __m256d half = _mm256_set1_pd(0.5);
+    const __m256d lat_scale = _mm256_set1_pd(GEO_LAT_SCALE / (1ull << GEO_HASH_STEP_MAX));
+    const __m256d long_scale = _mm256_set1_pd(GEO_LONG_SCALE / (1ull << GEO_HASH_STEP_MAX));
+    const __m256d lat_min = _mm256_set1_pd(GEO_LAT_MIN);
+    const __m256d long_min = _mm256_set1_pd(GEO_LONG_MIN);
+    const __m256d min_lon = _mm256_set1_pd(bounds[0]), min_lat = _mm256_set1_pd(bounds[1]);
+    const __m256d max_lon = _mm256_set1_pd(bounds[2]), max_lat = _mm256_set1_pd(bounds[3]);
+    const __m256d zero = _mm256_setzero_pd();
+    size_t kept = 0, i = 0;
+    for (; i + 4 <= count; i += 4) {
+        auto score = _mm256_loadu_pd(scores + i);
+        auto valid = _mm256_and_pd(_mm256_cmp_pd(score, zero, _CMP_GE_OQ), _mm256_cmp_pd(score, magic, _CMP_LT_OQ));
+        auto truncated = _mm256_round_pd(_mm256_and_pd(score, valid), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+        auto hash = _mm256_and_si256(_mm256_castpd_si256(_mm256_add_pd(truncated, magic)), mantissa);
+        auto x = _mm256_and_si256(hash, b0);
+        auto y = _mm256_and_si256(_mm256_srli_epi64(hash, 1), b0);
+        x = compact(x, b1, 1);
+        y = compact(y, b1, 1);
+        x = compact(x, b2, 2);
+        y = compact(y, b2, 2);
+        x = compact(x, b3, 4);
+        y = compact(y, b3, 4);
+        x = compact(x, b4, 8);
+        y = compact(y, b4, 8);
+        x = compact(x, b5, 16);
+        y = compact(y, b5, 16);
+        // x holds the latitude index, y the longitude one.
+        auto ilat = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(x, magic_bits)), magic);
+        auto ilon = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(y, magic_bits)), magic);
+        auto latitude = _mm256_add_pd(lat_min, _mm256_mul_pd(_mm256_add_pd(ilat, half), lat_scale));
+        auto longitude = _mm256_add_pd(long_min, _mm256_mul_pd(_mm256_add_pd(ilon, half), long_scale));
+        auto in = _mm256_and_pd(valid, _mm256_and_pd(
+            _mm256_and_pd(_mm256_cmp_pd(longitude, min_lon, _CMP_GE_OQ), _mm256_cmp_pd(longitude, max_lon, _CMP_LE_OQ)),
+            _mm256_and_pd(_mm256_cmp_pd(latitude, min_lat, _CMP_GE_OQ), _mm256_cmp_pd(latitude, max_lat, _CMP_LE_OQ))));
+        unsigned mask = _mm256_movemask_pd(in);
+        while (mask) {
+            keep[kept++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    auto tail = geo::within_bounds_scalar(scores + i, count - i, bounds, keep + kept);
+    for (size_t k = kept; k < kept + tail; ++k) {
+        keep[k] += i;
+    }
+    return kept + tail;
+}
+#endif
+
+using within_bounds_kernel = size_t (*)(const double*, size_t, const double*, uint32_t*);
+
+struct geo_kernels {
+    within_bounds_kernel within_bounds = geo::within_bounds_scalar;
+    const char* name = "portable";
+
+    geo_kernels() {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            within_bounds = within_bounds_avx2;
+            name = "avx2";
+        }
+#endif
+    }
+};
+
+static const geo_kernels& kernels()
+{
+    static const geo_kernels k;
+    return k;
+}
+
+size_t geo::within_bounds(const double* scores, size_t count, const double* bounds, uint32_t* keep)
+{
+    return kernels().within_bounds(scores, count, bounds, keep);
+}
+
+const char* geo::kernel_name()
+{
+    return kernels().name;
+}
+
 bool geo::to_meters(double& n, int flags)
 {
     if (flags & GEO_UNIT_M) {
@@ -556,10 +756,10 @@ bool geo::to_meters(double& n, int flags)
         n *= 1000;
     }
     else if (flags & GEO_UNIT_MI) {
-        n *= 0.3048;
+        n *= 1609.34;
     }
     else if (flags & GEO_UNIT_FT) {
-        n *= 1609.34;
+        n *= 0.3048;
     }
     else {
         return false;
@@ -575,10 +775,10 @@ bool geo::from_meters(double& n, int flags)
         n /= 1000;
     }
     else if (flags & GEO_UNIT_MI) {
-        n /= 0.3048;
+        n /= 1609.34;
     }
     else if (flags & GEO_UNIT_FT) {
-        n /= 1609.34;
+        n /= 0.3048;
     }
     else {
         return false;
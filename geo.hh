@@ -20,6 +20,11 @@
 */
 #pragma once
 #include "core/sstring.hh"
+#include "common.hh"
+#include <algorithm>
+#include <functional>
+#include <tuple>
+#include <vector>
 namespace redis {
 class geo {
 public:
@@ -30,12 +35,119 @@ public:
     static bool dist(const double& llongitude, const double& llatitude, const double& rlongtitude, const double& rlatitude, double& line);
     static sstring to_sstring(const long long& u);
 
-    //[key, dist, score, longitude, latitude]
+    //[key, score, dist, longitude, latitude]
     using points_type = std::vector<std::tuple<sstring, double, double, double, double>>;
-    using fetch_point = std::function<size_t (uint64_t, uint64_t, const double, const double, const double, points_type& points)>;
-    static bool fetch_points_from_location(double longitude, double latitude, double radius, fetch_point&& f, points_type& points);
     static bool to_meters(double& n, int flags);
     static bool from_meters(double& n, int flags);
+
+    // The area a search looks into, around its center, in meters.
+    struct shape {
+        bool _box = false;
+        double _longitude = 0;
+        double _latitude = 0;
+        double _radius = 0;
+        double _width = 0;
+        double _height = 0;
+    };
+    // Calls f with the score range [min, max) of every geohash cell, at most 9,
+    // which covers the shape. Returns false if its center is not a valid position.
+    using fetch_cell = std::function<void (uint64_t min, uint64_t max)>;
+    static bool fetch_cells(const shape& s, fetch_cell&& f);
+
+    // A candidate which is in the shape: its index in the batch, distance and position.
+    struct point {
+        uint32_t _index;
+        double _dist;
+        double _longitude;
+        double _latitude;
+    };
+    static constexpr size_t batch_size = 256;
+
+    // Tests batches of candidate scores against a shape. A kernel decodes the whole
+    // batch and keeps the scores which are within the bounds of the shape, the exact
+    // distances are only computed for those.
+    class matcher {
+        shape _shape;
+        // min longitude, min latitude, max longitude, max latitude.
+        double _bounds[4];
+    public:
+        explicit matcher(const shape& s);
+        // Writes the candidates in the shape into out, returns how many. At most
+        // batch_size scores at a time.
+        size_t match(const double* scores, size_t count, point* out) const;
+        inline const double* bounds() const { return _bounds; }
+    };
+    // The kernel which decodes and bounds the batches, the fastest the cpu supports
+    // is selected at startup: AVX2, or a portable one. Writes the indexes of the
+    // scores within the bounds into keep, returns how many.
+    static size_t within_bounds(const double* scores, size_t count, const double* bounds, uint32_t* keep);
+    static size_t within_bounds_scalar(const double* scores, size_t count, const double* bounds, uint32_t* keep);
+    static const char* kernel_name();
+
+    // A member of a sorted set found by search().
+    template <typename Entry>
+    struct match {
+        const Entry* _entry;
+        double _score;
+        point _point;
+    };
+    // The members of a sorted set of geohashes which are in the shape, ordered by
+    // GEORADIUS_ASC or GEORADIUS_DESC in flags, at most count of them unless count
+    // is 0. As Redis, a COUNT without ANY returns the nearest ones, with ANY the
+    // first ones found. Returns false if the center is not a valid position.
+    template <typename SortedSet, typename Entry>
+    static bool search(const SortedSet& set, const shape& s, size_t count, bool any, int flags, std::vector<match<Entry>>& matches);
 };
 
+template <typename SortedSet, typename Entry>
+bool geo::search(const SortedSet& set, const shape& s, size_t count, bool any, int flags, std::vector<match<Entry>>& matches)
+{
+    std::vector<const Entry*> entries;
+    std::vector<double> scores;
+    std::vector<point> points(batch_size);
+    entries.reserve(batch_size);
+    scores.reserve(batch_size);
+    matcher m(s);
+    bool enough = false;
+    auto flush = [&] {
+        auto matched = m.match(scores.data(), scores.size(), points.data());
+        for (size_t i = 0; i < matched && !enough; ++i) {
+            auto& p = points[i];
+            matches.emplace_back(match<Entry> { entries[p._index], scores[p._index], p });
+            enough = any && matches.size() == count;
+        }
+        entries.clear();
+        scores.clear();
+    };
+    auto found = fetch_cells(s, [&] (uint64_t min, uint64_t max) {
+        set.for_each_by_score(min, max, [&] (const Entry& entry) {
+            entries.push_back(&entry);
+            scores.push_back(entry.score());
+            if (scores.size() == batch_size) {
+                flush();
+            }
+            return !enough;
+        });
+        if (!enough && !scores.empty()) {
+            flush();
+        }
+    });
+    if (found == false) {
+        return false;
+    }
+    if (count > 0 && !any && !(flags & (GEORADIUS_ASC | GEORADIUS_DESC))) {
+        flags |= GEORADIUS_ASC;
+    }
+    auto size = count > 0 ? std::min(count, matches.size()) : matches.size();
+    auto nearer = [] (const match<Entry>& l, const match<Entry>& r) { return l._point._dist < r._point._dist; };
+    auto farther = [] (const match<Entry>& l, const match<Entry>& r) { return l._point._dist > r._point._dist; };
+    if (flags & GEORADIUS_ASC) {
+        std::partial_sort(matches.begin(), matches.begin() + size, matches.end(), nearer);
+    }
+    else if (flags & GEORADIUS_DESC) {
+        std::partial_sort(matches.begin(), matches.begin() + size, matches.end(), farther);
+    }
+    matches.resize(size);
+    return true;
+}
 }
@@ -1403,7 +1403,6 @@ future<> gossiper::start_gossiping(int generation_number) {
 }
 
 future<> gossiper::start_gossiping(int generation_nbr, std::map<application_state, versioned_value> preload_local_states) {
-/*
     // Although gossiper runs on cpu0 only, we need to listen incoming gossip
     // message on all cpus and forard them to cpu0 to process.
     return get_gossiper().invoke_on_all([] (gossiper& g) {
@@ -1417,20 +1416,13 @@ future<> gossiper::start_gossiping(int generation_nbr, std::map<application_stat
             local_state.add_application_state(entry.first, entry.second);
         }
 
-        //auto generation = local_state.get_heart_beat_state().get_generation();
-
-        //notify snitches that Gossiper is about to start
-        return locator::i_endpoint_snitch::get_local_snitch_ptr()->gossiper_starting().then([this, generation] {
-            logger.trace("gossip started with generation {}", generation);
-            _enabled = true;
-            _nr_run = 0;
-            _scheduled_gossip_task.arm(INTERVAL);
-            return make_ready_future<>();
-        });
-            return make_ready_future<>();
+        auto generation = local_state.get_heart_beat_state().get_generation();
+        logger.trace("gossip started with generation {}", generation);
+        _enabled = true;
+        _nr_run = 0;
+        _scheduled_gossip_task.arm(INTERVAL);
+        return make_ready_future<>();
     });
-*/
-            return make_ready_future<>();
 }
 
 future<> gossiper::do_shadow_round() {
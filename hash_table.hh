@@ -0,0 +1,547 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <boost/intrusive/parent_from_member.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+namespace redis {
+
+class hash_table_hook;
+template <typename T, hash_table_hook T::*Hook, typename Hash>
+class hash_table;
+
+// The hook of hash_table. Entries of a bucket are chained in a singly linked
+// list, every hook remembers the slot which points to it, so that unlinking is
+// O(1) and moving a linked hook (LSA migration) only patches its two neighbours.
+class hash_table_hook {
+    template <typename T, hash_table_hook T::*Hook, typename Hash>
+    friend class hash_table;
+    hash_table_hook* _next = nullptr;
+    hash_table_hook** _pprev = nullptr;
+public:
+    hash_table_hook() noexcept {}
+
+    hash_table_hook(hash_table_hook&& o) noexcept
+        : _next(o._next)
+        , _pprev(o._pprev)
+    {
+        if (_pprev) {
+            *_pprev = this;
+        }
+        if (_next) {
+            _next->_pprev = &_next;
+        }
+        o._next = nullptr;
+        o._pprev = nullptr;
+    }
+
+    hash_table_hook(const hash_table_hook&) = delete;
+    hash_table_hook& operator = (const hash_table_hook&) = delete;
+
+    inline bool is_linked() const {
+        return _pprev != nullptr;
+    }
+};
+
+// An intrusive chained hash table with power of 2 buckets, which grows and
+// shrinks incrementally: when the load factor crosses the threshold a second
+// bucket array is allocated, and every insert / erase migrates a few buckets
+// from the old array to the new one, lookups probe both arrays meanwhile.
+// So even a huge table never stalls the reactor on a full rehash.
+// The bucket arrays live in the standard allocator, as the ones of cache do,
+// so their addresses are stable while the entries are moved by LSA.
+template <typename T, hash_table_hook T::*Hook, typename Hash>
+class hash_table {
+public:
+    static constexpr size_t initial_bucket_count = 4;
+    // buckets migrated by every mutation while rehashing.
+    static constexpr size_t rehash_step_buckets = 4;
+private:
+    struct table {
+        std::unique_ptr<hash_table_hook*[]> _buckets;
+        size_t _count = 0;
+        size_t _size = 0;
+
+        table() noexcept {}
+        explicit table(size_t count) : _buckets(new hash_table_hook*[count]()), _count(count), _size(0) {}
+        table(table&& o) noexcept : _buckets(std::move(o._buckets)), _count(o._count), _size(o._size)
+        {
+            o._count = o._size = 0;
+        }
+        table& operator = (table&& o) noexcept
+        {
+            _buckets = std::move(o._buckets);
+            _count = o._count;
+            _size = o._size;
+            o._count = o._size = 0;
+            return *this;
+        }
+        inline hash_table_hook** bucket_of(size_t hash) const
+        {
+            return &_buckets[hash & (_count - 1)];
+        }
+    };
+    // _tables[1] is only allocated while rehashing.
+    table _tables[2];
+    size_t _rehash_index = 0;
+    bool _rehashing = false;
+    // while frozen no rehash starts or makes progress, see walk().
+    bool _frozen = false;
+    // the bucket array never shrinks below it, must be a power of 2.
+    size_t _min_bucket_count = initial_bucket_count;
+    float _max_load_factor = 1.0f;
+
+    template <typename V>
+    class iterator_impl : public std::iterator<std::forward_iterator_tag, V> {
+        friend class hash_table;
+        using table_ptr = std::conditional_t<std::is_const<V>::value, const hash_table*, hash_table*>;
+        table_ptr _table;
+        hash_table_hook* _node;
+        size_t _index;
+        size_t _bucket;
+        iterator_impl(table_ptr t, hash_table_hook* node, size_t index, size_t bucket)
+            : _table(t), _node(node), _index(index), _bucket(bucket) {}
+    public:
+        iterator_impl() : _table(nullptr), _node(nullptr), _index(0), _bucket(0) {}
+        template <typename U, typename = std::enable_if_t<std::is_const<V>::value && !std::is_const<U>::value>>
+        iterator_impl(const iterator_impl<U>& o) : _table(o._table), _node(o._node), _index(o._index), _bucket(o._bucket) {}
+        inline V& operator * () const { return to_value(_node); }
+        inline V* operator -> () const { return &to_value(_node); }
+        inline iterator_impl& operator ++ () {
+            if (_node->_next) {
+                _node = _node->_next;
+            }
+            else {
+                ++_bucket;
+                _table->seek(_node, _index, _bucket);
+            }
+            return *this;
+        }
+        inline iterator_impl operator ++ (int) {
+            auto it = *this;
+            ++(*this);
+            return it;
+        }
+        inline bool operator == (const iterator_impl& o) const { return _node == o._node; }
+        inline bool operator != (const iterator_impl& o) const { return _node != o._node; }
+        template <typename U>
+        friend class iterator_impl;
+    };
+public:
+    using iterator = iterator_impl<T>;
+    using const_iterator = iterator_impl<const T>;
+
+    hash_table() noexcept {}
+    explicit hash_table(size_t min_bucket_count, float max_load_factor = 1.0f) noexcept
+        : _min_bucket_count(min_bucket_count)
+        , _max_load_factor(max_load_factor)
+    {
+    }
+    hash_table(hash_table&& o) noexcept
+        : _tables { std::move(o._tables[0]), std::move(o._tables[1]) }
+        , _rehash_index(o._rehash_index)
+        , _rehashing(o._rehashing)
+        , _frozen(o._frozen)
+        , _min_bucket_count(o._min_bucket_count)
+        , _max_load_factor(o._max_load_factor)
+    {
+        o._rehash_index = 0;
+        o._rehashing = false;
+    }
+    hash_table(const hash_table&) = delete;
+    hash_table& operator = (const hash_table&) = delete;
+
+    inline size_t size() const { return _tables[0]._size + _tables[1]._size; }
+    inline bool empty() const { return size() == 0; }
+    inline size_t bucket_count() const { return _tables[0]._count + _tables[1]._count; }
+    inline bool rehashing() const { return _rehashing; }
+    // The number of the entries which are still in the old bucket array.
+    inline size_t rehash_pending() const { return _rehashing ? _tables[0]._size : 0; }
+    // Returns true if the next insert allocates a bucket array.
+    inline bool will_grow() const
+    {
+        return _tables[0]._count == 0 || (!_rehashing && !_frozen && _tables[0]._size + 1 >= grow_threshold());
+    }
+
+    // Pins every entry to its bucket: the load factor may exceed the threshold
+    // meanwhile, the rehash resumes on the first mutation after unfreezing.
+    inline void freeze(bool frozen) { _frozen = frozen; }
+    inline bool frozen() const { return _frozen; }
+
+    // Runs func on the entries of at most `buckets` buckets from the cursor, which
+    // indexes the buckets of both arrays, and returns the cursor of the next bucket,
+    // bucket_count() once all were visited. A walk spanning mutations only visits
+    // every entry exactly once if the table stays frozen; func must not unlink.
+    template <typename Func>
+    size_t walk(size_t cursor, size_t buckets, Func&& func)
+    {
+        for (; buckets > 0 && cursor < bucket_count(); --buckets, ++cursor) {
+            bool first = cursor < _tables[0]._count;
+            auto& t = first ? _tables[0] : _tables[1];
+            for (auto n = t._buckets[first ? cursor : cursor - _tables[0]._count]; n != nullptr; n = n->_next) {
+                func(to_value(n));
+            }
+        }
+        return cursor;
+    }
+
+    // Runs func on the entries of the bucket the cursor points to, in both arrays
+    // while rehashing, and returns the cursor of the next bucket, 0 once all were
+    // visited; a scan starts from 0. The cursor counts in reverse binary, as the
+    // one of Redis's dictScan(), so the buckets it already visited keep being
+    // covered when the table grows or shrinks between two calls: every entry which
+    // is in the table during the whole scan is visited at least once, some may be
+    // visited more than once. func must not unlink.
+    template <typename Func>
+    size_t scan(size_t cursor, Func&& func) const
+    {
+        if (_tables[0]._count == 0) {
+            return 0;
+        }
+        auto visit = [&func] (const table& t, size_t bucket) {
+            for (auto n = t._buckets[bucket]; n != nullptr; n = n->_next) {
+                func(to_value(n));
+            }
+        };
+        if (!_rehashing) {
+            size_t mask = _tables[0]._count - 1;
+            visit(_tables[0], cursor & mask);
+            return next_cursor(cursor, mask);
+        }
+        bool grows = _tables[0]._count <= _tables[1]._count;
+        const auto& small = grows ? _tables[0] : _tables[1];
+        const auto& large = grows ? _tables[1] : _tables[0];
+        size_t small_mask = small._count - 1;
+        size_t large_mask = large._count - 1;
+        visit(small, cursor & small_mask);
+        // the buckets of the larger array which the bucket of the smaller one expands to.
+        do {
+            visit(large, cursor & large_mask);
+            cursor = next_cursor(cursor, large_mask);
+        } while (cursor & (small_mask ^ large_mask));
+        return cursor;
+    }
+
+    // Runs func on at most `count` entries of the buckets which follow the bucket
+    // picked by seed, in both arrays, and gives up after visiting 10 times as many
+    // empty buckets. Returns how many entries were visited.
+    template <typename Func>
+    size_t sample(size_t seed, size_t count, Func&& func)
+    {
+        size_t total = bucket_count();
+        if (total == 0 || empty()) {
+            return 0;
+        }
+        size_t visited = 0;
+        size_t empty_budget = count * 10;
+        for (size_t cursor = seed % total, n = 0; n < total && visited < count; ++n, cursor = (cursor + 1) % total) {
+            bool first = cursor < _tables[0]._count;
+            auto& t = first ? _tables[0] : _tables[1];
+            auto node = t._buckets[first ? cursor : cursor - _tables[0]._count];
+            if (node == nullptr) {
+                if (empty_budget-- == 0) {
+                    break;
+                }
+                continue;
+            }
+            for (; node != nullptr && visited < count; node = node->_next, ++visited) {
+                func(to_value(node));
+            }
+        }
+        return visited;
+    }
+
+    // Returns a random entry in O(1) on average: random buckets are drawn until one
+    // is not empty, then a random entry of its chain, random(n) returns a number in
+    // [0, n). The load factor keeps the chains short, so the bias towards the entries
+    // of short chains is small.
+    template <typename Random>
+    T* random_entry(Random&& random) const
+    {
+        if (empty()) {
+            return nullptr;
+        }
+        hash_table_hook* node = nullptr;
+        while (node == nullptr) {
+            auto cursor = random(bucket_count());
+            bool first = cursor < _tables[0]._count;
+            auto& t = first ? _tables[0] : _tables[1];
+            node = t._buckets[first ? cursor : cursor - _tables[0]._count];
+        }
+        size_t length = 0;
+        for (auto n = node; n != nullptr; n = n->_next) {
+            ++length;
+        }
+        for (auto k = random(length); k > 0; --k) {
+            node = node->_next;
+        }
+        return &to_value(node);
+    }
+
+    inline iterator begin() { return make_begin<iterator>(this); }
+    inline const_iterator begin() const { return make_begin<const_iterator>(this); }
+    inline iterator end() { return iterator(this, nullptr, 0, 0); }
+    inline const_iterator end() const { return const_iterator(this, nullptr, 0, 0); }
+
+    template <typename K, typename Equal>
+    T* find(const K& key, size_t hash, Equal&& equal) const
+    {
+        for (size_t i = 0; i < (_rehashing ? 2 : 1); ++i) {
+            if (_tables[i]._count == 0) {
+                continue;
+            }
+            for (auto n = *(_tables[i].bucket_of(hash)); n != nullptr; n = n->_next) {
+                auto& v = to_value(n);
+                if (equal(key, v)) {
+                    return &v;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    // Links v without checking the uniqueness, callers find() it first.
+    void insert(T& v)
+    {
+        if (_tables[0]._count == 0) {
+            _tables[0] = table(_min_bucket_count);
+        }
+        rehash_step();
+        auto& t = _rehashing ? _tables[1] : _tables[0];
+        link(t, to_hook(v), Hash()(v));
+        maybe_grow();
+    }
+
+    void erase(T& v)
+    {
+        // the entry does not know which array holds it.
+        auto& t = (_rehashing && owned_by(_tables[1], v)) ? _tables[1] : _tables[0];
+        auto n = to_hook(v);
+        *(n->_pprev) = n->_next;
+        if (n->_next) {
+            n->_next->_pprev = n->_pprev;
+        }
+        n->_next = nullptr;
+        n->_pprev = nullptr;
+        --t._size;
+        rehash_step();
+        maybe_shrink();
+    }
+
+    template <typename Disposer>
+    void clear_and_dispose(Disposer&& disposer)
+    {
+        for (auto& t : _tables) {
+            for (size_t b = 0; b < t._count; ++b) {
+                auto n = t._buckets[b];
+                t._buckets[b] = nullptr;
+                while (n) {
+                    auto next = n->_next;
+                    n->_next = nullptr;
+                    n->_pprev = nullptr;
+                    disposer(&to_value(n));
+                    n = next;
+                }
+            }
+            t = table();
+        }
+        _rehash_index = 0;
+        _rehashing = false;
+    }
+
+    inline void clear()
+    {
+        clear_and_dispose([] (T*) {});
+    }
+
+    // Migrates at most `buckets` non-empty buckets of the old array to the new one,
+    // visiting no more than ten times as many empty ones. Returns true if rehash is
+    // still in progress.
+    bool rehash_step(size_t buckets = rehash_step_buckets)
+    {
+        if (!_rehashing || _frozen) {
+            return _rehashing;
+        }
+        auto& from = _tables[0];
+        auto& to = _tables[1];
+        size_t empty_visits = buckets * 10;
+        while (buckets > 0 && from._size > 0) {
+            auto n = from._buckets[_rehash_index];
+            if (n == nullptr) {
+                ++_rehash_index;
+                if (--empty_visits == 0) {
+                    return true;
+                }
+                continue;
+            }
+            from._buckets[_rehash_index] = nullptr;
+            while (n) {
+                auto next = n->_next;
+                link(to, n, Hash()(to_value(n)));
+                --from._size;
+                n = next;
+            }
+            ++_rehash_index;
+            --buckets;
+        }
+        if (from._size == 0) {
+            _tables[0] = std::move(_tables[1]);
+            _tables[1] = table();
+            _rehash_index = 0;
+            _rehashing = false;
+        }
+        return _rehashing;
+    }
+
+    // Returns the index-th element in iteration order, or end().
+    const_iterator at(size_t index) const
+    {
+        auto it = begin();
+        for (; it != end() && index > 0; ++it, --index) {}
+        return it;
+    }
+
+    const_iterator iterator_to(const T& v) const
+    {
+        size_t index = (_rehashing && owned_by(_tables[1], v)) ? 1 : 0;
+        size_t bucket = Hash()(v) & (_tables[index]._count - 1);
+        return const_iterator(this, to_hook(v), index, bucket);
+    }
+private:
+    static inline T& to_value(hash_table_hook* n)
+    {
+        return *boost::intrusive::get_parent_from_member<T>(n, Hook);
+    }
+    static inline hash_table_hook* to_hook(const T& v)
+    {
+        return const_cast<hash_table_hook*>(&(v.*Hook));
+    }
+
+    static inline void link(table& t, hash_table_hook* n, size_t hash)
+    {
+        auto head = t.bucket_of(hash);
+        n->_next = *head;
+        if (n->_next) {
+            n->_next->_pprev = &n->_next;
+        }
+        n->_pprev = head;
+        *head = n;
+        ++t._size;
+    }
+
+    inline bool owned_by(const table& t, const T& v) const
+    {
+        for (auto n = *(t.bucket_of(Hash()(v))); n != nullptr; n = n->_next) {
+            if (n == to_hook(v)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static inline size_t reverse_bits(size_t v)
+    {
+        size_t s = sizeof(v) * 8;
+        size_t mask = ~size_t(0);
+        while ((s >>= 1) > 0) {
+            mask ^= (mask << s);
+            v = ((v >> s) & mask) | ((v << s) & ~mask);
+        }
+        return v;
+    }
+
+    // Increments the bits of the cursor under mask from the high bit down.
+    static inline size_t next_cursor(size_t cursor, size_t mask)
+    {
+        cursor |= ~mask;
+        cursor = reverse_bits(cursor);
+        ++cursor;
+        return reverse_bits(cursor);
+    }
+
+    // Finds the first node starting from (index, bucket), sets node to nullptr at end.
+    void seek(hash_table_hook*& node, size_t& index, size_t& bucket) const
+    {
+        for (; index < 2; ++index, bucket = 0) {
+            const auto& t = _tables[index];
+            for (; bucket < t._count; ++bucket) {
+                if (t._buckets[bucket]) {
+                    node = t._buckets[bucket];
+                    return;
+                }
+            }
+        }
+        node = nullptr;
+    }
+
+    template <typename Iterator, typename Table>
+    static inline Iterator make_begin(Table t)
+    {
+        hash_table_hook* node = nullptr;
+        size_t index = 0, bucket = 0;
+        t->seek(node, index, bucket);
+        return Iterator(t, node, index, bucket);
+    }
+
+    inline size_t grow_threshold() const
+    {
+        return static_cast<size_t>(_tables[0]._count * _max_load_factor);
+    }
+
+    inline void start_rehash(size_t count)
+    {
+        try {
+            _tables[1] = table(count);
+        } catch (const std::bad_alloc&) {
+            // keep the current array, try again on the next mutation.
+            return;
+        }
+        _rehash_index = 0;
+        _rehashing = true;
+    }
+
+    inline void maybe_grow()
+    {
+        if (!_rehashing && !_frozen && _tables[0]._size >= grow_threshold()) {
+            start_rehash(_tables[0]._count * 2);
+        }
+    }
+
+    inline void maybe_shrink()
+    {
+        if (_rehashing || _frozen || _tables[0]._count <= _min_bucket_count) {
+            return;
+        }
+        if (_tables[0]._size * 8 < _tables[0]._count) {
+            size_t count = _min_bucket_count;
+            while (count < _tables[0]._size) {
+                count <<= 1;
+            }
+            start_rehash(count);
+        }
+    }
+};
+}
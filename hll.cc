@@ -20,11 +20,21 @@
 */
 #include "hll.hh"
 #include "common.hh"
+#include "key_hash.hh"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <endian.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 namespace redis {
 
-static constexpr const int HLL_BUCKET_COUNT_MAX = (1 << HLL_BITS) - 1;
-static constexpr const int HLL_BUCKET_COUNT_MASK = HLL_BUCKET_COUNT - 1; 
+static constexpr const int HLL_BUCKET_COUNT_MASK = HLL_BUCKET_COUNT - 1;
+static constexpr const uint64_t HLL_HASH_SEED = 0xadc83b19ULL;
+static constexpr const size_t HLL_SPARSE_ENTRY_SIZE = sizeof(uint32_t);
 static constexpr const double ALPHA = 0.7213 / (1+1.079 / HLL_BUCKET_COUNT);
 static constexpr const double ALPHA_BUCKET_COUNT_POWER_2 = ALPHA * HLL_BUCKET_COUNT * HLL_BUCKET_COUNT;
 static constexpr const double PE[64] = { 
@@ -50,95 +60,228 @@ static inline bool hll_is_valid_cache(const uint8_t* cache, size_t size)
     return size > 7 && (cache[7] & (1 << 7)) == 0;
 }
 
-static inline void hll_get_counter_on_bucket(uint8_t& counter, const uint8_t* p, long index)
+static inline bool hll_is_sparse(size_t size)
 {
-    const uint8_t* _p = p;
-    unsigned long _byte = index * HLL_BITS / 8;
-    unsigned long _fb = index * HLL_BITS & 7;
-    unsigned long _fb8 = 8 - _fb;
-    unsigned long b0 = _p[_byte];
-    unsigned long b1 = _p[_byte+1];
-    counter = ((b0 >> _fb) | (b1 << _fb8)) & HLL_BUCKET_COUNT_MAX;
+    return size != HLL_BYTES_SIZE;
 }
 
-static inline void hll_set_counter_on_bucket(uint8_t* p, long index, uint8_t counter)
+static inline bool hll_is_valid(size_t size)
 {
-    uint8_t *_p = p;
-    unsigned long _byte = index * HLL_BITS / 8;
-    unsigned long _fb = index * HLL_BITS & 7;
-    unsigned long _fb8 = 8 - _fb;
-    unsigned long _v = counter;
-    _p[_byte] &= ~(HLL_BUCKET_COUNT_MAX << _fb);
-    _p[_byte] |= _v << _fb;
-    _p[_byte+1] &= ~(HLL_BUCKET_COUNT_MAX >> _fb8);
-    _p[_byte+1] |= _v >> _fb8;
+    return size == HLL_BYTES_SIZE || (size >= HLL_CARD_CACHE_SIZE && size < HLL_BYTES_SIZE
+        && (size - HLL_CARD_CACHE_SIZE) % HLL_SPARSE_ENTRY_SIZE == 0);
 }
 
-bool hll_add(managed_bytes& data, const sstring& element)
+// The dense registers are packed four into three bytes, from the low bits.
+static inline uint8_t hll_get_register(const uint8_t* p, uint32_t index)
 {
-    uint8_t oldcount = 0, count = 1;
-    uint8_t* p = (uint8_t*)(data.data()) + HLL_CARD_CACHE_SIZE;
-    auto hash = (uint64_t)(std::hash<sstring>()(element));
-    //auto hash = murmur_hash_64a((uint8_t*)element.data(), element.size(), 0xadc83b19ULL);
-    auto index = hash & HLL_BUCKET_COUNT_MASK;
-    hash |= ((uint64_t) 1 << 63);
-    uint64_t bit = HLL_BUCKET_COUNT;
-    while ((hash & bit) == 0) {
-        ++count;
-        bit <<= 1;
-    }
-    hll_get_counter_on_bucket(oldcount, p, index);
-    if (count > oldcount) {
-        hll_set_counter_on_bucket(p, index, count);
-        hll_invalidate_cache((uint8_t*)(data.data()), HLL_CARD_CACHE_SIZE);
-        return true;
+    auto g = p + (index >> 2) * 3;
+    switch (index & 3) {
+    case 0: return g[0] & 63;
+    case 1: return (g[0] >> 6 | g[1] << 2) & 63;
+    case 2: return (g[1] >> 4 | g[2] << 4) & 63;
+    default: return g[2] >> 2;
+    }
+}
+
+static inline void hll_set_register(uint8_t* p, uint32_t index, uint8_t v)
+{
+    auto g = p + (index >> 2) * 3;
+    switch (index & 3) {
+    case 0:
+        g[0] = (g[0] & ~63) | v;
+        break;
+    case 1:
+        g[0] = (g[0] & 63) | uint8_t(v << 6);
+        g[1] = (g[1] & ~15) | (v >> 2);
+        break;
+    case 2:
+        g[1] = (g[1] & 15) | uint8_t(v << 4);
+        g[2] = (g[2] & ~3) | (v >> 4);
+        break;
+    default:
+        g[2] = (g[2] & 3) | uint8_t(v << 2);
+        break;
+    }
+}
+
+static void hll_unpack(const uint8_t* p, uint8_t* registers)
+{
+    for (size_t i = 0; i < HLL_BUCKET_COUNT / 4; ++i, p += 3, registers += 4) {
+        registers[0] = p[0] & 63;
+        registers[1] = (p[0] >> 6 | p[1] << 2) & 63;
+        registers[2] = (p[1] >> 4 | p[2] << 4) & 63;
+        registers[3] = p[2] >> 2;
+    }
+}
+
+static void hll_pack(const uint8_t* registers, uint8_t* p)
+{
+    for (size_t i = 0; i < HLL_BUCKET_COUNT / 4; ++i, p += 3, registers += 4) {
+        p[0] = registers[0] | uint8_t(registers[1] << 6);
+        p[1] = (registers[1] >> 2) | uint8_t(registers[2] << 4);
+        p[2] = (registers[2] >> 4) | uint8_t(registers[3] << 2);
     }
-    return false;
 }
 
-size_t hll::append(managed_bytes& data, const std::vector<sstring>& elements)
+static inline uint32_t hll_sparse_entry(const uint8_t* p)
 {
-    size_t result = 0;
-    for (size_t i = 0; i < elements.size(); ++i) {
-        if (hll_add(data, elements[i])) {
-            ++result;
+    uint32_t e;
+    std::memcpy(&e, p, sizeof(e));
+    return le32toh(e);
+}
+
+// MurmurHash64A as Redis: the low bits pick the register, the position of the
+// lowest set bit among the others is the register value.
+static inline void hll_hash(const sstring& element, uint32_t& index, uint8_t& count)
+{
+    auto hash = hash_key(element.data(), element.size(), HLL_HASH_SEED);
+    index = hash & HLL_BUCKET_COUNT_MASK;
+    hash >>= HLL_P;
+    hash |= uint64_t(1) << (64 - HLL_P);
+    count = __builtin_ctzll(hash) + 1;
+}
+
+static void registers_max_scalar(uint8_t* dst, const uint8_t* src, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        dst[i] = std::max(dst[i], src[i]);
+    }
+}
+
+// Sums 2^-register, and counts the registers which are zero.
+static double registers_sum_scalar(const uint8_t* registers, size_t size, size_t& zeros)
+{
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t z = 0, i = 0;
+    for (; i + 4 <= size; i += 4) {
+        s0 += PE[registers[i]];
+        s1 += PE[registers[i + 1]];
+        s2 += PE[registers[i + 2]];
+        s3 += PE[registers[i + 3]];
+        z += (registers[i] == 0) + (registers[i + 1] == 0) + (registers[i + 2] == 0) + (registers[i + 3] == 0);
+    }
+    for (; i < size; ++i) {
+        s0 += PE[registers[i]];
+        z += registers[i] == 0;
+    }
+    zeros = z;
+    return (s0 + s1) + (s2 + s3);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void registers_max_avx2(uint8_t* dst, const uint8_t* src, size_t size)
+{
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+        auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_max_epu8(a, b));
+    }
+    registers_max_scalar(dst + i, src + i, size - i);
+}
+
+// 2^-r is the double whose exponent is 1023 - r and whose mantissa is zero, so it
+// is built with integer operations on four registers at a time.
+__attribute__((target("avx2")))
+static double registers_sum_avx2(const uint8_t* registers, size_t size, size_t& zeros)
+{
+    const __m256i bias = _mm256_set1_epi64x(1023);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    size_t z = 0, i = 0;
+    for (; i + 32 <= size; i += 32) {
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(registers + i));
+        z += __builtin_popcount(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero))));
+        for (size_t k = 0; k < 32; k += 8) {
+            uint32_t lo, hi;
+            std::memcpy(&lo, registers + i + k, sizeof(lo));
+            std::memcpy(&hi, registers + i + k + 4, sizeof(hi));
+            auto rlo = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(int(lo)));
+            auto rhi = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(int(hi)));
+            s0 = _mm256_add_pd(s0, _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_sub_epi64(bias, rlo), 52)));
+            s1 = _mm256_add_pd(s1, _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_sub_epi64(bias, rhi), 52)));
         }
     }
-    return result > 0;
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(s0, s1));
+    size_t tail_zeros = 0;
+    auto sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + registers_sum_scalar(registers + i, size - i, tail_zeros);
+    zeros = z + tail_zeros;
+    return sum;
 }
+#endif
+
+struct hll_kernels {
+    void (*max)(uint8_t*, const uint8_t*, size_t) = registers_max_scalar;
+    double (*sum)(const uint8_t*, size_t, size_t&) = registers_sum_scalar;
+    const char* name = "portable";
 
+    hll_kernels() {
+        select(false);
+    }
+
+    void select(bool portable) {
+        max = registers_max_scalar;
+        sum = registers_sum_scalar;
+        name = "portable";
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (!portable && __builtin_cpu_supports("avx2")) {
+            max = registers_max_avx2;
+            sum = registers_sum_avx2;
+            name = "avx2";
+        }
+#endif
+    }
+};
+
+static hll_kernels& kernels()
+{
+    static hll_kernels k;
+    return k;
+}
+
+// The registers unpacked from a dense HLL, reused since they take 16KB.
+static uint8_t* scratch_registers()
+{
+    static thread_local uint8_t registers[HLL_BUCKET_COUNT];
+    return registers;
+}
 
-static double hll_bucket_counter_sum(const uint8_t* data, size_t size, int& ez)
+static uint64_t estimate(double E, size_t ez)
 {
-    ez = 0;
-    double E = 0;
+    auto S = (1 / E) * ALPHA_BUCKET_COUNT_POWER_2;
 
-    const uint8_t *r = data;
-    unsigned long r0, r1, r2, r3, r4, r5, r6, r7, r8, r9, r10, r11, r12, r13, r14, r15;
-    for (int j = 0; j < 1024; j++) {
-        r0 = r[0] & 63; if (r0 == 0) ez++;
-        r1 = (r[0] >> 6 | r[1] << 2) & 63; if (r1 == 0) ez++;
-        r2 = (r[1] >> 4 | r[2] << 4) & 63; if (r2 == 0) ez++;
-        r3 = (r[2] >> 2) & 63; if (r3 == 0) ez++;
-        r4 = r[3] & 63; if (r4 == 0) ez++;
-        r5 = (r[3] >> 6 | r[4] << 2) & 63; if (r5 == 0) ez++;
-        r6 = (r[4] >> 4 | r[5] << 4) & 63; if (r6 == 0) ez++;
-        r7 = (r[5] >> 2) & 63; if (r7 == 0) ez++;
-        r8 = r[6] & 63; if (r8 == 0) ez++;
-        r9 = (r[6] >> 6 | r[7] << 2) & 63; if (r9 == 0) ez++;
-        r10 = (r[7] >> 4 | r[8] << 4) & 63; if (r10 == 0) ez++;
-        r11 = (r[8] >> 2) & 63; if (r11 == 0) ez++;
-        r12 = r[9] & 63; if (r12 == 0) ez++;
-        r13 = (r[9] >> 6 | r[10] << 2) & 63; if (r13 == 0) ez++;
-        r14 = (r[10] >> 4 | r[11] << 4) & 63; if (r14 == 0) ez++;
-        r15 = (r[11] >> 2) & 63; if (r15 == 0) ez++;
+    if (S < HLL_BUCKET_COUNT * 2.5 && ez != 0) {
+        S = HLL_BUCKET_COUNT * std::log ( double(HLL_BUCKET_COUNT) / double(ez));
+    } else if (HLL_BUCKET_COUNT == 16384 && S < 72000) {
+        double bias = 5.9119 * 1.0e-18 * (S * S * S * S)
+                      -1.4253 * 1.0e-12 * (S * S * S)+
+                      1.2940 * 1.0e-7 * ( S * S)
+                      -5.2921 * 1.0e-3 * S +
+                      83.3216;
+        S -= S * (bias / 100);
+    }
+    return S;
+}
+
+static uint64_t compute_card(const uint8_t* registers)
+{
+    size_t ez = 0;
+    auto E = kernels().sum(registers, HLL_BUCKET_COUNT, ez);
+    return estimate(E, ez);
+}
 
-        E += (PE[r0] + PE[r1]) + (PE[r2] + PE[r3]) + (PE[r4] + PE[r5]) +
-            (PE[r6] + PE[r7]) + (PE[r8] + PE[r9]) + (PE[r10] + PE[r11]) +
-            (PE[r12] + PE[r13]) + (PE[r14] + PE[r15]);
-        r += 12;
+// the sparse entries only hold the registers which are not zero, they are summed directly.
+static uint64_t compute_sparse_card(const uint8_t* p, size_t size)
+{
+    size_t n = size / HLL_SPARSE_ENTRY_SIZE;
+    double E = double(HLL_BUCKET_COUNT - n);
+    for (size_t i = 0; i < n; ++i) {
+        E += PE[hll_sparse_entry(p + i * HLL_SPARSE_ENTRY_SIZE) & 0xff];
     }
-    return E;
+    return estimate(E, HLL_BUCKET_COUNT - n);
 }
 
 static size_t hll_read_card_from_cache(const managed_bytes& data)
@@ -169,82 +312,204 @@ static void hll_write_card_to_cache(uint64_t card, managed_bytes& data)
     p[7] = (card >> 56) & 0xff;
 }
 
+// Replaces data with the registers, sparse if they fit into sparse_max_bytes.
+static void hll_store(managed_bytes& data, const uint8_t* registers, size_t sparse_max_bytes)
+{
+    size_t n = HLL_BUCKET_COUNT - std::count(registers, registers + HLL_BUCKET_COUNT, 0);
+    size_t sparse_size = HLL_CARD_CACHE_SIZE + n * HLL_SPARSE_ENTRY_SIZE;
+    bool sparse = sparse_size <= sparse_max_bytes && sparse_size < HLL_BYTES_SIZE;
+    std::vector<uint8_t> encoded(sparse ? sparse_size : HLL_BYTES_SIZE, 0);
+    if (sparse) {
+        auto p = encoded.data() + HLL_CARD_CACHE_SIZE;
+        for (uint32_t i = 0; i < HLL_BUCKET_COUNT; ++i) {
+            if (registers[i]) {
+                auto e = htole32(i << 8 | registers[i]);
+                std::memcpy(p, &e, sizeof(e));
+                p += HLL_SPARSE_ENTRY_SIZE;
+            }
+        }
+    }
+    else {
+        hll_pack(registers, encoded.data() + HLL_CARD_CACHE_SIZE);
+    }
+    hll_invalidate_cache(encoded.data(), HLL_CARD_CACHE_SIZE);
+    data = managed_bytes(bytes_view(reinterpret_cast<const int8_t*>(encoded.data()), encoded.size()));
+}
 
-static uint64_t compute_card(const uint8_t* data, size_t size)
+// registers = max(registers, the registers of the encoded HLL).
+static void hll_merge_into(uint8_t* registers, const uint8_t* data, size_t size)
 {
-    int ez = 0;
-    auto S = hll_bucket_counter_sum(data, size, ez);
+    auto p = data + HLL_CARD_CACHE_SIZE;
+    if (hll_is_sparse(size)) {
+        auto end = data + size;
+        for (; p != end; p += HLL_SPARSE_ENTRY_SIZE) {
+            auto e = hll_sparse_entry(p);
+            auto index = e >> 8;
+            if (index < HLL_BUCKET_COUNT) {
+                registers[index] = std::max(registers[index], uint8_t(e & 0xff));
+            }
+        }
+        return;
+    }
+    auto unpacked = scratch_registers();
+    hll_unpack(p, unpacked);
+    kernels().max(registers, unpacked, HLL_BUCKET_COUNT);
+}
 
-    S = (1/ S )* ALPHA_BUCKET_COUNT_POWER_2;
+static bool hll_add_sparse(managed_bytes& data, const std::vector<sstring>& elements, size_t sparse_max_bytes)
+{
+    auto p = reinterpret_cast<const uint8_t*>(data.data());
+    size_t n = (data.size() - HLL_CARD_CACHE_SIZE) / HLL_SPARSE_ENTRY_SIZE;
+    std::vector<uint32_t> entries(n);
+    for (size_t i = 0; i < n; ++i) {
+        entries[i] = hll_sparse_entry(p + HLL_CARD_CACHE_SIZE + i * HLL_SPARSE_ENTRY_SIZE);
+    }
+    bool updated = false;
+    for (auto& element : elements) {
+        uint32_t index;
+        uint8_t count;
+        hll_hash(element, index, count);
+        auto it = std::lower_bound(entries.begin(), entries.end(), index << 8);
+        if (it != entries.end() && (*it >> 8) == index) {
+            if (count > (*it & 0xff)) {
+                *it = index << 8 | count;
+                updated = true;
+            }
+        }
+        else {
+            entries.insert(it, index << 8 | count);
+            updated = true;
+        }
+    }
+    if (!updated) {
+        return false;
+    }
+    size_t sparse_size = HLL_CARD_CACHE_SIZE + entries.size() * HLL_SPARSE_ENTRY_SIZE;
+    if (sparse_size > sparse_max_bytes || sparse_size >= HLL_BYTES_SIZE) {
+        auto registers = scratch_registers();
+        std::fill_n(registers, HLL_BUCKET_COUNT, 0);
+        for (auto e : entries) {
+            registers[e >> 8] = e & 0xff;
+        }
+        hll_store(data, registers, 0);
+        return true;
+    }
+    std::vector<uint8_t> encoded(sparse_size, 0);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        auto e = htole32(entries[i]);
+        std::memcpy(encoded.data() + HLL_CARD_CACHE_SIZE + i * HLL_SPARSE_ENTRY_SIZE, &e, sizeof(e));
+    }
+    hll_invalidate_cache(encoded.data(), HLL_CARD_CACHE_SIZE);
+    data = managed_bytes(bytes_view(reinterpret_cast<const int8_t*>(encoded.data()), encoded.size()));
+    return true;
+}
 
-    if (S < HLL_BUCKET_COUNT * 2.5 && ez != 0) {
-        S = HLL_BUCKET_COUNT * std::log ( double(HLL_BUCKET_COUNT) / double(ez));
-    } else if (HLL_BUCKET_COUNT == 16384 && S < 72000) {
-        double bias = 5.9119 * 1.0e-18 * (S * S * S * S)
-                      -1.4253 * 1.0e-12 * (S * S * S)+
-                      1.2940 * 1.0e-7 * ( S * S)
-                      -5.2921 * 1.0e-3 * S +
-                      83.3216;
-        S -= S * (bias / 100);
+size_t hll::append(managed_bytes& data, const std::vector<sstring>& elements, size_t sparse_max_bytes)
+{
+    if (hll_is_sparse(data.size())) {
+        return hll_add_sparse(data, elements, sparse_max_bytes);
     }
-    return S;
+    uint8_t* p = (uint8_t*)(data.data()) + HLL_CARD_CACHE_SIZE;
+    bool updated = false;
+    for (auto& element : elements) {
+        uint32_t index;
+        uint8_t count;
+        hll_hash(element, index, count);
+        if (count > hll_get_register(p, index)) {
+            hll_set_register(p, index, count);
+            updated = true;
+        }
+    }
+    if (updated) {
+        hll_invalidate_cache((uint8_t*)(data.data()), HLL_CARD_CACHE_SIZE);
+    }
+    return updated;
 }
 
 size_t hll::count(managed_bytes& data)
 {
-    uint64_t card = 0;
     // read the card from cache.
     if (hll_is_valid_cache((uint8_t*)(data.data()), HLL_CARD_CACHE_SIZE)) {
         return hll_read_card_from_cache(data);
     }
     // compute the value of card.
-    auto S = compute_card((uint8_t*)(data.data()) + HLL_CARD_CACHE_SIZE, data.size() - HLL_CARD_CACHE_SIZE);
-    card = (uint64_t) S;
+    auto p = (const uint8_t*)(data.data()) + HLL_CARD_CACHE_SIZE;
+    uint64_t card = 0;
+    if (hll_is_sparse(data.size())) {
+        card = compute_sparse_card(p, data.size() - HLL_CARD_CACHE_SIZE);
+    }
+    else {
+        auto registers = scratch_registers();
+        hll_unpack(p, registers);
+        card = compute_card(registers);
+    }
     hll_write_card_to_cache(card, data);
     return (size_t) card;
 }
 
-size_t hll::count(const uint8_t* merged_sources, size_t size)
+size_t hll::count(const uint8_t* registers)
 {
-    auto S = compute_card(merged_sources + HLL_CARD_CACHE_SIZE, size - HLL_CARD_CACHE_SIZE);
-    return (size_t) S;
+    return (size_t) compute_card(registers);
 }
 
-size_t hll::merge(managed_bytes& data, const uint8_t* merged_sources, size_t size)
+size_t hll::merge(managed_bytes& data, const uint8_t* registers, size_t sparse_max_bytes)
 {
-    if (size != HLL_BYTES_SIZE) {
+    auto merged = std::make_unique<uint8_t[]>(HLL_BUCKET_COUNT);
+    std::copy_n(registers, HLL_BUCKET_COUNT, merged.get());
+    hll_merge_into(merged.get(), reinterpret_cast<const uint8_t*>(data.data()), data.size());
+    hll_store(data, merged.get(), sparse_max_bytes);
+    return 1;
+}
+
+size_t hll::merge(uint8_t* registers, const sstring& source)
+{
+    if (!hll_is_valid(source.size())) {
         return 0;
     }
-    uint8_t* p = (uint8_t*)(data.data()) + HLL_CARD_CACHE_SIZE;
-    const uint8_t* s = merged_sources + HLL_CARD_CACHE_SIZE;
-    uint8_t counter = 0, counter_s = 0;
-    for (size_t i = 0; i < HLL_BUCKET_COUNT; ++i) {
-        hll_get_counter_on_bucket(counter_s, s, i);
-        hll_get_counter_on_bucket(counter, p, i);
-        if (counter_s > counter) {
-            hll_set_counter_on_bucket(p, i, counter_s);
-        }
-    }
-    hll_invalidate_cache((uint8_t*)data.data(), HLL_CARD_CACHE_SIZE);
+    hll_merge_into(registers, reinterpret_cast<const uint8_t*>(source.data()), source.size());
     return 1;
 }
 
-size_t hll::merge(uint8_t* data, size_t size, const sstring& merged_sources)
+bool hll::sparse(const managed_bytes& data)
 {
-    if (merged_sources.size() != HLL_BYTES_SIZE) {
-        return 0;
+    return hll_is_sparse(data.size());
+}
+
+bool hll::valid(const char* data, size_t size)
+{
+    // the register of an element is at most the position of the bit set above its hash.
+    static constexpr uint8_t max_register = 64 - HLL_P + 1;
+    if (!hll_is_valid(size)) {
+        return false;
     }
-    uint8_t* p = data + HLL_CARD_CACHE_SIZE;
-    const uint8_t* s = (uint8_t*)(merged_sources.data()) + HLL_CARD_CACHE_SIZE;
-    uint8_t counter = 0, counter_s = 0;
-    for (size_t i = 0; i < HLL_BUCKET_COUNT; ++i) {
-        hll_get_counter_on_bucket(counter_s, s, i);
-        hll_get_counter_on_bucket(counter, p, i);
-        if (counter_s > counter) {
-            hll_set_counter_on_bucket(p, i, counter_s);
+    auto p = reinterpret_cast<const uint8_t*>(data) + HLL_CARD_CACHE_SIZE;
+    if (hll_is_sparse(size)) {
+        uint32_t next = 0;
+        for (auto end = p + size - HLL_CARD_CACHE_SIZE; p != end; p += HLL_SPARSE_ENTRY_SIZE) {
+            auto e = hll_sparse_entry(p);
+            auto index = e >> 8, v = e & 0xff;
+            if (index < next || index >= HLL_BUCKET_COUNT || v == 0 || v > max_register) {
+                return false;
+            }
+            next = index + 1;
         }
+        return true;
     }
-    hll_invalidate_cache(data, HLL_CARD_CACHE_SIZE);
-    return 1;
+    for (uint32_t i = 0; i < HLL_BUCKET_COUNT; ++i) {
+        if (hll_get_register(p, i) > max_register) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const char* hll::kernel_name()
+{
+    return kernels().name;
+}
+
+void hll::use_portable_kernels(bool portable)
+{
+    kernels().select(portable);
 }
 }
@@ -22,13 +22,33 @@
 #include "core/sstring.hh"
 #include "utils/managed_bytes.hh"
 namespace redis {
+// A HyperLogLog is stored in one of two encodings, told apart by their size:
+//
+//   dense:  [card cache: 8][HLL_BUCKET_COUNT registers of HLL_BITS bits], HLL_BYTES_SIZE bytes
+//   sparse: [card cache: 8][le32 index << 8 | register]... sorted by index, only the
+//           registers which are not zero, always smaller than the dense encoding.
+//
+// A new HLL is sparse, and becomes dense once its sparse encoding would take more
+// than sparse_max_bytes. PFCOUNT of several keys and PFMERGE merge into an array of
+// registers of one byte each, which the kernels combine and sum.
 class hll {
 public:
-    static size_t append(managed_bytes& data, const std::vector<sstring>& elements);
+    static size_t append(managed_bytes& data, const std::vector<sstring>& elements, size_t sparse_max_bytes);
     static size_t count(managed_bytes& data);
-    static size_t count(const uint8_t* merged_sources, size_t size);
-    static size_t merge(managed_bytes& data, const uint8_t* merged_sources, size_t size); 
-    static size_t merge(uint8_t* dest, size_t size, const sstring& merged_sources); 
+    // the cardinality of HLL_BUCKET_COUNT registers of one byte.
+    static size_t count(const uint8_t* registers);
+    // data = max(data, registers), data stays sparse while it fits.
+    static size_t merge(managed_bytes& data, const uint8_t* registers, size_t sparse_max_bytes);
+    // registers = max(registers, the registers of an encoded HLL).
+    static size_t merge(uint8_t* registers, const sstring& source);
+    static bool sparse(const managed_bytes& data);
+    // the bytes are an HLL of either encoding: a string holding them is one, as
+    // the SET of the raw bytes which logs PFMERGE restores it.
+    static bool valid(const char* data, size_t size);
+    // the kernels selected for this cpu.
+    static const char* kernel_name();
+    // the portable kernels instead of the ones of this cpu, which the tests compare.
+    static void use_portable_kernels(bool portable);
 };
 
 }
@@ -0,0 +1,76 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <endian.h>
+
+namespace redis {
+
+static constexpr uint64_t key_hash_seed = 0x9e3779b97f4a7c15ULL;
+
+// MurmurHash64A of a key. It does not depend on the platform like std::hash, and
+// all of its 64 bits are well mixed: the shard of a key is taken from the high
+// half (shard_of) and the cache bucket from the low bits (hash_table), so the
+// keys of a shard still spread over all of its buckets.
+inline uint64_t hash_key(const char* data, size_t size, uint64_t seed = key_hash_seed)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = seed ^ (size * m);
+    auto p = data;
+    auto end = data + (size & ~size_t(7));
+    for (; p != end; p += 8) {
+        // the words are little endian, so a key hashes the same on every platform.
+        uint64_t k;
+        std::memcpy(&k, p, sizeof(k));
+        k = le64toh(k);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    auto tail = reinterpret_cast<const uint8_t*>(p);
+    switch (size & 7) {
+    case 7: h ^= uint64_t(tail[6]) << 48; // fall through
+    case 6: h ^= uint64_t(tail[5]) << 40; // fall through
+    case 5: h ^= uint64_t(tail[4]) << 32; // fall through
+    case 4: h ^= uint64_t(tail[3]) << 24; // fall through
+    case 3: h ^= uint64_t(tail[2]) << 16; // fall through
+    case 2: h ^= uint64_t(tail[1]) << 8;  // fall through
+    case 1: h ^= uint64_t(tail[0]);
+            h *= m;
+    };
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+// Maps the high 32 bits of a key hash onto [0, shards) by multiply and shift,
+// which is uniform for any number of shards and leaves the low bits to buckets.
+inline unsigned shard_of(uint64_t hash, unsigned shards)
+{
+    return static_cast<unsigned>(((hash >> 32) * shards) >> 32);
+}
+}
@@ -20,37 +20,70 @@
 */
 #pragma once
 #include <boost/intrusive/list.hpp>
+#include <cstring>
+#include <iterator>
+#include <memory>
 #include "utils/allocation_strategy.hh"
 #include "utils/managed_ref.hh"
 #include "utils/managed_bytes.hh"
 namespace redis {
+// A quicklist: the elements are packed back to back into chunks of at most
+// max_chunk_bytes, and the chunks are linked in a list. Every chunk counts
+// its elements, so that a seek by index skips whole chunks, while pushes and
+// pops at both ends only touch the first or the last chunk. Neighbouring
+// chunks which fit together into one are merged after removals.
 class list_lsa {
-    struct internal_node {
+    static constexpr size_t min_chunk_bytes = 64;
+    static constexpr size_t max_chunk_bytes = 8192;
+    using size_field = uint32_t;
+
+    // Every element is laid out as [size: 4][data][size: 4], so that a chunk can
+    // be walked in both directions. The elements live in [_begin, _end) of the
+    // buffer, the free space on both sides takes the pushes in place.
+    // A chunk holding more than one element never exceeds max_chunk_bytes, so
+    // its buffer is never fragmented and may be written in place.
+    struct chunk {
         boost::intrusive::list_member_hook<> _link;
         managed_bytes _data;
-        internal_node(bytes_view data) noexcept : _link(), _data(data) {}
-        internal_node(internal_node&& o) noexcept
-            : _link(std::move(o._link)), _data(std::move(o._data))
+        size_field _begin = 0;
+        size_field _end = 0;
+        size_field _count = 0;
+
+        chunk() noexcept {}
+        chunk(chunk&& o) noexcept
+            : _link()
+            , _data(std::move(o._data))
+            , _begin(o._begin)
+            , _end(o._end)
+            , _count(o._count)
         {
+            _link.swap_nodes(o._link);
         }
-        inline bool operator==(const internal_node& o) const
+
+        inline size_t capacity() const { return _data.size(); }
+        inline size_t used() const { return _end - _begin; }
+        inline const char* data() const { return reinterpret_cast<const char*>(_data.data()); }
+        inline char* mutable_data() { return reinterpret_cast<char*>(_data.data()); }
+        inline bool has_room(size_t need, bool front) const
         {
-            return _data == o._data;
+            return front ? _begin >= need : capacity() - _end >= need;
         }
     };
-    using internal_list_type = boost::intrusive::list<internal_node,
-                                                      boost::intrusive::member_hook<internal_node, boost::intrusive::list_member_hook<>,
-                                                      &internal_node::_link>>;
-    using const_iterator = internal_list_type::const_iterator;
-    using iterator = internal_list_type::iterator;
-    internal_list_type  _list;
+    using chunk_list_type = boost::intrusive::list<chunk,
+                                                   boost::intrusive::member_hook<chunk, boost::intrusive::list_member_hook<>, &chunk::_link>,
+                                                   boost::intrusive::constant_time_size<false>>;
+    using chunk_iterator = chunk_list_type::iterator;
+    using const_chunk_iterator = chunk_list_type::const_iterator;
+    chunk_list_type _chunks;
+    size_t _size = 0;
 public:
     list_lsa() noexcept
     {
     }
 
-    list_lsa(list_lsa&& o) noexcept : _list(std::move(o._list))
+    list_lsa(list_lsa&& o) noexcept : _chunks(std::move(o._chunks)), _size(o._size)
     {
+        o._size = 0;
     }
 
     ~list_lsa()
@@ -60,88 +93,120 @@ public:
     // Inserts the value in the front of the list.
     inline void insert_head(const sstring& data)
     {
-        bytes_view v {reinterpret_cast<const signed char*>(data.data()), data.size()};
-        auto entry = current_allocator().construct<internal_node>(v);
-        _list.push_front(*entry);
+        push(_chunks.begin(), view_of(data), true);
     }
 
     // Inserts the value in the back of the list.
     inline void insert_tail(const sstring& data)
     {
-        bytes_view v {reinterpret_cast<const signed char*>(data.data()), data.size()};
-        auto entry = current_allocator().construct<internal_node>(v);
-        _list.push_back(*entry);
+        push(_chunks.empty() ? _chunks.end() : std::prev(_chunks.end()), view_of(data), false);
     }
 
+    // Inserts the value before the index-th element, or in the back if index is size().
     inline void insert_at(size_t index, const sstring& data)
     {
-        assert(index < _list.size());
-        bytes_view v {reinterpret_cast<const signed char*>(data.data()), data.size()};
-        auto entry = current_allocator().construct<internal_node>(v);
-        const_iterator p = iterator_to(index);
-        _list.insert(p, *entry);
+        assert(index <= _size);
+        if (index == 0) {
+            return insert_head(data);
+        }
+        if (index == _size) {
+            return insert_tail(data);
+        }
+        size_t offset = 0;
+        auto it = locate(index, offset);
+        if (offset != it->_begin) {
+            split(it, offset);
+        }
+        // the value goes to the front of the chunk, which starts with the index-th element.
+        push(it, view_of(data), true);
     }
 
-    inline size_t index_of(const std::string& pivot)
+    inline size_t index_of(const std::string& pivot) const
     {
-        size_t result = _list.size();
-        for (auto i = _list.begin(); i != _list.end(); ++i, --result) {
-            if (equal(pivot, *i)) {
-                return _list.size() - result;
+        size_t index = 0;
+        for (auto& c : _chunks) {
+            for (size_t offset = c._begin; offset < c._end; offset = next_of(c, offset), ++index) {
+                if (equal(view_at(c, offset), pivot)) {
+                    return index;
+                }
             }
         }
-        return result;
+        return _size;
     }
 
-    inline const managed_bytes& at(size_t index) const
+    // Returns the index-th element, which is only valid until the list is modified.
+    inline bytes_view at(size_t index) const
     {
-        assert(index < _list.size());
-        auto i = iterator_to(index);
-        return i->_data;
+        assert(index < _size);
+        size_t offset = 0;
+        auto it = locate(index, offset);
+        return view_at(*it, offset);
     }
 
-    inline managed_bytes& at(size_t index)
+    // Replaces the index-th element.
+    inline void set(size_t index, const sstring& data)
     {
-        assert(index < _list.size());
-        iterator i = iterator_to(index);
-        return i->_data;
+        assert(index < _size);
+        size_t offset = 0;
+        auto it = locate(index, offset);
+        auto& c = *it;
+        if (read_size(c.data() + offset) == data.size() && c.capacity() <= max_chunk_bytes) {
+            memcpy(c.mutable_data() + offset + sizeof(size_field), data.data(), data.size());
+            return;
+        }
+        erase_at(it, offset);
+        insert_at(index, data);
     }
 
-    // Returns a reference to the data of first element of the list.
-    inline const managed_bytes& front() const
+    // Returns the data of first element of the list.
+    inline bytes_view front() const
     {
-        auto& front_ref = _list.front();
-        return front_ref._data;
+        auto& c = _chunks.front();
+        return view_at(c, c._begin);
     }
 
-    // Erases the first element of the list. Destructors are called.
+    // Erases the first element of the list.
     inline void pop_front()
     {
-        _list.pop_front_and_dispose(current_deleter<internal_node>());
+        auto it = _chunks.begin();
+        erase_at(it, it->_begin);
+        if (!_chunks.empty()) {
+            merge_around(_chunks.begin());
+        }
     }
 
-    // Returns a reference to the data of last element of the list.
-    inline const managed_bytes& back() const
+    // Returns the data of last element of the list.
+    inline bytes_view back() const
     {
-        auto& back_ref = _list.back();
-        return back_ref._data;
+        auto& c = _chunks.back();
+        return view_at(c, prev_of(c, c._end));
     }
 
-    // Erases the last element of the list. Destructors are called.
+    // Erases the last element of the list.
     inline void pop_back()
     {
-        _list.pop_back_and_dispose(current_deleter<internal_node>());
+        auto it = std::prev(_chunks.end());
+        erase_at(it, prev_of(*it, it->_end));
+        if (!_chunks.empty()) {
+            merge_around(std::prev(_chunks.end()));
+        }
     }
 
     inline bool empty() const
     {
-        return _list.empty();
+        return _size == 0;
     }
 
     // Returns the number of the elements contained in the list.
     inline size_t size() const
     {
-        return static_cast<size_t>(_list.size());
+        return _size;
+    }
+
+    // Returns the number of the chunks holding the elements.
+    inline size_t chunk_count() const
+    {
+        return std::distance(_chunks.begin(), _chunks.end());
     }
 
     // Erase the elements from the list.
@@ -154,93 +219,391 @@ public:
     inline size_t trem(const std::string& data, size_t count)
     {
         size_t erased = 0;
+        auto done = [&erased, count] { return !RemoveAllEqual && erased == count; };
         if (FromHeadToTail) {
-            for (auto it = _list.begin(); it != _list.end(); ++it) {
-                if (equal(*it, data)) {
-                    ++erased;
-                    const_iterator eit = it;
-                    ++it;
-                    _list.erase_and_dispose(eit, current_deleter<internal_node>());
-                    if (!RemoveAllEqual && erased == count) {
-                        break;
+            for (auto it = _chunks.begin(); it != _chunks.end() && !done();) {
+                auto next = std::next(it);
+                size_t offset = it->_begin;
+                while (offset < it->_end && !done()) {
+                    if (equal(view_at(*it, offset), data)) {
+                        ++erased;
+                        bool last = it->_count == 1;
+                        offset = erase_at(it, offset);
+                        if (last) {
+                            break;
+                        }
+                    }
+                    else {
+                        offset = next_of(*it, offset);
                     }
                 }
+                it = next;
             }
         }
         else {
-            for (auto it = _list.rbegin(); it != _list.rend(); ++it) {
-                if (equal(*it, data)) {
-                    ++erased;
-                    auto& entry = *it;
-                    ++it;
-                    _list.remove_and_dispose(entry, current_deleter<internal_node>());
-                    if (!RemoveAllEqual && erased == count) {
-                        break;
+            // end stays valid when the chunk before it is erased.
+            for (auto end = _chunks.end(); end != _chunks.begin() && !done();) {
+                auto it = std::prev(end);
+                bool alive = true;
+                size_t offset = it->_end;
+                while (offset > it->_begin && !done()) {
+                    offset = prev_of(*it, offset);
+                    if (equal(view_at(*it, offset), data)) {
+                        ++erased;
+                        alive = it->_count > 1;
+                        erase_at(it, offset);
+                        if (!alive) {
+                            break;
+                        }
                     }
                 }
+                if (alive) {
+                    end = it;
+                }
             }
         }
+        if (erased > 0) {
+            merge_chunks();
+        }
         return erased;
     }
 
+    // Keeps the elements in [start, end).
     inline bool trim(size_t start, size_t end)
     {
-        auto i = iterator_to(start);
-        for (auto it = _list.begin(); it != i; ++it) {
-            _list.erase_and_dispose(it, current_deleter<internal_node>());
+        if (end > _size) {
+            end = _size;
         }
-        for (auto it = iterator_to(end); it != _list.end(); ++it) {
-            _list.erase_and_dispose(it, current_deleter<internal_node>());
+        if (start >= end) {
+            clear();
+            return true;
         }
+        erase_back(_size - end);
+        erase_front(start);
+        merge_around(_chunks.begin());
+        merge_around(std::prev(_chunks.end()));
         return true;
     }
 
     // Erases all the elements of the list. Destructors are called.
     inline void clear()
     {
-        _list.clear_and_dispose(current_deleter<internal_node>());
+        _chunks.clear_and_dispose(current_deleter<chunk>());
+        _size = 0;
     }
 
-    // reduce
-    void reduce(size_t start, size_t end, std::function<void(const_iterator it)>&& reduce_fn)
+    // Appends the elements in [start, end) to result, which are only valid until
+    // the list is modified.
+    void range(size_t start, size_t end, std::vector<bytes_view>& result) const
     {
-        auto start_it = iterator_to(start);
-        auto end_it = iterator_to(end);
-        for (; start_it != end_it; ++start_it) {
-            reduce_fn(start_it);
+        if (end > _size) {
+            end = _size;
+        }
+        if (start >= end) {
+            return;
+        }
+        result.reserve(result.size() + end - start);
+        size_t offset = 0;
+        auto it = locate(start, offset);
+        for (size_t n = end - start; n > 0; --n) {
+            result.push_back(view_at(*it, offset));
+            offset = next_of(*it, offset);
+            if (offset == it->_end && n > 1) {
+                ++it;
+                offset = it->_begin;
+            }
         }
     }
 
     bool index_out_of_range(long index) const
     {
-        return index < 0 || static_cast<size_t>(index) > _list.size();
+        return index < 0 || static_cast<size_t>(index) >= _size;
     }
 private:
-    const_iterator iterator_to(size_t index) const
+    static inline bytes_view view_of(const sstring& s)
+    {
+        return bytes_view {reinterpret_cast<const signed char*>(s.data()), s.size()};
+    }
+
+    static inline size_t encoded_size(size_t size)
+    {
+        return size + 2 * sizeof(size_field);
+    }
+
+    static inline size_field read_size(const char* p)
+    {
+        size_field size;
+        memcpy(&size, p, sizeof(size));
+        return size;
+    }
+
+    static inline char* encode(char* p, bytes_view v)
+    {
+        size_field size = static_cast<size_field>(v.size());
+        memcpy(p, &size, sizeof(size));
+        p += sizeof(size);
+        memcpy(p, v.data(), v.size());
+        p += v.size();
+        memcpy(p, &size, sizeof(size));
+        return p + sizeof(size);
+    }
+
+    static inline bytes_view view_at(const chunk& c, size_t offset)
+    {
+        auto p = c.data() + offset;
+        return bytes_view {reinterpret_cast<const signed char*>(p + sizeof(size_field)), read_size(p)};
+    }
+
+    static inline size_t next_of(const chunk& c, size_t offset)
     {
-        auto i = _list.begin();
-        for (size_t idx = 0; idx < index && i != _list.end(); ++idx, ++i) {};
-        return i;
+        return offset + encoded_size(read_size(c.data() + offset));
     }
-    iterator iterator_to(size_t index)
+
+    static inline size_t prev_of(const chunk& c, size_t offset)
     {
-        auto i = _list.begin();
-        for (size_t idx = 0; idx < index && i != _list.end(); ++idx, ++i) {};
-        return i;
+        return offset - encoded_size(read_size(c.data() + offset - sizeof(size_field)));
     }
 
-    inline bool equal(const internal_node& n, const sstring& data) const
+    static inline bool equal(bytes_view v, const std::string& data)
     {
-        auto mb = n._data;
-        bytes_view b {mb.data(), mb.size()} ;
-        bytes_view a {reinterpret_cast<const signed char*>(data.data()), data.size()};
-        return b == a;
+        return v.size() == data.size() && memcmp(v.data(), data.data(), data.size()) == 0;
     }
 
-    inline bool equal(const sstring& data, const internal_node& n) const
+    // Finds the chunk and the offset of the index-th element, walking from the nearer end.
+    template <typename Iterator, typename List>
+    static Iterator locate_in(List& chunks, size_t size, size_t index, size_t& offset)
     {
-        return equal(data, n);
+        if (index < size / 2) {
+            auto it = chunks.begin();
+            for (; index >= it->_count; ++it) {
+                index -= it->_count;
+            }
+            for (offset = it->_begin; index > 0; --index) {
+                offset = next_of(*it, offset);
+            }
+            return it;
+        }
+        size_t from_back = size - 1 - index;
+        auto it = chunks.end();
+        for (--it; from_back >= it->_count; --it) {
+            from_back -= it->_count;
+        }
+        offset = prev_of(*it, it->_end);
+        for (; from_back > 0; --from_back) {
+            offset = prev_of(*it, offset);
+        }
+        return it;
     }
 
+    inline const_chunk_iterator locate(size_t index, size_t& offset) const
+    {
+        return locate_in<const_chunk_iterator>(_chunks, _size, index, offset);
+    }
+
+    inline chunk_iterator locate(size_t index, size_t& offset)
+    {
+        return locate_in<chunk_iterator>(_chunks, _size, index, offset);
+    }
+
+    // Pushes v into the front or the back of the chunk at it, or into a new chunk
+    // linked next to it if v does not fit. it may be end() if the list is empty.
+    void push(chunk_iterator it, bytes_view v, bool front)
+    {
+        const size_t need = encoded_size(v.size());
+        if (it != _chunks.end() && !it->has_room(need, front)) {
+            if (it->used() + need <= max_chunk_bytes) {
+                grow(*it, need, front);
+            }
+            else {
+                auto c = make_chunk(v, front);
+                _chunks.insert(front ? it : std::next(it), *c);
+                ++_size;
+                return;
+            }
+        }
+        if (it == _chunks.end()) {
+            auto c = make_chunk(v, front);
+            _chunks.push_back(*c);
+            ++_size;
+            return;
+        }
+        auto& c = *it;
+        if (front) {
+            c._begin -= need;
+            encode(c.mutable_data() + c._begin, v);
+        }
+        else {
+            encode(c.mutable_data() + c._end, v);
+            c._end += need;
+        }
+        ++c._count;
+        ++_size;
+    }
+
+    // Makes a chunk holding v only, with the room for the pushes on the front or
+    // the back side unless v is too large.
+    static chunk* make_chunk(bytes_view v, bool front)
+    {
+        const size_t need = encoded_size(v.size());
+        auto c = current_allocator().construct<chunk>();
+        size_t begin = 0;
+        if (need > max_chunk_bytes) {
+            // too large to be written in place, the buffer may be fragmented.
+            std::unique_ptr<char[]> buffer(new char[need]);
+            encode(buffer.get(), v);
+            c->_data = managed_bytes(bytes_view {reinterpret_cast<const signed char*>(buffer.get()), need});
+        }
+        else {
+            const size_t capacity = need > min_chunk_bytes ? need : min_chunk_bytes;
+            c->_data = managed_bytes(managed_bytes::initialized_later(), capacity);
+            begin = front ? capacity - need : 0;
+            encode(c->mutable_data() + begin, v);
+        }
+        c->_begin = static_cast<size_field>(begin);
+        c->_end = static_cast<size_field>(begin + need);
+        c->_count = 1;
+        return c;
+    }
+
+    // Reallocates the buffer of the chunk with the room for need bytes more.
+    // The elements are read after the allocation, which may move them.
+    static void grow(chunk& c, size_t need, bool front)
+    {
+        const size_t used = c.used();
+        size_t capacity = std::max(c.capacity() * 2, used + need);
+        if (capacity > max_chunk_bytes) {
+            capacity = max_chunk_bytes;
+        }
+        managed_bytes data(managed_bytes::initialized_later(), capacity);
+        const size_t begin = front ? capacity - used : 0;
+        memcpy(reinterpret_cast<char*>(data.data()) + begin, c.data() + c._begin, used);
+        c._data = std::move(data);
+        c._begin = static_cast<size_field>(begin);
+        c._end = static_cast<size_field>(begin + used);
+    }
+
+    // Moves the elements before offset of the chunk at it into a new chunk linked
+    // before it, so that the chunk at it starts with the element at offset.
+    void split(chunk_iterator it, size_t offset)
+    {
+        auto c = current_allocator().construct<chunk>();
+        const size_t used = offset - it->_begin;
+        c->_data = managed_bytes(managed_bytes::initialized_later(), used > min_chunk_bytes ? used : min_chunk_bytes);
+        memcpy(c->mutable_data(), it->data() + it->_begin, used);
+        c->_end = static_cast<size_field>(used);
+        for (size_t o = it->_begin; o < offset; o = next_of(*it, o)) {
+            ++c->_count;
+        }
+        it->_count -= c->_count;
+        it->_begin = static_cast<size_field>(offset);
+        _chunks.insert(it, *c);
+    }
+
+    // Erases the element at offset of the chunk at it, and the chunk if it becomes
+    // empty. Returns the offset of the next element in the chunk.
+    size_t erase_at(chunk_iterator it, size_t offset)
+    {
+        auto& c = *it;
+        const size_t size = encoded_size(read_size(c.data() + offset));
+        size_t next = offset;
+        if (offset == c._begin) {
+            c._begin += size;
+            next = c._begin;
+        }
+        else if (offset + size == c._end) {
+            c._end -= size;
+        }
+        else {
+            memmove(c.mutable_data() + offset, c.data() + offset + size, c._end - offset - size);
+            c._end -= size;
+        }
+        --c._count;
+        --_size;
+        if (c._count == 0) {
+            _chunks.erase_and_dispose(it, current_deleter<chunk>());
+        }
+        return next;
+    }
+
+    static inline bool fit(const chunk& left, const chunk& right)
+    {
+        return left.used() + right.used() <= max_chunk_bytes;
+    }
+
+    // Appends the elements of the chunk at right to the chunk at left, and erases
+    // the chunk at right. Returns left.
+    chunk_iterator merge(chunk_iterator left, chunk_iterator right)
+    {
+        const size_t need = right->used();
+        if (!left->has_room(need, false)) {
+            grow(*left, need, false);
+        }
+        memcpy(left->mutable_data() + left->_end, right->data() + right->_begin, need);
+        left->_end += need;
+        left->_count += right->_count;
+        _chunks.erase_and_dispose(right, current_deleter<chunk>());
+        return left;
+    }
+
+    // Merges the chunk at it with its neighbours which fit with it into one chunk.
+    void merge_around(chunk_iterator it)
+    {
+        if (it != _chunks.begin() && fit(*std::prev(it), *it)) {
+            it = merge(std::prev(it), it);
+        }
+        auto next = std::next(it);
+        if (next != _chunks.end() && fit(*it, *next)) {
+            merge(it, next);
+        }
+    }
+
+    // Merges all the neighbouring chunks which fit into one, after removals
+    // anywhere in the list.
+    void merge_chunks()
+    {
+        for (auto it = _chunks.begin(); it != _chunks.end();) {
+            auto next = std::next(it);
+            if (next != _chunks.end() && fit(*it, *next)) {
+                merge(it, next);
+            }
+            else {
+                it = next;
+            }
+        }
+    }
+
+    // Erases the first n elements, dropping whole chunks where possible.
+    void erase_front(size_t n)
+    {
+        while (n > 0) {
+            auto it = _chunks.begin();
+            if (it->_count <= n) {
+                n -= it->_count;
+                _size -= it->_count;
+                _chunks.erase_and_dispose(it, current_deleter<chunk>());
+            }
+            else {
+                erase_at(it, it->_begin);
+                --n;
+            }
+        }
+    }
+
+    // Erases the last n elements, dropping whole chunks where possible.
+    void erase_back(size_t n)
+    {
+        while (n > 0) {
+            auto it = std::prev(_chunks.end());
+            if (it->_count <= n) {
+                n -= it->_count;
+                _size -= it->_count;
+                _chunks.erase_and_dispose(it, current_deleter<chunk>());
+            }
+            else {
+                erase_at(it, prev_of(*it, it->_end));
+                --n;
+            }
+        }
+    }
 };
 }
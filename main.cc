@@ -22,6 +22,7 @@
 #include "db.hh"
 #include "redis.hh"
 #include "redis_protocol.hh"
+#include "snapshot.hh"
 #include "server.hh"
 #include "util/log.hh"
 #include "core/prometheus.hh"
@@ -84,10 +85,12 @@ int main(int ac, char** av) {
                 auto& token_ring = redis::ring();
                 auto& proxy = redis::get_storage_proxy();
                 auto& ss = redis::get_storage_service();
+                auto& snapshots = redis::get_snapshot_manager();
 
                 engine().at_exit([&] { return db.stop(); });
                 engine().at_exit([&] { return server.stop(); });
                 engine().at_exit([&] { return redis.stop(); });
+                engine().at_exit([&] { return snapshots.stop(); });
                 engine().at_exit([&] { return token_ring.stop(); });
                 engine().at_exit([&] { return proxy.stop(); });
                 engine().at_exit([&] { return ss.stop(); });
@@ -96,7 +99,20 @@ int main(int ac, char** av) {
                 auto port = cfg->service_port();
                 auto pport = cfg->prometheus_port();
                 // start databse
-                db.start().get();
+                db.start(std::ref(*cfg)).get();
+                redis.start().get();
+                snapshots.start(std::ref(*cfg)).get();
+
+                // load the latest snapshot and replay the commit log after it before
+                // serving, then log the new mutations
+                auto position = snapshots.local().load().get0();
+                if (cfg->enable_commitlog()) {
+                    auto generation = ::redis::commit_log::replay(::redis::commit_log::make_config(*cfg).directory, std::move(position)).get0();
+                    db.invoke_on_all([generation] (auto& local) {
+                        return local.start_commitlog(generation);
+                    }).get();
+                }
+                snapshots.invoke_on_all(&::redis::snapshot_manager::start).get();
 
                 // start gossper
                 sstring listen_address = cfg->listen_address();
@@ -139,7 +155,10 @@ int main(int ac, char** av) {
 
                 token_ring.start().get();
                 proxy.start().get();
+                proxy.invoke_on_all(&redis::storage_proxy::start).get();
                 ss.start().get();
+                // join the cluster once the forwarded requests can be served
+                ss.invoke_on(0, &redis::storage_service::start).get();
 
                 gms::get_local_gossiper().wait_for_gossip_to_settle().get();
 
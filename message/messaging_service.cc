@@ -31,10 +31,13 @@
 #include "rpc/rpc.hh"
 #include "config.hh"
 #include "digest_algorithm.hh"
+#include "internal_message.hh"
 #include "idl/gossip_digest.dist.hh"
+#include "idl/internal_message.dist.hh"
 #include "serializer_impl.hh"
 #include "serialization_visitors.hh"
 #include "idl/gossip_digest.dist.impl.hh"
+#include "idl/internal_message.dist.impl.hh"
 #include "rpc/lz4_compressor.hh"
 #include "rpc/multi_algo_compressor_factory.hh"
 
@@ -695,4 +698,26 @@ void messaging_service::unregister_gossip_digest_ack2() {
 future<> messaging_service::send_gossip_digest_ack2(msg_addr id, gossip_digest_ack2 msg) {
     return send_message_oneway(this, messaging_verb::GOSSIP_DIGEST_ACK2, std::move(id), std::move(msg));
 }
+
+// internal read
+void messaging_service::register_internal_read(std::function<future<sstring> (const rpc::client_info& cinfo, redis::internal_read_message)>&& func) {
+    register_handler(this, messaging_verb::INTERNAL_READ, std::move(func));
+}
+void messaging_service::unregister_internal_read() {
+    _rpc->unregister_handler(net::messaging_verb::INTERNAL_READ);
+}
+future<sstring> messaging_service::send_internal_read(msg_addr id, redis::internal_read_message msg) {
+    return send_message<sstring>(this, messaging_verb::INTERNAL_READ, std::move(id), std::move(msg));
+}
+
+// internal write
+void messaging_service::register_internal_write(std::function<future<sstring> (const rpc::client_info& cinfo, redis::internal_write_message)>&& func) {
+    register_handler(this, messaging_verb::INTERNAL_WRITE, std::move(func));
+}
+void messaging_service::unregister_internal_write() {
+    _rpc->unregister_handler(net::messaging_verb::INTERNAL_WRITE);
+}
+future<sstring> messaging_service::send_internal_write(msg_addr id, redis::internal_write_message msg) {
+    return send_message<sstring>(this, messaging_verb::INTERNAL_WRITE, std::move(id), std::move(msg));
+}
 }
@@ -209,17 +209,16 @@ public:
     void unregister_gossip_digest_ack2();
     future<> send_gossip_digest_ack2(msg_addr id, gms::gossip_digest_ack2 msg);
 
-    // Wrapper for INTERNAL_DATA_BUS_REQUEST
-    /*
-    void register_internal_read(std::function<future<foreign_ptr<lw_shared_ptr<scattered_message<char>>> (const rpc::client& cinfo, internal_read_request)>&& fun);
+    // Wrapper for INTERNAL_READ, the reply is the RESP reply of the owner node.
+    void register_internal_read(std::function<future<sstring> (const rpc::client_info& cinfo, redis::internal_read_message)>&& func);
     void unregister_internal_read();
-    future<foreign_ptr<lw_shared_ptr<scattered_message<char>>> send_internal_read(msg_addr id, internal_read_request msg);
+    future<sstring> send_internal_read(msg_addr id, redis::internal_read_message msg);
 
-
-    void register_internal_write(std::function<future<foreign_ptr<lw_shared_ptr<scattered_message<char>>> (const rpc::client& cinfo, internal_write_message)>&& fun);
+    // Wrapper for INTERNAL_WRITE
+    void register_internal_write(std::function<future<sstring> (const rpc::client_info& cinfo, redis::internal_write_message)>&& func);
     void unregister_internal_write();
-    future<foreign_ptr<lw_shared_ptr<scattered_message<char>>> send_internal_write(msg_addr id, internal_write_message msg);
-    */
+    future<sstring> send_internal_write(msg_addr id, redis::internal_write_message msg);
+
     void foreach_server_connection_stats(std::function<void(const rpc::client_info&, const rpc::stats&)>&& f) const;
 public:
     // Return rpc::protocol::client for a shard which is a ip + cpuid pair.
@@ -0,0 +1,415 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <boost/intrusive/parent_from_member.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+
+namespace redis {
+
+class rank_tree_hook;
+template <typename T, rank_tree_hook T::*Hook, typename Less>
+class rank_tree;
+
+// The hook of rank_tree. Every hook keeps the number of the nodes in the subtree
+// rooted at it, so that rank() and select() are O(log N).
+// Moving a linked hook relinks its parent and children to the new address, which
+// lets the objects holding it to be migrated by LSA.
+class rank_tree_hook {
+    template <typename T, rank_tree_hook T::*Hook, typename Less>
+    friend class rank_tree;
+    rank_tree_hook* _parent = nullptr;
+    rank_tree_hook* _left = nullptr;
+    rank_tree_hook* _right = nullptr;
+    uint32_t _count = 0;
+    uint32_t _priority = 0;
+public:
+    rank_tree_hook() noexcept {}
+
+    rank_tree_hook(rank_tree_hook&& o) noexcept
+        : _parent(o._parent)
+        , _left(o._left)
+        , _right(o._right)
+        , _count(o._count)
+        , _priority(o._priority)
+    {
+        if (_parent) {
+            if (_parent->_left == &o) {
+                _parent->_left = this;
+            }
+            else {
+                _parent->_right = this;
+            }
+        }
+        if (_left) {
+            _left->_parent = this;
+        }
+        if (_right) {
+            _right->_parent = this;
+        }
+        o._parent = o._left = o._right = nullptr;
+        o._count = 0;
+    }
+
+    rank_tree_hook(const rank_tree_hook&) = delete;
+    rank_tree_hook& operator = (const rank_tree_hook&) = delete;
+
+    inline bool is_linked() const {
+        return _parent != nullptr;
+    }
+};
+
+// An intrusive treap augmented with subtree counts (an order-statistic tree).
+// Insert, erase, rank and select are O(log N) expected, and range scans start
+// with a logarithmic seek instead of walking from the head.
+// The root hangs on the left of _header, the header is the end() position.
+template <typename T, rank_tree_hook T::*Hook, typename Less>
+class rank_tree {
+    rank_tree_hook _header;
+    uint32_t _seed = 2463534242U;
+
+    template <typename V>
+    class iterator_impl : public std::iterator<std::bidirectional_iterator_tag, V> {
+        friend class rank_tree;
+        rank_tree_hook* _node;
+        rank_tree_hook* _header;
+        iterator_impl(rank_tree_hook* node, rank_tree_hook* header) : _node(node), _header(header) {}
+    public:
+        iterator_impl() : _node(nullptr), _header(nullptr) {}
+        template <typename U, typename = std::enable_if_t<std::is_const<V>::value && !std::is_const<U>::value>>
+        iterator_impl(const iterator_impl<U>& o) : _node(o._node), _header(o._header) {}
+        inline V& operator * () const { return to_value(_node); }
+        inline V* operator -> () const { return &to_value(_node); }
+        inline iterator_impl& operator ++ () {
+            _node = successor(_node, _header);
+            return *this;
+        }
+        inline iterator_impl operator ++ (int) {
+            auto it = *this;
+            ++(*this);
+            return it;
+        }
+        inline iterator_impl& operator -- () {
+            _node = predecessor(_node, _header);
+            return *this;
+        }
+        inline iterator_impl operator -- (int) {
+            auto it = *this;
+            --(*this);
+            return it;
+        }
+        inline bool operator == (const iterator_impl& o) const { return _node == o._node; }
+        inline bool operator != (const iterator_impl& o) const { return _node != o._node; }
+        template <typename U>
+        friend class iterator_impl;
+    };
+public:
+    using iterator = iterator_impl<T>;
+    using const_iterator = iterator_impl<const T>;
+
+    rank_tree() noexcept {}
+    rank_tree(rank_tree&& o) noexcept : _header(std::move(o._header)), _seed(o._seed) {}
+    rank_tree(const rank_tree&) = delete;
+    rank_tree& operator = (const rank_tree&) = delete;
+
+    inline size_t size() const { return count(root()); }
+    inline bool empty() const { return root() == nullptr; }
+
+    inline iterator begin() { return make_iterator(leftmost(root())); }
+    inline const_iterator begin() const { return make_iterator(leftmost(root())); }
+    inline iterator end() { return make_iterator(nullptr); }
+    inline const_iterator end() const { return make_iterator(nullptr); }
+
+    inline T& front() { return to_value(leftmost(root())); }
+    inline const T& front() const { return to_value(leftmost(root())); }
+    inline T& back() { return to_value(rightmost(root())); }
+    inline const T& back() const { return to_value(rightmost(root())); }
+
+    inline iterator iterator_to(T& v) { return make_iterator(to_hook(v)); }
+    inline const_iterator iterator_to(const T& v) const { return make_iterator(to_hook(v)); }
+
+    void insert(T& v)
+    {
+        auto n = to_hook(v);
+        n->_left = n->_right = nullptr;
+        n->_count = 1;
+        n->_priority = next_priority();
+        rank_tree_hook* parent = &_header;
+        rank_tree_hook** link = &_header._left;
+        Less less;
+        while (*link) {
+            parent = *link;
+            ++parent->_count;
+            link = less(v, to_value(parent)) ? &parent->_left : &parent->_right;
+        }
+        *link = n;
+        n->_parent = parent;
+        while (n->_parent != &_header && n->_parent->_priority < n->_priority) {
+            rotate_up(n);
+        }
+    }
+
+    void erase(T& v)
+    {
+        auto n = to_hook(v);
+        // sink the node to a leaf, then cut it off.
+        while (n->_left || n->_right) {
+            rank_tree_hook* c = nullptr;
+            if (!n->_left) {
+                c = n->_right;
+            }
+            else if (!n->_right) {
+                c = n->_left;
+            }
+            else {
+                c = n->_left->_priority > n->_right->_priority ? n->_left : n->_right;
+            }
+            rotate_up(c);
+        }
+        auto p = n->_parent;
+        if (p->_left == n) {
+            p->_left = nullptr;
+        }
+        else {
+            p->_right = nullptr;
+        }
+        for (auto q = p; q != &_header; q = q->_parent) {
+            --q->_count;
+        }
+        n->_parent = nullptr;
+        n->_count = 0;
+    }
+
+    template <typename Disposer>
+    void clear_and_dispose(Disposer&& disposer)
+    {
+        auto n = root();
+        while (n) {
+            if (n->_left) {
+                n = n->_left;
+            }
+            else if (n->_right) {
+                n = n->_right;
+            }
+            else {
+                auto p = n->_parent;
+                if (p->_left == n) {
+                    p->_left = nullptr;
+                }
+                else {
+                    p->_right = nullptr;
+                }
+                n->_parent = nullptr;
+                n->_count = 0;
+                disposer(&to_value(n));
+                n = (p == &_header) ? nullptr : p;
+            }
+        }
+    }
+
+    inline void clear()
+    {
+        clear_and_dispose([] (T*) {});
+    }
+
+    // Returns the number of the elements which are ordered before v.
+    size_t rank(const T& v) const
+    {
+        const rank_tree_hook* n = to_hook(v);
+        size_t r = count(n->_left);
+        while (n->_parent != &_header) {
+            auto p = n->_parent;
+            if (p->_right == n) {
+                r += count(p->_left) + 1;
+            }
+            n = p;
+        }
+        return r;
+    }
+
+    inline size_t rank(const_iterator it) const
+    {
+        return it == end() ? size() : rank(*it);
+    }
+
+    // Returns the iterator to the element whose rank is index, or end().
+    inline iterator select(size_t index) { return make_iterator(select_node(index)); }
+    inline const_iterator select(size_t index) const { return make_iterator(select_node(index)); }
+
+    // Returns the first element which is not ordered before k.
+    template <typename K, typename Compare>
+    inline iterator lower_bound(const K& k, Compare cmp) { return make_iterator(lower_bound_node(k, cmp)); }
+    template <typename K, typename Compare>
+    inline const_iterator lower_bound(const K& k, Compare cmp) const { return make_iterator(lower_bound_node(k, cmp)); }
+
+    // Returns the first element which is ordered after k.
+    template <typename K, typename Compare>
+    inline iterator upper_bound(const K& k, Compare cmp) { return make_iterator(upper_bound_node(k, cmp)); }
+    template <typename K, typename Compare>
+    inline const_iterator upper_bound(const K& k, Compare cmp) const { return make_iterator(upper_bound_node(k, cmp)); }
+private:
+    inline rank_tree_hook* root() const { return _header._left; }
+    static inline size_t count(const rank_tree_hook* n) { return n ? n->_count : 0; }
+
+    static inline T& to_value(rank_tree_hook* n)
+    {
+        return *boost::intrusive::get_parent_from_member<T>(n, Hook);
+    }
+    static inline rank_tree_hook* to_hook(const T& v)
+    {
+        return const_cast<rank_tree_hook*>(&(v.*Hook));
+    }
+    inline iterator make_iterator(rank_tree_hook* n) const
+    {
+        auto header = const_cast<rank_tree_hook*>(&_header);
+        return iterator(n ? n : header, header);
+    }
+
+    static inline rank_tree_hook* leftmost(rank_tree_hook* n)
+    {
+        while (n && n->_left) n = n->_left;
+        return n;
+    }
+    static inline rank_tree_hook* rightmost(rank_tree_hook* n)
+    {
+        while (n && n->_right) n = n->_right;
+        return n;
+    }
+    static rank_tree_hook* successor(rank_tree_hook* n, rank_tree_hook* header)
+    {
+        if (n->_right) {
+            return leftmost(n->_right);
+        }
+        auto p = n->_parent;
+        while (p != header && p->_right == n) {
+            n = p;
+            p = p->_parent;
+        }
+        return p;
+    }
+    static rank_tree_hook* predecessor(rank_tree_hook* n, rank_tree_hook* header)
+    {
+        if (n == header) {
+            return rightmost(header->_left);
+        }
+        if (n->_left) {
+            return rightmost(n->_left);
+        }
+        auto p = n->_parent;
+        while (p != header && p->_left == n) {
+            n = p;
+            p = p->_parent;
+        }
+        return p;
+    }
+
+    template <typename K, typename Compare>
+    rank_tree_hook* lower_bound_node(const K& k, Compare& cmp) const
+    {
+        rank_tree_hook* n = root();
+        rank_tree_hook* r = nullptr;
+        while (n) {
+            if (cmp(to_value(n), k)) {
+                n = n->_right;
+            }
+            else {
+                r = n;
+                n = n->_left;
+            }
+        }
+        return r;
+    }
+
+    template <typename K, typename Compare>
+    rank_tree_hook* upper_bound_node(const K& k, Compare& cmp) const
+    {
+        rank_tree_hook* n = root();
+        rank_tree_hook* r = nullptr;
+        while (n) {
+            if (cmp(k, to_value(n))) {
+                r = n;
+                n = n->_left;
+            }
+            else {
+                n = n->_right;
+            }
+        }
+        return r;
+    }
+
+    rank_tree_hook* select_node(size_t index) const
+    {
+        auto n = root();
+        while (n) {
+            auto l = count(n->_left);
+            if (index < l) {
+                n = n->_left;
+            }
+            else if (index == l) {
+                return n;
+            }
+            else {
+                index -= l + 1;
+                n = n->_right;
+            }
+        }
+        return nullptr;
+    }
+
+    // Rotates n over its parent, keeps the subtree counts.
+    void rotate_up(rank_tree_hook* n)
+    {
+        auto p = n->_parent;
+        auto g = p->_parent;
+        if (p->_left == n) {
+            p->_left = n->_right;
+            if (n->_right) n->_right->_parent = p;
+            n->_right = p;
+        }
+        else {
+            p->_right = n->_left;
+            if (n->_left) n->_left->_parent = p;
+            n->_left = p;
+        }
+        p->_parent = n;
+        n->_parent = g;
+        if (g->_left == p) {
+            g->_left = n;
+        }
+        else {
+            g->_right = n;
+        }
+        n->_count = p->_count;
+        p->_count = 1 + count(p->_left) + count(p->_right);
+    }
+
+    inline uint32_t next_priority()
+    {
+        // xorshift32
+        _seed ^= _seed << 13;
+        _seed ^= _seed >> 17;
+        _seed ^= _seed << 5;
+        return _seed;
+    }
+};
+}
@@ -22,6 +22,9 @@
 #include <iomanip>
 #include <sstream>
 #include <algorithm>
+#include <unordered_set>
+#include <set>
+#include <boost/range/irange.hpp>
 #include "core/app-template.hh"
 #include "core/future-util.hh"
 #include "core/timer-set.hh"
@@ -39,9 +42,13 @@
 #include "util/log.hh"
 #include <unistd.h>
 #include <cstdlib>
+#include <cerrno>
+#include <cctype>
+#include <iterator>
 #include "redis_protocol.hh"
 #include "db.hh"
 #include "reply_builder.hh"
+#include "snapshot.hh"
 #include  <experimental/vector>
 #include "core/metrics.hh"
 using namespace net;
@@ -74,11 +81,11 @@ future<sstring> redis_service::echo(args_collection& args)
     return make_ready_future<sstring>(std::move(message));
 }
 
-future<bool> redis_service::set_impl(sstring& key, sstring& val, long expir, uint8_t flag)
+future<bool> redis_service::set_impl(sstring& key, temporary_buffer<char>& val, long expir, uint8_t flag)
 {
     redis_key rk { std::ref(key) };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::set_direct, std::move(rk), std::ref(val), expir, flag).then([] (auto&& m) {
+    return invoke_on_owner(cpu, &database::set_direct, std::move(rk), std::ref(val), expir, flag).then([] (auto&& m) {
         return m == REDIS_OK;
     });
 }
@@ -90,52 +97,39 @@ future<> redis_service::set(args_collection& args, output_stream<char>& out)
         return out.write(msg_syntax_err);
     }
     sstring& key = args._command_args[0];
-    sstring& val = args._command_args[1];
+    auto& val = args._command_views[1];
     long expir = 0;
     uint8_t flag = FLAG_SET_NO;
-    // [EX seconds] [PS milliseconds] [NX] [XX]
-    if (args._command_args_count > 2) {
-        for (unsigned int i = 2; i < args._command_args_count; ++i) {
-            sstring* v = (i == args._command_args_count - 1) ? nullptr : &(args._command_args[i + 1]);
-            sstring& o = args._command_args[i];
-            if (o.size() != 2) {
+    // [EX seconds] [PX milliseconds] [EXAT unix-time-seconds] [PXAT unix-time-milliseconds] [NX] [XX]
+    for (unsigned int i = 2; i < args._command_args_count; ++i) {
+        sstring* v = (i == args._command_args_count - 1) ? nullptr : &(args._command_args[i + 1]);
+        const char* o = args._command_args[i].c_str();
+        if (strcasecmp(o, "EX") == 0 || strcasecmp(o, "PX") == 0 || strcasecmp(o, "EXAT") == 0 || strcasecmp(o, "PXAT") == 0) {
+            if (v == nullptr) {
                 return out.write(msg_syntax_err);
             }
-            if ((o[0] == 'e' || o[0] == 'E') && (o[1] == 'x' || o[1] == 'X') && o[2] == '\0') {
-                flag |= FLAG_SET_EX;
-                if (v == nullptr) {
-                    return out.write(msg_syntax_err);
-                }
-                try {
-                    expir = std::atol(v->c_str()) * 1000;
-                } catch (const std::invalid_argument&) {
-                    return out.write(msg_syntax_err);
-                }
-                i++;
-            }
-            if ((o[0] == 'p' || o[0] == 'P') && (o[1] == 'x' || o[1] == 'X') && o[2] == '\0') {
-                flag |= FLAG_SET_PX;
-                if (v == nullptr) {
-                    return out.write(msg_syntax_err);
-                }
-                try {
-                    expir = std::atol(v->c_str());
-                } catch (const std::invalid_argument&) {
-                    return out.write(msg_syntax_err);
-                }
-                i++;
-            }
-            if ((o[0] == 'n' || o[0] == 'N') && (o[1] == 'x' || o[1] == 'X') && o[2] == '\0') {
-                flag |= FLAG_SET_NX;
-            }
-            if ((o[0] == 'x' || o[0] == 'X') && (o[1] == 'x' || o[1] == 'X') && o[2] == '\0') {
-                flag |= FLAG_SET_XX;
+            bool seconds = o[0] == 'e' || o[0] == 'E';
+            flag |= seconds ? FLAG_SET_EX : FLAG_SET_PX;
+            expir = std::atol(v->c_str()) * (seconds ? 1000 : 1);
+            if (o[2] != '\0') {
+                // a deadline which passed still replaces the value, which expires at once.
+                expir = std::max(expir - unix_time_ms(), 1L);
             }
+            i++;
+        }
+        else if (strcasecmp(o, "NX") == 0) {
+            flag |= FLAG_SET_NX;
+        }
+        else if (strcasecmp(o, "XX") == 0) {
+            flag |= FLAG_SET_XX;
+        }
+        else {
+            return out.write(msg_syntax_err);
         }
     }
     redis_key rk { std::ref(key) };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::set, std::move(rk), std::ref(val), expir, flag).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::set, std::move(rk), std::ref(val), expir, flag).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });;
 }
@@ -143,7 +137,7 @@ future<> redis_service::set(args_collection& args, output_stream<char>& out)
 future<bool> redis_service::remove_impl(sstring& key) {
     redis_key rk { std::ref(key) };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::del_direct, std::move(rk));
+    return invoke_on_owner(cpu, &database::del_direct, std::move(rk));
 }
 
 future<> redis_service::del(args_collection& args, output_stream<char>& out)
@@ -158,23 +152,100 @@ future<> redis_service::del(args_collection& args, output_stream<char>& out)
         });
     }
     else {
-        struct mdel_state {
-            std::vector<sstring>& keys;
-            size_t success_count;
-        };
-        for (size_t i = 0; i < args._command_args_count; ++i) {
-            args._tmp_keys.emplace_back(args._command_args[i]);
+        return count_keys_impl(args, &database::del_batch, out);
+    }
+}
+
+std::vector<key_batch> redis_service::make_key_batches(args_collection& args, size_t count, bool with_values)
+{
+    std::vector<key_batch> batches(smp::count);
+    size_t step = with_values ? 2 : 1;
+    for (size_t i = 0, position = 0; i + step <= count; i += step, ++position) {
+        redis_key rk { std::ref(args._command_args[i]) };
+        auto& batch = batches[get_cpu(rk)];
+        batch.keys.emplace_back(std::move(rk));
+        batch.positions.emplace_back(position);
+        if (with_values) {
+            batch.values.emplace_back(&args._command_views[i + 1]);
         }
-        return do_with(mdel_state{args._tmp_keys, 0}, [this, &out] (auto& state) {
-            return parallel_for_each(std::begin(state.keys), std::end(state.keys), [this, &state] (auto& key) {
-                return this->remove_impl(key).then([&state] (auto r) {
-                    if (r) state.success_count++;
-                });
-            }).then([&state, &out] {
-                return reply_builder::build_local(out, state.success_count);
+    }
+    return batches;
+}
+
+static sstring to_upper(const sstring& s)
+{
+    sstring upper(s);
+    std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+    return upper;
+}
+
+// The cursors are unsigned integers, as in Redis.
+static bool parse_cursor(const sstring& s, uint64_t& cursor)
+{
+    if (s.empty() || !std::isdigit(static_cast<unsigned char>(s[0]))) {
+        return false;
+    }
+    char* end = nullptr;
+    errno = 0;
+    cursor = std::strtoull(s.c_str(), &end, 10);
+    return errno == 0 && end == s.c_str() + s.size();
+}
+
+bool redis_service::parse_scan_args(args_collection& args, size_t first, bool with_type, scan_args& sargs)
+{
+    for (size_t i = first; i < args._command_args_count; i += 2) {
+        if (i + 1 >= args._command_args_count) {
+            return false;
+        }
+        auto option = to_upper(args._command_args[i]);
+        auto& value = args._command_args[i + 1];
+        if (option == "COUNT") {
+            long count = 0;
+            try {
+                count = std::stol(value.c_str());
+            } catch (const std::exception&) {
+                return false;
+            }
+            if (count < 1) {
+                return false;
+            }
+            sargs.count = static_cast<size_t>(count);
+        }
+        else if (option == "MATCH") {
+            // every key matches, skip matching.
+            sargs.pattern = value == "*" ? sstring() : value;
+        }
+        else if (option == "TYPE" && with_type) {
+            sstring type(value);
+            std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+            sargs.type = sstring("+") + type + msg_crlf;
+        }
+        else {
+            return false;
+        }
+    }
+    return true;
+}
+
+future<> redis_service::count_keys_impl(args_collection& args, size_t (database::*func)(key_batch&), output_stream<char>& out)
+{
+    struct count_state {
+        std::vector<key_batch> batches;
+        size_t count;
+    };
+    return do_with(count_state{make_key_batches(args, args._command_args_count, false), 0}, [func, &out] (auto& state) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [func, &state] (unsigned cpu) {
+            auto& batch = state.batches[cpu];
+            if (batch.keys.empty()) {
+                return make_ready_future<>();
+            }
+            return invoke_on_owner(cpu, func, std::ref(batch)).then([&state] (size_t n) {
+                state.count += n;
             });
+        }).then([&state, &out] {
+            return reply_builder::build_local(out, state.count);
         });
-    }
+    });
 }
 
 future<> redis_service::mset(args_collection& args, output_stream<char>& out)
@@ -186,23 +257,20 @@ future<> redis_service::mset(args_collection& args, output_stream<char>& out)
         return out.write(msg_syntax_err);
     }
     struct mset_state {
-        std::vector<std::pair<sstring, sstring>>& key_value_pairs;
+        std::vector<key_batch> batches;
         size_t success_count;
     };
-    auto pair_size = args._command_args.size() / 2;
-    for (size_t i = 0; i < pair_size; ++i) {
-        args._tmp_key_value_pairs.emplace_back(std::make_pair(std::move(args._command_args[i * 2]), std::move(args._command_args[i * 2 + 1])));
-    }
-    return do_with(mset_state{std::ref(args._tmp_key_value_pairs), 0}, [this, &out] (auto& state) {
-        return parallel_for_each(std::begin(state.key_value_pairs), std::end(state.key_value_pairs), [this, &state] (auto& entry) {
-            sstring& key = entry.first;
-            sstring& value = entry.second;
-            redis_key rk {std::ref(key)};
-            return get_database().invoke_on(this->get_cpu(rk), &database::set_direct, std::move(rk), std::ref(value), 0, FLAG_SET_NO).then([&state] (auto m) {
-                if (m) state.success_count++ ;
+    return do_with(mset_state{make_key_batches(args, args._command_args.size(), true), 0}, [&args, &out] (auto& state) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&state] (unsigned cpu) {
+            auto& batch = state.batches[cpu];
+            if (batch.keys.empty()) {
+                return make_ready_future<>();
+            }
+            return invoke_on_owner(cpu, &database::set_batch, std::ref(batch)).then([&state] (size_t n) {
+                state.success_count += n;
             });
-        }).then([&state, &out] {
-            return out.write(state.key_value_pairs.size() == state.success_count ? msg_ok : msg_err);
+        }).then([&state, &args, &out] {
+            return out.write(state.success_count * 2 == args._command_args.size() ? msg_ok : msg_err);
         });
    });
 }
@@ -215,7 +283,7 @@ future<> redis_service::get(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     redis_key rk { std::ref(key) };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::get, std::move(rk)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::get, std::move(rk)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -225,21 +293,28 @@ future<> redis_service::mget(args_collection& args, output_stream<char>& out)
     if (args._command_args_count < 1) {
         return out.write(msg_syntax_err);
     }
-    using return_type = foreign_ptr<lw_shared_ptr<sstring>>;
+    using return_type = foreign_ptr<lw_shared_ptr<std::vector<std::experimental::optional<sstring>>>>;
     struct mget_state {
-        std::vector<sstring> keys;
-        std::vector<return_type> values;
+        std::vector<key_batch> batches;
+        std::vector<return_type> results;
+        std::vector<const sstring*> values;
     };
-    for (size_t i = 0; i < args._command_args_count; ++i) {
-        args._tmp_keys.emplace_back(args._command_args[i]);
-    }
-    return do_with(mget_state{std::move(args._tmp_keys), {}}, [this, &out] (auto& state) {
-        return parallel_for_each(std::begin(state.keys), std::end(state.keys), [this, &state] (sstring& key) {
-            redis_key rk { std::ref(key) };
-            return get_database().invoke_on(this->get_cpu(rk), &database::get_direct, std::move(rk)).then([&state] (auto&& m) {
-                if (m) {
-                   state.values.emplace_back(std::move(m));
+    auto count = args._command_args_count;
+    return do_with(mget_state{make_key_batches(args, count, false), std::vector<return_type>(smp::count), std::vector<const sstring*>(count, nullptr)}, [&out] (auto& state) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&state] (unsigned cpu) {
+            auto& batch = state.batches[cpu];
+            if (batch.keys.empty()) {
+                return make_ready_future<>();
+            }
+            return invoke_on_owner(cpu, &database::get_batch, std::ref(batch)).then([&state, &batch, cpu] (auto&& m) {
+                // the values are read in place, the result is freed on its shard at last.
+                for (size_t i = 0; i < batch.positions.size(); ++i) {
+                    auto& value = (*m)[i];
+                    if (value) {
+                        state.values[batch.positions[i]] = &(*value);
+                    }
                 }
+                state.results[cpu] = std::move(m);
             });
         }).then([&state, &out] {
             return reply_builder::build_local(out, state.values);
@@ -255,7 +330,7 @@ future<> redis_service::strlen(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     redis_key rk { std::ref(key) };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::strlen, std::ref(rk)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::strlen, std::ref(rk)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -264,7 +339,7 @@ future<bool> redis_service::exists_impl(sstring& key)
 {
     redis_key rk { std::ref(key) };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::exists_direct, std::move(rk));
+    return invoke_on_owner(cpu, &database::exists_direct, std::move(rk));
 }
 
 future<> redis_service::exists(args_collection& args, output_stream<char>& out)
@@ -279,22 +354,7 @@ future<> redis_service::exists(args_collection& args, output_stream<char>& out)
         });
     }
     else {
-        struct mexists_state {
-            std::vector<sstring>& keys;
-            size_t success_count;
-        };
-        for (size_t i = 0; i < args._command_args_count; ++i) {
-            args._tmp_keys.emplace_back(args._command_args[i]);
-        }
-        return do_with(mexists_state{std::ref(args._tmp_keys), 0}, [this, &out] (auto& state) {
-            return parallel_for_each(std::begin(state.keys), std::end(state.keys), [this, &state] (auto& key) {
-                return this->exists_impl(key).then([&state] (auto r) {
-                    if (r) state.success_count++;
-                });
-            }).then([&state, &out] {
-                return reply_builder::build_local(out, state.success_count);
-            });
-        });
+        return count_keys_impl(args, &database::exists_batch, out);
     }
 }
 
@@ -304,10 +364,10 @@ future<> redis_service::append(args_collection& args, output_stream<char>& out)
         return out.write(msg_syntax_err);
     }
     sstring& key = args._command_args[0];
-    sstring& val = args._command_args[1];
+    auto& val = args._command_views[1];
     redis_key rk { std::ref(key) };
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::append, std::move(rk), std::ref(val)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::append, std::move(rk), std::ref(val)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -316,7 +376,7 @@ future<> redis_service::push_impl(sstring& key, sstring& val, bool force, bool l
 {
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::push, std::move(rk), std::ref(val), force, left).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::push, std::move(rk), std::ref(val), force, left).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -325,7 +385,7 @@ future<> redis_service::push_impl(sstring& key, std::vector<sstring>& vals, bool
 {
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::push_multi, std::move(rk), std::ref(vals), force, left).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::push_multi, std::move(rk), std::ref(vals), force, left).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -384,7 +444,7 @@ future<> redis_service::pop_impl(args_collection& args, bool left, output_stream
     sstring& key = args._command_args[0];
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::pop, std::move(rk), left).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::pop, std::move(rk), left).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -398,7 +458,7 @@ future<> redis_service::lindex(args_collection& args, output_stream<char>& out)
     int idx = std::atoi(args._command_args[1].c_str());
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::lindex, std::move(rk), idx).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::lindex, std::move(rk), idx).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -411,7 +471,7 @@ future<> redis_service::llen(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     auto cpu = get_cpu(key);
     redis_key rk {std::ref(key)};
-    return get_database().invoke_on(cpu, &database::llen, std::move(rk)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::llen, std::move(rk)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -430,7 +490,7 @@ future<> redis_service::linsert(args_collection& args, output_stream<char>& out)
     if (dir == "BEFORE") after = false;
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::linsert, std::move(rk), std::ref(pivot), std::ref(value), after).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::linsert, std::move(rk), std::ref(pivot), std::ref(value), after).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -447,7 +507,7 @@ future<> redis_service::lrange(args_collection& args, output_stream<char>& out)
     int end = std::atoi(e.c_str());
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::lrange, std::move(rk), start, end).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::lrange, std::move(rk), start, end).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -463,7 +523,7 @@ future<> redis_service::lset(args_collection& args, output_stream<char>& out)
     int idx = std::atoi(index.c_str());
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::lset, std::move(rk), idx, std::ref(value)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::lset, std::move(rk), idx, std::ref(value)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -478,7 +538,7 @@ future<> redis_service::ltrim(args_collection& args, output_stream<char>& out)
     int stop = std::atoi(args._command_args[2].c_str());
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::ltrim, std::move(rk), start, stop).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::ltrim, std::move(rk), start, stop).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -493,7 +553,7 @@ future<> redis_service::lrem(args_collection& args, output_stream<char>& out)
     sstring& value = args._command_args[2];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::lrem, std::move(rk), count, std::ref(value)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::lrem, std::move(rk), count, std::ref(value)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -533,7 +593,7 @@ future<> redis_service::counter_by(args_collection& args, bool incr, bool with_s
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::counter_by, std::move(rk), step, incr).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::counter_by, std::move(rk), step, incr).then([&out] (auto&& m) {
             return out.write(std::move(*m));
     });
 }
@@ -548,14 +608,14 @@ future<> redis_service::hdel(args_collection& args, output_stream<char>& out)
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
     if (args._command_args_count == 2) {
-        return get_database().invoke_on(cpu, &database::hdel, std::move(rk), std::ref(field)).then([&out] (auto&& m) {
+        return invoke_on_owner(cpu, &database::hdel, std::move(rk), std::ref(field)).then([&out] (auto&& m) {
             return out.write(std::move(*m));
         });
     }
     else {
         for (size_t i = 1; i < args._command_args.size(); ++i) args._tmp_keys.emplace_back(args._command_args[i]);
         auto& keys = args._tmp_keys;
-        return get_database().invoke_on(cpu, &database::hdel_multi, std::move(rk), std::ref(keys)).then([&out] (auto&& m) {
+        return invoke_on_owner(cpu, &database::hdel_multi, std::move(rk), std::ref(keys)).then([&out] (auto&& m) {
             return out.write(std::move(*m));
         });
     }
@@ -570,7 +630,7 @@ future<> redis_service::hexists(args_collection& args, output_stream<char>& out)
     sstring& field = args._command_args[1];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hexists, std::move(rk), std::ref(field)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::hexists, std::move(rk), std::ref(field)).then([&out] (auto&& m) {
         out.write(std::move(*m));
     });
 }
@@ -585,8 +645,8 @@ future<> redis_service::hset(args_collection& args, output_stream<char>& out)
     sstring& val = args._command_args[2];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hset, std::move(rk), std::ref(field), std::ref(val)).then([&out] (auto&& m) {
-        out.write(std::move(*m));
+    return invoke_on_owner(cpu, &database::hset, std::move(rk), std::ref(field), std::ref(val)).then([&out] (auto&& m) {
+        return out.write(std::move(*m));
     });
 }
 
@@ -602,7 +662,7 @@ future<> redis_service::hmset(args_collection& args, output_stream<char>& out)
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hmset, std::move(rk), std::ref(args._tmp_key_values)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::hmset, std::move(rk), std::ref(args._tmp_key_values)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -618,7 +678,7 @@ future<> redis_service::hincrby(args_collection& args, output_stream<char>& out)
     int delta = std::atoi(val.c_str());
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hincrby, std::move(rk), std::ref(field), delta).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::hincrby, std::move(rk), std::ref(field), delta).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -634,7 +694,7 @@ future<> redis_service::hincrbyfloat(args_collection& args, output_stream<char>&
     double delta = std::atof(val.c_str());
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hincrbyfloat, std::move(rk), std::ref(field), delta).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::hincrbyfloat, std::move(rk), std::ref(field), delta).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -647,7 +707,7 @@ future<> redis_service::hlen(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hlen, std::move(rk)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::hlen, std::move(rk)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -661,7 +721,7 @@ future<> redis_service::hstrlen(args_collection& args, output_stream<char>& out)
     sstring& field = args._command_args[1];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hstrlen, std::move(rk), std::ref(field)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::hstrlen, std::move(rk), std::ref(field)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -675,7 +735,7 @@ future<> redis_service::hget(args_collection& args, output_stream<char>& out)
     sstring& field = args._command_args[1];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hget, std::move(rk), std::ref(field)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::hget, std::move(rk), std::ref(field)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -688,7 +748,7 @@ future<> redis_service::hgetall(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hgetall, std::move(rk)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::hgetall, std::move(rk)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -701,7 +761,7 @@ future<> redis_service::hgetall_keys(args_collection& args, output_stream<char>&
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hgetall_keys, std::move(rk)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::hgetall_keys, std::move(rk)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -714,11 +774,45 @@ future<> redis_service::hgetall_values(args_collection& args, output_stream<char
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::hgetall_values, std::move(rk)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::hgetall_values, std::move(rk)).then([&out] (auto&& m) {
+        return out.write(std::move(*m));
+    });
+}
+
+future<> redis_service::hrandfield(args_collection& args, output_stream<char>& out)
+{
+    if (args._command_args_count < 1 || args._command_args.empty() || args._command_args_count > 3) {
+        return out.write(msg_syntax_err);
+    }
+    sstring& key = args._command_args[0];
+    long count = 1;
+    bool with_count = args._command_args_count > 1;
+    bool with_values = false;
+    if (with_count) {
+        try {
+            count = std::stol(args._command_args[1].c_str());
+        } catch (const std::exception&) {
+            return out.write(msg_syntax_err);
+        }
+    }
+    if (args._command_args_count > 2) {
+        if (to_upper(args._command_args[2]) != "WITHVALUES") {
+            return out.write(msg_syntax_err);
+        }
+        with_values = true;
+    }
+    redis_key rk{std::ref(key)};
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::hrandfield, std::move(rk), count, with_count, with_values).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
 
+future<> redis_service::hscan(args_collection& args, output_stream<char>& out)
+{
+    return scan_key_impl(args, &database::hscan, out);
+}
+
 future<> redis_service::hmget(args_collection& args, output_stream<char>& out)
 {
     if (args._command_args_count < 1 || args._command_args.empty()) {
@@ -731,7 +825,7 @@ future<> redis_service::hmget(args_collection& args, output_stream<char>& out)
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
     auto& keys = args._tmp_keys;
-    return get_database().invoke_on(cpu, &database::hmget, std::move(rk), std::ref(keys)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::hmget, std::move(rk), std::ref(keys)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -740,7 +834,7 @@ future<> redis_service::smembers_impl(sstring& key, output_stream<char>& out)
 {
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::smembers, std::move(rk)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::smembers, std::move(rk)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -758,7 +852,7 @@ future<> redis_service::sadds_impl(sstring& key, std::vector<sstring>& members,
 {
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::sadds, std::move(rk), std::ref(members)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::sadds, std::move(rk), std::ref(members)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -767,7 +861,7 @@ future<> redis_service::sadds_impl_return_keys(sstring& key, std::vector<sstring
 {
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::sadds_direct, std::move(rk), std::ref(members)).then([&out, &members] (auto m) {
+    return invoke_on_owner(cpu, &database::sadds_direct, std::move(rk), std::ref(members)).then([&out, &members] (auto m) {
         if (m)
            return reply_builder::build_local(out, members);
         return reply_builder::build_local(out, msg_err);
@@ -793,7 +887,7 @@ future<> redis_service::scard(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::scard, std::move(rk)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::scard, std::move(rk)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -806,7 +900,7 @@ future<> redis_service::sismember(args_collection& args, output_stream<char>& ou
     sstring& member = args._command_args[1];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::sismember, std::move(rk), std::ref(member)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::sismember, std::move(rk), std::ref(member)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -821,7 +915,7 @@ future<> redis_service::srem(args_collection& args, output_stream<char>& out)
     auto cpu = get_cpu(rk);
     for (uint32_t i = 1; i < args._command_args_count; ++i) args._tmp_keys.emplace_back(std::move(args._command_args[i]));
     auto& keys = args._tmp_keys;
-    return get_database().invoke_on(cpu, &database::srems, std::move(rk), std::ref(keys)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::srems, std::move(rk), std::ref(keys)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -849,79 +943,137 @@ future<> redis_service::sdiff(args_collection& args, output_stream<char>& out)
     return sdiff_impl(std::ref(args._command_args), nullptr, out);
 }
 
+// Keeps the candidates whose membership in the set of key equals exists. The set
+// is probed on its own shard, only the candidates are shipped to it.
+future<> redis_service::sprobe_impl(sstring& key, std::vector<sstring>& candidates, bool exists, size_t limit)
+{
+    redis_key rk { std::ref(key) };
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::sprobe_direct, std::move(rk), std::ref(candidates), exists, limit).then([&candidates] (auto&& indexes) {
+        std::vector<sstring> kept;
+        kept.reserve(indexes->size());
+        for (auto i : *indexes) {
+            kept.emplace_back(std::move(candidates[i]));
+        }
+        candidates = std::move(kept);
+    });
+}
+
+// Fills cards with the cardinalities of the sets of keys, queried in parallel.
+// Returns REDIS_WRONG_TYPE if one of the keys holds another type.
+future<int> redis_service::scard_all(std::vector<sstring>& keys, std::vector<long>& cards)
+{
+    cards.assign(keys.size(), 0);
+    return parallel_for_each(boost::irange<size_t>(0, keys.size()), [this, &keys, &cards] (size_t k) {
+        redis_key rk { std::ref(keys[k]) };
+        auto cpu = this->get_cpu(rk);
+        return invoke_on_owner(cpu, &database::scard_direct, std::move(rk)).then([&cards, k] (long card) {
+            cards[k] = card;
+        });
+    }).then([&cards] {
+        auto wrong = std::find(cards.begin(), cards.end(), REDIS_WRONG_TYPE) != cards.end();
+        return wrong ? REDIS_WRONG_TYPE : REDIS_OK;
+    });
+}
+
 future<> redis_service::sdiff_impl(std::vector<sstring>& keys, sstring* dest, output_stream<char>& out)
 {
-    using item_unordered_map = std::unordered_map<unsigned, std::vector<sstring>>;
     struct sdiff_state {
-        item_unordered_map items_set;
-        std::vector<sstring>& keys;
-        sstring* dest = nullptr;
         std::vector<sstring> result;
+        std::vector<long> cards;
     };
-    uint32_t count = static_cast<uint32_t>(keys.size());
-    return do_with(sdiff_state{item_unordered_map{}, std::ref(keys), dest, {}}, [&out, this, count] (auto& state) {
-        return parallel_for_each(boost::irange<unsigned>(0, count), [this, &state] (unsigned k) {
-            sstring& key = state.keys[k];
-            redis_key rk { std::ref(key) };
-            auto cpu = this->get_cpu(rk);
-            return get_database().invoke_on(cpu, &database::smembers_direct, std::move(rk)).then([&state, index = k] (auto&& members) {
-                state.items_set[index] = std::move(*members);
-            });
-        }).then([this, &out, &state, count] {
-            auto& temp = state.items_set[0];
-            for (uint32_t i = 1; i < count; ++i) {
-                auto&& next_items = std::move(state.items_set[i]);
-                for (auto& item : next_items) {
-                    stdx::erase_if(temp, [&item] (auto& o) { return item == o; });
-                }
+    return do_with(sdiff_state{}, [this, &keys, dest, &out] (auto& state) {
+        return this->scard_all(keys, state.cards).then([this, &keys, &state, dest, &out] (int status) {
+            if (status == REDIS_WRONG_TYPE) {
+                return out.write(msg_type_err);
             }
-            std::vector<sstring>& result = temp;
-            if (state.dest) {
-                return this->sadds_impl_return_keys(*state.dest, result, out);
+            auto& result = state.result;
+            auto fetched = make_ready_future<>();
+            if (state.cards[0] > 0) {
+                redis_key rk { std::ref(keys[0]) };
+                auto cpu = this->get_cpu(rk);
+                fetched = invoke_on_owner(cpu, &database::smembers_direct, std::move(rk)).then([this, &keys, &result] (auto&& members) {
+                    result = std::move(*members);
+                    auto range = boost::irange<size_t>(1, keys.size());
+                    return do_for_each(range.begin(), range.end(), [this, &keys, &result] (size_t i) {
+                        if (result.empty()) {
+                            return make_ready_future<>();
+                        }
+                        return this->sprobe_impl(keys[i], result, false, 0);
+                    });
+                });
             }
-            return reply_builder::build_local(out, result);
+            return fetched.then([this, &result, dest, &out] {
+                if (dest) {
+                    return this->sadds_impl_return_keys(*dest, result, out);
+                }
+                return reply_builder::build_local(out, result);
+            });
         });
     });
 }
 
-future<> redis_service::sinter_impl(std::vector<sstring>& keys, sstring* dest, output_stream<char>& out)
+// Intersects the sets of keys into result, stops at limit members unless limit is 0.
+// The smallest set drives the intersection: its members are the candidates, which
+// are probed against the other sets in ascending order of their cardinalities.
+// Returns REDIS_WRONG_TYPE, and leaves result empty, if a key holds another type.
+future<int> redis_service::sinter_members(std::vector<sstring>& keys, std::vector<sstring>& result, size_t limit)
 {
-    using item_unordered_map = std::unordered_map<unsigned, std::vector<sstring>>;
     struct sinter_state {
-        item_unordered_map items_set;
         std::vector<sstring>& keys;
-        sstring* dest = nullptr;
+        std::vector<sstring>& result;
+        std::vector<long> cards;
+        std::vector<unsigned> order;
     };
     uint32_t count = static_cast<uint32_t>(keys.size());
-    return do_with(sinter_state{item_unordered_map{}, std::ref(keys), dest}, [this, &out, count] (auto& state) {
-        return parallel_for_each(boost::irange<unsigned>(0, count), [this, &state] (unsigned k) {
-            sstring& key = state.keys[k];
-            redis_key rk { std::ref(key) };
-            auto cpu = this->get_cpu(rk);
-            return get_database().invoke_on(cpu, &database::smembers_direct, std::move(rk)).then([&state, index = k] (auto&& members) {
-                state.items_set[index] = std::move(*members);
+    return do_with(sinter_state{std::ref(keys), std::ref(result), {}, {}}, [this, count, limit] (auto& state) {
+        return this->scard_all(state.keys, state.cards).then([this, &state, count, limit] (int status) {
+            if (status == REDIS_WRONG_TYPE) {
+                return make_ready_future<int>(status);
+            }
+            auto range = boost::irange<unsigned>(0, count);
+            state.order.assign(range.begin(), range.end());
+            std::sort(state.order.begin(), state.order.end(), [&state] (unsigned l, unsigned r) {
+                return state.cards[l] < state.cards[r];
             });
-        }).then([this, &out, &state, count] {
-            auto& result = state.items_set[0];
-            for (uint32_t i = 1; i < count; ++i) {
-                auto& next_items = state.items_set[i];
-                if (result.empty() || next_items.empty()) {
-                    return reply_builder::build_local(out, result);
-                }
-                std::vector<sstring> temp;
-                for (auto& item : next_items) {
-                    if (std::find_if(result.begin(), result.end(), [&item] (auto& o) { return item == o; }) != result.end()) {
-                        temp.emplace_back(std::move(item));
+            if (state.cards[state.order[0]] == 0) {
+                return make_ready_future<int>(REDIS_OK);
+            }
+            redis_key rk { std::ref(state.keys[state.order[0]]) };
+            auto cpu = this->get_cpu(rk);
+            return invoke_on_owner(cpu, &database::smembers_direct, std::move(rk)).then([this, &state, count, limit] (auto&& members) {
+                state.result = std::move(*members);
+                auto range = boost::irange<unsigned>(1, count);
+                return do_for_each(range.begin(), range.end(), [this, &state, count, limit] (unsigned i) {
+                    if (state.result.empty()) {
+                        return make_ready_future<>();
                     }
+                    // only the last probe may stop early.
+                    return this->sprobe_impl(state.keys[state.order[i]], state.result, true, i + 1 == count ? limit : 0);
+                });
+            }).then([&state, count, limit] {
+                if (count == 1 && limit > 0 && state.result.size() > limit) {
+                    state.result.resize(limit);
                 }
-                result = std::move(temp);
+                return REDIS_OK;
+            });
+        });
+    });
+}
+
+future<> redis_service::sinter_impl(std::vector<sstring>& keys, sstring* dest, output_stream<char>& out)
+{
+    return do_with(std::vector<sstring>{}, [this, &keys, dest, &out] (auto& result) {
+        return this->sinter_members(keys, result, 0).then([this, &result, dest, &out] (int status) {
+            if (status == REDIS_WRONG_TYPE) {
+                return out.write(msg_type_err);
             }
-            if (state.dest) {
-                return this->sadds_impl_return_keys(*state.dest, result, out);
+            if (dest) {
+                return this->sadds_impl_return_keys(*dest, result, out);
             }
             return reply_builder::build_local(out, result);
-       });
-   });
+        });
+    });
 }
 
 future<> redis_service::sinter(args_collection& args, output_stream<char>& out)
@@ -935,6 +1087,51 @@ future<> redis_service::sinter(args_collection& args, output_stream<char>& out)
     return sinter_impl(args._command_args, nullptr, out);
 }
 
+future<> redis_service::sintercard(args_collection& args, output_stream<char>& out)
+{
+    if (args._command_args_count < 2 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    long numkeys = 0, limit = 0;
+    try {
+        numkeys = std::stol(args._command_args[0].c_str());
+    } catch (const std::invalid_argument&) {
+        return out.write(msg_syntax_err);
+    } catch (const std::out_of_range&) {
+        return out.write(msg_syntax_err);
+    }
+    if (numkeys <= 0 || static_cast<size_t>(numkeys) + 1 > args._command_args_count) {
+        return out.write(msg_syntax_err);
+    }
+    size_t index = static_cast<size_t>(numkeys) + 1;
+    if (index < args._command_args_count) {
+        if (index + 2 != args._command_args_count || to_upper(args._command_args[index]) != "LIMIT") {
+            return out.write(msg_syntax_err);
+        }
+        try {
+            limit = std::stol(args._command_args[index + 1].c_str());
+        } catch (const std::invalid_argument&) {
+            return out.write(msg_syntax_err);
+        } catch (const std::out_of_range&) {
+            return out.write(msg_syntax_err);
+        }
+        if (limit < 0) {
+            return out.write(msg_syntax_err);
+        }
+    }
+    for (size_t i = 1; i < index; ++i) {
+        args._tmp_keys.emplace_back(std::move(args._command_args[i]));
+    }
+    return do_with(std::vector<sstring>{}, [this, &args, limit, &out] (auto& result) {
+        return this->sinter_members(args._tmp_keys, result, static_cast<size_t>(limit)).then([&result, &out] (int status) {
+            if (status == REDIS_WRONG_TYPE) {
+                return out.write(msg_type_err);
+            }
+            return reply_builder::build_local(out, result.size());
+        });
+    });
+}
+
 future<> redis_service::sinter_store(args_collection& args, output_stream<char>& out)
 {
     if (args._command_args_count < 2 || args._command_args.empty()) {
@@ -950,26 +1147,25 @@ future<> redis_service::sinter_store(args_collection& args, output_stream<char>&
 future<> redis_service::sunion_impl(std::vector<sstring>& keys, sstring* dest, output_stream<char>& out)
 {
     struct union_state {
+        std::unordered_set<sstring> members;
         std::vector<sstring> result;
         std::vector<sstring>& keys;
         sstring* dest = nullptr;
     };
     uint32_t count = static_cast<uint32_t>(keys.size());
-    return do_with(union_state{{}, std::ref(keys), dest}, [this, &out, count] (auto& state) {
-        return parallel_for_each(boost::irange<unsigned>(0, count), [this, &out, &state] (unsigned k) {
+    return do_with(union_state{{}, {}, std::ref(keys), dest}, [this, &out, count] (auto& state) {
+        return parallel_for_each(boost::irange<unsigned>(0, count), [this, &state] (unsigned k) {
             sstring& key = state.keys[k];
             redis_key rk { std::ref(key) };
             auto cpu = this->get_cpu(rk);
-            return get_database().invoke_on(cpu, &database::smembers_direct, std::move(rk)).then([&state] (auto&& members) {
-                auto& result = state.result;
+            return invoke_on_owner(cpu, &database::smembers_direct, std::move(rk)).then([&state] (auto&& members) {
                 for (auto& item : *members) {
-                    if (std::find_if(result.begin(), result.end(), [&item] (auto& o) { return o == item; }) == result.end()) {
-                        result.emplace_back(std::move(item));
-                    }
+                    state.members.insert(std::move(item));
                 }
             });
         }).then([this, &state, &out] {
             auto& result = state.result;
+            result.assign(state.members.begin(), state.members.end());
             if (state.dest) {
                 return this->sadds_impl_return_keys(*state.dest, result, out);
             }
@@ -1005,14 +1201,14 @@ future<bool> redis_service::srem_direct(sstring& key, sstring& member)
 {
     redis_key rk {std::ref(key) };
     auto cpu = get_cpu(rk);
-    return   get_database().invoke_on(cpu, &database::srem_direct, rk, std::ref(member));
+    return   invoke_on_owner(cpu, &database::srem_direct, rk, std::ref(member));
 }
 
 future<bool> redis_service::sadd_direct(sstring& key, sstring& member)
 {
     redis_key rk {std::ref(key) };
     auto cpu = get_cpu(rk);
-    return  get_database().invoke_on(cpu, &database::sadd_direct, rk, std::ref(member));
+    return  invoke_on_owner(cpu, &database::sadd_direct, rk, std::ref(member));
 }
 
 future<> redis_service::smove(args_collection& args, output_stream<char>& out)
@@ -1046,17 +1242,18 @@ future<> redis_service::srandmember(args_collection& args, output_stream<char>&
         return out.write(msg_syntax_err);
     }
     sstring& key = args._command_args[0];
-    size_t count = 1;
-    if (args._command_args_count > 1) {
+    long count = 1;
+    bool with_count = args._command_args_count > 1;
+    if (with_count) {
         try {
             count  = std::stol(args._command_args[1].c_str());
-        } catch (const std::invalid_argument&) {
+        } catch (const std::exception&) {
             return out.write(msg_syntax_err);
         }
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::srandmember, rk, count).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::srandmember, rk, count, with_count).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1067,20 +1264,29 @@ future<> redis_service::spop(args_collection& args, output_stream<char>& out)
         return out.write(msg_syntax_err);
     }
     sstring& key = args._command_args[0];
-    size_t count = 1;
-    if (args._command_args_count > 1) {
+    long count = 1;
+    bool with_count = args._command_args_count > 1;
+    if (with_count) {
         try {
             count  = std::stol(args._command_args[1].c_str());
-        } catch (const std::invalid_argument&) {
+        } catch (const std::exception&) {
+            return out.write(msg_syntax_err);
+        }
+        if (count < 0) {
             return out.write(msg_syntax_err);
         }
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::spop, rk, count).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::spop, rk, static_cast<size_t>(count), with_count).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
+future<> redis_service::sscan(args_collection& args, output_stream<char>& out)
+{
+    return scan_key_impl(args, &database::sscan, out);
+}
+
 future<> redis_service::type(args_collection& args, output_stream<char>& out)
 {
     if (args._command_args_count <= 0 || args._command_args.empty()) {
@@ -1089,11 +1295,76 @@ future<> redis_service::type(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::type, std::move(rk)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::type, std::move(rk)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
 
+// Every call scans the shard the cursor points to, from its bucket cursor on, for
+// at most COUNT keys or COUNT * SCAN_BUCKETS_PER_COUNT buckets, and only moves on
+// to the next shards while the ones it finished returned fewer keys than COUNT.
+// So a call does a bounded amount of work on every shard it visits, and the
+// cursor of a shard stays valid while its table grows or shrinks.
+future<> redis_service::scan(args_collection& args, output_stream<char>& out)
+{
+    if (args._command_args_count < 1 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    uint64_t cursor = 0;
+    if (!parse_cursor(args._command_args[0], cursor)) {
+        return out.write(msg_invalid_cursor_err);
+    }
+    scan_state state;
+    if (!parse_scan_args(args, 1, true, state.options)) {
+        return out.write(msg_syntax_err);
+    }
+    state.shard = static_cast<unsigned>(cursor & ((uint64_t(1) << scan_shard_bits) - 1));
+    state.cursor = static_cast<size_t>(cursor >> scan_shard_bits);
+    if (state.shard >= smp::count) {
+        return reply_builder::build_local_scan(out, 0, state.keys);
+    }
+    return do_with(std::move(state), [&out] (auto& state) {
+        return repeat([&state] {
+            auto& options = state.options;
+            return invoke_on_owner(state.shard, &database::scan, state.cursor, options.count, std::ref(options.pattern), std::ref(options.type)).then([&state] (database::scan_result&& r) {
+                std::move(r._keys.begin(), r._keys.end(), std::back_inserter(state.keys));
+                state.cursor = r._cursor;
+                if (state.cursor != 0) {
+                    return stop_iteration::yes;
+                }
+                ++state.shard;
+                return (state.shard == smp::count || state.keys.size() >= state.options.count) ? stop_iteration::yes : stop_iteration::no;
+            });
+        }).then([&state, &out] {
+            uint64_t next = state.shard == smp::count ? 0 : (static_cast<uint64_t>(state.cursor) << scan_shard_bits) | state.shard;
+            return reply_builder::build_local_scan(out, next, state.keys);
+        });
+    });
+}
+
+future<> redis_service::scan_key_impl(args_collection& args, scan_key_func func, output_stream<char>& out)
+{
+    if (args._command_args_count < 2 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    uint64_t cursor = 0;
+    if (!parse_cursor(args._command_args[1], cursor)) {
+        return out.write(msg_invalid_cursor_err);
+    }
+    scan_args sargs;
+    if (!parse_scan_args(args, 2, false, sargs)) {
+        return out.write(msg_syntax_err);
+    }
+    sstring& key = args._command_args[0];
+    redis_key rk{std::ref(key)};
+    auto cpu = get_cpu(rk);
+    return do_with(std::move(sargs), [rk = std::move(rk), cpu, cursor, func, &out] (auto& sargs) mutable {
+        return invoke_on_owner(cpu, func, std::move(rk), cursor, sargs.count, std::ref(sargs.pattern)).then([&out] (auto&& m) {
+            return out.write(std::move(*m));
+        });
+    });
+}
+
 future<> redis_service::expire(args_collection& args, output_stream<char>& out)
 {
     if (args._command_args_count <= 1 || args._command_args.empty()) {
@@ -1109,7 +1380,7 @@ future<> redis_service::expire(args_collection& args, output_stream<char>& out)
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::expire, std::move(rk), expir).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::expire, std::move(rk), expir).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1128,7 +1399,27 @@ future<> redis_service::pexpire(args_collection& args, output_stream<char>& out)
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::expire, std::move(rk), expir).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::expire, std::move(rk), expir).then([&out] (auto&& m) {
+        return out.write(std::move(*m));
+    });
+}
+
+future<> redis_service::pexpireat(args_collection& args, output_stream<char>& out)
+{
+    if (args._command_args_count <= 1 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    sstring& key = args._command_args[0];
+    long expir = 0;
+    try {
+        // a deadline which passed deletes the key, as a timeout which is not positive.
+        expir = std::atol(args._command_args[1].c_str()) - unix_time_ms();
+    } catch (const std::invalid_argument&) {
+        return out.write(msg_syntax_err);
+    }
+    redis_key rk{std::ref(key)};
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::expire, std::move(rk), expir).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1141,7 +1432,7 @@ future<> redis_service::pttl(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::pttl, std::move(rk)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::pttl, std::move(rk)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1154,7 +1445,7 @@ future<> redis_service::ttl(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::ttl, std::move(rk)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::ttl, std::move(rk)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1167,7 +1458,7 @@ future<> redis_service::persist(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::persist, std::move(rk)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::persist, std::move(rk)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1211,7 +1502,7 @@ future<> redis_service::zadd(args_collection& args, output_stream<char>& out)
         } catch (const std::invalid_argument&) {
             return out.write(msg_syntax_err);
         }
-        return get_database().invoke_on(cpu, &database::zincrby, std::move(rk), std::ref(member), score).then([&out] (auto&& m) {
+        return invoke_on_owner(cpu, &database::zincrby, std::move(rk), std::ref(member), score).then([&out] (auto&& m) {
             return out.write(std::move(*m));
         });
     }
@@ -1233,7 +1524,7 @@ future<> redis_service::zadd(args_collection& args, output_stream<char>& out)
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zadds, std::move(rk), std::ref(args._tmp_key_scores), zadd_flags).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::zadds, std::move(rk), std::ref(args._tmp_key_scores), zadd_flags).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1246,7 +1537,7 @@ future<> redis_service::zcard(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zcard, std::move(rk)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::zcard, std::move(rk)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1274,7 +1565,7 @@ future<> redis_service::zrange(args_collection& args, bool reverse, output_strea
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zrange, std::move(rk), begin, end, reverse, with_score).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::zrange, std::move(rk), begin, end, reverse, with_score).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1302,7 +1593,7 @@ future<> redis_service::zrangebyscore(args_collection& args, bool reverse, outpu
             with_score = true;
         }
     }
-    return get_database().invoke_on(cpu, &database::zrangebyscore, std::move(rk), min, max, reverse, with_score).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::zrangebyscore, std::move(rk), min, max, reverse, with_score).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1322,7 +1613,7 @@ future<> redis_service::zcount(args_collection& args, output_stream<char>& out)
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zcount, std::move(rk), min, max).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::zcount, std::move(rk), min, max).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1342,7 +1633,7 @@ future<> redis_service::zincrby(args_collection& args, output_stream<char>& out)
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zincrby, std::move(rk), std::ref(member), delta).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::zincrby, std::move(rk), std::ref(member), delta).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1356,7 +1647,7 @@ future<> redis_service::zrank(args_collection& args, bool reverse, output_stream
     sstring& member = args._command_args[1];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zrank, std::move(rk), std::ref(member), reverse).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::zrank, std::move(rk), std::ref(member), reverse).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1373,7 +1664,7 @@ future<> redis_service::zrem(args_collection& args, output_stream<char>& out)
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zrem, std::move(rk), std::ref(args._tmp_keys)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::zrem, std::move(rk), std::ref(args._tmp_keys)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1387,7 +1678,7 @@ future<> redis_service::zscore(args_collection& args, output_stream<char>& out)
     sstring& member = args._command_args[1];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zscore, std::move(rk), std::ref(member)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::zscore, std::move(rk), std::ref(member)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1398,113 +1689,78 @@ bool redis_service::parse_zset_args(args_collection& args, zset_args& uargs)
         return false;
     }
     uargs.dest = std::move(args._command_args[0]);
+    long numkeys = 0;
     try {
-        uargs.numkeys = std::stol(args._command_args[1].c_str());
-    } catch(const std::invalid_argument&) {
+        numkeys = std::stol(args._command_args[1].c_str());
+    } catch (const std::invalid_argument&) {
+        return false;
+    } catch (const std::out_of_range&) {
         return false;
     }
-    size_t index = static_cast<size_t>(uargs.numkeys) + 2;
-    if (args._command_args_count < index) {
+    if (numkeys <= 0 || static_cast<size_t>(numkeys) + 2 > args._command_args_count) {
         return false;
     }
+    uargs.numkeys = static_cast<size_t>(numkeys);
+    size_t index = uargs.numkeys + 2;
     for (size_t i = 2; i < index; ++i) {
         uargs.keys.emplace_back(std::move(args._command_args[i]));
     }
-    bool has_weights = false, has_aggregate = false;
-    if (index < args._command_args_count) {
-        for (; index < args._command_args_count; ++index) {
-            sstring& syntax = args._command_args[index];
-            if (syntax == "WEIGHTS") {
-                index ++;
-                if (index + uargs.numkeys > args._command_args_count) {
-                    return false;
-                }
-                has_weights = true;
-                size_t i = index;
-                index += uargs.numkeys;
-                for (; i < index; ++i) {
-                    try {
-                        uargs.weights.push_back(std::stod(args._command_args[i].c_str()));
-                    } catch (const std::invalid_argument&) {
-                        return false;
-                    }
-                }
+    uargs.weights.assign(uargs.numkeys, 1);
+    uargs.aggregate_flag = ZAGGREGATE_SUM;
+    // the options may come in any order and case, the last one given wins.
+    while (index < args._command_args_count) {
+        auto syntax = to_upper(args._command_args[index++]);
+        if (syntax == "WEIGHTS") {
+            if (index + uargs.numkeys > args._command_args_count) {
+                return false;
             }
-            if (syntax == "AGGREGATE") {
-                if (index + 1 > args._command_args_count) {
+            for (size_t i = 0; i < uargs.numkeys; ++i, ++index) {
+                try {
+                    uargs.weights[i] = std::stod(args._command_args[index].c_str());
+                } catch (const std::invalid_argument&) {
                     return false;
-                }
-                index++;
-                sstring& aggre = args._command_args[index];
-                if (aggre == "SUM") {
-                    uargs.aggregate_flag |= ZAGGREGATE_SUM;
-                }
-                else if (aggre == "MIN") {
-                    uargs.aggregate_flag |= ZAGGREGATE_MIN;
-                }
-                else if (aggre == "MAX") {
-                    uargs.aggregate_flag |= ZAGGREGATE_MAX;
-                }
-                else {
+                } catch (const std::out_of_range&) {
                     return false;
                 }
-                has_aggregate = true;
             }
         }
-    }
-    if (has_weights == false) {
-        for (size_t i = 0; i < uargs.numkeys; ++i) {
-            uargs.weights.push_back(1);
+        else if (syntax == "AGGREGATE") {
+            if (index == args._command_args_count) {
+                return false;
+            }
+            auto aggregate = to_upper(args._command_args[index++]);
+            if (aggregate == "SUM") {
+                uargs.aggregate_flag = ZAGGREGATE_SUM;
+            }
+            else if (aggregate == "MIN") {
+                uargs.aggregate_flag = ZAGGREGATE_MIN;
+            }
+            else if (aggregate == "MAX") {
+                uargs.aggregate_flag = ZAGGREGATE_MAX;
+            }
+            else {
+                return false;
+            }
+        }
+        else {
+            return false;
         }
-    }
-    if (has_aggregate == false) {
-        uargs.aggregate_flag = ZAGGREGATE_SUM;
     }
     return true;
 }
 
+future<> redis_service::zscan(args_collection& args, output_stream<char>& out)
+{
+    return scan_key_impl(args, &database::zscan, out);
+}
+
 future<> redis_service::zunionstore(args_collection& args, output_stream<char>& out)
 {
     zset_args uargs;
     if (parse_zset_args(args, uargs) == false) {
         return out.write(msg_syntax_err);
     }
-    struct zunion_store_state {
-        std::vector<std::pair<sstring, double>> wkeys;
-        sstring dest;
-        std::unordered_map<sstring, double> result;
-        int aggregate_flag;
-    };
-    std::vector<std::pair<sstring, double>> wkeys;
-    for (size_t i = 0; i < uargs.numkeys; ++i) {
-        wkeys.emplace_back(std::pair<sstring, double>(std::move(uargs.keys[i]), uargs.weights[i]));
-    }
-    return do_with(zunion_store_state{std::move(wkeys), std::move(uargs.dest), {}, uargs.aggregate_flag}, [this, &out] (auto& state) {
-        return parallel_for_each(std::begin(state.wkeys), std::end(state.wkeys), [this, &state] (auto& entry) {
-            redis_key rk{std::ref(entry.first)};
-            auto cpu = rk.get_cpu();
-            return get_database().invoke_on(cpu, &database::zrange_direct, std::move(rk), 0, -1).then([this, weight = entry.second, &state] (auto&& m) {
-                auto& range_result = *m;
-                auto& result = state.result;
-                for (size_t i = 0; i < range_result.size(); ++i) {
-                    auto& key = range_result[i].first;
-                    auto& score = range_result[i].second;
-                    if (result.find(key) != result.end()) {
-                       result[key] = redis_service::score_aggregation(result[key], score * weight, state.aggregate_flag);
-                    }
-                    else {
-                        result[key] = score;
-                    }
-                }
-            });
-        }).then([this, &state, &out] () {
-            redis_key rk{std::ref(state.dest)};
-            auto cpu = rk.get_cpu();
-            return get_database().invoke_on(cpu, &database::zadds, std::move(rk), std::ref(state.result), ZADD_CH).then([&out] (auto&& m) {
-                return out.write(std::move(*m));
-            });
-        });
-    });
+    return zstore_impl(uargs, false, out);
 }
 
 future<> redis_service::zinterstore(args_collection& args, output_stream<char>& out)
@@ -1513,63 +1769,110 @@ future<> redis_service::zinterstore(args_collection& args, output_stream<char>&
     if (parse_zset_args(args, uargs) == false) {
         return out.write(msg_syntax_err);
     }
-    struct zinter_store_state {
-        std::vector<std::pair<sstring, double>> wkeys;
-        sstring dest;
-        std::unordered_map<sstring, double> result;
-        int aggregate_flag;
-    };
-    std::vector<std::pair<sstring, double>> wkeys;
+    return zstore_impl(uargs, true, out);
+}
+
+// ZUNIONSTORE and ZINTERSTORE run as a k-way merge: every source is read from its
+// own shard in batches in member order, the merged members are aggregated and sent
+// in batches to the destination shard, which builds the result aside and replaces
+// the destination with it at last. So at most a batch per source and one output
+// batch are held here, whatever the sizes of the sets are.
+future<> redis_service::zstore_impl(zset_args& uargs, bool intersect, output_stream<char>& out)
+{
+    std::vector<zstore_source> sources;
     for (size_t i = 0; i < uargs.numkeys; ++i) {
-        wkeys.emplace_back(std::pair<sstring, double>(std::move(uargs.keys[i]), uargs.weights[i]));
+        sources.emplace_back(zstore_source{std::move(uargs.keys[i]), uargs.weights[i]});
     }
-    return do_with(zinter_store_state{std::move(wkeys), std::move(uargs.dest), {}, uargs.aggregate_flag}, [this, &out] (auto& state) {
-        redis_key rk{std::ref(state.wkeys[0].first)};
-        return get_database().invoke_on(rk.get_cpu(), &database::zrange_direct, std::move(rk), 0, -1).then([this, &state, weight = state.wkeys[0].second] (auto&& m) {
-            auto& range_result = *m;
-            auto& result = state.result;
-            for (size_t i = 0; i < range_result.size(); ++i) {
-                result[range_result[i].first] = range_result[i].second * weight;
-            }
-            return make_ready_future<bool>(!result.empty() && state.wkeys.size() > 1);
-        }).then([this, &state, &out] (bool continue_next) {
-            if (!continue_next) {
-                return make_ready_future<>();
-            }
-            else {
-                return parallel_for_each(boost::irange<size_t>(1, state.wkeys.size()), [this, &state, &out] (size_t k) {
-                    auto& entry = state.wkeys[k];
-                    redis_key rk{std::ref(entry.first)};
-                    auto cpu = rk.get_cpu();
-                    return get_database().invoke_on(cpu, &database::zrange_direct, std::move(rk), 0, -1).then([this, &state, weight = entry.second] (auto&& m) {
-                        auto& range_result = *m;
-                        auto& result = state.result;
-                        std::unordered_map<sstring, double> new_result;
-                        for (size_t i = 0; i < range_result.size(); ++i) {
-                            auto& key = range_result[i].first;
-                            auto& score = range_result[i].second;
-                            auto it = result.find(key);
-                            if (it != result.end()) {
-                                auto& old_score = it->second;
-                                new_result[key] = redis_service::score_aggregation(old_score, score * weight, state.aggregate_flag);
-                            }
-                        }
-                        state.result = std::move(new_result);
-                    });
-                }).then([this] () {
+    auto id = (static_cast<uint64_t>(engine().cpu_id()) << 48) | ++_zstore_id;
+    return do_with(zstore_state{std::move(sources), std::move(uargs.dest), uargs.aggregate_flag, intersect, id}, [this, &out] (auto& state) {
+        return repeat([this, &state] {
+            return parallel_for_each(std::begin(state.sources), std::end(state.sources), [this] (auto& source) {
+                if (!source.needs_batch()) {
                     return make_ready_future<>();
+                }
+                return this->zstore_fetch(source);
+            }).then([this, &state] {
+                zstore_merge(state);
+                if (state.output.size() < zstore_batch_size && !(state.finished && !state.output.empty())) {
+                    return make_ready_future<stop_iteration>(state.finished ? stop_iteration::yes : stop_iteration::no);
+                }
+                redis_key rk{std::ref(state.dest)};
+                return invoke_on_owner(rk.get_cpu(), &database::zstore_batch_direct, state.id, std::ref(state.output)).then([&state] (auto&&) {
+                    state.output.clear();
+                    return state.finished ? stop_iteration::yes : stop_iteration::no;
                 });
-            }
-        }).then([this, &state, &out] {
+            });
+        }).then([&state] {
             redis_key rk{std::ref(state.dest)};
-            auto cpu = rk.get_cpu();
-            return get_database().invoke_on(cpu, &database::zadds, std::move(rk), std::ref(state.result), ZADD_CH).then([&out] (auto&& m) {
-                return out.write(std::move(*m));
+            return invoke_on_owner(rk.get_cpu(), &database::zstore_commit_direct, std::move(rk), state.id);
+        }).then([&out] (size_t size) {
+            return reply_builder::build_local(out, size);
+        }).handle_exception([&state, &out] (auto ep) {
+            redis_key rk{std::ref(state.dest)};
+            return invoke_on_owner(rk.get_cpu(), &database::zstore_abort_direct, state.id).then([&out] (auto&&) {
+                return out.write(msg_err);
             });
         });
     });
 }
 
+future<> redis_service::zstore_fetch(zstore_source& source)
+{
+    // the next batch starts after the last member of the current one.
+    bool from_start = !source.started;
+    if (!source.batch.empty()) {
+        source.after = std::move(source.batch.back().first);
+    }
+    redis_key rk{std::ref(source.key)};
+    auto cpu = rk.get_cpu();
+    return invoke_on_owner(cpu, &database::zrange_by_member_direct, std::move(rk), std::ref(source.after), from_start, static_cast<size_t>(zstore_batch_size)).then([&source] (auto&& m) {
+        source.batch = std::move(*m);
+        source.pos = 0;
+        source.started = true;
+        source.done = source.batch.size() < zstore_batch_size;
+    });
+}
+
+// Merges the heads of the sources until the output batch is full, a source needs
+// its next batch, or the result is complete.
+void redis_service::zstore_merge(zstore_state& state)
+{
+    auto& sources = state.sources;
+    while (state.output.size() < zstore_batch_size) {
+        const sstring* min = nullptr;
+        size_t alive = 0;
+        for (auto& source : sources) {
+            if (source.needs_batch()) {
+                return;
+            }
+            if (source.pos < source.batch.size()) {
+                ++alive;
+                auto& member = source.batch[source.pos].first;
+                if (min == nullptr || member < *min) {
+                    min = &member;
+                }
+            }
+        }
+        if (state.intersect ? alive < sources.size() : alive == 0) {
+            state.finished = true;
+            return;
+        }
+        sstring member = *min;
+        double score = 0;
+        size_t matched = 0;
+        for (auto& source : sources) {
+            if (source.pos < source.batch.size() && source.batch[source.pos].first == member) {
+                auto weighted = source.batch[source.pos].second * source.weight;
+                score = matched++ == 0 ? weighted : redis_service::score_aggregation(score, weighted, state.aggregate_flag);
+                ++source.pos;
+            }
+        }
+        if (!state.intersect || matched == sources.size()) {
+            state.output.emplace_back(std::move(member), score);
+        }
+    }
+}
+
 future<> redis_service::zremrangebyscore(args_collection& args, output_stream<char>& out)
 {
     // ZREMRANGEBYSCORE key min max
@@ -1588,7 +1891,7 @@ future<> redis_service::zremrangebyscore(args_collection& args, output_stream<ch
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zremrangebyscore, std::move(rk), min, max).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::zremrangebyscore, std::move(rk), min, max).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1611,7 +1914,7 @@ future<> redis_service::zremrangebyrank(args_collection& args, output_stream<cha
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zremrangebyrank, std::move(rk), begin, end).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::zremrangebyrank, std::move(rk), begin, end).then([&out] (auto&& m) {
        return out.write(std::move(*m));
     });
 }
@@ -1662,7 +1965,7 @@ future<> redis_service::select(args_collection& args, output_stream<char>& out)
     }
     return do_with(size_t {0}, [this, index, &out] (auto& count) {
         return parallel_for_each(boost::irange<unsigned>(0, smp::count), [this, index, &count] (unsigned cpu) {
-            return get_database().invoke_on(cpu, &database::select, index).then([&count] (auto&& u) {
+            return invoke_on_owner(cpu, &database::select, index).then([&count] (auto&& u) {
                 if (u) {
                     count++;
                 }
@@ -1698,7 +2001,7 @@ future<> redis_service::geoadd(args_collection& args, output_stream<char>& out)
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::zadds, std::move(rk), std::ref(args._tmp_key_scores), ZADD_CH).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::zadds, std::move(rk), std::ref(args._tmp_key_scores), ZADD_CH).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1729,7 +2032,7 @@ future<> redis_service::geodist(args_collection& args, output_stream<char>& out)
     }
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::geodist, std::move(rk), std::ref(lpos), std::ref(rpos), geodist_flag).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::geodist, std::move(rk), std::ref(lpos), std::ref(rpos), geodist_flag).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1745,7 +2048,7 @@ future<> redis_service::geohash(args_collection& args, output_stream<char>& out)
     }
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::geohash, std::move(rk), std::ref(args._tmp_keys)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::geohash, std::move(rk), std::ref(args._tmp_keys)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1762,7 +2065,7 @@ future<> redis_service::geopos(args_collection& args, output_stream<char>& out)
     }
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::geopos, std::move(rk), std::ref(members)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::geopos, std::move(rk), std::ref(members)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1877,8 +2180,8 @@ future<> redis_service::georadius(args_collection& args, bool member, output_str
 
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    auto points_ready = !member ? get_database().invoke_on(cpu, &database::georadius_coord_direct, std::move(rk), log, lat, radius, count, flags)
-                                : get_database().invoke_on(cpu, &database::georadius_member_direct, std::move(rk), std::ref(member_key), radius, count, flags);
+    auto points_ready = !member ? invoke_on_owner(cpu, &database::georadius_coord_direct, std::move(rk), log, lat, radius, count, flags)
+                                : invoke_on_owner(cpu, &database::georadius_member_direct, std::move(rk), std::ref(member_key), radius, count, flags);
     return  points_ready.then([this, flags, &args, stored_key_index, &out] (auto&& data) {
         using data_type = std::vector<std::tuple<sstring, double, double, double, double>>;
         using return_type = std::pair<std::vector<std::tuple<sstring, double, double, double, double>>, int>;
@@ -1909,7 +2212,7 @@ future<> redis_service::georadius(args_collection& args, bool member, output_str
             return do_with(store_state{std::move(members), std::ref(stored_key), std::ref(data_)}, [this, &out, flags, &data_] (auto& state) {
                 redis_key rk{std::ref(state.stored_key)};
                 auto cpu = rk.get_cpu();
-                return get_database().invoke_on(cpu, &database::zadds_direct, std::move(rk), std::ref(state.members), ZADD_CH).then([&out, flags, &data_] (auto&& m) {
+                return invoke_on_owner(cpu, &database::zadds_direct, std::move(rk), std::ref(state.members), ZADD_CH).then([&out, flags, &data_] (auto&& m) {
                    if (m)
                      return reply_builder::build_local(out, data_, flags);
                    else
@@ -1921,6 +2224,162 @@ future<> redis_service::georadius(args_collection& args, bool member, output_str
     });
 }
 
+// GEOSEARCH key FROMMEMBER member | FROMLONLAT longitude latitude
+//     BYRADIUS radius unit | BYBOX width height unit
+//     [ASC | DESC] [COUNT count [ANY]] [WITHCOORD] [WITHDIST] [WITHHASH]
+// GEOSEARCHSTORE destination key ... [STOREDIST] replaces the destination with the
+// members found, scored by their position or by their distance.
+future<> redis_service::geosearch(args_collection& args, bool store, output_stream<char>& out)
+{
+    size_t source = store ? 1 : 0;
+    if (args._command_args_count < source + 4 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    geo::shape shape;
+    sstring member;
+    bool from_member = false, from_position = false, by_shape = false, any = false;
+    int flags = 0;
+    size_t count = 0;
+    auto parse_unit = [&flags] (sstring unit) {
+        std::transform(unit.begin(), unit.end(), unit.begin(), ::tolower);
+        if (unit == "m") flags |= GEO_UNIT_M;
+        else if (unit == "km") flags |= GEO_UNIT_KM;
+        else if (unit == "mi") flags |= GEO_UNIT_MI;
+        else if (unit == "ft") flags |= GEO_UNIT_FT;
+        else return false;
+        return true;
+    };
+    try {
+        for (size_t i = source + 1; i < args._command_args_count; ++i) {
+            sstring option = args._command_args[i];
+            std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+            auto left = args._command_args_count - i - 1;
+            if (option == "FROMMEMBER" && left >= 1 && !from_member && !from_position) {
+                member = args._command_args[++i];
+                from_member = true;
+            }
+            else if (option == "FROMLONLAT" && left >= 2 && !from_member && !from_position) {
+                shape._longitude = std::stod(args._command_args[++i].c_str());
+                shape._latitude = std::stod(args._command_args[++i].c_str());
+                if (shape._longitude < GEO_LONG_MIN || shape._longitude > GEO_LONG_MAX || shape._latitude < GEO_LAT_MIN || shape._latitude > GEO_LAT_MAX) {
+                    return out.write(msg_geo_position_err);
+                }
+                from_position = true;
+            }
+            else if (option == "BYRADIUS" && left >= 2 && !by_shape) {
+                shape._radius = std::stod(args._command_args[++i].c_str());
+                if (shape._radius < 0 || !parse_unit(args._command_args[++i])) {
+                    return out.write(msg_syntax_err);
+                }
+                by_shape = true;
+            }
+            else if (option == "BYBOX" && left >= 3 && !by_shape) {
+                shape._box = true;
+                shape._width = std::stod(args._command_args[++i].c_str());
+                shape._height = std::stod(args._command_args[++i].c_str());
+                if (shape._width < 0 || shape._height < 0 || !parse_unit(args._command_args[++i])) {
+                    return out.write(msg_syntax_err);
+                }
+                by_shape = true;
+            }
+            else if (option == "ASC") {
+                flags = (flags & ~GEORADIUS_DESC) | GEORADIUS_ASC;
+            }
+            else if (option == "DESC") {
+                flags = (flags & ~GEORADIUS_ASC) | GEORADIUS_DESC;
+            }
+            else if (option == "COUNT" && left >= 1) {
+                auto c = std::stol(args._command_args[++i].c_str());
+                if (c <= 0) {
+                    return out.write(msg_syntax_err);
+                }
+                count = c;
+                flags |= GEORADIUS_COUNT;
+                if (left >= 2) {
+                    sstring next = args._command_args[i + 1];
+                    std::transform(next.begin(), next.end(), next.begin(), ::toupper);
+                    if (next == "ANY") {
+                        any = true;
+                        ++i;
+                    }
+                }
+            }
+            else if (option == "WITHCOORD" && !store) {
+                flags |= GEORADIUS_WITHCOORD;
+            }
+            else if (option == "WITHDIST" && !store) {
+                flags |= GEORADIUS_WITHDIST;
+            }
+            else if (option == "WITHHASH" && !store) {
+                flags |= GEORADIUS_WITHHASH;
+            }
+            else if (option == "STOREDIST" && store) {
+                flags |= GEORADIUS_STORE_DIST;
+            }
+            else {
+                return out.write(msg_syntax_err);
+            }
+        }
+    } catch (const std::invalid_argument&) {
+        return out.write(msg_syntax_err);
+    } catch (const std::out_of_range&) {
+        return out.write(msg_syntax_err);
+    }
+    if (!(from_member || from_position) || !by_shape) {
+        return out.write(msg_syntax_err);
+    }
+    geo::to_meters(shape._radius, flags);
+    geo::to_meters(shape._width, flags);
+    geo::to_meters(shape._height, flags);
+
+    redis_key rk {std::ref(args._command_args[source])};
+    auto cpu = get_cpu(rk);
+    return do_with(std::move(member), [this, &args, &out, rk = std::move(rk), cpu, from_member, shape, count, any, flags, store] (auto& member) mutable {
+        return invoke_on_owner(cpu, &database::geosearch_direct, std::move(rk), std::ref(member), from_member, shape, count, any, flags).then([this, &args, &out, flags, store] (auto&& data) {
+            auto& result = *data;
+            if (result.second == REDIS_WRONG_TYPE) {
+                return out.write(msg_type_err);
+            }
+            else if (result.second == REDIS_ERR) {
+                return out.write(msg_geo_member_err);
+            }
+            if (!store) {
+                if (result.second == REDIS_NONE) {
+                    return out.write(msg_empty_multi_bulk);
+                }
+                return reply_builder::build_local(out, result.first, flags);
+            }
+            // as Redis, a missing source leaves the destination alone.
+            if (result.second == REDIS_NONE) {
+                return out.write(msg_zero);
+            }
+            std::vector<std::pair<sstring, double>> members;
+            members.reserve(result.first.size());
+            for (auto& point : result.first) {
+                double dist = std::get<2>(point);
+                geo::from_meters(dist, flags);
+                members.emplace_back(std::move(std::get<0>(point)), (flags & GEORADIUS_STORE_DIST) ? dist : std::get<1>(point));
+            }
+            auto id = (static_cast<uint64_t>(engine().cpu_id()) << 48) | ++_zstore_id;
+            return do_with(std::move(members), [&args, &out, id] (auto& members) {
+                redis_key rk {std::ref(args._command_args[0])};
+                auto cpu = rk.get_cpu();
+                auto staged = members.empty() ? make_ready_future<bool>(true) : invoke_on_owner(cpu, &database::zstore_batch_direct, id, std::ref(members));
+                return staged.then([&args, id, cpu] (auto&&) {
+                    redis_key rk {std::ref(args._command_args[0])};
+                    return invoke_on_owner(cpu, &database::zstore_commit_direct, std::move(rk), id);
+                }).then([&out] (size_t size) {
+                    return reply_builder::build_local(out, size);
+                }).handle_exception([&out, id, cpu] (auto ep) {
+                    return invoke_on_owner(cpu, &database::zstore_abort_direct, id).then([&out] (auto&&) {
+                        return out.write(msg_err);
+                    });
+                });
+            });
+        });
+    });
+}
+
 future<> redis_service::setbit(args_collection& args, output_stream<char>& out)
 {
     if (args._command_args_count < 3 || args._command_args.empty()) {
@@ -1930,14 +2389,18 @@ future<> redis_service::setbit(args_collection& args, output_stream<char>& out)
     size_t offset = 0;
     int value = 0;
     try {
-        offset = std::stol(args._command_args[1]);
+        auto o = std::stol(args._command_args[1]);
+        if (o < 0 || uint64_t(o) > bitmap_lsa::max_offset) {
+            return out.write(msg_bit_offset_err);
+        }
+        offset = o;
         value = std::stoi(args._command_args[2]);
     } catch (const std::invalid_argument&) {
         return out.write(msg_syntax_err);
     }
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::setbit, std::move(rk), offset, value == 1).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::setbit, std::move(rk), offset, value == 1).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -1956,39 +2419,121 @@ future<> redis_service::getbit(args_collection& args, output_stream<char>& out)
     }
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::getbit, std::move(rk), offset).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::getbit, std::move(rk), offset).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
 
 future<> redis_service::bitcount(args_collection& args, output_stream<char>& out)
 {
-    if (args._command_args_count < 3 || args._command_args.empty()) {
+    if ((args._command_args_count != 1 && args._command_args_count != 3) || args._command_args.empty()) {
         return out.write(msg_syntax_err);
     }
     sstring& key = args._command_args[0];
-    long start = 0, end = 0;
-    try {
-        start = std::stol(args._command_args[1]);
-        end = std::stol(args._command_args[2]);
-    } catch (const std::invalid_argument&) {
-        return out.write(msg_syntax_err);
+    long start = 0, end = -1;
+    if (args._command_args_count == 3) {
+        try {
+            start = std::stol(args._command_args[1]);
+            end = std::stol(args._command_args[2]);
+        } catch (const std::invalid_argument&) {
+            return out.write(msg_syntax_err);
+        }
     }
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::bitcount, std::move(rk), start, end).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::bitcount, std::move(rk), start, end).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
 
 future<> redis_service::bitop(args_collection& args, output_stream<char>& out)
 {
-    return out.write(msg_nil);
+    if (args._command_args_count < 3 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    auto name = to_upper(args._command_args[0]);
+    bitop_type op;
+    if (name == "AND") {
+        op = bitop_type::AND;
+    }
+    else if (name == "OR") {
+        op = bitop_type::OR;
+    }
+    else if (name == "XOR") {
+        op = bitop_type::XOR;
+    }
+    else if (name == "NOT" && args._command_args_count == 3) {
+        op = bitop_type::NOT;
+    }
+    else {
+        return out.write(msg_syntax_err);
+    }
+    // The sources are copied from their shards as compressed bitmaps, combined here
+    // container by container and the result is stored by the shard of the destination.
+    struct bitop_state {
+        std::vector<foreign_ptr<lw_shared_ptr<bitmap_lsa>>> sources;
+        bitmap_lsa result;
+        bool wrong_type;
+    };
+    auto count = args._command_args_count - 2;
+    return do_with(bitop_state{std::vector<foreign_ptr<lw_shared_ptr<bitmap_lsa>>>(count), {}, false}, [this, op, count, &args, &out] (auto& state) {
+        return parallel_for_each(boost::irange<size_t>(0, count), [this, &state, &args] (size_t i) {
+            redis_key rk { std::ref(args._command_args[i + 2]) };
+            auto cpu = this->get_cpu(rk);
+            return invoke_on_owner(cpu, &database::get_bitmap_direct, std::move(rk)).then([&state, i] (auto&& u) {
+                if (!u) {
+                    state.wrong_type = true;
+                }
+                state.sources[i] = std::move(u);
+            });
+        }).then([this, op, &state, &args, &out] {
+            if (state.wrong_type) {
+                return out.write(msg_type_err);
+            }
+            // the shorter sources are padded with zeros.
+            state.result = bitmap_lsa(*state.sources[0]);
+            if (op == bitop_type::NOT) {
+                state.result.invert();
+            }
+            for (size_t i = 1; i < state.sources.size(); ++i) {
+                state.result.combine(op, *state.sources[i]);
+            }
+            redis_key rk { std::ref(args._command_args[1]) };
+            auto cpu = this->get_cpu(rk);
+            return invoke_on_owner(cpu, &database::bitop_store, std::move(rk), std::ref(state.result)).then([&out] (auto&& m) {
+                return out.write(std::move(*m));
+            });
+        });
+    });
 }
 
 future<> redis_service::bitpos(args_collection& args, output_stream<char>& out)
 {
-    return out.write(msg_nil);
+    if (args._command_args_count < 2 || args._command_args_count > 4 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    sstring& key = args._command_args[0];
+    auto& bit = args._command_args[1];
+    if (bit != "0" && bit != "1") {
+        return out.write(msg_syntax_err);
+    }
+    long start = 0, end = -1;
+    bool end_given = args._command_args_count == 4;
+    try {
+        if (args._command_args_count > 2) {
+            start = std::stol(args._command_args[2]);
+        }
+        if (end_given) {
+            end = std::stol(args._command_args[3]);
+        }
+    } catch (const std::invalid_argument&) {
+        return out.write(msg_syntax_err);
+    }
+    redis_key rk {std::ref(key)};
+    auto cpu = get_cpu(rk);
+    return invoke_on_owner(cpu, &database::bitpos, std::move(rk), bit == "1", start, end, end_given).then([&out] (auto&& m) {
+        return out.write(std::move(*m));
+    });
 }
 
 future<> redis_service::bitfield(args_collection& args, output_stream<char>& out)
@@ -2008,7 +2553,7 @@ future<> redis_service::pfadd(args_collection& args, output_stream<char>& out)
     redis_key rk {std::ref(key)};
     auto& elements = args._tmp_keys;
     auto cpu = get_cpu(rk);
-    return get_database().invoke_on(cpu, &database::pfadd, rk, std::ref(elements)).then([&out] (auto&& m) {
+    return invoke_on_owner(cpu, &database::pfadd, rk, std::ref(elements)).then([&out] (auto&& m) {
         return out.write(std::move(*m));
     });
 }
@@ -2022,14 +2567,14 @@ future<> redis_service::pfcount(args_collection& args, output_stream<char>& out)
         sstring& key = args._command_args[0];
         redis_key rk {std::ref(key)};
         auto cpu = get_cpu(rk);
-        return get_database().invoke_on(cpu, &database::pfcount, std::move(rk)).then([&out] (auto&& m) {
+        return invoke_on_owner(cpu, &database::pfcount, std::move(rk)).then([&out] (auto&& m) {
             return out.write(std::move(*m));
         });
     }
     else {
         struct merge_state {
             std::vector<sstring>& keys;
-            uint8_t merged_sources[HLL_BYTES_SIZE];
+            uint8_t registers[HLL_BUCKET_COUNT];
         };
         for (size_t i = 0; i < args._command_args_count; ++i) {
             args._tmp_keys.emplace_back(args._command_args[i]);
@@ -2038,14 +2583,14 @@ future<> redis_service::pfcount(args_collection& args, output_stream<char>& out)
             return parallel_for_each(std::begin(state.keys), std::end(state.keys), [this, &state] (auto& key) {
                 redis_key rk { std::ref(key) };
                 auto cpu = this->get_cpu(rk);
-                return get_database().invoke_on(cpu, &database::get_hll_direct, std::move(rk)).then([&state] (auto&& u) {
+                return invoke_on_owner(cpu, &database::get_hll_direct, std::move(rk)).then([&state] (auto&& u) {
                     if (u) {
-                        hll::merge(state.merged_sources, HLL_BYTES_SIZE, *u);
+                        hll::merge(state.registers, *u);
                     }
                     return make_ready_future<>();
                 });
             }).then([this, &state, &out] {
-                auto card = hll::count(state.merged_sources, HLL_BYTES_SIZE);
+                auto card = hll::count(state.registers);
                 return reply_builder::build_local(out, card);
             });
         });
@@ -2060,7 +2605,7 @@ future<> redis_service::pfmerge(args_collection& args, output_stream<char>& out)
     struct merge_state {
         sstring dest;
         std::vector<sstring>& keys;
-        uint8_t merged_sources[HLL_BYTES_SIZE];
+        uint8_t registers[HLL_BUCKET_COUNT];
     };
     for (size_t i = 1; i < args._command_args_count; ++i) {
         args._tmp_keys.emplace_back(args._command_args[i]);
@@ -2069,19 +2614,176 @@ future<> redis_service::pfmerge(args_collection& args, output_stream<char>& out)
         return parallel_for_each(std::begin(state.keys), std::end(state.keys), [this, &state] (auto& key) {
             redis_key rk { std::ref(key) };
             auto cpu = this->get_cpu(rk);
-            return get_database().invoke_on(cpu, &database::get_hll_direct, std::move(rk)).then([&state] (auto&& u) {
+            return invoke_on_owner(cpu, &database::get_hll_direct, std::move(rk)).then([&state] (auto&& u) {
                 if (u) {
-                    hll::merge(state.merged_sources, HLL_BYTES_SIZE, *u);
+                    hll::merge(state.registers, *u);
                 }
                 return make_ready_future<>();
             });
         }).then([this, &state, &out] {
             redis_key rk { std::ref(state.dest) };
             auto cpu = this->get_cpu(rk);
-            return get_database().invoke_on(cpu, &database::pfmerge, std::move(rk), state.merged_sources, HLL_BYTES_SIZE).then([&out] (auto&& m) {
+            return invoke_on_owner(cpu, &database::pfmerge, std::move(rk), state.registers).then([&out] (auto&& m) {
                 return out.write(std::move(*m));
             });
         });
     });
 }
+
+future<> redis_service::save(args_collection& args, output_stream<char>& out)
+{
+    return get_snapshot_manager().invoke_on(0, &snapshot_manager::save).then_wrapped([&out] (auto f) {
+        try {
+            return out.write(f.get0() ? msg_ok : msg_snapshot_in_progress);
+        } catch (...) {
+            return out.write(msg_err);
+        }
+    });
+}
+
+future<> redis_service::bgsave(args_collection& args, output_stream<char>& out)
+{
+    return get_snapshot_manager().invoke_on(0, &snapshot_manager::bgsave).then([&out] (bool started) {
+        return out.write(started ? msg_bgsave_started : msg_snapshot_in_progress);
+    });
+}
+
+future<> redis_service::lastsave(args_collection& args, output_stream<char>& out)
+{
+    return get_snapshot_manager().invoke_on(0, [] (snapshot_manager& snapshots) {
+        return snapshots.last_save();
+    }).then([&out] (uint64_t u) {
+        return reply_builder::build_local(out, size_t(u));
+    });
+}
+
+future<> redis_service::slowlog(args_collection& args, output_stream<char>& out)
+{
+    if (args._command_args_count < 1 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    auto sub = to_upper(args._command_args[0]);
+    if (sub == "LEN") {
+        return get_database().map_reduce(adder<size_t>(), [] (database& db) {
+            return db.get_slowlog().size();
+        }).then([&out] (size_t n) {
+            return reply_builder::build_local(out, n);
+        });
+    }
+    if (sub == "RESET") {
+        return get_database().invoke_on_all([] (database& db) {
+            db.get_slowlog().reset();
+        }).then([&out] {
+            return out.write(msg_ok);
+        });
+    }
+    if (sub != "GET") {
+        return out.write(msg_syntax_err);
+    }
+    // as Redis, 10 entries by default and all of them for a negative count.
+    size_t count = 10;
+    if (args._command_args_count > 1) {
+        try {
+            auto n = std::stol(args._command_args[1].c_str());
+            count = n < 0 ? std::numeric_limits<size_t>::max() : size_t(n);
+        } catch (const std::invalid_argument&) {
+            return out.write(msg_value_err);
+        } catch (const std::out_of_range&) {
+            return out.write(msg_value_err);
+        }
+    }
+    using entries_type = std::vector<slowlog_entry>;
+    return do_with(std::vector<entries_type>(smp::count), [count, &out] (auto& logs) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [count, &logs] (unsigned cpu) {
+            return get_database().invoke_on(cpu, [count] (database& db) {
+                auto& entries = db.get_slowlog().entries();
+                auto n = std::min(count, entries.size());
+                return entries_type(entries.begin(), entries.begin() + n);
+            }).then([&logs, cpu] (entries_type&& entries) {
+                logs[cpu] = std::move(entries);
+            });
+        }).then([count, &logs, &out] {
+            auto entries = redis::slowlog::merge(std::move(logs), count);
+            reply_writer w;
+            w.write_array_header(entries.size());
+            for (auto& e : entries) {
+                w.write_array_header(7);
+                w.write_integer(e._id);
+                w.write_integer(e._timestamp);
+                w.write_integer(e._duration_us);
+                w.write_array_header(e._args.size());
+                for (auto& arg : e._args) {
+                    w.write_bulk(arg);
+                }
+                w.write_bulk(e._client);
+                // the client name, connections have none.
+                w.write_bulk("", 0);
+                w.write_integer(e._shard);
+            }
+            return out.write(std::move(*w.finish()));
+        });
+    });
+}
+
+future<> redis_service::latency(args_collection& args, output_stream<char>& out)
+{
+    if (args._command_args_count < 1 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    auto sub = to_upper(args._command_args[0]);
+    using events_type = latency_monitor::events_type;
+    if (sub == "RESET") {
+        std::vector<sstring> events(args._command_args.begin() + 1, args._command_args.end());
+        return do_with(std::move(events), std::set<sstring>(), [&out] (auto& events, auto& reset) {
+            return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&events, &reset] (unsigned cpu) {
+                return get_database().invoke_on(cpu, [&events] (database& db) {
+                    return db.get_latency_monitor().reset(events);
+                }).then([&reset] (std::vector<sstring>&& names) {
+                    reset.insert(names.begin(), names.end());
+                });
+            }).then([&reset, &out] {
+                return reply_builder::build_local(out, reset.size());
+            });
+        });
+    }
+    bool latest = sub == "LATEST";
+    if (!latest && (sub != "HISTORY" || args._command_args_count < 2)) {
+        return out.write(msg_syntax_err);
+    }
+    return do_with(std::vector<events_type>(smp::count), [&args, latest, &out] (auto& shards) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&shards] (unsigned cpu) {
+            return get_database().invoke_on(cpu, [] (database& db) {
+                return db.get_latency_monitor().events();
+            }).then([&shards, cpu] (events_type&& events) {
+                shards[cpu] = std::move(events);
+            });
+        }).then([&args, &shards, latest, &out] {
+            auto events = latency_monitor::merge(std::move(shards));
+            reply_writer w;
+            if (latest) {
+                w.write_array_header(events.size());
+                for (auto& e : events) {
+                    auto& last = e.second._samples.back();
+                    w.write_array_header(4);
+                    w.write_bulk(e.first);
+                    w.write_integer(last._time);
+                    w.write_integer(last._latency_ms);
+                    w.write_integer(e.second._max_ms);
+                }
+                return out.write(std::move(*w.finish()));
+            }
+            auto it = events.find(args._command_args[1]);
+            if (it == events.end()) {
+                return out.write(msg_empty_multi_bulk);
+            }
+            w.write_array_header(it->second._samples.size());
+            for (auto& sample : it->second._samples) {
+                w.write_array_header(2);
+                w.write_integer(sample._time);
+                w.write_integer(sample._latency_ms);
+            }
+            return out.write(std::move(*w.finish()));
+        });
+    });
+}
 } /* namespace redis */
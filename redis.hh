@@ -62,10 +62,10 @@ using message = scattered_message<char>;
 class redis_service {
 private:
     inline unsigned get_cpu(const sstring& key) {
-        return std::hash<sstring>()(key) % smp::count;
+        return shard_of(hash_key(key.data(), key.size()), smp::count);
     }
     inline unsigned get_cpu(const redis_key& key) {
-        return key.hash() % smp::count;
+        return key.get_cpu();
     }
 public:
     redis_service()
@@ -120,6 +120,8 @@ public:
     future<> hgetall(args_collection& args, output_stream<char>& out);
     future<> hgetall_keys(args_collection& args, output_stream<char>& out);
     future<> hgetall_values(args_collection& args, output_stream<char>& out);
+    future<> hrandfield(args_collection& args, output_stream<char>& out);
+    future<> hscan(args_collection& args, output_stream<char>& out);
     future<> hmget(args_collection& args, output_stream<char>& out);
 
     // [SET]
@@ -131,17 +133,21 @@ public:
     future<> sdiff(args_collection& args, output_stream<char>& out);
     future<> sdiff_store(args_collection& args, output_stream<char>& out);
     future<> sinter(args_collection& args, output_stream<char>& out);
+    future<> sintercard(args_collection& args, output_stream<char>& out);
     future<> sinter_store(args_collection& args, output_stream<char>& out);
     future<> sunion(args_collection& args, output_stream<char>& out);
     future<> sunion_store(args_collection& args, output_stream<char>& out);
     future<> smove(args_collection& args, output_stream<char>& out);
     future<> srandmember(args_collection& args, output_stream<char>& out);
+    future<> sscan(args_collection& args, output_stream<char>& out);
     future<> spop(args_collection& args, output_stream<char>& out);
 
     future<> type(args_collection& args, output_stream<char>& out);
+    future<> scan(args_collection& args, output_stream<char>& out);
     future<> expire(args_collection& args, output_stream<char>& out);
     future<> persist(args_collection& args, output_stream<char>& out);
     future<> pexpire(args_collection& args, output_stream<char>& out);
+    future<> pexpireat(args_collection& args, output_stream<char>& out);
     future<> ttl(args_collection& args, output_stream<char>& out);
     future<> pttl(args_collection& args, output_stream<char>& out);
 
@@ -153,6 +159,7 @@ public:
     future<> zcount(args_collection& args, output_stream<char>& out);
     future<> zincrby(args_collection& args, output_stream<char>& out);
     future<> zrank(args_collection&, bool, output_stream<char>& out);
+    future<> zscan(args_collection&, output_stream<char>& out);
     future<> zrem(args_collection&, output_stream<char>& out);
     future<> zscore(args_collection&, output_stream<char>& out);
     future<> zunionstore(args_collection&, output_stream<char>& out);
@@ -174,6 +181,7 @@ public:
     future<> geodist(args_collection&, output_stream<char>& out);
     future<> geohash(args_collection&, output_stream<char>& out);
     future<> georadius(args_collection&, bool, output_stream<char>& out);
+    future<> geosearch(args_collection&, bool store, output_stream<char>& out);
 
     // [BITMAP]
     future<> setbit(args_collection&, output_stream<char>& out);
@@ -187,6 +195,15 @@ public:
     future<> pfadd(args_collection&, output_stream<char>& out);
     future<> pfcount(args_collection&, output_stream<char>& out);
     future<> pfmerge(args_collection&, output_stream<char>& out);
+
+    // [PERSISTENCE]
+    future<> save(args_collection&, output_stream<char>& out);
+    future<> bgsave(args_collection&, output_stream<char>& out);
+    future<> lastsave(args_collection&, output_stream<char>& out);
+
+    // [DIAGNOSTICS]
+    future<> slowlog(args_collection&, output_stream<char>& out);
+    future<> latency(args_collection&, output_stream<char>& out);
 private:
     future<std::pair<size_t, int>> zadds_impl(sstring& key, std::unordered_map<sstring, double>&& members, int flags);
     future<bool> exists_impl(sstring& key);
@@ -196,6 +213,9 @@ private:
     future<> sadds_impl_return_keys(sstring& key, std::vector<sstring>& members, output_stream<char>& out);
     future<> sdiff_impl(std::vector<sstring>& keys, sstring* dest, output_stream<char>& out);
     future<> sinter_impl(std::vector<sstring>& keys, sstring* dest, output_stream<char>& out);
+    future<int> scard_all(std::vector<sstring>& keys, std::vector<long>& cards);
+    future<int> sinter_members(std::vector<sstring>& keys, std::vector<sstring>& result, size_t limit);
+    future<> sprobe_impl(sstring& key, std::vector<sstring>& candidates, bool exists, size_t limit);
     future<> sunion_impl(std::vector<sstring>& keys, sstring* dest, output_stream<char>& out);
     future<> smembers_impl(sstring& key, output_stream<char>& out);
     future<> pop_impl(args_collection& args, bool left, output_stream<char>& out);
@@ -204,7 +224,7 @@ private:
     future<> push_impl(sstring& key, std::vector<sstring>& vals, bool force, bool left, output_stream<char>& out);
     future<bool> srem_direct(sstring& key, sstring& member);
     future<bool> sadd_direct(sstring& key, sstring& member);
-    future<bool> set_impl(sstring& key, sstring& value, long expir, uint8_t flag);
+    future<bool> set_impl(sstring& key, temporary_buffer<char>& value, long expir, uint8_t flag);
     //future<item_ptr> get_impl(sstring& key);
     future<bool> remove_impl(sstring& key);
     future<int> hdel_impl(sstring& key, sstring& field);
@@ -219,6 +239,55 @@ private:
         int aggregate_flag;
     };
     bool parse_zset_args(args_collection& args, zset_args& uargs);
+    std::vector<key_batch> make_key_batches(args_collection& args, size_t count, bool with_values);
+    future<> count_keys_impl(args_collection& args, size_t (database::*func)(key_batch&), output_stream<char>& out);
+    // The options of SCAN, HSCAN, SSCAN and ZSCAN. The type is in the form of
+    // cache_entry::type_name().
+    struct scan_args
+    {
+        size_t count = SCAN_COUNT_DEFAULT;
+        sstring pattern;
+        sstring type;
+    };
+    bool parse_scan_args(args_collection& args, size_t first, bool with_type, scan_args& sargs);
+    using scan_key_func = future<foreign_ptr<lw_shared_ptr<message>>> (database::*)(const redis_key&, uint64_t, size_t, const sstring&);
+    future<> scan_key_impl(args_collection& args, scan_key_func func, output_stream<char>& out);
+    // The cursor of SCAN is [bucket cursor of the shard][shard: scan_shard_bits].
+    static constexpr unsigned scan_shard_bits = 12;
+    struct scan_state
+    {
+        scan_args options;
+        unsigned shard;
+        size_t cursor;
+        std::vector<sstring> keys;
+    };
+    static constexpr size_t zstore_batch_size = 1024;
+    struct zstore_source
+    {
+        sstring key;
+        double weight;
+        std::vector<std::pair<sstring, double>> batch;
+        size_t pos = 0;
+        sstring after;
+        bool started = false;
+        // no batch is left after the current one.
+        bool done = false;
+        inline bool needs_batch() const { return !done && pos == batch.size(); }
+    };
+    struct zstore_state
+    {
+        std::vector<zstore_source> sources;
+        sstring dest;
+        int aggregate_flag;
+        bool intersect;
+        uint64_t id;
+        std::vector<std::pair<sstring, double>> output;
+        bool finished = false;
+    };
+    uint64_t _zstore_id = 0;
+    future<> zstore_impl(zset_args& uargs, bool intersect, output_stream<char>& out);
+    future<> zstore_fetch(zstore_source& source);
+    static void zstore_merge(zstore_state& state);
     static inline double score_aggregation(const double& old, const double& newscore, int flag)
     {
         if (flag == ZAGGREGATE_MIN) {
@@ -20,249 +20,631 @@
 */
 #include "redis_protocol.hh"
 #include "redis.hh"
+#include "db.hh"
+#include "storage_proxy.hh"
 #include "common.hh"
+#include "core/metrics.hh"
 #include <algorithm>
+#include <strings.h>
 
 namespace redis {
 
+void request_latency_tracer::register_command_metrics(redis_protocol_parser::command command, const histogram& h)
+{
+    namespace sm = seastar::metrics;
+    auto name = redis_protocol_parser::command_name(command);
+    _command_metrics->add_group("command_latency", {
+        sm::make_histogram(name, sm::description(sprint("Latency of %s in microseconds, until its reply is written.", name)), [&h] { return h.to_metrics(); }),
+    });
+}
+
 redis_protocol::redis_protocol()
 {
+    _parser.init();
+}
+
+redis_protocol::redis_protocol(bool replay)
+    : redis_protocol()
+{
+    _replay = replay;
+}
+
+void redis_protocol::parse_requests(temporary_buffer<char>& buf, request_latency_tracer& tracer)
+{
+    char* p = buf.get_write();
+    char* pe = p + buf.size();
+    _parser.set_input(buf);
+    auto start = steady_clock_type::now();
+    while (p != pe) {
+        p = _parser.parse(p, pe, nullptr);
+        if (p == nullptr) {
+            // the last request is incomplete, the parser keeps it until more data arrives.
+            return;
+        }
+        _requests.emplace_back();
+        auto& req = _requests.back();
+        req._valid = _parser._state == redis_protocol_parser::state::ok;
+        uint64_t copied = _parser._copied_bytes;
+        if (req._valid) {
+            req._command = _parser._command;
+            req._args._command_args_count = _parser._args_count - 1;
+            auto& views = _parser._args_list;
+            req._args._command_args.reserve(views.size());
+            for (size_t i = 0; i < views.size(); ++i) {
+                if (by_view(req._command, i)) {
+                    req._args._command_args.emplace_back();
+                }
+                else {
+                    req._args._command_args.emplace_back(views[i].get(), views[i].size());
+                    copied += views[i].size();
+                }
+            }
+            req._args._command_views = std::move(views);
+        }
+        tracer.incr_args_bytes(_parser._args_bytes, copied);
+        auto now = steady_clock_type::now();
+        tracer.trace_parse(now - start);
+        start = now;
+        _parser.init();
+    }
 }
 
-void redis_protocol::prepare_request()
+// The arguments which are stored as they were received, they are only copied into
+// the cache. All the others are materialized as sstrings.
+bool redis_protocol::by_view(redis_protocol_parser::command command, size_t index)
 {
-    _request_args._command_args_count = _parser._args_count - 1;
-    _request_args._command_args = std::move(_parser._args_list);
-    _request_args._tmp_keys.clear();
-    _request_args._tmp_key_values.clear();
-    _request_args._tmp_key_scores.clear();
-    _request_args._tmp_key_value_pairs.clear();
+    switch (command) {
+    case redis_protocol_parser::command::set:
+    case redis_protocol_parser::command::append:
+        return index == 1;
+    case redis_protocol_parser::command::mset:
+        return index % 2 == 1;
+    default:
+        return false;
+    }
+}
+
+// A request is pipelinable if all of its cross shard calls are issued as soon as it
+// is dispatched, and none of them depends on the result of another. Such requests
+// can run together: the per shard message queues are FIFO, so the requests of a
+// connection still reach every shard in the order they were sent.
+bool redis_protocol::pipelinable(const request& req)
+{
+    if (!req._valid) {
+        return true;
+    }
+    switch (req._command) {
+    case redis_protocol_parser::command::set:
+    case redis_protocol_parser::command::mset:
+    case redis_protocol_parser::command::get:
+    case redis_protocol_parser::command::mget:
+    case redis_protocol_parser::command::del:
+    case redis_protocol_parser::command::ping:
+    case redis_protocol_parser::command::command:
+    case redis_protocol_parser::command::incr:
+    case redis_protocol_parser::command::decr:
+    case redis_protocol_parser::command::incrby:
+    case redis_protocol_parser::command::decrby:
+    case redis_protocol_parser::command::exists:
+    case redis_protocol_parser::command::append:
+    case redis_protocol_parser::command::strlen:
+    case redis_protocol_parser::command::lpush:
+    case redis_protocol_parser::command::lpushx:
+    case redis_protocol_parser::command::rpush:
+    case redis_protocol_parser::command::rpushx:
+    case redis_protocol_parser::command::lpop:
+    case redis_protocol_parser::command::rpop:
+    case redis_protocol_parser::command::llen:
+    case redis_protocol_parser::command::lindex:
+    case redis_protocol_parser::command::lrange:
+    case redis_protocol_parser::command::hset:
+    case redis_protocol_parser::command::hget:
+    case redis_protocol_parser::command::hdel:
+    case redis_protocol_parser::command::hlen:
+    case redis_protocol_parser::command::hexists:
+    case redis_protocol_parser::command::hgetall:
+    case redis_protocol_parser::command::sadd:
+    case redis_protocol_parser::command::scard:
+    case redis_protocol_parser::command::sismember:
+    case redis_protocol_parser::command::smembers:
+    case redis_protocol_parser::command::srem:
+    case redis_protocol_parser::command::zadd:
+    case redis_protocol_parser::command::zcard:
+    case redis_protocol_parser::command::zscore:
+    case redis_protocol_parser::command::zrange:
+    case redis_protocol_parser::command::zrevrange:
+    case redis_protocol_parser::command::ttl:
+    case redis_protocol_parser::command::pttl:
+    case redis_protocol_parser::command::setbit:
+    case redis_protocol_parser::command::getbit:
+    case redis_protocol_parser::command::pfadd:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool redis_protocol::read_only(const request& req)
+{
+    if (!req._valid) {
+        return true;
+    }
+    switch (req._command) {
+    case redis_protocol_parser::command::get:
+    case redis_protocol_parser::command::mget:
+    case redis_protocol_parser::command::ping:
+    case redis_protocol_parser::command::command:
+    case redis_protocol_parser::command::exists:
+    case redis_protocol_parser::command::strlen:
+    case redis_protocol_parser::command::type:
+    case redis_protocol_parser::command::scan:
+    case redis_protocol_parser::command::llen:
+    case redis_protocol_parser::command::lindex:
+    case redis_protocol_parser::command::lrange:
+    case redis_protocol_parser::command::hget:
+    case redis_protocol_parser::command::hlen:
+    case redis_protocol_parser::command::hexists:
+    case redis_protocol_parser::command::hstrlen:
+    case redis_protocol_parser::command::hmget:
+    case redis_protocol_parser::command::hkeys:
+    case redis_protocol_parser::command::hvals:
+    case redis_protocol_parser::command::hgetall:
+    case redis_protocol_parser::command::hrandfield:
+    case redis_protocol_parser::command::hscan:
+    case redis_protocol_parser::command::lastsave:
+    case redis_protocol_parser::command::slowlog:
+    case redis_protocol_parser::command::latency:
+    case redis_protocol_parser::command::scard:
+    case redis_protocol_parser::command::sismember:
+    case redis_protocol_parser::command::smembers:
+    case redis_protocol_parser::command::srandmember:
+    case redis_protocol_parser::command::sscan:
+    case redis_protocol_parser::command::sinter:
+    case redis_protocol_parser::command::sintercard:
+    case redis_protocol_parser::command::sunion:
+    case redis_protocol_parser::command::sdiff:
+    case redis_protocol_parser::command::zcard:
+    case redis_protocol_parser::command::zcount:
+    case redis_protocol_parser::command::zscore:
+    case redis_protocol_parser::command::zrank:
+    case redis_protocol_parser::command::zrevrank:
+    case redis_protocol_parser::command::zrange:
+    case redis_protocol_parser::command::zrevrange:
+    case redis_protocol_parser::command::zrangebyscore:
+    case redis_protocol_parser::command::zrevrangebyscore:
+    case redis_protocol_parser::command::zscan:
+    case redis_protocol_parser::command::ttl:
+    case redis_protocol_parser::command::pttl:
+    case redis_protocol_parser::command::getbit:
+    case redis_protocol_parser::command::bitcount:
+    case redis_protocol_parser::command::bitpos:
+    case redis_protocol_parser::command::pfcount:
+    case redis_protocol_parser::command::geodist:
+    case redis_protocol_parser::command::geohash:
+    case redis_protocol_parser::command::geopos:
+    case redis_protocol_parser::command::georadius:
+    case redis_protocol_parser::command::georadiusbymember:
+    case redis_protocol_parser::command::geosearch:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// The requests served by the node owning their first key. The ones without a key,
+// or which touch several keys, are served by the node which received them.
+bool redis_protocol::routed(redis_protocol_parser::command command, const args_collection& args)
+{
+    if (args._command_args_count == 0) {
+        return false;
+    }
+    switch (command) {
+    case redis_protocol_parser::command::echo:
+    case redis_protocol_parser::command::ping:
+    case redis_protocol_parser::command::command:
+    case redis_protocol_parser::command::scan:
+    case redis_protocol_parser::command::select:
+    case redis_protocol_parser::command::save:
+    case redis_protocol_parser::command::bgsave:
+    case redis_protocol_parser::command::lastsave:
+    case redis_protocol_parser::command::slowlog:
+    case redis_protocol_parser::command::latency:
+    case redis_protocol_parser::command::mget:
+    case redis_protocol_parser::command::mset:
+    case redis_protocol_parser::command::sdiff:
+    case redis_protocol_parser::command::sdiffstore:
+    case redis_protocol_parser::command::sinter:
+    case redis_protocol_parser::command::sinterstore:
+    case redis_protocol_parser::command::sintercard:
+    case redis_protocol_parser::command::sunion:
+    case redis_protocol_parser::command::sunionstore:
+    case redis_protocol_parser::command::smove:
+    case redis_protocol_parser::command::zunionstore:
+    case redis_protocol_parser::command::zinterstore:
+    case redis_protocol_parser::command::zdiffstore:
+    case redis_protocol_parser::command::zunion:
+    case redis_protocol_parser::command::zinter:
+    case redis_protocol_parser::command::zdiff:
+    case redis_protocol_parser::command::geosearchstore:
+    case redis_protocol_parser::command::bitop:
+    case redis_protocol_parser::command::pfmerge:
+        return false;
+    case redis_protocol_parser::command::del:
+    case redis_protocol_parser::command::exists:
+    case redis_protocol_parser::command::pfcount:
+        return args._command_args_count == 1;
+    case redis_protocol_parser::command::georadius:
+    case redis_protocol_parser::command::georadiusbymember:
+        return std::none_of(args._command_args.begin() + 1, args._command_args.end(), [] (const sstring& a) {
+            return strcasecmp(a.c_str(), "STORE") == 0 || strcasecmp(a.c_str(), "STOREDIST") == 0;
+        });
+    default:
+        return true;
+    }
+}
+
+// The writes which may use more memory, they are rejected while a shard is out
+// of memory. The ones which only free memory are not.
+bool redis_protocol::denied_on_oom(const request& req)
+{
+    switch (req._command) {
+    case redis_protocol_parser::command::del:
+    case redis_protocol_parser::command::expire:
+    case redis_protocol_parser::command::pexpire:
+    case redis_protocol_parser::command::pexpireat:
+    case redis_protocol_parser::command::persist:
+    case redis_protocol_parser::command::lpop:
+    case redis_protocol_parser::command::rpop:
+    case redis_protocol_parser::command::lrem:
+    case redis_protocol_parser::command::ltrim:
+    case redis_protocol_parser::command::hdel:
+    case redis_protocol_parser::command::srem:
+    case redis_protocol_parser::command::spop:
+    case redis_protocol_parser::command::zrem:
+    case redis_protocol_parser::command::zremrangebyscore:
+    case redis_protocol_parser::command::zremrangebyrank:
+    case redis_protocol_parser::command::select:
+    case redis_protocol_parser::command::save:
+    case redis_protocol_parser::command::bgsave:
+        return false;
+    default:
+        return !read_only(req);
+    }
 }
 
 future<> redis_protocol::handle(input_stream<char>& in, output_stream<char>& out, request_latency_tracer& tracer)
 {
-    _parser.init();
-    // NOTE: The command is handled sequentially. The parser will control the lifetime
-    // of every parameters for command.
-    return in.consume(_parser).then([this, &in, &out, &tracer] () -> future<> {
-        tracer.begin_trace_latency();
-        switch (_parser._state) {
-            case redis_protocol_parser::state::eof:
-            case redis_protocol_parser::state::error:
-                return make_ready_future<>();
+    // Every complete request of the received data is parsed at once, so a pipeline is
+    // executed as a batch and its replies are flushed once by the caller.
+    return in.read().then([this, &out, &tracer] (temporary_buffer<char> buf) {
+        return handle(std::move(buf), out, tracer);
+    });
+}
 
-            case redis_protocol_parser::state::ok:
-            {
-                prepare_request();
-                switch (_parser._command) {
-                case redis_protocol_parser::command::set:
-                    return local_redis_service().set(_request_args, std::ref(out));
-                case redis_protocol_parser::command::mset:
-                    return local_redis_service().mset(_request_args, std::ref(out));
-                case redis_protocol_parser::command::get:
-                    return local_redis_service().get(_request_args, std::ref(out));
-                case redis_protocol_parser::command::del:
-                    return local_redis_service().del(_request_args, std::ref(out));
-                case redis_protocol_parser::command::ping:
-                    return out.write(msg_pong);
-                case redis_protocol_parser::command::incr:
-                    return local_redis_service().incr(_request_args, std::ref(out));
-                case redis_protocol_parser::command::decr:
-                    return local_redis_service().incr(_request_args, std::ref(out));
-                case redis_protocol_parser::command::incrby:
-                    return local_redis_service().incrby(_request_args, std::ref(out));
-                case redis_protocol_parser::command::decrby:
-                    return local_redis_service().decrby(_request_args, std::ref(out));
-                case redis_protocol_parser::command::mget:
-                    return local_redis_service().mget(_request_args, out);
-                case redis_protocol_parser::command::command:
-                    return out.write(msg_ok);
-                case redis_protocol_parser::command::exists:
-                    return local_redis_service().exists(_request_args, std::ref(out));
-                case redis_protocol_parser::command::append:
-                    return local_redis_service().append(_request_args, std::ref(out));
-                case redis_protocol_parser::command::strlen:
-                    return local_redis_service().strlen(_request_args, std::ref(out));
-                case redis_protocol_parser::command::lpush:
-                    return local_redis_service().lpush(_request_args, std::ref(out));
-                case redis_protocol_parser::command::lpushx:
-                    return local_redis_service().lpushx(_request_args, std::ref(out));
-                case redis_protocol_parser::command::lpop:
-                    return local_redis_service().lpop(_request_args, std::ref(out));
-                case redis_protocol_parser::command::llen:
-                    return local_redis_service().llen(_request_args, std::ref(out));
-                case redis_protocol_parser::command::lindex:
-                    return local_redis_service().lindex(_request_args, std::ref(out));
-                case redis_protocol_parser::command::linsert:
-                    return local_redis_service().linsert(_request_args, std::ref(out));
-                case redis_protocol_parser::command::lrange:
-                    return local_redis_service().lrange(_request_args, std::ref(out));
-                case redis_protocol_parser::command::lset:
-                    return local_redis_service().lset(_request_args, std::ref(out));
-                case redis_protocol_parser::command::rpush:
-                    return local_redis_service().rpush(_request_args, std::ref(out));
-                case redis_protocol_parser::command::rpushx:
-                    return local_redis_service().rpushx(_request_args, std::ref(out));
-                case redis_protocol_parser::command::rpop:
-                    return local_redis_service().rpop(_request_args, std::ref(out));
-                case redis_protocol_parser::command::lrem:
-                    return local_redis_service().lrem(_request_args, std::ref(out));
-                case redis_protocol_parser::command::ltrim:
-                    return local_redis_service().ltrim(_request_args, std::ref(out));
-                case redis_protocol_parser::command::hset:
-                    return local_redis_service().hset(_request_args, std::ref(out));
-                case redis_protocol_parser::command::hmset:
-                    return local_redis_service().hmset(_request_args, std::ref(out));
-                case redis_protocol_parser::command::hdel:
-                    return local_redis_service().hdel(_request_args, std::ref(out));
-                case redis_protocol_parser::command::hget:
-                    return local_redis_service().hget(_request_args, std::ref(out));
-                case redis_protocol_parser::command::hlen:
-                    return local_redis_service().hlen(_request_args, std::ref(out));
-                case redis_protocol_parser::command::hexists:
-                    return local_redis_service().hexists(_request_args, std::ref(out));
-                case redis_protocol_parser::command::hstrlen:
-                    return local_redis_service().hstrlen(_request_args, std::ref(out));
-                case redis_protocol_parser::command::hincrby:
-                    return local_redis_service().hincrby(_request_args, std::ref(out));
-                case redis_protocol_parser::command::hincrbyfloat:
-                    return local_redis_service().hincrbyfloat(_request_args, std::ref(out));
-                case redis_protocol_parser::command::hkeys:
-                    return local_redis_service().hgetall_keys(_request_args, std::ref(out));
-                case redis_protocol_parser::command::hvals:
-                    return local_redis_service().hgetall_values(_request_args, std::ref(out));
-                case redis_protocol_parser::command::hmget:
-                    return local_redis_service().hmget(_request_args, std::ref(out));
-                case redis_protocol_parser::command::hgetall:
-                    return local_redis_service().hgetall(_request_args, std::ref(out));
-                case redis_protocol_parser::command::sadd:
-                    return local_redis_service().sadd(_request_args, std::ref(out));
-                case redis_protocol_parser::command::scard:
-                    return local_redis_service().scard(_request_args, std::ref(out));
-                case redis_protocol_parser::command::sismember:
-                    return local_redis_service().sismember(_request_args, std::ref(out));
-                case redis_protocol_parser::command::smembers:
-                    return local_redis_service().smembers(_request_args, std::ref(out));
-                case redis_protocol_parser::command::srandmember:
-                    return local_redis_service().srandmember(_request_args, std::ref(out));
-                case redis_protocol_parser::command::srem:
-                    return local_redis_service().srem(_request_args, std::ref(out));
-                case redis_protocol_parser::command::sdiff:
-                    return local_redis_service().sdiff(_request_args,std::ref(out));
-                case redis_protocol_parser::command::sdiffstore:
-                    return local_redis_service().sdiff_store(_request_args, std::ref(out));
-                case redis_protocol_parser::command::sinter:
-                    return local_redis_service().sinter(_request_args, std::ref(out));
-                case redis_protocol_parser::command::sinterstore:
-                    return local_redis_service().sinter_store(_request_args, std::ref(out));
-                case redis_protocol_parser::command::sunion:
-                    return local_redis_service().sunion(_request_args, std::ref(out));
-                case redis_protocol_parser::command::sunionstore:
-                    return local_redis_service().sunion_store(_request_args, std::ref(out));
-                case redis_protocol_parser::command::smove:
-                    return local_redis_service().smove(_request_args, std::ref(out));
-                case redis_protocol_parser::command::spop:
-                    return local_redis_service().spop(_request_args, std::ref(out));
-                case redis_protocol_parser::command::type:
-                    return local_redis_service().type(_request_args, std::ref(out));
-                case redis_protocol_parser::command::expire:
-                    return local_redis_service().expire(_request_args, std::ref(out));
-                case redis_protocol_parser::command::pexpire:
-                    return local_redis_service().pexpire(_request_args, std::ref(out));
-                case redis_protocol_parser::command::ttl:
-                    return local_redis_service().ttl(_request_args, std::ref(out));
-                case redis_protocol_parser::command::pttl:
-                    return local_redis_service().pttl(_request_args, std::ref(out));
-                case redis_protocol_parser::command::persist:
-                    return local_redis_service().persist(_request_args, std::ref(out));
-                case redis_protocol_parser::command::zadd:
-                    return local_redis_service().zadd(_request_args, std::ref(out));
-                case redis_protocol_parser::command::zrange:
-                    return local_redis_service().zrange(_request_args, false, std::ref(out));
-                case redis_protocol_parser::command::zrevrange:
-                    return local_redis_service().zrange(_request_args, true, std::ref(out));
-                case redis_protocol_parser::command::zrangebyscore:
-                    return local_redis_service().zrangebyscore(_request_args, false, std::ref(out));
-                case redis_protocol_parser::command::zrevrangebyscore:
-                    return local_redis_service().zrangebyscore(_request_args, true, std::ref(out));
-                case redis_protocol_parser::command::zrem:
-                    return local_redis_service().zrem(_request_args, std::ref(out));
-                case redis_protocol_parser::command::zremrangebyscore:
-                    return local_redis_service().zremrangebyscore(_request_args, std::ref(out));
-                case redis_protocol_parser::command::zremrangebyrank:
-                    return local_redis_service().zremrangebyrank(_request_args, std::ref(out));
-                case redis_protocol_parser::command::zcard:
-                    return local_redis_service().zcard(_request_args, std::ref(out));
-                case redis_protocol_parser::command::zcount:
-                    return local_redis_service().zcount(_request_args, std::ref(out));
-                case redis_protocol_parser::command::zscore:
-                    return local_redis_service().zscore(_request_args, std::ref(out));
-                case redis_protocol_parser::command::zincrby:
-                    return local_redis_service().zincrby(_request_args, std::ref(out));
-                case redis_protocol_parser::command::zrank:
-                    return local_redis_service().zrank(_request_args, false, std::ref(out));
-                case redis_protocol_parser::command::zrevrank:
-                    return local_redis_service().zrank(_request_args, true, std::ref(out));
-                case redis_protocol_parser::command::zunionstore:
-                    return local_redis_service().zunionstore(_request_args, std::ref(out));
-                case redis_protocol_parser::command::zinterstore:
-                    return local_redis_service().zinterstore(_request_args, std::ref(out));
-                case redis_protocol_parser::command::select:
-                    return local_redis_service().select(_request_args, std::ref(out));
-                case redis_protocol_parser::command::geoadd:
-                    return local_redis_service().geoadd(_request_args, std::ref(out));
-                case redis_protocol_parser::command::geodist:
-                    return local_redis_service().geodist(_request_args, std::ref(out));
-                case redis_protocol_parser::command::geopos:
-                    return local_redis_service().geopos(_request_args, std::ref(out));
-                case redis_protocol_parser::command::geohash:
-                    return local_redis_service().geohash(_request_args, std::ref(out));
-                case redis_protocol_parser::command::georadius:
-                    return local_redis_service().georadius(_request_args, false, std::ref(out));
-                case redis_protocol_parser::command::georadiusbymember:
-                    return local_redis_service().georadius(_request_args, true, std::ref(out));
-                case redis_protocol_parser::command::setbit:
-                    return local_redis_service().setbit(_request_args, std::ref(out));
-                case redis_protocol_parser::command::getbit:
-                    return local_redis_service().getbit(_request_args, std::ref(out));
-                case redis_protocol_parser::command::bitcount:
-                    return local_redis_service().bitcount(_request_args, std::ref(out));
+future<> redis_protocol::handle(temporary_buffer<char> data, output_stream<char>& out, request_latency_tracer& tracer)
+{
+    if (data.empty()) {
+        return make_ready_future<>();
+    }
+    parse_requests(data, tracer);
+    return execute(out, tracer);
+}
+
+future<> redis_protocol::execute(output_stream<char>& out, request_latency_tracer& tracer)
+{
+    // When the commit log syncs in batch mode, the replies are held back until the
+    // mutations are durable on every shard, none of them reaches the client before.
+    bool wait_sync = get_local_database().commitlog_batch_mode()
+        && std::any_of(_requests.begin(), _requests.end(), [] (const request& req) { return !read_only(req); });
+    if (!wait_sync) {
+        return execute_runs(out, tracer).finally([this] {
+            _requests.clear();
+        });
+    }
+    auto held = make_lw_shared<reply_buffer>();
+    return execute_runs(held->stream(), tracer).then([] {
+        return get_database().invoke_on_all(&database::commitlog_sync_point);
+    }).then([held, &out] {
+        return held->write_to(out);
+    }).finally([this, held] {
+        _requests.clear();
+    });
+}
 
-                /*
-                case redis_protocol_parser::command::bitpos:
-                    return local_redis_service().bitpos(_request_args).then([&out] (auto&& m) {
-                        return out.write(std::move(m));
-                    });
-                case redis_protocol_parser::command::bitop:
-                    return local_redis_service().bitop(_request_args).then([&out] (auto&& m) {
-                        return out.write(std::move(m));
-                    });
-                */
-                case redis_protocol_parser::command::pfadd:
-                    return local_redis_service().pfadd(_request_args, std::ref(out));
-                case redis_protocol_parser::command::pfcount:
-                    return local_redis_service().pfcount(_request_args, std::ref(out));
-                case redis_protocol_parser::command::pfmerge:
-                    return local_redis_service().pfmerge(_request_args, std::ref(out));
-                default:
-                    tracer.incr_number_exceptions();
-                    return out.write("+Not Implemented");
-                };
+future<> redis_protocol::execute_runs(output_stream<char>& out, request_latency_tracer& tracer)
+{
+    return do_with(size_t(0), [this, &out, &tracer] (size_t& begin) {
+        return do_until([this, &begin] { return begin == _requests.size(); }, [this, &begin, &out, &tracer] {
+            // a run of pipelinable requests is executed together, any other request alone.
+            auto first = begin;
+            if (pipelinable(_requests[begin++])) {
+                while (begin < _requests.size() && pipelinable(_requests[begin])) {
+                    ++begin;
+                }
             }
-            default:
-                tracer.incr_number_exceptions();
-                return out.write("+Error\r\n");
+            return execute_run(first, begin, out, tracer);
+        });
+    });
+}
+
+future<> redis_protocol::execute_run(size_t begin, size_t end, output_stream<char>& out, request_latency_tracer& tracer)
+{
+    if (end - begin == 1) {
+        return dispatch(_requests[begin], out, tracer);
+    }
+    // The first request replies to the connection directly, the others into buffers
+    // which are appended in order once the whole run is done.
+    return do_with(std::vector<reply_buffer>(end - begin - 1), [this, begin, end, &out, &tracer] (auto& buffers) {
+        auto first = _requests.begin() + begin;
+        return parallel_for_each(first, _requests.begin() + end, [this, first, &buffers, &out, &tracer] (request& req) {
+            auto index = &req - &(*first);
+            return this->dispatch(req, index == 0 ? out : buffers[index - 1].stream(), tracer);
+        }).then([&buffers, &out] {
+            return do_for_each(buffers, [&out] (reply_buffer& buffer) {
+                return buffer.write_to(out);
+            });
+        });
+    });
+}
+
+void redis_protocol::trace_slow(const request& req, steady_clock_type::duration latency)
+{
+    if (!req._valid || _replay) {
+        return;
+    }
+    auto& db = get_local_database();
+    auto& slowlog = db.get_slowlog();
+    if (slowlog.slow(latency)) {
+        slowlog.add(latency, _client, redis_protocol_parser::command_name(req._command), req._args._command_views);
+    }
+    db.get_latency_monitor().record("command", latency);
+}
+
+future<> redis_protocol::dispatch(request& req, output_stream<char>& out, request_latency_tracer& tracer)
+{
+    auto start = tracer.begin_trace_latency();
+    return futurize_apply([this, &req, &out, &tracer] () -> future<> {
+        if (!req._valid) {
+            tracer.incr_number_exceptions();
+            return out.write("+Error\r\n");
+        }
+        if (_forward && !_replay && routed(req._command, req._args)) {
+            auto& proxy = get_local_storage_proxy();
+            auto owner = proxy.remote_owner(req._args._command_args[0]);
+            if (owner) {
+                return proxy.process(*owner, req._command, read_only(req), req._args, out);
+            }
+        }
+        if (!_replay && get_local_database().out_of_memory() && denied_on_oom(req)) {
+            get_local_database().note_oom_rejection();
+            return out.write(msg_oom_err);
+        }
+        switch (req._command) {
+        case redis_protocol_parser::command::set:
+            return local_redis_service().set(req._args, std::ref(out));
+        case redis_protocol_parser::command::mset:
+            return local_redis_service().mset(req._args, std::ref(out));
+        case redis_protocol_parser::command::get:
+            return local_redis_service().get(req._args, std::ref(out));
+        case redis_protocol_parser::command::del:
+            return local_redis_service().del(req._args, std::ref(out));
+        case redis_protocol_parser::command::ping:
+            return out.write(msg_pong);
+        case redis_protocol_parser::command::incr:
+            return local_redis_service().incr(req._args, std::ref(out));
+        case redis_protocol_parser::command::decr:
+            return local_redis_service().decr(req._args, std::ref(out));
+        case redis_protocol_parser::command::incrby:
+            return local_redis_service().incrby(req._args, std::ref(out));
+        case redis_protocol_parser::command::decrby:
+            return local_redis_service().decrby(req._args, std::ref(out));
+        case redis_protocol_parser::command::mget:
+            return local_redis_service().mget(req._args, out);
+        case redis_protocol_parser::command::command:
+            return out.write(msg_ok);
+        case redis_protocol_parser::command::exists:
+            return local_redis_service().exists(req._args, std::ref(out));
+        case redis_protocol_parser::command::append:
+            return local_redis_service().append(req._args, std::ref(out));
+        case redis_protocol_parser::command::strlen:
+            return local_redis_service().strlen(req._args, std::ref(out));
+        case redis_protocol_parser::command::lpush:
+            return local_redis_service().lpush(req._args, std::ref(out));
+        case redis_protocol_parser::command::lpushx:
+            return local_redis_service().lpushx(req._args, std::ref(out));
+        case redis_protocol_parser::command::lpop:
+            return local_redis_service().lpop(req._args, std::ref(out));
+        case redis_protocol_parser::command::llen:
+            return local_redis_service().llen(req._args, std::ref(out));
+        case redis_protocol_parser::command::lindex:
+            return local_redis_service().lindex(req._args, std::ref(out));
+        case redis_protocol_parser::command::linsert:
+            return local_redis_service().linsert(req._args, std::ref(out));
+        case redis_protocol_parser::command::lrange:
+            return local_redis_service().lrange(req._args, std::ref(out));
+        case redis_protocol_parser::command::lset:
+            return local_redis_service().lset(req._args, std::ref(out));
+        case redis_protocol_parser::command::rpush:
+            return local_redis_service().rpush(req._args, std::ref(out));
+        case redis_protocol_parser::command::rpushx:
+            return local_redis_service().rpushx(req._args, std::ref(out));
+        case redis_protocol_parser::command::rpop:
+            return local_redis_service().rpop(req._args, std::ref(out));
+        case redis_protocol_parser::command::lrem:
+            return local_redis_service().lrem(req._args, std::ref(out));
+        case redis_protocol_parser::command::ltrim:
+            return local_redis_service().ltrim(req._args, std::ref(out));
+        case redis_protocol_parser::command::hset:
+            return local_redis_service().hset(req._args, std::ref(out));
+        case redis_protocol_parser::command::hmset:
+            return local_redis_service().hmset(req._args, std::ref(out));
+        case redis_protocol_parser::command::hdel:
+            return local_redis_service().hdel(req._args, std::ref(out));
+        case redis_protocol_parser::command::hget:
+            return local_redis_service().hget(req._args, std::ref(out));
+        case redis_protocol_parser::command::hlen:
+            return local_redis_service().hlen(req._args, std::ref(out));
+        case redis_protocol_parser::command::hexists:
+            return local_redis_service().hexists(req._args, std::ref(out));
+        case redis_protocol_parser::command::hstrlen:
+            return local_redis_service().hstrlen(req._args, std::ref(out));
+        case redis_protocol_parser::command::hincrby:
+            return local_redis_service().hincrby(req._args, std::ref(out));
+        case redis_protocol_parser::command::hincrbyfloat:
+            return local_redis_service().hincrbyfloat(req._args, std::ref(out));
+        case redis_protocol_parser::command::hkeys:
+            return local_redis_service().hgetall_keys(req._args, std::ref(out));
+        case redis_protocol_parser::command::hvals:
+            return local_redis_service().hgetall_values(req._args, std::ref(out));
+        case redis_protocol_parser::command::hmget:
+            return local_redis_service().hmget(req._args, std::ref(out));
+        case redis_protocol_parser::command::hgetall:
+            return local_redis_service().hgetall(req._args, std::ref(out));
+        case redis_protocol_parser::command::hrandfield:
+            return local_redis_service().hrandfield(req._args, std::ref(out));
+        case redis_protocol_parser::command::hscan:
+            return local_redis_service().hscan(req._args, std::ref(out));
+        case redis_protocol_parser::command::sadd:
+            return local_redis_service().sadd(req._args, std::ref(out));
+        case redis_protocol_parser::command::scard:
+            return local_redis_service().scard(req._args, std::ref(out));
+        case redis_protocol_parser::command::sismember:
+            return local_redis_service().sismember(req._args, std::ref(out));
+        case redis_protocol_parser::command::smembers:
+            return local_redis_service().smembers(req._args, std::ref(out));
+        case redis_protocol_parser::command::srandmember:
+            return local_redis_service().srandmember(req._args, std::ref(out));
+        case redis_protocol_parser::command::srem:
+            return local_redis_service().srem(req._args, std::ref(out));
+        case redis_protocol_parser::command::sdiff:
+            return local_redis_service().sdiff(req._args,std::ref(out));
+        case redis_protocol_parser::command::sdiffstore:
+            return local_redis_service().sdiff_store(req._args, std::ref(out));
+        case redis_protocol_parser::command::sinter:
+            return local_redis_service().sinter(req._args, std::ref(out));
+        case redis_protocol_parser::command::sinterstore:
+            return local_redis_service().sinter_store(req._args, std::ref(out));
+        case redis_protocol_parser::command::sintercard:
+            return local_redis_service().sintercard(req._args, std::ref(out));
+        case redis_protocol_parser::command::sunion:
+            return local_redis_service().sunion(req._args, std::ref(out));
+        case redis_protocol_parser::command::sunionstore:
+            return local_redis_service().sunion_store(req._args, std::ref(out));
+        case redis_protocol_parser::command::smove:
+            return local_redis_service().smove(req._args, std::ref(out));
+        case redis_protocol_parser::command::spop:
+            return local_redis_service().spop(req._args, std::ref(out));
+        case redis_protocol_parser::command::sscan:
+            return local_redis_service().sscan(req._args, std::ref(out));
+        case redis_protocol_parser::command::type:
+            return local_redis_service().type(req._args, std::ref(out));
+        case redis_protocol_parser::command::scan:
+            return local_redis_service().scan(req._args, std::ref(out));
+        case redis_protocol_parser::command::expire:
+            return local_redis_service().expire(req._args, std::ref(out));
+        case redis_protocol_parser::command::pexpire:
+            return local_redis_service().pexpire(req._args, std::ref(out));
+        case redis_protocol_parser::command::pexpireat:
+            return local_redis_service().pexpireat(req._args, std::ref(out));
+        case redis_protocol_parser::command::ttl:
+            return local_redis_service().ttl(req._args, std::ref(out));
+        case redis_protocol_parser::command::pttl:
+            return local_redis_service().pttl(req._args, std::ref(out));
+        case redis_protocol_parser::command::persist:
+            return local_redis_service().persist(req._args, std::ref(out));
+        case redis_protocol_parser::command::zadd:
+            return local_redis_service().zadd(req._args, std::ref(out));
+        case redis_protocol_parser::command::zrange:
+            return local_redis_service().zrange(req._args, false, std::ref(out));
+        case redis_protocol_parser::command::zrevrange:
+            return local_redis_service().zrange(req._args, true, std::ref(out));
+        case redis_protocol_parser::command::zrangebyscore:
+            return local_redis_service().zrangebyscore(req._args, false, std::ref(out));
+        case redis_protocol_parser::command::zrevrangebyscore:
+            return local_redis_service().zrangebyscore(req._args, true, std::ref(out));
+        case redis_protocol_parser::command::zrem:
+            return local_redis_service().zrem(req._args, std::ref(out));
+        case redis_protocol_parser::command::zremrangebyscore:
+            return local_redis_service().zremrangebyscore(req._args, std::ref(out));
+        case redis_protocol_parser::command::zremrangebyrank:
+            return local_redis_service().zremrangebyrank(req._args, std::ref(out));
+        case redis_protocol_parser::command::zcard:
+            return local_redis_service().zcard(req._args, std::ref(out));
+        case redis_protocol_parser::command::zcount:
+            return local_redis_service().zcount(req._args, std::ref(out));
+        case redis_protocol_parser::command::zscore:
+            return local_redis_service().zscore(req._args, std::ref(out));
+        case redis_protocol_parser::command::zincrby:
+            return local_redis_service().zincrby(req._args, std::ref(out));
+        case redis_protocol_parser::command::zrank:
+            return local_redis_service().zrank(req._args, false, std::ref(out));
+        case redis_protocol_parser::command::zrevrank:
+            return local_redis_service().zrank(req._args, true, std::ref(out));
+        case redis_protocol_parser::command::zscan:
+            return local_redis_service().zscan(req._args, std::ref(out));
+        case redis_protocol_parser::command::zunionstore:
+            return local_redis_service().zunionstore(req._args, std::ref(out));
+        case redis_protocol_parser::command::zinterstore:
+            return local_redis_service().zinterstore(req._args, std::ref(out));
+        case redis_protocol_parser::command::select:
+            return local_redis_service().select(req._args, std::ref(out));
+        case redis_protocol_parser::command::geoadd:
+            return local_redis_service().geoadd(req._args, std::ref(out));
+        case redis_protocol_parser::command::geodist:
+            return local_redis_service().geodist(req._args, std::ref(out));
+        case redis_protocol_parser::command::geopos:
+            return local_redis_service().geopos(req._args, std::ref(out));
+        case redis_protocol_parser::command::geohash:
+            return local_redis_service().geohash(req._args, std::ref(out));
+        case redis_protocol_parser::command::georadius:
+            return local_redis_service().georadius(req._args, false, std::ref(out));
+        case redis_protocol_parser::command::georadiusbymember:
+            return local_redis_service().georadius(req._args, true, std::ref(out));
+        case redis_protocol_parser::command::geosearch:
+            return local_redis_service().geosearch(req._args, false, std::ref(out));
+        case redis_protocol_parser::command::geosearchstore:
+            return local_redis_service().geosearch(req._args, true, std::ref(out));
+        case redis_protocol_parser::command::setbit:
+            return local_redis_service().setbit(req._args, std::ref(out));
+        case redis_protocol_parser::command::getbit:
+            return local_redis_service().getbit(req._args, std::ref(out));
+        case redis_protocol_parser::command::bitcount:
+            return local_redis_service().bitcount(req._args, std::ref(out));
+        case redis_protocol_parser::command::bitpos:
+            return local_redis_service().bitpos(req._args, std::ref(out));
+        case redis_protocol_parser::command::bitop:
+            return local_redis_service().bitop(req._args, std::ref(out));
+        case redis_protocol_parser::command::pfadd:
+            return local_redis_service().pfadd(req._args, std::ref(out));
+        case redis_protocol_parser::command::pfcount:
+            return local_redis_service().pfcount(req._args, std::ref(out));
+        case redis_protocol_parser::command::pfmerge:
+            return local_redis_service().pfmerge(req._args, std::ref(out));
+        case redis_protocol_parser::command::save:
+            return local_redis_service().save(req._args, std::ref(out));
+        case redis_protocol_parser::command::bgsave:
+            return local_redis_service().bgsave(req._args, std::ref(out));
+        case redis_protocol_parser::command::lastsave:
+            return local_redis_service().lastsave(req._args, std::ref(out));
+        case redis_protocol_parser::command::slowlog:
+            return local_redis_service().slowlog(req._args, std::ref(out));
+        case redis_protocol_parser::command::latency:
+            return local_redis_service().latency(req._args, std::ref(out));
+        default:
+            tracer.incr_number_exceptions();
+            return out.write("+Not Implemented");
         };
-        std::abort();
-    }).then_wrapped([this, &in, &out, &tracer] (auto&& f) -> future<> {
+    }).then_wrapped([this, &req, &out, &tracer, start] (auto&& f) -> future<> {
+        // a request which fails replies an error of its own, the other requests of
+        // its run still reply in order.
         try {
             f.get();
-        } catch (std::bad_alloc& e) {
+        } catch (...) {
             tracer.incr_number_exceptions();
-            tracer.end_trace_latency();
+            trace_slow(req, tracer.end_trace_latency(start, req._valid, req._command));
             return out.write(msg_err);
         }
-        tracer.end_trace_latency();
+        trace_slow(req, tracer.end_trace_latency(start, req._valid, req._command));
         return make_ready_future<>();
     });
 }
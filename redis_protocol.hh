@@ -21,6 +21,8 @@
 #pragma once
 #include "common.hh"
 #include "core/stream.hh"
+#include "core/metrics_registration.hh"
+#include "utils/latency_histogram.hh"
 #include "redis_protocol_parser.hh"
 #include "net/packet-data-source.hh"
 #include "net/packet-data-source.hh"
@@ -28,25 +30,68 @@
 namespace redis {
 class redis_service;
 
+// Traces the requests of a connection shard: the latency of every command type,
+// from its dispatch until its reply is written, and the time taken to parse the
+// requests and to flush their replies. The stages which run on the shard owning
+// the key are traced by the database, see redis_service::invoke_on_owner().
 class request_latency_tracer
 {
-    static constexpr const int SAMPLE_COUNT = 256;
-    circular_buffer<double> _latencies;
-    double _average_latency = 0;
+    using histogram = utils::latency_histogram;
     uint64_t _requests_served = 0;
     uint64_t _requests_serving = 0;
     uint64_t _requests_exception = 0;
-    steady_clock_type::time_point _timestamp = steady_clock_type::now();
+    uint64_t _requests_parsed = 0;
+    uint64_t _args_bytes = 0;
+    uint64_t _args_copied_bytes = 0;
+    histogram _latency;
+    histogram _parse;
+    histogram _write;
+    // the histogram of a command is allocated when it is first traced.
+    std::vector<std::unique_ptr<histogram>> _commands;
+    std::unique_ptr<seastar::metrics::metric_groups> _command_metrics;
+
+    histogram& command_histogram(redis_protocol_parser::command command) {
+        auto i = static_cast<size_t>(command);
+        if (i >= _commands.size()) {
+            _commands.resize(i + 1);
+        }
+        if (!_commands[i]) {
+            _commands[i] = std::make_unique<histogram>();
+            if (_command_metrics) {
+                register_command_metrics(command, *_commands[i]);
+            }
+        }
+        return *_commands[i];
+    }
+    void register_command_metrics(redis_protocol_parser::command command, const histogram& h);
 public:
     request_latency_tracer() {}
     ~request_latency_tracer() {}
 
+    // Exports the histogram of every command as it is traced first.
+    inline void export_command_metrics() {
+        _command_metrics = std::make_unique<seastar::metrics::metric_groups>();
+    }
+
     inline uint64_t number_exceptions() const {
         return _requests_exception;
     }
 
+    // the mean latency, in microseconds.
     inline double latency() const {
-        return _average_latency;
+        return _latency.mean() / 1000;
+    }
+
+    inline const histogram& latency_histogram() const {
+        return _latency;
+    }
+
+    inline const histogram& parse_histogram() const {
+        return _parse;
+    }
+
+    inline const histogram& write_histogram() const {
+        return _write;
     }
 
     inline uint64_t served() const {
@@ -57,36 +102,136 @@ public:
         return _requests_serving;
     }
 
-    inline void begin_trace_latency() {
+    inline uint64_t args_bytes() const {
+        return _args_bytes;
+    }
+
+    inline uint64_t args_copied_bytes() const {
+        return _args_copied_bytes;
+    }
+
+    inline double copied_bytes_per_request() const {
+        return _requests_parsed ? static_cast<double>(_args_copied_bytes) / _requests_parsed : 0;
+    }
+
+    // the bytes of the arguments of a parsed request, and how many of them were copied.
+    inline void incr_args_bytes(uint64_t bytes, uint64_t copied) {
+        ++_requests_parsed;
+        _args_bytes += bytes;
+        _args_copied_bytes += copied;
+    }
+
+    inline steady_clock_type::time_point begin_trace_latency() {
         ++_requests_serving;
-        _timestamp = steady_clock_type::now();
+        return steady_clock_type::now();
     }
 
     inline void incr_number_exceptions() {
         ++_requests_exception;
     }
 
-    inline void end_trace_latency() {
-        auto rt = static_cast<double>((steady_clock_type::now() - _timestamp).count() / 1000.0); //us
-        _latencies.push_front(rt);
-        if (_latencies.size() > SAMPLE_COUNT) {
-            auto drop = _latencies.back();
-            _latencies.pop_back();
-            _average_latency -= (drop / SAMPLE_COUNT);
-        }
+    // an invalid request has no command, it is only traced in the total.
+    inline steady_clock_type::duration end_trace_latency(steady_clock_type::time_point start, bool valid, redis_protocol_parser::command command) {
+        auto latency = steady_clock_type::now() - start;
         --_requests_serving;
         ++_requests_served;
-        _average_latency += (rt / SAMPLE_COUNT);
+        _latency.add(latency);
+        if (valid) {
+            command_histogram(command).add(latency);
+        }
+        return latency;
+    }
+
+    inline void trace_parse(steady_clock_type::duration d) {
+        _parse.add(d);
+    }
+
+    inline void trace_write(steady_clock_type::duration d) {
+        _write.add(d);
+    }
+};
+
+// Keeps the replies of a request which runs ahead of its turn in a pipeline.
+class reply_buffer {
+    static constexpr const size_t BUFFER_SIZE = 8192;
+    std::vector<net::packet> _packets;
+    output_stream<char> _out;
+public:
+    reply_buffer() : _out(data_sink(std::make_unique<vector_data_sink>(_packets)), BUFFER_SIZE) {}
+    reply_buffer(const reply_buffer&) = delete;
+    reply_buffer(reply_buffer&&) = delete;
+
+    inline output_stream<char>& stream() {
+        return _out;
+    }
+
+    future<> write_to(output_stream<char>& out) {
+        return _out.flush().then([this, &out] {
+            return do_for_each(_packets, [&out] (net::packet& p) {
+                return out.write(std::move(p));
+            });
+        });
+    }
+
+    // The replies as one string, to be sent back to the node which forwarded the requests.
+    future<sstring> collect() {
+        return _out.flush().then([this] {
+            size_t size = 0;
+            for (auto& p : _packets) {
+                size += p.len();
+            }
+            sstring replies(sstring::initialized_later(), size);
+            auto dst = replies.begin();
+            for (auto& p : _packets) {
+                for (auto& f : p.fragments()) {
+                    dst = std::copy_n(f.base, f.size, dst);
+                }
+            }
+            return replies;
+        });
     }
 };
 
 class redis_protocol {
 private:
+    struct request {
+        redis_protocol_parser::command _command;
+        args_collection _args;
+        bool _valid = false;
+    };
     redis_protocol_parser _parser;
-    args_collection _request_args;
+    std::vector<request> _requests;
+    // the requests replayed from the commit log are never rejected.
+    bool _replay = false;
+    // the requests whose key is owned by another node are forwarded to it, unless
+    // they were forwarded to this node.
+    bool _forward = true;
+    // the address of the client, as the slowlog shows it.
+    sstring _client;
+    void parse_requests(temporary_buffer<char>& buf, request_latency_tracer& tracer);
+    static bool by_view(redis_protocol_parser::command command, size_t index);
+    static bool pipelinable(const request& req);
+    static bool read_only(const request& req);
+    static bool denied_on_oom(const request& req);
+    future<> execute(output_stream<char>& out, request_latency_tracer& tracer);
+    future<> execute_runs(output_stream<char>& out, request_latency_tracer& tracer);
+    future<> execute_run(size_t begin, size_t end, output_stream<char>& out, request_latency_tracer& tracer);
+    future<> dispatch(request& req, output_stream<char>& out, request_latency_tracer& tracer);
+    void trace_slow(const request& req, steady_clock_type::duration latency);
 public:
     redis_protocol();
-    void prepare_request();
+    explicit redis_protocol(bool replay);
+    inline void set_client(sstring client) {
+        _client = std::move(client);
+    }
+    // Serves the requests forwarded by another node, see storage_proxy.
+    inline void serve_locally() {
+        _forward = false;
+    }
     future<> handle(input_stream<char>& in, output_stream<char>& out, request_latency_tracer& tracer);
+    // Executes the requests in the data, as replayed from the commit log.
+    future<> handle(temporary_buffer<char> data, output_stream<char>& out, request_latency_tracer& tracer);
+    // The requests served by the node owning their first key.
+    static bool routed(redis_protocol_parser::command command, const args_collection& args);
 };
 }
@@ -24,6 +24,7 @@
 **/
 
 #include "core/ragel.hh"
+#include "core/temporary_buffer.hh"
 #include <memory>
 #include <iostream>
 #include <algorithm>
@@ -35,37 +36,17 @@ machine redis_resp_protocol;
 
 access _fsm_;
 
-action mark {
-    g.mark_start(p);
-}
-
 action start_blob {
-    g.mark_start(p);
-    _size_left = _arg_size;
-}
-action start_command {
-    g.mark_start(p);
     _size_left = _arg_size;
 }
 
 action advance_blob {
     auto len = std::min((uint32_t)(pe - p), _size_left);
+    append_blob(p, len);
     _size_left -= len;
     p += len;
     if (_size_left == 0) {
-      _args_list.push_back(str());
-      p--;
-      fret;
-    }
-    p--;
-}
-
-action advance_command {
-    auto len = std::min((uint32_t)(pe - p), _size_left);
-    _size_left -= len;
-    p += len;
-    if (_size_left == 0) {
-      _command = str();
+      _args_list.push_back(std::move(_blob));
       p--;
       fret;
     }
@@ -118,6 +99,8 @@ hkeys = "hkeys"i ${_command = command::hkeys;};
 hvals = "hvals"i ${_command = command::hvals;};
 hmget = "hmget"i ${_command = command::hmget;};
 hgetall = "hgetall"i ${_command = command::hgetall;};
+hrandfield = "hrandfield"i ${_command = command::hrandfield;};
+hscan = "hscan"i ${_command = command::hscan;};
 sadd = "sadd"i ${_command = command::sadd;};
 scard = "scard"i ${_command = command::scard;};
 sismember = "sismember"i ${_command = command::sismember;};
@@ -128,13 +111,17 @@ sdiff = "sdiff"i ${_command = command::sdiff;};
 sdiffstore = "sdiffstore"i ${_command = command::sdiffstore;};
 sinter = "sinter"i ${_command = command::sinter;};
 sinterstore = "sinterstore"i ${_command = command::sinterstore;};
+sintercard = "sintercard"i ${_command = command::sintercard;};
 sunion = "sunion"i ${_command = command::sunion;};
 sunionstore = "sunionstore"i ${_command = command::sunionstore;};
 smove = "smove"i ${_command = command::smove;};
 spop = "spop"i ${_command = command::spop;};
+sscan = "sscan"i ${_command = command::sscan;};
 type = "type"i ${_command = command::type; };
+scan = "scan"i ${_command = command::scan; };
 expire = "expire"i ${_command = command::expire; };
 pexpire = "pexpire"i ${_command = command::pexpire; };
+pexpireat = "pexpireat"i ${_command = command::pexpireat; };
 ttl = "ttl"i ${_command = command::ttl; };
 pttl = "pttl"i ${_command = command::pttl; };
 persist = "persist"i ${_command = command::persist; };
@@ -169,6 +156,8 @@ geohash = "geohash"i ${_command = command::geohash; };
 geopos = "geopos"i ${_command = command::geopos; };
 georadius = "georadius"i ${_command = command::georadius; };
 georadiusbymember = "georadiusbymember"i ${_command = command::georadiusbymember; };
+geosearch = "geosearch"i ${_command = command::geosearch; };
+geosearchstore = "geosearchstore"i ${_command = command::geosearchstore; };
 setbit = "setbit"i ${_command = command::setbit; };
 getbit = "getbit"i ${_command = command::getbit; };
 bitcount = "bitcount"i ${_command = command::bitcount; };
@@ -178,20 +167,31 @@ bitpos = "bitpos"i ${_command = command::bitpos; };
 pfadd = "pfadd"i ${_command = command::pfadd; };
 pfcount = "pfcount"i ${_command = command::pfcount; };
 pfmerge = "pfmerge"i ${_command = command::pfmerge; };
+save = "save"i ${_command = command::save; };
+bgsave = "bgsave"i ${_command = command::bgsave; };
+lastsave = "lastsave"i ${_command = command::lastsave; };
+slowlog = "slowlog"i ${_command = command::slowlog; };
+latency = "latency"i ${_command = command::latency; };
 
 command = (setbit | set | getbit | get | del | mget | mset | echo | ping | incr | decr | incrby | decrby | command_ | exists | append |
            strlen | lpushx | lpush | lpop | llen | lindex | linsert | lrange | lset | rpushx | rpush | rpop | lrem |
-           ltrim | hset | hgetall |hget | hdel | hlen | hexists | hstrlen | hincrby | hincrbyfloat | hkeys | hvals | hmget | hmset |
-           sadd | scard | sismember | smembers | srem | sdiffstore | sdiff | sinterstore | sinter| sunionstore | sunion | smove | srandmember | spop |
-           type | expire | pexpire | persist | ttl | pttl | zadd | zcard | zcount | zincrby |
+           ltrim | hset | hgetall | hrandfield |hget | hdel | hlen | hexists | hstrlen | hincrby | hincrbyfloat | hkeys | hvals | hmget | hmset | hscan |
+           sadd | scard | sismember | smembers | srem | sdiffstore | sdiff | sinterstore | sintercard | sinter| sunionstore | sunion | smove | srandmember | spop | sscan |
+           type | scan | expire | pexpireat | pexpire | persist | ttl | pttl | zadd | zcard | zcount | zincrby |
            zrangebyscore | zrank | zremrangebyrank | zremrangebyscore | zremrangebylex | zrem | zrevrangebyscore | zrevrange| zrevrank |
            zscore | zunionstore  | zinterstore | zdiffstore | zunion | zinter | zdiff | zscan | zrangebylex | zlexcount |
-           zrange | select | geoadd | geodist | geohash | geopos | georadiusbymember | georadius |  bitcount |
+           zrange | select | geoadd | geodist | geohash | geopos | georadiusbymember | georadius | geosearchstore | geosearch |  bitcount |
            bitpos | bitop | bitfield |
-           pfadd | pfcount | pfmerge );
+           pfadd | pfcount | pfmerge | save | bgsave | lastsave | slowlog | latency );
 arg = '$' u32 crlf ${ _arg_size = _u32;};
 
-main := (args_count (arg command crlf) (arg @{fcall blob; } crlf)+) ${_state = state::ok;};
+# stops right after the last argument, the rest of the buffer is the next request.
+main := (args_count (arg command crlf) (arg @{fcall blob; } crlf)*) @{
+    if (_args_list.size() + 1 == _args_count) {
+        _state = state::ok;
+        fbreak;
+    }
+};
 
 prepush {
     prepush();
@@ -253,6 +253,8 @@ public:
         hmget,
         hmset,
         hgetall,
+        hrandfield,
+        hscan,
         sadd,
         scard,
         sismember,
@@ -262,14 +264,18 @@ public:
         sdiffstore,
         sinter,
         sinterstore,
+        sintercard,
         sunion,
         sunionstore,
         smove,
         srandmember,
         spop,
+        sscan,
         type,
+        scan,
         expire,
         pexpire,
+        pexpireat,
         ttl,
         pttl,
         persist,
@@ -304,6 +310,8 @@ public:
         geopos,
         georadius,
         georadiusbymember,
+        geosearch,
+        geosearchstore,
         setbit,
         getbit,
         bitcount,
@@ -313,15 +321,168 @@ public:
         pfadd,
         pfcount,
         pfmerge,
+        save,
+        bgsave,
+        lastsave,
+        slowlog,
+        latency,
     };
 
+    // The name of a command, as in the metrics.
+    static const char* command_name(command c) {
+        switch (c) {
+        case command::set: return "set";
+        case command::mset: return "mset";
+        case command::get: return "get";
+        case command::mget: return "mget";
+        case command::del: return "del";
+        case command::echo: return "echo";
+        case command::ping: return "ping";
+        case command::incr: return "incr";
+        case command::decr: return "decr";
+        case command::incrby: return "incrby";
+        case command::decrby: return "decrby";
+        case command::command: return "command";
+        case command::exists: return "exists";
+        case command::append: return "append";
+        case command::strlen: return "strlen";
+        case command::lpush: return "lpush";
+        case command::lpushx: return "lpushx";
+        case command::lpop: return "lpop";
+        case command::llen: return "llen";
+        case command::lindex: return "lindex";
+        case command::linsert: return "linsert";
+        case command::lrange: return "lrange";
+        case command::lset: return "lset";
+        case command::rpush: return "rpush";
+        case command::rpushx: return "rpushx";
+        case command::rpop: return "rpop";
+        case command::lrem: return "lrem";
+        case command::ltrim: return "ltrim";
+        case command::hset: return "hset";
+        case command::hdel: return "hdel";
+        case command::hget: return "hget";
+        case command::hlen: return "hlen";
+        case command::hexists: return "hexists";
+        case command::hstrlen: return "hstrlen";
+        case command::hincrby: return "hincrby";
+        case command::hincrbyfloat: return "hincrbyfloat";
+        case command::hkeys: return "hkeys";
+        case command::hvals: return "hvals";
+        case command::hmget: return "hmget";
+        case command::hmset: return "hmset";
+        case command::hgetall: return "hgetall";
+        case command::hrandfield: return "hrandfield";
+        case command::hscan: return "hscan";
+        case command::sadd: return "sadd";
+        case command::scard: return "scard";
+        case command::sismember: return "sismember";
+        case command::smembers: return "smembers";
+        case command::srem: return "srem";
+        case command::sdiff: return "sdiff";
+        case command::sdiffstore: return "sdiffstore";
+        case command::sinter: return "sinter";
+        case command::sinterstore: return "sinterstore";
+        case command::sintercard: return "sintercard";
+        case command::sunion: return "sunion";
+        case command::sunionstore: return "sunionstore";
+        case command::smove: return "smove";
+        case command::srandmember: return "srandmember";
+        case command::spop: return "spop";
+        case command::sscan: return "sscan";
+        case command::type: return "type";
+        case command::scan: return "scan";
+        case command::expire: return "expire";
+        case command::pexpire: return "pexpire";
+        case command::pexpireat: return "pexpireat";
+        case command::ttl: return "ttl";
+        case command::pttl: return "pttl";
+        case command::persist: return "persist";
+        case command::zadd: return "zadd";
+        case command::zcard: return "zcard";
+        case command::zcount: return "zcount";
+        case command::zincrby: return "zincrby";
+        case command::zrange: return "zrange";
+        case command::zrangebyscore: return "zrangebyscore";
+        case command::zrank: return "zrank";
+        case command::zrem: return "zrem";
+        case command::zremrangebyrank: return "zremrangebyrank";
+        case command::zremrangebyscore: return "zremrangebyscore";
+        case command::zrevrange: return "zrevrange";
+        case command::zrevrangebyscore: return "zrevrangebyscore";
+        case command::zrevrank: return "zrevrank";
+        case command::zscore: return "zscore";
+        case command::zunionstore: return "zunionstore";
+        case command::zinterstore: return "zinterstore";
+        case command::zdiffstore: return "zdiffstore";
+        case command::zunion: return "zunion";
+        case command::zinter: return "zinter";
+        case command::zdiff: return "zdiff";
+        case command::zscan: return "zscan";
+        case command::zrangebylex: return "zrangebylex";
+        case command::zlexcount: return "zlexcount";
+        case command::zremrangebylex: return "zremrangebylex";
+        case command::select: return "select";
+        case command::geoadd: return "geoadd";
+        case command::geohash: return "geohash";
+        case command::geodist: return "geodist";
+        case command::geopos: return "geopos";
+        case command::georadius: return "georadius";
+        case command::georadiusbymember: return "georadiusbymember";
+        case command::geosearch: return "geosearch";
+        case command::geosearchstore: return "geosearchstore";
+        case command::setbit: return "setbit";
+        case command::getbit: return "getbit";
+        case command::bitcount: return "bitcount";
+        case command::bitop: return "bitop";
+        case command::bitpos: return "bitpos";
+        case command::bitfield: return "bitfield";
+        case command::pfadd: return "pfadd";
+        case command::pfcount: return "pfcount";
+        case command::pfmerge: return "pfmerge";
+        case command::save: return "save";
+        case command::bgsave: return "bgsave";
+        case command::lastsave: return "lastsave";
+        case command::slowlog: return "slowlog";
+        case command::latency: return "latency";
+        default: return nullptr;
+        }
+    }
+
     state _state;
     command _command;
     uint32_t _u32;
     uint32_t _arg_size;
     uint32_t _args_count;
     uint32_t _size_left;
-    std::vector<sstring>  _args_list;
+    // An argument is a share of the input buffer if it lies within it, or a copy
+    // if it spans buffers.
+    std::vector<temporary_buffer<char>> _args_list;
+    // the bytes of the arguments, and the ones which were copied.
+    uint64_t _args_bytes;
+    uint64_t _copied_bytes;
+private:
+    temporary_buffer<char>* _input = nullptr;
+    temporary_buffer<char> _blob;
+    uint32_t _blob_filled = 0;
+
+    void append_blob(char* p, uint32_t len) {
+        if (_blob_filled == 0 && len == _arg_size) {
+            _blob = _input->share(p - _input->get(), len);
+            _args_bytes += len;
+            return;
+        }
+        if (_blob_filled == 0) {
+            _blob = temporary_buffer<char>(_arg_size);
+        }
+        std::copy_n(p, len, _blob.get_write() + _blob_filled);
+        _blob_filled += len;
+        _args_bytes += len;
+        _copied_bytes += len;
+        if (_blob_filled == _arg_size) {
+            _blob_filled = 0;
+        }
+    }
 public:
     void init() {
         init_base();
@@ -330,12 +491,18 @@ public:
         _args_count = 0;
         _size_left = 0;
         _arg_size = 0;
+        _args_bytes = 0;
+        _copied_bytes = 0;
+        _blob_filled = 0;
         %% write init;
     }
 
+    // The buffer which the following calls of parse() read from.
+    void set_input(temporary_buffer<char>& buf) {
+        _input = &buf;
+    }
+
     char* parse(char* p, char* pe, char* eof) {
-        sstring_builder::guard g(_builder, p, pe);
-        auto str = [this, &g, &p] { g.mark_end(p); return get_str(); };
         %% write exec;
         if (_state != state::error) {
             return p;
@@ -37,38 +37,75 @@
 #include "dict_lsa.hh"
 #include "sset_lsa.hh"
 #include "geo.hh"
+#include "reply_writer.hh"
 namespace redis {
 using scattered_message_ptr = foreign_ptr<lw_shared_ptr<scattered_message<char>>>;
 
 class reply_builder final {
+static future<scattered_message_ptr> make_reply(lw_shared_ptr<scattered_message<char>> m)
+{
+    return make_ready_future<scattered_message_ptr>(scattered_message_ptr(std::move(m)));
+}
+
+// Writes the value of a cache or dict entry as a bulk string, returns false if
+// it has no such value.
+template<typename Entry>
+static bool write_value(reply_writer& w, const Entry& e)
+{
+    if (e.type_of_integer()) {
+        w.write_bulk(int64_t(e.value_integer()));
+    }
+    else if (e.type_of_float()) {
+        w.write_bulk(double(e.value_float()));
+    }
+    else if (e.type_of_bytes()) {
+        w.write_bulk(e.value_bytes_data(), e.value_bytes_size());
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+template<typename Entry>
+static size_t value_size_hint(const Entry& e)
+{
+    return e.type_of_bytes() ? reply_writer::bulk_size(e.value_bytes_size()) : 32;
+}
 public:
+static lw_shared_ptr<scattered_message<char>> integer_reply(int64_t v)
+{
+    const char* data;
+    size_t size;
+    if (preformatted_integers::get().find(v, data, size)) {
+        auto m = make_lw_shared<scattered_message<char>>();
+        m->append_static(data, size);
+        return m;
+    }
+    reply_writer w(24);
+    w.write_integer(v);
+    return w.finish();
+}
+
 static future<scattered_message_ptr> build(size_t size)
 {
-    auto m = make_lw_shared<scattered_message<char>>();
-    m->append_static(msg_num_tag);
-    m->append(to_sstring(size));
-    m->append_static(msg_crlf);
-    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+    return make_reply(integer_reply(size));
 }
 static future<> build_local(output_stream<char>& out, size_t size)
 {
-    auto m = make_lw_shared<scattered_message<char>>();
-    m->append_static(msg_num_tag);
-    m->append(to_sstring(size));
-    m->append_static(msg_crlf);
-    return out.write(std::move(*m));
+    const char* data;
+    size_t n;
+    if (preformatted_integers::get().find(size, data, n)) {
+        return out.write(data, n);
+    }
+    return out.write(std::move(*integer_reply(size)));
 }
 
 static future<scattered_message_ptr> build(double number)
 {
-    auto m = make_lw_shared<scattered_message<char>>();
-    auto&& n = to_sstring(number);
-    m->append_static(msg_batch_tag);
-    m->append(to_sstring(n.size()));
-    m->append_static(msg_crlf);
-    m->append(std::move(n));
-    m->append_static(msg_crlf);
-    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+    reply_writer w(48);
+    w.write_bulk(number);
+    return make_reply(w.finish());
 }
 
 static future<scattered_message_ptr> build(const sstring& message)
@@ -83,301 +120,269 @@ inline static future<> build_local(output_stream<char>& out, const sstring& mess
    return out.write(message);
 }
 
+// The bytes of the string a bitmap stands for.
+static future<scattered_message_ptr> build(const bitmap_lsa& bitmap)
+{
+    reply_writer w(reply_writer::bulk_size(bitmap.size()));
+    w.write_bulk(bitmap.size(), [&bitmap] (char* p) {
+        bitmap.read(0, p, bitmap.size());
+    });
+    return make_reply(w.finish());
+}
+
 template<bool Key, bool Value>
 static future<scattered_message_ptr> build(const cache_entry* e)
 {
-    if (e) {
-        //build reply
-        auto m = make_lw_shared<scattered_message<char>>();
-        if (Key) {
-            m->append(msg_batch_tag);
-            m->append(to_sstring(e->key_size()));
-            m->append_static(msg_crlf);
-            m->append(sstring{e->key_data(), e->key_size()});
-            m->append_static(msg_crlf);
-        }
-        if (Value) {
-            m->append_static(msg_batch_tag);
-            if (e->type_of_integer()) {
-               auto&& n = to_sstring(e->value_integer());
-               m->append(to_sstring(n.size()));
-               m->append_static(msg_crlf);
-               m->append(n);
-               m->append_static(msg_crlf);
-            }
-            else if (e->type_of_float()) {
-               auto&& n = to_sstring(e->value_float());
-               m->append(to_sstring(n.size()));
-               m->append_static(msg_crlf);
-               m->append(n);
-               m->append_static(msg_crlf);
-            }
-            else if (e->type_of_bytes()) {
-                m->append(to_sstring(e->value_bytes_size()));
-                m->append_static(msg_crlf);
-                m->append(sstring{e->value_bytes_data(), e->value_bytes_size()});
-                m->append_static(msg_crlf);
-            }
-            else {
-               m->append_static(msg_type_err);
-            }
-            return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
-        }
-    }
-    else {
+    if (!e) {
         return reply_builder::build(msg_not_found);
     }
+    reply_writer w((Key ? reply_writer::bulk_size(e->key_size()) : 0) + (Value ? value_size_hint(*e) : 0));
+    if (Key) {
+        w.write_bulk(e->key_data(), e->key_size());
+    }
+    if (Value && !write_value(w, *e)) {
+        w.write(msg_type_err);
+    }
+    return make_reply(w.finish());
 }
 
 template<bool Key, bool Value>
-static future<scattered_message_ptr> build(const std::vector<const dict_entry*>& entries)
+static future<scattered_message_ptr> build(const std::vector<dict_entry_view>& entries)
 {
-    if (!entries.empty()) {
-        //build reply
-        auto m = make_lw_shared<scattered_message<char>>();
-        m->append_static(msg_sigle_tag);
-        if (Key && Value) {
-           m->append(std::move(to_sstring(entries.size() * 2)));
+    if (entries.empty()) {
+        return reply_builder::build(msg_nil);
+    }
+    size_t hint = 16;
+    for (const auto& e : entries) {
+        if (e) {
+            hint += (Key ? reply_writer::bulk_size(e.key_size()) : 0) + (Value ? value_size_hint(e) : 0);
         }
-        else {
-           m->append(std::move(to_sstring(entries.size())));
+    }
+    reply_writer w(hint);
+    w.write_array_header(Key && Value ? entries.size() * 2 : entries.size());
+    for (const auto& e : entries) {
+        if (Key) {
+            if (e) {
+                w.write_bulk(e.key_data(), e.key_size());
+            }
+            else {
+                w.write(msg_not_found);
+            }
         }
-        m->append_static(msg_crlf);
-        for (size_t i = 0; i < entries.size(); ++i) {
-            const auto e = entries[i];
-            if (Key) {
-                if (e) {
-                    m->append_static(msg_batch_tag);
-                    m->append(to_sstring(e->key_size()));
-                    m->append_static(msg_crlf);
-                    m->append(sstring{e->key_data(), e->key_size()});
-                    m->append_static(msg_crlf);
-                }
-                else {
-                    m->append_static(msg_not_found);
-                }
+        if (Value) {
+            if (!e) {
+                w.write(msg_not_found);
             }
-            if (Value) {
-                if (e) {
-                    m->append_static(msg_batch_tag);
-                    if (e->type_of_integer()) {
-                        auto&& n = to_sstring(e->value_integer());
-                        m->append(to_sstring(n.size()));
-                        m->append_static(msg_crlf);
-                        m->append(n);
-                        m->append_static(msg_crlf);
-                    }
-                    else if (e->type_of_float()) {
-                        auto&& n = to_sstring(e->value_float());
-                        m->append(to_sstring(n.size()));
-                        m->append_static(msg_crlf);
-                        m->append(n);
-                        m->append_static(msg_crlf);
-                    }
-                    else if (e->type_of_bytes()) {
-                        m->append(to_sstring(e->value_bytes_size()));
-                        m->append_static(msg_crlf);
-                        m->append(sstring{e->value_bytes_data(), e->value_bytes_size()});
-                        m->append_static(msg_crlf);
-                    }
-                    else {
-                        m->append_static(msg_type_err);
-                    }
-                }
-                else {
-                    m->append_static(msg_not_found);
-                }
+            else if (!write_value(w, e)) {
+                w.write(msg_type_err);
             }
         }
-        return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
-    }
-    else {
-        return reply_builder::build(msg_nil);
     }
+    return make_reply(w.finish());
 }
 
 static  future<> build_local(output_stream<char>& out, std::vector<foreign_ptr<lw_shared_ptr<sstring>>>& entries)
 {
-    if (!entries.empty()) {
-        auto m = make_lw_shared<scattered_message<char>>();
-        m->append_static(msg_sigle_tag);
-        m->append(std::move(to_sstring(entries.size())));
-        m->append_static(msg_crlf);
-        for (size_t i = 0; i < entries.size(); ++i) {
-            auto& e = entries[i];
-            m->append_static(msg_batch_tag);
-            m->append(to_sstring(e->size()));
-            m->append_static(msg_crlf);
-            m->append(*e);
-            m->append_static(msg_crlf);
-        }
-        return out.write(std::move(*m));
-    }
-    else {
+    if (entries.empty()) {
         return out.write(msg_nil);
     }
+    size_t hint = 16;
+    for (auto& e : entries) {
+        hint += reply_writer::bulk_size(e->size());
+    }
+    reply_writer w(hint);
+    w.write_array_header(entries.size());
+    for (auto& e : entries) {
+        w.write_bulk(*e);
+    }
+    return out.write(std::move(*w.finish()));
 }
 
-static  future<> build_local(output_stream<char>& out, const std::vector<sstring>& entries)
+// Replies a multi bulk in which the missing entries are nil.
+static  future<> build_local(output_stream<char>& out, const std::vector<const sstring*>& entries)
 {
-    if (!entries.empty()) {
-        auto m = make_lw_shared<scattered_message<char>>();
-        m->append_static(msg_sigle_tag);
-        m->append(std::move(to_sstring(entries.size())));
-        m->append_static(msg_crlf);
-        for (size_t i = 0; i < entries.size(); ++i) {
-            const auto e = entries[i];
-            m->append_static(msg_batch_tag);
-            m->append(to_sstring(e.size()));
-            m->append_static(msg_crlf);
-            m->append(e);
-            m->append_static(msg_crlf);
+    size_t hint = 16;
+    for (auto e : entries) {
+        hint += e ? reply_writer::bulk_size(e->size()) : msg_null_blik.size();
+    }
+    reply_writer w(hint);
+    w.write_array_header(entries.size());
+    for (auto e : entries) {
+        if (e == nullptr) {
+            w.write(msg_null_blik);
+        }
+        else {
+            w.write_bulk(*e);
         }
-        return out.write(std::move(*m));
     }
-    else {
+    return out.write(std::move(*w.finish()));
+}
+
+static  future<> build_local(output_stream<char>& out, const std::vector<sstring>& entries)
+{
+    if (entries.empty()) {
         return out.write(msg_nil);
     }
+    size_t hint = 16;
+    for (auto& e : entries) {
+        hint += reply_writer::bulk_size(e.size());
+    }
+    reply_writer w(hint);
+    w.write_array_header(entries.size());
+    for (auto& e : entries) {
+        w.write_bulk(e);
+    }
+    return out.write(std::move(*w.finish()));
 }
 
 template<bool Key, bool Value>
-static future<scattered_message_ptr> build(const dict_entry* e)
+static future<scattered_message_ptr> build(const dict_entry_view* e)
 {
-    if (e) {
-        //build reply
-        auto m = make_lw_shared<scattered_message<char>>();
-        if (Key) {
-            m->append(msg_batch_tag);
-            m->append(to_sstring(e->key_size()));
-            m->append_static(msg_crlf);
-            m->append(sstring{e->key_data(), e->key_size()});
-            m->append_static(msg_crlf);
-        }
-        if (Value) {
-            if (e->type_of_integer()) {
-               auto&& n = to_sstring(e->value_integer());
-               m->append(to_sstring(n.size()));
-               m->append_static(msg_crlf);
-               m->append(n);
-               m->append_static(msg_crlf);
-            }
-            else if (e->type_of_float()) {
-               auto&& n = to_sstring(e->value_float());
-               m->append(to_sstring(n.size()));
-               m->append_static(msg_crlf);
-               m->append(n);
-               m->append_static(msg_crlf);
-            }
-            else if (e->type_of_bytes()) {
-                m->append_static(msg_batch_tag);
-                m->append(to_sstring(e->value_bytes_size()));
-                m->append_static(msg_crlf);
-                m->append(sstring{e->value_bytes_data(), e->value_bytes_size()});
-                m->append_static(msg_crlf);
-            }
-            else {
-               m->append_static(msg_type_err);
-            }
-            return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
-        }
-        return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
-    }
-    else {
+    if (!e) {
         return reply_builder::build(msg_nil);
     }
+    reply_writer w((Key ? reply_writer::bulk_size(e->key_size()) : 0) + (Value ? value_size_hint(*e) : 0));
+    if (Key) {
+        w.write_bulk(e->key_data(), e->key_size());
+    }
+    if (Value && !write_value(w, *e)) {
+        w.write(msg_type_err);
+    }
+    return make_reply(w.finish());
 }
 
 static future<scattered_message_ptr> build(const std::vector<const managed_bytes*>& data)
 {
-    auto m = make_lw_shared<scattered_message<char>>();
-    m->append(msg_sigle_tag);
-    m->append(to_sstring(data.size()));
-    m->append_static(msg_crlf);
-    for (size_t i = 0; i < data.size(); ++i) {
-        m->append_static(msg_batch_tag);
-        m->append(to_sstring(data[i]->size()));
-        m->append_static(msg_crlf);
-        m->append(sstring{reinterpret_cast<const char*>(data[i]->data()), data[i]->size()});
-        m->append_static(msg_crlf);
+    size_t hint = 16;
+    for (auto d : data) {
+        hint += reply_writer::bulk_size(d->size());
     }
-    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+    reply_writer w(hint);
+    w.write_array_header(data.size());
+    for (auto d : data) {
+        w.write_bulk(reinterpret_cast<const char*>(d->data()), d->size());
+    }
+    return make_reply(w.finish());
+}
+
+static future<scattered_message_ptr> build(const std::vector<bytes_view>& data)
+{
+    size_t hint = 16;
+    for (auto& d : data) {
+        hint += reply_writer::bulk_size(d.size());
+    }
+    reply_writer w(hint);
+    w.write_array_header(data.size());
+    for (auto& d : data) {
+        w.write_bulk(reinterpret_cast<const char*>(d.data()), d.size());
+    }
+    return make_reply(w.finish());
+}
+
+static future<scattered_message_ptr> build(bytes_view data)
+{
+    reply_writer w(reply_writer::bulk_size(data.size()));
+    w.write_bulk(reinterpret_cast<const char*>(data.data()), data.size());
+    return make_reply(w.finish());
 }
 
 static future<scattered_message_ptr> build(const managed_bytes& data)
 {
-    auto m = make_lw_shared<scattered_message<char>>();
-    m->append_static(msg_batch_tag);
-    m->append(to_sstring(data.size()));
-    m->append_static(msg_crlf);
-    m->append(sstring{reinterpret_cast<const char*>(data.data()), data.size()});
-    m->append_static(msg_crlf);
-    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+    reply_writer w(reply_writer::bulk_size(data.size()));
+    w.write_bulk(reinterpret_cast<const char*>(data.data()), data.size());
+    return make_reply(w.finish());
 }
 
 static future<> build_local(output_stream<char>& out, std::unordered_map<sstring, double>& data, bool with_score)
 {
-    auto m = make_lw_shared<scattered_message<char>>();
-    m->append_static(msg_sigle_tag);
-    if (with_score) {
-        m->append(std::move(to_sstring(data.size() * 2)));
-    }
-    else {
-        m->append(std::move(to_sstring(data.size())));
+    size_t hint = 16;
+    for (auto& d : data) {
+        hint += reply_writer::bulk_size(d.first.size()) + (with_score ? 32 : 0);
     }
-    m->append_static(msg_crlf);
+    reply_writer w(hint);
+    w.write_array_header(with_score ? data.size() * 2 : data.size());
     for (auto& d : data) {
-        m->append_static(msg_batch_tag);
-        m->append(to_sstring(d.first.size()));
-        m->append_static(msg_crlf);
-        m->append(std::move(d.first));
-        m->append_static(msg_crlf);
+        w.write_bulk(d.first);
         if (with_score) {
-            m->append_static(msg_batch_tag);
-            auto&& n = to_sstring(d.second);
-            m->append(to_sstring(n.size()));
-            m->append_static(msg_crlf);
-            m->append(n);
-            m->append_static(msg_crlf);
+            w.write_bulk(d.second);
         }
     }
-    return out.write(std::move(*m));
+    return out.write(std::move(*w.finish()));
 }
 
 static future<scattered_message_ptr> build(const std::vector<const sset_entry*>& entries, bool with_score)
 {
-    if (!entries.empty()) {
-        //build reply
-        auto m = make_lw_shared<scattered_message<char>>();
-        m->append_static(msg_sigle_tag);
+    if (entries.empty()) {
+        return reply_builder::build(msg_nil);
+    }
+    size_t hint = 16;
+    for (auto e : entries) {
+        assert(e != nullptr);
+        hint += reply_writer::bulk_size(e->key_size()) + (with_score ? 32 : 0);
+    }
+    reply_writer w(hint);
+    w.write_array_header(with_score ? entries.size() * 2 : entries.size());
+    for (auto e : entries) {
+        w.write_bulk(e->key_data(), e->key_size());
         if (with_score) {
-            m->append(std::move(to_sstring(entries.size() * 2)));
-        }
-        else {
-            m->append(std::move(to_sstring(entries.size())));
+            w.write_bulk(e->score());
         }
-        m->append_static(msg_crlf);
-        for (size_t i = 0; i < entries.size(); ++i) {
-            const auto& e = entries[i];
-            assert(e != nullptr);
-            m->append_static(msg_batch_tag);
-            m->append(to_sstring(e->key_size()));
-            m->append_static(msg_crlf);
-            m->append(sstring{e->key_data(), e->key_size()});
-            m->append_static(msg_crlf);
-            if (with_score) {
-                m->append_static(msg_batch_tag);
-                auto&& n = to_sstring(e->score());
-                m->append(to_sstring(n.size()));
-                m->append_static(msg_crlf);
-                m->append(n);
-                m->append_static(msg_crlf);
-            }
+    }
+    return make_reply(w.finish());
+}
+
+// The replies of the cursor commands: the cursor of the next call, then the entries.
+template<bool Value>
+static future<scattered_message_ptr> build_scan(uint64_t cursor, const std::vector<dict_entry_view>& entries)
+{
+    size_t hint = 48;
+    for (const auto& e : entries) {
+        hint += reply_writer::bulk_size(e.key_size()) + (Value ? value_size_hint(e) : 0);
+    }
+    reply_writer w(hint);
+    w.write_array_header(2);
+    w.write_bulk(to_sstring(cursor));
+    w.write_array_header(Value ? entries.size() * 2 : entries.size());
+    for (const auto& e : entries) {
+        w.write_bulk(e.key_data(), e.key_size());
+        if (Value && !write_value(w, e)) {
+            w.write(msg_type_err);
         }
-        return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
     }
-    else {
-        return reply_builder::build(msg_nil);
+    return make_reply(w.finish());
+}
+
+static future<scattered_message_ptr> build_scan(uint64_t cursor, const std::vector<const sset_entry*>& entries)
+{
+    size_t hint = 48;
+    for (auto e : entries) {
+        hint += reply_writer::bulk_size(e->key_size()) + 32;
+    }
+    reply_writer w(hint);
+    w.write_array_header(2);
+    w.write_bulk(to_sstring(cursor));
+    w.write_array_header(entries.size() * 2);
+    for (auto e : entries) {
+        w.write_bulk(e->key_data(), e->key_size());
+        w.write_bulk(e->score());
+    }
+    return make_reply(w.finish());
+}
+
+static future<> build_local_scan(output_stream<char>& out, uint64_t cursor, const std::vector<sstring>& keys)
+{
+    size_t hint = 48;
+    for (auto& k : keys) {
+        hint += reply_writer::bulk_size(k.size());
+    }
+    reply_writer w(hint);
+    w.write_array_header(2);
+    w.write_bulk(to_sstring(cursor));
+    w.write_array_header(keys.size());
+    for (auto& k : keys) {
+        w.write_bulk(k);
     }
+    return out.write(std::move(*w.finish()));
 }
 
 static future<scattered_message_ptr> build(std::vector<sstring>& data)
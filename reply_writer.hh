@@ -0,0 +1,251 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/shared_ptr.hh"
+#include "core/scattered_message.hh"
+#include "core/sstring.hh"
+#include "core/temporary_buffer.hh"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace redis {
+
+// The number of decimal digits of v.
+inline size_t uint_digits(uint64_t v)
+{
+    size_t n = 1;
+    for (;;) {
+        if (v < 10) return n;
+        if (v < 100) return n + 1;
+        if (v < 1000) return n + 2;
+        if (v < 10000) return n + 3;
+        v /= 10000;
+        n += 4;
+    }
+}
+
+// Formats v two digits at a time, returns the end of the digits.
+inline char* format_uint(char* out, uint64_t v)
+{
+    static constexpr char pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    auto end = out + uint_digits(v);
+    auto p = end;
+    while (v >= 100) {
+        auto i = (v % 100) * 2;
+        v /= 100;
+        *--p = pairs[i + 1];
+        *--p = pairs[i];
+    }
+    if (v >= 10) {
+        *--p = pairs[v * 2 + 1];
+        *--p = pairs[v * 2];
+    }
+    else {
+        *--p = '0' + v;
+    }
+    return end;
+}
+
+inline char* format_int(char* out, int64_t v)
+{
+    if (v < 0) {
+        *out++ = '-';
+        return format_uint(out, uint64_t(0) - uint64_t(v));
+    }
+    return format_uint(out, uint64_t(v));
+}
+
+// The integer replies of small numbers, formatted once. They never change, so the
+// replies built on any shard refer to them without copying.
+class preformatted_integers {
+    static constexpr int64_t count = 10000;
+    std::vector<char> _data;
+    std::vector<uint32_t> _offsets;
+
+    preformatted_integers()
+    {
+        _offsets.reserve(count + 1);
+        char buf[32];
+        for (int64_t i = 0; i < count; ++i) {
+            _offsets.push_back(_data.size());
+            buf[0] = ':';
+            auto end = format_uint(buf + 1, i);
+            *end++ = '\r';
+            *end++ = '\n';
+            _data.insert(_data.end(), buf, end);
+        }
+        _offsets.push_back(_data.size());
+    }
+public:
+    static const preformatted_integers& get()
+    {
+        static const preformatted_integers integers;
+        return integers;
+    }
+
+    // Returns false if the reply of v is not preformatted.
+    bool find(int64_t v, const char*& data, size_t& size) const
+    {
+        if (v < 0 || v >= count) {
+            return false;
+        }
+        data = _data.data() + _offsets[v];
+        size = _offsets[v + 1] - _offsets[v];
+        return true;
+    }
+};
+
+// Serializes a reply into a few contiguous chunks instead of one fragment per
+// header and value: a bulk string is formatted with its header in one step and
+// its value is copied exactly once, from the cache into the chunk.
+//
+// The first chunk has the size hint, so a reply whose size is known up front
+// takes a single allocation; the following chunks have chunk_size, or the size
+// of a larger bulk string.
+class reply_writer {
+    static constexpr size_t chunk_size = 4096;
+    lw_shared_ptr<scattered_message<char>> _message;
+    temporary_buffer<char> _chunk;
+    size_t _used = 0;
+    size_t _next_chunk;
+
+    char* reserve(size_t size)
+    {
+        if (_chunk.size() - _used < size) {
+            flush_chunk();
+            _chunk = temporary_buffer<char>(std::max(size, _next_chunk));
+            _next_chunk = chunk_size;
+        }
+        auto p = _chunk.get_write() + _used;
+        _used += size;
+        return p;
+    }
+
+    void flush_chunk()
+    {
+        if (_used == 0) {
+            return;
+        }
+        _message->append_static(_chunk.get(), _used);
+        _message->on_delete([chunk = std::move(_chunk)] {});
+        _chunk = temporary_buffer<char>();
+        _used = 0;
+    }
+
+    static char* crlf(char* p)
+    {
+        *p++ = '\r';
+        *p++ = '\n';
+        return p;
+    }
+
+    void write_header(char tag, uint64_t n)
+    {
+        auto p = reserve(1 + uint_digits(n) + 2);
+        *p++ = tag;
+        crlf(format_uint(p, n));
+    }
+public:
+    explicit reply_writer(size_t size_hint = 0)
+        : _message(make_lw_shared<scattered_message<char>>())
+        , _next_chunk(size_hint ? size_hint : chunk_size)
+    {
+    }
+
+    // The size of a bulk string reply.
+    static size_t bulk_size(size_t size)
+    {
+        return 1 + uint_digits(size) + 2 + size + 2;
+    }
+
+    void write(const char* data, size_t size)
+    {
+        std::copy_n(data, size, reserve(size));
+    }
+
+    void write(const sstring& s)
+    {
+        write(s.data(), s.size());
+    }
+
+    void write_integer(int64_t v)
+    {
+        char buf[24];
+        buf[0] = ':';
+        auto end = crlf(format_int(buf + 1, v));
+        write(buf, end - buf);
+    }
+
+    void write_array_header(size_t count)
+    {
+        write_header('*', count);
+    }
+
+    void write_bulk(const char* data, size_t size)
+    {
+        auto p = reserve(bulk_size(size));
+        *p++ = '$';
+        p = crlf(format_uint(p, size));
+        p = std::copy_n(data, size, p);
+        crlf(p);
+    }
+
+    // Writes a bulk string of size bytes, which fill writes in place.
+    template <typename Func>
+    void write_bulk(size_t size, Func&& fill)
+    {
+        auto p = reserve(bulk_size(size));
+        *p++ = '$';
+        p = crlf(format_uint(p, size));
+        fill(p);
+        crlf(p + size);
+    }
+
+    void write_bulk(const sstring& s)
+    {
+        write_bulk(s.data(), s.size());
+    }
+
+    void write_bulk(int64_t v)
+    {
+        char buf[24];
+        auto end = format_int(buf, v);
+        write_bulk(buf, end - buf);
+    }
+
+    void write_bulk(double v)
+    {
+        auto n = to_sstring(v);
+        write_bulk(n.data(), n.size());
+    }
+
+    // Moves the written chunks into the reply, a writer builds one reply.
+    lw_shared_ptr<scattered_message<char>> finish()
+    {
+        flush_chunk();
+        return std::move(_message);
+    }
+};
+}
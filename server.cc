@@ -31,11 +31,20 @@ void server::setup_metrics()
         sm::make_counter("current_total", [this] { return _stats._connections_current; }, sm::description("Total number of connections current opened.")),
     });
 
+    _latency_tracer.export_command_metrics();
     _metrics.add_group("reqests", {
         sm::make_counter("served_total", [this] { return _latency_tracer.served(); }, sm::description("Total number of served requests.")),
         sm::make_counter("serving_total", [this] { return _latency_tracer.serving(); }, sm::description("Total number of requests being serving.")),
         sm::make_counter("exception_total", [this] { return _latency_tracer.number_exceptions(); }, sm::description("Total number of bad requests.")),
-        sm::make_gauge("latency", [this] { return _latency_tracer.latency(); }, sm::description("Request latency (us).")),
+        sm::make_gauge("latency", [this] { return _latency_tracer.latency(); }, sm::description("Mean request latency (us).")),
+        sm::make_gauge("latency_p99", [this] { return _latency_tracer.latency_histogram().quantile(0.99) / 1000.0; }, sm::description("99th percentile of the request latency (us).")),
+        sm::make_gauge("latency_p999", [this] { return _latency_tracer.latency_histogram().quantile(0.999) / 1000.0; }, sm::description("99.9th percentile of the request latency (us).")),
+        sm::make_histogram("latency_histogram", sm::description("Request latency (us), from the dispatch until the reply is written."), [this] { return _latency_tracer.latency_histogram().to_metrics(); }),
+        sm::make_histogram("parse_latency", sm::description("Time to parse a request (us)."), [this] { return _latency_tracer.parse_histogram().to_metrics(); }),
+        sm::make_histogram("write_latency", sm::description("Time to flush the replies of the requests received together (us)."), [this] { return _latency_tracer.write_histogram().to_metrics(); }),
+        sm::make_counter("args_bytes_total", [this] { return _latency_tracer.args_bytes(); }, sm::description("Total number of bytes of the parsed arguments.")),
+        sm::make_counter("args_copied_bytes_total", [this] { return _latency_tracer.args_copied_bytes(); }, sm::description("Total number of argument bytes copied before they reached the cache.")),
+        sm::make_gauge("args_copied_bytes_per_request", [this] { return _latency_tracer.copied_bytes_per_request(); }, sm::description("Argument bytes copied per request, on average.")),
     });
 }
 }
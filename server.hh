@@ -26,6 +26,7 @@
 #include "core/metrics_registration.hh"
 #include "core/thread.hh"
 #include "core/gate.hh"
+#include <arpa/inet.h>
 namespace redis {
 
 class server;
@@ -62,6 +63,11 @@ private:
     stats _stats;
     request_latency_tracer _latency_tracer;
     seastar::gate _request_gate;
+    static sstring client_address(const socket_address& addr) {
+        char ip[INET_ADDRSTRLEN];
+        ::inet_ntop(AF_INET, &addr.u.in.sin_addr, ip, sizeof(ip));
+        return sprint("%s:%d", ip, ntohs(addr.u.in.sin_port));
+    }
 public:
     server(uint16_t port = 6379)
         : _port(port)
@@ -79,10 +85,14 @@ public:
                    ++_stats._connections_total;
                    ++_stats._connections_current;
                    auto conn = make_lw_shared<connection>(std::move(fd), addr);
+                   conn->_proto.set_client(client_address(addr));
                    do_until([conn] { return conn->_in.eof(); }, [this, conn] {
                        return with_gate(_request_gate, [this, conn] {
                            return conn->_proto.handle(conn->_in, conn->_out, _latency_tracer).then([this, conn] {
-                               return conn->_out.flush();
+                               auto start = steady_clock_type::now();
+                               return conn->_out.flush().then([this, start] {
+                                   _latency_tracer.trace_write(steady_clock_type::now() - start);
+                               });
                            });
                        });
                    }).finally([this, conn] {
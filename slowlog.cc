@@ -0,0 +1,165 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "slowlog.hh"
+#include <algorithm>
+#include <iterator>
+
+namespace redis {
+
+static const auto stall_check_period = std::chrono::milliseconds(10);
+
+static uint64_t unix_seconds()
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void slowlog::add(steady_clock_type::duration d, const sstring& client, const char* command, const std::vector<temporary_buffer<char>>& args)
+{
+    if (_max_len == 0) {
+        return;
+    }
+    slowlog_entry e;
+    e._id = _next_id++ * smp::count + engine().cpu_id();
+    e._timestamp = unix_seconds();
+    e._duration_us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    e._shard = engine().cpu_id();
+    e._client = client;
+    // as Redis, the last kept argument tells how many more there were.
+    size_t argc = args.size() + 1;
+    size_t kept = std::min(argc, size_t(max_args));
+    e._args.reserve(kept);
+    e._args.emplace_back(command);
+    for (size_t i = 1; i < kept; ++i) {
+        if (kept != argc && i == kept - 1) {
+            e._args.emplace_back(sprint("... (%d more arguments)", argc - kept + 1));
+            break;
+        }
+        auto& arg = args[i - 1];
+        if (arg.size() > max_arg_size) {
+            e._args.emplace_back(sstring(arg.get(), max_arg_size) + sprint("... (%d more bytes)", arg.size() - max_arg_size));
+        }
+        else {
+            e._args.emplace_back(arg.get(), arg.size());
+        }
+    }
+    _entries.push_front(std::move(e));
+    if (_entries.size() > _max_len) {
+        _entries.pop_back();
+    }
+}
+
+std::vector<slowlog_entry> slowlog::merge(std::vector<std::vector<slowlog_entry>>&& logs, size_t count)
+{
+    std::vector<slowlog_entry> merged;
+    for (auto& log : logs) {
+        std::move(log.begin(), log.end(), std::back_inserter(merged));
+    }
+    std::sort(merged.begin(), merged.end(), [] (const slowlog_entry& a, const slowlog_entry& b) {
+        return a._timestamp != b._timestamp ? a._timestamp > b._timestamp : a._id > b._id;
+    });
+    if (merged.size() > count) {
+        merged.resize(count);
+    }
+    return merged;
+}
+
+latency_monitor::latency_monitor(uint32_t threshold_ms)
+    : _threshold(threshold_ms)
+{
+    if (enabled()) {
+        _stall_timer.set_callback([this] { check_stall(); });
+        _expected = steady_clock_type::now() + stall_check_period;
+        _stall_timer.arm_periodic(stall_check_period);
+    }
+}
+
+void latency_monitor::check_stall()
+{
+    auto now = steady_clock_type::now();
+    record("event-loop", now - _expected);
+    _expected = now + stall_check_period;
+}
+
+void latency_monitor::record(const char* event, steady_clock_type::duration d)
+{
+    if (!enabled() || d < _threshold) {
+        return;
+    }
+    uint64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+    auto now = unix_seconds();
+    auto& history = _events[event];
+    if (!history._samples.empty() && history._samples.back()._time == now) {
+        history._samples.back()._latency_ms = std::max(history._samples.back()._latency_ms, ms);
+    }
+    else {
+        history._samples.push_back(sample { now, ms });
+        if (history._samples.size() > history_len) {
+            history._samples.pop_front();
+        }
+    }
+    history._max_ms = std::max(history._max_ms, ms);
+}
+
+std::vector<sstring> latency_monitor::reset(const std::vector<sstring>& events)
+{
+    std::vector<sstring> reset;
+    if (events.empty()) {
+        for (auto& e : _events) {
+            reset.push_back(e.first);
+        }
+        _events.clear();
+        return reset;
+    }
+    for (auto& event : events) {
+        if (_events.erase(event)) {
+            reset.push_back(event);
+        }
+    }
+    return reset;
+}
+
+latency_monitor::events_type latency_monitor::merge(std::vector<events_type>&& shards)
+{
+    events_type merged;
+    for (auto& events : shards) {
+        for (auto& e : events) {
+            auto& into = merged[e.first];
+            into._max_ms = std::max(into._max_ms, e.second._max_ms);
+            std::deque<sample> samples;
+            std::merge(into._samples.begin(), into._samples.end(), e.second._samples.begin(), e.second._samples.end(),
+                std::back_inserter(samples), [] (const sample& a, const sample& b) { return a._time < b._time; });
+            into._samples.clear();
+            for (auto& s : samples) {
+                if (!into._samples.empty() && into._samples.back()._time == s._time) {
+                    into._samples.back()._latency_ms = std::max(into._samples.back()._latency_ms, s._latency_ms);
+                }
+                else {
+                    into._samples.push_back(s);
+                }
+            }
+            while (into._samples.size() > history_len) {
+                into._samples.pop_front();
+            }
+        }
+    }
+    return merged;
+}
+}
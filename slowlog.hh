@@ -0,0 +1,115 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/reactor.hh"
+#include "core/sstring.hh"
+#include "core/temporary_buffer.hh"
+#include "core/timer.hh"
+#include <chrono>
+#include <deque>
+#include <map>
+#include <vector>
+
+namespace redis {
+
+// A command which ran longer than the slowlog threshold.
+struct slowlog_entry {
+    // unique across the shards, and increasing on every shard.
+    uint64_t _id;
+    // unix time in seconds.
+    uint64_t _timestamp;
+    uint64_t _duration_us;
+    unsigned _shard;
+    sstring _client;
+    // the command and its arguments, truncated as Redis does.
+    std::vector<sstring> _args;
+};
+
+// The slow commands of a shard, newest first, at most max_len of them. SLOWLOG
+// merges the logs of all shards.
+class slowlog {
+public:
+    static constexpr size_t max_args = 32;
+    static constexpr size_t max_arg_size = 128;
+private:
+    int64_t _threshold_us;
+    size_t _max_len;
+    uint64_t _next_id = 0;
+    std::deque<slowlog_entry> _entries;
+public:
+    // a negative threshold disables the log, 0 logs every command.
+    slowlog(int64_t threshold_us, size_t max_len) : _threshold_us(threshold_us), _max_len(max_len) {}
+
+    inline bool slow(steady_clock_type::duration d) const {
+        return _threshold_us >= 0 && std::chrono::duration_cast<std::chrono::microseconds>(d).count() >= _threshold_us;
+    }
+    void add(steady_clock_type::duration d, const sstring& client, const char* command, const std::vector<temporary_buffer<char>>& args);
+
+    inline const std::deque<slowlog_entry>& entries() const { return _entries; }
+    inline size_t size() const { return _entries.size(); }
+    inline void reset() { _entries.clear(); }
+
+    // Merges the logs of the shards into the count newest entries.
+    static std::vector<slowlog_entry> merge(std::vector<std::vector<slowlog_entry>>&& logs, size_t count);
+};
+
+// The latency spikes of a shard by event, as LATENCY LATEST and LATENCY HISTORY
+// report them: the largest spike, and the spikes of the last history_len seconds
+// in which one happened, the largest of every second.
+//
+// The events are "command", "rehash" and "expire-cycle", recorded when they take
+// at least the threshold, and "event-loop": a timer which should fire every 10ms
+// checks how late it fires, which is how long the reactor was stalled.
+class latency_monitor {
+public:
+    static constexpr size_t history_len = 160;
+    struct sample {
+        // unix time in seconds.
+        uint64_t _time;
+        uint64_t _latency_ms;
+    };
+    struct event_history {
+        std::deque<sample> _samples;
+        uint64_t _max_ms = 0;
+    };
+    using events_type = std::map<sstring, event_history>;
+private:
+    std::chrono::milliseconds _threshold;
+    events_type _events;
+    timer<> _stall_timer;
+    steady_clock_type::time_point _expected;
+
+    void check_stall();
+public:
+    // a threshold of 0 disables the monitor.
+    explicit latency_monitor(uint32_t threshold_ms);
+
+    inline bool enabled() const { return _threshold.count() > 0; }
+    void record(const char* event, steady_clock_type::duration d);
+
+    inline const events_type& events() const { return _events; }
+    // Resets the events, all of them if none is given, and returns the ones which were reset.
+    std::vector<sstring> reset(const std::vector<sstring>& events);
+
+    // Merges the events of the shards, a second keeps its largest spike.
+    static events_type merge(std::vector<events_type>&& shards);
+};
+}
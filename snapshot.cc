@@ -0,0 +1,602 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "snapshot.hh"
+#include "cache.hh"
+#include "config.hh"
+#include "db.hh"
+#include "key_hash.hh"
+#include "core/byteorder.hh"
+#include "core/reactor.hh"
+#include "core/metrics.hh"
+#include "utils/crc.hh"
+#include "util/log.hh"
+#include <boost/algorithm/string/replace.hpp>
+#include <boost/range/irange.hpp>
+#include <sstream>
+
+namespace redis {
+
+using logger = seastar::logger;
+static logger slog("snapshot");
+
+distributed<snapshot_manager> _the_snapshot_manager;
+
+namespace {
+// the magic and the le32 format version.
+const char snapshot_header[12] = { 'P', 'E', 'D', 'I', 'S', 'S', 'N', 'P', 1, 0, 0, 0 };
+const char snapshot_end[snapshot_writer::block_header_size] = {};
+const int64_t never_expires = -1;
+
+uint32_t checksum(const char* data, size_t size)
+{
+    utils::crc32 c;
+    c.process(reinterpret_cast<const uint8_t*>(data), size);
+    return c.get();
+}
+
+void write_le32(char* p, uint32_t v)
+{
+    v = cpu_to_le(v);
+    std::memcpy(p, &v, sizeof(v));
+}
+
+uint32_t read_le32(const char* p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return le_to_cpu(v);
+}
+
+sstring expand_home(const sstring& path)
+{
+    auto home = std::getenv("REDIS_HOME");
+    auto expanded = boost::replace_all_copy(std::string(path), "${REDIS_HOME}", home ? home : ".");
+    return sstring(expanded.data(), expanded.size());
+}
+}
+
+snapshot_writer::snapshot_writer(output_stream<char>&& out)
+    : _out(std::move(out))
+{
+    start_block();
+}
+
+void snapshot_writer::start_block()
+{
+    _block.clear();
+    _block.resize(block_header_size);
+}
+
+void snapshot_writer::put_u8(uint8_t v)
+{
+    _block.push_back(static_cast<char>(v));
+}
+
+void snapshot_writer::put_u32(uint32_t v)
+{
+    v = cpu_to_le(v);
+    auto p = reinterpret_cast<const char*>(&v);
+    _block.insert(_block.end(), p, p + sizeof(v));
+}
+
+void snapshot_writer::put_u64(uint64_t v)
+{
+    v = cpu_to_le(v);
+    auto p = reinterpret_cast<const char*>(&v);
+    _block.insert(_block.end(), p, p + sizeof(v));
+}
+
+void snapshot_writer::put_double(double v)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &v, sizeof(bits));
+    put_u64(bits);
+}
+
+void snapshot_writer::put_bytes(const char* data, size_t size)
+{
+    put_u32(static_cast<uint32_t>(size));
+    _block.insert(_block.end(), data, data + size);
+}
+
+void snapshot_writer::write(const cache_entry& e)
+{
+    int64_t expire_at = never_expires;
+    if (e.ever_expires()) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(e.get_timeout() - clock_type::now()).count();
+        if (left <= 0) {
+            return;
+        }
+        expire_at = unix_time_ms() + left;
+    }
+    auto start = _block.size();
+    put_u32(0);
+    put_u8(static_cast<uint8_t>(e.type()));
+    put_bytes(e.key_data(), e.key_size());
+    put_u64(static_cast<uint64_t>(expire_at));
+    switch (e.type()) {
+        case entry_type::ENTRY_FLOAT:
+            put_double(e.value_float());
+            break;
+        case entry_type::ENTRY_INT64:
+            put_u64(static_cast<uint64_t>(e.value_integer()));
+            break;
+        case entry_type::ENTRY_BYTES:
+        case entry_type::ENTRY_HLL:
+            put_bytes(e.value_bytes_data(), e.value_bytes_size());
+            break;
+        case entry_type::ENTRY_LIST: {
+            auto& list = e.value_list();
+            std::vector<bytes_view> elements;
+            list.range(0, list.size(), elements);
+            put_u32(static_cast<uint32_t>(elements.size()));
+            for (auto& v : elements) {
+                put_bytes(reinterpret_cast<const char*>(v.data()), v.size());
+            }
+            break;
+        }
+        case entry_type::ENTRY_MAP:
+        case entry_type::ENTRY_SET: {
+            std::vector<dict_entry_view> fields;
+            e.value_map().fetch(fields);
+            put_u32(static_cast<uint32_t>(fields.size()));
+            for (auto& f : fields) {
+                put_bytes(f.key_data(), f.key_size());
+                if (e.type() == entry_type::ENTRY_SET) {
+                    continue;
+                }
+                put_u8(static_cast<uint8_t>(f.type()));
+                if (f.type_of_bytes()) {
+                    put_bytes(f.value_bytes_data(), f.value_bytes_size());
+                }
+                else if (f.type_of_float()) {
+                    put_double(f.value_float());
+                }
+                else {
+                    put_u64(static_cast<uint64_t>(f.value_integer()));
+                }
+            }
+            break;
+        }
+        case entry_type::ENTRY_BITMAP: {
+            std::vector<char> encoded;
+            e.value_bitmap().serialize(encoded);
+            put_bytes(encoded.data(), encoded.size());
+            break;
+        }
+        case entry_type::ENTRY_SSET: {
+            std::vector<const sset_entry*> members;
+            e.value_sset().fetch_by_rank(0, -1, members);
+            put_u32(static_cast<uint32_t>(members.size()));
+            for (auto m : members) {
+                put_bytes(m->key_data(), m->key_size());
+                put_double(m->score());
+            }
+            break;
+        }
+    }
+    write_le32(_block.data() + start, static_cast<uint32_t>(_block.size() - start - sizeof(uint32_t)));
+    ++_entries;
+}
+
+future<> snapshot_writer::flush()
+{
+    if (_block.size() == block_header_size) {
+        return make_ready_future<>();
+    }
+    auto block = std::move(_block);
+    start_block();
+    auto size = block.size() - block_header_size;
+    write_le32(block.data(), static_cast<uint32_t>(size));
+    write_le32(block.data() + sizeof(uint32_t), checksum(block.data() + block_header_size, size));
+    _bytes += block.size();
+    auto header = make_ready_future<>();
+    if (!_started) {
+        _started = true;
+        header = _out.write(snapshot_header, sizeof(snapshot_header));
+    }
+    return header.then([this, block = std::move(block)] () mutable {
+        return do_with(std::move(block), [this] (auto& block) {
+            return _out.write(block.data(), block.size());
+        });
+    });
+}
+
+future<> snapshot_writer::close()
+{
+    return flush().then([this] {
+        if (!_started) {
+            _started = true;
+            return _out.write(snapshot_header, sizeof(snapshot_header));
+        }
+        return make_ready_future<>();
+    }).then([this] {
+        return _out.write(snapshot_end, sizeof(snapshot_end));
+    }).then([this] {
+        return _out.flush();
+    }).finally([this] {
+        return _out.close();
+    });
+}
+
+uint8_t snapshot_reader::u8()
+{
+    if (_end - _p < 1) {
+        throw std::runtime_error("truncated snapshot record");
+    }
+    return static_cast<uint8_t>(*_p++);
+}
+
+uint32_t snapshot_reader::u32()
+{
+    if (_end - _p < 4) {
+        throw std::runtime_error("truncated snapshot record");
+    }
+    auto v = read_le32(_p);
+    _p += sizeof(v);
+    return v;
+}
+
+uint64_t snapshot_reader::u64()
+{
+    if (_end - _p < 8) {
+        throw std::runtime_error("truncated snapshot record");
+    }
+    uint64_t v;
+    std::memcpy(&v, _p, sizeof(v));
+    _p += sizeof(v);
+    return le_to_cpu(v);
+}
+
+double snapshot_reader::f64()
+{
+    auto bits = u64();
+    double v;
+    std::memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+std::pair<const char*, size_t> snapshot_reader::view()
+{
+    size_t size = u32();
+    if (static_cast<size_t>(_end - _p) < size) {
+        throw std::runtime_error("truncated snapshot record");
+    }
+    auto p = _p;
+    _p += size;
+    return { p, size };
+}
+
+sstring snapshot_reader::bytes()
+{
+    auto v = view();
+    return sstring(v.first, v.second);
+}
+
+snapshot_reader snapshot_reader::record()
+{
+    auto v = view();
+    return snapshot_reader(v.first, v.second);
+}
+
+snapshot_manager::snapshot_manager(const redis::config& cfg)
+    : _directory(expand_home(cfg.data_file_directories().empty() ? sstring("${REDIS_HOME}/data") : sstring(cfg.data_file_directories().front())))
+    , _commitlog_directory(commit_log::make_config(cfg).directory)
+    , _commitlog_enabled(cfg.enable_commitlog())
+    , _period(cfg.snapshot_period_in_s())
+{
+    _timer.set_callback([this] {
+        bgsave();
+    });
+    setup_metrics();
+}
+
+void snapshot_manager::setup_metrics()
+{
+    namespace sm = seastar::metrics;
+    _metrics.add_group("snapshot", {
+        sm::make_counter("saves", [this] { return _stats._saves; }, sm::description("Total number of the completed snapshots.")),
+        sm::make_counter("failures", [this] { return _stats._failures; }, sm::description("Total number of the failed snapshots.")),
+        sm::make_gauge("last_duration_ms", [this] { return _stats._last_duration_ms; }, sm::description("Time taken by the last snapshot, in milliseconds.")),
+        sm::make_gauge("running", [this] { return _running ? 1 : 0; }, sm::description("Whether a snapshot is running.")),
+        sm::make_counter("loaded_entries", [this] { return _stats._loaded_entries; }, sm::description("Entries loaded from the snapshot at startup.")),
+    });
+}
+
+future<> snapshot_manager::start()
+{
+    if (engine().cpu_id() == 0 && _period.count() > 0) {
+        _timer.arm_periodic(_period);
+    }
+    return make_ready_future<>();
+}
+
+future<> snapshot_manager::stop()
+{
+    _timer.cancel();
+    return _gate.close();
+}
+
+sstring snapshot_manager::file_name(uint64_t id, unsigned shard)
+{
+    return sprint("snapshot-%d-%d.db", id, shard);
+}
+
+sstring snapshot_manager::manifest_name(uint64_t id)
+{
+    return sprint("snapshot-%d.manifest", id);
+}
+
+future<bool> snapshot_manager::save()
+{
+    assert(engine().cpu_id() == 0);
+    if (_running) {
+        return make_ready_future<bool>(false);
+    }
+    _running = true;
+    auto id = _next_id++;
+    auto start = std::chrono::steady_clock::now();
+    return with_gate(_gate, [this, id] {
+        return take(id);
+    }).then_wrapped([this, id, start] (auto&& f) {
+        _running = false;
+        try {
+            f.get();
+            ++_stats._saves;
+            _stats._last_duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            _last_save = static_cast<uint64_t>(unix_time_ms() / 1000);
+            slog.info("snapshot {} completed in {} ms", id, _stats._last_duration_ms);
+            return true;
+        } catch (...) {
+            ++_stats._failures;
+            slog.error("snapshot {} failed: {}", id, std::current_exception());
+            return false;
+        }
+    });
+}
+
+bool snapshot_manager::bgsave()
+{
+    if (_running) {
+        return false;
+    }
+    save();
+    return true;
+}
+
+future<> snapshot_manager::take(uint64_t id)
+{
+    return recursive_touch_directory(_directory).then([this, id] {
+        return do_with(replay_position {}, [this, id] (auto& position) {
+            position.generation = get_local_database().commitlog_generation();
+            position.first_segments.resize(smp::count);
+            return parallel_for_each(boost::irange<unsigned>(0, smp::count), [this, id, &position] (unsigned cpu) {
+                auto path = _directory + "/" + file_name(id, cpu);
+                return get_database().invoke_on(cpu, &database::snapshot, std::move(path)).then([&position, cpu] (uint64_t first_segment) {
+                    position.first_segments[cpu] = first_segment;
+                });
+            }).then([this, id, &position] {
+                return write_manifest(id, position);
+            }).then([this, id, &position] {
+                return remove_older(id).then([this, &position] {
+                    if (!_commitlog_enabled) {
+                        return make_ready_future<>();
+                    }
+                    return commit_log::discard(_commitlog_directory, position);
+                });
+            });
+        });
+    });
+}
+
+future<> snapshot_manager::write_manifest(uint64_t id, const replay_position& position)
+{
+    std::ostringstream manifest;
+    manifest << "snapshot " << id << "\n";
+    manifest << "generation " << position.generation << "\n";
+    manifest << "shards " << position.first_segments.size() << "\n";
+    for (auto segment : position.first_segments) {
+        manifest << segment << "\n";
+    }
+    auto path = _directory + "/" + manifest_name(id);
+    auto tmp = path + ".tmp";
+    return open_file_dma(tmp, open_flags::wo | open_flags::create | open_flags::truncate).then([content = manifest.str()] (file f) {
+        return do_with(make_file_output_stream(std::move(f)), std::move(content), [] (auto& out, auto& content) {
+            return out.write(content.data(), content.size()).then([&out] {
+                return out.flush();
+            }).finally([&out] {
+                return out.close();
+            });
+        });
+    }).then([tmp, path] {
+        return rename_file(tmp, path);
+    }).then([this] {
+        return sync_directory(_directory);
+    });
+}
+
+future<> snapshot_manager::remove_older(uint64_t id)
+{
+    return engine().open_directory(_directory).then([this, id] (file dir) {
+        auto names = make_lw_shared<std::vector<sstring>>();
+        auto listing = make_lw_shared(dir.list_directory([id, names] (directory_entry de) {
+            unsigned long long other = 0;
+            if (std::sscanf(de.name.c_str(), "snapshot-%llu", &other) == 1 && other < id) {
+                names->push_back(de.name);
+            }
+            return make_ready_future<>();
+        }));
+        return listing->done().then([this, listing, names] {
+            return do_for_each(*names, [this] (const sstring& name) {
+                return remove_file(_directory + "/" + name);
+            });
+        }).finally([dir, names] () mutable {
+            return dir.close().finally([dir] {});
+        });
+    });
+}
+
+future<replay_position> snapshot_manager::load()
+{
+    assert(engine().cpu_id() == 0);
+    return recursive_touch_directory(_directory).then([this] {
+        return engine().open_directory(_directory);
+    }).then([this] (file dir) {
+        // the latest complete snapshot, and the largest id used by any file.
+        struct found_type {
+            bool complete = false;
+            uint64_t id = 0;
+            uint64_t max_id = 0;
+        };
+        auto found = make_lw_shared<found_type>();
+        auto listing = make_lw_shared(dir.list_directory([found] (directory_entry de) {
+            unsigned long long id = 0;
+            int consumed = 0;
+            if (std::sscanf(de.name.c_str(), "snapshot-%llu", &id) != 1) {
+                return make_ready_future<>();
+            }
+            found->max_id = std::max(found->max_id, uint64_t(id));
+            if (std::sscanf(de.name.c_str(), "snapshot-%llu.manifest%n", &id, &consumed) == 1 && size_t(consumed) == de.name.size()) {
+                if (!found->complete || id > found->id) {
+                    found->complete = true;
+                    found->id = id;
+                }
+            }
+            return make_ready_future<>();
+        }));
+        return listing->done().then([listing, found] {
+            return *found;
+        }).finally([dir] () mutable {
+            return dir.close().finally([dir] {});
+        });
+    }).then([this] (auto found) {
+        _next_id = found.max_id + 1;
+        if (!found.complete) {
+            return make_ready_future<replay_position>(replay_position {});
+        }
+        auto path = _directory + "/" + manifest_name(found.id);
+        return open_file_dma(path, open_flags::ro).then([] (file f) {
+            return f.size().then([f] (uint64_t size) mutable {
+                return do_with(make_file_input_stream(f), [size] (auto& in) {
+                    return in.read_exactly(size).finally([&in] {
+                        return in.close();
+                    });
+                });
+            });
+        }).then([this, id = found.id, path] (temporary_buffer<char> content) {
+            std::istringstream manifest(std::string(content.get(), content.size()));
+            std::string key;
+            uint64_t manifest_id = 0;
+            size_t shards = 0;
+            replay_position position;
+            manifest >> key >> manifest_id >> key >> position.generation >> key >> shards;
+            position.first_segments.resize(shards);
+            for (auto& segment : position.first_segments) {
+                manifest >> segment;
+            }
+            if (!manifest || manifest_id != id) {
+                throw std::runtime_error(sprint("bad snapshot manifest %s", path));
+            }
+            return smp::invoke_on_all([directory = _directory, id, shards] {
+                // like the commit log, the files of the old shards are spread over
+                // the current ones, and every entry is sent to its owner.
+                return do_for_each(boost::irange<size_t>(0, shards), [directory, id] (size_t shard) {
+                    if (shard % smp::count != engine().cpu_id()) {
+                        return make_ready_future<>();
+                    }
+                    auto path = directory + "/" + file_name(id, shard);
+                    return load_file(path).then([path] (uint64_t entries) {
+                        slog.info("{}: loaded {} entries", path, entries);
+                        get_snapshot_manager().local()._stats._loaded_entries += entries;
+                    });
+                });
+            }).then([position = std::move(position)] () mutable {
+                return std::move(position);
+            });
+        });
+    });
+}
+
+future<uint64_t> snapshot_manager::load_file(sstring path)
+{
+    struct load_state {
+        input_stream<char> in;
+        // the records of the current block, by owner shard.
+        std::vector<std::vector<char>> records;
+        uint64_t entries = 0;
+        bool done = false;
+        explicit load_state(file f) : in(make_file_input_stream(std::move(f))), records(smp::count) {}
+    };
+    return open_file_dma(path, open_flags::ro).then([path] (file f) {
+        auto state = make_lw_shared<load_state>(f);
+        return state->in.read_exactly(sizeof(snapshot_header)).then([state, path] (temporary_buffer<char> header) {
+            if (header.size() < sizeof(snapshot_header) || std::memcmp(header.get(), snapshot_header, sizeof(snapshot_header)) != 0) {
+                throw std::runtime_error(sprint("%s is not a snapshot", path));
+            }
+            return do_until([state] { return state->done; }, [state, path] {
+                return state->in.read_exactly(snapshot_writer::block_header_size).then([state, path] (temporary_buffer<char> header) {
+                    if (header.size() < snapshot_writer::block_header_size) {
+                        throw std::runtime_error(sprint("%s is truncated", path));
+                    }
+                    auto size = read_le32(header.get());
+                    auto crc = read_le32(header.get() + sizeof(uint32_t));
+                    if (size == 0) {
+                        state->done = true;
+                        return make_ready_future<>();
+                    }
+                    return state->in.read_exactly(size).then([state, path, size, crc] (temporary_buffer<char> block) {
+                        if (block.size() < size || checksum(block.get(), size) != crc) {
+                            throw std::runtime_error(sprint("%s is corrupted", path));
+                        }
+                        snapshot_reader reader(block.get(), block.size());
+                        while (!reader.empty()) {
+                            auto record = reader.view();
+                            snapshot_reader fields(record.first, record.second);
+                            fields.u8();
+                            auto key = fields.view();
+                            auto shard = shard_of(hash_key(key.first, key.second), smp::count);
+                            auto& out = state->records[shard];
+                            char size_prefix[sizeof(uint32_t)];
+                            write_le32(size_prefix, static_cast<uint32_t>(record.second));
+                            out.insert(out.end(), size_prefix, size_prefix + sizeof(size_prefix));
+                            out.insert(out.end(), record.first, record.first + record.second);
+                        }
+                        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [state] (unsigned cpu) {
+                            auto& records = state->records[cpu];
+                            if (records.empty()) {
+                                return make_ready_future<>();
+                            }
+                            return get_database().invoke_on(cpu, &database::restore, std::ref(records)).then([state, &records] (size_t n) {
+                                state->entries += n;
+                                records.clear();
+                            });
+                        });
+                    });
+                });
+            });
+        }).then([state] {
+            return state->entries;
+        }).finally([state] {
+            return state->in.close().finally([state] {});
+        });
+    });
+}
+}
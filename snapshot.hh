@@ -0,0 +1,151 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/future.hh"
+#include "core/fstream.hh"
+#include "core/gate.hh"
+#include "core/sharded.hh"
+#include "core/sstring.hh"
+#include "core/timer.hh"
+#include "core/metrics_registration.hh"
+#include "commitlog.hh"
+#include <chrono>
+#include <vector>
+
+namespace redis {
+
+class cache_entry;
+class config;
+
+// A snapshot file holds the entries of one shard:
+//
+//   [magic: 8][format version: le32]
+//   blocks of [le32 size][le32 crc32][records], ended by a block of size 0
+//
+// and every record is [le32 size][type: 1][le32 key size][key][le64 expire at][value],
+// where expire at is in unix milliseconds, or -1. Blocks are verified before any
+// of their records is restored.
+class snapshot_writer {
+public:
+    static constexpr size_t block_header_size = 2 * sizeof(uint32_t);
+
+    explicit snapshot_writer(output_stream<char>&& out);
+
+    // Encodes the entry into the current block, synchronously.
+    void write(const cache_entry& e);
+    // Writes the current block, so the memory held by the encoded entries is bounded
+    // by what is captured between two flushes.
+    future<> flush();
+    future<> close();
+
+    inline uint64_t entries() const { return _entries; }
+    inline uint64_t bytes() const { return _bytes; }
+private:
+    output_stream<char> _out;
+    std::vector<char> _block;
+    uint64_t _entries = 0;
+    uint64_t _bytes = 0;
+    bool _started = false;
+
+    void start_block();
+    void put_u8(uint8_t v);
+    void put_u32(uint32_t v);
+    void put_u64(uint64_t v);
+    void put_double(double v);
+    void put_bytes(const char* data, size_t size);
+};
+
+// Decodes the fields of a record, throws if it is truncated.
+class snapshot_reader {
+    const char* _p;
+    const char* _end;
+public:
+    snapshot_reader(const char* data, size_t size) : _p(data), _end(data + size) {}
+    inline bool empty() const { return _p == _end; }
+    uint8_t u8();
+    uint32_t u32();
+    uint64_t u64();
+    double f64();
+    sstring bytes();
+    // returns the next size prefixed field in place.
+    std::pair<const char*, size_t> view();
+    // skips to the end of a size prefixed record, returns its payload.
+    snapshot_reader record();
+};
+
+// Takes the snapshots of all shards and loads the latest one at startup.
+//
+// Every shard walks its cache in bounded slices, see cache::start_snapshot(), so
+// nothing is forked and the memory is not copied. A snapshot is complete once its
+// manifest exists, which also records the commit log segment every shard moved on
+// to when it started; only then the older snapshots and the covered segments are
+// removed. Everything but the manifest runs on all shards in parallel.
+class snapshot_manager {
+public:
+    explicit snapshot_manager(const redis::config& cfg);
+
+    future<> start();
+    future<> stop();
+
+    // Takes a snapshot and resolves with false if one was already running. Only on shard 0.
+    future<bool> save();
+    // Starts a snapshot in the background, returns false if one was already running.
+    bool bgsave();
+    // The unix time of the last snapshot which completed.
+    inline uint64_t last_save() const { return _last_save; }
+
+    // Loads the latest complete snapshot into all shards, and returns where the
+    // replay of the commit log starts. Only on shard 0.
+    future<replay_position> load();
+private:
+    struct stats {
+        uint64_t _saves = 0;
+        uint64_t _failures = 0;
+        uint64_t _last_duration_ms = 0;
+        uint64_t _loaded_entries = 0;
+    };
+
+    sstring _directory;
+    sstring _commitlog_directory;
+    bool _commitlog_enabled;
+    std::chrono::seconds _period;
+    timer<> _timer;
+    seastar::gate _gate;
+    uint64_t _next_id = 0;
+    uint64_t _last_save = 0;
+    bool _running = false;
+    stats _stats;
+    seastar::metrics::metric_groups _metrics;
+
+    future<> take(uint64_t id);
+    future<> write_manifest(uint64_t id, const replay_position& position);
+    future<> remove_older(uint64_t id);
+    static future<uint64_t> load_file(sstring path);
+    static sstring file_name(uint64_t id, unsigned shard);
+    static sstring manifest_name(uint64_t id);
+    void setup_metrics();
+};
+
+extern distributed<snapshot_manager> _the_snapshot_manager;
+inline distributed<snapshot_manager>& get_snapshot_manager() {
+    return _the_snapshot_manager;
+}
+}
@@ -26,16 +26,19 @@
 #include "core/sstring.hh"
 #include "util/log.hh"
 #include "common.hh"
-#include <boost/intrusive/list.hpp>
 #include <boost/intrusive/set.hpp>
 #include "utils/managed_bytes.hh"
 #include "utils/managed_ref.hh"
 #include "bytes.hh"
 #include "utils/allocation_strategy.hh"
 #include "utils/logalloc.hh"
+#include "rank_tree.hh"
 #include  <experimental/vector>
 #include <experimental/optional>
 #include  <vector>
+#include <cmath>
+#include <cstring>
+#include <limits>
 
 using logger =  seastar::logger;
 static logger sset_log ("sset");
@@ -44,24 +47,23 @@ namespace redis {
 struct sset_entry
 {
     using set_hook_type = boost::intrusive::set_member_hook<>;
-    using list_hook_type = boost::intrusive::list_member_hook<>;
-    list_hook_type _list_link;
+    rank_tree_hook _rank_link;
     set_hook_type _set_link;
     managed_bytes _key;
     size_t _key_hash;
     double _score;
 
     sset_entry(const sstring& key, const double score) noexcept
-        : _list_link()
+        : _rank_link()
         , _set_link()
-        , _key(std::move(*(current_allocator().construct<managed_bytes>(bytes_view {reinterpret_cast<const signed char*>(key.data()), key.size()}))))
+        , _key(bytes_view {reinterpret_cast<const signed char*>(key.data()), key.size()})
         , _key_hash(std::hash<managed_bytes>()(_key))
         , _score(score)
     {
     }
 
     sset_entry(sset_entry&& o) noexcept
-        : _list_link(std::move(o._list_link))
+        : _rank_link(std::move(o._rank_link))
         , _set_link(std::move(o._set_link))
         , _key(std::move(o._key))
         , _key_hash(std::move(o._key_hash))
@@ -99,6 +101,16 @@ struct sset_entry
         }
     };
 
+    // Orders the entries by score, then by key, as redis does.
+    struct rank_compare {
+        inline bool operator () (const sset_entry& l, const sset_entry& r) const noexcept {
+            if (l.score() != r.score()) {
+                return l.score() < r.score();
+            }
+            return compare()(l, r);
+        }
+    };
+
     const managed_bytes& key() const {
         return _key;
     }
@@ -127,16 +139,14 @@ class sset_lsa final {
     using dict_type = boost::intrusive::set<sset_entry,
         boost::intrusive::member_hook<sset_entry, sset_entry::set_hook_type, &sset_entry::_set_link>,
         boost::intrusive::compare<sset_entry::compare>>;
-    using list_type = boost::intrusive::list<sset_entry,
-        boost::intrusive::member_hook<sset_entry, boost::intrusive::list_member_hook<>,
-        &sset_entry::_list_link>>;
+    using rank_type = rank_tree<sset_entry, &sset_entry::_rank_link, sset_entry::rank_compare>;
     dict_type _dict;
-    list_type _list;
+    rank_type _rank;
 public:
-    sset_lsa() noexcept : _dict(), _list()
+    sset_lsa() noexcept : _dict(), _rank()
     {
     }
-    sset_lsa(sset_lsa&& o) noexcept : _dict(std::move(o._dict)), _list(std::move(o._list))
+    sset_lsa(sset_lsa&& o) noexcept : _dict(std::move(o._dict)), _rank(std::move(o._rank))
     {
     }
     ~sset_lsa()
@@ -145,17 +155,18 @@ public:
     }
     void flush_all()
     {
-        _list.clear_and_dispose(current_deleter<sset_entry>());
+        _dict.clear();
+        _rank.clear_and_dispose(current_deleter<sset_entry>());
     }
 
     inline bool insert(sset_entry* e)
     {
         assert(e != nullptr);
-        if (insert_ordered(e)) {
-            auto r = _dict.insert(*e);
-            return r.second;
+        auto r = _dict.insert(*e);
+        if (r.second) {
+            _rank.insert(*e);
         }
-        return false;
+        return r.second;
     }
 
     size_t insert_if_not_exists(std::unordered_map<sstring, double>& members)
@@ -185,13 +196,8 @@ public:
             const auto& score = member.second;
             auto it = _dict.find(key, sset_entry::compare());
             if (it != _dict.end()) {
-                //remove it from list, update score, insert it to list again.
-                auto lit = list_type::s_iterator_to(*it);
-                _list.erase(lit);
-                it->update_score(score);
-                if (insert_ordered(&(*it))) {
-                    inserted++;
-                }
+                update(&(*it), score);
+                inserted++;
             }
         }
         return inserted;
@@ -203,8 +209,7 @@ public:
         auto it = _dict.find(key, sset_entry::compare());
         if (it != _dict.end()) {
             result += it->score();
-            it->update_score(result);
-            update(&(*it));
+            update(&(*it), result);
         }
         else {
             auto entry = current_allocator().construct<sset_entry>(key, result);
@@ -221,10 +226,8 @@ public:
             const auto& score = member.second;
             auto it = _dict.find(key, sset_entry::compare());
             if (it != _dict.end()) {
-                it->update_score(score);
-                if (update(&(*it))) {
-                    inserted++;
-                }
+                update(&(*it), score);
+                inserted++;
             }
             else {
                 auto entry = current_allocator().construct<sset_entry>(key, score);
@@ -238,95 +241,84 @@ public:
 
     void fetch_by_rank(long begin, long end, std::vector<std::pair<sstring, double>>& entries) const
     {
-        if (_list.empty()) {
+        if (!normalize_rank(begin, end)) {
             return;
         }
-        auto size = _list.size();
-        if (begin < 0) { begin += static_cast<long>(size); }
-        while (end < 0) { end += static_cast<long>(size); }
-        if (begin < 0) begin = 0;
-        if (begin > end) {
-           return;
-        }
-        if (begin > static_cast<long>(size)) {
-            begin = static_cast<long>(size);
-        }
-        long rank = 0;
-        if (rank_out_of_range(begin, end)) {
-            return;
+        entries.reserve(entries.size() + static_cast<size_t>(end - begin + 1));
+        auto it = _rank.select(static_cast<size_t>(begin));
+        for (long rank = begin; rank <= end; ++rank, ++it) {
+            const auto& e = *it;
+            entries.emplace_back(std::pair<sstring, double>(sstring(e.key_data(), e.key_size()), e.score()));
         }
-        for (auto it = _list.begin(); it != _list.end(); ++it, ++rank) {
-            if (rank < begin) {
-                continue;
-            }
-            else if (rank > end) {
-                return;
-            }
-            else {
-                const auto& e = *it;
-                entries.emplace_back(std::pair<sstring, double>(sstring(e.key_data(), e.key_size()), e.score()));
-            }
+    }
+
+    // Fetches at most count entries in member order, starting after the member
+    // after, or from the first one if after is nullptr.
+    void fetch_by_member(const sstring* after, size_t count, std::vector<std::pair<sstring, double>>& entries) const
+    {
+        auto it = after ? _dict.upper_bound(*after, sset_entry::compare()) : _dict.begin();
+        entries.reserve(entries.size() + std::min(count, _dict.size()));
+        for (; it != _dict.end() && count > 0; ++it, --count) {
+            entries.emplace_back(std::pair<sstring, double>(sstring(it->key_data(), it->key_size()), it->score()));
         }
     }
 
     void fetch_by_rank(long begin, long end, std::vector<const sset_entry*>& entries) const
     {
-        if (_list.empty()) {
+        if (!normalize_rank(begin, end)) {
             return;
         }
-        auto size = _list.size();
-        if (begin < 0) { begin += static_cast<long>(size); }
-        while (end < 0) { end += static_cast<long>(size); }
-        if (begin < 0) begin = 0;
-        if (begin > end) {
-           return;
-        }
-        if (begin > static_cast<long>(size)) {
-            begin = static_cast<long>(size);
-        }
-        long rank = 0;
-        if (rank_out_of_range(begin, end)) {
-            return;
-        }
-        for (auto it = _list.begin(); it != _list.end(); ++it, ++rank) {
-            if (rank < begin) {
-                continue;
-            }
-            else if (rank > end) {
-                return;
-            }
-            else {
-                const auto& e = *it;
-                entries.push_back(&e);
-            }
+        entries.reserve(entries.size() + static_cast<size_t>(end - begin + 1));
+        auto it = _rank.select(static_cast<size_t>(begin));
+        for (long rank = begin; rank <= end; ++rank, ++it) {
+            entries.push_back(&(*it));
         }
     }
 
     void fetch_by_score(const double min, const double max, std::vector<const sset_entry*>& entries, size_t limit = 0) const
     {
-        if (_list.empty()) {
-            return;
-        }
-        if (score_out_of_range(min, max)) {
-            return;
-        }
         if (limit == 0) {
-            limit = _list.size();
+            limit = _rank.size();
         }
-        for (auto it = _list.begin(); it != _list.end(); ++it) {
-            const auto& score = it->score();
-            if (score < min) {
-                continue;
+        size_t fetched = 0;
+        for (auto it = _rank.lower_bound(min, sset_entry::compare()); it != _rank.end() && fetched < limit; ++it, ++fetched) {
+            if (it->score() > max) {
+                break;
             }
-            else if (score > max) {
-                return;
+            entries.push_back(&(*it));
+        }
+    }
+
+    // Appends count entries in score order from the cursor, 0 for the first entry,
+    // then the other entries sharing the score of the last one, and returns the
+    // cursor of the next entry, or 0 once the last entry was appended.
+    //
+    // The cursor is the score of the next entry as an integer in the same order, so
+    // that the entries present during the whole scan are all returned, whatever is
+    // removed or added between the calls. A run of equal scores is never split, a
+    // call may return more than count entries then, COUNT being a hint as in Redis.
+    uint64_t fetch_scan(uint64_t cursor, size_t count, std::vector<const sset_entry*>& entries) const
+    {
+        auto it = cursor == 0 ? _rank.begin() : scan_lower_bound(cursor);
+        const sset_entry* last = nullptr;
+        for (; it != _rank.end() && (count > 0 || (last && it->score() == last->score())); ++it) {
+            last = &(*it);
+            entries.push_back(last);
+            if (count > 0) {
+                --count;
             }
-            else {
-                const auto& e = *it;
-                entries.push_back(&e);
-                if (entries.size() >= limit) {
-                    break;
-                }
+        }
+        return it == _rank.end() ? 0 : scan_order(it->score());
+    }
+
+    // Calls func with the entries whose score is in [min, max) in score order, from
+    // a seek to min, until it returns false.
+    template <typename Func>
+    void for_each_by_score(const double min, const double max, Func&& func) const
+    {
+        for (auto it = _rank.lower_bound(min, sset_entry::compare()); it != _rank.end() && it->score() < max; ++it) {
+            if (!func(*it)) {
+                return;
             }
         }
     }
@@ -346,10 +338,8 @@ public:
     {
         auto it = _dict.find(key, sset_entry::compare());
         if (it != _dict.end()) {
-            auto lit = list_type::s_iterator_to(*it);
-            _list.erase(lit);
-            it->update_score(delta);
-            return insert_ordered(&(*it));
+            update(&(*it), delta);
+            return true;
         }
         return false;
     }
@@ -357,10 +347,10 @@ public:
     size_t erase(std::vector<const sset_entry*>& entries)
     {
         for (size_t i = 0; i < entries.size(); ++i) {
-            auto lit = list_type::s_iterator_to(*entries[i]);
-            auto dit = dict_type::s_iterator_to(*lit);
-            _dict.erase(dit);
-            _list.erase_and_dispose(lit, current_deleter<sset_entry>());
+            auto e = const_cast<sset_entry*>(entries[i]);
+            _dict.erase(dict_type::s_iterator_to(*e));
+            _rank.erase(*e);
+            current_deleter<sset_entry>()(e);
         }
         return entries.size();
     }
@@ -372,9 +362,10 @@ public:
             auto& key = keys[i];
             auto dit = _dict.find(key, sset_entry::compare());
             if (dit != _dict.end()) {
-                auto lit = list_type::s_iterator_to(*dit);
+                auto& e = *dit;
                 _dict.erase(dit);
-                _list.erase_and_dispose(lit, current_deleter<sset_entry>());
+                _rank.erase(e);
+                current_deleter<sset_entry>()(&e);
                 removed++;
             }
         }
@@ -383,26 +374,12 @@ public:
 
     size_t count_by_score(const double min, const double max) const
     {
-        if (_dict.empty()) {
-            return 0;
-        }
-        if (score_out_of_range(min, max)) {
+        if (_rank.empty() || min > max) {
             return 0;
         }
-        size_t count = 0;
-        for (auto it = _list.begin(); it != _list.end(); ++it) {
-            auto score = it->score();
-            if (score < min) {
-                continue;
-            }
-            else if (score > max) {
-                break;
-            }
-            else {
-                count++;
-            }
-        }
-        return count;
+        auto first = _rank.lower_bound(min, sset_entry::compare());
+        auto last = _rank.upper_bound(max, sset_entry::compare());
+        return _rank.rank(last) - _rank.rank(first);
     }
 
     template <typename Func>
@@ -431,30 +408,30 @@ public:
 
     inline size_t size() const
     {
-        return _list.size();
+        return _rank.size();
     }
 
     inline bool empty() const
     {
-        return _list.empty();
+        return _rank.empty();
     }
 
     void erase(const sstring& key)
     {
-        auto removed = _dict.erase(_dict.find(key, sset_entry::compare()));
-        if (removed != _dict.end()) {
-            _list.erase_and_dispose(list_type::s_iterator_to(*removed), current_deleter<sset_entry>());
+        auto it = _dict.find(key, sset_entry::compare());
+        if (it != _dict.end()) {
+            auto& e = *it;
+            _dict.erase(it);
+            _rank.erase(e);
+            current_deleter<sset_entry>()(&e);
         }
     }
 
     std::experimental::optional<size_t> rank(const sstring& key) const
     {
-        size_t rank = 0;
         auto it = _dict.find(key, sset_entry::compare());
         if (it != _dict.end()) {
-            auto lit = list_type::s_iterator_to(*it);
-            for (auto i = _list.begin(); i != lit; ++i, ++rank) {}
-            return std::experimental::optional<size_t>(rank);
+            return std::experimental::optional<size_t>(_rank.rank(*it));
         }
         return  std::experimental::optional<size_t>();
     }
@@ -468,52 +445,53 @@ public:
         return  std::experimental::optional<double>();
     }
 private:
-    inline bool score_out_of_range(double min, double max) const
+    // A score as an integer in the same order, 0 and -0 are the same.
+    static inline uint64_t scan_order(double score)
     {
-        return (min > _list.rbegin()->score()) || (max < _list.begin()->score());
+        if (score == 0) {
+            score = 0;
+        }
+        uint64_t bits;
+        std::memcpy(&bits, &score, sizeof(bits));
+        return (bits >> 63) ? ~bits : bits | (uint64_t(1) << 63);
     }
 
-    inline bool rank_out_of_range(long begin, long end) const
+    // The first entry whose score, as an integer, is not below order.
+    inline rank_type::const_iterator scan_lower_bound(uint64_t order) const
     {
-        return begin > static_cast<long>(_list.size()) || end <= 0;
+        uint64_t bits = (order >> 63) ? order & ~(uint64_t(1) << 63) : ~order;
+        double score;
+        std::memcpy(&score, &bits, sizeof(score));
+        // the integers below the one of -inf or above the one of +inf are not scores.
+        if (std::isnan(score)) {
+            if (order >> 63) {
+                return _rank.end();
+            }
+            score = -std::numeric_limits<double>::infinity();
+        }
+        return _rank.lower_bound(score, sset_entry::compare());
     }
 
-    inline bool insert_ordered(sset_entry* e)
+    // Converts the redis style [begin, end] (negative means counting from the tail)
+    // to the inclusive ranks, returns false if the range is empty.
+    inline bool normalize_rank(long& begin, long& end) const
     {
-        assert(e != nullptr);
-        auto it = _list.begin();
-        const auto& score = e->score();
-        if (it == _list.end() || score < it->score()) {
-            _list.push_front(*e);
-            return true;
+        const auto size = static_cast<long>(_rank.size());
+        if (size == 0) {
+            return false;
         }
-        else {
-            auto trace = it;
-            for (; it != _list.end(); ++it) {
-                if (it->score() > score) {
-                    _list.insert(it, *e);
-                    return true;
-                }
-                trace = it;
-            }
-            if (it == _list.end()) {
-                if (trace->score() > score) {
-                    _list.push_front(*e);
-                }
-                else {
-                    _list.push_back(*e);
-                }
-                return true;
-            }
-        }
-        return false;
+        if (begin < 0) begin += size;
+        if (end < 0) end += size;
+        if (begin < 0) begin = 0;
+        if (end >= size) end = size - 1;
+        return begin <= end;
     }
 
-    inline bool update(sset_entry* e)
+    inline void update(sset_entry* e, double score)
     {
-        auto lit = list_type::s_iterator_to(*e);
-        _list.erase(lit);
-        return insert_ordered(e);
+        _rank.erase(*e);
+        e->update_score(score);
+        _rank.insert(*e);
     }
 };
 }
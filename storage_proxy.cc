@@ -43,67 +43,149 @@
 #include <cstdlib>
 #include "common.hh"
 #include "geo.hh"
+#include "redis_protocol.hh"
+#include "reply_writer.hh"
+#include "token_ring_manager.hh"
+#include "internal_message.hh"
+#include "message/messaging_service.hh"
+#include "utils/fb_utilities.hh"
+#include "core/metrics.hh"
+#include "core/scattered_message.hh"
 namespace redis {
 
+using logger = seastar::logger;
+static logger plog("storage_proxy");
+
 distributed<storage_proxy> _storage_proxy;
 
 future<> storage_proxy::start()
 {
+    auto& ms = net::get_local_messaging_service();
+    ms.register_internal_read([this] (const rpc::client_info& cinfo, internal_read_message msg) {
+        ++_stats._served_reads;
+        return serve(std::move(msg.request));
+    });
+    ms.register_internal_write([this] (const rpc::client_info& cinfo, internal_write_message msg) {
+        ++_stats._served_writes;
+        return serve(std::move(msg.request));
+    });
+    setup_metrics();
     return make_ready_future<>();
 }
 
 future<> storage_proxy::stop()
 {
+    auto& ms = net::get_local_messaging_service();
+    ms.unregister_internal_read();
+    ms.unregister_internal_write();
     return make_ready_future<>();
 }
 
-future<> storage_proxy::process(args_collection& request_args, output_stream<char>& out)
+void storage_proxy::setup_metrics()
 {
-    /*
-    auto rk = extract_request_key(request_args);
-    auto type = request_args.type();
-    if (type == request::write) {
-        // The key will be processed by local node.
-        if (get_ring().local().should_served_by_me(rk)) {
-            // First, handle the write request locally.
-            // Second, submit the write request to remote node for replication.
-            // Finally, write message to client. 
-            return _redis.local().handle(request_args).then([this, rk, &out] (auto m) {
-                auto remote_request = make_remote_request(request_args);
-                auto replica_nodes = get_ring().local().get_replica_nodes_for_write(rk);
-                for (auto& node : replica_nodes) {
-                   _ms.local().send_internal_write(node, remote_request);
-                }
-                return out.write(*m);
-            }); 
-        }
-        // This request will be served by remote node.
-        // When the primary replica is successfuly served, return the message to the client.
-        auto remote_request = make_remote_request(request_args);
-        auto target_nodes = get_ring().local().get_target_node_for_write(rk);
-        assert(target_nodes.empty() == false);
-        auto f = _ms.local().send_internal_write(target_nodes[0], remote_request);
-        for (auto i = target_nodes.begin() + 1, i != target_nodes.end(); ++i) {
-            _ms.local().send_internal_write(node, remote_request);
-        }
-        return f.then([this, &out] (auto m) {
-                return out.write(m);
-        });
+    namespace sm = seastar::metrics;
+    _metrics.add_group("storage_proxy", {
+        sm::make_counter("forwarded_reads", [this] { return _stats._forwarded_reads; }, sm::description("Total number of reads forwarded to the owner of their key.")),
+        sm::make_counter("forwarded_writes", [this] { return _stats._forwarded_writes; }, sm::description("Total number of writes forwarded to the owner of their key.")),
+        sm::make_counter("forward_errors", [this] { return _stats._forward_errors; }, sm::description("Total number of forwarded requests which the owner did not reply to.")),
+        sm::make_counter("served_reads", [this] { return _stats._served_reads; }, sm::description("Total number of reads served for the other nodes.")),
+        sm::make_counter("served_writes", [this] { return _stats._served_writes; }, sm::description("Total number of writes served for the other nodes.")),
+    });
+}
+
+std::experimental::optional<gms::inet_address> storage_proxy::remote_owner(sstring& key)
+{
+    // a single node serves every key, without looking it up in the ring.
+    auto& ring = get_local_ring();
+    if (ring.get_endpoint_count() < 2) {
+        return {};
+    }
+    redis_key rk{key};
+    auto owner = ring.get_replica_node_for_read(rk);
+    if (owner == utils::fb_utilities::get_broadcast_address()) {
+        return {};
+    }
+    return owner;
+}
+
+// The request as a RESP multi bulk, as the client sent it.
+sstring storage_proxy::encode_request(redis_protocol_parser::command command, const args_collection& request_args)
+{
+    auto name = redis_protocol_parser::command_name(command);
+    auto name_size = std::strlen(name);
+    auto& views = request_args._command_views;
+    auto bulk_size = [] (size_t n) { return 1 + uint_digits(n) + 2 + n + 2; };
+    size_t size = 1 + uint_digits(views.size() + 1) + 2 + bulk_size(name_size);
+    for (auto& v : views) {
+        size += bulk_size(v.size());
     }
-    else if (type == request::read) {
-        if (get_ring().local().should_served_by_me(rk)) {
-            return _redis.local().handle(request_args).then([this, &out] (auto m) {
-                return out.write(*m);
-            });
+    sstring request(sstring::initialized_later(), size);
+    auto p = request.begin();
+    auto write_header = [&p] (char tag, size_t n) {
+        *p++ = tag;
+        p = format_uint(p, n);
+        *p++ = '\r';
+        *p++ = '\n';
+    };
+    auto write_bulk = [&p, &write_header] (const char* data, size_t n) {
+        write_header('$', n);
+        p = std::copy_n(data, n, p);
+        *p++ = '\r';
+        *p++ = '\n';
+    };
+    write_header('*', views.size() + 1);
+    write_bulk(name, name_size);
+    for (auto& v : views) {
+        write_bulk(v.get(), v.size());
+    }
+    return request;
+}
+
+// Executes a request forwarded by another node, as the commit log replays its
+// records, and returns its reply.
+future<sstring> storage_proxy::serve(sstring request)
+{
+    struct serve_state {
+        redis_protocol proto;
+        reply_buffer replies;
+        request_latency_tracer tracer;
+        serve_state() {
+            proto.serve_locally();
         }
-        auto remote_request = make_remote_request(request_args);
-        auto primary_node = get_ring().local().get_replica_node_for_read(rk);
-        return _ms.send_internal_read(primary_node, remote_request).then([this, &out] (auto m) {
-            return out.write(*m);
-        });
+    };
+    auto state = make_lw_shared<serve_state>();
+    temporary_buffer<char> data(request.data(), request.size());
+    return state->proto.handle(std::move(data), state->replies.stream(), state->tracer).then([state] {
+        return state->replies.collect();
+    }).finally([state] {});
+}
+
+future<> storage_proxy::process(const gms::inet_address& owner, redis_protocol_parser::command command, bool read_only, args_collection& request_args, output_stream<char>& out)
+{
+    // All the requests of a shard to a node share a single connection, the messaging
+    // service sends them as they come without waiting for the previous replies.
+    auto id = net::msg_addr{owner, 0};
+    auto request = encode_request(command, request_args);
+    auto& ms = net::get_local_messaging_service();
+    future<sstring> f = make_ready_future<sstring>();
+    if (read_only) {
+        ++_stats._forwarded_reads;
+        f = ms.send_internal_read(id, internal_read_message{std::move(request)});
     }
-    // The system commands
-    */
-    return make_ready_future<>();
+    else {
+        ++_stats._forwarded_writes;
+        f = ms.send_internal_write(id, internal_write_message{std::move(request)});
+    }
+    return f.then_wrapped([this, owner, &out] (future<sstring> f) {
+        scattered_message<char> reply;
+        try {
+            reply.append(f.get0());
+        } catch (...) {
+            ++_stats._forward_errors;
+            plog.warn("failed to forward the request to {}: {}", owner, std::current_exception());
+            reply.append(msg_forward_err);
+        }
+        return out.write(std::move(reply));
+    });
 }
 }
@@ -45,19 +45,43 @@
 #include "common.hh"
 #include "geo.hh"
 #include "redis.hh"
+#include "redis_protocol_parser.hh"
+#include "gms/inet_address.hh"
+#include "core/metrics_registration.hh"
 namespace redis {
 class storage_proxy;
 extern distributed<storage_proxy> _storage_proxy;
 inline distributed<storage_proxy>& get_storage_proxy() {
     return _storage_proxy;
 }
+inline storage_proxy& get_local_storage_proxy() {
+    return _storage_proxy.local();
+}
+// Routes the requests by the owner of their key in the token ring: the ones owned
+// by another node are forwarded to it over the messaging service, and the ones
+// forwarded by the other nodes are served here.
 class storage_proxy : public seastar::async_sharded_service<storage_proxy> {
+    struct stats {
+        uint64_t _forwarded_reads = 0;
+        uint64_t _forwarded_writes = 0;
+        uint64_t _forward_errors = 0;
+        uint64_t _served_reads = 0;
+        uint64_t _served_writes = 0;
+    };
+    stats _stats;
+    seastar::metrics::metric_groups _metrics;
+    void setup_metrics();
 public:
     storage_proxy() {}
-    future<> process(args_collection& request_args, output_stream<char>& out);
+    // The request as a RESP multi bulk, as the client sent it.
+    static sstring encode_request(redis_protocol_parser::command command, const args_collection& request_args);
+    // Executes the requests forwarded by another node, and returns their replies.
+    static future<sstring> serve(sstring request);
+    // The node owning the key, unless it is this one.
+    std::experimental::optional<gms::inet_address> remote_owner(sstring& key);
+    // Forwards the request to the owner of its key, and writes the reply of the owner.
+    future<> process(const gms::inet_address& owner, redis_protocol_parser::command command, bool read_only, args_collection& request_args, output_stream<char>& out);
     future<> stop();
     future<> start();
-private:
-    redis_key extract_request_key(args_collection& request_args) const;
 };
 }
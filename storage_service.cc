@@ -43,17 +43,59 @@
 #include <cstdlib>
 #include "common.hh"
 #include "geo.hh"
+#include "token_ring_manager.hh"
+#include "gms/gossiper.hh"
+#include "utils/fb_utilities.hh"
 namespace redis {
 
 distributed<storage_service> _storage_service;
 
 future<> storage_service::start()
 {
-    return make_ready_future<>();
+    assert(engine().cpu_id() == 0);
+    auto& gossiper = gms::get_local_gossiper();
+    gossiper.register_(this->shared_from_this());
+    _endpoints.insert(utils::fb_utilities::get_broadcast_address());
+    update_ring();
+    auto generation = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    return gossiper.start_gossiping(static_cast<int>(generation));
 }
 
 future<> storage_service::stop()
 {
-    return make_ready_future<>();
+    if (engine().cpu_id() == 0) {
+        gms::get_local_gossiper().unregister_(this->shared_from_this());
+    }
+    return std::move(_ring_update);
+}
+
+// A member stays in the ring while it is down, its keys are not served by the
+// others: the requests forwarded to it fail until it is back.
+void storage_service::update_ring()
+{
+    _ring_update = _ring_update.then([endpoints = _endpoints] {
+        return ring().invoke_on_all([endpoints] (token_ring_manager& r) {
+            r.set_endpoints(endpoints);
+        });
+    });
+}
+
+void storage_service::on_join(gms::inet_address endpoint, gms::endpoint_state ep_state)
+{
+    if (_endpoints.insert(endpoint).second) {
+        update_ring();
+    }
+}
+
+void storage_service::on_alive(gms::inet_address endpoint, gms::endpoint_state state)
+{
+    on_join(endpoint, state);
+}
+
+void storage_service::on_remove(gms::inet_address endpoint)
+{
+    if (_endpoints.erase(endpoint)) {
+        update_ring();
+    }
 }
 }
@@ -43,6 +43,8 @@
 #include <cstdlib>
 #include "common.hh"
 #include "geo.hh"
+#include "gms/i_endpoint_state_change_subscriber.hh"
+#include <set>
 namespace redis {
 class storage_service;
 extern distributed<storage_service> _storage_service;
@@ -52,11 +54,25 @@ inline distributed<storage_service>& get_storage_service() {
 inline storage_service& get_local_storage_service() {
     return _storage_service.local();
 }
-class storage_service : public seastar::async_sharded_service<storage_service> {
+// Keeps the token ring of every shard in sync with the members of the cluster,
+// as the gossiper learns them. The subscriber runs on shard 0, as the gossiper.
+class storage_service : public gms::i_endpoint_state_change_subscriber, public seastar::async_sharded_service<storage_service> {
+    std::set<gms::inet_address> _endpoints;
+    future<> _ring_update = make_ready_future<>();
+    void update_ring();
 public:
     storage_service() {}
     ~storage_service() {}
+    // Joins the cluster: starts gossiping, on shard 0 only.
     future<> start();
     future<> stop();
+
+    virtual void on_join(gms::inet_address endpoint, gms::endpoint_state ep_state) override;
+    virtual void before_change(gms::inet_address endpoint, gms::endpoint_state current_state, gms::application_state new_state_key, const gms::versioned_value& new_value) override {}
+    virtual void on_change(gms::inet_address endpoint, gms::application_state state, const gms::versioned_value& value) override {}
+    virtual void on_alive(gms::inet_address endpoint, gms::endpoint_state state) override;
+    virtual void on_dead(gms::inet_address endpoint, gms::endpoint_state state) override {}
+    virtual void on_remove(gms::inet_address endpoint) override;
+    virtual void on_restart(gms::inet_address endpoint, gms::endpoint_state state) override {}
 };
 }
@@ -0,0 +1,458 @@
+#include "tests/test-utils.hh"
+#include "bitmap_lsa.hh"
+#include "utils/logalloc.hh"
+#include <cstring>
+#include <endian.h>
+#include <random>
+#include <stdexcept>
+
+using namespace redis;
+
+using container_type = bitmap_lsa::container_type;
+
+// The bitmaps are checked against the string they stand for, as plain bytes.
+class bitmap_holder : private logalloc::region {
+public:
+    future<> conversions() {
+        with_allocator(allocator(), [this] {
+            bitmap_lsa m;
+            // every other bit: an array up to 4095 values, 8190 bytes.
+            for (uint64_t v = 0; v < 2 * 4095; v += 2) {
+                m.set(v, true);
+            }
+            BOOST_REQUIRE(types(m) == std::vector<container_type>({ container_type::ARRAY }));
+            // 4096 values take as much as a bitset, and too many runs.
+            m.set(2 * 4095, true);
+            BOOST_REQUIRE(types(m) == std::vector<container_type>({ container_type::BITSET }));
+            BOOST_CHECK(m.cardinality() == 4096);
+            m.set(2 * 4095, false);
+            BOOST_REQUIRE(types(m) == std::vector<container_type>({ container_type::ARRAY }));
+            check_bytes(m);
+
+            // bits set in order make a single run, up to a full chunk.
+            bitmap_lsa r;
+            for (uint64_t v = 0; v < bitmap_lsa::chunk_bits; ++v) {
+                r.set(v, true);
+            }
+            BOOST_REQUIRE(types(r) == std::vector<container_type>({ container_type::RUN }));
+            BOOST_CHECK(r.cardinality() == bitmap_lsa::chunk_bits);
+            // a hole splits the run.
+            r.set(1000, false);
+            BOOST_REQUIRE(types(r) == std::vector<container_type>({ container_type::RUN }));
+            BOOST_CHECK(!r.get(1000) && r.get(999) && r.get(1001));
+            // runs of a single bit, a bitset is smaller.
+            for (uint64_t v = 0; v < bitmap_lsa::chunk_bits; v += 2) {
+                r.set(v, false);
+            }
+            BOOST_REQUIRE(types(r) == std::vector<container_type>({ container_type::BITSET }));
+            BOOST_CHECK(r.cardinality() == bitmap_lsa::chunk_bits / 2);
+            check_bytes(r);
+            // back below the array threshold.
+            for (uint64_t v = 1; r.cardinality() > 4095; v += 2) {
+                r.set(v, false);
+            }
+            BOOST_REQUIRE(types(r) == std::vector<container_type>({ container_type::ARRAY }));
+            check_bytes(r);
+            // the bitmap of a string picks the encodings too.
+            std::string s(bitmap_lsa::chunk_bytes * 3, '\0');
+            std::fill(s.begin(), s.begin() + 1000, '\xff');
+            std::fill(s.begin() + bitmap_lsa::chunk_bytes, s.begin() + 2 * bitmap_lsa::chunk_bytes, '\xaa');
+            s[2 * bitmap_lsa::chunk_bytes + 7] = '\x01';
+            bitmap_lsa f(s.data(), s.size());
+            BOOST_REQUIRE(types(f) == std::vector<container_type>({ container_type::RUN, container_type::BITSET, container_type::ARRAY }));
+            BOOST_CHECK(f.size() == s.size());
+            BOOST_CHECK(read(f) == s);
+        });
+        return make_ready_future<>();
+    }
+
+    future<> boundaries() {
+        with_allocator(allocator(), [this] {
+            bitmap_lsa m;
+            std::string ref;
+            const uint64_t offsets[] = { 0, 65535, 65536, 65537, 131071, 131072, 3 * 65536 + 7 };
+            for (auto o : offsets) {
+                BOOST_CHECK(!m.set(o, true));
+                set(ref, o, true);
+            }
+            BOOST_REQUIRE(m.size() == ref.size());
+            BOOST_CHECK(m.containers() == 4);
+            for (auto o : offsets) {
+                BOOST_CHECK(m.set(o, true));
+                BOOST_CHECK(m.get(o));
+                BOOST_CHECK(m.get(o + 1) == get(ref, o + 1));
+                BOOST_CHECK(o == 0 || m.get(o - 1) == get(ref, o - 1));
+            }
+            BOOST_CHECK(m.count(0, -1) == sizeof(offsets) / sizeof(offsets[0]));
+            // the bytes on both sides of the first chunk boundary.
+            BOOST_CHECK(m.count(8191, 8192) == 3);
+            BOOST_CHECK(m.count(8191, 8191) == 1);
+            BOOST_CHECK(m.count(8192, -1) == 5);
+            BOOST_CHECK(m.pos(true, 1, -1, false) == 65535);
+            BOOST_CHECK(m.pos(true, 8192, -1, false) == 65536);
+            BOOST_CHECK(m.pos(false, 8191, -1, false) == 65528);
+            // a run of set bits going over the boundary.
+            for (uint64_t o = 65528; o < 65535; ++o) {
+                m.set(o, true);
+                set(ref, o, true);
+            }
+            BOOST_CHECK(m.pos(false, 8191, -1, false) == 65538);
+            BOOST_CHECK(m.pos(false, 8191, 8191, true) == -1);
+            BOOST_CHECK(m.count(8191, 8192) == 10);
+            // emptied containers are dropped, the size stays.
+            m.set(3 * 65536 + 7, false);
+            set(ref, 3 * 65536 + 7, false);
+            BOOST_CHECK(m.containers() == 3);
+            BOOST_CHECK(m.size() == ref.size());
+            BOOST_CHECK(read(m) == ref);
+            // the bytes past the end read as zeros.
+            std::string tail(16, '\xff');
+            m.read(ref.size() - 8, &tail[0], tail.size());
+            BOOST_CHECK(tail == ref.substr(ref.size() - 8) + std::string(8, '\0'));
+
+            // the last offset of a string, in the last chunk.
+            bitmap_lsa last;
+            last.set(bitmap_lsa::max_offset, true);
+            BOOST_CHECK(last.size() == (bitmap_lsa::max_offset >> 3) + 1);
+            BOOST_CHECK(last.containers() == 1);
+            BOOST_CHECK(last.get(bitmap_lsa::max_offset) && !last.get(bitmap_lsa::max_offset - 1));
+            BOOST_CHECK(!last.get(bitmap_lsa::max_offset + 1));
+            BOOST_CHECK(last.count(-1, -1) == 1);
+            BOOST_CHECK(last.pos(true, 0, -1, false) == long(bitmap_lsa::max_offset));
+            BOOST_CHECK(last.pos(false, -1, -1, true) == long(bitmap_lsa::max_offset) - 7);
+        });
+        return make_ready_future<>();
+    }
+
+    future<> ranges() {
+        with_allocator(allocator(), [this] {
+            std::mt19937_64 rng(22);
+            bitmap_lsa m;
+            std::string ref;
+            // an array, a bitset, a run and an empty chunk before a short last one.
+            for (int i = 0; i < 300; ++i) {
+                auto o = rng() % bitmap_lsa::chunk_bits;
+                m.set(o, true);
+                set(ref, o, true);
+            }
+            for (int i = 0; i < 30000; ++i) {
+                auto o = bitmap_lsa::chunk_bits + rng() % bitmap_lsa::chunk_bits;
+                m.set(o, true);
+                set(ref, o, true);
+            }
+            for (uint64_t o = 2 * bitmap_lsa::chunk_bits + 100; o < 3 * bitmap_lsa::chunk_bits; ++o) {
+                m.set(o, true);
+                set(ref, o, true);
+            }
+            m.set(4 * bitmap_lsa::chunk_bits + 77, true);
+            set(ref, 4 * bitmap_lsa::chunk_bits + 77, true);
+            BOOST_REQUIRE(types(m) == std::vector<container_type>({ container_type::ARRAY, container_type::BITSET, container_type::RUN, container_type::ARRAY }));
+            check_bytes(m);
+
+            managed_bytes s(bytes_view(reinterpret_cast<const int8_t*>(ref.data()), ref.size()));
+            long n = long(ref.size());
+            std::vector<long> bounds { 0, 1, 8191, 8192, 8193, 16383, 16384, 2 * 8192 + 12, 3 * 8192 - 1, 3 * 8192, n - 1, n, n + 5, -1, -2, -8193, -n, -n - 1 };
+            for (int i = 0; i < 200; ++i) {
+                bounds.push_back(long(rng() % (2 * n + 2)) - n - 1);
+            }
+            for (auto start : bounds) {
+                for (size_t k = 0; k < 8; ++k) {
+                    auto end = bounds[rng() % bounds.size()];
+                    BOOST_REQUIRE(m.count(start, end) == bits_operation::count(s, start, end));
+                    for (auto bit : { true, false }) {
+                        for (auto end_given : { true, false }) {
+                            BOOST_REQUIRE(m.pos(bit, start, end, end_given) == bits_operation::pos(s, bit, start, end, end_given));
+                        }
+                    }
+                }
+            }
+        });
+        return make_ready_future<>();
+    }
+
+    future<> bitop() {
+        with_allocator(allocator(), [this] {
+            std::mt19937_64 rng(23);
+            // the operands cover different chunks and sizes, in every encoding.
+            std::string a_ref, b_ref;
+            bitmap_lsa a, b;
+            fill(a, a_ref, rng, 0, 3 * bitmap_lsa::chunk_bits + 1000);
+            fill(b, b_ref, rng, bitmap_lsa::chunk_bits, 2 * bitmap_lsa::chunk_bits + 5);
+            for (uint64_t o = 2 * bitmap_lsa::chunk_bits; o < 2 * bitmap_lsa::chunk_bits + 9000; ++o) {
+                b.set(o, true);
+                set(b_ref, o, true);
+            }
+            for (auto op : { bitop_type::AND, bitop_type::OR, bitop_type::XOR }) {
+                for (auto swap : { false, true }) {
+                    auto& x = swap ? b : a;
+                    auto& y = swap ? a : b;
+                    auto& x_ref = swap ? b_ref : a_ref;
+                    auto& y_ref = swap ? a_ref : b_ref;
+                    bitmap_lsa r(x);
+                    r.combine(op, y);
+                    std::string expected(std::max(x_ref.size(), y_ref.size()), '\0');
+                    for (size_t i = 0; i < expected.size(); ++i) {
+                        uint8_t u = i < x_ref.size() ? x_ref[i] : 0, v = i < y_ref.size() ? y_ref[i] : 0;
+                        expected[i] = char(op == bitop_type::AND ? u & v : op == bitop_type::OR ? u | v : u ^ v);
+                    }
+                    BOOST_REQUIRE(r.size() == expected.size());
+                    BOOST_REQUIRE(read(r) == expected);
+                    BOOST_CHECK(r.count(0, -1) == popcount(expected));
+                }
+            }
+            for (auto src : { &a, &b }) {
+                auto& src_ref = src == &a ? a_ref : b_ref;
+                bitmap_lsa r;
+                r.combine(bitop_type::NOT, *src);
+                std::string expected(src_ref);
+                for (auto& c : expected) {
+                    c = char(~uint8_t(c));
+                }
+                BOOST_REQUIRE(r.size() == expected.size());
+                BOOST_REQUIRE(read(r) == expected);
+                BOOST_CHECK(r.cardinality() == popcount(expected));
+            }
+        });
+        return make_ready_future<>();
+    }
+
+    future<> serialize() {
+        with_allocator(allocator(), [this] {
+            std::mt19937_64 rng(24);
+            bitmap_lsa m;
+            std::string ref;
+            fill(m, ref, rng, 0, 2 * bitmap_lsa::chunk_bits);
+            for (uint64_t o = 5 * bitmap_lsa::chunk_bits; o < 5 * bitmap_lsa::chunk_bits + 5000; ++o) {
+                m.set(o, true);
+                set(ref, o, true);
+            }
+            std::vector<char> out;
+            m.serialize(out);
+            bitmap_lsa d;
+            d.deserialize(out.data(), out.size());
+            BOOST_CHECK(d.size() == m.size());
+            BOOST_CHECK(types(d) == types(m));
+            BOOST_CHECK(d.cardinality() == m.cardinality());
+            BOOST_CHECK(read(d) == ref);
+            std::vector<char> again;
+            d.serialize(again);
+            BOOST_CHECK(again == out);
+            // the empty bitmap of an emptied key keeps its size.
+            bitmap_lsa e;
+            e.set(100, true);
+            e.set(100, false);
+            out.clear();
+            e.serialize(out);
+            d.deserialize(out.data(), out.size());
+            BOOST_CHECK(d.size() == 13 && d.containers() == 0);
+            out.clear();
+            m.serialize(out);
+            BOOST_CHECK_THROW(d.deserialize(out.data(), out.size() - 1), std::runtime_error);
+            out[12 + 2] = 7;
+            BOOST_CHECK_THROW(d.deserialize(out.data(), out.size()), std::runtime_error);
+        });
+        return make_ready_future<>();
+    }
+
+    future<> directory_memory() {
+        auto before = bitmap_lsa::directory_memory();
+        with_allocator(allocator(), [before] {
+            bitmap_lsa m;
+            for (uint64_t k = 0; k < 100; ++k) {
+                m.set(k * bitmap_lsa::chunk_bits, true);
+            }
+            auto used = bitmap_lsa::directory_memory() - before;
+            BOOST_CHECK(used > 0 && used < m.memory_usage());
+            bitmap_lsa n;
+            n.combine(bitop_type::NOT, m);
+            BOOST_CHECK(bitmap_lsa::directory_memory() - before > used);
+        });
+        BOOST_CHECK(bitmap_lsa::directory_memory() == before);
+        return make_ready_future<>();
+    }
+    // SETBIT on a string grows it to the byte of the offset only, inline or not,
+    // and keeps its bytes.
+    future<> string_growth() {
+        with_allocator(allocator(), [] {
+            std::mt19937_64 rng(5);
+            for (auto initial : { "", "abcdefgh", "abcdefghijklmn", "abcdefghijklmnopqrstuvwxyz" }) {
+                std::string ref(initial);
+                managed_bytes s(reinterpret_cast<const int8_t*>(ref.data()), ref.size());
+                uint64_t offset = 0;
+                for (size_t i = 0; i < 2000; ++i) {
+                    // mostly past the end, by a bit, a byte, or many.
+                    switch (rng() % 4) {
+                    case 0: offset = rng() % (ref.size() * 8 + 1); break;
+                    case 1: offset = ref.size() * 8 + rng() % 8; break;
+                    case 2: offset = ref.size() * 8 + rng() % 64; break;
+                    default: offset = ref.size() * 8 + rng() % 100000; break;
+                    }
+                    auto value = rng() % 2 == 0;
+                    BOOST_REQUIRE(bits_operation::set(s, offset, value) == get(ref, offset));
+                    set(ref, offset, value);
+                    BOOST_REQUIRE(s.size() == ref.size());
+                    if (i % 100 == 0 || i == 1999) {
+                        std::string bytes;
+                        s.for_each_fragment([&bytes] (size_t, const int8_t* data, size_t size) {
+                            bytes.append(reinterpret_cast<const char*>(data), size);
+                            return true;
+                        });
+                        BOOST_REQUIRE(bytes == ref);
+                        BOOST_REQUIRE(bits_operation::count(s, 0, -1) == popcount(ref));
+                    }
+                }
+            }
+        });
+        return make_ready_future<>();
+    }
+private:
+    // the encodings of the containers, as serialized.
+    static std::vector<container_type> types(const bitmap_lsa& m) {
+        std::vector<char> out;
+        m.serialize(out);
+        std::vector<container_type> types;
+        for (size_t p = 12; p < out.size();) {
+            types.push_back(container_type(out[p + 2]));
+            uint32_t bytes;
+            std::memcpy(&bytes, out.data() + p + 7, sizeof(bytes));
+            p += 11 + le32toh(bytes);
+        }
+        return types;
+    }
+    static std::string read(const bitmap_lsa& m) {
+        std::string out(m.size(), '\0');
+        m.read(0, &out[0], out.size());
+        return out;
+    }
+    static void set(std::string& ref, uint64_t offset, bool value) {
+        if ((offset >> 3) >= ref.size()) {
+            ref.resize((offset >> 3) + 1, '\0');
+        }
+        auto mask = char(0x80 >> (offset & 7));
+        ref[offset >> 3] = value ? ref[offset >> 3] | mask : ref[offset >> 3] & ~mask;
+    }
+    static uint64_t popcount(const std::string& s) {
+        uint64_t n = 0;
+        for (auto c : s) {
+            n += __builtin_popcount(uint8_t(c));
+        }
+        return n;
+    }
+    // The bitmap and the string agree, by every way of reading them.
+    static void check_bytes(const bitmap_lsa& m) {
+        auto bytes = read(m);
+        BOOST_REQUIRE(m.cardinality() == popcount(bytes));
+        uint64_t n = 0;
+        m.for_each_set_bit([&bytes, &n] (uint64_t o) {
+            BOOST_REQUIRE(bytes[o >> 3] & (0x80 >> (o & 7)));
+            ++n;
+        });
+        BOOST_REQUIRE(n == m.cardinality());
+    }
+    // random bits in [first, last), sparse in the first chunk, dense in the others.
+    static void fill(bitmap_lsa& m, std::string& ref, std::mt19937_64& rng, uint64_t first, uint64_t last) {
+        for (uint64_t chunk = first; chunk < last; chunk += bitmap_lsa::chunk_bits) {
+            auto n = chunk == first ? 500 : 20000;
+            auto span = std::min<uint64_t>(bitmap_lsa::chunk_bits, last - chunk);
+            for (int i = 0; i < n; ++i) {
+                auto o = chunk + rng() % span;
+                auto v = rng() % 4 != 0;
+                BOOST_REQUIRE(m.set(o, v) == get(ref, o));
+                set(ref, o, v);
+            }
+        }
+        m.set(last - 1, true);
+        set(ref, last - 1, true);
+    }
+    static bool get(const std::string& ref, uint64_t offset) {
+        return (offset >> 3) < ref.size() && (ref[offset >> 3] & (0x80 >> (offset & 7)));
+    }
+};
+
+SEASTAR_TEST_CASE(bitmap_conversions) {
+    bitmap_holder h;
+    return h.conversions();
+}
+
+SEASTAR_TEST_CASE(bitmap_boundaries) {
+    bitmap_holder h;
+    return h.boundaries();
+}
+
+SEASTAR_TEST_CASE(bitmap_ranges) {
+    bitmap_holder h;
+    return h.ranges();
+}
+
+SEASTAR_TEST_CASE(bitmap_bitop) {
+    bitmap_holder h;
+    return h.bitop();
+}
+
+SEASTAR_TEST_CASE(bitmap_serialize) {
+    bitmap_holder h;
+    return h.serialize();
+}
+
+SEASTAR_TEST_CASE(bitmap_directory_memory) {
+    bitmap_holder h;
+    return h.directory_memory();
+}
+
+SEASTAR_TEST_CASE(bitmap_string_growth) {
+    bitmap_holder h;
+    return h.string_growth();
+}
+
+// Every kernel the cpu supports counts and finds the bits as the portable ones do,
+// at every alignment and on the lengths around their words and blocks.
+SEASTAR_TEST_CASE(bit_kernels) {
+    auto kernels = bits_operation::supported_kernels();
+    BOOST_REQUIRE(sstring(kernels.front().name) == "portable");
+    BOOST_REQUIRE(sstring(kernels.back().name) == bits_operation::kernel_name());
+    std::vector<size_t> sizes;
+    for (size_t size = 0; size <= 70; ++size) {
+        sizes.push_back(size);
+    }
+    // the blocks of 32 bytes, and the 31 of them summed at once by AVX2.
+    for (size_t size : { 95, 96, 97, 127, 128, 129, 991, 992, 993, 1023, 1024, 1025, 1984, 1985, 4095, 4096 }) {
+        sizes.push_back(size);
+    }
+    std::mt19937_64 rng(6);
+    std::vector<char> data(4096 + 64);
+    auto check = [&kernels] (const char* p, size_t size) {
+        auto count = bits_operation::popcount_scalar(p, size);
+        auto set = bits_operation::find_bit_scalar(p, size, true);
+        auto clear = bits_operation::find_bit_scalar(p, size, false);
+        auto u = reinterpret_cast<const uint8_t*>(p);
+        for (auto& k : kernels) {
+            BOOST_REQUIRE(k.popcount(u, size) == count);
+            BOOST_REQUIRE(k.find_bit(u, size, true) == set);
+            BOOST_REQUIRE(k.find_bit(u, size, false) == clear);
+        }
+        BOOST_REQUIRE(bits_operation::popcount(p, size) == count);
+        BOOST_REQUIRE(bits_operation::find_bit(p, size, true) == set);
+        BOOST_REQUIRE(bits_operation::find_bit(p, size, false) == clear);
+    };
+    // random bytes, then all clear and all set with a single bit flipped.
+    for (int pattern = 0; pattern < 3; ++pattern) {
+        for (auto& c : data) {
+            c = pattern == 0 ? char(rng()) : pattern == 1 ? 0 : char(0xff);
+        }
+        for (size_t offset = 0; offset < 33; ++offset) {
+            auto p = data.data() + offset;
+            for (auto size : sizes) {
+                check(p, size);
+                if (pattern == 0 || size == 0) {
+                    continue;
+                }
+                for (auto bit : { size_t(0), size * 8 - 1, size_t(rng() % (size * 8)) }) {
+                    p[bit >> 3] ^= char(0x80 >> (bit & 7));
+                    check(p, size);
+                    p[bit >> 3] ^= char(0x80 >> (bit & 7));
+                }
+            }
+        }
+    }
+    return make_ready_future<>();
+}
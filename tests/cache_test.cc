@@ -1,5 +1,8 @@
 #include "tests/test-utils.hh"
 #include "cache.hh"
+#include "core/sleep.hh"
+#include <random>
+#include <unordered_set>
 
 #include "util/log.hh"
 using logger =  seastar::logger;
@@ -9,6 +12,8 @@ using namespace redis;
 
 class cache_holder : private logalloc::region {
 public:
+    cache_holder() {}
+    explicit cache_holder(size_t bucket_count) : _c(bucket_count) {}
     ~cache_holder()
     {
         with_allocator(allocator(), [this] {
@@ -48,6 +53,180 @@ public:
         BOOST_CHECK(_c.empty());
         return make_ready_future<>();
     }
+
+    future<> rehash() {
+        static constexpr size_t count = 10000;
+        std::vector<sstring> keys;
+        for (size_t i = 0; i < count; ++i) {
+            keys.emplace_back(sprint("key-%d", i));
+        }
+        sstring val {"test"};
+        bool seen_rehashing = false;
+        with_allocator(allocator(), [this, &keys, &val, &seen_rehashing] {
+            for (auto& key : keys) {
+                redis_key rk { std::ref(key) };
+                auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), val);
+                _c.insert(entry);
+                seen_rehashing |= _c.rehashing();
+            }
+        });
+        BOOST_CHECK(seen_rehashing);
+        BOOST_CHECK(_c.size() == count);
+        // every key is reachable, whichever bucket array holds it.
+        for (auto& key : keys) {
+            redis_key rk { std::ref(key) };
+            BOOST_REQUIRE(_c.exists(rk));
+        }
+        with_allocator(allocator(), [this, &keys] {
+            for (size_t i = 0; i < count; i += 2) {
+                redis_key rk { std::ref(keys[i]) };
+                BOOST_CHECK(_c.erase(rk));
+            }
+        });
+        BOOST_CHECK(_c.size() == count / 2);
+        for (size_t i = 0; i < count; ++i) {
+            redis_key rk { std::ref(keys[i]) };
+            BOOST_REQUIRE(_c.exists(rk) == (i % 2 == 1));
+        }
+        BOOST_CHECK(_c.rehash_statistics()._started > 0);
+        return make_ready_future<>();
+    }
+
+    future<> snapshot() {
+        static constexpr size_t count = 10000;
+        std::vector<sstring> keys;
+        for (size_t i = 0; i < count; ++i) {
+            keys.emplace_back(sprint("key-%d", i));
+        }
+        sstring val {"test"};
+        std::unordered_set<sstring> seen;
+        size_t captured = 0;
+        with_allocator(allocator(), [this, &keys, &val, &seen, &captured] {
+            for (size_t i = 0; i < count / 2; ++i) {
+                redis_key rk { std::ref(keys[i]) };
+                _c.insert(current_allocator().construct<cache_entry>(rk.key(), rk.hash(), val));
+            }
+            _c.start_snapshot([&seen, &captured] (const cache_entry& e) {
+                seen.emplace(e.key_data(), e.key_size());
+                ++captured;
+            });
+            // the keys inserted or erased during the walk do not change what is captured,
+            // and the table does not grow while it is frozen.
+            auto buckets = _c.bucket_count();
+            size_t next = count / 2;
+            while (!_c.snapshot_step(std::chrono::microseconds(10))) {
+                for (size_t i = 0; i < 100 && next < count; ++i, ++next) {
+                    redis_key rk { std::ref(keys[next]) };
+                    _c.insert(current_allocator().construct<cache_entry>(rk.key(), rk.hash(), val));
+                    redis_key erased { std::ref(keys[next - count / 2]) };
+                    _c.erase(erased);
+                }
+                BOOST_REQUIRE(_c.bucket_count() == buckets);
+            }
+            _c.end_snapshot();
+        });
+        BOOST_CHECK(captured == count / 2);
+        for (size_t i = 0; i < count / 2; ++i) {
+            BOOST_REQUIRE(seen.count(keys[i]) == 1);
+        }
+        return make_ready_future<>();
+    }
+
+    future<> scan() {
+        static constexpr size_t count = 10000;
+        std::vector<sstring> keys;
+        for (size_t i = 0; i < count; ++i) {
+            keys.emplace_back(sprint("key-%d", i));
+        }
+        sstring val {"test"};
+        std::unordered_set<sstring> seen;
+        with_allocator(allocator(), [this, &keys, &val, &seen] {
+            for (size_t i = 0; i < count / 2; ++i) {
+                redis_key rk { std::ref(keys[i]) };
+                _c.insert(current_allocator().construct<cache_entry>(rk.key(), rk.hash(), val));
+            }
+            // the table grows while the scan is in progress, the keys which were
+            // there from the start are all returned anyway.
+            auto buckets = _c.bucket_count();
+            size_t next = count / 2;
+            size_t cursor = 0;
+            do {
+                cursor = _c.scan(cursor, 10, [&seen] (const cache_entry& e) {
+                    seen.emplace(e.key_data(), e.key_size());
+                });
+                for (size_t i = 0; i < 10 && next < count; ++i, ++next) {
+                    redis_key rk { std::ref(keys[next]) };
+                    _c.insert(current_allocator().construct<cache_entry>(rk.key(), rk.hash(), val));
+                }
+            } while (cursor != 0);
+            BOOST_CHECK(_c.bucket_count() > buckets);
+        });
+        for (size_t i = 0; i < count / 2; ++i) {
+            BOOST_REQUIRE(seen.count(keys[i]) == 1);
+        }
+        return make_ready_future<>();
+    }
+
+    future<> eviction() {
+        static constexpr size_t count = 1000;
+        std::vector<sstring> keys;
+        for (size_t i = 0; i < count; ++i) {
+            keys.emplace_back(sprint("key-%d", i));
+        }
+        sstring val {"test"};
+        with_allocator(allocator(), [this, &keys, &val] {
+            for (auto& key : keys) {
+                redis_key rk { std::ref(key) };
+                _c.insert(current_allocator().construct<cache_entry>(rk.key(), rk.hash(), val));
+            }
+        });
+        BOOST_CHECK(_c.eviction_candidate() == nullptr);
+        _c.set_eviction_policy(eviction_policy::allkeys_lru, 5);
+        BOOST_CHECK(_c.eviction_candidate() != nullptr);
+        // volatile-ttl only picks the keys with a timeout.
+        for (size_t i = 0; i < count; i += 10) {
+            redis_key rk { std::ref(keys[i]) };
+            BOOST_REQUIRE(_c.expire(rk, 3600 * 1000));
+        }
+        _c.set_eviction_policy(eviction_policy::volatile_ttl, 16);
+        for (size_t i = 0; i < 100; ++i) {
+            auto e = _c.eviction_candidate();
+            BOOST_REQUIRE(e == nullptr || e->ever_expires());
+        }
+        return make_ready_future<>();
+    }
+
+    future<> expiry() {
+        static constexpr size_t count = 10000;
+        _c.set_expired_entry_releaser([this] (cache_entry& e) {
+            with_allocator(allocator(), [this, &e] {
+                _c.erase(e);
+            });
+        });
+        auto keys = make_lw_shared<std::vector<sstring>>();
+        for (size_t i = 0; i < count; ++i) {
+            keys->emplace_back(sprint("key-%d", i));
+        }
+        sstring val {"test"};
+        with_allocator(allocator(), [this, &keys, &val] {
+            for (auto& key : *keys) {
+                redis_key rk { std::ref(key) };
+                _c.insert(current_allocator().construct<cache_entry>(rk.key(), rk.hash(), val));
+                BOOST_REQUIRE(_c.expire(rk, 1));
+            }
+        });
+        return sleep(std::chrono::milliseconds(100)).then([this, keys] {
+            // released by the active expiry, or on access.
+            for (auto& key : *keys) {
+                redis_key rk { std::ref(key) };
+                BOOST_REQUIRE(!_c.exists(rk));
+            }
+            BOOST_CHECK(_c.empty());
+            BOOST_CHECK(_c.expired_backlog() == 0);
+            auto& stats = _c.expire_statistics();
+            BOOST_CHECK(stats._active + stats._lazy == count);
+        });
+    }
 protected:
     cache _c;
 };
@@ -55,3 +234,301 @@ SEASTAR_TEST_CASE(cache_insert) {
     cache_holder h;
     return h.insert();
 }
+
+SEASTAR_TEST_CASE(cache_rehash) {
+    cache_holder h(4);
+    return h.rehash();
+}
+
+SEASTAR_TEST_CASE(cache_snapshot) {
+    cache_holder h(4);
+    return h.snapshot();
+}
+
+SEASTAR_TEST_CASE(cache_scan) {
+    cache_holder h(4);
+    return h.scan();
+}
+
+SEASTAR_TEST_CASE(cache_expiry) {
+    auto h = make_lw_shared<cache_holder>(4);
+    return h->expiry().finally([h] {});
+}
+
+SEASTAR_TEST_CASE(cache_eviction) {
+    cache_holder h(4);
+    return h.eviction();
+}
+
+class list_holder : private logalloc::region {
+public:
+    ~list_holder()
+    {
+        with_allocator(allocator(), [this] {
+           _l.clear();
+        });
+    }
+    future<> run() {
+        static constexpr size_t count = 5000;
+        with_allocator(allocator(), [this] {
+            for (size_t i = 0; i < count; ++i) {
+                if (i % 2 == 0) {
+                    _l.insert_tail(to_sstring(i));
+                }
+                else {
+                    _l.insert_head(to_sstring(i));
+                }
+            }
+            BOOST_REQUIRE(_l.size() == count);
+            // the odd values in descending order, then the even ones in ascending order.
+            for (size_t i = 0; i < count; ++i) {
+                size_t expected = i < count / 2 ? count - 1 - 2 * i : 2 * (i - count / 2);
+                BOOST_REQUIRE(as_sstring(_l.at(i)) == to_sstring(expected));
+            }
+            std::vector<bytes_view> range;
+            _l.range(count / 2, count / 2 + 3, range);
+            BOOST_REQUIRE(range.size() == 3);
+            BOOST_CHECK(as_sstring(range[0]) == "0" && as_sstring(range[2]) == "4");
+
+            // splits the chunk holding the even values.
+            _l.insert_at(count / 2 + 1, "pivot");
+            BOOST_CHECK(as_sstring(_l.at(count / 2)) == "0");
+            BOOST_CHECK(as_sstring(_l.at(count / 2 + 1)) == "pivot");
+            BOOST_CHECK(as_sstring(_l.at(count / 2 + 2)) == "2");
+            BOOST_CHECK(_l.index_of("pivot") == count / 2 + 1);
+            _l.set(count / 2 + 1, sstring(10000, 'x'));
+            BOOST_CHECK(_l.at(count / 2 + 1).size() == 10000);
+            auto erased = _l.trem<false, true>(sstring(10000, 'x'), 1);
+            BOOST_CHECK(erased == 1);
+            BOOST_REQUIRE(_l.size() == count);
+
+            BOOST_CHECK(as_sstring(_l.front()) == to_sstring(count - 1));
+            BOOST_CHECK(as_sstring(_l.back()) == to_sstring(count - 2));
+            _l.pop_front();
+            _l.pop_back();
+            _l.trim(10, 20);
+            BOOST_REQUIRE(_l.size() == 10);
+            BOOST_CHECK(as_sstring(_l.front()) == to_sstring(count - 23));
+        });
+        return make_ready_future<>();
+    }
+
+    // The chunks left nearly empty by removals are merged with their neighbours.
+    future<> merge() {
+        static constexpr size_t count = 20000;
+        static constexpr size_t max_chunk_bytes = 8192;
+        with_allocator(allocator(), [this] {
+            _l.clear();
+            for (size_t i = 0; i < count; ++i) {
+                _l.insert_tail(to_sstring(i));
+            }
+            // the inserts in the middle split the chunks.
+            for (size_t i = 0; i < 500; ++i) {
+                _l.insert_at(1 + i * 37, "x");
+            }
+            auto split = _l.chunk_count();
+            BOOST_REQUIRE(split > 500);
+            auto erased = _l.trem<true, true>("x", 0);
+            BOOST_REQUIRE(erased == 500);
+            // any two neighbours hold more than a chunk.
+            BOOST_CHECK(_l.chunk_count() <= 2 * bytes(0, count) / max_chunk_bytes + 1);
+            BOOST_CHECK(_l.chunk_count() < split);
+            for (size_t i = 0; i < count; i += 997) {
+                BOOST_REQUIRE(as_sstring(_l.at(i)) == to_sstring(i));
+            }
+
+            // the values of one chunk in four are removed.
+            for (size_t i = 0; i < count; i += 4) {
+                erased = _l.trem<false, false>(to_sstring(i), 1);
+                BOOST_REQUIRE(erased == 1);
+            }
+            BOOST_REQUIRE(_l.size() == count - count / 4);
+            for (size_t i = 0; i < 300; ++i) {
+                _l.insert_at(1 + i * 41, "x");
+            }
+            erased = _l.trem<true, false>("x", 0);
+            BOOST_REQUIRE(erased == 300);
+            BOOST_CHECK(_l.chunk_count() <= 2 * (bytes(0, count) - bytes_of_every_fourth(count)) / max_chunk_bytes + 1);
+
+            // the pops and the trims merge the chunks at the ends.
+            _l.clear();
+            for (size_t i = 0; i < count; ++i) {
+                _l.insert_tail(to_sstring(i));
+            }
+            for (size_t i = 0; i < 200; ++i) {
+                _l.insert_at(1 + i * 7, "x");
+                _l.insert_at(_l.size() - 1 - i * 7, "x");
+            }
+            while (as_sstring(_l.front()) != to_sstring(1500)) {
+                _l.pop_front();
+            }
+            while (as_sstring(_l.back()) != to_sstring(count - 1500)) {
+                _l.pop_back();
+            }
+            BOOST_CHECK(_l.chunk_count() <= 2 * bytes(1500, count - 1499) / max_chunk_bytes + 3);
+            _l.trim(1, _l.size() - 1);
+            BOOST_REQUIRE(as_sstring(_l.front()) == to_sstring(1501));
+            BOOST_REQUIRE(as_sstring(_l.back()) == to_sstring(count - 1501));
+        });
+        return make_ready_future<>();
+    }
+private:
+    static sstring as_sstring(bytes_view v) {
+        return sstring(reinterpret_cast<const char*>(v.data()), v.size());
+    }
+    // the bytes taken by the values in [from, to), with their sizes.
+    static size_t bytes(size_t from, size_t to) {
+        size_t n = 0;
+        for (size_t i = from; i < to; ++i) {
+            n += to_sstring(i).size() + 8;
+        }
+        return n;
+    }
+    static size_t bytes_of_every_fourth(size_t count) {
+        size_t n = 0;
+        for (size_t i = 0; i < count; i += 4) {
+            n += to_sstring(i).size() + 8;
+        }
+        return n;
+    }
+    list_lsa _l;
+};
+SEASTAR_TEST_CASE(list_quicklist) {
+    list_holder h;
+    return h.run();
+}
+
+SEASTAR_TEST_CASE(list_merge) {
+    list_holder h;
+    return h.merge();
+}
+
+// A dict stays packed while its fields fit into one contiguous buffer, whatever
+// its limits allow.
+class dict_holder : private logalloc::region {
+public:
+    dict_holder() : _limits { 100000, 255 }, _d(_limits) {}
+    ~dict_holder()
+    {
+        with_allocator(allocator(), [this] {
+           _d.flush_all();
+        });
+    }
+    future<> run() {
+        with_allocator(allocator(), [this] {
+            // 2 + 5 + 1 + 1 + 200 bytes a field.
+            size_t bytes = 0;
+            size_t i = 0;
+            for (; _d.packed(); ++i) {
+                bytes += 209;
+                BOOST_REQUIRE(_d.insert(sprint("f%04d", i), sstring(200, 'v')));
+            }
+            BOOST_CHECK(bytes > 16 * 1024 && bytes - 209 <= 16 * 1024);
+            BOOST_REQUIRE(_d.size() == i);
+            for (size_t j = 0; j < i; ++j) {
+                BOOST_REQUIRE(_d.exists(sprint("f%04d", j)));
+            }
+            // a value growing past the bound converts the dict as well.
+            _d.flush_all();
+            for (i = 0; i < 70; ++i) {
+                BOOST_REQUIRE(_d.insert(sprint("f%04d", i), sstring(200, 'v')));
+            }
+            BOOST_REQUIRE(_d.packed());
+            BOOST_REQUIRE(!_d.insert_or_update(sstring("f0000"), sstring(255, 'w')));
+            BOOST_REQUIRE(_d.packed());
+            for (i = 1; _d.packed(); ++i) {
+                BOOST_REQUIRE(!_d.insert_or_update(sprint("f%04d", i), sstring(255, 'w')));
+            }
+            BOOST_REQUIRE(_d.size() == 70);
+        });
+        return make_ready_future<>();
+    }
+private:
+    packed_limits _limits;
+    dict_lsa _d;
+};
+SEASTAR_TEST_CASE(dict_packed_bytes) {
+    dict_holder h;
+    return h.run();
+}
+
+// Random fields of packed dicts and of hash tables, with and without repeats: the
+// fields exist, their values come along, and every field is drawn sooner or later,
+// from both tables while they are rehashed.
+class dict_random_holder : private logalloc::region {
+public:
+    dict_random_holder() : _limits { 128, 64 }, _d(_limits) {}
+    ~dict_random_holder()
+    {
+        with_allocator(allocator(), [this] {
+           _d.flush_all();
+        });
+    }
+    future<> run() {
+        with_allocator(allocator(), [this] {
+            BOOST_REQUIRE(fetch(5, true).empty());
+            BOOST_REQUIRE(fetch(5, false).empty());
+            size_t size = 0;
+            // 300 and 1100 fields are drawn while the table grows to 512 and 2048 buckets.
+            for (auto target : { 1, 2, 50, 128, 129, 300, 1100, 3000 }) {
+                for (; size < size_t(target); ++size) {
+                    BOOST_REQUIRE(_d.insert(sprint("f%d", size), sprint("v%d", size)));
+                }
+                BOOST_REQUIRE(_d.packed() == (size <= 128));
+                check(size);
+            }
+            // the holes left by the erased fields are not drawn.
+            for (size_t i = 0; i < size; i += 3) {
+                BOOST_REQUIRE(_d.erase(sprint("f%d", i)));
+            }
+            check(_d.size());
+        });
+        return make_ready_future<>();
+    }
+private:
+    std::vector<sstring> fetch(size_t count, bool distinct) {
+        std::vector<dict_entry_view> entries;
+        _d.fetch_random(count, distinct, [this] (size_t n) { return _rng() % n; }, entries);
+        std::vector<sstring> keys;
+        for (auto& e : entries) {
+            sstring key(e.key_data(), e.key_size());
+            BOOST_REQUIRE(_d.exists(key));
+            BOOST_REQUIRE(e.type_of_bytes());
+            BOOST_REQUIRE(sstring(e.value_bytes_data(), e.value_bytes_size()) == "v" + key.substr(1));
+            keys.push_back(std::move(key));
+        }
+        return keys;
+    }
+
+    void check(size_t size) {
+        for (auto count : { size_t(1), size_t(2), size / 4, size / 3 + 1, size - 1, size, size + 1, size * 2 }) {
+            if (count == 0) {
+                continue;
+            }
+            auto distinct = fetch(count, true);
+            BOOST_REQUIRE(distinct.size() == std::min(count, size));
+            BOOST_REQUIRE(std::unordered_set<sstring>(distinct.begin(), distinct.end()).size() == distinct.size());
+            BOOST_REQUIRE(fetch(count, false).size() == count);
+        }
+        std::unordered_set<sstring> seen;
+        for (size_t i = 0; i < 100 && seen.size() < size; ++i) {
+            auto drawn = fetch(size, false);
+            seen.insert(drawn.begin(), drawn.end());
+        }
+        BOOST_REQUIRE(seen.size() == size);
+        seen.clear();
+        for (size_t i = 0; i < 100 * size && seen.size() < size; ++i) {
+            auto drawn = fetch(1, true);
+            seen.insert(drawn.begin(), drawn.end());
+        }
+        BOOST_REQUIRE(seen.size() == size);
+    }
+
+    std::mt19937 _rng { 3 };
+    packed_limits _limits;
+    dict_lsa _d;
+};
+SEASTAR_TEST_CASE(dict_random) {
+    dict_random_holder h;
+    return h.run();
+}
@@ -0,0 +1,106 @@
+#!/bin/bash
+#
+# Starts a cluster of two nodes on the loopback addresses 127.0.0.1 and 127.0.0.2,
+# as in the README, then writes keys through one node and reads them through the
+# other, so that about half of the requests are forwarded to the owner of their key.
+#
+#   tests/cluster_loopback.sh [path to pedis, build/release/pedis by default]
+#
+# Needs redis-cli, and curl to check the storage_proxy metrics.
+
+set -e
+
+PEDIS=${1:-build/release/pedis}
+KEYS=${KEYS:-1000}
+WORKDIR=$(mktemp -d)
+PIDS=()
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill "$pid" 2>/dev/null || true
+    done
+    wait 2>/dev/null || true
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $*" >&2
+    echo "the logs of the nodes are in $WORKDIR" >&2
+    trap - EXIT
+    for pid in "${PIDS[@]}"; do
+        kill "$pid" 2>/dev/null || true
+    done
+    exit 1
+}
+
+start_node() {
+    local node=$1 address=$2 port=$3 prometheus_port=$4
+    mkdir -p "$WORKDIR/$node"
+    REDIS_HOME="$WORKDIR/$node" "$PEDIS" --c 1 -m 1G --listen-address "$address" --seeds 127.0.0.1 \
+        --service-port "$port" --prometheus-port "$prometheus_port" > "$WORKDIR/$node.log" 2>&1 &
+    PIDS+=($!)
+}
+
+node1() {
+    redis-cli -h 127.0.0.1 -p 6379 "$@"
+}
+
+node2() {
+    redis-cli -h 127.0.0.2 -p 6380 "$@"
+}
+
+metric() {
+    local port=$1 name=$2
+    curl -s "http://127.0.0.1:$port/metrics" | awk -v name="redis_storage_proxy_$name" '$1 ~ "^" name { sum += $2 } END { print sum + 0 }'
+}
+
+start_node node1 127.0.0.1 6379 9180
+start_node node2 127.0.0.2 6380 9181
+
+# Both nodes serve once they agree on the ring: the keys written through the
+# first one are then read back through the second one.
+joined=0
+for attempt in $(seq 60); do
+    sleep 1
+    node1 PING > /dev/null 2>&1 && node2 PING > /dev/null 2>&1 || continue
+    missing=0
+    for i in $(seq 32); do
+        node1 SET "probe-$i" "$i" > /dev/null
+        [ "$(node2 GET "probe-$i")" = "$i" ] || missing=$((missing + 1))
+    done
+    if [ $missing -eq 0 ]; then
+        joined=1
+        break
+    fi
+done
+[ $joined -eq 1 ] || fail "the nodes did not form a cluster"
+
+for i in $(seq "$KEYS"); do
+    node1 SET "key-$i" "value-$i" > /dev/null
+done
+for i in $(seq "$KEYS"); do
+    [ "$(node2 GET "key-$i")" = "value-$i" ] || fail "GET key-$i through node2"
+done
+# the values of APPEND and INCR go through the forwarding as well.
+for i in $(seq 100); do
+    node2 APPEND "key-$i" "-tail" > /dev/null
+    node2 INCR "counter-$i" > /dev/null
+    node1 INCR "counter-$i" > /dev/null
+done
+for i in $(seq 100); do
+    [ "$(node1 GET "key-$i")" = "value-$i-tail" ] || fail "GET key-$i through node1 after APPEND"
+    [ "$(node2 GET "counter-$i")" = "2" ] || fail "GET counter-$i through node2"
+done
+
+if command -v curl > /dev/null; then
+    for port in 9180 9181; do
+        reads=$(metric $port forwarded_reads)
+        writes=$(metric $port forwarded_writes)
+        errors=$(metric $port forward_errors)
+        echo "node on prometheus port $port: forwarded $reads reads, $writes writes, $errors errors"
+        [ "$reads" -gt 0 ] && [ "$writes" -gt 0 ] || fail "no request was forwarded by the node on port $port"
+        [ "$errors" -eq 0 ] || fail "forward errors on port $port"
+    done
+fi
+echo "OK"
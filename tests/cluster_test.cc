@@ -0,0 +1,159 @@
+#include "tests/test-utils.hh"
+#include "core/thread.hh"
+#include "config.hh"
+#include "db.hh"
+#include "redis.hh"
+#include "redis_protocol.hh"
+#include "storage_proxy.hh"
+#include "token_ring_manager.hh"
+#include <map>
+
+using namespace redis;
+
+using command = redis_protocol_parser::command;
+
+// Two nodes compute the same ring from the same members, and a key is read from
+// the node owning the first token not below its hash.
+SEASTAR_TEST_CASE(ring_set_endpoints) {
+    gms::inet_address node1(sstring("127.0.0.1")), node2(sstring("127.0.0.2"));
+    token_ring_manager a, b;
+    a.set_endpoints({ node1, node2 });
+    b.set_endpoints({ node2, node1 });
+    BOOST_REQUIRE(a.get_endpoint_count() == 2);
+    BOOST_CHECK(a.is_member(node1) && a.is_member(node2));
+    BOOST_CHECK(!a.is_member(gms::inet_address(sstring("127.0.0.3"))));
+    std::map<token, gms::inet_address> owners;
+    for (auto& node : { node1, node2 }) {
+        auto tokens = a.get_tokens(node);
+        BOOST_REQUIRE(tokens == b.get_tokens(node));
+        for (auto t : tokens) {
+            owners.emplace(t, node);
+        }
+    }
+    std::map<gms::inet_address, size_t> keys;
+    for (size_t i = 0; i < 10000; ++i) {
+        auto key = sprint("key-%d", i);
+        redis_key rk { key };
+        auto it = owners.lower_bound(rk.hash());
+        auto expected = it == owners.end() ? owners.begin()->second : it->second;
+        auto owner = a.get_replica_node_for_read(rk);
+        BOOST_REQUIRE(owner == expected);
+        BOOST_REQUIRE(b.get_replica_node_for_read(rk) == owner);
+        auto writes = a.get_replica_nodes_for_write(rk);
+        BOOST_REQUIRE(writes.size() == 1 && writes[0] == owner);
+        ++keys[owner];
+    }
+    // the vnodes spread the keys over both nodes.
+    BOOST_CHECK(keys[node1] > 4000 && keys[node2] > 4000);
+    // a node which leaves gives its keys to the other one.
+    a.set_endpoints({ node1 });
+    for (size_t i = 0; i < 100; ++i) {
+        auto key = sprint("key-%d", i);
+        redis_key rk { key };
+        BOOST_REQUIRE(a.get_replica_node_for_read(rk) == node1);
+    }
+    return make_ready_future<>();
+}
+
+// The arguments as redis_protocol parses them: the values which are stored as they
+// were received are only in the views.
+static args_collection make_args(std::vector<sstring> args, std::function<bool (size_t)> by_view)
+{
+    args_collection a;
+    a._command_args_count = args.size();
+    for (size_t i = 0; i < args.size(); ++i) {
+        a._command_views.emplace_back(args[i].data(), args[i].size());
+        a._command_args.emplace_back(by_view(i) ? sstring() : args[i]);
+    }
+    return a;
+}
+
+static bool by_key(size_t) {
+    return false;
+}
+
+SEASTAR_TEST_CASE(routed_commands) {
+    auto routed = [] (command c, std::vector<sstring> args) {
+        return redis_protocol::routed(c, make_args(std::move(args), by_key));
+    };
+    BOOST_CHECK(routed(command::get, { "k" }));
+    BOOST_CHECK(routed(command::set, { "k", "v" }));
+    BOOST_CHECK(routed(command::hset, { "h", "f", "v" }));
+    BOOST_CHECK(routed(command::zadd, { "z", "1", "m" }));
+    BOOST_CHECK(!routed(command::ping, {}));
+    BOOST_CHECK(!routed(command::scan, { "0" }));
+    // several keys are served by the node receiving them.
+    BOOST_CHECK(routed(command::del, { "a" }));
+    BOOST_CHECK(!routed(command::del, { "a", "b" }));
+    BOOST_CHECK(routed(command::exists, { "a" }));
+    BOOST_CHECK(!routed(command::exists, { "a", "b" }));
+    BOOST_CHECK(routed(command::pfcount, { "a" }));
+    BOOST_CHECK(!routed(command::pfcount, { "a", "b" }));
+    BOOST_CHECK(!routed(command::mget, { "a" }));
+    BOOST_CHECK(!routed(command::mset, { "a", "1" }));
+    BOOST_CHECK(!routed(command::sinter, { "a", "b" }));
+    BOOST_CHECK(!routed(command::sintercard, { "1", "a" }));
+    BOOST_CHECK(!routed(command::sunionstore, { "d", "a" }));
+    BOOST_CHECK(!routed(command::zunionstore, { "d", "1", "a" }));
+    BOOST_CHECK(!routed(command::bitop, { "AND", "d", "a" }));
+    BOOST_CHECK(!routed(command::pfmerge, { "d", "a" }));
+    BOOST_CHECK(!routed(command::smove, { "a", "b", "m" }));
+    BOOST_CHECK(!routed(command::geosearchstore, { "d", "a", "FROMLONLAT", "0", "0", "BYRADIUS", "1", "m" }));
+    // as are the searches storing their result into another key.
+    BOOST_CHECK(routed(command::georadius, { "g", "0", "0", "1", "m" }));
+    BOOST_CHECK(routed(command::georadius, { "g", "0", "0", "1", "m", "COUNT", "3" }));
+    BOOST_CHECK(!routed(command::georadius, { "g", "0", "0", "1", "m", "STORE", "d" }));
+    BOOST_CHECK(!routed(command::georadius, { "g", "0", "0", "1", "m", "storedist", "d" }));
+    BOOST_CHECK(routed(command::georadiusbymember, { "g", "m", "1", "m" }));
+    BOOST_CHECK(!routed(command::georadiusbymember, { "g", "m", "1", "m", "Store", "d" }));
+    BOOST_CHECK(routed(command::geosearch, { "g", "FROMMEMBER", "m", "BYRADIUS", "1", "m" }));
+    return make_ready_future<>();
+}
+
+static sstring bulk(const sstring& s) {
+    return sprint("$%d\r\n%s\r\n", s.size(), s);
+}
+
+static sstring multi_bulk(std::vector<sstring> args) {
+    auto out = sprint("*%d\r\n", args.size());
+    for (auto& a : args) {
+        out += bulk(a);
+    }
+    return out;
+}
+
+// A request forwarded by another node is encoded as the client sent it, its values
+// included though they are only in the views, and executed here.
+SEASTAR_TEST_CASE(forward_round_trip) {
+    return seastar::async([] {
+        redis::config cfg;
+        get_database().start(std::ref(cfg)).get();
+        get_redis_service().start().get();
+
+        auto value = sstring(10000, 'v');
+        auto set = make_args({ "key", value }, [] (size_t i) { return i == 1; });
+        auto request = storage_proxy::encode_request(command::set, set);
+        BOOST_REQUIRE(request == multi_bulk({ "set", "key", value }));
+        BOOST_REQUIRE(storage_proxy::serve(request).get0() == "+OK\r\n");
+        BOOST_REQUIRE(storage_proxy::serve(multi_bulk({ "get", "key" })).get0() == bulk(value));
+
+        auto append = make_args({ "key", "tail" }, [] (size_t i) { return i == 1; });
+        request = storage_proxy::encode_request(command::append, append);
+        BOOST_REQUIRE(request == multi_bulk({ "append", "key", "tail" }));
+        BOOST_REQUIRE(storage_proxy::serve(request).get0() == sprint(":%d\r\n", value.size() + 4));
+        BOOST_REQUIRE(storage_proxy::serve(multi_bulk({ "get", "key" })).get0() == bulk(value + "tail"));
+
+        auto mset = make_args({ "a", "1", "b", "", "c", "\r\n" }, [] (size_t i) { return i % 2 == 1; });
+        request = storage_proxy::encode_request(command::mset, mset);
+        BOOST_REQUIRE(request == multi_bulk({ "mset", "a", "1", "b", "", "c", "\r\n" }));
+        BOOST_REQUIRE(storage_proxy::serve(request).get0() == "+OK\r\n");
+        BOOST_REQUIRE(storage_proxy::serve(multi_bulk({ "mget", "a", "b", "c" })).get0() == "*3\r\n" + bulk("1") + bulk("") + bulk("\r\n"));
+
+        // a pipelined run is served as one request, its replies in order.
+        auto run = multi_bulk({ "incr", "n" }) + multi_bulk({ "incr", "n" }) + multi_bulk({ "get", "n" });
+        BOOST_REQUIRE(storage_proxy::serve(run).get0() == ":1\r\n:2\r\n" + bulk("2"));
+
+        get_redis_service().stop().get();
+        get_database().stop().get();
+    });
+}
@@ -0,0 +1,727 @@
+#include "tests/test-utils.hh"
+#include "core/thread.hh"
+#include "config.hh"
+#include "db.hh"
+#include "redis.hh"
+#include "redis_protocol.hh"
+#include "storage_proxy.hh"
+#include <algorithm>
+#include <map>
+#include <random>
+#include <set>
+#include <strings.h>
+
+using namespace redis;
+
+static sstring bulk(const sstring& s) {
+    return sprint("$%d\r\n%s\r\n", s.size(), s);
+}
+
+static sstring multi_bulk(std::vector<sstring> args) {
+    auto out = sprint("*%d\r\n", args.size());
+    for (auto& a : args) {
+        out += bulk(a);
+    }
+    return out;
+}
+
+static sstring serve(std::vector<sstring> args)
+{
+    return storage_proxy::serve(multi_bulk(std::move(args))).get0();
+}
+
+// The bulk strings of a multi bulk reply, in order.
+static std::vector<sstring> elements(const sstring& reply)
+{
+    std::vector<sstring> out;
+    if (reply.empty() || reply[0] != '*') {
+        return out;
+    }
+    auto p = reply.c_str();
+    auto count = std::strtol(p + 1, nullptr, 10);
+    p = std::strchr(p, '\n') + 1;
+    for (long i = 0; i < count; ++i) {
+        BOOST_REQUIRE(*p == '$');
+        auto size = std::strtol(p + 1, nullptr, 10);
+        p = std::strchr(p, '\n') + 1;
+        out.emplace_back(p, size);
+        p += size + 2;
+    }
+    return out;
+}
+
+static std::vector<sstring> sorted(std::vector<sstring> v)
+{
+    std::sort(v.begin(), v.end());
+    return v;
+}
+
+// A fresh server, its commands served through storage_proxy as the other nodes
+// forward them.
+class server {
+    redis::config _cfg;
+public:
+    server() {
+        _cfg.enable_commitlog(false);
+        get_database().start(std::ref(_cfg)).get();
+        get_redis_service().start().get();
+    }
+    ~server() {
+        get_redis_service().stop().get();
+        get_database().stop().get();
+    }
+};
+
+// SINTER, SINTERCARD and SDIFF check the type of every key, even once the result
+// is known to be empty, as the stores do.
+SEASTAR_TEST_CASE(set_algebra_wrong_type) {
+    return seastar::async([] {
+        server s;
+        serve({ "sadd", "a", "x", "y" });
+        serve({ "set", "str", "value" });
+        for (auto& keys : std::vector<std::vector<sstring>> { { "a", "str" }, { "str", "a" }, { "missing", "str" } }) {
+            BOOST_REQUIRE(serve({ "sinter", keys[0], keys[1] }) == msg_type_err);
+            BOOST_REQUIRE(serve({ "sintercard", "2", keys[0], keys[1] }) == msg_type_err);
+            BOOST_REQUIRE(serve({ "sdiff", keys[0], keys[1] }) == msg_type_err);
+            BOOST_REQUIRE(serve({ "sinterstore", "d", keys[0], keys[1] }) == msg_type_err);
+            BOOST_REQUIRE(serve({ "sdiffstore", "d", keys[0], keys[1] }) == msg_type_err);
+            BOOST_REQUIRE(serve({ "exists", "d" }) == ":0\r\n");
+        }
+        BOOST_REQUIRE(serve({ "sintercard", "1", "str" }) == msg_type_err);
+        BOOST_REQUIRE(sorted(elements(serve({ "sdiff", "a", "missing" }))) == std::vector<sstring>({ "x", "y" }));
+        BOOST_REQUIRE(serve({ "sintercard", "2", "a", "missing" }) == ":0\r\n");
+    });
+}
+
+// numkeys must match the keys given, and LIMIT is a keyword in any case followed by
+// a count which is not negative.
+SEASTAR_TEST_CASE(sintercard_arguments) {
+    return seastar::async([] {
+        server s;
+        serve({ "sadd", "a", "1", "2", "3", "4" });
+        serve({ "sadd", "b", "2", "3", "4", "5" });
+        BOOST_REQUIRE(serve({ "sintercard", "2", "a", "b" }) == ":3\r\n");
+        for (auto limit : { "limit", "LIMIT", "LiMiT" }) {
+            BOOST_REQUIRE(serve({ "sintercard", "2", "a", "b", limit, "2" }) == ":2\r\n");
+            BOOST_REQUIRE(serve({ "sintercard", "2", "a", "b", limit, "0" }) == ":3\r\n");
+            BOOST_REQUIRE(serve({ "sintercard", "2", "a", "b", limit, "10" }) == ":3\r\n");
+            BOOST_REQUIRE(serve({ "sintercard", "1", "a", limit, "1" }) == ":1\r\n");
+        }
+        std::vector<std::vector<sstring>> invalid = {
+            { "sintercard", "0", "a" },
+            { "sintercard", "-1", "a" },
+            { "sintercard", "3", "a", "b" },
+            { "sintercard", "1", "a", "b" },
+            { "sintercard", "x", "a" },
+            { "sintercard", "99999999999999999999", "a" },
+            { "sintercard", "2", "a", "b", "limit" },
+            { "sintercard", "2", "a", "b", "limit", "-1" },
+            { "sintercard", "2", "a", "b", "limit", "x" },
+            { "sintercard", "2", "a", "b", "limit", "99999999999999999999" },
+            { "sintercard", "2", "a", "b", "limits", "1" },
+            { "sintercard", "2", "a", "b", "limit", "1", "extra" },
+        };
+        for (auto& args : invalid) {
+            BOOST_REQUIRE(serve(args) == msg_syntax_err);
+        }
+    });
+}
+
+// The smallest set drives the intersection whatever the order of the keys: the
+// members come in the order of that set and an empty or missing set ends it.
+SEASTAR_TEST_CASE(sinter_smallest_first) {
+    return seastar::async([] {
+        server s;
+        std::vector<sstring> big = { "sadd", "big" };
+        std::vector<sstring> mid = { "sadd", "mid" };
+        for (size_t i = 0; i < 1000; ++i) {
+            big.push_back(sprint("m%d", i));
+            if (i % 2 == 0) {
+                mid.push_back(sprint("m%d", i));
+            }
+        }
+        serve(big);
+        serve(mid);
+        std::vector<sstring> small = { "sadd", "small" };
+        for (size_t i = 0; i < 40; ++i) {
+            small.push_back(sprint("m%d", i * 5));
+        }
+        small.push_back("only-small");
+        serve(small);
+
+        std::vector<sstring> expected;
+        for (auto& m : elements(serve({ "smembers", "small" }))) {
+            auto n = std::atoi(m.c_str() + 1);
+            if (m[0] == 'm' && n % 2 == 0) {
+                expected.push_back(m);
+            }
+        }
+        BOOST_REQUIRE(expected.size() == 20);
+        for (auto& keys : std::vector<std::vector<sstring>> { { "big", "mid", "small" }, { "small", "mid", "big" }, { "mid", "small", "big" } }) {
+            BOOST_REQUIRE(elements(serve({ "sinter", keys[0], keys[1], keys[2] })) == expected);
+            BOOST_REQUIRE(serve({ "sintercard", "3", keys[0], keys[1], keys[2] }) == ":20\r\n");
+            BOOST_REQUIRE(serve({ "sintercard", "3", keys[0], keys[1], keys[2], "limit", "5" }) == ":5\r\n");
+        }
+        // the stored members are the reply.
+        BOOST_REQUIRE(elements(serve({ "sinterstore", "d", "big", "small", "mid" })) == expected);
+        BOOST_REQUIRE(sorted(elements(serve({ "smembers", "d" }))) == sorted(expected));
+        BOOST_REQUIRE(serve({ "sintercard", "3", "big", "missing", "small" }) == ":0\r\n");
+        BOOST_REQUIRE(serve({ "sinter", "big", "small", "missing" }) == msg_nil);
+    });
+}
+
+static sstring integer(size_t n)
+{
+    return sprint(":%d\r\n", n);
+}
+
+// SRANDMEMBER and HRANDFIELD draw distinct members for a positive count, all of
+// them once the count reaches the size, and may repeat them for a negative count;
+// packed collections and hash tables alike.
+SEASTAR_TEST_CASE(random_members) {
+    return seastar::async([] {
+        server s;
+        for (size_t size : { 5, 1000 }) {
+            auto set = sprint("set%d", size), hash = sprint("hash%d", size);
+            std::vector<sstring> members;
+            for (size_t i = 0; i < size; ++i) {
+                members.push_back(sprint("m%d", i));
+                serve({ "sadd", set, members.back() });
+                serve({ "hset", hash, members.back(), sprint("v%d", i) });
+            }
+            auto all = sorted(members);
+            for (auto& key : { set, hash }) {
+                auto command = key == set ? "srandmember" : "hrandfield";
+                for (size_t count : { size_t(1), size_t(3), size - 1, size, size + 1, size * 3 }) {
+                    auto drawn = sorted(elements(serve({ command, key, sprint("%d", count) })));
+                    BOOST_REQUIRE(drawn.size() == std::min(count, size));
+                    BOOST_REQUIRE(std::unique(drawn.begin(), drawn.end()) == drawn.end());
+                    BOOST_REQUIRE(std::includes(all.begin(), all.end(), drawn.begin(), drawn.end()));
+                    if (count >= size) {
+                        BOOST_REQUIRE(drawn == all);
+                    }
+                    auto repeated = sorted(elements(serve({ command, key, sprint("-%d", count) })));
+                    BOOST_REQUIRE(repeated.size() == count);
+                    auto last = std::unique(repeated.begin(), repeated.end());
+                    BOOST_REQUIRE(std::includes(all.begin(), all.end(), repeated.begin(), last));
+                }
+                // more draws than members must repeat some.
+                auto repeated = sorted(elements(serve({ command, key, sprint("-%d", size * 3) })));
+                BOOST_REQUIRE(std::unique(repeated.begin(), repeated.end()) != repeated.end());
+                auto one = serve({ command, key });
+                BOOST_REQUIRE(one[0] == '$');
+                BOOST_REQUIRE(serve({ command, key, "0" }) == msg_empty_multi_bulk);
+            }
+            // every field comes with its own value.
+            for (auto count : { "3", "-3", "100000", "-100000" }) {
+                auto pairs = elements(serve({ "hrandfield", hash, count, "withvalues" }));
+                BOOST_REQUIRE(pairs.size() % 2 == 0 && !pairs.empty());
+                for (size_t i = 0; i < pairs.size(); i += 2) {
+                    BOOST_REQUIRE(pairs[i + 1] == "v" + pairs[i].substr(1));
+                }
+            }
+        }
+        BOOST_REQUIRE(serve({ "srandmember", "missing", "3" }) == msg_empty_multi_bulk);
+        BOOST_REQUIRE(serve({ "hrandfield", "missing", "-3" }) == msg_empty_multi_bulk);
+        serve({ "set", "str", "value" });
+        BOOST_REQUIRE(serve({ "srandmember", "str", "3" }) == msg_type_err);
+        BOOST_REQUIRE(serve({ "hrandfield", "str", "3" }) == msg_type_err);
+    });
+}
+
+// SPOP removes exactly the members it returns.
+SEASTAR_TEST_CASE(spop_removes) {
+    return seastar::async([] {
+        server s;
+        for (size_t size : { 5, 1000 }) {
+            auto key = sprint("set%d", size);
+            std::set<sstring> left;
+            for (size_t i = 0; i < size; ++i) {
+                left.insert(sprint("m%d", i));
+                serve({ "sadd", key, sprint("m%d", i) });
+            }
+            auto pop = [&] (std::vector<sstring> popped) {
+                for (auto& m : popped) {
+                    BOOST_REQUIRE(left.erase(m) == 1);
+                    BOOST_REQUIRE(serve({ "sismember", key, m }) == ":0\r\n");
+                }
+                BOOST_REQUIRE(serve({ "scard", key }) == integer(left.size()));
+            };
+            auto one = serve({ "spop", key });
+            BOOST_REQUIRE(one[0] == '$');
+            pop({ one.substr(one.find('\n') + 1, one.size() - one.find('\n') - 3) });
+            auto popped = elements(serve({ "spop", key, "2" }));
+            BOOST_REQUIRE(popped.size() == 2);
+            pop(popped);
+            popped = elements(serve({ "spop", key, sprint("%d", size / 3) }));
+            BOOST_REQUIRE(popped.size() == size / 3);
+            pop(popped);
+            BOOST_REQUIRE(serve({ "spop", key, "-1" }) == msg_syntax_err);
+            popped = elements(serve({ "spop", key, sprint("%d", size) }));
+            BOOST_REQUIRE(std::set<sstring>(popped.begin(), popped.end()) == left);
+            pop(popped);
+            BOOST_REQUIRE(left.empty());
+            BOOST_REQUIRE(serve({ "exists", key }) == ":0\r\n");
+        }
+    });
+}
+
+// A connection whose requests arrive in the given pieces, as the reads return them.
+static sstring pipeline(const std::vector<sstring>& pieces)
+{
+    redis_protocol proto;
+    proto.serve_locally();
+    reply_buffer replies;
+    request_latency_tracer tracer;
+    for (auto& piece : pieces) {
+        proto.handle(temporary_buffer<char>(piece.data(), piece.size()), replies.stream(), tracer).get();
+    }
+    return replies.collect().get0();
+}
+
+// The replies of a pipeline come in the order of its requests, whether they run
+// together with their pipelinable neighbours or alone, and wherever the reads cut
+// the data.
+SEASTAR_TEST_CASE(pipelined_runs) {
+    return seastar::async([] {
+        server s;
+        sstring requests, expected;
+        auto add = [&] (std::vector<sstring> args, sstring reply) {
+            requests += multi_bulk(std::move(args));
+            expected += reply;
+        };
+        add({ "set", "a", "1" }, "+OK\r\n");
+        add({ "incr", "a" }, ":2\r\n");
+        add({ "type", "a" }, "+string\r\n");
+        add({ "incr", "a" }, ":3\r\n");
+        add({ "get", "a" }, bulk("3"));
+        add({ "sadd", "s", "x" }, ":1\r\n");
+        add({ "sinter", "s" }, "*1\r\n" + bulk("x"));
+        add({ "sinter", "s", "s" }, "*1\r\n" + bulk("x"));
+        add({ "sismember", "s", "x" }, ":1\r\n");
+        add({ "append", "a", "0" }, ":2\r\n");
+        add({ "strlen", "a" }, ":2\r\n");
+        add({ "mget", "a", "a" }, "*2\r\n" + bulk("30") + bulk("30"));
+        for (size_t i = 1; i <= 100; ++i) {
+            add({ "rpush", "l", sprint("%d", i) }, integer(i));
+            if (i % 7 == 0) {
+                add({ "lrange", "l", "-1", "-1" }, "*1\r\n" + bulk(sprint("%d", i)));
+                add({ "type", "l" }, "+list\r\n");
+            }
+        }
+        add({ "del", "a", "s", "l" }, ":3\r\n");
+        add({ "exists", "a" }, ":0\r\n");
+        BOOST_REQUIRE(pipeline({ requests }) == expected);
+
+        // the request cut by a read is completed by the next one, its arguments are
+        // not those of the data which follows.
+        auto head = requests.substr(0, requests.find("*3\r\n$5\r\nrpush") + 200);
+        for (size_t cut = 1; cut < head.size(); ++cut) {
+            auto replies = pipeline({ requests.substr(0, cut), requests.substr(cut) });
+            BOOST_REQUIRE(replies == expected);
+        }
+        BOOST_REQUIRE(pipeline({ requests.substr(0, 3), requests.substr(3, 1), requests.substr(4, 20), requests.substr(24) }) == expected);
+        std::vector<sstring> bytes;
+        for (size_t i = 0; i < head.size(); ++i) {
+            bytes.push_back(head.substr(i, 1));
+        }
+        bytes.push_back(requests.substr(head.size()));
+        BOOST_REQUIRE(pipeline(bytes) == expected);
+    });
+}
+
+// A request failing in the middle of a run replies an error, the others of the run
+// and of the next ones reply as they would without it.
+SEASTAR_TEST_CASE(pipelined_run_failure) {
+    return seastar::async([] {
+        server s;
+        // the offset overflows the integer it is parsed into, which throws.
+        auto requests = multi_bulk({ "set", "a", "1" }) + multi_bulk({ "incr", "a" })
+            + multi_bulk({ "getbit", "a", "99999999999999999999" })
+            + multi_bulk({ "incr", "a" }) + multi_bulk({ "get", "a" })
+            + multi_bulk({ "type", "a" }) + multi_bulk({ "getbit", "a", "99999999999999999999" })
+            + multi_bulk({ "incr", "a" });
+        auto expected = "+OK\r\n:2\r\n" + msg_err + ":3\r\n" + bulk("3") + "+string\r\n" + msg_err + ":4\r\n";
+        BOOST_REQUIRE(pipeline({ requests }) == expected);
+        // the first request of the run, which replies to the connection itself.
+        BOOST_REQUIRE(pipeline({ multi_bulk({ "getbit", "a", "99999999999999999999" }) + multi_bulk({ "incr", "a" }) }) == msg_err + ":5\r\n");
+    });
+}
+
+using zset_model = std::map<sstring, double>;
+
+static zset_model zset_of(const sstring& key)
+{
+    zset_model m;
+    auto e = elements(serve({ "zrange", key, "0", "-1", "withscores" }));
+    for (size_t i = 0; i < e.size(); i += 2) {
+        m[e[i]] = std::stod(e[i + 1].c_str());
+    }
+    return m;
+}
+
+static void zadd(const sstring& key, const zset_model& m)
+{
+    std::vector<sstring> args = { "zadd", key };
+    for (auto& e : m) {
+        args.push_back(sprint("%.17g", e.second));
+        args.push_back(e.first);
+        if (args.size() == 1002) {
+            serve(args);
+            args.resize(2);
+        }
+    }
+    if (args.size() > 2) {
+        serve(args);
+    }
+}
+
+// What ZUNIONSTORE and ZINTERSTORE store, as the documentation of Redis defines it.
+static zset_model combine(const std::vector<zset_model>& sources, const std::vector<double>& weights, const sstring& aggregate, bool intersect)
+{
+    zset_model out;
+    std::map<sstring, size_t> matched;
+    for (size_t i = 0; i < sources.size(); ++i) {
+        for (auto& e : sources[i]) {
+            auto weighted = e.second * weights[i];
+            auto it = out.find(e.first);
+            if (it == out.end()) {
+                out.emplace(e.first, weighted);
+            }
+            else if (strcasecmp(aggregate.c_str(), "MIN") == 0) {
+                it->second = std::min(it->second, weighted);
+            }
+            else if (strcasecmp(aggregate.c_str(), "MAX") == 0) {
+                it->second = std::max(it->second, weighted);
+            }
+            else {
+                it->second += weighted;
+            }
+            ++matched[e.first];
+        }
+    }
+    if (intersect) {
+        for (auto& m : matched) {
+            if (m.second < sources.size()) {
+                out.erase(m.first);
+            }
+        }
+    }
+    return out;
+}
+
+// Sources of several batches on their own shards, weighted and aggregated in every
+// way the options allow.
+SEASTAR_TEST_CASE(zstore_weights_aggregate) {
+    return seastar::async([] {
+        server s;
+        std::vector<zset_model> sources(3);
+        for (size_t i = 0; i < 3000; ++i) {
+            sources[0][sprint("m%d", i)] = double(i % 17) / 2;
+            if (i % 2 == 0) {
+                sources[1][sprint("m%d", i)] = -double(i % 5);
+            }
+            if (i % 300 == 0) {
+                sources[2][sprint("m%d", i)] = double(i) / 4;
+            }
+        }
+        for (size_t i = 0; i < 1500; ++i) {
+            sources[1][sprint("n%d", i)] = 1.5;
+        }
+        sources[2]["zz"] = 7;
+        std::vector<sstring> keys = { "za", "zb", "zc" };
+        for (size_t i = 0; i < 3; ++i) {
+            zadd(keys[i], sources[i]);
+            BOOST_REQUIRE(zset_of(keys[i]) == sources[i]);
+        }
+        for (auto command : { "zunionstore", "zinterstore" }) {
+            bool intersect = sstring(command) == "zinterstore";
+            for (auto weighted : { false, true }) {
+                for (auto aggregate : { "", "sum", "MIN", "Max" }) {
+                    std::vector<sstring> args = { command, "dest", "3", "za", "zb", "zc" };
+                    std::vector<double> weights = { 1, 1, 1 };
+                    if (weighted) {
+                        args.insert(args.end(), { "weights", "2", "0.5", "-1" });
+                        weights = { 2, 0.5, -1 };
+                    }
+                    if (*aggregate) {
+                        args.insert(args.end(), { "AGGREGATE", aggregate });
+                    }
+                    auto expected = combine(sources, weights, aggregate, intersect);
+                    BOOST_REQUIRE(serve(args) == integer(expected.size()));
+                    BOOST_REQUIRE(zset_of("dest") == expected);
+                }
+            }
+        }
+        // the options in the other order, the last one given winning.
+        auto expected = combine(sources, { 3, 1, 1 }, "MIN", false);
+        BOOST_REQUIRE(serve({ "zunionstore", "dest", "3", "za", "zb", "zc", "aggregate", "max", "aggregate", "min", "WEIGHTS", "1", "1", "1", "weights", "3", "1", "1" }) == integer(expected.size()));
+        BOOST_REQUIRE(zset_of("dest") == expected);
+
+        std::vector<std::vector<sstring>> invalid = {
+            { "zunionstore", "dest", "0", "za" },
+            { "zunionstore", "dest", "-1", "za" },
+            { "zunionstore", "dest", "x", "za" },
+            { "zunionstore", "dest", "99999999999999999999", "za" },
+            { "zunionstore", "dest", "3", "za", "zb" },
+            { "zunionstore", "dest", "2", "za", "zb", "weights", "1" },
+            { "zunionstore", "dest", "2", "za", "zb", "weights", "1", "x" },
+            { "zunionstore", "dest", "2", "za", "zb", "weights", "1", "1e999" },
+            { "zunionstore", "dest", "2", "za", "zb", "aggregate" },
+            { "zunionstore", "dest", "2", "za", "zb", "aggregate", "avg" },
+            { "zunionstore", "dest", "2", "za", "zb", "withscores" },
+            { "zinterstore", "dest", "1", "za", "zb" },
+        };
+        for (auto& args : invalid) {
+            BOOST_REQUIRE(serve(args) == msg_syntax_err);
+        }
+    });
+}
+
+// The destination is replaced whatever it held, removed when the result is empty,
+// and may be one of the sources, which are read before it is replaced.
+SEASTAR_TEST_CASE(zstore_destination) {
+    return seastar::async([] {
+        server s;
+        zset_model a, b;
+        for (size_t i = 0; i < 2500; ++i) {
+            a[sprint("m%d", i)] = i;
+            if (i % 3 == 0) {
+                b[sprint("m%d", i)] = 1;
+            }
+        }
+        zadd("a", a);
+        zadd("b", b);
+        serve({ "set", "dest", "value" });
+        BOOST_REQUIRE(serve({ "zunionstore", "dest", "1", "b" }) == integer(b.size()));
+        BOOST_REQUIRE(serve({ "type", "dest" }) == msg_type_zset);
+        BOOST_REQUIRE(zset_of("dest") == b);
+        serve({ "del", "dest" });
+        serve({ "rpush", "dest", "x" });
+        BOOST_REQUIRE(serve({ "zinterstore", "dest", "2", "a", "b" }) == integer(b.size()));
+        BOOST_REQUIRE(zset_of("dest") == combine({ a, b }, { 1, 1 }, "SUM", true));
+        zadd("dest", { { "other", 1 } });
+        BOOST_REQUIRE(serve({ "zinterstore", "dest", "2", "a", "missing" }) == ":0\r\n");
+        BOOST_REQUIRE(serve({ "exists", "dest" }) == ":0\r\n");
+
+        auto union_ab = combine({ a, b }, { 1, 2 }, "SUM", false);
+        BOOST_REQUIRE(serve({ "zunionstore", "a", "2", "a", "b", "weights", "1", "2" }) == integer(union_ab.size()));
+        BOOST_REQUIRE(zset_of("a") == union_ab);
+        auto inter = combine({ union_ab, b }, { 1, 1 }, "MAX", true);
+        BOOST_REQUIRE(serve({ "zinterstore", "b", "2", "a", "b", "aggregate", "max" }) == integer(inter.size()));
+        BOOST_REQUIRE(zset_of("b") == inter);
+        BOOST_REQUIRE(serve({ "zunionstore", "b", "1", "b" }) == integer(inter.size()));
+        BOOST_REQUIRE(zset_of("b") == inter);
+    });
+}
+
+// The result is staged aside on the shard of the destination, per store: a commit
+// replaces the destination with what its store staged, an abort drops it.
+SEASTAR_TEST_CASE(zstore_staging) {
+    return seastar::async([] {
+        server s;
+        for (sstring key : { "x", "y", "zstore" }) {
+            serve({ "set", key, "value" });
+            redis_key rk { std::ref(key) };
+            auto sizes = get_database().invoke_on(rk.get_cpu(), [key] (database& db) {
+                std::vector<std::pair<sstring, double>> first = { { "a", 1 }, { "b", 2 } };
+                std::vector<std::pair<sstring, double>> second = { { "c", 3 } };
+                std::vector<std::pair<sstring, double>> other = { { "d", 4 } };
+                db.zstore_batch_direct(1, first);
+                db.zstore_batch_direct(2, other);
+                db.zstore_batch_direct(1, second);
+                std::vector<size_t> sizes;
+                sizes.push_back(db.zstore_abort_direct(2));
+                sizes.push_back(db.zstore_abort_direct(2));
+                auto k = key;
+                redis_key rk { std::ref(k) };
+                sizes.push_back(db.zstore_commit_direct(rk, 1));
+                // nothing staged any more.
+                sizes.push_back(db.zstore_abort_direct(1));
+                return sizes;
+            }).get0();
+            BOOST_REQUIRE(sizes == std::vector<size_t>({ 1, 0, 3, 0 }));
+            BOOST_REQUIRE(zset_of(key) == zset_model({ { "a", 1 }, { "b", 2 }, { "c", 3 } }));
+            // a store whose batches were aborted, or which staged none, empties it.
+            auto empty = get_database().invoke_on(rk.get_cpu(), [key] (database& db) {
+                auto k = key;
+                redis_key rk { std::ref(k) };
+                std::vector<std::pair<sstring, double>> batch = { { "e", 5 } };
+                db.zstore_batch_direct(3, batch);
+                db.zstore_abort_direct(3);
+                return db.zstore_commit_direct(rk, 3);
+            }).get0();
+            BOOST_REQUIRE(empty == 0);
+            BOOST_REQUIRE(serve({ "exists", key }) == ":0\r\n");
+        }
+    });
+}
+
+// The arguments of the requests, and the bytes of them which were copied: the keys,
+// the values split between reads, but not the values which stay views.
+SEASTAR_TEST_CASE(args_copied_bytes) {
+    return seastar::async([] {
+        server s;
+        auto value = sstring(1000, 'v');
+        auto bytes = [] (std::vector<sstring> pieces) {
+            redis_protocol proto;
+            proto.serve_locally();
+            reply_buffer replies;
+            request_latency_tracer tracer;
+            for (auto& piece : pieces) {
+                proto.handle(temporary_buffer<char>(piece.data(), piece.size()), replies.stream(), tracer).get();
+            }
+            replies.collect().get();
+            return std::make_pair(tracer.args_bytes(), tracer.args_copied_bytes());
+        };
+        auto set = multi_bulk({ "set", "k", value });
+        BOOST_REQUIRE(bytes({ set }) == std::make_pair(uint64_t(1001), uint64_t(1)));
+        BOOST_REQUIRE(bytes({ set.substr(0, 500), set.substr(500) }) == std::make_pair(uint64_t(1001), uint64_t(1001)));
+        BOOST_REQUIRE(serve({ "get", "k" }) == bulk(value));
+        auto mset = multi_bulk({ "mset", "a", value, "bb", "", "c", value });
+        BOOST_REQUIRE(bytes({ mset }) == std::make_pair(uint64_t(2004), uint64_t(4)));
+        BOOST_REQUIRE(serve({ "mget", "a", "bb", "c" }) == "*3\r\n" + bulk(value) + bulk("") + bulk(value));
+        auto append = multi_bulk({ "append", "bb", value });
+        BOOST_REQUIRE(bytes({ append.substr(0, 40), append.substr(40) }) == std::make_pair(uint64_t(1002), uint64_t(1002)));
+        BOOST_REQUIRE(serve({ "get", "bb" }) == bulk(value));
+        // the values of the other commands are materialized.
+        auto rpush = multi_bulk({ "rpush", "l", value, "" });
+        BOOST_REQUIRE(bytes({ rpush }) == std::make_pair(uint64_t(1001), uint64_t(1001)));
+        BOOST_REQUIRE(bytes({ multi_bulk({ "get", "k" }) + multi_bulk({ "del", "k", "a" }) }) == std::make_pair(uint64_t(3), uint64_t(3)));
+    });
+}
+
+// The integers replied and the numbers stored in strings and hashes, byte for byte:
+// zero, negative, the limits of int64_t, and the counts around the preformatted ones.
+SEASTAR_TEST_CASE(numeric_replies) {
+    return seastar::async([] {
+        server s;
+        for (sstring v : { "0", "-1", "9999", "10000", "-9223372036854775808", "9223372036854775807" }) {
+            auto key = "n" + v;
+            BOOST_REQUIRE(serve({ "incrby", key, v }) == bulk(v));
+            BOOST_REQUIRE(serve({ "get", key }) == bulk(v));
+        }
+        serve({ "hset", "h", "s", "12345" });
+        serve({ "hincrby", "h", "zero", "0" });
+        serve({ "hincrby", "h", "negative", "-7" });
+        serve({ "hincrby", "h", "min", "-2147483648" });
+        for (size_t i = 0; i < 3; ++i) {
+            serve({ "hincrby", "h", "large", "2147483647" });
+        }
+        std::map<sstring, sstring> expected = {
+            { "s", "12345" }, { "zero", "0" }, { "negative", "-7" }, { "min", "-2147483648" }, { "large", "6442450941" },
+        };
+        auto all = elements(serve({ "hgetall", "h" }));
+        BOOST_REQUIRE(all.size() == expected.size() * 2);
+        std::map<sstring, sstring> fields;
+        for (size_t i = 0; i < all.size(); i += 2) {
+            fields.emplace(all[i], all[i + 1]);
+        }
+        BOOST_REQUIRE(fields == expected);
+        for (auto& f : expected) {
+            BOOST_REQUIRE(serve({ "hget", "h", f.first }) == bulk(f.second));
+        }
+        BOOST_REQUIRE(serve({ "hlen", "h" }) == integer(5));
+
+        BOOST_REQUIRE(serve({ "del", "missing" }) == integer(0));
+        std::vector<sstring> args = { "rpush", "l" };
+        for (size_t i = 0; i < 9999; ++i) {
+            args.push_back("x");
+        }
+        BOOST_REQUIRE(serve(std::move(args)) == integer(9999));
+        BOOST_REQUIRE(serve({ "rpush", "l", "x" }) == integer(10000));
+        BOOST_REQUIRE(serve({ "rpush", "l", "x" }) == integer(10001));
+        BOOST_REQUIRE(serve({ "llen", "l" }) == integer(10001));
+    });
+}
+
+// The count of SLOWLOG GET is an integer, one which does not fit in a long is an error.
+SEASTAR_TEST_CASE(slowlog_get_count) {
+    return seastar::async([] {
+        server s;
+        BOOST_REQUIRE(serve({ "slowlog", "get", "99999999999999999999" }) == msg_value_err);
+        BOOST_REQUIRE(serve({ "slowlog", "get", "-99999999999999999999" }) == msg_value_err);
+        BOOST_REQUIRE(serve({ "slowlog", "get", "many" }) == msg_value_err);
+        BOOST_REQUIRE(serve({ "slowlog", "get", "0" }) == "*0\r\n");
+    });
+}
+
+// SETBIT on a string grows it to the byte of the offset only: STRLEN, GET and
+// BITPOS 0 see no padding, and the bytes it had are kept.
+SEASTAR_TEST_CASE(setbit_string_length) {
+    return seastar::async([] {
+        server s;
+        serve({ "set", "s", "\xff\xff" });
+        BOOST_REQUIRE(serve({ "setbit", "s", "23", "1" }) == ":0\r\n");
+        BOOST_REQUIRE(serve({ "strlen", "s" }) == integer(3));
+        BOOST_REQUIRE(serve({ "get", "s" }) == bulk(sstring("\xff\xff\x01", 3)));
+        BOOST_REQUIRE(serve({ "bitpos", "s", "0" }) == integer(16));
+        serve({ "setbit", "s", "16", "1" });
+        serve({ "setbit", "s", "17", "1" });
+        BOOST_REQUIRE(serve({ "bitpos", "s", "0" }) == integer(18));
+
+        // from the inline bytes of a short string to a larger one.
+        serve({ "set", "t", "abcdefgh" });
+        serve({ "setbit", "t", "200", "1" });
+        BOOST_REQUIRE(serve({ "strlen", "t" }) == integer(26));
+        BOOST_REQUIRE(serve({ "get", "t" }) == bulk(sstring("abcdefgh") + sstring(17, '\0') + "\x80"));
+
+        sstring value(100, '\xff');
+        serve({ "set", "u", value });
+        for (size_t offset = 800; offset < 8 * 3000; offset += 8 * 7 + 3) {
+            serve({ "setbit", "u", to_sstring(offset), "1" });
+            BOOST_REQUIRE(serve({ "strlen", "u" }) == integer(offset / 8 + 1));
+        }
+        BOOST_REQUIRE(serve({ "bitpos", "u", "0" }) == integer(800));
+    });
+}
+
+// MGET replies the values in the order of its keys whichever shards own them, a
+// nil for the keys which are missing or hold no string, and the counters and
+// bitmaps as GET does.
+SEASTAR_TEST_CASE(mget_order) {
+    return seastar::async([] {
+        server s;
+        std::map<sstring, sstring> values;
+        for (size_t i = 0; i < 200; ++i) {
+            auto key = sprint("k%d", i);
+            values[key] = sprint("value-%d", i * 7);
+            serve({ "set", key, values[key] });
+        }
+        serve({ "set", "empty", "" });
+        values["empty"] = "";
+        serve({ "incrby", "counter", "-42" });
+        values["counter"] = "-42";
+        serve({ "setbit", "bitmap", "7", "1" });
+        values["bitmap"] = sstring("\x01", 1);
+        serve({ "rpush", "list", "a" });
+        serve({ "hset", "hash", "f", "v" });
+        serve({ "sadd", "set", "m" });
+        serve({ "zadd", "zset", "1", "m" });
+
+        std::mt19937_64 rng(3);
+        std::vector<sstring> names;
+        for (auto& v : values) {
+            names.push_back(v.first);
+        }
+        for (auto name : { "missing", "list", "hash", "set", "zset" }) {
+            names.push_back(name);
+        }
+        for (size_t round = 0; round < 20; ++round) {
+            std::vector<sstring> keys;
+            size_t count = 1 + rng() % 300;
+            for (size_t i = 0; i < count; ++i) {
+                keys.push_back(names[rng() % names.size()]);
+            }
+            auto expected = sprint("*%d\r\n", keys.size());
+            for (auto& key : keys) {
+                auto v = values.find(key);
+                expected += v == values.end() ? msg_null_blik : bulk(v->second);
+            }
+            keys.insert(keys.begin(), "mget");
+            BOOST_REQUIRE(serve(keys) == expected);
+        }
+        BOOST_REQUIRE(serve({ "mget", "missing" }) == "*1\r\n" + msg_null_blik);
+        BOOST_REQUIRE(serve({ "mget", "list", "k1", "list" }) == "*3\r\n" + msg_null_blik + bulk(values["k1"]) + msg_null_blik);
+    });
+}
@@ -0,0 +1,545 @@
+#include "tests/test-utils.hh"
+#include "core/align.hh"
+#include "core/byteorder.hh"
+#include "core/reactor.hh"
+#include "core/sleep.hh"
+#include "core/thread.hh"
+#include "core/vector-data-sink.hh"
+#include "commitlog.hh"
+#include "config.hh"
+#include "db.hh"
+#include "redis.hh"
+#include "redis_protocol.hh"
+#include "storage_proxy.hh"
+#include "utils/crc.hh"
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <tuple>
+
+using namespace redis;
+namespace fs = boost::filesystem;
+
+// the framing of the records, as commitlog.cc writes them.
+static const size_t header_size = 8;
+static const size_t alignment = 4096;
+
+static sstring bulk(const sstring& s) {
+    return sprint("$%d\r\n%s\r\n", s.size(), s);
+}
+
+static sstring multi_bulk(std::vector<sstring> args) {
+    auto out = sprint("*%d\r\n", args.size());
+    for (auto& a : args) {
+        out += bulk(a);
+    }
+    return out;
+}
+
+static sstring make_directory()
+{
+    auto path = fs::temp_directory_path() / fs::unique_path("commitlog_test-%%%%-%%%%-%%%%");
+    fs::create_directories(path);
+    return sstring(path.string().c_str());
+}
+
+static commit_log::config log_config(const sstring& directory)
+{
+    commit_log::config c;
+    c.directory = directory;
+    c.segment_size = 256 * 1024;
+    return c;
+}
+
+// Appends with a log of the generation, which is synced and closed after.
+template <typename Func>
+static void write_log(const sstring& directory, uint64_t generation, Func&& func)
+{
+    commit_log log(log_config(directory));
+    log.start(generation).get();
+    func(log);
+    log.stop().get();
+}
+
+struct segment_file {
+    uint64_t generation;
+    unsigned shard;
+    uint64_t id;
+    sstring path;
+};
+
+// The segments in the directory in replay order.
+static std::vector<segment_file> segments(const sstring& directory)
+{
+    std::vector<segment_file> files;
+    for (auto it = fs::directory_iterator(directory.c_str()); it != fs::directory_iterator(); ++it) {
+        unsigned long long generation = 0, id = 0;
+        unsigned shard = 0;
+        auto name = it->path().filename().string();
+        if (std::sscanf(name.c_str(), "commitlog-%llu-%u-%llu.log", &generation, &shard, &id) == 3) {
+            files.push_back(segment_file { generation, shard, id, sstring(it->path().string().c_str()) });
+        }
+    }
+    std::sort(files.begin(), files.end(), [] (auto& l, auto& r) {
+        return std::tie(l.generation, l.shard, l.id) < std::tie(r.generation, r.shard, r.id);
+    });
+    return files;
+}
+
+static void rename_shard(const segment_file& s, unsigned shard)
+{
+    auto name = sprint("commitlog-%d-%d-%d.log", s.generation, shard, s.id);
+    fs::rename(s.path.c_str(), (fs::path(s.path.c_str()).parent_path() / name.c_str()));
+}
+
+static uint32_t read_le32(const char* p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return le_to_cpu(v);
+}
+
+static uint32_t checksum(const char* data, size_t size)
+{
+    utils::crc32 c;
+    c.process(reinterpret_cast<const uint8_t*>(data), size);
+    return c.get();
+}
+
+struct record {
+    uint64_t offset;
+    sstring payload;
+};
+
+struct parsed_segment {
+    std::vector<record> records;
+    size_t paddings = 0;
+};
+
+// Reads the records of a segment back: [le32 size][le32 crc][RESP], 8 bytes
+// aligned, a zero size pads up to the next block or ends the log at a block.
+static parsed_segment parse_segment(const sstring& path)
+{
+    std::ifstream in(path.c_str(), std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    parsed_segment s;
+    size_t position = 0;
+    while (position + header_size <= data.size()) {
+        auto size = read_le32(&data[position]);
+        if (size == 0) {
+            if (position % alignment == 0) {
+                break;
+            }
+            position = align_up(position, alignment);
+            ++s.paddings;
+            continue;
+        }
+        BOOST_REQUIRE(position % 8 == 0);
+        BOOST_REQUIRE(position + header_size + size <= data.size());
+        auto payload = &data[position + header_size];
+        BOOST_REQUIRE(read_le32(&data[position + sizeof(uint32_t)]) == checksum(payload, size));
+        s.records.push_back(record { position, sstring(payload, size) });
+        position += align_up(header_size + size, size_t(8));
+    }
+    // nothing follows the end of the log.
+    BOOST_REQUIRE(std::all_of(data.begin() + std::min(position, data.size()), data.end(), [] (char c) { return c == 0; }));
+    return s;
+}
+
+static void overwrite(const sstring& path, uint64_t offset, const std::string& bytes)
+{
+    std::fstream f(path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+    f.seekp(offset);
+    f.write(bytes.data(), bytes.size());
+}
+
+static bool exists(const sstring& key)
+{
+    return storage_proxy::serve(multi_bulk({ "exists", key })).get0() == ":1\r\n";
+}
+
+static sstring get(const sstring& key)
+{
+    return storage_proxy::serve(multi_bulk({ "get", key })).get0();
+}
+
+// How many of the keys prefix-0, prefix-1, ... exist, which must be the first ones.
+static size_t replayed(const sstring& prefix, size_t n)
+{
+    size_t count = 0;
+    while (count < n && exists(sprint("%s-%d", prefix, count))) {
+        ++count;
+    }
+    for (size_t i = count; i < n; ++i) {
+        BOOST_REQUIRE(!exists(sprint("%s-%d", prefix, i)));
+    }
+    return count;
+}
+
+// Runs func with the database and the redis service started, as main does before
+// the log is replayed.
+template <typename Func>
+static future<> with_server(Func func)
+{
+    return seastar::async([func = std::move(func)] () mutable {
+        redis::config cfg;
+        get_database().start(std::ref(cfg)).get();
+        get_redis_service().start().get();
+        func();
+        get_redis_service().stop().get();
+        get_database().stop().get();
+    });
+}
+
+// Every record is framed by its size and crc, 8 bytes aligned, the buffers end
+// with padding up to a block, and the segments follow each other in id order.
+SEASTAR_TEST_CASE(framing) {
+    return seastar::async([] {
+        auto directory = make_directory();
+        std::vector<sstring> expected;
+        write_log(directory, 1, [&expected] (commit_log& log) {
+            for (size_t i = 0; i < 2000; ++i) {
+                auto key = sprint("key-%d", i);
+                // the largest value takes more than a buffer.
+                auto value = sstring(i == 1000 ? size_t(200 * 1024) : (i * 37) % 1000, 'a' + i % 26);
+                log.append({ "SET", key, value });
+                expected.push_back(multi_bulk({ "SET", key, value }));
+            }
+        });
+        auto files = segments(directory);
+        BOOST_REQUIRE(files.size() > 1);
+        std::vector<sstring> payloads;
+        size_t paddings = 0;
+        uint64_t id = 0;
+        for (auto& f : files) {
+            BOOST_REQUIRE(f.generation == 1 && f.shard == engine().cpu_id() && f.id == id++);
+            auto s = parse_segment(f.path);
+            paddings += s.paddings;
+            for (auto& r : s.records) {
+                payloads.push_back(r.payload);
+            }
+        }
+        BOOST_REQUIRE(paddings > 0);
+        BOOST_REQUIRE(payloads == expected);
+        fs::remove_all(directory.c_str());
+    });
+}
+
+// The replay executes the logged requests in order, across the padding of the
+// buffers and the segments, and returns the next generation.
+SEASTAR_TEST_CASE(replay) {
+    return with_server([] {
+        auto directory = make_directory();
+        write_log(directory, 1, [] (commit_log& log) {
+            log.append({ "SET", "a", "1" });
+            log.append({ "SET", "b", "2" });
+            for (size_t i = 0; i < 3000; ++i) {
+                log.append({ "SET", sprint("r-%d", i), sstring(i % 500, 'v') });
+                log.append({ "INCR", "n" });
+            }
+            log.append({ "DEL", "b" });
+            log.append({ "HSET", "h", "f", "v" });
+            log.cut();
+            log.append({ "SET", "a", "3" });
+        });
+        BOOST_REQUIRE(segments(directory).size() > 2);
+        BOOST_REQUIRE(commit_log::replay(directory, replay_position()).get0() == 2);
+        BOOST_REQUIRE(get("a") == bulk("3"));
+        BOOST_REQUIRE(!exists("b"));
+        BOOST_REQUIRE(get("n") == bulk("3000"));
+        BOOST_REQUIRE(storage_proxy::serve(multi_bulk({ "hget", "h", "f" })).get0() == bulk("v"));
+        BOOST_REQUIRE(replayed("r", 3000) == 3000);
+        BOOST_REQUIRE(get("r-2999") == bulk(sstring(2999 % 500, 'v')));
+        fs::remove_all(directory.c_str());
+    });
+}
+
+static int64_t pttl(const sstring& key)
+{
+    auto reply = storage_proxy::serve(multi_bulk({ "pttl", key })).get0();
+    return std::atol(reply.c_str() + 1);
+}
+
+// The database logs the deadline of an expiry rather than its timeout, which the
+// replay applies through SET PXAT and PEXPIREAT.
+SEASTAR_TEST_CASE(absolute_expiry) {
+    return seastar::async([] {
+        auto directory = make_directory();
+        redis::config cfg;
+        cfg.commitlog_directory(directory);
+        get_database().start(std::ref(cfg)).get();
+        get_redis_service().start().get();
+        get_database().invoke_on_all([] (database& db) {
+            return db.start_commitlog(1);
+        }).get();
+        auto before = unix_time_ms();
+        BOOST_REQUIRE(storage_proxy::serve(multi_bulk({ "set", "a", "v", "px", "3600000" })).get0() == "+OK\r\n");
+        BOOST_REQUIRE(storage_proxy::serve(multi_bulk({ "set", "b", "v" })).get0() == "+OK\r\n");
+        BOOST_REQUIRE(storage_proxy::serve(multi_bulk({ "pexpire", "b", "7200000" })).get0() == ":1\r\n");
+        BOOST_REQUIRE(storage_proxy::serve(multi_bulk({ "set", "c", "v", "EXAT", to_sstring(before / 1000 + 3600) })).get0() == "+OK\r\n");
+        auto after = unix_time_ms();
+        BOOST_REQUIRE(pttl("c") > 0 && pttl("c") <= 3600000);
+        get_redis_service().stop().get();
+        get_database().stop().get();
+
+        // the deadline after the other arguments of a logged request.
+        auto deadline_of = [] (const sstring& payload, size_t count, std::vector<sstring> args) {
+            auto prefix = sprint("*%d\r\n", count);
+            for (auto& a : args) {
+                prefix += bulk(a);
+            }
+            if (payload.compare(0, prefix.size(), prefix) != 0) {
+                return int64_t(0);
+            }
+            return int64_t(std::atol(std::strchr(payload.c_str() + prefix.size(), '\n') + 1));
+        };
+        std::map<sstring, int64_t> deadlines;
+        for (auto& f : segments(directory)) {
+            for (auto& r : parse_segment(f.path).records) {
+                for (auto key : { "a", "c" }) {
+                    if (auto at = deadline_of(r.payload, 5, { "SET", key, "v", "PXAT" })) {
+                        deadlines[key] = at;
+                    }
+                }
+                if (auto at = deadline_of(r.payload, 3, { "PEXPIREAT", "b" })) {
+                    deadlines["b"] = at;
+                }
+            }
+        }
+        BOOST_REQUIRE(deadlines.size() == 3);
+        BOOST_REQUIRE(deadlines["a"] >= before + 3600000 && deadlines["a"] <= after + 3600000);
+        BOOST_REQUIRE(deadlines["b"] >= before + 7200000 && deadlines["b"] <= after + 7200000);
+        BOOST_REQUIRE(deadlines["c"] >= before + 3599000 && deadlines["c"] <= after + 3600000);
+
+        // replayed later, the keys keep their deadlines.
+        redis::config replay_cfg;
+        get_database().start(std::ref(replay_cfg)).get();
+        get_redis_service().start().get();
+        commit_log::replay(directory, replay_position()).get();
+        auto now = unix_time_ms();
+        for (auto& d : deadlines) {
+            auto left = pttl(d.first);
+            BOOST_REQUIRE(left > 0 && left <= d.second - now + 20);
+        }
+        // deadlines which passed expire the keys.
+        BOOST_REQUIRE(storage_proxy::serve(multi_bulk({ "pexpireat", "a", to_sstring(now - 1000) })).get0() == ":1\r\n");
+        BOOST_REQUIRE(!exists("a"));
+        BOOST_REQUIRE(storage_proxy::serve(multi_bulk({ "set", "b", "w", "pxat", to_sstring(now - 1000) })).get0() == "+OK\r\n");
+        sleep(std::chrono::milliseconds(50)).get();
+        BOOST_REQUIRE(!exists("b"));
+        get_redis_service().stop().get();
+        get_database().stop().get();
+        fs::remove_all(directory.c_str());
+    });
+}
+
+// In batch mode no reply of a pipeline with a mutation reaches the client before
+// the mutations are synced, not even the ones too large for the connection's buffer.
+SEASTAR_TEST_CASE(batch_mode_replies) {
+    return seastar::async([] {
+        auto directory = make_directory();
+        redis::config cfg;
+        cfg.commitlog_directory(directory);
+        cfg.commitlog_sync(sstring("batch"));
+        cfg.commitlog_sync_batch_window_in_ms(300);
+        get_database().start(std::ref(cfg)).get();
+        get_redis_service().start().get();
+        get_database().invoke_on_all([] (database& db) {
+            return db.start_commitlog(1);
+        }).get();
+
+        auto value = sstring(20000, 'v');
+        auto requests = multi_bulk({ "set", "k", value }) + multi_bulk({ "get", "k" }) + multi_bulk({ "incr", "n" }) + multi_bulk({ "get", "k" });
+        std::vector<net::packet> packets;
+        output_stream<char> out(data_sink(std::make_unique<vector_data_sink>(packets)), 8192);
+        redis_protocol proto;
+        proto.serve_locally();
+        request_latency_tracer tracer;
+        auto done = proto.handle(temporary_buffer<char>(requests.data(), requests.size()), out, tracer);
+        sleep(std::chrono::milliseconds(100)).get();
+        BOOST_REQUIRE(!done.available());
+        BOOST_REQUIRE(packets.empty());
+        done.get();
+        out.flush().get();
+        sstring replies;
+        for (auto& p : packets) {
+            for (auto& f : p.fragments()) {
+                replies += sstring(f.base, f.size);
+            }
+        }
+        BOOST_REQUIRE(replies == "+OK\r\n" + bulk(value) + ":1\r\n" + bulk(value));
+        // and the mutations were logged before.
+        size_t records = 0;
+        for (auto& f : segments(directory)) {
+            records += parse_segment(f.path).records.size();
+        }
+        BOOST_REQUIRE(records == 2);
+        out.close().get();
+        get_redis_service().stop().get();
+        get_database().stop().get();
+        fs::remove_all(directory.c_str());
+    });
+}
+
+// A torn or corrupted record ends the replay: the records before it are applied,
+// the ones after it are not.
+SEASTAR_TEST_CASE(truncation) {
+    return with_server([] {
+        auto write = [] (const sstring& prefix) {
+            auto directory = make_directory();
+            write_log(directory, 1, [&prefix] (commit_log& log) {
+                for (size_t i = 0; i < 100; ++i) {
+                    log.append({ "SET", sprint("%s-%d", prefix, i), sstring(100, 'v') });
+                }
+            });
+            auto files = segments(directory);
+            BOOST_REQUIRE(files.size() == 1);
+            auto s = parse_segment(files[0].path);
+            BOOST_REQUIRE(s.records.size() == 100);
+            return std::make_tuple(directory, files[0].path, s.records);
+        };
+
+        // a bad crc.
+        sstring directory, path;
+        std::vector<record> records;
+        std::tie(directory, path, records) = write("crc");
+        overwrite(path, records[50].offset + header_size + 20, "x");
+        commit_log::replay(directory, replay_position()).get();
+        BOOST_REQUIRE(replayed("crc", 100) == 50);
+        fs::remove_all(directory.c_str());
+
+        // the tail of a record which was never written.
+        std::tie(directory, path, records) = write("torn");
+        overwrite(path, records[70].offset + header_size + 50, std::string(20, '\0'));
+        commit_log::replay(directory, replay_position()).get();
+        BOOST_REQUIRE(replayed("torn", 100) == 70);
+        fs::remove_all(directory.c_str());
+
+        // the file ends within a record, or within a header.
+        std::tie(directory, path, records) = write("cut");
+        fs::resize_file(path.c_str(), records[80].offset + header_size + 13);
+        commit_log::replay(directory, replay_position()).get();
+        BOOST_REQUIRE(replayed("cut", 100) == 80);
+        fs::remove_all(directory.c_str());
+
+        std::tie(directory, path, records) = write("header");
+        fs::resize_file(path.c_str(), records[90].offset + 5);
+        commit_log::replay(directory, replay_position()).get();
+        BOOST_REQUIRE(replayed("header", 100) == 90);
+        fs::remove_all(directory.c_str());
+    });
+}
+
+// The segments of an old shard are replayed in id order, whatever the number of
+// shards now, and the generations one after the other.
+SEASTAR_TEST_CASE(old_shards) {
+    return with_server([] {
+        auto directory = make_directory();
+        auto write_shard = [&directory] (uint64_t generation, unsigned shard, std::vector<std::vector<sstring>> requests) {
+            write_log(directory, generation, [&requests] (commit_log& log) {
+                for (auto& r : requests) {
+                    if (r.empty()) {
+                        log.cut();
+                        continue;
+                    }
+                    std::vector<log_arg> args(r.begin(), r.end());
+                    log.append(args);
+                }
+            });
+            for (auto& f : segments(directory)) {
+                if (f.generation == generation && f.shard == engine().cpu_id()) {
+                    rename_shard(f, shard);
+                }
+            }
+        };
+        write_shard(1, 7, { { "SET", "x", "1" }, {}, { "SET", "x", "2" }, {}, { "APPEND", "x", "3" }, { "SET", "z", "old" } });
+        write_shard(1, 3, { { "RPUSH", "l", "a" }, {}, { "RPUSH", "l", "b" }, {}, { "RPUSH", "l", "c" } });
+        write_shard(2, 5, { { "SET", "z", "new" }, {}, { "RPUSH", "l", "d" } });
+        BOOST_REQUIRE(segments(directory).size() == 8);
+        BOOST_REQUIRE(commit_log::replay(directory, replay_position()).get0() == 3);
+        BOOST_REQUIRE(get("x") == bulk("23"));
+        BOOST_REQUIRE(get("z") == bulk("new"));
+        BOOST_REQUIRE(storage_proxy::serve(multi_bulk({ "lrange", "l", "0", "-1" })).get0() == "*4\r\n" + bulk("a") + bulk("b") + bulk("c") + bulk("d"));
+        fs::remove_all(directory.c_str());
+    });
+}
+
+// The segments covered by a snapshot: the older generations, and the ones of its
+// generation below the first segment of their shard.
+SEASTAR_TEST_CASE(covers) {
+    replay_position p;
+    BOOST_REQUIRE(!p.covers(0, 0, 0));
+    p.generation = 2;
+    p.first_segments = { 1, 0, 3 };
+    BOOST_REQUIRE(p.covers(1, 0, 100));
+    BOOST_REQUIRE(p.covers(1, 9, 0));
+    BOOST_REQUIRE(p.covers(2, 0, 0));
+    BOOST_REQUIRE(!p.covers(2, 0, 1));
+    BOOST_REQUIRE(!p.covers(2, 1, 0));
+    BOOST_REQUIRE(p.covers(2, 2, 2));
+    BOOST_REQUIRE(!p.covers(2, 2, 3));
+    // a shard which did not exist when the snapshot was taken.
+    BOOST_REQUIRE(!p.covers(2, 3, 0));
+    BOOST_REQUIRE(!p.covers(3, 0, 0));
+    return make_ready_future<>();
+}
+
+// Discard removes exactly the covered segments, and the replay skips them.
+SEASTAR_TEST_CASE(discard) {
+    return with_server([] {
+        auto directory = make_directory();
+        auto touch = [&directory] (uint64_t generation, unsigned shard, uint64_t id, std::vector<sstring> request) {
+            write_log(directory, generation, [&request] (commit_log& log) {
+                std::vector<log_arg> args(request.begin(), request.end());
+                log.append(args);
+            });
+            for (auto& f : segments(directory)) {
+                if (f.generation == generation && f.shard == engine().cpu_id() && f.id == 0) {
+                    fs::rename(f.path.c_str(), (fs::path(directory.c_str()) / sprint("tmp-%d-%d-%d", generation, shard, id).c_str()));
+                }
+            }
+        };
+        struct segment_key {
+            uint64_t generation;
+            unsigned shard;
+            uint64_t id;
+        };
+        std::vector<segment_key> keys = {
+            { 1, 0, 0 }, { 1, 1, 0 }, { 2, 0, 0 }, { 2, 0, 1 }, { 2, 0, 2 }, { 2, 1, 0 }, { 3, 0, 0 },
+        };
+        for (auto& k : keys) {
+            auto name = sprint("d-%d-%d-%d", k.generation, k.shard, k.id);
+            touch(k.generation, k.shard, k.id, { "SET", name, "1" });
+        }
+        for (auto& k : keys) {
+            auto from = fs::path(directory.c_str()) / sprint("tmp-%d-%d-%d", k.generation, k.shard, k.id).c_str();
+            fs::rename(from, fs::path(directory.c_str()) / sprint("commitlog-%d-%d-%d.log", k.generation, k.shard, k.id).c_str());
+        }
+        replay_position p;
+        p.generation = 2;
+        p.first_segments = { 1, 0 };
+        commit_log::discard(directory, p).get();
+        std::vector<std::tuple<uint64_t, unsigned, uint64_t>> left;
+        for (auto& f : segments(directory)) {
+            left.emplace_back(f.generation, f.shard, f.id);
+        }
+        std::vector<std::tuple<uint64_t, unsigned, uint64_t>> expected = {
+            std::make_tuple(2, 0, 1), std::make_tuple(2, 0, 2), std::make_tuple(2, 1, 0), std::make_tuple(3, 0, 0),
+        };
+        BOOST_REQUIRE(left == expected);
+
+        // the replay from the same position finds only the segments after it.
+        BOOST_REQUIRE(commit_log::replay(directory, p).get0() == 4);
+        for (auto& k : keys) {
+            auto name = sprint("d-%d-%d-%d", k.generation, k.shard, k.id);
+            BOOST_REQUIRE(exists(name) == !p.covers(k.generation, k.shard, k.id));
+        }
+        // a position past the segments gives the next generation after it.
+        p.generation = 5;
+        BOOST_REQUIRE(commit_log::replay(directory, p).get0() == 6);
+        fs::remove_all(directory.c_str());
+    });
+}
@@ -0,0 +1,196 @@
+#include "tests/test-utils.hh"
+#include "sset_lsa.hh"
+#include "geo.hh"
+#include "common.hh"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <random>
+#include <set>
+
+using namespace redis;
+
+// GEOSEARCH against a brute force filter of every member by its haversine distance.
+class geo_holder : private logalloc::region {
+public:
+    ~geo_holder()
+    {
+        with_allocator(allocator(), [this] {
+           _set.flush_all();
+        });
+    }
+    future<> run() {
+        std::mt19937_64 rng(23);
+        std::uniform_real_distribution<double> ulongitude(-180, 180), ulatitude(-85, 85), u01(0, 1);
+        for (int q = 0; q < 400; ++q) {
+            geo::shape s;
+            // some centers next to the antimeridian and the poles.
+            s._longitude = q % 10 == 0 ? (u01(rng) < 0.5 ? 179.9 : -179.9) : ulongitude(rng);
+            s._latitude = q % 13 == 0 ? (u01(rng) < 0.5 ? 84 : -84) : ulatitude(rng);
+            s._box = q & 1;
+            // from 10m to 1000km.
+            double scale = std::pow(10, 1 + u01(rng) * 5);
+            s._radius = scale;
+            s._width = scale * (0.5 + u01(rng));
+            s._height = scale * (0.5 + u01(rng));
+            populate(s, scale, rng);
+            check(s);
+        }
+        // the center must be a valid position.
+        geo::shape s;
+        s._latitude = 86;
+        s._radius = 1000;
+        std::vector<geo::match<sset_entry>> matches;
+        BOOST_CHECK(!geo::search(_set, s, 0, false, 0, matches));
+        return make_ready_future<>();
+    }
+private:
+    // 2000 points around the center, some of them in the shape, and a few anywhere.
+    void populate(const geo::shape& s, double scale, std::mt19937_64& rng) {
+        std::uniform_real_distribution<double> u01(0, 1);
+        with_allocator(allocator(), [this, &s, scale, &rng, &u01] {
+            _set.flush_all();
+            _positions.clear();
+            for (int i = 0; i < 2000; ++i) {
+                double longitude, latitude;
+                if (i % 50 == 0) {
+                    longitude = -180 + 360 * u01(rng);
+                    latitude = -85 + 170 * u01(rng);
+                }
+                else {
+                    auto degrees = 4 * scale / 111000;
+                    latitude = s._latitude + (u01(rng) - 0.5) * degrees;
+                    longitude = s._longitude + (u01(rng) - 0.5) * degrees / std::max(0.05, std::cos(s._latitude * M_PI / 180));
+                    longitude = longitude > 180 ? longitude - 360 : longitude < -180 ? longitude + 360 : longitude;
+                }
+                double score;
+                if (!geo::encode_to_geohash(longitude, latitude, score)) {
+                    continue;
+                }
+                auto name = to_sstring(i);
+                auto entry = current_allocator().construct<sset_entry>(name, score);
+                BOOST_REQUIRE(_set.insert(entry));
+                // the members are where their geohash decodes, as the ones of Redis.
+                geo::decode_from_geohash(score, longitude, latitude);
+                _positions.emplace(name, std::make_pair(longitude, latitude));
+            }
+        });
+    }
+
+    static double haversine(double longitude1, double latitude1, double longitude2, double latitude2) {
+        auto rad = [] (double degrees) { return degrees * M_PI / 180; };
+        double u = std::sin((rad(latitude2) - rad(latitude1)) / 2);
+        double v = std::sin((rad(longitude2) - rad(longitude1)) / 2);
+        return 2 * EARTH_RADIUS_IN_METERS * std::asin(std::sqrt(u * u + std::cos(rad(latitude1)) * std::cos(rad(latitude2)) * v * v));
+    }
+
+    // the members in the shape and their distances to its center.
+    std::map<sstring, double> brute_force(const geo::shape& s) const {
+        std::map<sstring, double> found;
+        for (auto& p : _positions) {
+            auto longitude = p.second.first, latitude = p.second.second;
+            auto dist = haversine(s._longitude, s._latitude, longitude, latitude);
+            bool in = !s._box ? dist <= s._radius
+                : EARTH_RADIUS_IN_METERS * std::abs(latitude - s._latitude) * M_PI / 180 <= s._height / 2
+                  && haversine(longitude, latitude, s._longitude, latitude) <= s._width / 2;
+            if (in) {
+                found.emplace(p.first, dist);
+            }
+        }
+        return found;
+    }
+
+    std::vector<geo::match<sset_entry>> search(const geo::shape& s, size_t count, bool any, int flags) const {
+        std::vector<geo::match<sset_entry>> matches;
+        BOOST_REQUIRE(geo::search(_set, s, count, any, flags, matches));
+        return matches;
+    }
+
+    static sstring name_of(const geo::match<sset_entry>& m) {
+        return sstring(m._entry->key_data(), m._entry->key_size());
+    }
+
+    // The matches are members of the expected ones, once, at their distance.
+    static void check_members(const std::vector<geo::match<sset_entry>>& matches, const std::map<sstring, double>& expected) {
+        std::set<sstring> seen;
+        for (auto& m : matches) {
+            auto name = name_of(m);
+            auto it = expected.find(name);
+            BOOST_REQUIRE(it != expected.end());
+            BOOST_REQUIRE(seen.insert(name).second);
+            BOOST_REQUIRE(std::abs(m._point._dist - it->second) <= 1e-6);
+            BOOST_REQUIRE(m._score == m._entry->score());
+        }
+    }
+
+    static bool ascending(const std::vector<geo::match<sset_entry>>& matches) {
+        return std::is_sorted(matches.begin(), matches.end(), [] (const geo::match<sset_entry>& l, const geo::match<sset_entry>& r) {
+            return l._point._dist < r._point._dist;
+        });
+    }
+
+    static bool descending(const std::vector<geo::match<sset_entry>>& matches) {
+        return std::is_sorted(matches.begin(), matches.end(), [] (const geo::match<sset_entry>& l, const geo::match<sset_entry>& r) {
+            return l._point._dist > r._point._dist;
+        });
+    }
+
+    void check(const geo::shape& s) const {
+        auto expected = brute_force(s);
+        std::vector<double> distances;
+        for (auto& e : expected) {
+            distances.push_back(e.second);
+        }
+        std::sort(distances.begin(), distances.end());
+
+        // every member in the shape, none missed or added, in any order or sorted.
+        auto all = search(s, 0, false, 0);
+        BOOST_REQUIRE(all.size() == expected.size());
+        check_members(all, expected);
+        auto asc = search(s, 0, false, GEORADIUS_ASC);
+        BOOST_REQUIRE(asc.size() == expected.size());
+        BOOST_REQUIRE(ascending(asc));
+        auto desc = search(s, 0, false, GEORADIUS_DESC);
+        BOOST_REQUIRE(desc.size() == expected.size());
+        BOOST_REQUIRE(descending(desc));
+
+        for (size_t count : { size_t(1), size_t(7), expected.size() + 1 }) {
+            auto n = std::min(count, expected.size());
+            // COUNT is the nearest ones, the farthest ones with DESC.
+            auto nearest = search(s, count, false, 0);
+            BOOST_REQUIRE(nearest.size() == n);
+            check_members(nearest, expected);
+            BOOST_REQUIRE(ascending(nearest));
+            for (size_t i = 0; i < n; ++i) {
+                BOOST_REQUIRE(std::abs(nearest[i]._point._dist - distances[i]) <= 1e-6);
+            }
+            auto farthest = search(s, count, false, GEORADIUS_DESC);
+            BOOST_REQUIRE(farthest.size() == n);
+            check_members(farthest, expected);
+            BOOST_REQUIRE(descending(farthest));
+            for (size_t i = 0; i < n; ++i) {
+                BOOST_REQUIRE(std::abs(farthest[i]._point._dist - distances[distances.size() - 1 - i]) <= 1e-6);
+            }
+            // COUNT ANY is any of them, sorted when asked to.
+            auto any = search(s, count, true, 0);
+            BOOST_REQUIRE(any.size() == n);
+            check_members(any, expected);
+            auto any_asc = search(s, count, true, GEORADIUS_ASC);
+            BOOST_REQUIRE(any_asc.size() == n);
+            check_members(any_asc, expected);
+            BOOST_REQUIRE(ascending(any_asc));
+            auto any_desc = search(s, count, true, GEORADIUS_DESC);
+            BOOST_REQUIRE(any_desc.size() == n);
+            check_members(any_desc, expected);
+            BOOST_REQUIRE(descending(any_desc));
+        }
+    }
+
+    sset_lsa _set;
+    std::map<sstring, std::pair<double, double>> _positions;
+};
+
+SEASTAR_TEST_CASE(geo_search_brute_force) {
+    geo_holder h;
+    return h.run();
+}
@@ -0,0 +1,239 @@
+#include "tests/test-utils.hh"
+#include "hll.hh"
+#include "common.hh"
+#include "core/print.hh"
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <stdexcept>
+
+using namespace redis;
+
+static const size_t sparse_entry_size = 4;
+
+static std::vector<sstring> elements(size_t from, size_t n)
+{
+    std::vector<sstring> e;
+    for (size_t i = from; i < from + n; ++i) {
+        e.push_back(sprint("element-%d", i));
+    }
+    return e;
+}
+
+static sstring bytes_of(const managed_bytes& data)
+{
+    return sstring(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+// the registers of an HLL, whatever its encoding.
+static std::vector<uint8_t> registers_of(const managed_bytes& data)
+{
+    std::vector<uint8_t> registers(HLL_BUCKET_COUNT, 0);
+    if (!hll::merge(registers.data(), bytes_of(data))) {
+        throw std::runtime_error("not an HLL");
+    }
+    return registers;
+}
+
+static size_t non_zero(const std::vector<uint8_t>& registers)
+{
+    return registers.size() - std::count(registers.begin(), registers.end(), 0);
+}
+
+static managed_bytes make_sparse()
+{
+    return managed_bytes(HLL_CARD_CACHE_SIZE, 0);
+}
+
+static managed_bytes make_dense()
+{
+    return managed_bytes(HLL_BYTES_SIZE, 0);
+}
+
+// The sparse encoding holds the same registers as the dense one, and is replaced
+// by it once it would take more than sparse_max_bytes.
+SEASTAR_TEST_CASE(sparse_to_dense) {
+    for (size_t sparse_max_bytes : { size_t(0), size_t(3000), size_t(HLL_BYTES_SIZE), std::numeric_limits<size_t>::max() }) {
+        auto sparse = make_sparse();
+        auto dense = make_dense();
+        bool converted = false;
+        for (size_t from = 0; from < 40000; from += 97) {
+            auto batch = elements(from, 97);
+            hll::append(sparse, batch, sparse_max_bytes);
+            hll::append(dense, batch, 0);
+            BOOST_REQUIRE(!hll::sparse(dense));
+            auto registers = registers_of(sparse);
+            BOOST_REQUIRE(registers == registers_of(dense));
+            auto sparse_size = HLL_CARD_CACHE_SIZE + non_zero(registers) * sparse_entry_size;
+            if (hll::sparse(sparse)) {
+                // sparse while it fits, the entries of the registers which are not zero.
+                BOOST_REQUIRE(!converted);
+                BOOST_REQUIRE(sparse.size() == sparse_size);
+                BOOST_REQUIRE(sparse_size <= sparse_max_bytes && sparse_size < size_t(HLL_BYTES_SIZE));
+            }
+            else {
+                // and dense for good past the bound.
+                BOOST_REQUIRE(sparse.size() == size_t(HLL_BYTES_SIZE));
+                BOOST_REQUIRE(converted || sparse_size > sparse_max_bytes || sparse_size >= size_t(HLL_BYTES_SIZE));
+                converted = true;
+            }
+            BOOST_REQUIRE(hll::count(sparse) == hll::count(dense));
+        }
+        BOOST_REQUIRE(converted);
+    }
+    return make_ready_future<>();
+}
+
+// The cardinality is cached until an element changes a register.
+SEASTAR_TEST_CASE(count_cache) {
+    for (auto data : { make_sparse(), make_dense() }) {
+        BOOST_REQUIRE(hll::count(data) == 0);
+        BOOST_REQUIRE(hll::append(data, elements(0, 1000), 3000));
+        auto card = hll::count(data);
+        BOOST_CHECK(card > 950 && card < 1050);
+        BOOST_REQUIRE(hll::count(data) == card);
+        // the same elements again change nothing.
+        BOOST_REQUIRE(!hll::append(data, elements(0, 1000), 3000));
+        BOOST_REQUIRE(hll::count(data) == card);
+        BOOST_REQUIRE(hll::append(data, elements(1000, 1000), 3000));
+        BOOST_REQUIRE(hll::count(data) > card);
+    }
+    return make_ready_future<>();
+}
+
+// PFCOUNT of several keys and PFMERGE: sparse and dense sources merge into the
+// registers of the union of their elements, with both kernels.
+SEASTAR_TEST_CASE(merge) {
+    std::vector<managed_bytes> sources;
+    for (size_t k = 0; k < 8; ++k) {
+        auto data = k % 2 ? make_dense() : make_sparse();
+        // a few elements in common, and some keys which stay sparse.
+        hll::append(data, elements(k * 300, k < 4 ? 200 : 5000), 3000);
+        sources.push_back(std::move(data));
+    }
+    auto all = make_dense();
+    for (size_t k = 0; k < 8; ++k) {
+        hll::append(all, elements(k * 300, k < 4 ? 200 : 5000), 0);
+    }
+    auto expected = registers_of(all);
+    auto expected_count = hll::count(all);
+
+    for (bool portable : { false, true }) {
+        hll::use_portable_kernels(portable);
+        std::vector<uint8_t> registers(HLL_BUCKET_COUNT, 0);
+        for (auto& source : sources) {
+            BOOST_REQUIRE(hll::merge(registers.data(), bytes_of(source)));
+        }
+        BOOST_REQUIRE(registers == expected);
+        BOOST_REQUIRE(hll::count(registers.data()) == expected_count);
+
+        // the destination of PFMERGE, sparse while the result fits.
+        for (size_t sparse_max_bytes : { size_t(0), size_t(3000), size_t(HLL_BYTES_SIZE) }) {
+            for (auto dest : { make_sparse(), make_dense() }) {
+                hll::append(dest, elements(100000, 50), sparse_max_bytes);
+                auto merged = registers_of(dest);
+                for (size_t i = 0; i < merged.size(); ++i) {
+                    merged[i] = std::max(merged[i], registers[i]);
+                }
+                BOOST_REQUIRE(hll::merge(dest, registers.data(), sparse_max_bytes));
+                BOOST_REQUIRE(registers_of(dest) == merged);
+                auto sparse_size = HLL_CARD_CACHE_SIZE + non_zero(merged) * sparse_entry_size;
+                BOOST_REQUIRE(hll::sparse(dest) == (sparse_size <= sparse_max_bytes && sparse_size < size_t(HLL_BYTES_SIZE)));
+                BOOST_REQUIRE(hll::count(dest) == hll::count(merged.data()));
+            }
+        }
+        // a merge of sparse sources only stays sparse.
+        std::vector<uint8_t> small(HLL_BUCKET_COUNT, 0);
+        for (size_t k = 0; k < 4; k += 2) {
+            BOOST_REQUIRE(hll::merge(small.data(), bytes_of(sources[k])));
+        }
+        auto dest = make_sparse();
+        BOOST_REQUIRE(hll::merge(dest, small.data(), 3000));
+        BOOST_REQUIRE(hll::sparse(dest));
+        BOOST_REQUIRE(registers_of(dest) == small);
+    }
+    hll::use_portable_kernels(false);
+    // what is not an HLL is not merged.
+    std::vector<uint8_t> registers(HLL_BUCKET_COUNT, 0);
+    BOOST_REQUIRE(!hll::merge(registers.data(), sstring("not an HLL")));
+    BOOST_REQUIRE(!hll::merge(registers.data(), sstring(HLL_BYTES_SIZE + 1, '\0')));
+    return make_ready_future<>();
+}
+
+// The kernels of this cpu and the portable ones agree on any registers, the
+// sparse estimate as well.
+SEASTAR_TEST_CASE(kernels) {
+    std::mt19937_64 rng(20);
+    std::uniform_int_distribution<int> value(0, 32);
+    std::uniform_real_distribution<double> u01(0, 1);
+    for (double density : { 0.0, 0.01, 0.1, 0.5, 1.0 }) {
+        std::vector<uint8_t> a(HLL_BUCKET_COUNT, 0), b(HLL_BUCKET_COUNT, 0);
+        for (size_t i = 0; i < a.size(); ++i) {
+            a[i] = u01(rng) < density ? value(rng) : 0;
+            b[i] = u01(rng) < density ? value(rng) : 0;
+        }
+        std::vector<uint8_t> expected(HLL_BUCKET_COUNT);
+        for (size_t i = 0; i < a.size(); ++i) {
+            expected[i] = std::max(a[i], b[i]);
+        }
+        size_t counts[2];
+        for (bool portable : { false, true }) {
+            hll::use_portable_kernels(portable);
+            // b is merged through its dense encoding, which runs the max kernel.
+            auto dense = make_dense();
+            BOOST_REQUIRE(hll::merge(dense, b.data(), 0));
+            BOOST_REQUIRE(!hll::sparse(dense));
+            auto merged = a;
+            BOOST_REQUIRE(hll::merge(merged.data(), bytes_of(dense)));
+            BOOST_REQUIRE(merged == expected);
+            counts[portable] = hll::count(merged.data());
+            BOOST_REQUIRE(hll::count(dense) == hll::count(b.data()));
+        }
+        hll::use_portable_kernels(false);
+        BOOST_REQUIRE(counts[0] == counts[1]);
+        auto sparse = make_sparse();
+        BOOST_REQUIRE(hll::merge(sparse, expected.data(), std::numeric_limits<size_t>::max()));
+        if (hll::sparse(sparse)) {
+            BOOST_REQUIRE(hll::count(sparse) == counts[0]);
+        }
+    }
+    return make_ready_future<>();
+}
+
+// What PFMERGE logs, the raw bytes of either encoding, is an HLL again once
+// SET into a string; other strings are not.
+SEASTAR_TEST_CASE(valid) {
+    auto sparse = make_sparse();
+    auto dense = make_dense();
+    auto check_valid = [] (const managed_bytes& data) {
+        return hll::valid(reinterpret_cast<const char*>(data.data()), data.size());
+    };
+    BOOST_REQUIRE(check_valid(sparse) && check_valid(dense));
+    hll::append(sparse, elements(0, 100), 3000);
+    hll::append(dense, elements(0, 100000), 0);
+    BOOST_REQUIRE(hll::sparse(sparse) && check_valid(sparse));
+    BOOST_REQUIRE(check_valid(dense));
+
+    auto s = bytes_of(sparse);
+    BOOST_REQUIRE(!hll::valid(s.data(), s.size() - 1));
+    BOOST_REQUIRE(!hll::valid(s.data(), HLL_CARD_CACHE_SIZE - 1));
+    // the sparse entries are sorted, of registers which are set, in range.
+    auto entry = s.size() - 4;
+    auto broken = s;
+    std::swap_ranges(&broken[HLL_CARD_CACHE_SIZE], &broken[HLL_CARD_CACHE_SIZE] + 4, &broken[entry]);
+    BOOST_REQUIRE(!hll::valid(broken.data(), broken.size()));
+    broken = s;
+    broken[entry] = 0;
+    BOOST_REQUIRE(!hll::valid(broken.data(), broken.size()));
+    broken = s;
+    broken[entry] = 52;
+    BOOST_REQUIRE(!hll::valid(broken.data(), broken.size()));
+    broken = s;
+    broken[entry + 3] = char(0xff);
+    BOOST_REQUIRE(!hll::valid(broken.data(), broken.size()));
+    // a dense register is at most 51.
+    auto d = bytes_of(dense);
+    d[HLL_CARD_CACHE_SIZE] = char(63);
+    BOOST_REQUIRE(!hll::valid(d.data(), d.size()));
+    return make_ready_future<>();
+}
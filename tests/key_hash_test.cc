@@ -0,0 +1,79 @@
+#include "tests/test-utils.hh"
+#include "key_hash.hh"
+#include "core/print.hh"
+#include "core/sstring.hh"
+#include <limits>
+#include <vector>
+
+using namespace redis;
+
+struct known_answer {
+    sstring key;
+    uint64_t hash;
+    // the shard among 3, 8 and 12 shards.
+    unsigned shards[3];
+};
+
+// MurmurHash64A with key_hash_seed, as the reference implementation computes it on a
+// little endian cpu. The shard of a key is where its entries are, in the snapshots
+// too, so these must not change.
+static const std::vector<known_answer> known_answers = {
+    { sstring(), 0x84d69dcef1e6733aULL, { 1, 4, 6 } },
+    { "a", 0xb2b29803fc3845c1ULL, { 2, 5, 8 } },
+    { "ab", 0xa0c8db531672346aULL, { 1, 5, 7 } },
+    { "abc", 0x78886a7108057be8ULL, { 1, 3, 5 } },
+    { "abcd", 0xd6ff9c2c8e5f1cc2ULL, { 2, 6, 10 } },
+    { "abcde", 0xd1cb40211fbd6102ULL, { 2, 6, 9 } },
+    { "abcdef", 0x78b6de25e3a5cc74ULL, { 1, 3, 5 } },
+    { "abcdefg", 0x87893c601f490c77ULL, { 1, 4, 6 } },
+    { "abcdefgh", 0x3c637301817a7cbdULL, { 0, 1, 2 } },
+    { "abcdefghi", 0x0e64643616cc82a1ULL, { 0, 0, 0 } },
+    { "key:000000000001", 0x3f0bc505ee6df246ULL, { 0, 1, 2 } },
+    { "user:1000:profile", 0x43ce357892f122ceULL, { 0, 2, 3 } },
+    { sstring("\xff\xfe\x00\x01\x80\x7f\x10\x20\x30", 9), 0x5dea5f8d12385cb3ULL, { 1, 2, 4 } },
+};
+
+SEASTAR_TEST_CASE(key_hash_known_answers) {
+    for (auto& a : known_answers) {
+        auto hash = hash_key(a.key.data(), a.key.size());
+        BOOST_REQUIRE(hash == a.hash);
+        BOOST_REQUIRE(shard_of(hash, 1) == 0);
+        BOOST_REQUIRE(shard_of(hash, 3) == a.shards[0]);
+        BOOST_REQUIRE(shard_of(hash, 8) == a.shards[1]);
+        BOOST_REQUIRE(shard_of(hash, 12) == a.shards[2]);
+        // wherever the key lies in memory.
+        for (size_t offset = 1; offset < 8; ++offset) {
+            sstring moved = sstring(offset, 'x') + a.key;
+            BOOST_REQUIRE(hash_key(moved.data() + offset, a.key.size()) == a.hash);
+        }
+    }
+    return make_ready_future<>();
+}
+
+// The shards are taken from the high half of the hash, the bounds included, and the
+// keys spread evenly over them.
+SEASTAR_TEST_CASE(shard_of_range) {
+    for (unsigned shards = 1; shards <= 64; ++shards) {
+        BOOST_REQUIRE(shard_of(0, shards) == 0);
+        BOOST_REQUIRE(shard_of(std::numeric_limits<uint32_t>::max(), shards) == 0);
+        BOOST_REQUIRE(shard_of(std::numeric_limits<uint64_t>::max(), shards) == shards - 1);
+        unsigned last = 0;
+        for (uint64_t high = 0; high < (uint64_t(1) << 32); high += 0x1000001) {
+            auto shard = shard_of(high << 32, shards);
+            BOOST_REQUIRE(shard >= last && shard < shards);
+            last = shard;
+        }
+    }
+    const size_t keys = 100000;
+    for (unsigned shards : { 3, 7, 8, 12 }) {
+        std::vector<size_t> counts(shards);
+        for (size_t i = 0; i < keys; ++i) {
+            auto key = sprint("key:%012d", i);
+            ++counts[shard_of(hash_key(key.data(), key.size()), shards)];
+        }
+        for (auto c : counts) {
+            BOOST_REQUIRE(c > keys / shards * 95 / 100 && c < keys / shards * 105 / 100);
+        }
+    }
+    return make_ready_future<>();
+}
@@ -0,0 +1,197 @@
+#include "tests/test-utils.hh"
+#include "redis_protocol_parser.hh"
+#include "core/print.hh"
+#include "core/sstring.hh"
+#include "core/temporary_buffer.hh"
+#include <vector>
+
+using command = redis_protocol_parser::command;
+
+// A request as the client sends it, with the offsets of its arguments.
+struct request {
+    sstring data;
+    std::vector<sstring> args;
+    std::vector<size_t> offsets;
+
+    request(std::vector<sstring> command_and_args) {
+        data = sprint("*%d\r\n", command_and_args.size());
+        for (size_t i = 0; i < command_and_args.size(); ++i) {
+            auto& a = command_and_args[i];
+            data += sprint("$%d\r\n", a.size());
+            if (i > 0) {
+                args.push_back(a);
+                offsets.push_back(data.size());
+            }
+            data += a + "\r\n";
+        }
+    }
+};
+
+struct parsed_request {
+    command cmd;
+    std::vector<sstring> args;
+    // whether the argument is a share of the buffer it was read from.
+    std::vector<bool> shared;
+    uint64_t args_bytes;
+    uint64_t copied_bytes;
+};
+
+static bool within(const std::vector<temporary_buffer<char>>& buffers, const temporary_buffer<char>& arg)
+{
+    for (auto& b : buffers) {
+        if (arg.get() >= b.get() && arg.get() < b.get() + b.size() && arg.get() + arg.size() <= b.get() + b.size()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parses the pieces as the reads of a connection return them, as
+// redis_protocol::parse_requests() does.
+static std::vector<parsed_request> parse(const std::vector<sstring>& pieces)
+{
+    redis_protocol_parser parser;
+    parser.init();
+    std::vector<parsed_request> out;
+    // the buffers outlive the parser's shares of them.
+    std::vector<temporary_buffer<char>> buffers;
+    buffers.reserve(pieces.size());
+    for (auto& piece : pieces) {
+        buffers.emplace_back(piece.data(), piece.size());
+        auto& buf = buffers.back();
+        char* p = buf.get_write();
+        char* pe = p + buf.size();
+        parser.set_input(buf);
+        while (p != pe) {
+            p = parser.parse(p, pe, nullptr);
+            if (p == nullptr) {
+                break;
+            }
+            BOOST_REQUIRE(parser._state == redis_protocol_parser::state::ok);
+            parsed_request r { parser._command, {}, {}, parser._args_bytes, parser._copied_bytes };
+            for (auto& a : parser._args_list) {
+                r.args.emplace_back(a.get(), a.size());
+                r.shared.push_back(within(buffers, a));
+            }
+            out.push_back(std::move(r));
+            parser.init();
+        }
+    }
+    return out;
+}
+
+// The pieces of the data cut at the positions.
+static std::vector<sstring> cut(const sstring& data, std::vector<size_t> positions)
+{
+    std::vector<sstring> pieces;
+    size_t from = 0;
+    positions.push_back(data.size());
+    for (auto to : positions) {
+        pieces.push_back(data.substr(from, to - from));
+        from = to;
+    }
+    return pieces;
+}
+
+// Checks the requests parsed from the data cut at the positions: every argument
+// is as it was sent, a share of the buffer holding all of it, or else a copy which
+// is accounted.
+static void check(const std::vector<request>& requests, std::vector<command> commands, const std::vector<size_t>& positions)
+{
+    sstring data;
+    for (auto& r : requests) {
+        data += r.data;
+    }
+    auto parsed = parse(cut(data, positions));
+    BOOST_REQUIRE(parsed.size() == requests.size());
+    size_t base = 0;
+    for (size_t i = 0; i < requests.size(); ++i) {
+        auto& r = requests[i];
+        auto& p = parsed[i];
+        BOOST_REQUIRE(p.cmd == commands[i]);
+        BOOST_REQUIRE(p.args == r.args);
+        uint64_t bytes = 0, copied = 0;
+        for (size_t a = 0; a < r.args.size(); ++a) {
+            auto begin = base + r.offsets[a];
+            auto end = begin + r.args[a].size();
+            bool split = false;
+            for (auto pos : positions) {
+                split |= pos > begin && pos < end;
+            }
+            BOOST_REQUIRE(p.shared[a] == !split);
+            bytes += r.args[a].size();
+            copied += split ? r.args[a].size() : 0;
+        }
+        BOOST_REQUIRE(p.args_bytes == bytes);
+        BOOST_REQUIRE(p.copied_bytes == copied);
+        base += r.data.size();
+    }
+}
+
+static std::vector<request> sample()
+{
+    return {
+        request({ "set", "key", sstring(100, 'v') }),
+        request({ "get", "key" }),
+        request({ "mset", "a", "1", "bb", "", "c", "\r\n$3\r\n" }),
+        request({ "append", "key", "" }),
+        request({ "rpush", "list", "x", "", "yyyy" }),
+    };
+}
+
+static const std::vector<command> sample_commands = { command::set, command::get, command::mset, command::append, command::rpush };
+
+// The arguments of the requests in a single buffer are shares of it, nothing copied.
+SEASTAR_TEST_CASE(parse_whole) {
+    check(sample(), sample_commands, {});
+    return make_ready_future<>();
+}
+
+// An argument split between two reads is copied, whole in either of them it is a
+// share of it; the zero length ones included, wherever the reads end.
+SEASTAR_TEST_CASE(parse_split) {
+    sstring data;
+    for (auto& r : sample()) {
+        data += r.data;
+    }
+    for (size_t pos = 1; pos < data.size(); ++pos) {
+        check(sample(), sample_commands, { pos });
+    }
+    for (size_t pos = 1; pos + 7 < data.size(); pos += 3) {
+        check(sample(), sample_commands, { pos, pos + 7 });
+    }
+    return make_ready_future<>();
+}
+
+// A byte a read, so every argument of more than one byte is copied.
+SEASTAR_TEST_CASE(parse_bytes) {
+    sstring data;
+    for (auto& r : sample()) {
+        data += r.data;
+    }
+    std::vector<size_t> positions;
+    for (size_t pos = 1; pos < data.size(); ++pos) {
+        positions.push_back(pos);
+    }
+    check(sample(), sample_commands, positions);
+    return make_ready_future<>();
+}
+
+// Zero length bulk strings, alone, in a row and last in the data.
+SEASTAR_TEST_CASE(parse_empty_args) {
+    std::vector<request> requests = {
+        request({ "set", "", "" }),
+        request({ "mset", "", "", "", "" }),
+        request({ "get", "" }),
+    };
+    std::vector<command> commands = { command::set, command::mset, command::get };
+    check(requests, commands, {});
+    sstring data;
+    for (auto& r : requests) {
+        data += r.data;
+    }
+    for (size_t pos = 1; pos < data.size(); ++pos) {
+        check(requests, commands, { pos });
+    }
+    return make_ready_future<>();
+}
@@ -0,0 +1,92 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "core/app-template.hh"
+#include "core/reactor.hh"
+#include "bitmap_lsa.hh"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace redis;
+
+// SETBIT on a string and on a compressed bitmap, with user ids spread over the
+// 32 bits offsets and with increasing ones, and the memory both take. Then
+// BITCOUNT, BITPOS and BITOP on the resulting bitmaps.
+
+template <typename Func>
+static void run(const char* name, size_t iterations, Func&& func)
+{
+    uint64_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        sink += func(i);
+    }
+    auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+    std::cout << sprint("%-36s %10.1f ns/op  (%d)\n", name, ns, sink);
+}
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    app_template app;
+    app.add_options()
+        ("ids", bpo::value<size_t>()->default_value(1000000), "bits set per bitmap")
+        ("max-id", bpo::value<uint64_t>()->default_value(uint64_t(1) << 30), "largest offset of the sparse bitmaps");
+    return app.run(ac, av, [&app] {
+        auto& config = app.configuration();
+        auto ids = config["ids"].as<size_t>();
+        auto max_id = std::min(config["max-id"].as<uint64_t>(), bitmap_lsa::max_offset);
+        std::mt19937_64 rng(1);
+        std::vector<uint64_t> sparse(ids);
+        for (auto& id : sparse) {
+            id = rng() % max_id;
+        }
+
+        managed_bytes string;
+        run("setbit sparse (string)", ids, [&] (size_t i) { return bits_operation::set(string, sparse[i], true); });
+        bitmap_lsa a;
+        run("setbit sparse (bitmap)", ids, [&] (size_t i) { return a.set(sparse[i], true); });
+        std::cout << sprint("sparse: string %d bytes, bitmap %d bytes in %d containers\n", string.size(), a.memory_usage(), a.containers());
+
+        managed_bytes sequential;
+        run("setbit increasing (string)", ids, [&] (size_t i) { return bits_operation::set(sequential, i, true); });
+        bitmap_lsa b;
+        run("setbit increasing (bitmap)", ids, [&] (size_t i) { return b.set(i, true); });
+        std::cout << sprint("increasing: string %d bytes, bitmap %d bytes in %d containers\n", sequential.size(), b.memory_usage(), b.containers());
+
+        run("getbit sparse (bitmap)", ids, [&] (size_t i) { return a.get(sparse[ids - 1 - i]); });
+        run("bitcount (string)", 10, [&] (size_t) { return bits_operation::count(string, 0, -1); });
+        run("bitcount (bitmap)", 10, [&] (size_t) { return a.count(0, -1); });
+        run("bitpos 0 (bitmap)", 10, [&] (size_t) { return uint64_t(b.pos(false, 0, -1, false)); });
+        run("bitop or (bitmap)", 10, [&] (size_t) {
+            bitmap_lsa r(a);
+            r.combine(bitop_type::OR, b);
+            return r.cardinality();
+        });
+        run("bitop and (bitmap)", 10, [&] (size_t) {
+            bitmap_lsa r(a);
+            r.combine(bitop_type::AND, b);
+            return r.cardinality();
+        });
+        return make_ready_future<>();
+    });
+}
@@ -0,0 +1,86 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "core/app-template.hh"
+#include "core/reactor.hh"
+#include "bits_operation.hh"
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace redis;
+
+// Compares the kernels selected for this cpu with the portable ones on a bitmap
+// as large as a daily active users one: BITCOUNT over the whole bitmap, BITPOS
+// of the first set bit in a sparse bitmap and of the first clear bit in a dense
+// one, and the word-wide BITOP against a loop over the bytes.
+
+template <typename Func>
+static void run(const char* name, size_t iterations, size_t bytes, Func&& func)
+{
+    uint64_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        sink += func();
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << sprint("%-28s %8.2f GB/s  %8.3f ms/op  (%d)\n",
+        name, double(bytes) * iterations / elapsed / 1e9, elapsed * 1e3 / iterations, sink);
+}
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    app_template app;
+    app.add_options()
+        ("bits", bpo::value<size_t>()->default_value(128 * 1024 * 1024), "bits per bitmap")
+        ("iterations", bpo::value<size_t>()->default_value(20), "runs per measurement");
+    return app.run(ac, av, [&app] {
+        auto& config = app.configuration();
+        auto size = config["bits"].as<size_t>() / 8;
+        auto iterations = config["iterations"].as<size_t>();
+        std::mt19937_64 rng(1);
+        std::vector<char> random(size), sparse(size, 0), dense(size, char(0xff)), dst(size);
+        for (auto& b : random) {
+            b = char(rng());
+        }
+        sparse[size - 1] = 1;
+        dense[size - 1] = char(0xfe);
+        std::cout << "kernels: " << bits_operation::kernel_name() << "\n";
+
+        run("bitcount (scalar)", iterations, size, [&] { return bits_operation::popcount_scalar(random.data(), size); });
+        run("bitcount", iterations, size, [&] { return bits_operation::popcount(random.data(), size); });
+        run("bitpos 1 sparse (scalar)", iterations, size, [&] { return bits_operation::find_bit_scalar(sparse.data(), size, true); });
+        run("bitpos 1 sparse", iterations, size, [&] { return bits_operation::find_bit(sparse.data(), size, true); });
+        run("bitpos 0 dense (scalar)", iterations, size, [&] { return bits_operation::find_bit_scalar(dense.data(), size, false); });
+        run("bitpos 0 dense", iterations, size, [&] { return bits_operation::find_bit(dense.data(), size, false); });
+        run("bitop and (bytes)", iterations, size, [&] {
+            for (size_t i = 0; i < size; ++i) {
+                dst[i] &= random[i];
+            }
+            return uint64_t(dst[0]);
+        });
+        run("bitop and", iterations, size, [&] {
+            bits_operation::combine(bitop_type::AND, dst.data(), random.data(), size);
+            return uint64_t(dst[0]);
+        });
+        return make_ready_future<>();
+    });
+}
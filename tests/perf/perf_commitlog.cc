@@ -0,0 +1,98 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "core/app-template.hh"
+#include "core/reactor.hh"
+#include "core/thread.hh"
+#include "config.hh"
+#include "db.hh"
+#include "redis.hh"
+#include "storage_proxy.hh"
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <iostream>
+
+using namespace redis;
+
+// Measures the throughput of pipelined SETs served as a client sends them, without
+// the commit log and with it in periodic mode. Appending only copies the request
+// into the buffer of the log, so the throughput with the log should stay within a
+// few percent of the one without it.
+
+static sstring pipeline(size_t requests, size_t value_size)
+{
+    sstring value(value_size, 'v');
+    sstring out;
+    for (size_t i = 0; i < requests; ++i) {
+        auto key = sprint("key:%012d", i);
+        out += sprint("*3\r\n$3\r\nset\r\n$%d\r\n%s\r\n$%d\r\n%s\r\n", key.size(), key, value.size(), value);
+    }
+    return out;
+}
+
+// Returns the served requests per second.
+static double run(const char* name, size_t iterations, const sstring& requests, size_t count)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        storage_proxy::serve(requests).get();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    auto seconds = std::chrono::duration<double>(elapsed).count();
+    auto rate = iterations * count / seconds;
+    std::cout << sprint("%-24s requests/s: %12.0f  time/request: %7.1f ns\n", name, rate, 1e9 / rate);
+    return rate;
+}
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    app_template app;
+    app.add_options()
+        ("iterations", bpo::value<size_t>()->default_value(2000), "pipelines per measurement")
+        ("pipeline", bpo::value<size_t>()->default_value(100), "requests per pipeline")
+        ("value-size", bpo::value<size_t>()->default_value(64), "bytes per value");
+    return app.run(ac, av, [&app] {
+        return seastar::async([&app] {
+            auto& config = app.configuration();
+            auto iterations = config["iterations"].as<size_t>();
+            auto count = config["pipeline"].as<size_t>();
+            auto requests = pipeline(count, config["value-size"].as<size_t>());
+
+            auto directory = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("perf_commitlog-%%%%-%%%%");
+            redis::config cfg;
+            cfg.commitlog_directory(sstring(directory.string().c_str()));
+            get_database().start(std::ref(cfg)).get();
+            get_redis_service().start().get();
+
+            // the keys exist in both runs, so both only replace the values.
+            storage_proxy::serve(requests).get();
+            auto without = run("set", iterations, requests, count);
+            get_database().invoke_on_all([] (database& db) {
+                return db.start_commitlog(1);
+            }).get();
+            auto with = run("set, commit log", iterations, requests, count);
+            std::cout << sprint("throughput with the commit log: %.1f%%\n", 100 * with / without);
+
+            get_redis_service().stop().get();
+            get_database().stop().get();
+            boost::filesystem::remove_all(directory);
+        });
+    });
+}
@@ -0,0 +1,128 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "core/app-template.hh"
+#include "core/reactor.hh"
+#include "geo.hh"
+#include "common.hh"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace redis;
+
+// GEOSEARCH BYRADIUS ... COUNT 10 around random places of a city full of points.
+// The cells are read from a sorted vector of scores, as the sorted set does after
+// its seek, and the candidates are tested one at a time with a full decode and
+// distance, as before, or in batches by the matcher, then the nearest are
+// selected. Also compares the bounds kernel selected for this cpu with the
+// portable one.
+
+template <typename Func>
+static void run(const char* name, size_t iterations, Func&& func)
+{
+    uint64_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        sink += func(i);
+    }
+    auto elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    std::cout << sprint("%-32s %10.2f us/op  (%d)\n", name, elapsed / iterations, sink);
+}
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    app_template app;
+    app.add_options()
+        ("points", bpo::value<size_t>()->default_value(4000000), "points in the set")
+        ("radius", bpo::value<double>()->default_value(500), "radius of the searches, in meters")
+        ("count", bpo::value<size_t>()->default_value(10), "COUNT of the searches")
+        ("queries", bpo::value<size_t>()->default_value(2000), "searches per measurement");
+    return app.run(ac, av, [&app] {
+        auto& config = app.configuration();
+        auto size = config["points"].as<size_t>();
+        auto radius = config["radius"].as<double>();
+        auto count = config["count"].as<size_t>();
+        auto queries = config["queries"].as<size_t>();
+        std::mt19937_64 rng(1);
+        std::uniform_real_distribution<double> lon(116.0, 116.8), lat(39.6, 40.2);
+        std::vector<double> scores(size);
+        for (auto& score : scores) {
+            geo::encode_to_geohash(lon(rng), lat(rng), score);
+        }
+        std::sort(scores.begin(), scores.end());
+        std::vector<geo::shape> shapes(queries);
+        for (auto& s : shapes) {
+            s._longitude = lon(rng);
+            s._latitude = lat(rng);
+            s._radius = radius;
+        }
+        std::cout << "kernels: " << geo::kernel_name() << "\n";
+
+        run("georadius (one at a time)", queries, [&] (size_t q) {
+            auto& s = shapes[q];
+            std::vector<std::pair<double, double>> found;
+            geo::fetch_cells(s, [&] (uint64_t min, uint64_t max) {
+                for (auto it = std::lower_bound(scores.begin(), scores.end(), double(min)); it != scores.end() && *it < max; ++it) {
+                    double longitude = 0, latitude = 0, dist = 0;
+                    geo::decode_from_geohash(*it, longitude, latitude);
+                    geo::dist(s._longitude, s._latitude, longitude, latitude, dist);
+                    if (dist <= s._radius) {
+                        found.emplace_back(dist, *it);
+                    }
+                }
+            });
+            std::sort(found.begin(), found.end());
+            return std::min(found.size(), count);
+        });
+        run("geosearch (batched, top k)", queries, [&] (size_t q) {
+            geo::matcher matcher(shapes[q]);
+            std::vector<geo::point> points(geo::batch_size);
+            std::vector<double> found;
+            geo::fetch_cells(shapes[q], [&] (uint64_t min, uint64_t max) {
+                auto first = std::lower_bound(scores.begin(), scores.end(), double(min));
+                auto last = std::lower_bound(first, scores.end(), double(max));
+                for (; first < last; first += std::min<ptrdiff_t>(geo::batch_size, last - first)) {
+                    auto n = std::min<ptrdiff_t>(geo::batch_size, last - first);
+                    auto matched = matcher.match(&*first, n, points.data());
+                    for (size_t i = 0; i < matched; ++i) {
+                        found.push_back(points[i]._dist);
+                    }
+                }
+            });
+            auto k = std::min(found.size(), count);
+            std::partial_sort(found.begin(), found.begin() + k, found.end());
+            return k;
+        });
+
+        std::vector<uint32_t> keep(geo::batch_size);
+        geo::matcher matcher(shapes[0]);
+        auto batches = size / geo::batch_size;
+        run("bounds (scalar), per batch", batches, [&] (size_t b) {
+            return geo::within_bounds_scalar(scores.data() + b * geo::batch_size, geo::batch_size, matcher.bounds(), keep.data());
+        });
+        run("bounds, per batch", batches, [&] (size_t b) {
+            return geo::within_bounds(scores.data() + b * geo::batch_size, geo::batch_size, matcher.bounds(), keep.data());
+        });
+        return make_ready_future<>();
+    });
+}
@@ -0,0 +1,135 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "core/app-template.hh"
+#include "core/reactor.hh"
+#include "hll.hh"
+#include "common.hh"
+#include <chrono>
+#include <iostream>
+
+using namespace redis;
+
+// PFCOUNT over many keys: the sources are merged into one array of registers and
+// counted. Compares the former merge, one packed register at a time, with the
+// kernels, and reports the memory taken by HLLs of a few distinct elements.
+
+static const size_t packed_size = HLL_BYTES_SIZE - HLL_CARD_CACHE_SIZE;
+
+static uint8_t old_get(const uint8_t* p, size_t index)
+{
+    size_t byte = index * HLL_BITS / 8, fb = index * HLL_BITS & 7;
+    unsigned b0 = p[byte], b1 = byte + 1 < packed_size ? p[byte + 1] : 0;
+    return ((b0 >> fb) | (b1 << (8 - fb))) & 63;
+}
+
+static void old_set(uint8_t* p, size_t index, uint8_t v)
+{
+    size_t byte = index * HLL_BITS / 8, fb = index * HLL_BITS & 7;
+    p[byte] &= ~(63 << fb);
+    p[byte] |= v << fb;
+    if (byte + 1 < packed_size) {
+        p[byte + 1] &= ~(63 >> (8 - fb));
+        p[byte + 1] |= v >> (8 - fb);
+    }
+}
+
+static size_t old_pfcount(const std::vector<sstring>& sources)
+{
+    std::vector<uint8_t> merged(HLL_BYTES_SIZE, 0);
+    auto p = merged.data() + HLL_CARD_CACHE_SIZE;
+    for (auto& source : sources) {
+        auto s = reinterpret_cast<const uint8_t*>(source.data()) + HLL_CARD_CACHE_SIZE;
+        for (size_t i = 0; i < HLL_BUCKET_COUNT; ++i) {
+            auto v = old_get(s, i);
+            if (v > old_get(p, i)) {
+                old_set(p, i, v);
+            }
+        }
+    }
+    // the registers are summed one at a time, as the estimate does.
+    double sum = 0;
+    for (size_t i = 0; i < HLL_BUCKET_COUNT; ++i) {
+        sum += 1.0 / double(uint64_t(1) << old_get(p, i));
+    }
+    return size_t(sum);
+}
+
+static size_t new_pfcount(const std::vector<sstring>& sources)
+{
+    std::vector<uint8_t> registers(HLL_BUCKET_COUNT, 0);
+    for (auto& source : sources) {
+        hll::merge(registers.data(), source);
+    }
+    return hll::count(registers.data());
+}
+
+template <typename Func>
+static void run(const char* name, size_t iterations, Func&& func)
+{
+    size_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        sink += func();
+    }
+    auto us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+    std::cout << sprint("%-32s %10.1f us/op  (%d)\n", name, us, sink / iterations);
+}
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    app_template app;
+    app.add_options()
+        ("keys", bpo::value<size_t>()->default_value(100), "keys per PFCOUNT")
+        ("elements", bpo::value<size_t>()->default_value(20000), "distinct elements per key")
+        ("iterations", bpo::value<size_t>()->default_value(100), "runs per measurement");
+    return app.run(ac, av, [&app] {
+        auto& config = app.configuration();
+        auto keys = config["keys"].as<size_t>();
+        auto elements = config["elements"].as<size_t>();
+        auto iterations = config["iterations"].as<size_t>();
+        std::cout << "kernels: " << hll::kernel_name() << "\n";
+
+        std::vector<sstring> sources;
+        for (size_t k = 0; k < keys; ++k) {
+            managed_bytes data(HLL_BYTES_SIZE, 0);
+            std::vector<sstring> batch;
+            for (size_t i = 0; i < elements; ++i) {
+                batch.push_back(to_sstring(k * elements / 2 + i));
+            }
+            hll::append(data, batch, 0);
+            sources.emplace_back(reinterpret_cast<const char*>(data.data()), data.size());
+        }
+        run("pfcount dense keys (old)", iterations, [&sources] { return old_pfcount(sources); });
+        run("pfcount dense keys", iterations, [&sources] { return new_pfcount(sources); });
+
+        for (size_t n : { 1, 10, 100, 500, 1000 }) {
+            managed_bytes data(HLL_CARD_CACHE_SIZE, 0);
+            std::vector<sstring> batch;
+            for (size_t i = 0; i < n; ++i) {
+                batch.push_back(to_sstring(i));
+            }
+            hll::append(data, batch, 3000);
+            std::cout << sprint("%5d elements: %5d bytes (%s), dense takes %d\n",
+                n, data.size(), hll::sparse(data) ? "sparse" : "dense", HLL_BYTES_SIZE);
+        }
+        return make_ready_future<>();
+    });
+}
@@ -0,0 +1,156 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "core/app-template.hh"
+#include "core/reactor.hh"
+#include "core/sstring.hh"
+#include "key_hash.hh"
+#include <chrono>
+#include <random>
+#include <iostream>
+
+using namespace redis;
+
+// Compares the key routing of std::hash<sstring> (shard = hash % shards) with
+// hash_key (shard = shard_of(hash)). Every shard owns a power of 2 bucket array
+// indexed by the low bits of the same hash, as cache does, so the bucket
+// occupancy and the lookup time show how the two indexes interfere.
+
+struct routing {
+    const char* name;
+    uint64_t (*hash)(const sstring&);
+    unsigned (*shard)(uint64_t, unsigned);
+};
+
+static uint64_t std_hash(const sstring& key) { return std::hash<sstring>()(key); }
+static unsigned std_shard(uint64_t hash, unsigned shards) { return hash % shards; }
+static uint64_t murmur_hash(const sstring& key) { return hash_key(key.data(), key.size()); }
+
+static constexpr uint32_t none = ~uint32_t(0);
+
+// A chained hash table of key indexes, with the load factor of cache.
+class shard_table {
+    std::vector<uint32_t> _heads;
+    std::vector<uint32_t> _next;
+    std::vector<uint32_t> _keys;
+public:
+    explicit shard_table(size_t count)
+    {
+        size_t buckets = 16;
+        while (buckets * 3 / 4 < count) {
+            buckets *= 2;
+        }
+        _heads.assign(buckets, none);
+    }
+    void insert(uint32_t key, uint64_t hash)
+    {
+        auto& head = _heads[hash & (_heads.size() - 1)];
+        _keys.push_back(key);
+        _next.push_back(head);
+        head = _keys.size() - 1;
+    }
+    bool find(const std::vector<sstring>& keys, const sstring& key, uint64_t hash) const
+    {
+        for (auto n = _heads[hash & (_heads.size() - 1)]; n != none; n = _next[n]) {
+            if (keys[_keys[n]] == key) {
+                return true;
+            }
+        }
+        return false;
+    }
+    size_t buckets() const { return _heads.size(); }
+    size_t used_buckets() const { return std::count_if(_heads.begin(), _heads.end(), [] (uint32_t h) { return h != none; }); }
+    size_t longest_chain() const
+    {
+        size_t longest = 0;
+        for (auto h : _heads) {
+            size_t length = 0;
+            for (auto n = h; n != none; n = _next[n]) {
+                ++length;
+            }
+            longest = std::max(longest, length);
+        }
+        return longest;
+    }
+};
+
+static void run(const routing& r, const std::vector<sstring>& keys, unsigned shards, size_t lookups)
+{
+    std::vector<std::vector<uint32_t>> owned(shards);
+    for (uint32_t i = 0; i < keys.size(); ++i) {
+        owned[r.shard(r.hash(keys[i]), shards)].push_back(i);
+    }
+    std::vector<shard_table> tables;
+    size_t buckets = 0, used = 0, longest = 0, smallest = keys.size(), largest = 0;
+    for (auto& o : owned) {
+        tables.emplace_back(o.size());
+        for (auto i : o) {
+            tables.back().insert(i, r.hash(keys[i]));
+        }
+        buckets += tables.back().buckets();
+        used += tables.back().used_buckets();
+        longest = std::max(longest, tables.back().longest_chain());
+        smallest = std::min(smallest, o.size());
+        largest = std::max(largest, o.size());
+    }
+
+    std::mt19937 gen(keys.size());
+    std::vector<uint32_t> order(lookups);
+    for (auto& i : order) {
+        i = gen() % keys.size();
+    }
+    size_t found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (auto i : order) {
+        auto& key = keys[i];
+        auto hash = r.hash(key);
+        found += tables[r.shard(hash, shards)].find(keys, key, hash);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    auto ns = std::chrono::duration<double, std::nano>(elapsed).count() / lookups;
+    std::cout << sprint("%-10s keys: %8d  shards: %2d  keys/shard: %d..%d  bucket occupancy: %5.1f%%  longest chain: %3d  lookup: %6.1f ns  found: %d\n",
+        r.name, keys.size(), shards, smallest, largest, 100.0 * used / buckets, longest, ns, found);
+}
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    app_template app;
+    app.add_options()
+        ("shards", bpo::value<unsigned>()->default_value(8), "number of simulated shards")
+        ("lookups", bpo::value<size_t>()->default_value(1000000), "lookups per measurement");
+    return app.run(ac, av, [&app] {
+        auto shards = app.configuration()["shards"].as<unsigned>();
+        auto lookups = app.configuration()["lookups"].as<size_t>();
+        const routing routings[] = {
+            { "std::hash", std_hash, std_shard },
+            { "hash_key", murmur_hash, shard_of },
+        };
+        for (size_t count : { 100000, 1000000 }) {
+            std::vector<sstring> keys;
+            for (size_t i = 0; i < count; ++i) {
+                keys.push_back(sprint("key:%d", i));
+            }
+            for (auto& r : routings) {
+                run(r, keys, shards, lookups);
+            }
+        }
+        return make_ready_future<>();
+    });
+}
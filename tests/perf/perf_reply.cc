@@ -0,0 +1,134 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "core/app-template.hh"
+#include "core/reactor.hh"
+#include "core/memory.hh"
+#include "reply_builder.hh"
+#include <chrono>
+#include <iostream>
+
+using namespace redis;
+
+// Counts the allocations and the time taken to build the common replies, with the
+// fragment per header and value of the former reply_builder and with reply_builder,
+// as the database builds them. The built replies are released in the measured
+// loop, as once they are sent.
+
+using reply_ptr = lw_shared_ptr<scattered_message<char>>;
+
+// The former way: a fragment per tag, length and value, the value copied into an sstring.
+static reply_ptr old_integer(size_t v)
+{
+    auto m = make_lw_shared<scattered_message<char>>();
+    m->append_static(msg_num_tag);
+    m->append(to_sstring(v));
+    m->append_static(msg_crlf);
+    return m;
+}
+
+static void old_bulk(scattered_message<char>& m, const char* data, size_t size)
+{
+    m.append_static(msg_batch_tag);
+    m.append(to_sstring(size));
+    m.append_static(msg_crlf);
+    m.append(sstring{data, size});
+    m.append_static(msg_crlf);
+}
+
+static reply_ptr old_get(const cache_entry& e)
+{
+    auto m = make_lw_shared<scattered_message<char>>();
+    old_bulk(*m, e.value_bytes_data(), e.value_bytes_size());
+    return m;
+}
+
+static reply_ptr old_array(const std::vector<const managed_bytes*>& data)
+{
+    auto m = make_lw_shared<scattered_message<char>>();
+    m->append(msg_sigle_tag);
+    m->append(to_sstring(data.size()));
+    m->append_static(msg_crlf);
+    for (auto d : data) {
+        old_bulk(*m, reinterpret_cast<const char*>(d->data()), d->size());
+    }
+    return m;
+}
+
+static size_t size_of(const reply_ptr& m)
+{
+    return m->size();
+}
+
+// the replies of reply_builder are ready, as the ones of the database.
+static size_t size_of(future<scattered_message_ptr> f)
+{
+    return f.get0()->size();
+}
+
+template <typename Func>
+static void run(const char* name, size_t iterations, Func&& build)
+{
+    size_t bytes = 0;
+    auto mallocs = memory::stats().mallocs();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        bytes += size_of(build(i));
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    auto allocations = memory::stats().mallocs() - mallocs;
+    auto ns = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+    std::cout << sprint("%-28s allocations/reply: %5.2f  time/reply: %9.1f ns  bytes/reply: %d\n",
+        name, double(allocations) / iterations, ns, bytes / iterations);
+}
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    app_template app;
+    app.add_options()
+        ("iterations", bpo::value<size_t>()->default_value(100000), "replies per measurement");
+    return app.run(ac, av, [&app] {
+        auto iterations = app.configuration()["iterations"].as<size_t>();
+        sstring key("key:000000000001");
+        auto hash = hash_key(key.data(), key.size());
+        cache_entry small(key, hash, sstring(16, 'v'));
+        cache_entry large(key, hash, sstring(64 * 1024, 'v'));
+        std::vector<managed_bytes> values;
+        for (size_t i = 0; i < 16; ++i) {
+            values.emplace_back(bytes_view(reinterpret_cast<const int8_t*>(key.data()), key.size()));
+        }
+        std::vector<const managed_bytes*> array;
+        for (auto& v : values) {
+            array.push_back(&v);
+        }
+
+        run("integer (old)", iterations, [] (size_t i) { return old_integer(i % 1000); });
+        run("integer", iterations, [] (size_t i) { return reply_builder::build(i % 1000); });
+        run("integer > 10000 (old)", iterations, [] (size_t i) { return old_integer(100000 + i); });
+        run("integer > 10000", iterations, [] (size_t i) { return reply_builder::build(100000 + i); });
+        run("get 16 bytes (old)", iterations, [&small] (size_t) { return old_get(small); });
+        run("get 16 bytes", iterations, [&small] (size_t) { return reply_builder::build<false, true>(&small); });
+        run("get 64 KB (old)", iterations / 10, [&large] (size_t) { return old_get(large); });
+        run("get 64 KB", iterations / 10, [&large] (size_t) { return reply_builder::build<false, true>(&large); });
+        run("16 x 16 bytes array (old)", iterations, [&array] (size_t) { return old_array(array); });
+        run("16 x 16 bytes array", iterations, [&array] (size_t) { return reply_builder::build(array); });
+        return make_ready_future<>();
+    });
+}
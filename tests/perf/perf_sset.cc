@@ -0,0 +1,170 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "core/app-template.hh"
+#include "core/reactor.hh"
+#include "sset_lsa.hh"
+#include <boost/intrusive/list.hpp>
+#include <chrono>
+#include <random>
+#include <iostream>
+
+using namespace redis;
+
+// Compares the rank tree of sset_lsa with the sorted list it replaced, for
+// score updates (ZADD/ZINCRBY), ZRANK and ZRANGE with an offset.
+
+// The old sorted list: linear ordered insertion and linear rank.
+class sorted_list {
+    struct node {
+        boost::intrusive::list_member_hook<> _link;
+        size_t _key;
+        double _score;
+        node(size_t key, double score) : _key(key), _score(score) {}
+    };
+    using list_type = boost::intrusive::list<node,
+        boost::intrusive::member_hook<node, boost::intrusive::list_member_hook<>, &node::_link>>;
+    std::vector<std::unique_ptr<node>> _nodes;
+    list_type _list;
+
+    void insert_ordered(node& n)
+    {
+        auto it = _list.begin();
+        for (; it != _list.end() && it->_score <= n._score; ++it) {}
+        _list.insert(it, n);
+    }
+public:
+    explicit sorted_list(const std::vector<double>& scores)
+    {
+        for (size_t i = 0; i < scores.size(); ++i) {
+            _nodes.emplace_back(std::make_unique<node>(i, scores[i]));
+        }
+        std::vector<node*> sorted;
+        for (auto& n : _nodes) {
+            sorted.push_back(n.get());
+        }
+        std::sort(sorted.begin(), sorted.end(), [] (auto l, auto r) { return l->_score < r->_score; });
+        for (auto n : sorted) {
+            _list.push_back(*n);
+        }
+    }
+    ~sorted_list()
+    {
+        _list.clear();
+    }
+    void update(size_t key, double score)
+    {
+        auto& n = *_nodes[key];
+        _list.erase(list_type::s_iterator_to(n));
+        n._score = score;
+        insert_ordered(n);
+    }
+    size_t rank(size_t key) const
+    {
+        size_t r = 0;
+        auto target = list_type::s_iterator_to(*_nodes[key]);
+        for (auto it = _list.begin(); it != target; ++it, ++r) {}
+        return r;
+    }
+    size_t range(size_t begin, size_t count) const
+    {
+        size_t r = 0, fetched = 0;
+        for (auto it = _list.begin(); it != _list.end() && fetched < count; ++it, ++r) {
+            if (r >= begin) {
+                ++fetched;
+            }
+        }
+        return fetched;
+    }
+};
+
+template <typename Func>
+static double measure(size_t iterations, Func&& func)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        func(i);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+static void report(const char* name, size_t members, double tree_ns, double list_ns)
+{
+    std::cout << sprint("%-10s members: %8d  rank_tree: %10.1f ns/op  sorted_list: %12.1f ns/op  speedup: %8.1fx\n",
+        name, members, tree_ns, list_ns, list_ns / tree_ns);
+}
+
+static void run(logalloc::region& region, size_t members, size_t iterations)
+{
+    std::mt19937 gen(members);
+    std::uniform_real_distribution<double> dist(0, 1e9);
+    std::vector<double> scores;
+    std::vector<sstring> keys;
+    for (size_t i = 0; i < members; ++i) {
+        scores.push_back(dist(gen));
+        keys.push_back(sprint("member:%d", i));
+    }
+    // the sorted list is O(N) per operation, so it gets fewer iterations at scale.
+    const size_t list_iterations = std::max<size_t>(100, std::min<size_t>(iterations, 200000000 / members));
+    sorted_list list { scores };
+
+    with_allocator(region.allocator(), [&] {
+        sset_lsa sset;
+        for (size_t i = 0; i < members; ++i) {
+            sset.insert(current_allocator().construct<sset_entry>(keys[i], scores[i]));
+        }
+
+        auto tree_ns = measure(iterations, [&] (size_t i) { sset.update_score(keys[gen() % members], dist(gen)); });
+        auto list_ns = measure(list_iterations, [&] (size_t i) { list.update(gen() % members, dist(gen)); });
+        report("update", members, tree_ns, list_ns);
+
+        size_t sink = 0;
+        tree_ns = measure(iterations, [&] (size_t i) { sink += *sset.rank(keys[gen() % members]); });
+        list_ns = measure(list_iterations, [&] (size_t i) { sink += list.rank(gen() % members); });
+        report("zrank", members, tree_ns, list_ns);
+
+        tree_ns = measure(iterations, [&] (size_t i) {
+            std::vector<const sset_entry*> entries;
+            long begin = gen() % members;
+            sset.fetch_by_rank(begin, begin + 9, entries);
+            sink += entries.size();
+        });
+        list_ns = measure(list_iterations, [&] (size_t i) { sink += list.range(gen() % members, 10); });
+        report("zrange", members, tree_ns, list_ns);
+        std::cout << sprint("checksum: %d\n", sink);
+        sset.flush_all();
+    });
+}
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    app_template app;
+    app.add_options()
+        ("iterations", bpo::value<size_t>()->default_value(100000), "operations per measurement");
+    return app.run(ac, av, [&app] {
+        auto iterations = app.configuration()["iterations"].as<size_t>();
+        logalloc::region region;
+        for (size_t members : { 1000, 100000, 1000000 }) {
+            run(region, members, iterations);
+        }
+        return make_ready_future<>();
+    });
+}
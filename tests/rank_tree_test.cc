@@ -0,0 +1,239 @@
+#include "tests/test-utils.hh"
+#include "rank_tree.hh"
+#include "utils/logalloc.hh"
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <set>
+#include <unordered_map>
+
+using namespace redis;
+
+struct item {
+    rank_tree_hook _hook;
+    int64_t _key;
+    // the order of the insertion, which orders the items of equal keys.
+    uint64_t _seq;
+    item(int64_t key, uint64_t seq) noexcept : _key(key), _seq(seq) {}
+    item(item&& o) noexcept : _hook(std::move(o._hook)), _key(o._key), _seq(o._seq) {}
+};
+
+struct item_less {
+    inline bool operator () (const item& l, const item& r) const {
+        return l._key < r._key;
+    }
+};
+
+using tree_type = rank_tree<item, &item::_hook, item_less>;
+using model_type = std::multiset<std::pair<int64_t, uint64_t>>;
+
+static bool key_before(const item& i, int64_t k) {
+    return i._key < k;
+}
+
+static bool key_after(int64_t k, const item& i) {
+    return k < i._key;
+}
+
+// Checks the tree against the model: the order, the ranks of all items, select
+// and the bounds of every key around the ones in the model.
+static void check(tree_type& t, const model_type& model)
+{
+    BOOST_REQUIRE(t.size() == model.size());
+    BOOST_REQUIRE(t.empty() == model.empty());
+    size_t index = 0;
+    auto m = model.begin();
+    for (auto it = t.begin(); it != t.end(); ++it, ++m, ++index) {
+        BOOST_REQUIRE(it->_key == m->first && it->_seq == m->second);
+        BOOST_REQUIRE(t.rank(*it) == index);
+        BOOST_REQUIRE(&*t.select(index) == &*it);
+        BOOST_REQUIRE(t.iterator_to(*it) == it);
+    }
+    BOOST_REQUIRE(t.select(model.size()) == t.end());
+    BOOST_REQUIRE(t.select(model.size() + 100) == t.end());
+    BOOST_REQUIRE(t.rank(t.end()) == model.size());
+    if (model.empty()) {
+        BOOST_REQUIRE(t.begin() == t.end());
+        return;
+    }
+    BOOST_REQUIRE(t.front()._seq == model.begin()->second);
+    BOOST_REQUIRE(t.back()._seq == model.rbegin()->second);
+    // backwards from end().
+    auto r = model.rbegin();
+    auto it = t.end();
+    do {
+        --it;
+        BOOST_REQUIRE(it->_seq == r->second);
+        ++r;
+    } while (it != t.begin());
+
+    std::set<int64_t> keys;
+    for (auto& e : model) {
+        keys.insert(e.first);
+        if (e.first > std::numeric_limits<int64_t>::min()) {
+            keys.insert(e.first - 1);
+        }
+        if (e.first < std::numeric_limits<int64_t>::max()) {
+            keys.insert(e.first + 1);
+        }
+    }
+    for (auto k : keys) {
+        auto lower = std::distance(model.begin(), model.lower_bound(std::make_pair(k, uint64_t(0))));
+        auto upper = std::distance(model.begin(), model.upper_bound(std::make_pair(k, std::numeric_limits<uint64_t>::max())));
+        BOOST_REQUIRE(t.rank(t.lower_bound(k, key_before)) == size_t(lower));
+        BOOST_REQUIRE(t.rank(t.upper_bound(k, key_after)) == size_t(upper));
+    }
+}
+
+class tree_holder : private logalloc::region {
+public:
+    ~tree_holder()
+    {
+        with_allocator(allocator(), [this] {
+            clear();
+        });
+    }
+
+    // Random inserts and erases, with few keys so that most of them are tied.
+    future<> random() {
+        with_allocator(allocator(), [this] {
+            std::mt19937_64 rng(1);
+            for (int64_t keys : { 1, 10, 1000000 }) {
+                std::uniform_int_distribution<int64_t> key(-keys / 2, keys / 2);
+                for (size_t round = 0; round < 20; ++round) {
+                    for (size_t i = 0; i < 100; ++i) {
+                        insert(key(rng));
+                    }
+                    for (size_t i = 0; i < 60 && !_items.empty(); ++i) {
+                        erase(rng() % _items.size());
+                    }
+                    check(_t, _model);
+                }
+                clear();
+                check(_t, _model);
+            }
+        });
+        return make_ready_future<>();
+    }
+
+    // The first and the last items, and the runs of equal keys which are ordered as
+    // they were inserted.
+    future<> bounds() {
+        with_allocator(allocator(), [this] {
+            check(_t, _model);
+            BOOST_REQUIRE(_t.lower_bound(0, key_before) == _t.end());
+            BOOST_REQUIRE(_t.upper_bound(0, key_after) == _t.end());
+            insert(5);
+            check(_t, _model);
+            for (size_t i = 0; i < 50; ++i) {
+                insert(5);
+                insert(i % 2 ? 3 : 7);
+            }
+            insert(std::numeric_limits<int64_t>::min());
+            insert(std::numeric_limits<int64_t>::max());
+            check(_t, _model);
+            BOOST_REQUIRE(_t.rank(*_t.lower_bound(5, key_before)) == 26);
+            BOOST_REQUIRE(_t.rank(_t.upper_bound(5, key_after)) == 77);
+            BOOST_REQUIRE(_t.front()._key == std::numeric_limits<int64_t>::min());
+            BOOST_REQUIRE(_t.back()._key == std::numeric_limits<int64_t>::max());
+            // the first and the last of a run, and the ends of the tree.
+            erase(index_of(*_t.lower_bound(5, key_before)));
+            erase(index_of(*std::prev(_t.upper_bound(5, key_after))));
+            erase(index_of(_t.front()));
+            erase(index_of(_t.back()));
+            check(_t, _model);
+        });
+        return make_ready_future<>();
+    }
+
+    // An item moved to another address, by the LSA or as its migrator does, is
+    // relinked to its parent and children there.
+    future<> relocation() {
+        with_allocator(allocator(), [this] {
+            std::mt19937_64 rng(2);
+            std::uniform_int_distribution<int64_t> key(0, 100);
+            for (size_t i = 0; i < 20000; ++i) {
+                insert(key(rng));
+            }
+            for (size_t i = 0; i < 13000; ++i) {
+                erase(rng() % _items.size());
+            }
+            for (size_t round = 0; round < 5; ++round) {
+                for (size_t i = 0; i < 500; ++i) {
+                    auto& slot = _items[rng() % _items.size()];
+                    auto moved = current_allocator().construct<item>(std::move(*slot));
+                    current_allocator().destroy(slot);
+                    slot = moved;
+                }
+                check(_t, _model);
+            }
+            std::unordered_map<uint64_t, const item*> before;
+            for (auto i : _items) {
+                before.emplace(i->_seq, i);
+            }
+            full_compaction();
+            size_t moved = 0;
+            _items.clear();
+            for (auto& i : _t) {
+                moved += before[i._seq] != &i;
+                _items.push_back(&i);
+            }
+            BOOST_REQUIRE(moved > 0);
+            check(_t, _model);
+            for (size_t i = 0; i < 1000; ++i) {
+                insert(key(rng));
+                erase(rng() % _items.size());
+            }
+            check(_t, _model);
+        });
+        return make_ready_future<>();
+    }
+private:
+    void insert(int64_t key) {
+        auto i = current_allocator().construct<item>(key, _seq++);
+        _t.insert(*i);
+        _model.emplace(key, i->_seq);
+        _items.push_back(i);
+    }
+
+    void erase(size_t index) {
+        auto i = _items[index];
+        _t.erase(*i);
+        _model.erase(_model.find(std::make_pair(i->_key, i->_seq)));
+        current_allocator().destroy(i);
+        _items[index] = _items.back();
+        _items.pop_back();
+    }
+
+    size_t index_of(const item& i) const {
+        return std::find(_items.begin(), _items.end(), &i) - _items.begin();
+    }
+
+    void clear() {
+        _t.clear_and_dispose([] (item* i) {
+            current_allocator().destroy(i);
+        });
+        _model.clear();
+        _items.clear();
+    }
+
+    tree_type _t;
+    model_type _model;
+    std::vector<item*> _items;
+    uint64_t _seq = 0;
+};
+
+SEASTAR_TEST_CASE(rank_tree_random) {
+    tree_holder h;
+    return h.random();
+}
+
+SEASTAR_TEST_CASE(rank_tree_bounds) {
+    tree_holder h;
+    return h.bounds();
+}
+
+SEASTAR_TEST_CASE(rank_tree_relocation) {
+    tree_holder h;
+    return h.relocation();
+}
@@ -0,0 +1,201 @@
+#include "tests/test-utils.hh"
+#include "reply_writer.hh"
+#include "core/print.hh"
+#include <limits>
+#include <random>
+#include <set>
+#include <string>
+
+using namespace redis;
+
+// The bytes of a reply, and the offsets its fragments end at.
+struct flat_reply {
+    sstring data;
+    std::vector<size_t> ends;
+};
+
+static flat_reply flatten(lw_shared_ptr<scattered_message<char>> m)
+{
+    flat_reply r;
+    auto p = std::move(*m).release();
+    for (auto& f : p.fragments()) {
+        r.data += sstring(f.base, f.size);
+        r.ends.push_back(r.data.size());
+    }
+    return r;
+}
+
+// The decimal digits of v, as the standard library formats them.
+template <typename T>
+static sstring decimal(T v)
+{
+    auto s = std::to_string(v);
+    return sstring(s.data(), s.size());
+}
+
+static sstring format(uint64_t v)
+{
+    char buf[24];
+    auto end = format_uint(buf, v);
+    BOOST_REQUIRE(size_t(end - buf) == uint_digits(v));
+    return sstring(buf, end - buf);
+}
+
+static sstring format(int64_t v)
+{
+    char buf[24];
+    return sstring(buf, format_int(buf, v) - buf);
+}
+
+// The numbers around every power of ten, the limits and random ones of every width.
+static std::vector<uint64_t> unsigned_samples()
+{
+    std::vector<uint64_t> v = { 0, std::numeric_limits<uint64_t>::max(), uint64_t(std::numeric_limits<int64_t>::max()) };
+    uint64_t p = 1;
+    for (size_t digits = 0; digits < 20; ++digits, p *= 10) {
+        v.insert(v.end(), { p - 1, p, p + 1, 2 * p - 1 });
+    }
+    std::mt19937_64 rng(1);
+    for (size_t bits = 1; bits <= 64; ++bits) {
+        for (size_t i = 0; i < 20; ++i) {
+            v.push_back(bits == 64 ? rng() : rng() & ((uint64_t(1) << bits) - 1));
+        }
+    }
+    return v;
+}
+
+SEASTAR_TEST_CASE(format_integers) {
+    for (auto v : unsigned_samples()) {
+        BOOST_REQUIRE(format(v) == decimal(v));
+        if (v <= uint64_t(std::numeric_limits<int64_t>::max())) {
+            auto i = int64_t(v);
+            BOOST_REQUIRE(format(i) == decimal(i));
+            BOOST_REQUIRE(format(-i) == decimal(-i));
+        }
+    }
+    BOOST_REQUIRE(format(int64_t(0)) == "0");
+    BOOST_REQUIRE(format(int64_t(-1)) == "-1");
+    BOOST_REQUIRE(format(std::numeric_limits<int64_t>::min()) == "-9223372036854775808");
+    BOOST_REQUIRE(format(std::numeric_limits<int64_t>::max()) == "9223372036854775807");
+    BOOST_REQUIRE(format(std::numeric_limits<uint64_t>::max()) == "18446744073709551615");
+    return make_ready_future<>();
+}
+
+// The replies of the preformatted integers, and of the ones around them which are
+// formatted when written.
+SEASTAR_TEST_CASE(integer_replies) {
+    auto& integers = preformatted_integers::get();
+    for (int64_t v = 0; v < 10000; ++v) {
+        const char* data;
+        size_t size;
+        BOOST_REQUIRE(integers.find(v, data, size));
+        BOOST_REQUIRE(sstring(data, size) == ":" + decimal(v) + "\r\n");
+    }
+    for (int64_t v : { int64_t(-1), int64_t(10000), int64_t(10001), std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max() }) {
+        const char* data;
+        size_t size;
+        BOOST_REQUIRE(!integers.find(v, data, size));
+    }
+    for (int64_t v : { int64_t(0), int64_t(-1), int64_t(9999), int64_t(10000), int64_t(-10000), std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max() }) {
+        reply_writer w;
+        w.write_integer(v);
+        BOOST_REQUIRE(flatten(w.finish()).data == ":" + decimal(v) + "\r\n");
+        reply_writer b;
+        b.write_bulk(v);
+        auto s = decimal(v);
+        BOOST_REQUIRE(flatten(b.finish()).data == sprint("$%d\r\n%s\r\n", s.size(), s));
+    }
+    return make_ready_future<>();
+}
+
+// Replies written across many chunks are the bytes of their elements in order, and
+// a chunk ends only between two elements: the first one has the size hint, the next
+// ones 4096 bytes, or the size of a larger bulk string.
+SEASTAR_TEST_CASE(chunk_boundaries) {
+    std::mt19937_64 rng(2);
+    for (size_t hint : { size_t(0), size_t(1), size_t(100), size_t(4096), size_t(10000) }) {
+        for (size_t round = 0; round < 20; ++round) {
+            reply_writer w(hint);
+            sstring expected;
+            std::set<size_t> element_ends = { 0 };
+            auto element = [&] (const sstring& bytes) {
+                expected += bytes;
+                element_ends.insert(expected.size());
+            };
+            size_t count = 1 + rng() % 300;
+            w.write_array_header(count);
+            element(sprint("*%d\r\n", count));
+            for (size_t i = 0; i < count; ++i) {
+                switch (rng() % 6) {
+                case 0: {
+                    // around a chunk, and once in a while larger than one.
+                    size_t size = rng() % 8 ? rng() % 100 : 4000 + rng() % 5000;
+                    sstring value(size, char('a' + i % 26));
+                    w.write_bulk(value);
+                    element(sprint("$%d\r\n%s\r\n", size, value));
+                    break;
+                }
+                case 1: {
+                    sstring value(rng() % 50, char('A' + i % 26));
+                    w.write_bulk(value.size(), [&value] (char* p) {
+                        std::copy_n(value.data(), value.size(), p);
+                    });
+                    element(sprint("$%d\r\n%s\r\n", value.size(), value));
+                    break;
+                }
+                case 2: {
+                    auto v = int64_t(rng());
+                    w.write_integer(v);
+                    element(":" + decimal(v) + "\r\n");
+                    break;
+                }
+                case 3: {
+                    auto v = int64_t(rng()) >> (rng() % 64);
+                    w.write_bulk(v);
+                    auto s = decimal(v);
+                    element(sprint("$%d\r\n%s\r\n", s.size(), s));
+                    break;
+                }
+                case 4: {
+                    size_t n = rng() % 20000;
+                    w.write_array_header(n);
+                    element(sprint("*%d\r\n", n));
+                    break;
+                }
+                default:
+                    w.write(sstring("+OK\r\n"));
+                    element("+OK\r\n");
+                    break;
+                }
+            }
+            auto reply = flatten(w.finish());
+            BOOST_REQUIRE(reply.data == expected);
+            size_t begin = 0;
+            for (size_t f = 0; f < reply.ends.size(); ++f) {
+                auto end = reply.ends[f];
+                BOOST_REQUIRE(element_ends.count(end));
+                BOOST_REQUIRE(end > begin);
+                // larger than its chunk only when it holds a single larger element.
+                auto limit = f == 0 && hint ? hint : size_t(4096);
+                if (end - begin > limit) {
+                    auto next = element_ends.upper_bound(begin);
+                    BOOST_REQUIRE(*next == end);
+                }
+                begin = end;
+            }
+        }
+    }
+    return make_ready_future<>();
+}
+
+// An empty bulk string, and a writer with nothing written.
+SEASTAR_TEST_CASE(empty_replies) {
+    reply_writer w;
+    w.write_array_header(0);
+    w.write_bulk(sstring());
+    w.write_bulk(0, [] (char*) {});
+    BOOST_REQUIRE(flatten(w.finish()).data == "*0\r\n$0\r\n\r\n$0\r\n\r\n");
+    reply_writer nothing;
+    BOOST_REQUIRE(flatten(nothing.finish()).data == "");
+    return make_ready_future<>();
+}
@@ -0,0 +1,220 @@
+#include "tests/test-utils.hh"
+#include "slowlog.hh"
+#include "core/print.hh"
+#include <algorithm>
+#include <random>
+
+using namespace redis;
+
+static std::vector<temporary_buffer<char>> buffers(const std::vector<sstring>& args)
+{
+    std::vector<temporary_buffer<char>> out;
+    for (auto& a : args) {
+        out.emplace_back(a.data(), a.size());
+    }
+    return out;
+}
+
+static std::vector<sstring> numbered(size_t n)
+{
+    std::vector<sstring> args;
+    for (size_t i = 0; i < n; ++i) {
+        args.push_back(sprint("arg-%d", i));
+    }
+    return args;
+}
+
+// The threshold, and the arguments kept as Redis keeps them: at most 32 with the
+// command, the last one telling how many more there were, and 128 bytes of each.
+SEASTAR_TEST_CASE(slowlog_add) {
+    using namespace std::chrono;
+    BOOST_REQUIRE(!slowlog(-1, 10).slow(seconds(10)));
+    BOOST_REQUIRE(slowlog(0, 10).slow(microseconds(0)));
+    BOOST_REQUIRE(!slowlog(1000, 10).slow(microseconds(999)));
+    BOOST_REQUIRE(slowlog(1000, 10).slow(microseconds(1000)));
+
+    slowlog log(0, 100);
+    log.add(microseconds(1500), "127.0.0.1:1234", "get", buffers({ "key" }));
+    auto& e = log.entries().front();
+    BOOST_REQUIRE(e._duration_us == 1500);
+    BOOST_REQUIRE(e._client == "127.0.0.1:1234");
+    BOOST_REQUIRE(e._shard == engine().cpu_id());
+    BOOST_REQUIRE(e._args == std::vector<sstring>({ "get", "key" }));
+
+    // all of them up to 32, with the command.
+    for (size_t n : { size_t(0), size_t(30), size_t(31) }) {
+        log.add(microseconds(1), "c", "rpush", buffers(numbered(n)));
+        auto expected = numbered(n);
+        expected.insert(expected.begin(), "rpush");
+        BOOST_REQUIRE(log.entries().front()._args == expected);
+    }
+    for (size_t n : { size_t(32), size_t(33), size_t(100) }) {
+        log.add(microseconds(1), "c", "rpush", buffers(numbered(n)));
+        auto expected = numbered(30);
+        expected.insert(expected.begin(), "rpush");
+        expected.push_back(sprint("... (%d more arguments)", n - 30));
+        BOOST_REQUIRE(log.entries().front()._args == expected);
+    }
+
+    sstring exact(slowlog::max_arg_size, 'x');
+    sstring longer(slowlog::max_arg_size + 1, 'y');
+    sstring large(10000, 'z');
+    log.add(microseconds(1), "c", "mset", buffers({ exact, longer, "", large }));
+    BOOST_REQUIRE(log.entries().front()._args == std::vector<sstring>({ "mset", exact,
+        sstring(slowlog::max_arg_size, 'y') + "... (1 more bytes)", "",
+        sstring(slowlog::max_arg_size, 'z') + sprint("... (%d more bytes)", 10000 - slowlog::max_arg_size) }));
+    return make_ready_future<>();
+}
+
+// The newest max_len entries are kept, newest first, their ids increasing on the
+// shard and telling it apart from the others.
+SEASTAR_TEST_CASE(slowlog_max_len) {
+    slowlog none(0, 0);
+    none.add(std::chrono::seconds(1), "c", "get", buffers({ "key" }));
+    BOOST_REQUIRE(none.size() == 0);
+
+    slowlog log(0, 5);
+    for (size_t i = 0; i < 12; ++i) {
+        log.add(std::chrono::microseconds(i), "c", "get", buffers({ sprint("key-%d", i) }));
+        BOOST_REQUIRE(log.size() == std::min(i + 1, size_t(5)));
+    }
+    size_t i = 11;
+    for (auto& e : log.entries()) {
+        BOOST_REQUIRE(e._args[1] == sprint("key-%d", i));
+        BOOST_REQUIRE(e._id == i * smp::count + engine().cpu_id());
+        --i;
+    }
+    log.reset();
+    BOOST_REQUIRE(log.size() == 0);
+    log.add(std::chrono::microseconds(1), "c", "get", buffers({ "key" }));
+    BOOST_REQUIRE(log.entries().front()._id == 12 * smp::count + engine().cpu_id());
+    return make_ready_future<>();
+}
+
+// The logs of the shards, newest first, merge into the count newest entries: by
+// timestamp, the entries of the same second by id, each shard keeping its own order.
+SEASTAR_TEST_CASE(slowlog_merge) {
+    std::mt19937_64 rng(1);
+    const unsigned shards = 4;
+    for (size_t round = 0; round < 50; ++round) {
+        std::vector<std::vector<slowlog_entry>> logs(shards);
+        std::vector<uint64_t> next_id(shards, 0);
+        uint64_t timestamp = 1000;
+        size_t total = rng() % 100;
+        for (size_t i = 0; i < total; ++i) {
+            timestamp += rng() % 3 == 0;
+            auto shard = unsigned(rng() % shards);
+            slowlog_entry e;
+            e._id = next_id[shard]++ * shards + shard;
+            e._timestamp = timestamp;
+            e._duration_us = i;
+            e._shard = shard;
+            logs[shard].insert(logs[shard].begin(), std::move(e));
+        }
+        for (size_t count : { size_t(0), size_t(1), size_t(10), total, total + 10 }) {
+            auto copy = logs;
+            auto merged = slowlog::merge(std::move(copy), count);
+            BOOST_REQUIRE(merged.size() == std::min(count, total));
+            for (size_t i = 1; i < merged.size(); ++i) {
+                auto& a = merged[i - 1];
+                auto& b = merged[i];
+                BOOST_REQUIRE(a._timestamp > b._timestamp || (a._timestamp == b._timestamp && a._id > b._id));
+            }
+            // the newest of every shard, in its order, none newer left out.
+            for (unsigned s = 0; s < shards; ++s) {
+                size_t kept = 0;
+                for (auto& e : merged) {
+                    if (e._shard == s) {
+                        BOOST_REQUIRE(e._id == logs[s][kept]._id);
+                        ++kept;
+                    }
+                }
+                if (kept < logs[s].size() && !merged.empty()) {
+                    auto& left = logs[s][kept];
+                    auto& last = merged.back();
+                    BOOST_REQUIRE(left._timestamp < last._timestamp || (left._timestamp == last._timestamp && left._id < last._id));
+                }
+            }
+        }
+    }
+    return make_ready_future<>();
+}
+
+// the time and the latency of every sample.
+using samples_type = std::vector<std::pair<uint64_t, uint64_t>>;
+
+static latency_monitor::event_history history(samples_type samples)
+{
+    latency_monitor::event_history h;
+    for (auto& s : samples) {
+        h._samples.push_back(latency_monitor::sample { s.first, s.second });
+        h._max_ms = std::max(h._max_ms, s.second);
+    }
+    return h;
+}
+
+static samples_type samples_of(const latency_monitor::event_history& h)
+{
+    samples_type samples;
+    for (auto& s : h._samples) {
+        samples.emplace_back(s._time, s._latency_ms);
+    }
+    return samples;
+}
+
+// The events of the shards merge by second, a second keeping its largest spike,
+// and the newest history_len seconds are kept.
+SEASTAR_TEST_CASE(latency_merge) {
+    latency_monitor::events_type a, b, c;
+    a["command"] = history({ { 10, 5 }, { 12, 7 }, { 15, 3 } });
+    b["command"] = history({ { 11, 4 }, { 12, 9 }, { 16, 2 } });
+    c["command"] = history({ { 12, 1 } });
+    b["rehash"] = history({ { 20, 30 } });
+    auto merged = latency_monitor::merge({ a, b, c });
+    BOOST_REQUIRE(merged.size() == 2);
+    BOOST_REQUIRE(samples_of(merged["command"]) == samples_type({ { 10, 5 }, { 11, 4 }, { 12, 9 }, { 15, 3 }, { 16, 2 } }));
+    BOOST_REQUIRE(merged["command"]._max_ms == 9);
+    BOOST_REQUIRE(samples_of(merged["rehash"]) == samples_type({ { 20, 30 } }));
+    BOOST_REQUIRE(merged["rehash"]._max_ms == 30);
+
+    // two full histories which overlap in part.
+    samples_type old_samples, new_samples, expected;
+    for (uint64_t t = 0; t < latency_monitor::history_len; ++t) {
+        old_samples.emplace_back(t, 100 + t);
+        new_samples.emplace_back(t + 100, t);
+    }
+    for (uint64_t t = 260 - latency_monitor::history_len; t < 260; ++t) {
+        expected.emplace_back(t, t < latency_monitor::history_len ? std::max(100 + t, t - 100) : t - 100);
+    }
+    latency_monitor::events_type o, n;
+    o["event-loop"] = history(old_samples);
+    n["event-loop"] = history(new_samples);
+    merged = latency_monitor::merge({ o, n });
+    BOOST_REQUIRE(samples_of(merged["event-loop"]) == expected);
+    BOOST_REQUIRE(merged["event-loop"]._max_ms == 100 + latency_monitor::history_len - 1);
+    BOOST_REQUIRE(latency_monitor::merge({}).empty());
+    return make_ready_future<>();
+}
+
+// A disabled monitor records nothing, an enabled one what takes the threshold.
+SEASTAR_TEST_CASE(latency_record) {
+    using namespace std::chrono;
+    latency_monitor disabled(0);
+    disabled.record("command", seconds(1));
+    BOOST_REQUIRE(disabled.events().empty());
+
+    latency_monitor m(10);
+    m.record("command", milliseconds(9));
+    BOOST_REQUIRE(m.events().empty());
+    m.record("command", milliseconds(20));
+    m.record("command", milliseconds(15));
+    m.record("rehash", milliseconds(10));
+    auto& command = m.events().at("command");
+    BOOST_REQUIRE(command._max_ms == 20);
+    BOOST_REQUIRE(command._samples.front()._latency_ms == 20);
+    BOOST_REQUIRE(m.events().at("rehash")._max_ms == 10);
+    BOOST_REQUIRE(m.reset({ "rehash", "missing" }) == std::vector<sstring>({ "rehash" }));
+    BOOST_REQUIRE(m.reset({}) == std::vector<sstring>({ "command" }));
+    BOOST_REQUIRE(m.events().empty());
+    return make_ready_future<>();
+}
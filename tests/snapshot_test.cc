@@ -0,0 +1,313 @@
+#include "tests/test-utils.hh"
+#include "core/byteorder.hh"
+#include "core/reactor.hh"
+#include "core/sleep.hh"
+#include "core/thread.hh"
+#include "config.hh"
+#include "db.hh"
+#include "redis.hh"
+#include "snapshot.hh"
+#include "storage_proxy.hh"
+#include "utils/crc.hh"
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+using namespace redis;
+namespace fs = boost::filesystem;
+
+// the framing of the files, as snapshot.cc writes them.
+static const size_t header_size = 12;
+static const size_t block_header_size = 8;
+
+static sstring bulk(const sstring& s) {
+    return sprint("$%d\r\n%s\r\n", s.size(), s);
+}
+
+static sstring multi_bulk(std::vector<sstring> args) {
+    auto out = sprint("*%d\r\n", args.size());
+    for (auto& a : args) {
+        out += bulk(a);
+    }
+    return out;
+}
+
+static sstring serve(std::vector<sstring> args)
+{
+    return storage_proxy::serve(multi_bulk(std::move(args))).get0();
+}
+
+static sstring make_directory()
+{
+    auto path = fs::temp_directory_path() / fs::unique_path("snapshot_test-%%%%-%%%%-%%%%");
+    fs::create_directories(path);
+    return sstring(path.string().c_str());
+}
+
+static std::string read_file(const sstring& path)
+{
+    std::ifstream in(path.c_str(), std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+static void write_file(const sstring& path, const std::string& data)
+{
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size());
+}
+
+static uint32_t read_le32(const char* p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return le_to_cpu(v);
+}
+
+static void write_le32(char* p, uint32_t v)
+{
+    v = cpu_to_le(v);
+    std::memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t checksum(const char* data, size_t size)
+{
+    utils::crc32 c;
+    c.process(reinterpret_cast<const uint8_t*>(data), size);
+    return c.get();
+}
+
+// A fresh server whose snapshots go to the directory, as main starts it.
+class server {
+    redis::config _cfg;
+public:
+    explicit server(const sstring& directory) {
+        _cfg.data_file_directories(redis::config::string_list { directory });
+        _cfg.enable_commitlog(false);
+        get_database().start(std::ref(_cfg)).get();
+        get_redis_service().start().get();
+        get_snapshot_manager().start(std::ref(_cfg)).get();
+    }
+    ~server() {
+        get_snapshot_manager().stop().get();
+        get_redis_service().stop().get();
+        get_database().stop().get();
+    }
+};
+
+static sstring shard_file(const sstring& directory, uint64_t id, unsigned shard)
+{
+    return sprint("%s/snapshot-%d-%d.db", directory, id, shard);
+}
+
+// The reads which show every entry type, its fields in an order which does not
+// depend on the layout of the entry.
+static std::vector<std::vector<sstring>> probes()
+{
+    std::vector<std::vector<sstring>> p = {
+        { "get", "s" }, { "get", "n" }, { "get", "big" },
+        { "lrange", "l", "0", "-1" }, { "llen", "l" },
+        { "hlen", "h" }, { "hget", "h", "s" }, { "hget", "h", "i" }, { "hget", "h", "f" }, { "hlen", "hb" },
+        { "scard", "set" }, { "scard", "setb" },
+        { "zrange", "z", "0", "-1", "withscores" },
+        { "pfcount", "p" }, { "pfcount", "pd" },
+        { "get", "b" }, { "bitcount", "b" },
+    };
+    for (auto key : { "s", "n", "l", "h", "hb", "set", "setb", "z", "p", "pd", "b" }) {
+        p.push_back({ "type", key });
+    }
+    for (size_t i = 0; i < 300; i += 7) {
+        p.push_back({ "hget", "hb", sprint("field-%d", i) });
+        p.push_back({ "sismember", "setb", sprint("member-%d", i) });
+        p.push_back({ "sismember", "set", sprint("member-%d", i) });
+    }
+    return p;
+}
+
+static void populate()
+{
+    serve({ "set", "s", "value" });
+    serve({ "incrby", "n", "-42" });
+    serve({ "set", "big", sstring(100000, 'x') });
+    for (size_t i = 0; i < 100; ++i) {
+        serve({ "rpush", "l", sprint("element-%d", i) });
+    }
+    serve({ "hset", "h", "s", "value" });
+    serve({ "hincrby", "h", "i", "7" });
+    serve({ "hincrbyfloat", "h", "f", "2.5" });
+    for (size_t i = 0; i < 300; ++i) {
+        // packed and hash table encodings.
+        serve({ "hset", "hb", sprint("field-%d", i), sprint("value-%d", i) });
+        serve({ "sadd", "setb", sprint("member-%d", i) });
+    }
+    for (size_t i = 0; i < 5; ++i) {
+        serve({ "sadd", "set", sprint("member-%d", i * 7) });
+    }
+    serve({ "zadd", "z", "1.5", "a", "-3", "b", "1.5", "c", "1e10", "d" });
+    serve({ "pfadd", "p", "a", "b", "c" });
+    for (size_t i = 0; i < 20000; i += 100) {
+        std::vector<sstring> args = { "pfadd", "pd" };
+        for (size_t j = i; j < i + 100; ++j) {
+            args.push_back(sprint("element-%d", j));
+        }
+        serve(std::move(args));
+    }
+    for (auto offset : { "0", "7", "1000", "123457" }) {
+        serve({ "setbit", "b", offset, "1" });
+    }
+}
+
+// Every entry type is restored as it was saved, and the entries keep their deadline.
+SEASTAR_TEST_CASE(round_trip) {
+    return seastar::async([] {
+        auto directory = make_directory();
+        std::vector<sstring> expected;
+        int64_t before = 0;
+        {
+            server s(directory);
+            populate();
+            serve({ "set", "e", "v", "px", "3600000" });
+            before = unix_time_ms();
+            // expired before the snapshot, and before the load.
+            serve({ "set", "gone", "v", "px", "100" });
+            serve({ "set", "soon", "v", "px", "1000" });
+            sleep(std::chrono::milliseconds(200)).get();
+            for (auto& p : probes()) {
+                expected.push_back(serve(p));
+            }
+            BOOST_REQUIRE(get_snapshot_manager().local().save().get0());
+        }
+        sleep(std::chrono::milliseconds(1000)).get();
+        server s(directory);
+        auto position = get_snapshot_manager().local().load().get0();
+        BOOST_REQUIRE(position.first_segments.size() == smp::count);
+        std::vector<sstring> restored;
+        for (auto& p : probes()) {
+            restored.push_back(serve(p));
+        }
+        BOOST_REQUIRE(restored == expected);
+        auto pttl = std::atol(serve({ "pttl", "e" }).c_str() + 1);
+        BOOST_REQUIRE(pttl > 0 && pttl <= 3600000 - (unix_time_ms() - before) + 20);
+        BOOST_REQUIRE(serve({ "exists", "gone" }) == ":0\r\n");
+        BOOST_REQUIRE(serve({ "exists", "soon" }) == ":0\r\n");
+        fs::remove_all(directory.c_str());
+    });
+}
+
+// A snapshot whose blocks or manifest are damaged is rejected rather than loaded
+// in part silently.
+SEASTAR_TEST_CASE(corruption) {
+    return seastar::async([] {
+        auto directory = make_directory();
+        server s(directory);
+        populate();
+        BOOST_REQUIRE(get_snapshot_manager().local().save().get0());
+        auto manager = [] () -> snapshot_manager& { return get_snapshot_manager().local(); };
+        manager().load().get();
+
+        // the shard which holds the most, so its first block has records.
+        unsigned shard = 0;
+        for (unsigned c = 0; c < smp::count; ++c) {
+            if (read_file(shard_file(directory, 0, c)).size() > read_file(shard_file(directory, 0, shard)).size()) {
+                shard = c;
+            }
+        }
+        auto path = shard_file(directory, 0, shard);
+        auto original = read_file(path);
+        auto block_size = read_le32(&original[header_size]);
+        BOOST_REQUIRE(block_size > 0);
+        auto first_record = header_size + block_header_size;
+
+        auto data = original;
+        data[first_record + block_size / 2] ^= 1;
+        write_file(path, data);
+        BOOST_REQUIRE_THROW(manager().load().get(), std::runtime_error);
+
+        write_file(path, original.substr(0, first_record + block_size / 2));
+        BOOST_REQUIRE_THROW(manager().load().get(), std::runtime_error);
+
+        write_file(path, original.substr(0, original.size() - block_header_size));
+        BOOST_REQUIRE_THROW(manager().load().get(), std::runtime_error);
+
+        data = original;
+        data[0] = 'X';
+        write_file(path, data);
+        BOOST_REQUIRE_THROW(manager().load().get(), std::runtime_error);
+
+        // a record of an unknown type, in a block whose crc is right.
+        data = original;
+        data[first_record + sizeof(uint32_t)] = char(200);
+        write_le32(&data[header_size + sizeof(uint32_t)], checksum(&data[first_record], block_size));
+        write_file(path, data);
+        BOOST_REQUIRE_THROW(manager().load().get(), std::runtime_error);
+
+        write_file(path, original);
+        manager().load().get();
+
+        auto manifest = sprint("%s/snapshot-0.manifest", directory);
+        auto content = read_file(manifest);
+        write_file(manifest, "snapshot 1\n" + content.substr(content.find('\n') + 1));
+        BOOST_REQUIRE_THROW(manager().load().get(), std::runtime_error);
+        write_file(manifest, content.substr(0, content.size() / 2));
+        BOOST_REQUIRE_THROW(manager().load().get(), std::runtime_error);
+        write_file(manifest, content);
+        manager().load().get();
+        fs::remove_all(directory.c_str());
+    });
+}
+
+// The files of a snapshot taken with another number of shards are spread over the
+// current shards, and every entry goes to its owner.
+SEASTAR_TEST_CASE(shard_count) {
+    return seastar::async([] {
+        auto directory = make_directory();
+        // the entries of a snapshot of all shards, as the file of a single shard.
+        std::vector<std::string> old_shards;
+        {
+            server s(directory);
+            for (uint64_t id = 0; id < 3; ++id) {
+                for (size_t i = 0; i < 100; ++i) {
+                    serve({ "set", sprint("k%d-%d", id, i), sprint("v%d", i) });
+                    serve({ "rpush", sprint("l%d", id), sprint("v%d", i) });
+                }
+                BOOST_REQUIRE(get_snapshot_manager().local().save().get0());
+                std::string merged;
+                for (unsigned c = 0; c < smp::count; ++c) {
+                    auto data = read_file(shard_file(directory, id, c));
+                    if (merged.empty()) {
+                        merged = data.substr(0, header_size);
+                    }
+                    merged += data.substr(header_size, data.size() - header_size - block_header_size);
+                }
+                old_shards.push_back(merged + std::string(block_header_size, '\0'));
+                for (size_t i = 0; i < 100; ++i) {
+                    serve({ "del", sprint("k%d-%d", id, i) });
+                }
+                serve({ "del", sprint("l%d", id) });
+            }
+        }
+        // more shards than now, some of them empty.
+        auto shards = smp::count + 2;
+        auto manifest = sprint("snapshot 100\ngeneration 7\nshards %d\n", shards);
+        for (unsigned c = 0; c < shards; ++c) {
+            write_file(shard_file(directory, 100, c), c < old_shards.size() ? old_shards[c] : old_shards[0].substr(0, header_size) + std::string(block_header_size, '\0'));
+            manifest += sprint("%d\n", c + 10);
+        }
+        write_file(sprint("%s/snapshot-100.manifest", directory), manifest);
+
+        server s(directory);
+        auto position = get_snapshot_manager().local().load().get0();
+        BOOST_REQUIRE(position.generation == 7);
+        BOOST_REQUIRE(position.first_segments.size() == shards);
+        for (unsigned c = 0; c < shards; ++c) {
+            BOOST_REQUIRE(position.first_segments[c] == c + 10);
+        }
+        for (uint64_t id = 0; id < 3; ++id) {
+            for (size_t i = 0; i < 100; ++i) {
+                BOOST_REQUIRE(serve({ "get", sprint("k%d-%d", id, i) }) == bulk(sprint("v%d", i)));
+            }
+            BOOST_REQUIRE(serve({ "llen", sprint("l%d", id) }) == ":100\r\n");
+        }
+        fs::remove_all(directory.c_str());
+    });
+}
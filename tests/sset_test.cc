@@ -0,0 +1,120 @@
+#include "tests/test-utils.hh"
+#include "sset_lsa.hh"
+#include <set>
+
+using namespace redis;
+
+class sset_holder : private logalloc::region {
+public:
+    ~sset_holder()
+    {
+        with_allocator(allocator(), [this] {
+           _s.flush_all();
+        });
+    }
+    // Every member is returned once, count of them a call and the rest of the run
+    // of equal scores the last one is in.
+    future<> scan() {
+        with_allocator(allocator(), [this] {
+            check_scan(10, 5000, [] (size_t) { return 1.0; });
+            check_scan(7, 3000, [] (size_t i) { return double(i % 3); });
+            check_scan(1, 500, [] (size_t i) { return i % 2 ? 0.0 : -0.0; });
+            check_scan(100, 5000, [] (size_t i) { return double(i) / 3; });
+            check_scan(3, 100, [] (size_t i) {
+                return i % 2 ? std::numeric_limits<double>::infinity() : -std::numeric_limits<double>::infinity();
+            });
+            check_scan(5, 1000, [] (size_t i) { return double(i / 10); });
+        });
+        return make_ready_future<>();
+    }
+
+    // The members removed between the calls, tied with the ones returned or not,
+    // make the scan skip none of the others.
+    future<> scan_removals() {
+        with_allocator(allocator(), [this] {
+            for (size_t ties : { size_t(1), size_t(4), size_t(50) }) {
+                fill(2000, [ties] (size_t i) { return double(i / ties); });
+                std::set<sstring> seen, removed;
+                uint64_t cursor = 0;
+                size_t call = 0;
+                do {
+                    std::vector<const sset_entry*> entries;
+                    cursor = _s.fetch_scan(cursor, 3, entries);
+                    for (auto e : entries) {
+                        BOOST_REQUIRE(seen.emplace(e->key_data(), e->key_size()).second);
+                    }
+                    // two of the members just returned, before the cursor, and now and then one
+                    // which was not returned yet.
+                    std::vector<sstring> keys;
+                    for (auto e : entries) {
+                        if (keys.size() < 2) {
+                            keys.emplace_back(e->key_data(), e->key_size());
+                        }
+                    }
+                    if (++call % 3 == 0) {
+                        auto next = to_sstring(seen.size() * 7 % 2000);
+                        if (!seen.count(next)) {
+                            keys.push_back(next);
+                        }
+                    }
+                    for (auto& k : keys) {
+                        if (_s.score(k)) {
+                            removed.insert(k);
+                            _s.erase(k);
+                        }
+                    }
+                } while (cursor != 0);
+                for (size_t i = 0; i < 2000; ++i) {
+                    auto k = to_sstring(i);
+                    BOOST_REQUIRE(seen.count(k) || removed.count(k));
+                }
+            }
+        });
+        return make_ready_future<>();
+    }
+private:
+    template <typename Score>
+    void fill(size_t members, Score&& score) {
+        _s.flush_all();
+        for (size_t i = 0; i < members; ++i) {
+            auto entry = current_allocator().construct<sset_entry>(to_sstring(i), score(i));
+            BOOST_REQUIRE(_s.insert(entry));
+        }
+    }
+
+    template <typename Score>
+    void check_scan(size_t count, size_t members, Score&& score) {
+        fill(members, score);
+        std::set<sstring> seen;
+        uint64_t cursor = 0;
+        do {
+            std::vector<const sset_entry*> entries;
+            cursor = _s.fetch_scan(cursor, count, entries);
+            BOOST_REQUIRE(entries.size() >= std::min(count, members - seen.size()));
+            for (size_t i = 0; i < entries.size(); ++i) {
+                BOOST_REQUIRE(seen.emplace(entries[i]->key_data(), entries[i]->key_size()).second);
+                // past count, only the run of the last score.
+                if (i >= count) {
+                    BOOST_REQUIRE(entries[i]->score() == entries[count - 1]->score());
+                }
+            }
+            if (cursor != 0) {
+                std::vector<const sset_entry*> next;
+                _s.fetch_scan(cursor, 1, next);
+                BOOST_REQUIRE(next.size() >= 1 && next[0]->score() != entries.back()->score());
+            }
+        } while (cursor != 0);
+        BOOST_REQUIRE(seen.size() == members);
+    }
+    sset_lsa _s;
+};
+
+SEASTAR_TEST_CASE(sset_scan) {
+    sset_holder h;
+    return h.scan();
+}
+
+SEASTAR_TEST_CASE(sset_scan_removals) {
+    sset_holder h;
+    return h.scan_removals();
+}
@@ -79,7 +79,7 @@ const gms::inet_address token_ring_manager::get_replica_node_for_read(const redi
     if (targets != _token_read_targets_endpoints_cache.end()) {
         return targets->second;
     }
-    auto target = _token_to_endpoint[first_token_index];
+    auto target = _token_to_endpoint[first_token];
     _token_read_targets_endpoints_cache[first_token] = target;
     return target;
 }
@@ -92,6 +92,34 @@ void token_ring_manager::set_sorted_tokens(const std::vector<token>& tokens, con
     _token_read_targets_endpoints_cache.clear();
 }
 
+std::vector<token> token_ring_manager::get_tokens(const gms::inet_address& endpoint) const
+{
+    auto name = sprint("%s", endpoint);
+    std::vector<token> tokens;
+    tokens.reserve(_vnode_count);
+    for (size_t i = 0; i < _vnode_count; ++i) {
+        tokens.emplace_back(hash_key(name.data(), name.size(), key_hash_seed + i));
+    }
+    return tokens;
+}
+
+void token_ring_manager::set_endpoints(const std::set<gms::inet_address>& endpoints)
+{
+    std::vector<token> tokens;
+    std::unordered_map<token, gms::inet_address> token_to_endpoint;
+    tokens.reserve(endpoints.size() * _vnode_count);
+    for (auto& endpoint : endpoints) {
+        for (auto t : get_tokens(endpoint)) {
+            tokens.emplace_back(t);
+            token_to_endpoint.emplace(t, endpoint);
+        }
+    }
+    std::sort(tokens.begin(), tokens.end());
+    tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+    _endpoints = endpoints;
+    set_sorted_tokens(tokens, token_to_endpoint);
+}
+
 std::chrono::milliseconds token_ring_manager::get_ring_delay() const{
     auto ring_delay = get_local_database().get_config().ring_delay_ms();
     return std::chrono::milliseconds(ring_delay);
@@ -25,6 +25,7 @@
 #include <experimental/optional>
 #include <unordered_map>
 #include <vector>
+#include <set>
 #include "gms/inet_address.hh"
 #include "common.hh"
 namespace redis {
@@ -51,15 +52,21 @@ public:
     const gms::inet_address get_replica_node_for_read(const redis_key& rk);
     const size_t get_replica_count() const { return _replica_count; }
     void set_sorted_tokens(const std::vector<token>& tokens, const std::unordered_map<token, gms::inet_address>& token_to_endpoint);
+    // Rebuilds the ring from the tokens of the endpoints.
+    void set_endpoints(const std::set<gms::inet_address>& endpoints);
+    size_t get_endpoint_count() const { return _endpoints.size(); }
 
-    bool is_member(const gms::inet_address& endpoint) const { return true; }
+    bool is_member(const gms::inet_address& endpoint) const { return _endpoints.count(endpoint) > 0; }
     std::chrono::milliseconds get_ring_delay() const;
-    std::vector<token> get_tokens(const gms::inet_address& endpoint) const { return {}; }
+    // The vnode tokens of an endpoint, derived from its address, so every node
+    // computes the same ring from the same members without exchanging tokens.
+    std::vector<token> get_tokens(const gms::inet_address& endpoint) const;
     future<> start();
     future<> stop();
 private:
     size_t _replica_count = 1;
     size_t _vnode_count = 1023;
+    std::set<gms::inet_address> _endpoints {};
     std::vector<token> _sorted_tokens {};
     std::unordered_map<token, gms::inet_address> _token_to_endpoint {};
 
@@ -0,0 +1,126 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/metrics_types.hh"
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+namespace utils {
+
+// A log-linear histogram of durations in nanoseconds, in the manner of HdrHistogram:
+// every power of two range is split into 8 linear buckets, so a value is recorded
+// with an error below 12.5% by a count of leading zeros and an increment. Values
+// from 2^36 ns (about 68 seconds) on share the last bucket.
+class latency_histogram {
+public:
+    static constexpr unsigned sub_bucket_bits = 3;
+    static constexpr unsigned sub_buckets = 1 << sub_bucket_bits;
+    static constexpr unsigned max_bits = 36;
+    static constexpr unsigned bucket_count = (max_bits - sub_bucket_bits + 1) * sub_buckets;
+private:
+    std::array<uint64_t, bucket_count> _buckets{};
+    uint64_t _count = 0;
+    uint64_t _sum = 0;
+    uint64_t _max = 0;
+
+    static unsigned bucket_of(uint64_t v)
+    {
+        if (v < 2 * sub_buckets) {
+            return v;
+        }
+        unsigned msb = 63 - __builtin_clzll(v);
+        if (msb >= max_bits) {
+            return bucket_count - 1;
+        }
+        return (msb - sub_bucket_bits + 1) * sub_buckets + ((v >> (msb - sub_bucket_bits)) & (sub_buckets - 1));
+    }
+
+    // The values of a bucket are below its upper bound.
+    static uint64_t upper_bound(unsigned bucket)
+    {
+        if (bucket < 2 * sub_buckets) {
+            return bucket + 1;
+        }
+        unsigned shift = bucket / sub_buckets - 1;
+        return uint64_t(sub_buckets + bucket % sub_buckets + 1) << shift;
+    }
+public:
+    void add(uint64_t ns)
+    {
+        ++_buckets[bucket_of(ns)];
+        ++_count;
+        _sum += ns;
+        if (ns > _max) {
+            _max = ns;
+        }
+    }
+
+    template <typename Rep, typename Period>
+    void add(std::chrono::duration<Rep, Period> d)
+    {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+        add(ns > 0 ? uint64_t(ns) : 0);
+    }
+
+    uint64_t count() const { return _count; }
+    uint64_t sum() const { return _sum; }
+    uint64_t max() const { return _max; }
+    double mean() const { return _count ? double(_sum) / _count : 0; }
+
+    // The value below which the fraction q of the values lies, in nanoseconds.
+    uint64_t quantile(double q) const
+    {
+        if (_count == 0) {
+            return 0;
+        }
+        uint64_t rank = q * _count;
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < bucket_count; ++i) {
+            seen += _buckets[i];
+            if (seen > rank) {
+                return std::min(upper_bound(i), _max);
+            }
+        }
+        return _max;
+    }
+
+    // Exports the histogram with one bucket per power of two, in microseconds.
+    seastar::metrics::histogram to_metrics() const
+    {
+        seastar::metrics::histogram h;
+        h.sample_count = _count;
+        h.sample_sum = _sum / 1000.0;
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < bucket_count; ++i) {
+            seen += _buckets[i];
+            if (i >= 2 * sub_buckets - 1 && i % sub_buckets == sub_buckets - 1) {
+                seastar::metrics::histogram_bucket b;
+                b.count = seen;
+                b.upper_bound = upper_bound(i) / 1000.0;
+                h.buckets.push_back(b);
+            }
+        }
+        return h;
+    }
+};
+
+}
@@ -228,20 +228,35 @@ public:
             auto& alctr = current_allocator();
             auto maxseg = max_seg(alctr);
             if (!external()) {
+                // the blob sets the pointer, which shares its bytes with the inline ones.
+                auto small = _u.small;
                 auto now = std::min(size_t(needed_room_size), maxseg);
                 void* p = alctr.alloc(&standard_migrator<blob_storage>::object, sizeof(blob_storage) + now, alignof(blob_storage));
                 last = new (p) blob_storage(&_u.ptr, needed_room_size, now);
-                memcpy(last->data, _u.small.data, _u.small.size);
-                std::fill(last->data + _u.small.size, last->data + now, v);
+                memcpy(last->data, small.data, small.size);
+                std::fill(last->data + small.size, last->data + now, v);
                 needed_room_size -= now;
                 _u.small.size = -1;
             }
             else {
                 last = _u.ptr;
-                last->size = needed_room_size;
+                needed_room_size -= last->size;
+                last->size = new_size;
                 while (last->next) {
                     last = last->next;
                 }
+                // the last fragment is reallocated up to the largest one first, so that
+                // a value extended a few bytes at a time is not a chain of small ones.
+                if (last->frag_size < maxseg) {
+                    auto now = std::min(last->frag_size + needed_room_size, maxseg);
+                    void* p = alctr.alloc(&standard_migrator<blob_storage>::object, sizeof(blob_storage) + now, alignof(blob_storage));
+                    auto grown = new (p) blob_storage(last->backref, last->size, now);
+                    memcpy(grown->data, last->data, last->frag_size);
+                    std::fill(grown->data + last->frag_size, grown->data + now, v);
+                    needed_room_size -= now - last->frag_size;
+                    alctr.destroy(last);
+                    last = grown;
+                }
             }
             try {
                 while (needed_room_size) {
@@ -425,6 +440,20 @@ public:
         return read_linearize();
     }
 
+    // Calls func(offset, data, size) on the fragments in order, without linearizing,
+    // until it returns false.
+    template <typename Func>
+    void for_each_fragment(Func&& func) const {
+        if (!external()) {
+            func(size_t(0), _u.small.data, size_t(_u.small.size));
+            return;
+        }
+        size_t offset = 0;
+        for (auto b = _u.ptr; b && func(offset, b->data, size_t(b->frag_size)); b = b->next) {
+            offset += b->frag_size;
+        }
+    }
+
     // Returns the amount of external memory used.
     size_t external_memory_usage() const {
         if (external()) {